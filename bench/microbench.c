@@ -0,0 +1,338 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Cost per record of single operators
+//
+// Each operator is run over synthetic inputs generated in memory, so that
+// neither parsing nor I/O is timed:
+//	constant: contiguous spans of 100 bases, all with value 1
+//	random: spans of 1 to 100 bases, separated by gaps of 0 to 99 bases, with random values
+//	dense: one record per base, with random values
+// The generators are seeded, so that two builds are timed over the same
+// records. The operators on sets are run over increasing numbers of inputs.
+//
+//	microbench [--records N] [--inputs N,N,...] [--runs N] [operator ...]
+//
+// Reports the best of the runs, in nanoseconds per input record and input
+// records per second.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "wiggleIterator.h"
+#include "multiplexer.h"
+#include "multiSet.h"
+
+//////////////////////////////////////////////////////
+// Synthetic inputs
+//////////////////////////////////////////////////////
+
+typedef enum {GENERATOR_CONSTANT, GENERATOR_RANDOM, GENERATOR_DENSE} Generator;
+
+static const char * generatorNames[] = {"constant", "random", "dense"};
+
+typedef struct syntheticData_st {
+	Generator generator;
+	long long remaining;
+	int position;
+	unsigned long long state;
+} SyntheticData;
+
+// Numerical Recipes LCG: fast enough not to weigh on the timings
+static unsigned int nextRandom(SyntheticData * data) {
+	data->state = data->state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned int) (data->state >> 33);
+}
+
+static void SyntheticPop(WiggleIterator * wi) {
+	SyntheticData * data = (SyntheticData *) wi->data;
+
+	if (data->remaining == 0) {
+		wi->done = true;
+		return;
+	}
+	data->remaining--;
+
+	switch (data->generator) {
+	case GENERATOR_CONSTANT:
+		wi->start = data->position;
+		wi->finish = data->position + 100;
+		wi->value = 1;
+		break;
+	case GENERATOR_RANDOM:
+		wi->start = data->position + nextRandom(data) % 100;
+		wi->finish = wi->start + 1 + nextRandom(data) % 100;
+		wi->value = (nextRandom(data) % 10000) / 100.0;
+		break;
+	case GENERATOR_DENSE:
+		wi->start = data->position;
+		wi->finish = data->position + 1;
+		wi->value = (nextRandom(data) % 10000) / 100.0;
+		break;
+	}
+	data->position = wi->finish;
+}
+
+static void SyntheticSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	fprintf(stderr, "Synthetic inputs cannot be seeked\n");
+	raiseError();
+}
+
+static WiggleIterator * SyntheticWiggleIterator(Generator generator, long long records, int seed) {
+	SyntheticData * data = (SyntheticData *) calloc(1, sizeof(SyntheticData));
+	WiggleIterator * new;
+
+	data->generator = generator;
+	data->remaining = records;
+	data->position = 1;
+	data->state = seed + 1;
+	new = newWiggleIterator(data, &SyntheticPop, &SyntheticSeek, 0);
+	new->chrom = internChromosome("chr1");
+	new->finite = true;
+	new->integral = generator == GENERATOR_CONSTANT;
+	new->compressed = generator == GENERATOR_CONSTANT;
+	if (generator != GENERATOR_RANDOM)
+		new->step = generator == GENERATOR_CONSTANT ? 100 : 1;
+	return new;
+}
+
+//////////////////////////////////////////////////////
+// Operators
+//////////////////////////////////////////////////////
+
+typedef enum {OPERATOR_UNARY, OPERATOR_SET, OPERATOR_SET_OF_SETS} OperatorKind;
+
+typedef struct operator_st {
+	const char * name;
+	OperatorKind kind;
+	WiggleIterator * (*unary)(WiggleIterator *);
+	WiggleIterator * (*reduction)(Multiplexer *);
+	WiggleIterator * (*comparison)(Multiset *);
+} Operator;
+
+static WiggleIterator * scaleOperator(WiggleIterator * i) {
+	return ScaleWiggleIterator(i, 2);
+}
+
+static WiggleIterator * shiftOperator(WiggleIterator * i) {
+	return ShiftWiggleIterator(i, 1);
+}
+
+static WiggleIterator * log10Operator(WiggleIterator * i) {
+	return LogWiggleIterator(i, 10);
+}
+
+static WiggleIterator * gtOperator(WiggleIterator * i) {
+	return HighPassFilterWiggleIterator(i, 50);
+}
+
+static WiggleIterator * smoothOperator(WiggleIterator * i) {
+	return SmoothWiggleIterator(i, 101);
+}
+
+static WiggleIterator * binOperator(WiggleIterator * i) {
+	return BinWiggleIterator(i, 1000, BIN_MEAN);
+}
+
+static WiggleIterator * rollingMaxOperator(WiggleIterator * i) {
+	return RollingWiggleIterator(i, 101, ROLLING_MAX);
+}
+
+static WiggleIterator * medianOperator(WiggleIterator * i) {
+	return QuantileIntegrator(i, 0.5);
+}
+
+static const Operator operators[] = {
+	// unaryOps.c
+	{"scale", OPERATOR_UNARY, &scaleOperator, NULL, NULL},
+	{"shift", OPERATOR_UNARY, &shiftOperator, NULL, NULL},
+	{"abs", OPERATOR_UNARY, &AbsWiggleIterator, NULL, NULL},
+	{"ln", OPERATOR_UNARY, &NaturalLogWiggleIterator, NULL, NULL},
+	{"log", OPERATOR_UNARY, &log10Operator, NULL, NULL},
+	{"gt", OPERATOR_UNARY, &gtOperator, NULL, NULL},
+	{"unit", OPERATOR_UNARY, &UnitWiggleIterator, NULL, NULL},
+	{"coverage", OPERATOR_UNARY, &CoverageWiggleIterator, NULL, NULL},
+	{"smooth", OPERATOR_UNARY, &smoothOperator, NULL, NULL},
+	{"bin", OPERATOR_UNARY, &binOperator, NULL, NULL},
+	{"rolling_max", OPERATOR_UNARY, &rollingMaxOperator, NULL, NULL},
+	// statistics.c
+	{"AUC", OPERATOR_UNARY, &AUCIntegrator, NULL, NULL},
+	{"meanI", OPERATOR_UNARY, &MeanIntegrator, NULL, NULL},
+	{"maxI", OPERATOR_UNARY, &MaxIntegrator, NULL, NULL},
+	{"varI", OPERATOR_UNARY, &VarianceIntegrator, NULL, NULL},
+	{"medianI", OPERATOR_UNARY, &medianOperator, NULL, NULL},
+	// reducers.c
+	{"sum", OPERATOR_SET, NULL, &SumReduction, NULL},
+	{"mean", OPERATOR_SET, NULL, &MeanReduction, NULL},
+	{"max", OPERATOR_SET, NULL, &MaxReduction, NULL},
+	{"min", OPERATOR_SET, NULL, &MinReduction, NULL},
+	{"product", OPERATOR_SET, NULL, &ProductReduction, NULL},
+	{"var", OPERATOR_SET, NULL, &VarianceReduction, NULL},
+	{"stddev", OPERATOR_SET, NULL, &StdDevReduction, NULL},
+	{"entropy", OPERATOR_SET, NULL, &EntropyReduction, NULL},
+	{"median", OPERATOR_SET, NULL, &MedianReduction, NULL},
+	// setComparisons.c, the inputs split in two sets, from 4 inputs up
+	{"ttest", OPERATOR_SET_OF_SETS, NULL, NULL, &TTestReduction},
+	{"ftest", OPERATOR_SET_OF_SETS, NULL, NULL, &FTestReduction},
+	{"mwu", OPERATOR_SET_OF_SETS, NULL, NULL, &MWUReduction},
+	{NULL, 0, NULL, NULL, NULL}
+};
+
+//////////////////////////////////////////////////////
+// Timing
+//////////////////////////////////////////////////////
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static WiggleIterator * buildOperator(const Operator * operator, Generator generator, long long records, int inputs) {
+	WiggleIterator ** iters = (WiggleIterator **) calloc(inputs, sizeof(WiggleIterator *));
+	WiggleIterator * res;
+	int i;
+
+	for (i = 0; i < inputs; i++)
+		iters[i] = SyntheticWiggleIterator(generator, records, i);
+
+	if (operator->kind == OPERATOR_UNARY)
+		res = operator->unary(iters[0]);
+	else if (operator->kind == OPERATOR_SET)
+		res = operator->reduction(newMultiplexer(iters, inputs, false));
+	else {
+		// Kept by the multiset
+		Multiplexer ** sets = (Multiplexer **) calloc(2, sizeof(Multiplexer *));
+		sets[0] = newMultiplexer(iters, inputs / 2, false);
+		sets[1] = newMultiplexer(iters + inputs / 2, inputs - inputs / 2, false);
+		res = operator->comparison(newMultiset(sets, 2));
+	}
+	free(iters);
+	return res;
+}
+
+// Best time of the runs. Building is timed too, as iterators read ahead
+// to their first record, e.g. all of the input if no value passes a filter.
+static double timeOperator(const Operator * operator, Generator generator, long long records, int inputs, int runs) {
+	double best = -1;
+	int run;
+
+	for (run = 0; run < runs; run++) {
+		double start = now();
+		WiggleIterator * iter = buildOperator(operator, generator, records, inputs);
+		runWiggleIterator(iter);
+		double elapsed = now() - start;
+		if (best < 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static void benchOperator(const Operator * operator, long long records, int * inputCounts, int inputCountCount, int runs) {
+	int generator, i;
+
+	for (generator = GENERATOR_CONSTANT; generator <= GENERATOR_DENSE; generator++) {
+		for (i = 0; i < inputCountCount; i++) {
+			int inputs = operator->kind == OPERATOR_UNARY ? 1 : inputCounts[i];
+			double seconds;
+
+			// Variances need two inputs per set
+			if (operator->kind == OPERATOR_SET_OF_SETS && inputs < 4)
+				continue;
+			seconds = timeOperator(operator, (Generator) generator, records, inputs, runs);
+			printf("%-12s %-10s %6i %12.2f %14.0f\n", operator->name, generatorNames[generator], inputs, seconds * 1e9 / (records * inputs), records * inputs / seconds);
+			fflush(stdout);
+			if (operator->kind == OPERATOR_UNARY)
+				break;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////
+// Main
+//////////////////////////////////////////////////////
+
+static int parseInputCounts(char * list, int * inputCounts, int max) {
+	int count = 0;
+	char * token;
+
+	for (token = strtok(list, ","); token && count < max; token = strtok(NULL, ","))
+		if ((inputCounts[count] = atoi(token)) > 0)
+			count++;
+	return count;
+}
+
+static void printUsage() {
+	const Operator * operator;
+
+	puts("Usage: microbench [--records N] [--inputs N,N,...] [--runs N] [operator ...]");
+	printf("Operators:");
+	for (operator = operators; operator->name; operator++)
+		printf(" %s", operator->name);
+	puts("");
+}
+
+int main(int argc, char ** argv) {
+	long long records = 1000000;
+	int inputCounts[32] = {1, 2, 8, 32};
+	int inputCountCount = 4;
+	int runs = 3;
+	const Operator * operator;
+	int i;
+
+	argc--;
+	argv++;
+	while (argc > 0 && strncmp(argv[0], "--", 2) == 0) {
+		if (strcmp(argv[0], "--help") == 0) {
+			printUsage();
+			return 0;
+		} else if (argc < 2) {
+			printUsage();
+			return 1;
+		} else if (strcmp(argv[0], "--records") == 0)
+			records = atoll(argv[1]);
+		else if (strcmp(argv[0], "--inputs") == 0)
+			inputCountCount = parseInputCounts(argv[1], inputCounts, 32);
+		else if (strcmp(argv[0], "--runs") == 0)
+			runs = atoi(argv[1]);
+		else {
+			printUsage();
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (records < 1 || inputCountCount < 1 || runs < 1) {
+		printUsage();
+		return 1;
+	}
+	// Positions stay within int range
+	if (records > 10000000)
+		records = 10000000;
+
+	printf("%-12s %-10s %6s %12s %14s\n", "operator", "input", "inputs", "ns/record", "records/s");
+	for (operator = operators; operator->name; operator++) {
+		if (argc > 0) {
+			for (i = 0; i < argc; i++)
+				if (strcmp(argv[i], operator->name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		benchOperator(operator, records, inputCounts, inputCountCount, runs);
+	}
+	return 0;
+}
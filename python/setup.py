@@ -0,0 +1,48 @@
+# Copyright [1999-2016] EMBL-European Bioinformatics Institute
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+# http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Builds the Python bindings over lib/libwiggletools.a, which must have been 
+# compiled with PIC=1, as well as the libraries it links against:
+#
+#   make PIC=1
+#   cd python; python setup.py build_ext --inplace
+#
+# The same variables as src/Makefile locate the dependencies (KENT_SRC, 
+# MACHTYPE, TABIX_SRC, SAMTOOLS).
+
+import os
+from setuptools import setup, Extension
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..'))
+SAMTOOLS = os.environ.get('SAMTOOLS', os.path.join(ROOT, 'samtools'))
+KENT_SRC = os.environ.get('KENT_SRC', '')
+MACHTYPE = os.environ.get('MACHTYPE', '')
+TABIX_SRC = os.environ.get('TABIX_SRC', '')
+
+extension = Extension(
+	'wiggletools._wiggletools',
+	sources = ['wiggletools/_wiggletools.c'],
+	include_dirs = [os.path.join(ROOT, 'inc')],
+	library_dirs = [os.path.join(KENT_SRC, 'lib', MACHTYPE), SAMTOOLS, os.path.join(SAMTOOLS, 'bcftools'), TABIX_SRC],
+	libraries = ['bam', 'bcf', 'tabix', 'z', 'pthread', 'ssl', 'crypto', 'dl', 'gsl', 'gslcblas', 'm'],
+	# Static libraries in dependency order
+	extra_objects = [os.path.join(ROOT, 'lib', 'libwiggletools.a'), os.path.join(KENT_SRC, 'lib', 'local', 'jkweb.a')],
+	extra_compile_args = ['-std=gnu99'],
+)
+
+setup(
+	name = 'wiggletools',
+	packages = ['wiggletools'],
+	ext_modules = [extension],
+)
@@ -0,0 +1,557 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CPython bindings over libwiggletools.a
+//
+// Programs are parsed by the library's own parser, from lists of words.
+// Each batch popped from an iterator is a fresh SpanBatch, which is kept
+// alive by the Python objects exporting its arrays, so that NumPy arrays
+// built on them share its memory. The GIL is released while the library
+// runs, and library errors are raised as RuntimeErrors, the message
+// having been printed to stderr.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "wiggletools.h"
+
+// Python 2 keeps words as byte strings, and the new buffer protocol behind
+// a type flag
+#if PY_MAJOR_VERSION >= 3
+#define wordString PyUnicode_AsUTF8
+#define COLUMN_FLAGS Py_TPFLAGS_DEFAULT
+#else
+#define wordString PyString_AsString
+#define COLUMN_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#endif
+
+//////////////////////////////////////////////////////
+// Running library calls
+//////////////////////////////////////////////////////
+
+typedef struct call_st {
+	int argc;
+	char ** argv;
+	bool hold;
+	WiggleIterator * iter;
+	WiggleIterator ** iters;
+	int count;
+	const char * chrom;
+	int start;
+	int finish;
+	SpanBatch * batch;
+	int width;
+	Histogram * hist;
+} Call;
+
+static char ** readWords(PyObject * words, int * count) {
+	PyObject * sequence = PySequence_Fast(words, "expected a sequence of words");
+	char ** argv;
+	int index;
+
+	if (!sequence)
+		return NULL;
+	*count = PySequence_Fast_GET_SIZE(sequence);
+	if (*count == 0) {
+		PyErr_SetString(PyExc_ValueError, "empty program");
+		Py_DECREF(sequence);
+		return NULL;
+	}
+	argv = calloc(*count, sizeof(char *));
+	for (index = 0; index < *count; index++) {
+		const char * word = wordString(PySequence_Fast_GET_ITEM(sequence, index));
+		if (!word) {
+			while (index--)
+				free(argv[index]);
+			free(argv);
+			Py_DECREF(sequence);
+			return NULL;
+		}
+		// The parser keeps pointers to some of the words
+		argv[index] = strdup(word);
+	}
+	Py_DECREF(sequence);
+	return argv;
+}
+
+// Runs the call without the GIL, returns false on a library error
+static bool runCall(void (*function)(void *), Call * call) {
+	bool success;
+
+	Py_BEGIN_ALLOW_THREADS
+	success = catchErrors(function, call);
+	Py_END_ALLOW_THREADS
+	if (!success)
+		PyErr_SetString(PyExc_RuntimeError, "wiggletools error, see stderr");
+	return success;
+}
+
+static void parseCall(void * args) {
+	Call * call = (Call *) args;
+	call->iter = parseIterator(call->argc, call->argv, call->hold);
+	if (call->chrom)
+		seek(call->iter, call->chrom, call->start, call->finish);
+}
+
+static void parseListCall(void * args) {
+	Call * call = (Call *) args;
+	call->iters = parseIteratorList(call->argc, call->argv, call->hold, &call->count);
+}
+
+static void seekCall(void * args) {
+	Call * call = (Call *) args;
+	seek(call->iter, call->chrom, call->start, call->finish);
+}
+
+static void popBatchCall(void * args) {
+	Call * call = (Call *) args;
+	popBatch(call->iter, call->batch);
+}
+
+static void runIteratorCall(void * args) {
+	Call * call = (Call *) args;
+	runWiggleIterator(call->iter);
+}
+
+static void histogramCall(void * args) {
+	Call * call = (Call *) args;
+	call->hist = histogram(call->iters, call->count, call->width);
+}
+
+//////////////////////////////////////////////////////
+// Columns
+//////////////////////////////////////////////////////
+
+// One array of a batch, exported through the buffer protocol
+typedef struct {
+	PyObject_HEAD
+	PyObject * batch;
+	void * data;
+	Py_ssize_t length;
+	Py_ssize_t itemsize;
+	char * format;
+} Column;
+
+static void Column_dealloc(Column * self) {
+	Py_XDECREF(self->batch);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int Column_getbuffer(Column * self, Py_buffer * view, int flags) {
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "batch columns are read only");
+		view->obj = NULL;
+		return -1;
+	}
+	view->obj = (PyObject *) self;
+	Py_INCREF(self);
+	view->buf = self->data;
+	view->len = self->length * self->itemsize;
+	view->readonly = 1;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+	view->strides = (flags & PyBUF_STRIDES) ? &self->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static Py_ssize_t Column_length(Column * self) {
+	return self->length;
+}
+
+static PyBufferProcs Column_buffer = {
+	.bf_getbuffer = (getbufferproc) Column_getbuffer
+};
+
+static PySequenceMethods Column_sequence = {
+	.sq_length = (lenfunc) Column_length
+};
+
+static PyTypeObject ColumnType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "wiggletools._wiggletools.Column",
+	.tp_doc = "Read only array of a batch, to be wrapped e.g. with numpy.asarray",
+	.tp_basicsize = sizeof(Column),
+	.tp_flags = COLUMN_FLAGS,
+	.tp_dealloc = (destructor) Column_dealloc,
+	.tp_as_buffer = &Column_buffer,
+	.tp_as_sequence = &Column_sequence,
+};
+
+//////////////////////////////////////////////////////
+// Batches
+//////////////////////////////////////////////////////
+
+typedef struct {
+	PyObject_HEAD
+	SpanBatch * batch;
+	// (chrom, first, last) triplets, over consecutive records of the same chromosome
+	PyObject * chroms;
+} Batch;
+
+static void Batch_dealloc(Batch * self) {
+	Py_XDECREF(self->chroms);
+	if (self->batch)
+		destroySpanBatch(self->batch);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static Py_ssize_t Batch_length(Batch * self) {
+	return spanBatchCount(self->batch);
+}
+
+static PyObject * newColumn(Batch * batch, void * data, Py_ssize_t itemsize, char * format) {
+	Column * column = PyObject_New(Column, &ColumnType);
+	if (!column)
+		return NULL;
+	column->batch = (PyObject *) batch;
+	Py_INCREF(batch);
+	column->data = data;
+	column->length = spanBatchCount(batch->batch);
+	column->itemsize = itemsize;
+	column->format = format;
+	return (PyObject *) column;
+}
+
+// The chromosome names are copied right away, as the readers may free them later on
+static PyObject * batchChroms(SpanBatch * batch) {
+	char ** chroms = spanBatchChroms(batch);
+	int count = spanBatchCount(batch);
+	PyObject * list = PyList_New(0);
+	int first, last;
+
+	if (!list)
+		return NULL;
+	for (first = 0; first < count; first = last) {
+		PyObject * run;
+		for (last = first + 1; last < count && strcmp(chroms[last], chroms[first]) == 0; last++);
+		run = Py_BuildValue("(sii)", chroms[first], first, last);
+		if (!run || PyList_Append(list, run)) {
+			Py_XDECREF(run);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(run);
+	}
+	return list;
+}
+
+static PyTypeObject BatchType;
+
+static PyObject * newBatch(SpanBatch * spanBatch) {
+	Batch * batch = PyObject_New(Batch, &BatchType);
+	if (!batch) {
+		destroySpanBatch(spanBatch);
+		return NULL;
+	}
+	batch->batch = spanBatch;
+	if (!(batch->chroms = batchChroms(spanBatch))) {
+		Py_DECREF(batch);
+		return NULL;
+	}
+	return (PyObject *) batch;
+}
+
+static PyObject * Batch_getChroms(Batch * self, void * closure) {
+	Py_INCREF(self->chroms);
+	return self->chroms;
+}
+
+// The columns hold a reference to the batch, and are created on demand
+static PyObject * Batch_getStarts(Batch * self, void * closure) {
+	return newColumn(self, spanBatchStarts(self->batch), sizeof(int), "i");
+}
+
+static PyObject * Batch_getFinishes(Batch * self, void * closure) {
+	return newColumn(self, spanBatchFinishes(self->batch), sizeof(int), "i");
+}
+
+static PyObject * Batch_getValues(Batch * self, void * closure) {
+	return newColumn(self, spanBatchValues(self->batch), sizeof(double), "d");
+}
+
+static PyGetSetDef Batch_getset[] = {
+	{"chroms", (getter) Batch_getChroms, NULL, "List of (chrom, first, last) runs of records on the same chromosome", NULL},
+	{"starts", (getter) Batch_getStarts, NULL, "Start of each record (0-based)", NULL},
+	{"finishes", (getter) Batch_getFinishes, NULL, "Finish of each record (exclusive)", NULL},
+	{"values", (getter) Batch_getValues, NULL, "Value of each record", NULL},
+	{NULL}
+};
+
+static PySequenceMethods Batch_sequence = {
+	.sq_length = (lenfunc) Batch_length
+};
+
+static PyTypeObject BatchType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "wiggletools._wiggletools.Batch",
+	.tp_doc = "Consecutive records popped from an iterator",
+	.tp_basicsize = sizeof(Batch),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) Batch_dealloc,
+	.tp_getset = Batch_getset,
+	.tp_as_sequence = &Batch_sequence,
+};
+
+//////////////////////////////////////////////////////
+// Iterators
+//////////////////////////////////////////////////////
+
+// The library does not free iterator trees, so neither do the bindings
+typedef struct {
+	PyObject_HEAD
+	WiggleIterator * iter;
+	bool ran;
+} Iterator;
+
+static int Iterator_init(Iterator * self, PyObject * args, PyObject * kwds) {
+	static char * keywords[] = {"words", "chrom", "start", "finish", NULL};
+	PyObject * words;
+	Call call = {0};
+	bool success;
+	int index;
+
+	call.start = 0;
+	call.finish = -1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|zii", keywords, &words, &call.chrom, &call.start, &call.finish))
+		return -1;
+	if (self->iter) {
+		PyErr_SetString(PyExc_RuntimeError, "iterator already initialised");
+		return -1;
+	}
+	if (call.chrom && call.finish < 0)
+		call.finish = 2147483647;
+	if (!(call.argv = readWords(words, &call.argc)))
+		return -1;
+	// Readers seeked right away need not start reading from the top
+	call.hold = call.chrom != NULL;
+	success = runCall(&parseCall, &call);
+	if (!success) {
+		for (index = 0; index < call.argc; index++)
+			free(call.argv[index]);
+		free(call.argv);
+		return -1;
+	}
+	self->iter = call.iter;
+	return 0;
+}
+
+static PyObject * Iterator_seek(Iterator * self, PyObject * args) {
+	Call call = {0};
+
+	if (!PyArg_ParseTuple(args, "sii", &call.chrom, &call.start, &call.finish))
+		return NULL;
+	if (!self->iter) {
+		PyErr_SetString(PyExc_RuntimeError, "iterator not initialised");
+		return NULL;
+	}
+	call.iter = self->iter;
+	if (!runCall(&seekCall, &call))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject * Iterator_popBatch(Iterator * self, PyObject * unused) {
+	Call call = {0};
+
+	if (!self->iter) {
+		PyErr_SetString(PyExc_RuntimeError, "iterator not initialised");
+		return NULL;
+	}
+	if (isDone(self->iter))
+		Py_RETURN_NONE;
+	call.iter = self->iter;
+	call.batch = newSpanBatch();
+	if (!runCall(&popBatchCall, &call)) {
+		destroySpanBatch(call.batch);
+		return NULL;
+	}
+	return newBatch(call.batch);
+}
+
+// Filtering operators may return empty batches before the end
+static PyObject * Iterator_next(Iterator * self) {
+	PyObject * batch;
+
+	while ((batch = Iterator_popBatch(self, NULL)) && batch != Py_None) {
+		if (PySequence_Length(batch) > 0)
+			return batch;
+		Py_DECREF(batch);
+	}
+	if (batch == Py_None)
+		Py_DECREF(batch);
+	return NULL;
+}
+
+static PyObject * Iterator_statistics(Iterator * self, PyObject * unused) {
+	Call call = {0};
+	PyObject * tuple;
+	double * results;
+	int count, index;
+
+	if (!self->iter) {
+		PyErr_SetString(PyExc_RuntimeError, "iterator not initialised");
+		return NULL;
+	}
+	if (!self->ran) {
+		call.iter = self->iter;
+		if (!runCall(&runIteratorCall, &call))
+			return NULL;
+		self->ran = true;
+	}
+	results = statisticResults(self->iter, &count);
+	if (!(tuple = PyTuple_New(count))) {
+		free(results);
+		return NULL;
+	}
+	for (index = 0; index < count; index++)
+		PyTuple_SET_ITEM(tuple, index, PyFloat_FromDouble(results[index]));
+	free(results);
+	return tuple;
+}
+
+static PyObject * Iterator_getDone(Iterator * self, void * closure) {
+	return PyBool_FromLong(self->iter && isDone(self->iter));
+}
+
+static PyMethodDef Iterator_methods[] = {
+	{"seek", (PyCFunction) Iterator_seek, METH_VARARGS, "seek(chrom, start, finish): restricts the iterator to a region"},
+	{"pop_batch", (PyCFunction) Iterator_popBatch, METH_NOARGS, "Next batch of records, possibly empty, or None at the end"},
+	{"statistics", (PyCFunction) Iterator_statistics, METH_NOARGS, "Runs a program of statistics, e.g. meanI maxI x, and returns their values"},
+	{NULL}
+};
+
+static PyGetSetDef Iterator_getset[] = {
+	{"done", (getter) Iterator_getDone, NULL, "True once all the records were popped", NULL},
+	{NULL}
+};
+
+static PyTypeObject IteratorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "wiggletools._wiggletools.Iterator",
+	.tp_doc = "Iterator(words, chrom = None, start = 0, finish = -1): iterator parsed from a list of program words, yielding batches",
+	.tp_basicsize = sizeof(Iterator),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc) Iterator_init,
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc) Iterator_next,
+	.tp_methods = Iterator_methods,
+	.tp_getset = Iterator_getset,
+};
+
+//////////////////////////////////////////////////////
+// Histograms
+//////////////////////////////////////////////////////
+
+static PyObject * histogramObject(Histogram * hist, int count) {
+	PyObject * rows = PyList_New(count);
+	double min = NAN, max = NAN;
+	int row, width = 0, column;
+
+	if (!rows)
+		return NULL;
+	for (row = 0; row < count; row++) {
+		double * values = histogramRow(hist, row, &width, &min, &max);
+		PyObject * list = PyList_New(width);
+		if (!list) {
+			Py_DECREF(rows);
+			return NULL;
+		}
+		for (column = 0; column < width; column++)
+			PyList_SET_ITEM(list, column, PyFloat_FromDouble(values[column]));
+		PyList_SET_ITEM(rows, row, list);
+	}
+	return Py_BuildValue("(ddN)", min, max, rows);
+}
+
+static PyObject * wiggletools_histogram(PyObject * module, PyObject * args) {
+	PyObject * words, * result;
+	Call call = {0};
+	int index;
+
+	if (!PyArg_ParseTuple(args, "iO", &call.width, &words))
+		return NULL;
+	if (call.width <= 0) {
+		PyErr_SetString(PyExc_ValueError, "the width must be positive");
+		return NULL;
+	}
+	if (!(call.argv = readWords(words, &call.argc)))
+		return NULL;
+	if (!runCall(&parseListCall, &call) || !runCall(&histogramCall, &call)) {
+		for (index = 0; index < call.argc; index++)
+			free(call.argv[index]);
+		free(call.argv);
+		return NULL;
+	}
+	result = histogramObject(call.hist, call.count);
+	destroyHistogram(call.hist);
+	return result;
+}
+
+//////////////////////////////////////////////////////
+// Module
+//////////////////////////////////////////////////////
+
+static PyMethodDef wiggletools_methods[] = {
+	{"histogram", wiggletools_histogram, METH_VARARGS, "histogram(width, words): (min, max, counts) of each of the iterators of a list, over width bins"},
+	{NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef wiggletools_module = {
+	PyModuleDef_HEAD_INIT,
+	"wiggletools._wiggletools",
+	"Bindings over libwiggletools",
+	-1,
+	wiggletools_methods
+};
+#endif
+
+static PyObject * createModule(void) {
+	PyObject * module;
+
+	if (PyType_Ready(&ColumnType) < 0 || PyType_Ready(&BatchType) < 0 || PyType_Ready(&IteratorType) < 0)
+		return NULL;
+#if PY_MAJOR_VERSION >= 3
+	module = PyModule_Create(&wiggletools_module);
+#else
+	// Borrowed reference
+	module = Py_InitModule3("wiggletools._wiggletools", wiggletools_methods, "Bindings over libwiggletools");
+#endif
+	if (!module)
+		return NULL;
+	Py_INCREF(&IteratorType);
+	if (PyModule_AddObject(module, "Iterator", (PyObject *) &IteratorType) < 0) {
+		Py_DECREF(&IteratorType);
+#if PY_MAJOR_VERSION >= 3
+		Py_DECREF(module);
+#endif
+		return NULL;
+	}
+	return module;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit__wiggletools(void) {
+	return createModule();
+}
+#else
+PyMODINIT_FUNC init_wiggletools(void) {
+	createModule();
+}
+#endif
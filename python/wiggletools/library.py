@@ -0,0 +1,68 @@
+# Copyright [1999-2016] EMBL-European Bioinformatics Institute
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+# http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Runs wiggletools programs within Python, on top of the _wiggletools extension
+
+	from wiggletools import library
+	for chrom, starts, finishes, values in library.spans('mean a.bw b.bw'):
+		...
+	mean, maximum = library.statistics('meanI maxI a.bw')
+	low, high, counts = library.histogram(10, 'a.bw b.bw')
+
+Programs are written as on the command line, or as lists of words. The
+arrays are NumPy arrays (int32 coordinates and float64 values) sharing the
+memory of the library's batches, or memoryviews if NumPy is not installed.
+"""
+
+import shlex
+
+from wiggletools import _wiggletools
+
+try:
+	import numpy
+except ImportError:
+	numpy = None
+
+def words(program):
+	if isinstance(program, str):
+		return shlex.split(program)
+	return list(program)
+
+def array(column):
+	if numpy is not None:
+		return numpy.asarray(column)
+	return memoryview(column)
+
+def iterator(program, chrom = None, start = 0, finish = -1):
+	return _wiggletools.Iterator(words(program), chrom, start, finish)
+
+def batches(program, chrom = None, start = 0, finish = -1):
+	"""Yields (chrom, starts, finishes, values), each batch being split by chromosome"""
+	for batch in iterator(program, chrom, start, finish):
+		starts = array(batch.starts)
+		finishes = array(batch.finishes)
+		values = array(batch.values)
+		for name, first, last in batch.chroms:
+			yield name, starts[first:last], finishes[first:last], values[first:last]
+
+spans = batches
+
+def statistics(program, chrom = None, start = 0, finish = -1):
+	"""Values of a program of statistics, e.g. 'meanI maxI a.bw', as a tuple of floats"""
+	return iterator(program, chrom, start, finish).statistics()
+
+def histogram(width, program):
+	"""(min, max, counts) of the iterators of a list, e.g. 'a.bw scale 2 b.bw', counts having one list of width bins per iterator"""
+	return _wiggletools.histogram(width, words(program))
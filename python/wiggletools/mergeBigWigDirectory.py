@@ -22,10 +22,15 @@ import shutil
 import os
 
 directory = sys.argv[1]
+partials = glob.glob(os.path.join(directory + "x", '*.partial'))
 bigwigs = glob.glob(os.path.join(directory + "x", '*.bw'))
 
-if len(bigwigs) > 0:
-	command = ['bigWigCat', directory] + bigwigs
+if len(partials) > 0 or len(bigwigs) > 0:
+	if len(partials) > 0:
+		# Shards written by wiggletools: the compressed blocks are copied over, only the index and zoom levels are rebuilt
+		command = ['wiggletools', 'merge_partials', directory] + partials
+	else:
+		command = ['bigWigCat', directory] + bigwigs
 	p = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
 	return_code = p.wait()
 
@@ -18,8 +18,15 @@
 import sys
 import glob
 import shutil
+import numpy
 import wigglePlots
 
+def merge_binary_profiles(target, files):
+	# Sum the vectors of the jobs
+	array = sum(numpy.load(file) for file in files)
+	numpy.save(target, array.astype(numpy.float32))
+	wigglePlots.make_profile_curve(target, target + ".png", format='png')
+
 try:
 	target = sys.argv[1]
 	firstFile = True
@@ -27,7 +34,9 @@ try:
 
 	files = glob.glob(target + "x/*")
 
-	if len(files) > 0:
+	if len(files) > 0 and target.endswith('.npy'):
+		merge_binary_profiles(target, files)
+	elif len(files) > 0:
 		# Scan through files and add up their profiles
 		for file in files:
 			for line in open(file):
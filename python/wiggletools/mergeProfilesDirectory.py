@@ -17,22 +17,47 @@
 
 import sys
 import subprocess
+import numpy
 import wigglePlots
 import os
 import os.path
 import shutil
+import glob
 
-try:
-	file=sys.argv[1]
-	if (subprocess.call("sort -k1,1 -k2,2n -k3,3n -m %sx/* > %s" % (file, file), shell=True)):
-		print 'Error processing directory %sx' % file
-		sys.exit(100)
+def merge_binary_profiles(file):
+	# Each job wrote a matrix, with its regions alongside: the rows are sorted as the text lines would be
+	matrices = []
+	regions = []
+	for shard in glob.glob(file + "x/*.npy"):
+		matrices.append(numpy.load(shard))
+		regions.extend(line.rstrip('\n').split('\t') for line in open(shard + ".regions"))
 	shutil.rmtree(file + "x")
 
-	if os.path.getsize(file) > 0:
-		wigglePlots.make_profiles_matrix(file, file + ".png", format='png')
-	else:
-		# Create empty file with .empty suffix
+	if len(regions) == 0:
 		open(file + ".empty", "w").close()
+		return
+	order = sorted(range(len(regions)), key=lambda row: (regions[row][0], int(regions[row][1]), int(regions[row][2])))
+	numpy.save(file, numpy.concatenate(matrices)[order].astype(numpy.float32))
+	out = open(file + ".regions", "w")
+	for row in order:
+		out.write("\t".join(regions[row]) + "\n")
+	out.close()
+	wigglePlots.make_profiles_matrix(file, file + ".png", format='png')
+
+try:
+	file=sys.argv[1]
+	if file.endswith('.npy'):
+		merge_binary_profiles(file)
+	else:
+		if (subprocess.call("sort -k1,1 -k2,2n -k3,3n -m %sx/* > %s" % (file, file), shell=True)):
+			print 'Error processing directory %sx' % file
+			sys.exit(100)
+		shutil.rmtree(file + "x")
+
+		if os.path.getsize(file) > 0:
+			wigglePlots.make_profiles_matrix(file, file + ".png", format='png')
+		else:
+			# Create empty file with .empty suffix
+			open(file + ".empty", "w").close()
 except:
 	sys.exit(100)
@@ -17,6 +17,7 @@
 import sys
 import os.path
 import re
+import math
 import tempfile
 import subprocess
 import glob
@@ -32,7 +33,7 @@ DUMP_DIR = '.'
 ################################################
 
 def create_dirs(command):
-	for match in re.finditer(r'(write|write_bg|profile|profiles|AUC|mean|variance|pearson)\s+(\S+)\s', command):
+	for match in re.finditer(r'(write|write_bg|profile|profiles|AUC|mean|variance|pearson|apply_paste)\s+(\S+)\s', command):
 		path = match.group(2) + "x"
 		if not os.path.exists(path):
 			os.makedirs(path)
@@ -42,8 +43,11 @@ def create_new_command(command, chr, start, finish, chrom_sizes_file):
 	# Careful: the following line has to be AFTER the one above, else they overwrite each other
 	command = re.sub(r'write\s+(\S+.bw)\s',r'write \1x/%s_%i_%i.wig ' % (chr, start, finish), command)
 	command = re.sub(r'write_bg\s+(\S+)\s',r'write \1x/%s_%i_%i.wig ' % (chr, start, finish), command)
-	command = re.sub(r'(profile|profiles)\s+(\S+)\s',r'\1 \2x/%s_%i_%i ' % (chr, start, finish), command)
+	command = re.sub(r'(profile|profiles)\s+(\S+)(?<!\.npy)\s',r'\1 \2x/%s_%i_%i ' % (chr, start, finish), command)
+	# Binary profiles are written as such by each job
+	command = re.sub(r'(profile|profiles)\s+(\S+\.npy)\s',r'\1 \2x/%s_%i_%i.npy ' % (chr, start, finish), command)
 	command = re.sub(r'^(AUC|mean|variance|pearson)\s+(\S+)\s',r'\1 \2x/%s_%i_%i ' % (chr, start, finish), command)
+	command = re.sub(r'^apply_paste\s+(\S+)\s',r'apply_paste \1x/%s_%i_%i ' % (chr, start, finish), command)
 	
 	m = re.match(r'(profile|profiles)\s+(\S+)\s(\S+)\s+(.*)', command)
 	m2 = re.match(r'(AUC|mean|variance|pearson)\s+(\S+)\s+(.*)', command)
@@ -53,6 +57,9 @@ def create_new_command(command, chr, start, finish, chrom_sizes_file):
 		width = m.group(3)
 		iterator = m.group(4)
 		return " ".join(map(str, ['wiggletoolsIndex.py', chrom_sizes_file, plot, output, width,'seek',chr,start,finish,iterator]))
+	elif command.startswith('apply_paste'):
+		# Each job jumps straight to the lines of its region in the Bed file
+		return " ".join(map(str, ['wiggletoolsIndex.py', chrom_sizes_file,'seek',chr,start,finish,command]))
 	elif m2 is not None:
 		plot = m.group(1)
 		output = m.group(2)
@@ -65,6 +72,14 @@ def create_new_command(command, chr, start, finish, chrom_sizes_file):
 
 def makeMapCommand(command, chrom_sizes_file, chrom_sizes, region_size):
 	create_dirs(command)
+	m = re.match(r'write\s+(\S+.bw)\s', command)
+	if m is not None:
+		# Each job writes a shard of the BigWig file, already compressed, which mergeBigWigDirectory.py stitches together
+		shards = max(1, int(math.ceil(sum(chrom_sizes.values()) / float(region_size))))
+		return [" ".join(map(str, ['wiggletools', '--chrom_sizes', chrom_sizes_file, '--shard', '%i/%i' % (shard, shards), command, '>', '%sx/%i.partial' % (m.group(1), shard)])) for shard in range(1, shards + 1)]
+	if command.startswith('apply_paste'):
+		# Regions straddling two jobs would be printed twice, so the jobs cover whole chromosomes
+		return [create_new_command(command, chr, 1, chrom_sizes[chr] + 1, chrom_sizes_file) for chr in sorted(chrom_sizes.keys())]
 	return [create_new_command(command, chr, start, min(chrom_sizes[chr], start + int(region_size)), chrom_sizes_file) for chr in sorted(chrom_sizes.keys()) for start in range(1, chrom_sizes[chr], int(region_size))]
 
 def test_makeMapCommand():
@@ -84,7 +99,8 @@ def makeReduceCommands(command):
 	mergeProfilesCommand = ['mergeProfilesDirectory.py %s' % match.group(1) for match in re.finditer(r'profiles\s+(\S+)\s', command)]
 	mergeWigglesCommand = ['mergeBedLikeDirectory.sh %s' % match.group(1) for match in re.finditer(r'write\s+(\S+.wig)\s', command)]
 	mergeBedGraphsCommand = ['mergeBedLikeDirectory.sh %s' % match.group(1) for match in re.finditer(r'write_bg\s+(\S+.bg)\s', command)]
-	return mergeBigWigCommands + mergeProfileCommand + mergeProfilesCommand + mergeWigglesCommand + mergeBedGraphsCommand
+	mergePastesCommand = ['mergeBedLikeDirectory.sh %s' % match.group(1) for match in re.finditer(r'^apply_paste\s+(\S+)\s', command)]
+	return mergeBigWigCommands + mergeProfileCommand + mergeProfilesCommand + mergeWigglesCommand + mergeBedGraphsCommand + mergePastesCommand
 
 
 ################################################
@@ -102,8 +118,8 @@ def readChromSizes(file):
 
 def run(cmds, chrom_file, batch_system='local', tmp='.'):
 	for cmd in cmds:
-		if re.search('(apply_paste|histogram)', cmd) is not None:
-			print "Cannot parallelize the computation of histograms or apply_paste operations"
+		if re.search('histogram', cmd) is not None:
+			print "Cannot parallelize the computation of histograms"
 			sys.exit(1)
 	chrom_sizes = readChromSizes(chrom_file)
 	mapCommands = sum((makeMapCommand(cmd, chrom_file, chrom_sizes, region_size=3e7) for cmd in cmds), [])
@@ -125,7 +141,7 @@ Usage: parallelWiggletools.py chrom_sizes.txt 'command1' ['command2' [...]]
 
 Where:
 * chrom_sizes.txt is a tab-delimited text file with the chromosome names and lengths	
-* command* is a valid wiggletools command, without histogram or apply_paste keywords.
+* command* is a valid wiggletools command, without histogram keywords.
 		"""
 
 if __name__ == "__main__":
@@ -53,6 +53,12 @@ def make_histogram(infile, labels, out, format='pdf', normalised=True):
 ##############################################
 
 def make_profile_curve(infile, out, format='pdf'):
+	if infile.endswith('.npy'):
+		Y = numpy.load(infile, mmap_mode='r')
+		pyplot.plot(numpy.arange(len(Y)), Y, '-')
+		pyplot.savefig(out, format=format)
+		return
+
 	X = []
 	Y = []
 	file = open(infile)
@@ -69,8 +75,15 @@ def make_profile_curve(infile, out, format='pdf'):
 ## Profile matrix
 ##############################################
 
+def load_profiles_matrix(infile):
+	if infile.endswith('.npy'):
+		# Binary profiles are mapped rather than parsed
+		return numpy.load(infile, mmap_mode='r')
+	else:
+		return numpy.array([map(float, line.strip().split("\t")[3:]) for line in open(infile)])
+
 def make_profiles_matrix(infile, out, format='pdf'):
-	M = numpy.array([map(float, line.strip().split("\t")[3:]) for line in open(infile)])
+	M = load_profiles_matrix(infile)
 	M = numpy.log(M+1)
 	M = M / numpy.max(M)
 	means = numpy.mean(M, axis=1)
@@ -210,33 +210,33 @@ static int deflate_block(BGZF *fp, int block_length)
 	return comp_size;
 }
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+// Inflate the block in src into dst
+static int inflate_data(void *dst, void *src, int block_length)
 {
 	z_stream zs;
 	zs.zalloc = NULL;
 	zs.zfree = NULL;
-	zs.next_in = fp->compressed_block + 18;
+	zs.next_in = (uint8_t*)src + 18;
 	zs.avail_in = block_length - 16;
-	zs.next_out = fp->uncompressed_block;
+	zs.next_out = dst;
 	zs.avail_out = BGZF_MAX_BLOCK_SIZE;
-
-	if (inflateInit2(&zs, -15) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
+	if (inflateInit2(&zs, -15) != Z_OK) return -1;
 	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
 		inflateEnd(&zs);
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
-	if (inflateEnd(&zs) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
 		return -1;
 	}
+	if (inflateEnd(&zs) != Z_OK) return -1;
 	return zs.total_out;
 }
 
+// Inflate the block in fp->compressed_block into fp->uncompressed_block
+static int inflate_block(BGZF* fp, int block_length)
+{
+	int length = inflate_data(fp->uncompressed_block, fp->compressed_block, block_length);
+	if (length < 0) fp->errcode |= BGZF_ERR_ZLIB;
+	return length;
+}
+
 static int check_header(const uint8_t *header)
 {
 	return (header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) != 0
@@ -304,11 +304,17 @@ static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
 #endif
 
+static int ra_read_block(BGZF *fp);
+static int64_t ra_next_address(BGZF *fp);
+// compressed offset of the block following the current one
+#define next_block_address(fp) ((fp)->mt? ra_next_address(fp) : _bgzf_tell((_bgzf_file_t)(fp)->fp))
+
 int bgzf_read_block(BGZF *fp)
 {
 	uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
 	int count, size = 0, block_length, remaining;
 	int64_t block_address;
+	if (fp->mt) return ra_read_block(fp);
 	block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
 	if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
 	count = _bgzf_read(fp->fp, header, sizeof(header));
@@ -361,7 +367,7 @@ ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
 		bytes_read += copy_length;
 	}
 	if (fp->block_offset == fp->block_length) {
-		fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+		fp->block_address = next_block_address(fp);
 		fp->block_offset = fp->block_length = 0;
 	}
 	return bytes_read;
@@ -523,6 +529,223 @@ static ssize_t mt_write(BGZF *fp, const void *data, ssize_t length)
 
 /***** END: multi-threading *****/
 
+/***** BEGIN: multi-threaded read-ahead *****/
+
+/* Blocks are read from the file in order, one at a time under the lock,
+ * and inflated by the workers outside of it, into a ring of slots which
+ * the reading thread consumes in the same order. Seeks within the blocks
+ * already queued skip over them, other seeks restart the queue. */
+
+enum { RA_EMPTY, RA_BUSY, RA_READY };
+
+typedef struct {
+	int state, errcode;
+	int64_t address;
+	int size, length; // compressed and uncompressed lengths
+	void *compressed, *uncompressed;
+} rablock_t;
+
+typedef struct {
+	int n_threads, n_blks;
+	rablock_t *blk;
+	int64_t head, tail; // numbers of the next blocks to be read from the file and consumed
+	int64_t file_address, next_address; // offsets of the next block to be read and consumed
+	int eof, done, busy;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_ready;
+} raux_t;
+
+// read the next compressed block into b, with the lock held; returns 0 at the end of the file
+static int ra_fetch(BGZF *fp, raux_t *ra, rablock_t *b)
+{
+	uint8_t *header = (uint8_t*)b->compressed;
+	int count = _bgzf_read(fp->fp, header, BLOCK_HEADER_LENGTH);
+	b->address = ra->file_address;
+	b->errcode = 0;
+	if (count == 0) return 0;
+	if (count != BLOCK_HEADER_LENGTH || !check_header(header)) {
+		b->errcode = BGZF_ERR_HEADER;
+		return -1;
+	}
+	b->size = unpackInt16(&header[16]) + 1;
+	count = _bgzf_read(fp->fp, header + BLOCK_HEADER_LENGTH, b->size - BLOCK_HEADER_LENGTH);
+	if (count != b->size - BLOCK_HEADER_LENGTH) {
+		b->errcode = BGZF_ERR_IO;
+		return -1;
+	}
+	ra->file_address += b->size;
+	return 1;
+}
+
+static void *ra_worker(void *data)
+{
+	BGZF *fp = (BGZF*)data;
+	raux_t *ra = (raux_t*)fp->mt;
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->done) {
+		rablock_t *b;
+		int ret;
+		if (ra->eof || ra->head - ra->tail == ra->n_blks) {
+			pthread_cond_wait(&ra->cv_work, &ra->lock);
+			continue;
+		}
+		b = &ra->blk[ra->head % ra->n_blks];
+		ret = ra_fetch(fp, ra, b);
+		if (ret <= 0) {
+			// errors are reported when the block is consumed
+			ra->eof = 1;
+			if (ret < 0) {
+				b->state = RA_READY;
+				++ra->head;
+			}
+			pthread_cond_broadcast(&ra->cv_ready);
+			continue;
+		}
+		b->state = RA_BUSY;
+		++ra->head;
+		++ra->busy;
+		pthread_mutex_unlock(&ra->lock);
+		b->length = inflate_data(b->uncompressed, b->compressed, b->size);
+		if (b->length < 0) b->errcode = BGZF_ERR_ZLIB;
+		pthread_mutex_lock(&ra->lock);
+		b->state = RA_READY;
+		--ra->busy;
+		pthread_cond_broadcast(&ra->cv_ready);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+// with the lock held: empties the queue and reads on from address
+static void ra_restart(BGZF *fp, raux_t *ra, int64_t address)
+{
+	int i;
+	while (ra->busy) pthread_cond_wait(&ra->cv_ready, &ra->lock);
+	for (i = 0; i < ra->n_blks; ++i) ra->blk[i].state = RA_EMPTY;
+	ra->head = ra->tail = 0;
+	ra->eof = 0;
+	ra->file_address = ra->next_address = address;
+	pthread_cond_broadcast(&ra->cv_work);
+}
+
+static int ra_read_block(BGZF *fp)
+{
+	raux_t *ra = (raux_t*)fp->mt;
+	rablock_t *b;
+	pthread_mutex_lock(&ra->lock);
+	b = &ra->blk[ra->tail % ra->n_blks];
+	while (!(ra->tail < ra->head && b->state == RA_READY) && !(ra->tail == ra->head && ra->eof))
+		pthread_cond_wait(&ra->cv_ready, &ra->lock);
+	if (ra->tail == ra->head) { // no data read
+		fp->block_length = 0;
+		pthread_mutex_unlock(&ra->lock);
+		return 0;
+	}
+	if (b->errcode) {
+		fp->errcode |= b->errcode;
+		pthread_mutex_unlock(&ra->lock);
+		return -1;
+	}
+	memcpy(fp->uncompressed_block, b->uncompressed, b->length);
+	if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+	fp->block_address = b->address;
+	fp->block_length = b->length;
+	ra->next_address = b->address + b->size;
+	b->state = RA_EMPTY;
+	++ra->tail;
+	pthread_cond_signal(&ra->cv_work);
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+static int64_t ra_next_address(BGZF *fp)
+{
+	raux_t *ra = (raux_t*)fp->mt;
+	int64_t address;
+	pthread_mutex_lock(&ra->lock);
+	address = ra->next_address;
+	pthread_mutex_unlock(&ra->lock);
+	return address;
+}
+
+static int ra_seek(BGZF *fp, int64_t address)
+{
+	raux_t *ra = (raux_t*)fp->mt;
+	int64_t i;
+	pthread_mutex_lock(&ra->lock);
+	if (address == ra->next_address) {
+		pthread_mutex_unlock(&ra->lock);
+		return 0;
+	}
+	// blocks queued up to the address are dropped
+	for (i = ra->tail; i < ra->head; ++i)
+		if (ra->blk[i % ra->n_blks].address == address) break;
+	if (i < ra->head) {
+		for (; ra->tail < i; ++ra->tail) {
+			rablock_t *b = &ra->blk[ra->tail % ra->n_blks];
+			while (b->state != RA_READY) pthread_cond_wait(&ra->cv_ready, &ra->lock);
+			b->state = RA_EMPTY;
+		}
+		ra->next_address = address;
+		pthread_cond_broadcast(&ra->cv_work);
+		pthread_mutex_unlock(&ra->lock);
+		return 0;
+	}
+	ra_restart(fp, ra, address);
+	if (_bgzf_seek(fp->fp, address, SEEK_SET) < 0) {
+		pthread_mutex_unlock(&ra->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+int bgzf_mt_read(BGZF *fp, int n_threads, int n_blks)
+{
+	int i;
+	raux_t *ra;
+	if (fp->is_write || fp->mt || n_threads < 1 || n_blks < 1) return -1;
+	ra = calloc(1, sizeof(raux_t));
+	ra->n_threads = n_threads;
+	ra->n_blks = n_blks;
+	ra->blk = calloc(n_blks, sizeof(rablock_t));
+	for (i = 0; i < n_blks; ++i) {
+		ra->blk[i].compressed = malloc(BGZF_MAX_BLOCK_SIZE);
+		ra->blk[i].uncompressed = malloc(BGZF_MAX_BLOCK_SIZE);
+	}
+	ra->file_address = ra->next_address = _bgzf_tell((_bgzf_file_t)fp->fp); // the current block stays loaded
+	pthread_mutex_init(&ra->lock, 0);
+	pthread_cond_init(&ra->cv_work, 0);
+	pthread_cond_init(&ra->cv_ready, 0);
+	fp->mt = ra;
+	ra->tid = calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_threads; ++i)
+		pthread_create(&ra->tid[i], 0, ra_worker, fp);
+	return 0;
+}
+
+static void ra_destroy(raux_t *ra)
+{
+	int i;
+	pthread_mutex_lock(&ra->lock);
+	ra->done = 1;
+	pthread_cond_broadcast(&ra->cv_work);
+	pthread_mutex_unlock(&ra->lock);
+	for (i = 0; i < ra->n_threads; ++i) pthread_join(ra->tid[i], 0);
+	for (i = 0; i < ra->n_blks; ++i) {
+		free(ra->blk[i].compressed);
+		free(ra->blk[i].uncompressed);
+	}
+	free(ra->blk); free(ra->tid);
+	pthread_cond_destroy(&ra->cv_work);
+	pthread_cond_destroy(&ra->cv_ready);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+/***** END: multi-threaded read-ahead *****/
+
 int bgzf_flush(BGZF *fp)
 {
 	if (!fp->is_write) return 0;
@@ -581,7 +804,7 @@ int bgzf_close(BGZF* fp)
 			return -1;
 		}
 		if (fp->mt) mt_destroy(fp->mt);
-	}
+	} else if (fp->mt) ra_destroy(fp->mt);
 	ret = fp->is_write? fclose(fp->fp) : _bgzf_close(fp->fp);
 	if (ret != 0) return -1;
 	free(fp->uncompressed_block);
@@ -601,11 +824,16 @@ int bgzf_check_EOF(BGZF *fp)
 	static uint8_t magic[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
 	uint8_t buf[28];
 	off_t offset;
+	int ret = 0;
+	if (fp->mt) pthread_mutex_lock(&((raux_t*)fp->mt)->lock); // the workers read from the same file
 	offset = _bgzf_tell((_bgzf_file_t)fp->fp);
-	if (_bgzf_seek(fp->fp, -28, SEEK_END) < 0) return 0;
-	_bgzf_read(fp->fp, buf, 28);
-	_bgzf_seek(fp->fp, offset, SEEK_SET);
-	return (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	if (_bgzf_seek(fp->fp, -28, SEEK_END) >= 0) {
+		_bgzf_read(fp->fp, buf, 28);
+		_bgzf_seek(fp->fp, offset, SEEK_SET);
+		ret = (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	}
+	if (fp->mt) pthread_mutex_unlock(&((raux_t*)fp->mt)->lock);
+	return ret;
 }
 
 int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
@@ -619,7 +847,11 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 	}
 	block_offset = pos & 0xFFFF;
 	block_address = pos >> 16;
-	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+	if (fp->mt && block_address == fp->block_address && fp->block_length > 0) { // within the current block
+		fp->block_offset = block_offset;
+		return 0;
+	}
+	if ((fp->mt? ra_seek(fp, block_address) : _bgzf_seek(fp->fp, block_address, SEEK_SET)) < 0) {
 		fp->errcode |= BGZF_ERR_IO;
 		return -1;
 	}
@@ -650,7 +882,7 @@ int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+        fp->block_address = next_block_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -683,7 +915,7 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 		str->l += l;
 		fp->block_offset += l + 1;
 		if (fp->block_offset >= fp->block_length) {
-			fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+			fp->block_address = next_block_address(fp);
 			fp->block_offset = 0;
 			fp->block_length = 0;
 		} 
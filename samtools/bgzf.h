@@ -200,6 +200,15 @@ extern "C" {
 	 */
 	int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 
+	/**
+	 * Enable multi-threaded read-ahead (only effective on reading)
+	 *
+	 * @param fp          BGZF file handler; must be opened for reading
+	 * @param n_threads   #threads inflating blocks ahead of the reader
+	 * @param n_blks      #blocks read ahead
+	 */
+	int bgzf_mt_read(BGZF *fp, int n_threads, int n_blks);
+
 #ifdef __cplusplus
 }
 #endif
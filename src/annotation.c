@@ -0,0 +1,172 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "multiplexer.h"
+
+//////////////////////////////////////////////////////
+// Annotation of a signal against several masks
+//
+// Each span of the signal is annotated, for each mask,
+// with a flag telling whether they overlap, or with the
+// distance to the nearest region of the mask, as the
+// overlaps and nearest operators do one mask at a time,
+// or with the value of the mask at its first base, for
+// point lookups. The signal is read once, and the masks
+// move forward with it, each catching up on its own:
+// indexed masks jump over long gaps, and nothing is 
+// allocated per span.
+//////////////////////////////////////////////////////
+
+typedef enum {ANNOTATE_OVERLAPS, ANNOTATE_NEAREST, ANNOTATE_VALUES} AnnotationMode;
+
+typedef struct annotationData_st {
+	WiggleIterator * signal;
+	WiggleIterator ** masks;
+	AnnotationMode mode;
+	// Last region of each mask starting at or before the current span, for nearest
+	char ** prevChroms;
+	int * prevFinishes;
+} AnnotationData;
+
+static double overlapFlag(WiggleIterator * mask, WiggleIterator * signal) {
+	catchUp(mask, signal->chrom, signal->start);
+	return !mask->done && mask->chrom == signal->chrom && mask->start < signal->finish;
+}
+
+// Distances are counted as by the nearest operator, 0 when overlapping
+static double nearestDistance(AnnotationData * data, int index, WiggleIterator * signal) {
+	WiggleIterator * mask = data->masks[index];
+	double distance = NAN;
+
+	while (!mask->done) {
+		int chrom_cmp = compareChroms(mask->chrom, signal->chrom);
+		if (chrom_cmp < 0)
+			catchUp(mask, signal->chrom, 0);
+		else if (chrom_cmp > 0 || mask->start > signal->start)
+			break;
+		else {
+			data->prevChroms[index] = mask->chrom;
+			data->prevFinishes[index] = mask->finish;
+			pop(mask);
+		}
+	}
+
+	if (data->prevChroms[index] == signal->chrom)
+		distance = signal->start - data->prevFinishes[index] + 1;
+	if (!mask->done && mask->chrom == signal->chrom && !(distance <= mask->start - signal->finish + 1))
+		distance = mask->start - signal->finish + 1;
+	return distance < 0 ? 0 : distance;
+}
+
+// The mask is out of play where no region holds the first base of the span
+static void lookupValue(Multiplexer * multi, int index, WiggleIterator * signal) {
+	WiggleIterator * mask = ((AnnotationData *) multi->data)->masks[index];
+
+	catchUp(mask, signal->chrom, signal->start);
+	multi->inplay[index] = !mask->done && mask->chrom == signal->chrom && mask->start <= signal->start;
+	if (multi->inplay[index]) {
+		multi->values[index] = mask->value;
+		multi->inplay_count++;
+	} else
+		multi->values[index] = multi->default_values[index];
+}
+
+static void AnnotationPop(Multiplexer * multi) {
+	AnnotationData * data = (AnnotationData *) multi->data;
+	WiggleIterator * signal = data->signal;
+	int i;
+
+	if (signal->done) {
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = signal->chrom;
+	multi->start = signal->start;
+	multi->finish = signal->finish;
+	if (data->mode == ANNOTATE_VALUES) {
+		multi->inplay_count = 0;
+		for (i = 0; i < multi->count; i++)
+			lookupValue(multi, i, signal);
+	} else
+		for (i = 0; i < multi->count; i++)
+			multi->values[i] = data->mode == ANNOTATE_NEAREST ? nearestDistance(data, i, signal) : overlapFlag(data->masks[i], signal);
+	pop(signal);
+}
+
+static void AnnotationSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	AnnotationData * data = (AnnotationData *) multi->data;
+	int i;
+
+	seek(data->signal, chrom, start, finish);
+	for (i = 0; i < multi->count; i++) {
+		seek(data->masks[i], chrom, start, finish);
+		data->prevChroms[i] = NULL;
+	}
+	AnnotationPop(multi);
+}
+
+// Only the signal is skipped, the masks follow at the next pop
+static void AnnotationSkip(Multiplexer * multi, const char * chrom, int start) {
+	skipTo(((AnnotationData *) multi->data)->signal, chrom, start);
+}
+
+static Multiplexer * newAnnotation(WiggleIterator * signal, WiggleIterator ** masks, int count, AnnotationMode mode) {
+	AnnotationData * data = (AnnotationData *) calloc(1, sizeof(AnnotationData));
+	Multiplexer * new;
+	int i;
+
+	if (count < 1) {
+		fprintf(stderr, "A signal is annotated against at least one mask\n");
+		raiseError();
+	}
+	data->signal = signal;
+	data->mode = mode;
+	data->masks = (WiggleIterator **) calloc(count, sizeof(WiggleIterator *));
+	data->prevChroms = (char **) calloc(count, sizeof(char *));
+	data->prevFinishes = (int *) calloc(count, sizeof(int));
+	// Overlapping regions of a mask are merged, so that they come sorted by finish too
+	for (i = 0; i < count; i++)
+		data->masks[i] = NonOverlappingWiggleIterator(masks[i]);
+
+	new = newCoreMultiplexer(data, count, &AnnotationPop, &AnnotationSeek);
+	if (signal->skipTo)
+		new->skipTo = &AnnotationSkip;
+	new->finite = mode != ANNOTATE_NEAREST;
+	new->integral = mode != ANNOTATE_NEAREST;
+	for (i = 0; i < count; i++) {
+		if (mode == ANNOTATE_VALUES) {
+			new->default_values[i] = new->values[i] = data->masks[i]->default_value;
+			new->finite &= data->masks[i]->finite && isfinite(data->masks[i]->default_value);
+			new->integral &= data->masks[i]->integral;
+		} else
+			new->default_values[i] = new->values[i] = mode == ANNOTATE_NEAREST ? NAN : 0;
+		new->inplay[i] = true;
+	}
+	new->inplay_count = count;
+	popMultiplexer(new);
+	return new;
+}
+
+Multiplexer * AnnotationMultiplexer(WiggleIterator * signal, WiggleIterator ** masks, int count, bool nearest) {
+	return newAnnotation(signal, masks, count, nearest ? ANNOTATE_NEAREST : ANNOTATE_OVERLAPS);
+}
+
+Multiplexer * LookupMultiplexer(WiggleIterator * positions, WiggleIterator ** inputs, int count) {
+	return newAnnotation(positions, inputs, count, ANNOTATE_VALUES);
+}
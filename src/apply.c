@@ -16,32 +16,89 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "multiplexer.h"
+#include "memoryUsage.h"
+#include "tracer.h"
 
 const int MAX_BUFFER = 1e6;
-const int MAX_BUFFER_SUM = 1e6;
+// Buffers only hold the records of the input, so batches can overlap a lot
+const int MAX_BUFFER_SUM = 1e7;
+// Gap between the regions of a batch when the costs of the input are unknown, see plannedGap
 const int MAX_SEEK = 1e6;
 
+// Number of threads computing the statistics of buffered regions
+static int applyThreads = 1;
+
+void setApplyThreads(int threads) {
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of apply threads: %i\n", threads);
+		raiseError();
+	}
+	applyThreads = threads;
+}
+
 //////////////////////////////////////////////////////
 // Buffered wiggleIterator
 //////////////////////////////////////////////////////
 
+// The data of a region is kept as the spans of the input records,
+// clipped to the region, in coordinates relative to its start
+
+typedef struct bufferedSpan_st {
+	int start;
+	int finish;
+	StoredValue value;
+} BufferedSpan;
+
 typedef struct bufferedWiggleIteratorData_st {
 	char * chrom;
 	int start;
 	int finish;
-	int index;
 	int length;
-	double * values;
-	bool * set;
+	// Regions which are too long are read straight from the input
+	bool buffered;
+	// Large regions of a sorted run, read forward from a single seek of the input
+	bool streamed;
+	BufferedSpan * spans;
+	int count;
+	int maxSpans;
+	// Replay
+	int index;
+	int position;
 	struct bufferedWiggleIteratorData_st * next;
 	double default_value;
+	// Computation by the worker threads, see below
+	// results is only allocated, by the main thread, once queued
+	double * results;
+	int job_state;
+	struct bufferedWiggleIteratorData_st * next_job;
+	// Later targets of the batch on the same region, which are
+	// neither filled nor computed, but given a copy of its results
+	bool copy;
+	struct bufferedWiggleIteratorData_st * copies;
+	struct bufferedWiggleIteratorData_st * next_copy;
 } BufferedWiggleIteratorData;
 
-static BufferedWiggleIteratorData * createBufferedWiggleIteratorData(char * chrom, int start, int finish, float default_value) {
-	BufferedWiggleIteratorData * bufferedData = (BufferedWiggleIteratorData *) calloc(1, sizeof(BufferedWiggleIteratorData));
-	if (!bufferedData) {
+// Regions of a batch, as passed to seekRegions
+typedef struct batchRegions_st {
+	int * starts;
+	int * finishes;
+	int count;
+	int capacity;
+} BatchRegions;
+
+// Recycled data keeps its spans, which are reused
+static BufferedWiggleIteratorData * createBufferedWiggleIteratorData(BufferedWiggleIteratorData * recycled, char * chrom, int start, int finish, float default_value) {
+	BufferedWiggleIteratorData * bufferedData = recycled;
+	if (bufferedData) {
+		BufferedSpan * spans = bufferedData->spans;
+		int maxSpans = bufferedData->maxSpans;
+		memset(bufferedData, 0, sizeof(BufferedWiggleIteratorData));
+		bufferedData->spans = spans;
+		bufferedData->maxSpans = maxSpans;
+	} else if (!(bufferedData = (BufferedWiggleIteratorData *) calloc(1, sizeof(BufferedWiggleIteratorData)))) {
 		fprintf(stderr, "Could not calloc %li bytes\n", sizeof(BufferedWiggleIteratorData));
 		abort();
 	}
@@ -50,69 +107,179 @@ static BufferedWiggleIteratorData * createBufferedWiggleIteratorData(char * chro
 	bufferedData->finish = finish;
 	bufferedData->index = 0;
 	bufferedData->length = finish - start;
-	if (bufferedData->length < MAX_BUFFER) {
-		bufferedData->values = (double *) calloc(bufferedData->length, sizeof(double));
-		bufferedData->set = (bool *) calloc(bufferedData->length, sizeof(bool));
-	}
+	bufferedData->buffered = bufferedData->length < MAX_BUFFER;
 	bufferedData->default_value = default_value;
 	return bufferedData;
 }
 
 void destroyBufferedWiggleIteratorData(BufferedWiggleIteratorData * data) {
-	if (data->values) {
-		free(data->values);
-		free(data->set);
-	}
+	countMemory(MEMORY_APPLY, -data->maxSpans * (long long) sizeof(BufferedSpan));
+	free(data->spans);
+	free(data->results);
 	free(data);
 }
 
+static BufferedSpan * newBufferedSpan(BufferedWiggleIteratorData * data) {
+	if (data->count == data->maxSpans) {
+		int added = data->maxSpans ? data->maxSpans : 4;
+		countMemory(MEMORY_APPLY, added * (long long) sizeof(BufferedSpan));
+		data->maxSpans += added;
+		data->spans = (BufferedSpan *) realloc(data->spans, data->maxSpans * sizeof(BufferedSpan));
+		if (!data->spans) {
+			fprintf(stderr, "Could not allocate %i spans\n", data->maxSpans);
+			abort();
+		}
+	}
+	return data->spans + data->count++;
+}
+
+static void appendBufferedSpan(BufferedWiggleIteratorData * data, int start, int finish, double value) {
+	BufferedSpan * span = newBufferedSpan(data);
+	span->start = start;
+	span->finish = finish;
+	span->value = value;
+}
+
+// The input records come by order of start, so the spans they overwrite
+// are at the end of the list. As when the data was stored base by base,
+// the latest record takes precedence over the bases it covers.
+static void addBufferedSpan(BufferedWiggleIteratorData * data, int start, int finish, double value) {
+	int first, index;
+
+	if (data->count == 0 || data->spans[data->count - 1].finish <= start) {
+		appendBufferedSpan(data, start, finish, value);
+		return;
+	}
+
+	for (first = data->count - 1; first > 0 && data->spans[first - 1].finish > start; first--)
+		continue;
+
+	int overlapCount = data->count - first;
+	BufferedSpan * overlaps = (BufferedSpan *) malloc(overlapCount * sizeof(BufferedSpan));
+	memcpy(overlaps, data->spans + first, overlapCount * sizeof(BufferedSpan));
+	data->count = first;
+
+	if (overlaps[0].start < start)
+		appendBufferedSpan(data, overlaps[0].start, start, overlaps[0].value);
+	appendBufferedSpan(data, start, finish, value);
+	for (index = 0; index < overlapCount; index++)
+		if (overlaps[index].finish > finish)
+			appendBufferedSpan(data, overlaps[index].start > finish ? overlaps[index].start : finish, overlaps[index].finish, overlaps[index].value);
+	free(overlaps);
+}
+
+static void popBufferedSpan(WiggleIterator * apply, BufferedWiggleIteratorData * data) {
+	BufferedSpan * span = data->spans + data->index;
+	if (data->position < span->start)
+		data->position = span->start;
+	apply->start = data->position;
+	apply->finish = span->finish;
+	apply->value = span->value;
+	data->position = apply->finish;
+	if (data->position == span->finish)
+		data->index++;
+}
+
 void LooseBufferedWiggleIteratorPop(WiggleIterator * apply) {
 	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
 	if (apply->done)
 		;
-	else if (data->index == data->length)
+	else if (data->position == data->length)
 		apply->done = true;
+	else if (data->index < data->count && data->spans[data->index].start <= data->position)
+		popBufferedSpan(apply, data);
 	else {
-		apply->start = data->index;
-		if (data->set[data->index]) {
-			apply->value = data->values[data->index];
-			data->index++;
-		} else {
-			apply->value = apply->default_value;
-			while (data->index < data->length && !data->set[data->index])
-				data->index++;
-		}
-		apply->finish = data->index;
+		// Gaps between spans take the default value
+		apply->start = data->position;
+		apply->finish = data->index < data->count ? data->spans[data->index].start : data->length;
+		apply->value = apply->default_value;
+		data->position = apply->finish;
 	}
 }
 
 void StrictBufferedWiggleIteratorPop(WiggleIterator * apply) {
 	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
-	while (data->index < data->length) {
-		if (data->set[data->index]) {
-			apply->start = data->index;
-			apply->finish = apply->start + 1;
-			apply->value = data->values[data->index];
-			data->index++;
-			return;
-		} else
-			data->index++;
-	}
-	apply->done = true;
+	if (data->index < data->count)
+		popBufferedSpan(apply, data);
+	else
+		apply->done = true;
 }
 
 void BufferedWiggleIteratorSeek(WiggleIterator * apply, const char * chrom, int start, int finish) {
 	fprintf(stderr, "Cannot seek on buffered iterator!");
-	exit(1);
+	raiseError();
+}
+
+// Reversed replays, from the end of the region back to its start
+static void LooseBufferedWiggleIteratorPopReverse(WiggleIterator * apply) {
+	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
+	if (apply->done)
+		;
+	else if (data->position == 0)
+		apply->done = true;
+	else if (data->index >= 0 && data->spans[data->index].finish >= data->position) {
+		BufferedSpan * span = data->spans + data->index;
+		apply->start = span->start;
+		apply->finish = data->position;
+		apply->value = span->value;
+		data->position = span->start;
+		data->index--;
+	} else {
+		apply->finish = data->position;
+		apply->start = data->index >= 0 ? data->spans[data->index].finish : 0;
+		apply->value = apply->default_value;
+		data->position = apply->start;
+	}
+}
+
+static void StrictBufferedWiggleIteratorPopReverse(WiggleIterator * apply) {
+	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
+	if (data->index >= 0) {
+		BufferedSpan * span = data->spans + data->index--;
+		apply->start = span->start;
+		apply->finish = span->finish;
+		apply->value = span->value;
+	} else
+		apply->done = true;
+}
+
+static bool isReversedBufferedWiggleIterator(WiggleIterator * apply) {
+	return apply->pop == &LooseBufferedWiggleIteratorPopReverse || apply->pop == &StrictBufferedWiggleIteratorPopReverse;
+}
+
+// As for the rewind below, the region is always replayed whole
+static void BufferedWiggleIteratorSeekReverse(WiggleIterator * apply, const char * chrom, int start, int finish) {
+	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
+	if (!isReversedBufferedWiggleIterator(apply))
+		apply->pop = apply->pop == &StrictBufferedWiggleIteratorPop ? &StrictBufferedWiggleIteratorPopReverse : &LooseBufferedWiggleIteratorPopReverse;
+	data->index = data->count - 1;
+	data->position = data->length;
+	apply->chrom = data->chrom;
+	apply->done = false;
+	pop(apply);
+}
+
+// Only used by the statistic chains below, which replay each region from its start
+static void BufferedWiggleIteratorRewind(WiggleIterator * apply, const char * chrom, int start, int finish) {
+	BufferedWiggleIteratorData * data = (BufferedWiggleIteratorData *) apply->data;
+	if (isReversedBufferedWiggleIterator(apply))
+		apply->pop = apply->pop == &StrictBufferedWiggleIteratorPopReverse ? &StrictBufferedWiggleIteratorPop : &LooseBufferedWiggleIteratorPop;
+	data->index = 0;
+	data->position = 0;
+	apply->chrom = data->chrom;
+	pop(apply);
 }
 
 WiggleIterator * BufferedWiggleIterator(BufferedWiggleIteratorData * data, bool strict) {
 	WiggleIterator * apply;
+	data->index = 0;
+	data->position = 0;
 	if (strict)
 		apply = newWiggleIterator(data, &StrictBufferedWiggleIteratorPop, &BufferedWiggleIteratorSeek, data->default_value);
 	else
 		apply = newWiggleIterator(data, &LooseBufferedWiggleIteratorPop, &BufferedWiggleIteratorSeek, data->default_value);
 	apply->chrom = data->chrom;
+	apply->seekReverse = &BufferedWiggleIteratorSeekReverse;
 	return apply;
 }
 
@@ -169,10 +336,71 @@ WiggleIterator * FillInUnaryWiggleIterator(WiggleIterator * source, char * chrom
 	return newWiggleIterator(data, &FillInUnaryPop, NULL, source->default_value);
 }
 
+//////////////////////////////////////////////////////
+// Streamed regions
+//
+// A sorted run of large regions is read with a single
+// seek of the input, which then moves forward across
+// the regions. Each region takes the records which
+// overlap it, clipped to its bounds, and leaves a record
+// which straddles its end on the input for the next one.
+//////////////////////////////////////////////////////
+
+typedef struct streamedRegionData_st {
+	WiggleIterator * source;
+	char * chrom;
+	int start;
+	int finish;
+	// The last record was clipped, and stays on the source
+	bool straddling;
+} StreamedRegionData;
+
+static void StreamedRegionPop(WiggleIterator * wi) {
+	StreamedRegionData * data = (StreamedRegionData *) wi->data;
+	WiggleIterator * source = data->source;
+
+	if (data->straddling || source->done || source->chrom != data->chrom || source->start >= data->finish) {
+		wi->done = true;
+		return;
+	}
+	wi->chrom = data->chrom;
+	wi->start = source->start > data->start ? source->start : data->start;
+	wi->finish = source->finish < data->finish ? source->finish : data->finish;
+	wi->value = source->value;
+	wi->strand = source->strand;
+	if (source->finish > data->finish)
+		data->straddling = true;
+	else
+		pop(source);
+}
+
+static WiggleIterator * StreamedRegionWiggleIterator(WiggleIterator * source, char * chrom, int start, int finish) {
+	StreamedRegionData * data = (StreamedRegionData *) calloc(1, sizeof(StreamedRegionData));
+	data->source = source;
+	data->chrom = chrom;
+	data->start = start;
+	data->finish = finish;
+	// Past the gap since the previous region
+	skipTo(source, chrom, start);
+	return newWiggleIterator(data, &StreamedRegionPop, NULL, source->default_value);
+}
+
+static WiggleIterator * StreamedFillInWiggleIterator(WiggleIterator * source, char * chrom, int start, int finish) {
+	FillInUnaryData * data = (FillInUnaryData*) calloc(1, sizeof(FillInUnaryData));
+	data->chrom = chrom;
+	data->start = start;
+	data->finish = finish;
+	data->source = StreamedRegionWiggleIterator(source, chrom, start, finish);
+	data->first = true;
+	return newWiggleIterator(data, &FillInUnaryPop, NULL, source->default_value);
+}
+
 //////////////////////////////////////////////////////
 // Apply operator
 //////////////////////////////////////////////////////
 
+enum jobState {JOB_QUEUED, JOB_RUNNING, JOB_DONE};
+
 typedef struct applyWiggleIteratorData_st {
 	WiggleIterator * regions;
 	WiggleIterator * (**statistics)(WiggleIterator *);
@@ -181,44 +409,263 @@ typedef struct applyWiggleIteratorData_st {
 	WiggleIterator * input;
 	BufferedWiggleIteratorData * head;
 	BufferedWiggleIteratorData * tail;
+	// Furthest finish of the batch, which may not be that of the last region when regions overlap
+	int finish;
+	// Targets already returned, whose buffers are reused
+	BufferedWiggleIteratorData * spares;
+	// Targets overlapping the current input record, and first target not reached yet
+	BufferedWiggleIteratorData ** active;
+	int activeCount;
+	int maxActive;
+	BufferedWiggleIteratorData * pending;
+	// Answer from the input's precomputed summaries
+	bool zoom;
+	RegionSummary * summaries;
+	// Second reader on the same data, seeking the next batch of targets in the background
+	WiggleIterator * prefetch;
+	BufferedWiggleIteratorData * nextHead;
+	BufferedWiggleIteratorData * nextTail;
+	int nextFinish;
+	pthread_t prefetchThread;
+	bool prefetching;
+	char * prefetchChrom;
+	int prefetchStart;
+	int prefetchFinish;
+	BatchRegions batchRegions;
+	BatchRegions prefetchRegions;
+	// Worker threads, which compute buffered regions in the order they are queued
+	int count;
+	int workerCount;
+	pthread_t * workers;
+	BufferedWiggleIteratorData * firstJob;
+	BufferedWiggleIteratorData * lastJob;
+	int runningJobs;
+	bool stopWorkers;
+	pthread_mutex_t jobMutex;
+	pthread_cond_t jobCond;
+	// Statistics of the buffered regions computed by the main thread, see computeApplyValues
+	struct applyChain_st * chain;
+	// Records read by the sweeps of the batches, and bases spanned, see plannedGap
+	long long sweptRecords;
+	long long sweptBases;
 } ApplyMultiplexerData;
 
 static BufferedWiggleIteratorData * createTarget(ApplyMultiplexerData * data) {
-	return createBufferedWiggleIteratorData(data->regions->chrom, data->regions->start, data->regions->finish, data->input->default_value);
+	BufferedWiggleIteratorData * recycled = data->spares;
+	if (recycled)
+		data->spares = recycled->next;
+	return createBufferedWiggleIteratorData(recycled, data->regions->chrom, data->regions->start, data->regions->finish, data->input->default_value);
+}
+
+static void releaseTarget(ApplyMultiplexerData * data, BufferedWiggleIteratorData * bufferedData) {
+	free(bufferedData->results);
+	bufferedData->next = data->spares;
+	data->spares = bufferedData;
 }
 
-static void addTarget(ApplyMultiplexerData * data, BufferedWiggleIteratorData * bufferedData) {
-	if (!data->head)
-		data->head = bufferedData;
+static void addTarget(BufferedWiggleIteratorData ** head, BufferedWiggleIteratorData ** tail, BufferedWiggleIteratorData * bufferedData) {
+	if (!*head)
+		*head = bufferedData;
 	else
-		data->tail->next = bufferedData;
-	data->tail = bufferedData;
+		(*tail)->next = bufferedData;
+	*tail = bufferedData;
 }
 
-static void createTargets(ApplyMultiplexerData * data) {
+// Regions repeated in a bed file, e.g. the shared exons of isoforms, are computed once.
+// run is the first target of the batch with the same start, as sorted regions follow each other.
+static void findOriginal(BufferedWiggleIteratorData * run, BufferedWiggleIteratorData * tail, BufferedWiggleIteratorData * target) {
+	BufferedWiggleIteratorData * original;
+
+	for (original = run; original; original = original == tail ? NULL : original->next) {
+		if (!original->copy && original->finish == target->finish) {
+			target->copy = true;
+			target->next_copy = original->copies;
+			original->copies = target;
+			return;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////
+// Seek planning
+//
+// A batch is read with a single seek, through the gaps
+// between its regions. Reading through a gap costs the
+// records it holds, starting a new batch costs a seek of
+// the input, so the gaps bridged are those holding fewer
+// records than a seek of the input costs, given its
+// density as measured by the previous sweeps. Inputs
+// which read through the gaps anyway, e.g. streams, and
+// those which skip them within a batched seek, e.g.
+// BigWig files, are read in batches as large as the
+// buffers allow. Seeks of remote files cost a round trip,
+// so they bridge far longer gaps than local ones.
+//////////////////////////////////////////////////////
+
+// Gap bridged by streamed inputs, anything within a chromosome
+#define MAX_STREAM_GAP (1 << 30)
+// Records swept before the density of the input is trusted
+#define MIN_SWEPT_RECORDS 4096
+
+// Longest gap bridged within a batch. Returns false if the costs of the
+// input are unknown, the batches then span up to MAX_SEEK bases.
+static bool plannedGap(ApplyMultiplexerData * data, long long * gap) {
+	WiggleIterator * input = data->input;
+	double cost = input->seekCost;
+	double bases;
+
+	if (input->seekRegions || isinf(cost)) {
+		*gap = MAX_STREAM_GAP;
+		return true;
+	}
+	// Operators which pass skips on are as fast to seek as a local reader
+	if (cost == 0 && !input->skipTo)
+		return false;
+	else if (cost == 0)
+		cost = LOCAL_SEEK_COST;
+	if (data->sweptRecords < MIN_SWEPT_RECORDS)
+		return false;
+	bases = cost * data->sweptBases / data->sweptRecords;
+	*gap = bases < MAX_STREAM_GAP ? (long long) bases : MAX_STREAM_GAP;
+	return true;
+}
+
+// Bases of a batch, within half of the memory budget even if each base holds a span
+static int maxBufferSum() {
+	long long bases = memoryBudget() / 2 / sizeof(BufferedSpan);
+	if (bases && bases < MAX_BUFFER_SUM)
+		return bases;
+	return MAX_BUFFER_SUM;
+}
+
+// Groups the next regions into a batch which can be read with a single seek
+static void collectTargets(ApplyMultiplexerData * data, BufferedWiggleIteratorData ** head, BufferedWiggleIteratorData ** tail, int * finish) {
 	int length;
 	int total_buffers = 0;
+	int max_buffers = maxBufferSum();
+	long long gap = MAX_SEEK;
+	bool planned = plannedGap(data, &gap);
+	BufferedWiggleIteratorData * target, * run = NULL;
 
+	*finish = data->regions->finish;
 	if (data->regions->finish - data->regions->start >= MAX_BUFFER) {
-		addTarget(data, createTarget(data));
-		pop(data->regions);
+		// Followed by the next large regions, sorted and close enough to stream through the gaps.
+		// Records which overlap each other could not be shared between two regions.
+		do {
+			*finish = data->regions->finish;
+			addTarget(head, tail, createTarget(data));
+			(*tail)->streamed = !data->input->overlaps;
+			pop(data->regions);
+		} while ((*tail)->streamed
+			 && !data->regions->done
+			 && data->regions->finish - data->regions->start >= MAX_BUFFER
+			 && data->regions->chrom == (*tail)->chrom
+			 && data->regions->start >= (*tail)->finish
+			 && data->regions->start <= (*tail)->finish + gap);
 	} else {
 		while(!data->regions->done 
 		      && (length = data->regions->finish - data->regions->start) < MAX_BUFFER
-		      && (!data->head 
-			  || ((total_buffers += length) < MAX_BUFFER_SUM && data->regions->finish <= data->head->start + MAX_SEEK && !strcmp(data->regions->chrom, data->tail->chrom))
+		      && (!*head 
+			  || ((total_buffers += length) < max_buffers && (planned ? data->regions->start <= *finish + gap : data->regions->finish <= (*head)->start + MAX_SEEK) && data->regions->chrom == (*tail)->chrom)
 			 )
 		     ) 
 		{
-			addTarget(data, createTarget(data));
+			if (data->regions->finish > *finish)
+				*finish = data->regions->finish;
+			target = createTarget(data);
+			if (run && run->start == target->start)
+				findOriginal(run, *tail, target);
+			else
+				run = target;
+			addTarget(head, tail, target);
 			pop(data->regions);
 		}
-		seek(data->input, data->head->chrom, data->head->start, data->tail->finish);	
+	}
+}
+
+// Indexed readers only read the parts of the file which overlap the targets
+static void listBatchRegions(BatchRegions * regions, BufferedWiggleIteratorData * head, BufferedWiggleIteratorData * tail) {
+	BufferedWiggleIteratorData * target;
+
+	regions->count = 0;
+	for (target = head; target; target = target == tail ? NULL : target->next) {
+		if (regions->count == regions->capacity) {
+			regions->capacity = regions->capacity ? 2 * regions->capacity : 64;
+			regions->starts = (int *) realloc(regions->starts, regions->capacity * sizeof(int));
+			regions->finishes = (int *) realloc(regions->finishes, regions->capacity * sizeof(int));
+		}
+		regions->starts[regions->count] = target->start;
+		regions->finishes[regions->count] = target->finish;
+		regions->count++;
+	}
+}
+
+static void * prefetchRegion(void * args) {
+	ApplyMultiplexerData * data = (ApplyMultiplexerData *) args;
+	nameTraceThread("prefetch");
+	seekRegions(data->prefetch, data->prefetchChrom, data->prefetchRegions.starts, data->prefetchRegions.finishes, data->prefetchRegions.count);
+	return NULL;
+}
+
+static void launchPrefetch(ApplyMultiplexerData * data, BufferedWiggleIteratorData * head, BufferedWiggleIteratorData * tail, int finish) {
+	data->prefetchChrom = head->chrom;
+	data->prefetchStart = head->start;
+	data->prefetchFinish = finish;
+	listBatchRegions(&data->prefetchRegions, head, tail);
+	if (pthread_create(&data->prefetchThread, NULL, &prefetchRegion, data)) {
+		fprintf(stderr, "Could not create prefetch thread\n");
+		raiseError();
+	}
+	data->prefetching = true;
+}
+
+// Returns true if the prefetch reader was positioned on the requested region
+static bool joinPrefetch(ApplyMultiplexerData * data, char * chrom, int start, int finish) {
+	if (!data->prefetching)
+		return false;
+	pthread_join(data->prefetchThread, NULL);
+	data->prefetching = false;
+	return data->prefetchChrom == chrom && data->prefetchStart == start && data->prefetchFinish == finish;
+}
+
+static void seekInput(ApplyMultiplexerData * data, BufferedWiggleIteratorData * head, BufferedWiggleIteratorData * tail, int finish) {
+	if (head->buffered)
+		data->sweptBases += finish - head->start;
+	if (joinPrefetch(data, head->chrom, head->start, finish)) {
+		WiggleIterator * tmp = data->input;
+		data->input = data->prefetch;
+		data->prefetch = tmp;
+	} else {
+		listBatchRegions(&data->batchRegions, head, tail);
+		seekRegions(data->input, head->chrom, data->batchRegions.starts, data->batchRegions.finishes, data->batchRegions.count);
+	}
+}
+
+static void createTargets(ApplyMultiplexerData * data) {
+	if (data->nextHead) {
+		data->head = data->nextHead;
+		data->tail = data->nextTail;
+		data->finish = data->nextFinish;
+		data->nextHead = data->nextTail = NULL;
+	} else
+		collectTargets(data, &data->head, &data->tail, &data->finish);
+	data->pending = data->head;
+	data->activeCount = 0;
+
+	// Large regions are read straight from the input, see computeApplyValues
+	if (data->head->buffered || data->head->streamed)
+		seekInput(data, data->head, data->tail, data->finish);
+
+	// Start reading the following batch while this one is processed
+	if (data->prefetch && !data->regions->done) {
+		collectTargets(data, &data->nextHead, &data->nextTail, &data->nextFinish);
+		if (data->nextHead->buffered)
+			launchPrefetch(data, data->nextHead, data->nextTail, data->nextFinish);
 	}
 }
 
 static void pushDataOnBuffer(ApplyMultiplexerData * data, BufferedWiggleIteratorData * bufferedData) {
-	int pos, start, finish;
+	int start, finish;
 
 	if (bufferedData->start > data->input->start)
 		start = 0;
@@ -230,26 +677,54 @@ static void pushDataOnBuffer(ApplyMultiplexerData * data, BufferedWiggleIterator
 	else
 		finish = data->input->finish - bufferedData->start;
 
-	for (pos = start; pos < finish; pos++) {
-		bufferedData->values[pos] = data->input->value;
-		bufferedData->set[pos] = true;
-	}
+	if (finish > start)
+		addBufferedSpan(bufferedData, start, finish, data->input->value);
+}
 
+static void activateTarget(ApplyMultiplexerData * data, BufferedWiggleIteratorData * bufferedData) {
+	if (data->activeCount == data->maxActive) {
+		data->maxActive = data->maxActive ? 2 * data->maxActive : 16;
+		data->active = (BufferedWiggleIteratorData **) realloc(data->active, data->maxActive * sizeof(BufferedWiggleIteratorData *));
+	}
+	data->active[data->activeCount++] = bufferedData;
 }
 
+// Sweep over the targets: they are activated by order of start as the
+// input reaches them, and dropped once the input has moved past them,
+// so that each record only visits the targets it overlaps
 static void pushData(ApplyMultiplexerData * data) {
-	BufferedWiggleIteratorData * bufferedData;
+	WiggleIterator * input = data->input;
+	int index, kept = 0;
 
-	for (bufferedData = data->head; bufferedData; bufferedData = bufferedData->next) {
-		if (bufferedData->start >= data->input->finish)
-			break;
-		else
+	data->sweptRecords++;
+	for (; data->pending && data->pending->start < input->finish; data->pending = data->pending->next)
+		if (!data->pending->copy)
+			activateTarget(data, data->pending);
+
+	for (index = 0; index < data->activeCount; index++) {
+		BufferedWiggleIteratorData * bufferedData = data->active[index];
+		if (bufferedData->finish > input->start) {
 			pushDataOnBuffer(data, bufferedData);
+			data->active[kept++] = bufferedData;
+		}
 	}
+	data->activeCount = kept;
 }
 
 BufferedWiggleIteratorData * popApplyMultiplexerData(ApplyMultiplexerData * data) {
 	BufferedWiggleIteratorData * bufferedData = data->head;
+	int index;
+
+	// The first target may be returned while the sweep still holds it
+	if (data->pending == bufferedData)
+		data->pending = bufferedData->next;
+	for (index = 0; index < data->activeCount; index++) {
+		if (data->active[index] == bufferedData) {
+			data->active[index] = data->active[--data->activeCount];
+			break;
+		}
+	}
+
 	if (data->tail == data->head) 
 		data->tail = data->head = NULL;
 	else
@@ -257,10 +732,78 @@ BufferedWiggleIteratorData * popApplyMultiplexerData(ApplyMultiplexerData * data
 	return bufferedData;
 }
 
-void computeApplyValues(Multiplexer * apply, ApplyMultiplexerData * data, BufferedWiggleIteratorData * bufferedData) {
+//////////////////////////////////////////////////////
+// Statistic chains
+//
+// The statistics of the buffered regions are computed
+// by a chain built once per thread, over an iterator
+// which is rebound to each region in turn. Seeking the
+// chain resets the statistics and rewinds the region.
+//////////////////////////////////////////////////////
+
+typedef struct applyChain_st {
+	WiggleIterator * replay;
+	// Bound to the replay until the first region
+	BufferedWiggleIteratorData empty;
+	WiggleIterator * statistics;
+} ApplyChain;
+
+static ApplyChain * newApplyChain(ApplyMultiplexerData * data, int count) {
+	ApplyChain * chain = (ApplyChain *) calloc(1, sizeof(ApplyChain));
+	WiggleIterator * wi;
+	int i;
+
+	chain->empty.chrom = data->input->chrom;
+	chain->empty.default_value = data->input->default_value;
+	wi = chain->replay = BufferedWiggleIterator(&chain->empty, data->strict);
+	chain->replay->seek = &BufferedWiggleIteratorRewind;
+	for (i = count - 1; i >= 0; i--)
+		wi = (data->statistics[i])(wi);
+	chain->statistics = wi;
+	return chain;
+}
+
+static void destroyApplyChain(ApplyChain * chain) {
+	WiggleIterator * wi;
+
+	if (!chain)
+		return;
+	wi = chain->statistics;
+	while (wi->append) {
+		WiggleIterator * tmp = wi;
+		wi = wi->append;
+		free(tmp->data);
+		freeWiggleIterator(tmp);
+	}
+	freeWiggleIterator(chain->replay);
+	free(chain);
+}
+
+// The results are read down the chain, in the order of the statistics
+static void runApplyChain(ApplyChain * chain, BufferedWiggleIteratorData * bufferedData, double * values) {
+	WiggleIterator * wi = chain->statistics;
+	int i;
+
+	chain->replay->data = bufferedData;
+	seek(wi, bufferedData->chrom, 0, bufferedData->length);
+	runWiggleIterator(wi);
+	for (i = 0; wi->append; wi = wi->append)
+		values[i++] = *((double *) wi->data);
+}
+
+static void computeApplyValues(ApplyMultiplexerData * data, ApplyChain ** chain, BufferedWiggleIteratorData * bufferedData, double * values, int count) {
 	WiggleIterator * wi;
-	if (bufferedData->values)
+	if (bufferedData->buffered && data->statistics) {
+		if (!*chain)
+			*chain = newApplyChain(data, count);
+		runApplyChain(*chain, bufferedData, values);
+		return;
+	} else if (bufferedData->buffered)
 		wi = BufferedWiggleIterator(bufferedData, data->strict);
+	else if (bufferedData->streamed && data->strict)
+		wi = StreamedRegionWiggleIterator(data->input, bufferedData->chrom, bufferedData->start, bufferedData->finish);
+	else if (bufferedData->streamed)
+		wi = StreamedFillInWiggleIterator(data->input, bufferedData->chrom, bufferedData->start, bufferedData->finish);
 	else if (data->strict) {
 		wi = data->input;
 		seek(wi, bufferedData->chrom, bufferedData->start, bufferedData->finish);
@@ -269,27 +812,181 @@ void computeApplyValues(Multiplexer * apply, ApplyMultiplexerData * data, Buffer
 
 	if (data->statistics) {
 		int i;
-		for (i = apply->count-1; i >= 0; i--)
+		for (i = count-1; i >= 0; i--)
 			wi = (data->statistics[i])(wi);
 		runWiggleIterator(wi);
 		i=0;
 		while (wi->append) {
-			apply->values[i] = *((double*) (wi->data));
+			values[i] = *((double*) (wi->data));
 			WiggleIterator * tmp = wi;
 			wi = wi->append;
 			if (tmp->data)
 				free(tmp->data);
-			free(tmp);
+			freeWiggleIterator(tmp);
 			i++;
 		}
 	} else
-		regionProfile(wi, apply->values, apply->count, apply->finish - apply->start, false);
+		// Buffered spans are relative to the start of the region
+		regionProfile(wi, values, count, bufferedData->buffered ? 0 : bufferedData->start, bufferedData->finish - bufferedData->start, false);
 
 	if (wi != data->input) {
+		// The streamed region under the fill in
+		if (wi->pop == &FillInUnaryPop && bufferedData->streamed)
+			destroyWiggleIterator(((FillInUnaryData *) wi->data)->source);
 		// Careful not to destroy buffered data. It requires special function and is destroyed elsewhere.
 		if (wi->data != bufferedData)
 			free(wi->data);
-		free(wi);
+		freeWiggleIterator(wi);
+	}
+}
+
+//////////////////////////////////////////////////////
+// Worker threads
+//
+// With several apply threads, each buffered region is
+// queued as soon as all its data has been read, and
+// computed by the workers into its own results. The
+// regions are still returned in order: the main thread 
+// waits for the first region, or computes it itself if
+// no worker has picked it up yet. Large regions, which 
+// are read straight from the input, are computed by the 
+// main thread.
+//////////////////////////////////////////////////////
+
+static void runJob(ApplyMultiplexerData * data, ApplyChain ** chain, BufferedWiggleIteratorData * job) {
+	computeApplyValues(data, chain, job, job->results, data->count);
+	pthread_mutex_lock(&data->jobMutex);
+	job->job_state = JOB_DONE;
+	data->runningJobs--;
+	pthread_cond_broadcast(&data->jobCond);
+	pthread_mutex_unlock(&data->jobMutex);
+}
+
+// Called with the mutex locked
+static BufferedWiggleIteratorData * takeJob(ApplyMultiplexerData * data) {
+	BufferedWiggleIteratorData * job = data->firstJob;
+	data->firstJob = job->next_job;
+	if (!data->firstJob)
+		data->lastJob = NULL;
+	job->job_state = JOB_RUNNING;
+	data->runningJobs++;
+	return job;
+}
+
+static void * runWorker(void * args) {
+	ApplyMultiplexerData * data = (ApplyMultiplexerData *) args;
+	ApplyChain * chain = NULL;
+
+	nameTraceThread("apply");
+	pthread_mutex_lock(&data->jobMutex);
+	while (true) {
+		while (!data->firstJob && !data->stopWorkers)
+			pthread_cond_wait(&data->jobCond, &data->jobMutex);
+		if (data->stopWorkers)
+			break;
+		BufferedWiggleIteratorData * job = takeJob(data);
+		pthread_mutex_unlock(&data->jobMutex);
+		double start = traceClock();
+		runJob(data, &chain, job);
+		traceSpan("apply regions", start);
+		pthread_mutex_lock(&data->jobMutex);
+	}
+	pthread_mutex_unlock(&data->jobMutex);
+	destroyApplyChain(chain);
+	return NULL;
+}
+
+static void launchWorkers(ApplyMultiplexerData * data) {
+	int i;
+	data->workers = (pthread_t *) calloc(data->workerCount, sizeof(pthread_t));
+	for (i = 0; i < data->workerCount; i++) {
+		if (pthread_create(data->workers + i, NULL, &runWorker, data)) {
+			fprintf(stderr, "Could not create apply thread\n");
+			raiseError();
+		}
+	}
+}
+
+static void queueJob(ApplyMultiplexerData * data, BufferedWiggleIteratorData * job) {
+	if (!data->workers)
+		launchWorkers(data);
+	job->results = (double *) calloc(data->count, sizeof(double));
+	pthread_mutex_lock(&data->jobMutex);
+	job->job_state = JOB_QUEUED;
+	if (data->lastJob)
+		data->lastJob->next_job = job;
+	else
+		data->firstJob = job;
+	data->lastJob = job;
+	pthread_cond_signal(&data->jobCond);
+	pthread_mutex_unlock(&data->jobMutex);
+}
+
+// Reads the data of the whole batch, queueing each region once complete
+static void queueTargets(ApplyMultiplexerData * data) {
+	BufferedWiggleIteratorData * next = data->head;
+	WiggleIterator * input = data->input;
+
+	while (!input->done && input->start < data->finish && input->chrom == data->head->chrom) {
+		pushData(data);
+		pop(input);
+		for (; next && (input->done || input->chrom != next->chrom || input->start >= next->finish); next = next->next)
+			if (!next->copy)
+				queueJob(data, next);
+	}
+	for (; next; next = next->next)
+		if (!next->copy)
+			queueJob(data, next);
+}
+
+static void waitForJob(ApplyMultiplexerData * data, BufferedWiggleIteratorData * job) {
+	pthread_mutex_lock(&data->jobMutex);
+	if (job->job_state == JOB_QUEUED) {
+		// Jobs are queued in order, so the first region is at the front of the queue
+		takeJob(data);
+		pthread_mutex_unlock(&data->jobMutex);
+		runJob(data, &data->chain, job);
+		return;
+	}
+	while (job->job_state != JOB_DONE)
+		pthread_cond_wait(&data->jobCond, &data->jobMutex);
+	pthread_mutex_unlock(&data->jobMutex);
+}
+
+// Drops the queued jobs and waits for the running ones
+static void cancelJobs(ApplyMultiplexerData * data) {
+	if (!data->workers)
+		return;
+	pthread_mutex_lock(&data->jobMutex);
+	data->firstJob = data->lastJob = NULL;
+	while (data->runningJobs)
+		pthread_cond_wait(&data->jobCond, &data->jobMutex);
+	pthread_mutex_unlock(&data->jobMutex);
+}
+
+static void stopWorkers(ApplyMultiplexerData * data) {
+	int i;
+	if (!data->workers)
+		return;
+	pthread_mutex_lock(&data->jobMutex);
+	data->stopWorkers = true;
+	pthread_cond_broadcast(&data->jobCond);
+	pthread_mutex_unlock(&data->jobMutex);
+	for (i = 0; i < data->workerCount; i++)
+		pthread_join(data->workers[i], NULL);
+	free(data->workers);
+	data->workers = NULL;
+	data->stopWorkers = false;
+}
+
+// Copies are returned after their original, which is released by then
+static void shareResults(Multiplexer * apply, BufferedWiggleIteratorData * bufferedData) {
+	BufferedWiggleIteratorData * copy;
+
+	for (copy = bufferedData->copies; copy; copy = copy->next_copy) {
+		copy->results = (double *) malloc(apply->count * sizeof(double));
+		memcpy(copy->results, apply->values, apply->count * sizeof(double));
+		copy->job_state = JOB_DONE;
 	}
 }
 
@@ -297,26 +994,163 @@ void  updateApplyMultiplexer(Multiplexer * apply, ApplyMultiplexerData * data, B
 	apply->chrom = bufferedData->chrom;
 	apply->start = bufferedData->start;
 	apply->finish = bufferedData->finish;
-	computeApplyValues(apply, data, bufferedData);
+	if (!bufferedData->results)
+		computeApplyValues(data, &data->chain, bufferedData, apply->values, apply->count);
+	else {
+		waitForJob(data, bufferedData);
+		memcpy(apply->values, bufferedData->results, apply->count * sizeof(double));
+	}
+	shareResults(apply, bufferedData);
+}
+
+//////////////////////////////////////////////////////
+// Zoomed apply
+//////////////////////////////////////////////////////
+
+static bool isSummaryStatistic(WiggleIterator * (*statistic)(WiggleIterator *)) {
+	return statistic == &AUCIntegrator
+		|| statistic == &MeanIntegrator
+		|| statistic == &VarianceIntegrator
+		|| statistic == &StandardDeviationIntegrator
+		|| statistic == &CoefficientOfVariationIntegrator
+		|| statistic == &MaxIntegrator
+		|| statistic == &MinIntegrator;
+}
+
+bool canZoomApply(WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator * dataset) {
+	int i;
+
+	if (!dataset->summarize)
+		return false;
+	if (statistics)
+		for (i = 0; i < count; i++)
+			if (!isSummaryStatistic(statistics[i]))
+				return false;
+	return true;
+}
+
+// Bases without data take the default value
+static void fillInSummary(RegionSummary * summary, double length, double default_value) {
+	double gap = length - summary->validCount;
+
+	if (isnan(default_value) || gap <= 0)
+		return;
+
+	if (summary->validCount == 0 || default_value < summary->min)
+		summary->min = default_value;
+	if (summary->validCount == 0 || default_value > summary->max)
+		summary->max = default_value;
+	summary->sum += gap * default_value;
+	summary->sumSquares += gap * default_value * default_value;
+	summary->validCount = length;
+}
+
+static double summaryStatistic(WiggleIterator * (*statistic)(WiggleIterator *), RegionSummary * summary) {
+	double count = summary->validCount;
+	double variance = NAN;
+
+	if (statistic == &AUCIntegrator)
+		return summary->sum;
+	if (count == 0)
+		return NAN;
+	if (statistic == &MeanIntegrator)
+		return summary->sum / count;
+	if (statistic == &MaxIntegrator)
+		return summary->max;
+	if (statistic == &MinIntegrator)
+		return summary->min;
+
+	if (count > 1) {
+		variance = (summary->sumSquares - summary->sum * summary->sum / count) / (count - 1);
+		// Rounding errors on constant signals
+		if (variance < 0)
+			variance = 0;
+	}
+	if (statistic == &VarianceIntegrator)
+		return variance;
+	if (statistic == &StandardDeviationIntegrator)
+		return sqrt(variance);
+	return sqrt(variance) / (summary->sum / count);
+}
+
+static void computeZoomedValues(Multiplexer * apply, ApplyMultiplexerData * data) {
+	int length = apply->finish - apply->start;
+	int i;
+
+	if (data->statistics) {
+		data->input->summarize(data->input, apply->chrom, apply->start, apply->finish, data->summaries, 1);
+		if (!data->strict)
+			fillInSummary(data->summaries, length, data->input->default_value);
+		for (i = 0; i < apply->count; i++)
+			apply->values[i] = summaryStatistic(data->statistics[i], data->summaries);
+	} else if (length >= 2 * apply->count) {
+		// regionProfile rounds positions to the nearest bin, so each bin is
+		// centered on its boundary with the previous one, and the last half bin
+		// is dropped. Summaries are read in half bins to mimic this.
+		double compression = apply->count / (double) length;
+		RegionSummary * halves = data->summaries;
+		data->input->summarize(data->input, apply->chrom, apply->start, apply->finish, halves, 2 * apply->count);
+		for (i = 0; i < 2 * apply->count; i++)
+			fillInSummary(halves + i, length / (2.0 * apply->count), data->input->default_value);
+		for (i = 0; i < apply->count; i++) {
+			double sum = halves[2 * i].sum;
+			if (i > 0)
+				sum += halves[2 * i - 1].sum;
+			apply->values[i] = sum / compression;
+		}
+	} else {
+		// Bins smaller than a base, read the data
+		BufferedWiggleIteratorData target;
+		memset(&target, 0, sizeof(BufferedWiggleIteratorData));
+		target.chrom = apply->chrom;
+		target.start = apply->start;
+		target.finish = apply->finish;
+		computeApplyValues(data, &data->chain, &target, apply->values, apply->count);
+	}
+}
+
+static void ZoomedApplyMultiplexerPop(Multiplexer * apply, ApplyMultiplexerData * data) {
+	if (data->regions->done) {
+		apply->done = true;
+		return;
+	}
+
+	apply->chrom = data->regions->chrom;
+	apply->start = data->regions->start;
+	apply->finish = data->regions->finish;
+	computeZoomedValues(apply, data);
+	pop(data->regions);
 }
 
+//////////////////////////////////////////////////////
+// Apply multiplexer
+//////////////////////////////////////////////////////
+
 void ApplyMultiplexerPop(Multiplexer * apply) {
 	ApplyMultiplexerData * data = (ApplyMultiplexerData *) apply->data;
 
+	if (data->zoom) {
+		ZoomedApplyMultiplexerPop(apply, data);
+		return;
+	}
+
 	// If no ongoing jobs, create some
 	if (data->head == NULL) {
 		// Note: only exit if no more regions AND no targets waiting 
-		if (data->regions->done) {
+		if (data->regions->done && !data->nextHead) {
 			apply->done = true;
+			stopWorkers(data);
 			return;
 		} 
 		createTargets(data);
+		if (data->workerCount && data->head->buffered)
+			queueTargets(data);
 	}
 
 	// If ongoing targets are reading:
 	// Push enough data to finish the first job
-	if (data->head->values) {
-		while (!data->input->done && data->input->start < data->head->finish && !strcmp(data->input->chrom, data->head->chrom)) {
+	if (data->head->buffered && !data->head->results) {
+		while (!data->input->done && data->input->start < data->head->finish && data->input->chrom == data->head->chrom) {
 			pushData(data);
 			pop(data->input);
 		}
@@ -325,44 +1159,302 @@ void ApplyMultiplexerPop(Multiplexer * apply) {
 	// Return value
 	BufferedWiggleIteratorData * bufferedData = popApplyMultiplexerData(data);
 	updateApplyMultiplexer(apply, data, bufferedData);
-	destroyBufferedWiggleIteratorData(bufferedData);
+	releaseTarget(data, bufferedData);
 }
 
 void ApplyMultiplexerSeek(Multiplexer * apply, const char * chrom, int start, int finish) {
 	ApplyMultiplexerData * data = (ApplyMultiplexerData *) apply->data;
 	BufferedWiggleIteratorData * bufferedData;
+	cancelJobs(data);
 	while (data->head) {
 		bufferedData = data->head;
 		data->head = data->head->next;
-		destroyBufferedWiggleIteratorData(bufferedData);
+		releaseTarget(data, bufferedData);
 	}
 	data->tail = NULL;
+	while (data->nextHead) {
+		bufferedData = data->nextHead;
+		data->nextHead = data->nextHead->next;
+		releaseTarget(data, bufferedData);
+	}
+	data->nextTail = NULL;
+	data->pending = NULL;
+	data->activeCount = 0;
+	joinPrefetch(data, NULL, 0, 0);
 	seek(data->regions, chrom, start, finish);
+	popMultiplexer(apply);
 }
 
-Multiplexer * ApplyMultiplexer(WiggleIterator * regions, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator * dataset, bool strict) {
+// The workers are only launched once a region is queued
+static void initWorkers(ApplyMultiplexerData * data, int count) {
+	data->count = count;
+	if (applyThreads > 1) {
+		data->workerCount = applyThreads - 1;
+		pthread_mutex_init(&data->jobMutex, NULL);
+		pthread_cond_init(&data->jobCond, NULL);
+	}
+}
+
+Multiplexer * ApplyMultiplexerFull(WiggleIterator * regions, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator * dataset, bool strict, bool zoom, WiggleIterator * prefetch) {
 	ApplyMultiplexerData * data = (ApplyMultiplexerData *) calloc(1, sizeof(ApplyMultiplexerData));
 	data->regions = regions;
 	data->statistics = statistics;
 	data->input = dataset;
 	data->strict = strict;
+	if (zoom && canZoomApply(statistics, count, dataset)) {
+		data->zoom = true;
+		data->summaries = (RegionSummary *) calloc(1, sizeof(RegionSummary));
+	} else {
+		data->prefetch = prefetch;
+		initWorkers(data, count);
+	}
 	Multiplexer * res = newCoreMultiplexer(data, count, &ApplyMultiplexerPop, &ApplyMultiplexerSeek);
 	int i;
-	for (i=0; i < count; i++)
+	// The statistics of each region are all in play
+	for (i=0; i < count; i++) {
 		res->default_values[i] = NAN;
+		res->inplay[i] = true;
+	}
+	res->inplay_count = count;
 	popMultiplexer(res);
 	return res;
 }
 
-Multiplexer * ProfileMultiplexer(WiggleIterator * regions, int width, WiggleIterator * dataset) {
+Multiplexer * ProfileMultiplexerFull(WiggleIterator * regions, int width, WiggleIterator * dataset, bool zoom, WiggleIterator * prefetch) {
 	ApplyMultiplexerData * data = (ApplyMultiplexerData *) calloc(1, sizeof(ApplyMultiplexerData));
 	data->regions = regions;
 	data->input = dataset;
 	data->strict = false;
+	if (zoom && canZoomApply(NULL, 0, dataset)) {
+		data->zoom = true;
+		data->summaries = (RegionSummary *) calloc(2 * width, sizeof(RegionSummary));
+	} else {
+		data->prefetch = prefetch;
+		initWorkers(data, width);
+	}
 	Multiplexer * res = newCoreMultiplexer(data, width, &ApplyMultiplexerPop, &ApplyMultiplexerSeek);
 	int i;
-	for (i=0; i < width; i++)
+	// The statistics of each region are all in play
+	for (i=0; i < width; i++) {
 		res->default_values[i] = NAN;
+		res->inplay[i] = true;
+	}
+	res->inplay_count = width;
+	popMultiplexer(res);
+	return res;
+}
+
+Multiplexer * ApplyMultiplexer(WiggleIterator * regions, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator * dataset, bool strict) {
+	return ApplyMultiplexerFull(regions, statistics, count, dataset, strict, false, NULL);
+}
+
+Multiplexer * ProfileMultiplexer(WiggleIterator * regions, int width, WiggleIterator * dataset) {
+	return ProfileMultiplexerFull(regions, width, dataset, false, NULL);
+}
+
+//////////////////////////////////////////////////////
+// Shared regions
+//
+// When the same regions are applied to several inputs,
+// they are read once, and queued until each of the
+// applies has read them. The applies are popped in 
+// lockstep, so the queue only holds the regions read
+// ahead by the furthest of them.
+//////////////////////////////////////////////////////
+
+typedef struct sharedRegion_st {
+	char * chrom;
+	int start;
+	int finish;
+	double value;
+} SharedRegion;
+
+typedef struct sharedRegionsReaderData_st SharedRegionsReaderData;
+
+typedef struct sharedRegions_st {
+	WiggleIterator * source;
+	// queue[0] is the region of index first
+	SharedRegion * queue;
+	int first, count, capacity;
+	SharedRegionsReaderData ** readers;
+	int readerCount;
+	// Latest seek of the source
+	int generation;
+	const char * seekChrom;
+	int seekStart, seekFinish;
+	// Index of the first region after that seek, kept until all the readers joined it
+	int seekFirst;
+} SharedRegions;
+
+struct sharedRegionsReaderData_st {
+	SharedRegions * shared;
+	// Index of the next region to read
+	int position;
+	int generation;
+};
+
+// Drops the regions which all the readers have gone past
+static void trimSharedRegions(SharedRegions * shared) {
+	int index, done = shared->count;
+
+	for (index = 0; index < shared->readerCount; index++) {
+		SharedRegionsReaderData * reader = shared->readers[index];
+		int position = reader->generation == shared->generation ? reader->position : shared->seekFirst;
+		if (position - shared->first < done)
+			done = position - shared->first;
+	}
+
+	if (done == 0)
+		return;
+	memmove(shared->queue, shared->queue + done, (shared->count - done) * sizeof(SharedRegion));
+	shared->first += done;
+	shared->count -= done;
+}
+
+static void readSharedRegion(SharedRegions * shared) {
+	WiggleIterator * source = shared->source;
+
+	if (shared->count == shared->capacity) {
+		trimSharedRegions(shared);
+		if (shared->count == shared->capacity) {
+			shared->capacity = shared->capacity ? 2 * shared->capacity : 64;
+			shared->queue = (SharedRegion *) realloc(shared->queue, shared->capacity * sizeof(SharedRegion));
+		}
+	}
+
+	SharedRegion * region = shared->queue + shared->count++;
+	region->chrom = source->chrom;
+	region->start = source->start;
+	region->finish = source->finish;
+	region->value = source->value;
+	pop(source);
+}
+
+static void SharedRegionsReaderPop(WiggleIterator * wi) {
+	SharedRegionsReaderData * reader = (SharedRegionsReaderData *) wi->data;
+	SharedRegions * shared = reader->shared;
+
+	// Left behind by a seek of the other readers
+	if (reader->generation != shared->generation) {
+		wi->done = true;
+		return;
+	}
+
+	if (reader->position == shared->first + shared->count) {
+		if (shared->source->done) {
+			wi->done = true;
+			return;
+		}
+		readSharedRegion(shared);
+	}
+
+	SharedRegion * region = shared->queue + (reader->position++ - shared->first);
+	wi->chrom = region->chrom;
+	wi->start = region->start;
+	wi->finish = region->finish;
+	wi->value = region->value;
+}
+
+// The first reader to seek a region seeks the source, the others join it
+static void SharedRegionsReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	SharedRegionsReaderData * reader = (SharedRegionsReaderData *) wi->data;
+	SharedRegions * shared = reader->shared;
+
+	if (reader->generation == shared->generation || chrom != shared->seekChrom || start != shared->seekStart || finish != shared->seekFinish) {
+		seek(shared->source, chrom, start, finish);
+		shared->first += shared->count;
+		shared->count = 0;
+		shared->generation++;
+		shared->seekChrom = chrom;
+		shared->seekStart = start;
+		shared->seekFinish = finish;
+		shared->seekFirst = shared->first;
+	}
+
+	reader->generation = shared->generation;
+	reader->position = shared->seekFirst;
+	SharedRegionsReaderPop(wi);
+}
+
+// All the readers are registered upfront, so that no region is dropped before each of them has read it.
+// With holdFire, they read nothing before the first seek, as regions queued ahead would be lost.
+static SharedRegions * newSharedRegions(WiggleIterator * source, int readerCount, bool holdFire) {
+	SharedRegions * shared = (SharedRegions *) calloc(1, sizeof(SharedRegions));
+	int index;
+
+	shared->source = source;
+	shared->readerCount = readerCount;
+	shared->readers = (SharedRegionsReaderData **) calloc(readerCount, sizeof(SharedRegionsReaderData *));
+	for (index = 0; index < readerCount; index++) {
+		shared->readers[index] = (SharedRegionsReaderData *) calloc(1, sizeof(SharedRegionsReaderData));
+		shared->readers[index]->shared = shared;
+		if (holdFire)
+			shared->readers[index]->generation = -1;
+	}
+	return shared;
+}
+
+static WiggleIterator * SharedRegionsReader(SharedRegions * shared, int index) {
+	return newWiggleIterator(shared->readers[index], &SharedRegionsReaderPop, &SharedRegionsReaderSeek, shared->source->default_value);
+}
+
+//////////////////////////////////////////////////////
+// Apply over several inputs
+//////////////////////////////////////////////////////
+
+typedef struct multiApplyData_st {
+	Multiplexer ** applies;
+	int count;
+} MultiApplyData;
+
+static void MultiApplyMultiplexerPop(Multiplexer * multi) {
+	MultiApplyData * data = (MultiApplyData *) multi->data;
+	int index;
+
+	if (data->applies[0]->done) {
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = data->applies[0]->chrom;
+	multi->start = data->applies[0]->start;
+	multi->finish = data->applies[0]->finish;
+	for (index = 0; index < data->count; index++) {
+		Multiplexer * apply = data->applies[index];
+		memcpy(multi->values + index * apply->count, apply->values, apply->count * sizeof(double));
+		popMultiplexer(apply);
+	}
+}
+
+static void MultiApplyMultiplexerSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	MultiApplyData * data = (MultiApplyData *) multi->data;
+	int index;
+
+	for (index = 0; index < data->count; index++)
+		seekMultiplexer(data->applies[index], chrom, start, finish);
+	popMultiplexer(multi);
+}
+
+// The values of each region are the statistics of the first input, then those of the second etc.
+Multiplexer * MultiApplyMultiplexer(WiggleIterator * regions, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator ** datasets, int datasetCount, bool strict, bool zoom, bool holdFire) {
+	int index;
+
+	if (datasetCount == 1)
+		return ApplyMultiplexerFull(regions, statistics, count, datasets[0], strict, zoom, NULL);
+
+	MultiApplyData * data = (MultiApplyData *) calloc(1, sizeof(MultiApplyData));
+	SharedRegions * shared = newSharedRegions(regions, datasetCount, holdFire);
+	data->count = datasetCount;
+	data->applies = (Multiplexer **) calloc(datasetCount, sizeof(Multiplexer *));
+	for (index = 0; index < datasetCount; index++)
+		data->applies[index] = ApplyMultiplexerFull(SharedRegionsReader(shared, index), statistics, count, datasets[index], strict, zoom, NULL);
+
+	Multiplexer * res = newCoreMultiplexer(data, count * datasetCount, &MultiApplyMultiplexerPop, &MultiApplyMultiplexerSeek);
+	for (index = 0; index < res->count; index++) {
+		res->default_values[index] = NAN;
+		res->inplay[index] = true;
+	}
+	res->inplay_count = res->count;
 	popMultiplexer(res);
 	return res;
 }
@@ -0,0 +1,247 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "asyncReads.h"
+#include "ioScheduler.h"
+
+// Reads in flight at most, 0 to read through the udc layer
+static int ASYNC_READ_DEPTH = 256;
+
+void setAsyncReadDepth(int value) {
+	if (value < 0) {
+		fprintf(stderr, "Depth of the asynchronous read queue cannot be negative: %i\n", value);
+		raiseError();
+	}
+	ASYNC_READ_DEPTH = value;
+}
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// A read submitted by a task, which lives on the stack of the task while it is parked
+typedef struct asyncRead_st {
+	IoTask * task;
+	struct iovec iovec;
+	int result;
+	// Set by the completion thread, accessed atomically
+	bool completed;
+} AsyncRead;
+
+typedef struct ring_st {
+	int fd;
+	unsigned entries;
+	unsigned * sqTail, * sqMask, * sqArray;
+	struct io_uring_sqe * sqes;
+	unsigned * cqHead, * cqTail, * cqMask;
+	struct io_uring_cqe * cqes;
+	// Reads submitted and not yet collected, protected by the mutex
+	unsigned inFlight;
+} Ring;
+
+static Ring ring;
+static bool ringReady = false;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when reads complete, for submitters waiting for room in the queue
+static pthread_cond_t roomCond = PTHREAD_COND_INITIALIZER;
+
+static int enterRing(unsigned submitted, unsigned waited, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring.fd, submitted, waited, flags, NULL, 0);
+}
+
+static void * collectCompletions(void * args) {
+	for (;;) {
+		if (enterRing(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			fprintf(stderr, "Could not wait for asynchronous reads: %s\n", strerror(errno));
+			abort();
+		}
+
+		unsigned head = *ring.cqHead;
+		unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		unsigned count = tail - head;
+		for (; head != tail; head++) {
+			struct io_uring_cqe * cqe = ring.cqes + (head & *ring.cqMask);
+			AsyncRead * request = (AsyncRead *) (uintptr_t) cqe->user_data;
+			// The task may resume and drop the read as soon as it is complete
+			IoTask * task = request->task;
+			request->result = cqe->res;
+			__atomic_store_n(&request->completed, true, __ATOMIC_SEQ_CST);
+			wakeIoTask(task);
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+		if (count) {
+			pthread_mutex_lock(&mutex);
+			ring.inFlight -= count;
+			pthread_cond_broadcast(&roomCond);
+			pthread_mutex_unlock(&mutex);
+		}
+	}
+	return NULL;
+}
+
+// Falls back onto the udc layer if the kernel has no io_uring, or forbids it
+static void setUpRing() {
+	struct io_uring_params params;
+	size_t sqSize, cqSize;
+	char * sq, * cq;
+	pthread_t thread;
+
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, ASYNC_READ_DEPTH, &params);
+	if (ring.fd < 0)
+		return;
+
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqSize > sqSize)
+			sqSize = cqSize;
+		cqSize = sqSize;
+	}
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(ring.fd);
+		return;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(ring.fd);
+		return;
+	}
+
+	ring.entries = params.sq_entries;
+	ring.sqTail = (unsigned *) (sq + params.sq_off.tail);
+	ring.sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned *) (sq + params.sq_off.array);
+	ring.cqHead = (unsigned *) (cq + params.cq_off.head);
+	ring.cqTail = (unsigned *) (cq + params.cq_off.tail);
+	ring.cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	if (pthread_create(&thread, NULL, &collectCompletions, NULL)) {
+		close(ring.fd);
+		return;
+	}
+	pthread_detach(thread);
+	ringReady = true;
+}
+
+static void submitRead(AsyncRead * request, int fd, off_t offset) {
+	pthread_mutex_lock(&mutex);
+	// Not to overflow the completion queue, which is twice as long
+	while (ring.inFlight == ring.entries)
+		pthread_cond_wait(&roomCond, &mutex);
+
+	unsigned tail = *ring.sqTail;
+	unsigned index = tail & *ring.sqMask;
+	struct io_uring_sqe * sqe = ring.sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t) &request->iovec;
+	sqe->len = 1;
+	sqe->user_data = (uintptr_t) request;
+	ring.sqArray[index] = index;
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring.inFlight++;
+
+	while (enterRing(1, 0, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			fprintf(stderr, "Could not submit an asynchronous read: %s\n", strerror(errno));
+			abort();
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static bool readCompleted(void * args) {
+	return __atomic_load_n(&((AsyncRead *) args)->completed, __ATOMIC_SEQ_CST);
+}
+
+int openAsyncFile(const char * filename) {
+	if (ASYNC_READ_DEPTH == 0 || strstr(filename, "://"))
+		return -1;
+	pthread_once(&ringOnce, &setUpRing);
+	if (!ringReady)
+		return -1;
+	return open(filename, O_RDONLY);
+}
+
+void closeAsyncFile(int fd) {
+	if (fd >= 0)
+		close(fd);
+}
+
+bool readAsyncFile(int fd, const char * filename, char * buffer, size_t size, off_t offset) {
+	IoTask * task = currentIoTask();
+	AsyncRead request;
+
+	if (task == NULL)
+		return false;
+
+	// Short reads are resumed where they stopped
+	while (size > 0) {
+		request.task = task;
+		request.iovec.iov_base = buffer;
+		request.iovec.iov_len = size;
+		request.completed = false;
+		submitRead(&request, fd, offset);
+		parkIoTaskOn(task, &readCompleted, &request);
+
+		if (request.result < 0) {
+			fprintf(stderr, "Could not read %s: %s\n", filename, strerror(-request.result));
+			raiseError();
+		} else if (request.result == 0) {
+			fprintf(stderr, "Unexpected end of file %s\n", filename);
+			raiseError();
+		}
+		buffer += request.result;
+		size -= request.result;
+		offset += request.result;
+	}
+	return true;
+}
+
+#else
+
+int openAsyncFile(const char * filename) {
+	return -1;
+}
+
+void closeAsyncFile(int fd) {
+}
+
+bool readAsyncFile(int fd, const char * filename, char * buffer, size_t size, off_t offset) {
+	return false;
+}
+
+#endif
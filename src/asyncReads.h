@@ -0,0 +1,39 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _ASYNC_READS_H_
+#define _ASYNC_READS_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include "wiggletools.h"
+
+// Reads of local files, queued to the kernel through io_uring
+//
+// A download running as an I/O task submits its read and parks, so that
+// its worker thread serves the other downloads in the meantime. A single
+// thread collects the completed reads and wakes their tasks, so all the 
+// readers together keep a deep queue of reads in flight with a handful 
+// of threads.
+
+// Descriptor of a local file for the reads below, -1 if the file is 
+// remote, or if asynchronous reads are disabled or not supported
+int openAsyncFile(const char * filename);
+void closeAsyncFile(int fd);
+// Reads size bytes at offset, raising an error if the file is shorter.
+// Returns false, without reading, when not called from an I/O task.
+bool readAsyncFile(int fd, const char * filename, char * buffer, size_t size, off_t offset);
+
+#endif
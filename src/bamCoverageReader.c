@@ -0,0 +1,904 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Coverage straight from the alignments: each read's CIGAR is added
+// to a difference array, which is integrated into runs of constant depth
+// once no further read can start upstream of them.
+//
+// Fragment coverage counts the span of each proper pair, from its TLEN,
+// once at its leftmost mate, and extends any other read from its 5' end.
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sam.h"
+#include "cramReader.h"
+#include "blockCache.h"
+#include "wiggleIterator.h"
+#include "bufferedReader.h"
+#include "multiplexer.h"
+
+static const int INITIAL_WINDOW = 1024;
+// Longer proper pairs are counted as two reads
+static const int MAX_FRAGMENT_LENGTH = 1000;
+
+// See bamReader.c
+void readAheadBamFile(bamFile file);
+
+typedef struct bamCoverageReaderData_st {
+	// Arguments to downloader
+	char * filename;
+	char * chrom;
+	int start, stop;
+	BufferedReaderData * bufferedReaderData;
+
+	// Read filters
+	int minMapQ, requiredFlags, excludedFlags, strand;
+	// Fragment length of single reads, 0 to keep their alignment, -1 to count the CIGAR blocks instead of fragments
+	int extension;
+
+	// BAM stuff
+	bamFile fp;
+	bam_header_t * header;
+	bam_index_t * idx;
+	bam_iter_t iter;
+	bam1_t * read;
+	// CRAM files are decoded by cramReader.c instead
+	CramFile * cram;
+	CramIterator * cramIter;
+	// Targets in genome order, NULL if the header already is
+	int * chromOrder;
+
+	// Without an index, the file is read once, and each seek resumes where
+	// the previous region stopped: target of the region, target of the
+	// window, and whether the read in hand is past the previous region
+	int tid, lastTid;
+	bool holding, exhausted;
+
+	// Depth changes at positions base, base + 1, ... base + capacity - 1
+	int * diff;
+	int capacity, base;
+	// First unresolved position and end of the furthest read
+	int next, end;
+	int depth;
+
+	// Current run of constant depth, 0-based half open
+	char * runChrom;
+	int runStart, runFinish, runValue;
+	bool killed;
+} BamCoverageReaderData;
+
+static bool keepRead(BamCoverageReaderData * data, bam1_t * b) {
+	if (b->core.tid < 0 || b->core.n_cigar == 0)
+		return false;
+	if (b->core.qual < data->minMapQ)
+		return false;
+	if ((b->core.flag & data->requiredFlags) != data->requiredFlags)
+		return false;
+	if (b->core.flag & data->excludedFlags)
+		return false;
+	if (data->strand > 0 && bam1_strand(b))
+		return false;
+	if (data->strand < 0 && !bam1_strand(b))
+		return false;
+	return true;
+}
+
+static void pushRun(BamCoverageReaderData * data) {
+	// +1 to account for 0-based indexing in BAMs:
+	int start = data->runStart + 1;
+	int finish = data->runFinish + 1;
+
+	if (data->runValue == 0 || data->killed)
+		return;
+	if (data->stop > 0 && data->runChrom != data->chrom)
+		return;
+
+	if (data->stop > 0) {
+		if (start < data->start)
+			start = data->start;
+		if (finish > data->stop)
+			finish = data->stop;
+		if (start >= finish)
+			return;
+	}
+
+	if (pushValuesToBuffer(data->bufferedReaderData, data->runChrom, start, finish, data->runValue))
+		data->killed = true;
+}
+
+// Integrates the depth over all positions before pos
+static void resolveUpTo(BamCoverageReaderData * data, int pos) {
+	int position;
+	int last = pos <= data->end ? pos : data->end + 1;
+
+	for (position = data->next; position < last; position++) {
+		data->depth += data->diff[position - data->base];
+		if (data->depth == data->runValue && position == data->runFinish)
+			data->runFinish++;
+		else {
+			pushRun(data);
+			data->runStart = position;
+			data->runFinish = position + 1;
+			data->runValue = data->depth;
+		}
+	}
+	if (last > data->next)
+		data->next = last;
+
+	// Skip over a gap in coverage
+	if (pos > data->end) {
+		memset(data->diff, 0, (data->end - data->base + 1) * sizeof(int));
+		data->base = data->next = data->end = pos;
+	}
+}
+
+// Makes room in the window for positions up to pos included
+static void reserveWindow(BamCoverageReaderData * data, int pos) {
+	if (pos - data->base < data->capacity)
+		return;
+
+	// Drop resolved positions
+	int shift = data->next - data->base;
+	int used = data->end - data->next + 1;
+	memmove(data->diff, data->diff + shift, used * sizeof(int));
+	memset(data->diff + used, 0, (data->capacity - used) * sizeof(int));
+	data->base = data->next;
+
+	// Keep at least half the window free so that compactions stay rare
+	if (2 * (pos - data->base) >= data->capacity) {
+		int capacity = data->capacity;
+		while (2 * (pos - data->base) >= capacity)
+			capacity *= 2;
+		data->diff = (int *) realloc(data->diff, capacity * sizeof(int));
+		memset(data->diff + data->capacity, 0, (capacity - data->capacity) * sizeof(int));
+		data->capacity = capacity;
+	}
+}
+
+static void addCoverage(BamCoverageReaderData * data, int start, int finish) {
+	reserveWindow(data, finish);
+	data->diff[start - data->base]++;
+	data->diff[finish - data->base]--;
+	if (finish > data->end)
+		data->end = finish;
+}
+
+static void addRead(BamCoverageReaderData * data, bam1_t * b) {
+	uint32_t * cigar = bam1_cigar(b);
+	int position = b->core.pos;
+	int i;
+
+	for (i = 0; i < b->core.n_cigar; i++) {
+		int length = cigar[i] >> BAM_CIGAR_SHIFT;
+		switch (cigar[i] & BAM_CIGAR_MASK) {
+			case BAM_CMATCH:
+			case BAM_CEQUAL:
+			case BAM_CDIFF:
+			case BAM_CDEL:
+				addCoverage(data, position, position + length);
+			case BAM_CREF_SKIP:
+				position += length;
+			default:
+				break;
+		}
+	}
+}
+
+// Reverse reads extend upstream of their position, by this much at most
+static int fragmentLag(BamCoverageReaderData * data) {
+	return data->extension > 0 ? data->extension : 0;
+}
+
+// Returns false if the read is counted with its mate
+static bool readFragment(BamCoverageReaderData * data, bam1_t * b, int * start, int * finish) {
+	int32_t length = b->core.isize;
+
+	if ((b->core.flag & BAM_FPROPER_PAIR) && length != 0 && length <= MAX_FRAGMENT_LENGTH && -length <= MAX_FRAGMENT_LENGTH) {
+		if (length < 0)
+			return false;
+		*start = b->core.pos;
+		*finish = b->core.pos + length;
+	} else if (data->extension <= 0) {
+		*start = b->core.pos;
+		*finish = bam_calend(&b->core, bam1_cigar(b));
+	} else if (bam1_strand(b)) {
+		*finish = bam_calend(&b->core, bam1_cigar(b));
+		*start = *finish > data->extension ? *finish - data->extension : 0;
+	} else {
+		*start = b->core.pos;
+		*finish = b->core.pos + data->extension;
+	}
+	return *finish > *start;
+}
+
+static void resetWindow(BamCoverageReaderData * data, char * chrom, int pos) {
+	memset(data->diff, 0, data->capacity * sizeof(int));
+	data->base = data->next = data->end = pos;
+	data->depth = 0;
+	data->runChrom = chrom;
+	data->runStart = data->runFinish = pos;
+	data->runValue = 0;
+}
+
+//////////////////////////////////////////////////////
+// Alignment access, from BAM or CRAM files alike
+//////////////////////////////////////////////////////
+
+static bool isIndexed(BamCoverageReaderData * data) {
+	return data->idx || (data->cram && hasCramIndex(data->cram));
+}
+
+static bool isQuerying(BamCoverageReaderData * data) {
+	return data->iter || data->cramIter;
+}
+
+static void queryAlignments(BamCoverageReaderData * data, int tid, int beg, int end) {
+	if (data->cram)
+		data->cramIter = queryCramFile(data->cram, tid, beg, end);
+	else
+		data->iter = bam_iter_query(data->idx, tid, beg, end);
+}
+
+static void endQuery(BamCoverageReaderData * data) {
+	if (data->iter)
+		bam_iter_destroy(data->iter);
+	if (data->cramIter)
+		destroyCramIterator(data->cramIter);
+	data->iter = NULL;
+	data->cramIter = NULL;
+}
+
+// Without a query, the file is read on sequentially
+static bool readAlignment(BamCoverageReaderData * data, bam1_t * b) {
+	if (data->cram)
+		return readCramRecord(data->cram, data->cramIter, b);
+	return bam_iter_read(data->fp, data->iter, b) >= 0;
+}
+
+static void readBamCoverage(BamCoverageReaderData * data, bam1_t * b) {
+	bool streaming = !isIndexed(data);
+	int last_tid = streaming ? data->lastTid : -1;
+	int lag = fragmentLag(data);
+	int floor = 0, start, finish;
+
+	while (!data->killed && (data->holding || readAlignment(data, b))) {
+		data->holding = false;
+		if (!keepRead(data, b))
+			continue;
+		// Streams skip the targets before the region
+		if (streaming && data->stop > 0 && b->core.tid < data->tid)
+			continue;
+		// First position the read can cover
+		floor = b->core.pos > lag ? b->core.pos - lag : 0;
+
+		if (b->core.tid != last_tid) {
+			if (last_tid >= 0) {
+				resolveUpTo(data, data->end);
+				pushRun(data);
+			}
+			resetWindow(data, internChromosome(data->header->target_name[b->core.tid]), floor);
+			last_tid = b->core.tid;
+		} else if (floor < data->next) {
+			fprintf(stderr, "BAM file %s is not sorted!\nPosition %s:%i is before %s:%i\n", data->filename, data->runChrom, b->core.pos + 1, data->runChrom, data->next + lag + 1);
+			raiseError();
+		}
+
+		if (data->stop > 0 && (data->runChrom != data->chrom || b->core.pos + 1 - lag >= data->stop)) {
+			data->holding = streaming;
+			break;
+		}
+
+		resolveUpTo(data, floor);
+		if (data->extension < 0)
+			addRead(data, b);
+		else if (readFragment(data, b, &start, &finish))
+			addCoverage(data, start, finish);
+	}
+
+	if (data->holding) {
+		// No read left can start before the read in hand
+		resolveUpTo(data, floor);
+		pushRun(data);
+		data->lastTid = last_tid;
+	} else if (streaming && data->killed)
+		data->lastTid = last_tid;
+	else {
+		if (last_tid >= 0) {
+			resolveUpTo(data, data->end);
+			pushRun(data);
+		}
+		data->exhausted = streaming;
+		data->lastTid = last_tid;
+	}
+}
+
+static void * downloadBamCoverage(void * args) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) args;
+	bam1_t * b = data->read;
+	int index;
+
+	data->killed = false;
+	if (data->exhausted)
+		;
+	else if (data->chromOrder && !isQuerying(data)) {
+		// Whole files not in genome order are read one chromosome at a time
+		for (index = 0; index < data->header->n_targets && !data->killed; index++) {
+			queryAlignments(data, data->chromOrder[index], 0, 1 << 29);
+			readBamCoverage(data, b);
+			endQuery(data);
+		}
+	} else
+		readBamCoverage(data, b);
+
+	endQuery(data);
+	endBufferedSignal(data->bufferedReaderData);
+	return NULL;
+}
+
+void BamCoverageReaderPop(WiggleIterator * wi) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) wi->data;
+	BufferedReaderPop(wi, data->bufferedReaderData);
+}
+
+static void BamCoverageReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) wi->data;
+	BufferedReaderPopBatch(wi, data->bufferedReaderData, batch);
+}
+
+// Without an index, the file is read on to the region, which cannot start
+// before the depths already counted
+static void seekBamStream(WiggleIterator * wi, int tid) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) wi->data;
+
+	if (tid < data->lastTid || (tid == data->lastTid && data->start - 1 < data->runStart)) {
+		fprintf(stderr, "Cannot seek back to %s:%i in BAM file %s without an index!\n", data->chrom, data->start, data->filename);
+		raiseError();
+	}
+	if (data->stop <= 0)
+		data->stop = INT_MAX;
+	data->tid = tid;
+	launchBufferedReader(&downloadBamCoverage, data, &(data->bufferedReaderData));
+	wi->done = false;
+	BamCoverageReaderPop(wi);
+}
+
+void BamCoverageReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) wi->data;
+	int tid;
+
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
+	endQuery(data);
+
+	data->chrom = (char *) chrom;
+	data->start = start;
+	data->stop = finish;
+
+	for (tid = 0; tid < data->header->n_targets; tid++)
+		if (internChromosome(data->header->target_name[tid]) == chrom)
+			break;
+
+	if (tid == data->header->n_targets) {
+		wi->done = true;
+		return;
+	}
+
+	if (!isIndexed(data)) {
+		seekBamStream(wi, tid);
+		return;
+	}
+
+	// Reads can only be looked up by 0-based start, fragments reach beyond their reads
+	if (data->extension >= 0) {
+		start -= data->extension > MAX_FRAGMENT_LENGTH ? data->extension : MAX_FRAGMENT_LENGTH;
+		finish = finish > 0 ? finish + fragmentLag(data) : 0;
+	}
+	queryAlignments(data, tid, start > 0 ? start - 1 : 0, finish > 0 ? finish - 1 : 0);
+	launchBufferedReader(&downloadBamCoverage, data, &(data->bufferedReaderData));
+	wi->done = false;
+	BamCoverageReaderPop(wi);
+}
+
+static WiggleIterator * openBamCoverage(char * filename, bool holdFire, int minMapQ, int requiredFlags, int excludedFlags, int strand, int extension) {
+	BamCoverageReaderData * data = (BamCoverageReaderData *) calloc(1, sizeof(BamCoverageReaderData));
+	data->filename = filename;
+	data->minMapQ = minMapQ;
+	data->requiredFlags = requiredFlags;
+	data->excludedFlags = excludedFlags;
+	data->strand = strand;
+	data->extension = extension;
+	data->capacity = INITIAL_WINDOW;
+	data->diff = (int *) calloc(data->capacity, sizeof(int));
+	data->read = bam_init1();
+	data->lastTid = -1;
+
+	if (isCramFilename(filename)) {
+		data->cram = openCramFile(filename);
+		data->header = cramHeader(data->cram);
+	} else {
+		if (strcmp(filename, "-"))
+			data->fp = bam_open(filename, "r");
+		else
+			data->fp = bam_dopen(fileno(stdin), "r");
+		if (!data->fp) {
+			fprintf(stderr, "Could not open input file %s\n", filename);
+			raiseError();
+		}
+		data->header = bam_header_read(data->fp);
+		readAheadBamFile(data->fp);
+
+		// The index is only needed for seeks
+		if (strcmp(filename, "-"))
+			data->idx = bam_index_load(filename);
+	}
+	if (isIndexed(data))
+		data->chromOrder = sortChromosomes(data->header->target_name, data->header->n_targets);
+
+	if (!holdFire)
+		launchBufferedReader(&downloadBamCoverage, data, &(data->bufferedReaderData));
+	WiggleIterator * new = newWiggleIterator(data, &BamCoverageReaderPop, &BamCoverageReaderSeek, 0);
+	new->popBatch = &BamCoverageReaderPopBatch;
+	new->finite = true;
+	new->integral = true;
+	new->seekCost = readerSeekCost(filename, isIndexed(data));
+	return new;
+}
+
+//////////////////////////////////////////////////////
+// Coverage sidecars
+//
+// With --coverage_sidecars, the coverage of a BAM or 
+// CRAM file read whole is stored as an integer track,
+// so that later runs with the same read filters read
+// it back instead of decompressing the alignments. The
+// sidecar is named after a checksum of the file, i.e.
+// its size and its first and last 64kB, which cover its
+// header and its last blocks, and of the filters. It is 
+// kept in the cache directory if --cache is set, next 
+// to the file otherwise. Reads which are seeked, e.g.
+// one chromosome per thread, use the sidecars but do not
+// write them.
+//////////////////////////////////////////////////////
+
+static bool coverageSidecars = false;
+#define SIDECAR_SAMPLE_SIZE 65536
+
+void setCoverageSidecars(bool value) {
+	coverageSidecars = value;
+}
+
+static unsigned long long hashCoverageBytes(unsigned long long hash, const void * bytes, size_t length) {
+	const unsigned char * ptr = (const unsigned char *) bytes;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= ptr[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// NULL if the file cannot be checksummed, e.g. a stream or a URL
+static char * coverageSidecarPath(char * filename, int minMapQ, int requiredFlags, int excludedFlags, int strand, int extension) {
+	int settings[5] = {minMapQ, requiredFlags, excludedFlags, strand, extension};
+	unsigned long long hash = 14695981039346656037ULL;
+	char * buffer, * path, key[64];
+	struct stat info;
+	long long size;
+	size_t count;
+	FILE * file;
+
+	if (stat(filename, &info) || !S_ISREG(info.st_mode) || !(file = fopen(filename, "rb")))
+		return NULL;
+	size = info.st_size;
+	hash = hashCoverageBytes(hash, &size, sizeof(size));
+	buffer = (char *) malloc(SIDECAR_SAMPLE_SIZE);
+	count = fread(buffer, 1, SIDECAR_SAMPLE_SIZE, file);
+	hash = hashCoverageBytes(hash, buffer, count);
+	if (size > SIDECAR_SAMPLE_SIZE && fseeko(file, size - SIDECAR_SAMPLE_SIZE, SEEK_SET) == 0) {
+		count = fread(buffer, 1, SIDECAR_SAMPLE_SIZE, file);
+		hash = hashCoverageBytes(hash, buffer, count);
+	}
+	hash = hashCoverageBytes(hash, settings, sizeof(settings));
+	free(buffer);
+	fclose(file);
+
+	path = (char *) malloc(strlen(filename) + 2048);
+	sprintf(key, "%016llx", hash);
+	if (!cachedFilePath(path, strlen(filename) + 2048, key, ".coverage.wti"))
+		sprintf(path, "%s.%s.coverage.wti", filename, key);
+	return path;
+}
+
+WiggleIterator * BamCoverageReader(char * filename, bool holdFire, int minMapQ, int requiredFlags, int excludedFlags, int strand, int extension) {
+	char * sidecar;
+
+	if (!coverageSidecars || !(sidecar = coverageSidecarPath(filename, minMapQ, requiredFlags, excludedFlags, strand, extension)))
+		return openBamCoverage(filename, holdFire, minMapQ, requiredFlags, excludedFlags, strand, extension);
+	if (access(sidecar, R_OK) == 0)
+		return IntegerTrackReader(sidecar);
+	WiggleIterator * coverage = openBamCoverage(filename, holdFire, minMapQ, requiredFlags, excludedFlags, strand, extension);
+	if (holdFire) {
+		free(sidecar);
+		return coverage;
+	}
+	return IntegerTrackMemoWiggleIterator(coverage, sidecar);
+}
+
+//////////////////////////////////////////////////////
+// Coverage per strand
+//
+// A multiplex of the forward, reverse and total coverage,
+// then the same over reads of high mapping quality if a
+// threshold is set, from a single decompression and CIGAR
+// walk. The tracks share one difference array, with one
+// column per track, and the runs end wherever any depth
+// changes.
+//////////////////////////////////////////////////////
+
+typedef struct bamStrandsData_st {
+	char * filename;
+	const char * chrom;
+	int start, stop;
+
+	// Read filters, the quality threshold only applies to the last tracks
+	int minMapQ, requiredFlags, excludedFlags;
+	int trackCount;
+
+	// BAM stuff
+	bamFile fp;
+	bam_header_t * header;
+	bam_index_t * idx;
+	bam_iter_t iter;
+	bam1_t * b;
+	// Targets in genome order, NULL if the header already is
+	int * chromOrder;
+	int orderIndex;
+	bool finished;
+
+	// Depth changes at positions base, base + 1, ..., trackCount per position
+	int * diff;
+	int capacity, base;
+	int next, end;
+	int * depth;
+	int tid;
+
+	// Current run of constant depths, 0-based half open
+	char * runChrom;
+	int runStart, runFinish;
+	int * runDepth;
+
+	// Resolved runs, from the first to be popped, 1-based
+	char ** queueChroms;
+	int * queueStarts, * queueFinishes, * queueDepths;
+	int queueFirst, queueCount, queueCapacity;
+} BamStrandsData;
+
+// Bit mask of the tracks which count the read
+static int bamStrandsTracks(BamStrandsData * data, bam1_t * b) {
+	int mask;
+
+	if (b->core.tid < 0 || b->core.n_cigar == 0)
+		return 0;
+	if ((b->core.flag & data->requiredFlags) != data->requiredFlags)
+		return 0;
+	if (b->core.flag & data->excludedFlags)
+		return 0;
+
+	// Strand, then total
+	mask = (bam1_strand(b) ? 2 : 1) | 4;
+	if (data->trackCount > 3 && b->core.qual >= data->minMapQ)
+		mask |= mask << 3;
+	return mask;
+}
+
+static void pushBamStrandsRun(BamStrandsData * data) {
+	// +1 to account for 0-based indexing in BAMs:
+	int start = data->runStart + 1;
+	int finish = data->runFinish + 1;
+	int track;
+
+	for (track = 0; track < data->trackCount; track++)
+		if (data->runDepth[track])
+			break;
+	if (track == data->trackCount)
+		return;
+
+	if (data->stop > 0) {
+		if (start < data->start)
+			start = data->start;
+		if (finish > data->stop)
+			finish = data->stop;
+		if (start >= finish)
+			return;
+	}
+
+	if (data->queueCount == data->queueCapacity) {
+		data->queueCapacity = data->queueCapacity ? 2 * data->queueCapacity : 64;
+		data->queueChroms = (char **) realloc(data->queueChroms, data->queueCapacity * sizeof(char *));
+		data->queueStarts = (int *) realloc(data->queueStarts, data->queueCapacity * sizeof(int));
+		data->queueFinishes = (int *) realloc(data->queueFinishes, data->queueCapacity * sizeof(int));
+		data->queueDepths = (int *) realloc(data->queueDepths, data->queueCapacity * data->trackCount * sizeof(int));
+	}
+	data->queueChroms[data->queueCount] = data->runChrom;
+	data->queueStarts[data->queueCount] = start;
+	data->queueFinishes[data->queueCount] = finish;
+	memcpy(data->queueDepths + data->queueCount * data->trackCount, data->runDepth, data->trackCount * sizeof(int));
+	data->queueCount++;
+}
+
+// Integrates the depths over all positions before pos
+static void resolveBamStrandsUpTo(BamStrandsData * data, int pos) {
+	int position, track;
+	int last = pos <= data->end ? pos : data->end + 1;
+	bool changed;
+
+	for (position = data->next; position < last; position++) {
+		int * diff = data->diff + (position - data->base) * data->trackCount;
+		changed = false;
+		for (track = 0; track < data->trackCount; track++) {
+			if (diff[track]) {
+				data->depth[track] += diff[track];
+				changed = true;
+			}
+		}
+		if (!changed && position == data->runFinish)
+			data->runFinish++;
+		else {
+			pushBamStrandsRun(data);
+			data->runStart = position;
+			data->runFinish = position + 1;
+			memcpy(data->runDepth, data->depth, data->trackCount * sizeof(int));
+		}
+	}
+	if (last > data->next)
+		data->next = last;
+
+	// Skip over a gap in coverage
+	if (pos > data->end) {
+		memset(data->diff, 0, (data->end - data->base + 1) * data->trackCount * sizeof(int));
+		data->base = data->next = data->end = pos;
+	}
+}
+
+// Makes room in the window for positions up to pos included
+static void reserveBamStrandsWindow(BamStrandsData * data, int pos) {
+	int width = data->trackCount;
+
+	if (pos - data->base < data->capacity)
+		return;
+
+	// Drop resolved positions
+	int shift = data->next - data->base;
+	int used = data->end - data->next + 1;
+	memmove(data->diff, data->diff + shift * width, used * width * sizeof(int));
+	memset(data->diff + used * width, 0, (data->capacity - used) * width * sizeof(int));
+	data->base = data->next;
+
+	// Keep at least half the window free so that compactions stay rare
+	if (2 * (pos - data->base) >= data->capacity) {
+		int capacity = data->capacity;
+		while (2 * (pos - data->base) >= capacity)
+			capacity *= 2;
+		data->diff = (int *) realloc(data->diff, capacity * width * sizeof(int));
+		memset(data->diff + data->capacity * width, 0, (capacity - data->capacity) * width * sizeof(int));
+		data->capacity = capacity;
+	}
+}
+
+static void addBamStrandsRead(BamStrandsData * data, bam1_t * b, int mask) {
+	uint32_t * cigar = bam1_cigar(b);
+	int position = b->core.pos;
+	int i, track;
+
+	for (i = 0; i < b->core.n_cigar; i++) {
+		int length = cigar[i] >> BAM_CIGAR_SHIFT;
+		switch (cigar[i] & BAM_CIGAR_MASK) {
+			case BAM_CMATCH:
+			case BAM_CEQUAL:
+			case BAM_CDIFF:
+			case BAM_CDEL:
+				reserveBamStrandsWindow(data, position + length);
+				for (track = 0; track < data->trackCount; track++) {
+					if (mask & (1 << track)) {
+						data->diff[(position - data->base) * data->trackCount + track]++;
+						data->diff[(position + length - data->base) * data->trackCount + track]--;
+					}
+				}
+				if (position + length > data->end)
+					data->end = position + length;
+			case BAM_CREF_SKIP:
+				position += length;
+			default:
+				break;
+		}
+	}
+}
+
+static void resetBamStrandsWindow(BamStrandsData * data, char * chrom, int pos) {
+	memset(data->diff, 0, data->capacity * data->trackCount * sizeof(int));
+	memset(data->depth, 0, data->trackCount * sizeof(int));
+	memset(data->runDepth, 0, data->trackCount * sizeof(int));
+	data->base = data->next = data->end = pos;
+	data->runChrom = chrom;
+	data->runStart = data->runFinish = pos;
+}
+
+// Whole files not in genome order are read one chromosome at a time
+static bool readBamStrandsRead(BamStrandsData * data) {
+	while (bam_iter_read(data->fp, data->iter, data->b) < 0) {
+		if (data->iter) {
+			bam_iter_destroy(data->iter);
+			data->iter = NULL;
+		}
+		if (data->stop > 0 || !data->chromOrder || data->orderIndex == data->header->n_targets)
+			return false;
+		data->iter = bam_iter_query(data->idx, data->chromOrder[data->orderIndex++], 0, 1 << 29);
+	}
+	return true;
+}
+
+static void finishBamStrands(BamStrandsData * data) {
+	if (data->tid >= 0) {
+		resolveBamStrandsUpTo(data, data->end);
+		pushBamStrandsRun(data);
+	}
+	data->tid = -1;
+	data->finished = true;
+}
+
+// Reads on until some runs are resolved, returns false at the end of the input
+static bool fillBamStrands(BamStrandsData * data) {
+	bam1_t * b = data->b;
+	int mask;
+
+	data->queueFirst = data->queueCount = 0;
+	while (!data->finished && data->queueCount == 0) {
+		if (!readBamStrandsRead(data)) {
+			finishBamStrands(data);
+			break;
+		}
+		if (!(mask = bamStrandsTracks(data, b)))
+			continue;
+
+		if (b->core.tid != data->tid) {
+			if (data->tid >= 0) {
+				resolveBamStrandsUpTo(data, data->end);
+				pushBamStrandsRun(data);
+			}
+			resetBamStrandsWindow(data, internChromosome(data->header->target_name[b->core.tid]), b->core.pos);
+			data->tid = b->core.tid;
+		} else if (b->core.pos < data->next) {
+			fprintf(stderr, "BAM file %s is not sorted!\nPosition %s:%i is before %s:%i\n", data->filename, data->runChrom, b->core.pos + 1, data->runChrom, data->next + 1);
+			raiseError();
+		}
+
+		if (data->stop > 0 && (data->runChrom != data->chrom || b->core.pos + 1 >= data->stop)) {
+			finishBamStrands(data);
+			break;
+		}
+
+		resolveBamStrandsUpTo(data, b->core.pos);
+		addBamStrandsRead(data, b, mask);
+	}
+	return data->queueCount > 0;
+}
+
+static void BamStrandsPop(Multiplexer * multi) {
+	BamStrandsData * data = (BamStrandsData *) multi->data;
+	int track, * depths;
+
+	if (data->queueFirst == data->queueCount && !fillBamStrands(data)) {
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = data->queueChroms[data->queueFirst];
+	multi->start = data->queueStarts[data->queueFirst];
+	multi->finish = data->queueFinishes[data->queueFirst];
+	depths = data->queueDepths + data->queueFirst * data->trackCount;
+	data->queueFirst++;
+
+	multi->inplay_count = 0;
+	for (track = 0; track < multi->count; track++) {
+		multi->values[track] = depths[track];
+		if ((multi->inplay[track] = depths[track] != 0))
+			multi->inplay_count++;
+	}
+	multi->change_count = -1;
+}
+
+static void startBamStrands(BamStrandsData * data) {
+	data->tid = -1;
+	data->finished = false;
+	data->queueFirst = data->queueCount = 0;
+}
+
+static void BamStrandsSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	BamStrandsData * data = (BamStrandsData *) multi->data;
+	int tid;
+
+	if (!data->idx) {
+		fprintf(stderr, "Cannot do a seek on BAM file %s without an index!\n", data->filename);
+		raiseError();
+	}
+	if (data->iter) {
+		bam_iter_destroy(data->iter);
+		data->iter = NULL;
+	}
+
+	data->chrom = chrom;
+	data->start = start;
+	data->stop = finish;
+
+	for (tid = 0; tid < data->header->n_targets; tid++)
+		if (internChromosome(data->header->target_name[tid]) == chrom)
+			break;
+
+	if (tid == data->header->n_targets) {
+		multi->done = true;
+		return;
+	}
+
+	// Reads can only be looked up by 0-based start
+	data->iter = bam_iter_query(data->idx, tid, start > 0 ? start - 1 : 0, finish > 0 ? finish - 1 : 0);
+	startBamStrands(data);
+	multi->done = false;
+	BamStrandsPop(multi);
+}
+
+Multiplexer * BamStrandsMultiplexer(char * filename, int minMapQ, int requiredFlags, int excludedFlags) {
+	BamStrandsData * data = (BamStrandsData *) calloc(1, sizeof(BamStrandsData));
+	data->filename = filename;
+	data->minMapQ = minMapQ;
+	data->requiredFlags = requiredFlags;
+	data->excludedFlags = excludedFlags;
+	data->trackCount = minMapQ > 0 ? 6 : 3;
+	data->capacity = INITIAL_WINDOW;
+	data->diff = (int *) calloc(data->capacity * data->trackCount, sizeof(int));
+	data->depth = (int *) calloc(data->trackCount, sizeof(int));
+	data->runDepth = (int *) calloc(data->trackCount, sizeof(int));
+	data->b = bam_init1();
+
+	if (isCramFilename(filename)) {
+		fprintf(stderr, "CRAM file %s can only be read for its coverage, not per strand\n", filename);
+		raiseError();
+	}
+	if (strcmp(filename, "-"))
+		data->fp = bam_open(filename, "r");
+	else
+		data->fp = bam_dopen(fileno(stdin), "r");
+	if (!data->fp) {
+		fprintf(stderr, "Could not open input file %s\n", filename);
+		raiseError();
+	}
+	data->header = bam_header_read(data->fp);
+	readAheadBamFile(data->fp);
+
+	// The index is only needed for seeks
+	if (strcmp(filename, "-"))
+		data->idx = bam_index_load(filename);
+	if (data->idx && (data->chromOrder = sortChromosomes(data->header->target_name, data->header->n_targets)))
+		data->iter = bam_iter_query(data->idx, data->chromOrder[data->orderIndex++], 0, 1 << 29);
+	startBamStrands(data);
+
+	Multiplexer * res = newCoreMultiplexer(data, data->trackCount, &BamStrandsPop, &BamStrandsSeek);
+	res->finite = true;
+	res->integral = true;
+	popMultiplexer(res);
+	return res;
+}
@@ -62,8 +62,38 @@ typedef struct bamFileReaderData_st {
 	mplp_aux_t * data;
 	int ref_tid;
 	bam_mplp_t iter;
+	// Targets in genome order, NULL if the header already is
+	int * chromOrder;
+	int chromIndex;
 } BamReaderData;
 
+//////////////////////////////////////////////////////
+// Read-ahead
+//////////////////////////////////////////////////////
+
+// Threads inflating the blocks of each BAM file ahead of its reader
+static int bgzfThreads = 0;
+// Blocks read ahead per thread
+static const int BGZF_BLOCKS_PER_THREAD = 8;
+
+void setBgzfThreads(int threads) {
+	if (threads < 0) {
+		fprintf(stderr, "Number of BGZF threads cannot be negative: %i\n", threads);
+		raiseError();
+	}
+	bgzfThreads = threads;
+}
+
+// After the header is read, as checking for the end of the file seeks
+void readAheadBamFile(bamFile file) {
+	if (bgzfThreads > 0)
+		bgzf_mt_read(file, bgzfThreads, bgzfThreads * BGZF_BLOCKS_PER_THREAD);
+}
+
+//////////////////////////////////////////////////////
+// Pileup
+//////////////////////////////////////////////////////
+
 void setSamtoolsDefaultConf(BamReaderData * data) {
 	data->conf = (mplp_conf_t *) calloc(1, sizeof(mplp_conf_t));
 	memset(data->conf, 0, sizeof(mplp_conf_t));
@@ -80,12 +110,38 @@ void setSamtoolsDefaultConf(BamReaderData * data) {
 	data->conf->flag = MPLP_NO_ORPHAN | MPLP_REALN;
 }
 
+// Whole files not in genome order are read one chromosome at a time
+static void queryBamChrom(BamReaderData * data) {
+	data->data->iter = bam_iter_query(data->idx, data->chromOrder[data->chromIndex], 0, 1 << 29);
+}
+
+static bool nextBamChrom(BamReaderData * data) {
+	if (!data->chromOrder || data->conf->reg || ++data->chromIndex == data->data->h->n_targets)
+		return false;
+	bam_mplp_destroy(data->iter);
+	bam_iter_destroy(data->data->iter);
+	queryBamChrom(data);
+	data->iter = bam_mplp_init(1, mplp_func, (void**) &data->data);
+	return true;
+}
+
 static void * downloadBamFile(void * args) {
 	BamReaderData * data = (BamReaderData *) args;
 	int j, tid, cnt, pos, n_plp;
+	int last_tid = -1;
+	char * chrom = NULL;
 	const bam_pileup1_t *plp;
+	// Pending run of equal counts
+	char * run_chrom = NULL;
+	int run_start = 0, run_finish = 0, run_count = 0;
+
+	for (;;) {
+		if (bam_mplp_auto(data->iter, &tid, &pos, &n_plp, &plp) <= 0) {
+			if (nextBamChrom(data))
+				continue;
+			break;
+		}
 
-	while (bam_mplp_auto(data->iter, &tid, &pos, &n_plp, &plp) > 0) {
 		// Count reads in pileup
 		cnt = 0;
 		const bam_pileup1_t *p = plp;
@@ -96,17 +152,34 @@ static void * downloadBamFile(void * args) {
 		}
 
 		// Its a wrap:
-		char * chrom = data->data->h->target_name[tid];
+		if (tid != last_tid) {
+			chrom = internChromosome(data->data->h->target_name[tid]);
+			last_tid = tid;
+		}
 
-		if (data->stop > 0 && (strcmp(chrom, data->chrom) == 0 && pos >= data->stop))
+		if (data->stop > 0 && (chrom == data->chrom && pos >= data->stop))
 			break;
 
 		// +1 to account for 0-based indexing in BAMs:
-		if (pushValuesToBuffer(data->bufferedReaderData, chrom, pos+1, pos+2, cnt))
+		if (chrom == run_chrom && pos+1 == run_finish && cnt == run_count) {
+			run_finish++;
+			continue;
+		}
+		if (run_chrom && pushValuesToBuffer(data->bufferedReaderData, run_chrom, run_start, run_finish, run_count)) {
+			run_chrom = NULL;
 			break;
+		}
+		run_chrom = chrom;
+		run_start = pos+1;
+		run_finish = pos+2;
+		run_count = cnt;
 	}
 
+	if (run_chrom)
+		pushValuesToBuffer(data->bufferedReaderData, run_chrom, run_start, run_finish, run_count);
+
 	bam_iter_destroy(data->data->iter);
+	data->data->iter = NULL;
 	endBufferedSignal(data->bufferedReaderData);
 	return NULL;
 }
@@ -118,10 +191,13 @@ void seekRegion(BamReaderData * data) {
 		// Create BAM iterator at region
 		if (bam_parse_region(data->data->h, data->conf->reg, &tid, &beg, &end) < 0) {
 			fprintf(stderr, "[%s] malformatted region or wrong seqname for input.\n", __func__);
-			exit(1);
+			raiseError();
 		}
 		data->data->iter = bam_iter_query(data->idx, tid, beg, end);
 		data->ref_tid = tid;
+	} else if (data->chromOrder) {
+		data->chromIndex = 0;
+		queryBamChrom(data);
 	} else {
 		// Create general BAM iterator
 		data->data->iter = NULL;
@@ -132,6 +208,7 @@ void seekRegion(BamReaderData * data) {
 }
 
 void OpenBamFile(BamReaderData * data, char * filename) {
+	data->filename = filename;
 	// Allocate space
 	data->data = (mplp_aux_t *) calloc(1, sizeof(mplp_aux_t));
 
@@ -142,13 +219,13 @@ void OpenBamFile(BamReaderData * data, char * filename) {
 		data->data->fp = bam_dopen(fileno(stdin), "r");
 	data->data->conf = data->conf;
 	data->data->h = bam_header_read(data->data->fp);
+	readAheadBamFile(data->data->fp);
 
-	// Load index
-	data->idx = bam_index_load(filename);
-	if (data->idx == 0) {
-		fprintf(stderr, "[%s] fail to load index for input.\n", __func__);
-		exit(1);
-	}
+	// The index is only needed for seeks, streams are read in file order
+	if (strcmp(filename, "-"))
+		data->idx = bam_index_load(filename);
+	if (data->idx)
+		data->chromOrder = sortChromosomes(data->data->h->target_name, data->data->h->n_targets);
 
 	// Start reading
 	data->ref_tid = -1;
@@ -163,7 +240,8 @@ void closeBamFile(BamReaderData * data) {
 	if (data->data->iter) 
 		bam_iter_destroy(data->data->iter);
 	free(data->data); 
-	bam_index_destroy(data->idx);
+	if (data->idx)
+		bam_index_destroy(data->idx);
 }
 
 void BamReaderPop(WiggleIterator * wi) {
@@ -175,11 +253,13 @@ void BamReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finis
 	BamReaderData * data = (BamReaderData *) wi->data;
 	char region[1000];
 
-	if (data->bufferedReaderData) {
-		killBufferedReader(data->bufferedReaderData);
-		free(data->bufferedReaderData);
-		data->bufferedReaderData = NULL;
+	if (!data->idx) {
+		fprintf(stderr, "Cannot do a seek on BAM file %s without an index!\n", data->filename);
+		raiseError();
 	}
+
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
 	data->chrom = chrom;
 	data->stop = finish;
 
@@ -190,9 +270,13 @@ void BamReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finis
 	wi->done = false;
 	BamReaderPop(wi);
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(wi->chrom, chrom) == 0 && wi->finish <= start)))
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(wi->chrom, chrom) == 0 && wi->finish <= start)))
 		BamReaderPop(wi);
 
+	// Runs of equal counts may straddle the start of the region
+	if (!wi->done && wi->chrom == chrom && wi->start < start)
+		wi->start = start;
+
 }
 
 WiggleIterator * BamReader(char * filename, bool holdFire) {
@@ -201,5 +285,8 @@ WiggleIterator * BamReader(char * filename, bool holdFire) {
 	OpenBamFile(data, filename);
 	if (!holdFire)
 		launchBufferedReader(&downloadBamFile, data, &(data->bufferedReaderData));
-	return newWiggleIterator(data, &BamReaderPop, &BamReaderSeek, 0);
+	WiggleIterator * res = newWiggleIterator(data, &BamReaderPop, &BamReaderSeek, 0);
+	res->finite = true;
+	res->integral = true;
+	return res;
 }
@@ -17,6 +17,7 @@
 #include <tabix.h>
 #include "wiggleIterator.h"
 #include "bufferedReader.h"
+#include "vcfReader.h"
 
 #define BUFF_LENGTH 1000
 
@@ -35,6 +36,9 @@ typedef struct bamFileReaderData_st {
 
 	// Gzip file
 	gzFile gz_file;
+
+	// Value for each record, 1 if NULL
+	VcfField * field;
 } BCFReaderData;
 
 static char * nextLine(BCFReaderData * data) {
@@ -48,25 +52,53 @@ static void * downloadTabixFile(void * args) {
 	BCFReaderData * data = (BCFReaderData *) args;
 	char * line;
 	char * last_chrom = "";
+	// With a field, the values of the records at the same position are summed
+	int pending_pos = -1;
+	double pending_value = 0;
 
 	while ((line = nextLine(data))) {
+		double value = 1;
+
 		if (line[0] == '#')
 			continue;
+		if (data->field && !readVcfValue(data->field, line, line + strcspn(line, "\r\n"), &value)) {
+			if (data->tabix_iterator)
+				free(line);
+			continue;
+		}
 
 		char * chrom = strtok(line, "\t");
-		if (strcmp(chrom, last_chrom)) {
-			last_chrom = calloc(strlen(chrom) + 1, sizeof(char));
-			strcpy(last_chrom, chrom);
-		}
 		int pos = atoi(strtok(NULL, "\t"));
+		bool same_chrom = !strcmp(chrom, last_chrom);
+
+		if (data->field && same_chrom && pos == pending_pos) {
+			pending_value += value;
+		} else {
+			if (pending_pos >= 0 && pushValuesToBuffer(data->bufferedReaderData, last_chrom, pending_pos, pending_pos+1, pending_value)) {
+				pending_pos = -1;
+				if (data->tabix_iterator)
+					free(line);
+				break;
+			}
+			if (!same_chrom)
+				last_chrom = internChromosome(chrom);
+			pending_pos = pos;
+			pending_value = value;
+		}
 
 		if (data->tabix_iterator)
 			free(line);
 
-		if (pushValuesToBuffer(data->bufferedReaderData, last_chrom, pos, pos+1, 1))
-			break;
+		if (!data->field) {
+			pending_pos = -1;
+			if (pushValuesToBuffer(data->bufferedReaderData, last_chrom, pos, pos+1, value))
+				break;
+		}
 	}
 
+	if (pending_pos >= 0)
+		pushValuesToBuffer(data->bufferedReaderData, last_chrom, pending_pos, pending_pos+1, pending_value);
+
 	if (data->tabix_iterator) 
 		ti_iter_destroy(data->tabix_iterator);
 
@@ -89,26 +121,39 @@ void BCFReaderPop(WiggleIterator * wi) {
 	BufferedReaderPop(wi, data->bufferedReaderData);
 }
 
+static void BCFReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	BCFReaderData * data = (BCFReaderData *) wi->data;
+	BufferedReaderPopBatch(wi, data->bufferedReaderData, batch);
+}
+
 void BcfReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	BCFReaderData * data = (BCFReaderData *) wi->data;
 
-	killBufferedReader(data->bufferedReaderData);
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
 	data->tabix_iterator = ti_query(data->tabix_file, chrom, start, finish);
 	launchBufferedReader(&downloadTabixFile, data, &(data->bufferedReaderData));
 	wi->done = false;
 	BCFReaderPop(wi);
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && wi->finish <= start))) 
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish <= start))) 
 		BCFReaderPop(wi);
 
 	data->chrom = chrom;
 	data->stop = finish;
 }
 
-WiggleIterator * BcfReader(char * filename, bool holdFire) {
+WiggleIterator * BcfValueReader(char * filename, bool holdFire, VcfField * field) {
 	BCFReaderData * data = (BCFReaderData *) calloc(1, sizeof(BCFReaderData));
+	data->field = field;
 	OpenTabixFile(data, filename);
 	if (!holdFire)
 		launchBufferedReader(&downloadTabixFile, data, &(data->bufferedReaderData));
-	return newWiggleIterator(data, &BCFReaderPop, &BcfReaderSeek, 0);
+	WiggleIterator * new = newWiggleIterator(data, &BCFReaderPop, &BcfReaderSeek, 0);
+	new->popBatch = &BCFReaderPopBatch;
+	return new;
+}
+
+WiggleIterator * BcfReader(char * filename, bool holdFire) {
+	return BcfValueReader(filename, holdFire, NULL);
 }
@@ -16,37 +16,59 @@
 #include <string.h> 
 
 #include "wiggleIterator.h"
+#include "lineReader.h"
+#include "offsetIndex.h"
 
 typedef struct bedReaderData_st {
 	char  *filename;
-	FILE * file;
+	LineReader * reader;
+	bool finished;
 	char * chrom;
 	int stop;
+	// Start of the last record read, before it was clipped to the region
+	int lastStart;
+	// Offsets of a few lines, set on the first seek of a large plain file
+	OffsetIndex * index;
 } BedReaderData;
 
 void BedReaderPop(WiggleIterator * wi) {
 	BedReaderData * data = (BedReaderData *) wi->data;
-	char line[5000];
-	char chrom[1000];
+	char * line, * end;
+	char * chrom;
 	char sign = '.';
-	int start, finish;
+	int start, finish, length;
 
 	if (wi->done)
 		return;
 
-	while (fgets(line, 5000, data->file)) {
-		if (line[0] == '#' || line[0] == EOF)
+	while ((line = readNextLine(data->reader, &end))) {
+		if (line == end || line[0] == '#' || line[0] == EOF)
 			continue;
 
-		sscanf(line, "%s\t%i\t%i", chrom, &start, &finish);
+		length = tokenLength(&line, end);
+		if (strncmp(line, wi->chrom, length) || wi->chrom[length] != '\0')
+			chrom = internChromosomeN(line, length);
+		else
+			chrom = wi->chrom;
+		line += length;
+		parseInteger(&line, end, &start);
+		parseInteger(&line, end, &finish);
+		// Name and score, then the strand if there is one
+		if (line < end) {
+			line += tokenLength(&line, end);
+			line += tokenLength(&line, end);
+			if (tokenLength(&line, end) == 1)
+				sign = *line;
+		}
 		// Conversion from 0 to 1-based...
 		start++;
 		finish++;
 
-		if (strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && start < wi->start)) {
-			fprintf(stderr, "Bed file %s is not sorted!\nPosition %s:%i is before %s:%i\n", data->filename, chrom, start, wi->chrom, wi->start);
-			exit(1);
+		if (compareChroms(chrom, wi->chrom) < 0 || (chrom == wi->chrom && start < data->lastStart)) {
+			fprintf(stderr, "Bed file %s is not sorted!\nPosition %s:%i is before %s:%i\nSort it, or set --sort_memory\n", data->filename, chrom, start, wi->chrom, data->lastStart);
+			raiseError();
 		}
+		data->lastStart = start;
 
 		wi->start = start;
 		wi->finish = finish;
@@ -59,16 +81,10 @@ void BedReaderPop(WiggleIterator * wi) {
 			wi->strand = 0;
 
 
-		// The reason for creating a new string instead of simply 
-		// overwriting is that other functions may still be pointin
-		// at the old label
-		if (wi->chrom[0] == '\0' || strcmp(wi->chrom, chrom)) {
-			wi->chrom = (char *) calloc(strlen(chrom) + 1, sizeof(char));
-			strcpy(wi->chrom, chrom);
-		}
+		wi->chrom = chrom;
 
 		if (data->stop > 0) {
-			if ((wi->start >= data->stop && strcmp(wi->chrom, data->chrom) == 0) || strcmp(wi->chrom, data->chrom) > 0) {
+			if ((wi->start >= data->stop && compareChroms(wi->chrom, data->chrom) == 0) || compareChroms(wi->chrom, data->chrom) > 0) {
 				wi->done = true;
 				return;
 			} else if (wi->finish > data->stop) {
@@ -79,32 +95,80 @@ void BedReaderPop(WiggleIterator * wi) {
 		return;
 	} 
 
-	fclose(data->file);
-	data->file = NULL;
+	data->finished = true;
 	wi->done = true;
 }
 
+// Plain files are indexed on their first seek, see offsetIndex.h
+static void BedReaderIndexLines(OffsetIndex * index, char * lines, char * end) {
+	char * line, * next, * ptr;
+	char * chrom = internChromosome("");
+	int start, finish, length;
+
+	for (line = lines; line < end; line = next + 1) {
+		if (!(next = memchr(line, '\n', end - line)))
+			next = end;
+		if (line == next || line[0] == '#' || line[0] == EOF)
+			continue;
+		ptr = line;
+		length = tokenLength(&ptr, next);
+		if (strncmp(ptr, chrom, length) || chrom[length] != '\0')
+			chrom = internChromosomeN(ptr, length);
+		ptr += length;
+		parseInteger(&ptr, next, &start);
+		parseInteger(&ptr, next, &finish);
+		indexRecord(index, line - lines, chrom, finish + 1, NULL);
+	}
+}
+
+// Moves the reader to the indexed line closest above the region, when it is 
+// behind the reader or too far ahead of it. Returns false if it did not move. 
+static bool BedReaderJump(WiggleIterator * wi, const char * chrom, int start, bool backwards) {
+	BedReaderData * data = (BedReaderData*) wi->data;
+	OffsetIndexEntry * entry;
+	char * lines, * end;
+
+	if (!data->index && (lines = mappedLines(data->reader, &end)))
+		data->index = getOffsetIndex(data->filename, lines, end, &BedReaderIndexLines);
+	if (!data->index || !(entry = findOffsetIndexEntry(data->index, chrom, start)))
+		return false;
+	if (!backwards && entry->offset <= lineReaderOffset(data->reader))
+		return false;
+	return jumpLineReader(data->reader, entry->offset);
+}
+
 void BedReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	BedReaderData * data = (BedReaderData*) wi->data;
+	bool backwards = data->finished || compareChroms(chrom, wi->chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && start < wi->start);
+	bool restart = false;
 
 	data->stop = finish;
 	data->chrom = chrom;
 
-	if (!data->file || strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && start < wi->start)) {
-		if (data->file)
-			fclose(data->file);
-		if (!(data->file = fopen(data->filename, "r"))) {
-			fprintf(stderr, "Could not open input file %s\n", data->filename);
-			exit(1);
+	if (seekLineReader(data->reader, chrom, start, finish))
+		restart = true;
+	else if (BedReaderJump(wi, chrom, start, backwards))
+		restart = true;
+	else if (backwards) {
+		if (!rewindLineReader(data->reader)) {
+			fprintf(stderr, "Cannot rewind input file %s\n", data->filename);
+			raiseError();
 		}
+		restart = true;
+	}
+
+	if (restart) {
+		data->finished = false;
+		wi->chrom = internChromosome("");
+		wi->start = 0;
 		wi->done = false;
 		pop(wi);
 	}
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && wi->finish < start))) 
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish < start))) 
 		pop(wi);
 
-	if (!wi->done && strcmp(chrom, wi->chrom) == 0 && wi->start < start)
+	if (!wi->done && compareChroms(chrom, wi->chrom) == 0 && wi->start < start)
 		wi->start = start;
 }
 
@@ -112,11 +176,14 @@ WiggleIterator * BedReader(char * filename) {
 	BedReaderData * data = (BedReaderData *) calloc(1, sizeof(BedReaderData));
 	data->filename = filename;
 	data->stop = -1;
-	if (!(data->file = fopen(filename, "r"))) {
+	if (!(data->reader = sortingLines() ? newSortingLineReader(filename, 0, 1) : newLineReader(filename))) {
 		fprintf(stderr, "Could not open bed file %s\n", filename);
-		exit(1);
+		raiseError();
 	}
 	WiggleIterator * res = newWiggleIterator(data, &BedReaderPop, &BedReaderSeek, 0);
 	res->overlaps = true;
+	res->finite = true;
+	res->integral = true;
+	res->seekCost = readerSeekCost(filename, lineReaderJumps(data->reader));
 	return res;
 }
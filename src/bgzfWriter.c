@@ -0,0 +1,491 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BGZF compressed text outputs, with their tabix index built on the fly.
+//
+// The text goes through the samtools BGZF library, which compresses it
+// on worker threads. While it is written, each BedGraph line is binned
+// as tabix does, keeping track of its offset in the uncompressed stream.
+// Once the file is closed, the block headers are scanned to map these
+// offsets onto the virtual file offsets stored in the index.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "bgzf.h"
+#include "bgzfWriter.h"
+#include "bigWigWriter.h"
+
+// Same parameters as tabix
+#define LINEAR_SHIFT 14
+// BED conventions: 0-based half open, columns 1, 2 and 3, comments start with #
+static const int32_t TABIX_CONF[6] = {0x10000, 1, 2, 3, '#', 0};
+// Blocks queued per compression thread
+#define BLOCKS_PER_THREAD 64
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+bool isBgzfFilename(const char * filename) {
+	size_t length = strlen(filename);
+	return length > 3 && !strcmp(filename + length - 3, ".gz");
+}
+
+//////////////////////////////////////////////////////
+// Data structures
+//////////////////////////////////////////////////////
+
+// Offsets are counted in the uncompressed stream, until the index is written
+typedef struct indexChunk_st {
+	uint32_t bin;
+	long long begin, end;
+} IndexChunk;
+
+typedef struct indexedChrom_st {
+	char * name;
+	IndexChunk * chunks;
+	int chunkCount, maxChunks;
+	long long * linear;
+	int linearCount, maxLinear;
+} IndexedChrom;
+
+struct bgzfWriter_st {
+	char * filename;
+	BGZF * bgzf;
+	bool index;
+	bool finished;
+	// Uncompressed bytes written so far
+	long long offset;
+
+	// Incomplete line, waiting for its end
+	char * line;
+	size_t lineLength, maxLine;
+
+	// Tabix index
+	IndexedChrom * chroms;
+	int chromCount, maxChroms;
+	int lastStart;
+	uint32_t lastBin;
+	long long binBegin;
+
+	// Compressed blocks scanned so far: uncompressed and compressed start offsets
+	long long * blockOffsets;
+	long long * blockAddresses;
+	int blockCount, maxBlocks;
+	long long scannedOffset, scannedAddress;
+};
+
+//////////////////////////////////////////////////////
+// Index construction
+//////////////////////////////////////////////////////
+
+static uint32_t regionToBin(uint32_t start, uint32_t end) {
+	--end;
+	if (start>>14 == end>>14) return 4681 + (start>>14);
+	if (start>>17 == end>>17) return  585 + (start>>17);
+	if (start>>20 == end>>20) return   73 + (start>>20);
+	if (start>>23 == end>>23) return    9 + (start>>23);
+	if (start>>26 == end>>26) return    1 + (start>>26);
+	return 0;
+}
+
+static void addChunk(IndexedChrom * chrom, uint32_t bin, long long begin, long long end) {
+	if (chrom->chunkCount == chrom->maxChunks) {
+		chrom->maxChunks = chrom->maxChunks ? 2 * chrom->maxChunks : 64;
+		chrom->chunks = (IndexChunk *) realloc(chrom->chunks, chrom->maxChunks * sizeof(IndexChunk));
+	}
+	chrom->chunks[chrom->chunkCount].bin = bin;
+	chrom->chunks[chrom->chunkCount].begin = begin;
+	chrom->chunks[chrom->chunkCount].end = end;
+	chrom->chunkCount++;
+}
+
+// First line overlapping each 16kb window, -1 if none so far
+static void addToLinearIndex(IndexedChrom * chrom, int start, int end, long long offset) {
+	int first = start >> LINEAR_SHIFT;
+	int last = (end - 1) >> LINEAR_SHIFT;
+	int window;
+
+	if (last >= chrom->maxLinear) {
+		int max = chrom->maxLinear ? chrom->maxLinear : 64;
+		while (last >= max)
+			max *= 2;
+		chrom->linear = (long long *) realloc(chrom->linear, max * sizeof(long long));
+		for (window = chrom->maxLinear; window < max; window++)
+			chrom->linear[window] = -1;
+		chrom->maxLinear = max;
+	}
+	for (window = first; window <= last; window++)
+		if (chrom->linear[window] < 0)
+			chrom->linear[window] = offset;
+	if (chrom->linearCount <= last)
+		chrom->linearCount = last + 1;
+}
+
+static void closeChunk(BgzfWriter * writer, long long end) {
+	if (writer->chromCount && writer->lastBin != UINT32_MAX)
+		addChunk(writer->chroms + writer->chromCount - 1, writer->lastBin, writer->binBegin, end);
+	writer->lastBin = UINT32_MAX;
+}
+
+static void addChrom(BgzfWriter * writer, const char * name, size_t length, long long begin) {
+	int i;
+
+	for (i = 0; i < writer->chromCount; i++) {
+		if (strlen(writer->chroms[i].name) == length && !strncmp(writer->chroms[i].name, name, length)) {
+			fprintf(stderr, "Cannot index %s: chromosome %s appears twice, the data is not sorted\n", writer->filename, writer->chroms[i].name);
+			raiseError();
+		}
+	}
+
+	closeChunk(writer, begin);
+	if (writer->chromCount == writer->maxChroms) {
+		writer->maxChroms = writer->maxChroms ? 2 * writer->maxChroms : 64;
+		writer->chroms = (IndexedChrom *) realloc(writer->chroms, writer->maxChroms * sizeof(IndexedChrom));
+	}
+	memset(writer->chroms + writer->chromCount, 0, sizeof(IndexedChrom));
+	writer->chroms[writer->chromCount].name = strndup(name, length);
+	writer->chromCount++;
+	writer->lastStart = 0;
+}
+
+// Reads a decimal integer up to the next tab or end of line
+static bool parseColumn(const char ** ptr, const char * end, int * value) {
+	const char * c = *ptr;
+	*value = 0;
+	if (c == end || *c < '0' || *c > '9')
+		return false;
+	for (; c < end && *c >= '0' && *c <= '9'; c++)
+		*value = *value * 10 + (*c - '0');
+	*ptr = c;
+	return true;
+}
+
+// Mirrors the index construction in tabix
+static void indexLine(BgzfWriter * writer, const char * line, size_t length, long long begin) {
+	const char * end = line + length;
+	const char * tab = memchr(line, '\t', length);
+	const char * ptr;
+	int start, finish;
+	uint32_t bin;
+	IndexedChrom * chrom;
+
+	if (!tab || line[0] == '#')
+		return;
+	ptr = tab + 1;
+	if (!parseColumn(&ptr, end, &start) || ptr == end || *(ptr++) != '\t' || !parseColumn(&ptr, end, &finish))
+		return;
+	if (finish <= start)
+		finish = start + 1;
+
+	chrom = writer->chromCount ? writer->chroms + writer->chromCount - 1 : NULL;
+	if (!chrom || strlen(chrom->name) != tab - line || strncmp(chrom->name, line, tab - line)) {
+		addChrom(writer, line, tab - line, begin);
+		chrom = writer->chroms + writer->chromCount - 1;
+	} else if (start < writer->lastStart) {
+		fprintf(stderr, "Cannot index %s: %s:%i is before %s:%i, the data is not sorted\n", writer->filename, chrom->name, start, chrom->name, writer->lastStart);
+		raiseError();
+	}
+
+	addToLinearIndex(chrom, start, finish, begin);
+	bin = regionToBin(start, finish);
+	if (bin != writer->lastBin) {
+		closeChunk(writer, begin);
+		writer->binBegin = begin;
+		writer->lastBin = bin;
+	}
+	writer->lastStart = start;
+}
+
+static void indexText(BgzfWriter * writer, const char * data, size_t length) {
+	const char * end = data + length;
+	long long offset = writer->offset;
+
+	while (data < end) {
+		const char * newline = memchr(data, '\n', end - data);
+		size_t piece = newline ? newline - data : end - data;
+
+		if (!newline || writer->lineLength) {
+			// Line split across writes
+			if (writer->lineLength + piece > writer->maxLine) {
+				writer->maxLine = 2 * (writer->lineLength + piece);
+				writer->line = (char *) realloc(writer->line, writer->maxLine);
+			}
+			memcpy(writer->line + writer->lineLength, data, piece);
+			writer->lineLength += piece;
+			if (newline) {
+				indexLine(writer, writer->line, writer->lineLength, offset - (writer->lineLength - piece));
+				writer->lineLength = 0;
+			}
+		} else
+			indexLine(writer, data, piece, offset);
+
+		if (!newline)
+			break;
+		offset += piece + 1;
+		data = newline + 1;
+	}
+}
+
+//////////////////////////////////////////////////////
+// Virtual offsets
+//////////////////////////////////////////////////////
+
+static void addBlock(BgzfWriter * writer, long long offset, long long address) {
+	if (writer->blockCount == writer->maxBlocks) {
+		writer->maxBlocks = writer->maxBlocks ? 2 * writer->maxBlocks : 1024;
+		writer->blockOffsets = (long long *) realloc(writer->blockOffsets, writer->maxBlocks * sizeof(long long));
+		writer->blockAddresses = (long long *) realloc(writer->blockAddresses, writer->maxBlocks * sizeof(long long));
+	}
+	writer->blockOffsets[writer->blockCount] = offset;
+	writer->blockAddresses[writer->blockCount] = address;
+	writer->blockCount++;
+}
+
+static unsigned int readLittleEndian(unsigned char * bytes, int count) {
+	unsigned int value = 0;
+	int i;
+	for (i = count - 1; i >= 0; i--)
+		value = value << 8 | bytes[i];
+	return value;
+}
+
+// Reads the headers and footers of the blocks written since the last scan.
+// The scan stops at the empty block which marks the end of the file, so that
+// it can be overwritten if the file is reopened.
+static void scanBlocks(BgzfWriter * writer) {
+	FILE * file = fopen(writer->filename, "r");
+	unsigned char header[BGZF_HEADER_SIZE];
+	unsigned char footer[BGZF_FOOTER_SIZE];
+
+	if (!file || fseeko(file, writer->scannedAddress, SEEK_SET)) {
+		fprintf(stderr, "Could not read back BGZF file %s\n", writer->filename);
+		raiseError();
+	}
+
+	while (fread(header, 1, BGZF_HEADER_SIZE, file) == BGZF_HEADER_SIZE) {
+		long long size = readLittleEndian(header + 16, 2) + 1;
+		long long length;
+		if (fseeko(file, size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE, SEEK_CUR) || fread(footer, 1, BGZF_FOOTER_SIZE, file) != BGZF_FOOTER_SIZE) {
+			fprintf(stderr, "Truncated BGZF block in %s\n", writer->filename);
+			raiseError();
+		}
+		length = readLittleEndian(footer + 4, 4);
+		if (length == 0)
+			break;
+		addBlock(writer, writer->scannedOffset, writer->scannedAddress);
+		writer->scannedOffset += length;
+		writer->scannedAddress += size;
+	}
+	fclose(file);
+
+	if (writer->scannedOffset != writer->offset) {
+		fprintf(stderr, "Inconsistent BGZF file %s: %lli bytes written, %lli found\n", writer->filename, writer->offset, writer->scannedOffset);
+		raiseError();
+	}
+}
+
+static uint64_t virtualOffset(BgzfWriter * writer, long long offset) {
+	int low = 0, high = writer->blockCount;
+
+	if (offset >= writer->scannedOffset)
+		return (uint64_t) writer->scannedAddress << 16;
+
+	// Last block starting at or before offset
+	while (high - low > 1) {
+		int middle = (low + high) / 2;
+		if (writer->blockOffsets[middle] <= offset)
+			low = middle;
+		else
+			high = middle;
+	}
+	return (uint64_t) writer->blockAddresses[low] << 16 | (offset - writer->blockOffsets[low]);
+}
+
+//////////////////////////////////////////////////////
+// Index output
+//////////////////////////////////////////////////////
+
+static int compareChunks(const void * A, const void * B) {
+	const IndexChunk * a = (const IndexChunk *) A;
+	const IndexChunk * b = (const IndexChunk *) B;
+	if (a->bin != b->bin)
+		return a->bin < b->bin ? -1 : 1;
+	if (a->begin != b->begin)
+		return a->begin < b->begin ? -1 : 1;
+	return 0;
+}
+
+static void writeIndexBytes(BGZF * index, const void * data, size_t length) {
+	if (bgzf_write(index, data, length) != length) {
+		fprintf(stderr, "Could not write tabix index\n");
+		raiseError();
+	}
+}
+
+static void writeInt32(BGZF * index, int32_t value) {
+	writeIndexBytes(index, &value, sizeof(value));
+}
+
+static void writeUInt64(BGZF * index, uint64_t value) {
+	writeIndexBytes(index, &value, sizeof(value));
+}
+
+// Converts the chunks of a bin to virtual offsets, merging those which touch the same block
+static int collectBinChunks(BgzfWriter * writer, IndexChunk * chunks, int count, uint64_t * pairs) {
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		uint64_t begin = virtualOffset(writer, chunks[i].begin);
+		uint64_t end = virtualOffset(writer, chunks[i].end);
+		if (n && pairs[2 * n - 1] >> 16 == begin >> 16)
+			pairs[2 * n - 1] = end;
+		else {
+			pairs[2 * n] = begin;
+			pairs[2 * n + 1] = end;
+			n++;
+		}
+	}
+	return n;
+}
+
+static void writeChromIndex(BgzfWriter * writer, BGZF * index, IndexedChrom * chrom) {
+	int i, j, binCount = 0;
+	uint64_t * pairs = (uint64_t *) calloc(2 * chrom->chunkCount + 2, sizeof(uint64_t));
+	long long previous = 0;
+
+	qsort(chrom->chunks, chrom->chunkCount, sizeof(IndexChunk), compareChunks);
+	for (i = 0; i < chrom->chunkCount; i++)
+		if (i == 0 || chrom->chunks[i].bin != chrom->chunks[i-1].bin)
+			binCount++;
+
+	// Binning index
+	writeInt32(index, binCount);
+	for (i = 0; i < chrom->chunkCount; i = j) {
+		int n;
+		for (j = i; j < chrom->chunkCount && chrom->chunks[j].bin == chrom->chunks[i].bin; j++);
+		n = collectBinChunks(writer, chrom->chunks + i, j - i, pairs);
+		writeIndexBytes(index, &chrom->chunks[i].bin, sizeof(uint32_t));
+		writeInt32(index, n);
+		writeIndexBytes(index, pairs, 2 * n * sizeof(uint64_t));
+	}
+
+	// Linear index, empty windows point to the previous line
+	writeInt32(index, chrom->linearCount);
+	for (i = 0; i < chrom->linearCount; i++) {
+		if (chrom->linear[i] >= 0)
+			previous = chrom->linear[i];
+		writeUInt64(index, virtualOffset(writer, previous));
+	}
+
+	free(pairs);
+}
+
+static void writeTabixIndex(BgzfWriter * writer) {
+	char * filename = (char *) malloc(strlen(writer->filename) + 5);
+	BGZF * index;
+	int32_t namesLength = 0;
+	int i;
+
+	sprintf(filename, "%s.tbi", writer->filename);
+	if (!(index = bgzf_open(filename, "w"))) {
+		fprintf(stderr, "Could not open tabix index %s\n", filename);
+		raiseError();
+	}
+
+	writeIndexBytes(index, "TBI\1", 4);
+	writeInt32(index, writer->chromCount);
+	writeIndexBytes(index, TABIX_CONF, sizeof(TABIX_CONF));
+	for (i = 0; i < writer->chromCount; i++)
+		namesLength += strlen(writer->chroms[i].name) + 1;
+	writeInt32(index, namesLength);
+	for (i = 0; i < writer->chromCount; i++)
+		writeIndexBytes(index, writer->chroms[i].name, strlen(writer->chroms[i].name) + 1);
+	for (i = 0; i < writer->chromCount; i++)
+		writeChromIndex(writer, index, writer->chroms + i);
+
+	if (bgzf_close(index)) {
+		fprintf(stderr, "Could not write tabix index %s\n", filename);
+		raiseError();
+	}
+	free(filename);
+}
+
+//////////////////////////////////////////////////////
+// Writer
+//////////////////////////////////////////////////////
+
+static void attachFile(BgzfWriter * writer, FILE * file) {
+	int threads = getCompressionThreads();
+	int fd = dup(fileno(file));
+
+	fclose(file);
+	if (fd < 0 || !(writer->bgzf = bgzf_dopen(fd, "w"))) {
+		fprintf(stderr, "Could not open output file %s\n", writer->filename);
+		raiseError();
+	}
+	if (threads > 1)
+		bgzf_mt(writer->bgzf, threads, BLOCKS_PER_THREAD);
+}
+
+BgzfWriter * openBgzfWriter(FILE * file, char * filename, bool index) {
+	BgzfWriter * writer = (BgzfWriter *) calloc(1, sizeof(BgzfWriter));
+	writer->filename = filename;
+	writer->index = index;
+	writer->lastBin = UINT32_MAX;
+	attachFile(writer, file);
+	return writer;
+}
+
+// Overwrites the end of file marker
+static void reopenBgzfWriter(BgzfWriter * writer) {
+	FILE * file = fopen(writer->filename, "r+");
+	if (!file || ftruncate(fileno(file), writer->scannedAddress) || fseeko(file, 0, SEEK_END)) {
+		fprintf(stderr, "Could not reopen output file %s\n", writer->filename);
+		raiseError();
+	}
+	attachFile(writer, file);
+	writer->finished = false;
+}
+
+void writeBgzf(BgzfWriter * writer, const char * data, size_t length) {
+	if (writer->finished)
+		reopenBgzfWriter(writer);
+	if (bgzf_write(writer->bgzf, data, length) != length) {
+		fprintf(stderr, "Could not write to output file %s\n", writer->filename);
+		raiseError();
+	}
+	if (writer->index)
+		indexText(writer, data, length);
+	writer->offset += length;
+}
+
+void finishBgzfWriter(BgzfWriter * writer) {
+	if (writer->finished)
+		return;
+
+	if (bgzf_close(writer->bgzf)) {
+		fprintf(stderr, "Could not write to output file %s\n", writer->filename);
+		raiseError();
+	}
+	writer->bgzf = NULL;
+	writer->finished = true;
+
+	scanBlocks(writer);
+	if (writer->index && writer->chromCount) {
+		closeChunk(writer, writer->offset);
+		writeTabixIndex(writer);
+	}
+}
@@ -0,0 +1,33 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BGZF_WRITER_H_
+#define _BGZF_WRITER_H_
+
+#include <stdio.h>
+#include "wiggletools.h"
+
+typedef struct bgzfWriter_st BgzfWriter;
+
+// Takes over the file, which must have been opened under filename.
+// If index is set, the text is parsed as BedGraph lines and a tabix
+// index is written next to the file, as filename.tbi
+BgzfWriter * openBgzfWriter(FILE * file, char * filename, bool index);
+void writeBgzf(BgzfWriter * writer, const char * data, size_t length);
+// Closes the file and writes the index. Writing afterwards reopens the file.
+void finishBgzfWriter(BgzfWriter * writer);
+
+bool isBgzfFilename(const char * filename);
+
+#endif
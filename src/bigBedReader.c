@@ -12,10 +12,56 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <math.h>
+#include <string.h>
+
 #include "bigFileReader.h"
+#include "asyncReads.h"
+
+// The rest of a BigBed record holds the columns after the coordinates, 
+// separated by tabs: name, score, strand... They are only scanned up to 
+// the strand, and the score is only parsed when it is the value.
+static char * readBedRestFields(char * rest, bool readScore, double * value, int * strand) {
+	char * ptr = rest;
+	char * scoreEnd;
+
+	*value = 1;
+	*strand = 0;
+
+	// Name
+	while (*ptr && *ptr != '\t')
+		ptr++;
+	if (*ptr)
+		ptr++;
+
+	// Score
+	if (readScore) {
+		*value = strtod(ptr, &scoreEnd);
+		if (scoreEnd == ptr)
+			*value = NAN;
+		ptr = scoreEnd;
+	}
+	while (*ptr && *ptr != '\t')
+		ptr++;
+	if (*ptr)
+		ptr++;
+
+	// Strand
+	if (ptr[0] && (ptr[1] == '\t' || ptr[1] == '\0')) {
+		if (ptr[0] == '+')
+			*strand = 1;
+		else if (ptr[0] == '-')
+			*strand = -1;
+	}
+
+	// Skip the remaining columns
+	return ptr + strlen(ptr) + 1;
+}
 
 bool readBigBedBuffer(BigFileReaderData * data) {
 	char *blockPt;
+	double value;
+	int strand;
 
 	/* Read next record into local variables. */
 	for (blockPt = data->uncompressBuf; blockPt != data->blockEnd; ) {
@@ -23,10 +69,7 @@ bool readBigBedBuffer(BigFileReaderData * data) {
 		int start = memReadBits32(&blockPt, data->isSwapped) + 1;
 		int finish = memReadBits32(&blockPt, data->isSwapped) + 1; 
 
-		// Skip boring stuff...
-		for (;;)
-			if (*(blockPt++) <= 0)
-				break;
+		blockPt = readBedRestFields(blockPt, data->readScore, &value, &strand);
 
 		if (data->stop > 0) {
 			if (start >= data->stop)
@@ -34,7 +77,31 @@ bool readBigBedBuffer(BigFileReaderData * data) {
 			else if (finish > data->stop)
 				finish = data->stop;
 		}
-		if (pushValuesToBuffer(data->bufferedReaderData, data->chrom, start, finish, 1))
+		if (pushBigFileRecord(data, start, finish, value, strand))
+			return true;
+	}
+
+	return false;
+}
+
+// Only the coordinates of each record are decoded, the rest is skipped in a
+// single scan, and all records are unstranded with value 1
+static bool readBigBedCoordinates(BigFileReaderData * data) {
+	char *blockPt;
+
+	for (blockPt = data->uncompressBuf; blockPt != data->blockEnd; ) {
+		memReadBits32(&blockPt, data->isSwapped);	// Read and discard chromId
+		int start = memReadBits32(&blockPt, data->isSwapped) + 1;
+		int finish = memReadBits32(&blockPt, data->isSwapped) + 1; 
+		blockPt += strlen(blockPt) + 1;
+
+		if (data->stop > 0) {
+			if (start >= data->stop)
+				return true;
+			else if (finish > data->stop)
+				finish = data->stop;
+		}
+		if (pushBigFileRecord(data, start, finish, 1, 0))
 			return true;
 	}
 
@@ -42,21 +109,41 @@ bool readBigBedBuffer(BigFileReaderData * data) {
 }
 
 void openBigBedFile(BigFileReaderData * data, char * filename, bool holdFire) {
-	data->filename = filename;
-	data->bwf = bigBedFileOpen(data->filename);
-	data->isSwapped = data->bwf->isSwapped;
-	bbiAttachUnzoomedCir(data->bwf);
-	data->udc = data->bwf->udc;
-	data->readBuffer = &readBigBedBuffer;
-	data->uncompressBuf = (char *) needLargeMem(data->bwf->uncompressBufSize);
+	openBigFileReaderData(data, filename, true);
+	data->readBuffer = data->coordinatesOnly ? &readBigBedCoordinates : &readBigBedBuffer;
 	if (!holdFire)
 		launchBufferedReader(&downloadBigFile, data, &(data->bufferedReaderData));
 }
 
-WiggleIterator * BigBedReader(char * f, bool holdFire) {
+static void BigBedCoordinatesPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data;
+	BufferedReaderPopBatch(wi, data->bufferedReaderData, batch);
+}
+
+static WiggleIterator * newBigBedReader(char * f, bool holdFire, bool readScore, bool coordinatesOnly) {
 	BigFileReaderData * data = (BigFileReaderData *) calloc(1, sizeof(BigFileReaderData));
+	data->readScore = readScore;
+	data->coordinatesOnly = coordinatesOnly;
 	openBigBedFile(data, f, holdFire);
 	WiggleIterator * res = newWiggleIterator(data, &BigFileReaderPop, &BigFileReaderSeek, 0);
 	res->overlaps = true;
+	res->seekRegions = &BigFileReaderSeekRegions;
+	res->seekReverse = &BigFileReaderSeekReverse;
+	res->seekCost = readerSeekCost(f, true);
+	// Batches drop the strands, which these records do not have
+	if (coordinatesOnly)
+		res->popBatch = &BigBedCoordinatesPopBatch;
 	return res;
 }	
+
+WiggleIterator * BigBedReader(char * f, bool holdFire) {
+	return newBigBedReader(f, holdFire, false, false);
+}
+
+WiggleIterator * BigBedScoreReader(char * f, bool holdFire) {
+	return newBigBedReader(f, holdFire, true, false);
+}
+
+WiggleIterator * BigBedCoordinatesReader(char * f, bool holdFire) {
+	return newBigBedReader(f, holdFire, false, true);
+}
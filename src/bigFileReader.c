@@ -12,10 +12,254 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include "bigFileReader.h"
 #include "bufferedReader.h"
+#include "cirTree.h"
+#include "blockCache.h"
+#include "memoryUsage.h"
+#include "asyncReads.h"
+#include "objectStore.h"
+#include "tracer.h"
 
 static int MAX_BLOCKS = 100;
+// Number of threads inflating blocks on behalf of the downloaders, 0 to inflate in place
+static int DECOMPRESSION_THREADS = 0;
+// Gaps between blocks of remote files read through rather than requested separately
+static int READ_AHEAD = 65536;
+
+void setMaxBlocks(int value) {
+	if (value < 1) {
+		fprintf(stderr, "Maximum number of blocks must be positive: %i\n", value);
+		raiseError();
+	}
+	MAX_BLOCKS = value;
+}
+
+void setDecompressionThreads(int value) {
+	if (value < 0) {
+		fprintf(stderr, "Number of decompression threads cannot be negative: %i\n", value);
+		raiseError();
+	}
+	DECOMPRESSION_THREADS = value;
+}
+
+void setReadAhead(int value) {
+	if (value < 0) {
+		fprintf(stderr, "Read ahead cannot be negative: %i\n", value);
+		raiseError();
+	}
+	READ_AHEAD = value;
+}
+
+//////////////////////////////////////////////////////
+// Decompression pool
+//////////////////////////////////////////////////////
+
+// A run of blocks handed to the pool. Jobs are claimed in order by
+// the workers and by the downloader itself, which then consumes the 
+// inflated blocks in order.
+typedef struct inflateRun_st {
+	struct fileOffsetSize * firstBlock;
+	char ** inputs;
+	char * outputs;
+	size_t outputSize;
+	int * sizes;
+	int count;
+	// Protected by the pool mutex
+	int claimed;
+	struct inflateRun_st * next;
+	// Protected by the run mutex
+	bool * inflated;
+	int completed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} InflateRun;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+static InflateRun * poolQueue = NULL, * poolQueueTail = NULL;
+static int poolThreads = 0;
+
+static void inflateJob(InflateRun * run, int index) {
+	run->sizes[index] = zUncompress(run->inputs[index], run->sizes[index], run->outputs + index * run->outputSize, run->outputSize);
+
+	pthread_mutex_lock(&run->mutex);
+	run->inflated[index] = true;
+	run->completed++;
+	pthread_cond_broadcast(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+}
+
+// Must be called with the pool mutex held
+static void unqueueRun(InflateRun * run) {
+	InflateRun * prev = NULL, * ptr;
+
+	for (ptr = poolQueue; ptr && ptr != run; ptr = ptr->next)
+		prev = ptr;
+	if (ptr == NULL)
+		return;
+	if (prev)
+		prev->next = run->next;
+	else
+		poolQueue = run->next;
+	if (poolQueueTail == run)
+		poolQueueTail = prev;
+}
+
+// Must be called with the pool mutex held. Returns -1 if all jobs were claimed
+static int claimJob(InflateRun * run) {
+	if (run->claimed == run->count)
+		return -1;
+
+	int index = run->claimed++;
+	// Only runs with unclaimed jobs stay in the queue
+	if (run->claimed == run->count)
+		unqueueRun(run);
+	return index;
+}
+
+static void * inflateWorker(void * args) {
+	nameTraceThread("inflate");
+	for (;;) {
+		pthread_mutex_lock(&poolMutex);
+		while (poolQueue == NULL)
+			pthread_cond_wait(&poolCond, &poolMutex);
+		InflateRun * run = poolQueue;
+		int index = claimJob(run);
+		pthread_mutex_unlock(&poolMutex);
+
+		double start = traceClock();
+		inflateJob(run, index);
+		traceSpan("inflate", start);
+	}
+	return NULL;
+}
+
+static void startInflateWorkers() {
+	pthread_mutex_lock(&poolMutex);
+	while (poolThreads < DECOMPRESSION_THREADS) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, &inflateWorker, NULL);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			abort();
+		}
+		pthread_detach(thread);
+		poolThreads++;
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+static void submitRun(InflateRun * run) {
+	pthread_mutex_lock(&poolMutex);
+	run->next = NULL;
+	if (poolQueueTail)
+		poolQueueTail->next = run;
+	else
+		poolQueue = run;
+	poolQueueTail = run;
+	pthread_cond_broadcast(&poolCond);
+	pthread_mutex_unlock(&poolMutex);
+}
+
+// Withdraws the unclaimed jobs of a run, e.g. when the reader is killed
+static void withdrawRun(InflateRun * run) {
+	pthread_mutex_lock(&poolMutex);
+	unqueueRun(run);
+	int claimed = run->claimed;
+	run->claimed = run->count;
+	pthread_mutex_unlock(&poolMutex);
+
+	pthread_mutex_lock(&run->mutex);
+	while (run->completed < claimed)
+		pthread_cond_wait(&run->cond, &run->mutex);
+	pthread_mutex_unlock(&run->mutex);
+}
+
+static void waitForJob(InflateRun * run, int index) {
+	for (;;) {
+		pthread_mutex_lock(&run->mutex);
+		bool inflated = run->inflated[index];
+		pthread_mutex_unlock(&run->mutex);
+		if (inflated)
+			return;
+
+		// Lend a hand rather than wait idly
+		pthread_mutex_lock(&poolMutex);
+		int job = claimJob(run);
+		pthread_mutex_unlock(&poolMutex);
+		if (job >= 0) {
+			inflateJob(run, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&run->mutex);
+		while (!run->inflated[index])
+			pthread_cond_wait(&run->cond, &run->mutex);
+		pthread_mutex_unlock(&run->mutex);
+		return;
+	}
+}
+
+static bool inflateBlockRun(BigFileReaderData * data, struct fileOffsetSize * firstBlock, struct fileOffsetSize * afterBlock, char * mergedBuf) {
+	InflateRun run;
+	struct fileOffsetSize * block;
+	char * uncompressBuf = data->uncompressBuf;
+	bool killed = false;
+	int index;
+
+	memset(&run, 0, sizeof(InflateRun));
+	for (block = firstBlock; block != afterBlock; block = block->next)
+		run.count++;
+	run.firstBlock = firstBlock;
+	run.outputSize = data->bwf->uncompressBufSize;
+	run.inputs = (char **) calloc(run.count, sizeof(char *));
+	run.sizes = (int *) calloc(run.count, sizeof(int));
+	run.inflated = (bool *) calloc(run.count, sizeof(bool));
+	run.outputs = (char *) needLargeMem(run.count * run.outputSize);
+	countMemory(MEMORY_READERS, run.count * (long long) run.outputSize);
+	pthread_mutex_init(&run.mutex, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	for (block = firstBlock, index = 0; block != afterBlock; block = block->next, index++) {
+		run.inputs[index] = mergedBuf + (block->offset - firstBlock->offset);
+		run.sizes[index] = block->size;
+	}
+
+	startInflateWorkers();
+	submitRun(&run);
+
+	for (index = 0; index < run.count; index++) {
+		waitForJob(&run, index);
+		data->uncompressBuf = run.outputs + index * run.outputSize;
+		data->blockEnd = data->uncompressBuf + run.sizes[index];
+		// Callback to specialised BigBed or BigWig function
+		if (data->readBuffer(data)) {
+			killed = true;
+			break;
+		}
+	}
+
+	withdrawRun(&run);
+	data->uncompressBuf = uncompressBuf;
+	pthread_mutex_destroy(&run.mutex);
+	pthread_cond_destroy(&run.cond);
+	freeMem(run.outputs);
+	countMemory(MEMORY_READERS, -run.count * (long long) run.outputSize);
+	free(run.inputs);
+	free(run.sizes);
+	free(run.inflated);
+	return killed;
+}
+
+//////////////////////////////////////////////////////
+// Downloader
+//////////////////////////////////////////////////////
+
+static bool pushReversedBlock(BigFileReaderData * data);
 
 static bool openBlock(BigFileReaderData * data, struct fileOffsetSize * block, char * blockBuf) {
 	size_t uncompressBufSize = data->bwf->uncompressBufSize;
@@ -28,58 +272,151 @@ static bool openBlock(BigFileReaderData * data, struct fileOffsetSize * block, c
 		data->blockEnd = blockBuf + block->size;
 	}
 
-	// Callback to specialised BigBed or BigWig function
+	// Callback to specialised BigBed or BigWig function, which only stops
+	// early in a reversed block once past the end of the region
+	if (data->reverse) {
+		data->readBuffer(data);
+		return pushReversedBlock(data);
+	}
 	return data->readBuffer(data);
 }
 
+// Remote runs are split into ranges of at least this many bytes, fetched concurrently
+#define MIN_RANGE_SIZE (256 * 1024)
+
+static bool isRemoteFile(BigFileReaderData * data) {
+	return strstr(data->filename, "://") != NULL;
+}
+
+// Cuts the blocks in [firstBlock, lastBlock] into ranges of similar sizes, 
+// at block starts. Returns the number of ranges, 0 if not worth splitting.
+static int splitBlockRun(struct fileOffsetSize * firstBlock, struct fileOffsetSize * lastBlock, char * mergedBuf, bits64 mergedOffset, RangeRequest ** ranges) {
+	struct fileOffsetSize * block;
+	bits64 end = lastBlock->offset + lastBlock->size;
+	bits64 total = end - firstBlock->offset;
+	bits64 parts = total / MIN_RANGE_SIZE;
+	int count = 1, index;
+
+	if (parts > fetchConnections())
+		parts = fetchConnections();
+	if (parts < 2)
+		return 0;
+
+	*ranges = (RangeRequest *) calloc(parts, sizeof(RangeRequest));
+	(*ranges)[0].offset = firstBlock->offset;
+	for (block = firstBlock->next; block != lastBlock->next && count < parts; block = block->next) {
+		if (block->offset - (*ranges)[count - 1].offset >= total / parts) {
+			(*ranges)[count - 1].size = block->offset - (*ranges)[count - 1].offset;
+			(*ranges)[count++].offset = block->offset;
+		}
+	}
+	(*ranges)[count - 1].size = end - (*ranges)[count - 1].offset;
+
+	for (index = 0; index < count; index++)
+		(*ranges)[index].buffer = mergedBuf + ((*ranges)[index].offset - mergedOffset);
+	return count;
+}
+
+// Copies the blocks in [firstBlock, lastBlock] from the file, in one request
+// or, for remote files, in concurrent requests
+static void downloadBlocks(BigFileReaderData * data, struct fileOffsetSize * firstBlock, struct fileOffsetSize * lastBlock, char * mergedBuf, bits64 mergedOffset, bool cache) {
+	struct fileOffsetSize * block;
+	char * buffer = mergedBuf + (firstBlock->offset - mergedOffset);
+	size_t size = lastBlock->offset + lastBlock->size - firstBlock->offset;
+
+	RangeRequest * ranges;
+	int rangeCount;
+
+	if (isRemoteFile(data) && (rangeCount = splitBlockRun(firstBlock, lastBlock, mergedBuf, mergedOffset, &ranges))) {
+		fetchRanges(data->filename, ranges, rangeCount);
+		free(ranges);
+	} else if (data->asyncFd < 0 || !readAsyncFile(data->asyncFd, data->filename, buffer, size, firstBlock->offset)) {
+		udcSeek(data->udc, firstBlock->offset);
+		udcMustRead(data->udc, buffer, size);
+	}
+
+	if (cache)
+		for (block = firstBlock; block != lastBlock->next; block = block->next)
+			storeCachedBlock(data->filename, data->shared->version, block->offset, block->size, mergedBuf + (block->offset - mergedOffset));
+}
+
+// Fills mergedBuf with the blocks, from the cache where possible
+static void readBlockRun(BigFileReaderData * data, struct fileOffsetSize * firstBlock, struct fileOffsetSize * afterBlock, char * mergedBuf) {
+	struct fileOffsetSize * block, * missFirst = NULL, * missLast = NULL;
+
+	if (!useBlockCache(data->filename)) {
+		for (block = firstBlock; block->next != afterBlock; block = block->next);
+		downloadBlocks(data, firstBlock, block, mergedBuf, firstBlock->offset, false);
+		return;
+	}
+
+	// Download each stretch of missing blocks in one go
+	for (block = firstBlock; block != afterBlock; block = block->next) {
+		if (readCachedBlock(data->filename, data->shared->version, block->offset, block->size, mergedBuf + (block->offset - firstBlock->offset))) {
+			if (missFirst)
+				downloadBlocks(data, missFirst, missLast, mergedBuf, firstBlock->offset, true);
+			missFirst = NULL;
+		} else {
+			if (!missFirst)
+				missFirst = block;
+			missLast = block;
+		}
+	}
+	if (missFirst)
+		downloadBlocks(data, missFirst, missLast, mergedBuf, firstBlock->offset, true);
+}
+
 static bool downloadBlockRun(BigFileReaderData * data, char * chrom, struct fileOffsetSize * firstBlock, struct fileOffsetSize * afterBlock, bits64 mergedSize) {
-	char * mergedBuf, *blockBuf;
+	char * mergedBuf;
 	struct fileOffsetSize * block;
 
-	udcSeek(data->udc, firstBlock->offset);
-	blockBuf = mergedBuf = (char *) needLargeMem(mergedSize);
-	udcMustRead(data->udc, mergedBuf, mergedSize);
+	mergedBuf = (char *) needLargeMem(mergedSize);
+	readBlockRun(data, firstBlock, afterBlock, mergedBuf);
+	countBufferedBytes(data->bufferedReaderData, mergedSize);
+
+	if (DECOMPRESSION_THREADS > 0 && data->bwf->uncompressBufSize > 0 && firstBlock->next != afterBlock) {
+		bool killed = inflateBlockRun(data, firstBlock, afterBlock, mergedBuf);
+		freeMem(mergedBuf);
+		return killed;
+	}
 
 	for (block = firstBlock; block != afterBlock; block = block->next) {
-		if (openBlock(data, block, blockBuf)) {
+		if (openBlock(data, block, mergedBuf + (block->offset - firstBlock->offset))) {
 			freeMem(mergedBuf);
 			return true;
 		}
-		blockBuf += block->size;
 	}
 
 	freeMem(mergedBuf);
 	return false;
 }
 
-static bool downloadBigRegion(BigFileReaderData * data, char * chrom, int start, int finish) {
-	struct fileOffsetSize *blockList, *block, *beforeGap, *afterGap;
-	int blockCounter;
-	bits64 mergedSize;
+// Finds the end of a run of blocks close enough to be read in one request
+static void findBlockRun(struct fileOffsetSize * block, bits64 readAhead, struct fileOffsetSize ** lastBlock, struct fileOffsetSize ** afterBlock) {
+	int blockCounter = 1;
+	bits64 end = block->offset + block->size;
 
-	data->chrom = chrom;
-	blockList = bbiOverlappingBlocks(data->bwf, data->bwf->unzoomedCir, chrom, start, finish, NULL);
-
-	for (block = blockList; block; block=afterGap) {
-		/* Read contiguous blocks into mergedBuf. */
-		fileOffsetSizeFindGap(block, &beforeGap, &afterGap);
-
-		// Little hack to limit the number of blocks read at any time
-		struct fileOffsetSize * blockPtr, * prevBlock;
-		blockCounter = 0;
-		prevBlock = block;
-		for (blockPtr = block; blockPtr != afterGap && blockCounter < MAX_BLOCKS; blockPtr = blockPtr->next) {
-			blockCounter++;
-			prevBlock = blockPtr;
-		}
-		if (blockCounter == MAX_BLOCKS) {
-			beforeGap = prevBlock;
-			afterGap = blockPtr;
-		}
+	while (block->next && blockCounter < MAX_BLOCKS && block->next->offset >= end && block->next->offset <= end + readAhead) {
+		block = block->next;
+		end = block->offset + block->size;
+		blockCounter++;
+	}
+	*lastBlock = block;
+	*afterBlock = block->next;
+}
+
+// Reads the blocks of a list in file order, and frees the list
+static bool downloadBlockList(BigFileReaderData * data, char * chrom, struct fileOffsetSize * blockList) {
+	struct fileOffsetSize *block, *lastBlock, *afterBlock;
+	bits64 mergedSize;
+	// Round trips to a server cost more than the bytes between blocks
+	bits64 readAhead = strstr(data->filename, "://") ? READ_AHEAD : 0;
 
-		mergedSize = beforeGap->offset + beforeGap->size - block->offset;
+	for (block = blockList; block; block=afterBlock) {
+		findBlockRun(block, readAhead, &lastBlock, &afterBlock);
+		mergedSize = lastBlock->offset + lastBlock->size - block->offset;
 
-		if (downloadBlockRun(data, chrom, block, afterGap, mergedSize)) {
+		if (downloadBlockRun(data, chrom, block, afterBlock, mergedSize)) {
 			slFreeList(blockList);
 			return true;
 		}
@@ -90,16 +427,262 @@ static bool downloadBigRegion(BigFileReaderData * data, char * chrom, int start,
 	return false;
 }
 
+static bool downloadBigRegion(BigFileReaderData * data, char * chrom, int start, int finish) {
+	data->chrom = chrom;
+	return downloadBlockList(data, chrom, sharedBigFileBlocks(data->shared, chrom, start, finish));
+}
+
+//////////////////////////////////////////////////////
+// Batched queries
+//////////////////////////////////////////////////////
+
+// The regions of a batched seek are looked up in a single descent of the
+// R-tree index, which only visits the nodes overlapping at least one of 
+// them. Each block is then read and inflated once, in file order, and only
+// the records overlapping a region are passed on.
+
+// R-tree nodes, as laid out in the index of BigWig and BigBed files
+#define CIR_NODE_HEADER_SIZE 4
+#define CIR_LEAF_ITEM_SIZE 32
+#define CIR_BRANCH_ITEM_SIZE 24
+
+static bool findChromId(BigFileReaderData * data, const char * chrom, bits32 * chromId) {
+	struct bbiChromInfo * info;
+
+	for (info = data->chromList; info; info = info->next) {
+		if (!strcmp(info->name, chrom)) {
+			*chromId = info->id;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether the range of an index item overlaps one of the regions on chromosome chromId
+static bool itemOverlapsRegions(BigFileReaderData * data, bits32 chromId, bits32 startChromId, bits32 startBase, bits32 endChromId, bits32 endBase) {
+	// Index ranges are 0-based, regions 1-based
+	long long start = startChromId < chromId ? 0 : (long long) startBase + 1;
+	long long end = endChromId > chromId ? LLONG_MAX : (long long) endBase + 1;
+	int low = 0, high = data->regionCount;
+
+	if (startChromId > chromId || endChromId < chromId)
+		return false;
+
+	// First region finishing after the start of the item
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (data->regionFinishes[middle] <= start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < data->regionCount && data->regionStarts[low] < end;
+}
+
+// Reads the index nodes at offsets. The nodes of remote files are fetched
+// concurrently, each with as many bytes as the largest node may hold.
+static char ** readIndexNodes(BigFileReaderData * data, struct cirTreeFile * tree, bits64 * offsets, int count) {
+	char ** nodes = (char **) calloc(count, sizeof(char *));
+	int index;
+
+	if (isRemoteFile(data) && count > 1 && fetchConnections() > 1) {
+		RangeRequest * ranges = (RangeRequest *) calloc(count, sizeof(RangeRequest));
+		bits64 maxSize = CIR_NODE_HEADER_SIZE + tree->blockSize * CIR_LEAF_ITEM_SIZE;
+		for (index = 0; index < count; index++) {
+			ranges[index].offset = offsets[index];
+			ranges[index].size = offsets[index] + maxSize > tree->fileSize ? tree->fileSize - offsets[index] : maxSize;
+			ranges[index].buffer = nodes[index] = (char *) needLargeMem(ranges[index].size);
+		}
+		fetchRanges(data->filename, ranges, count);
+		free(ranges);
+		return nodes;
+	}
+
+	for (index = 0; index < count; index++) {
+		char header[CIR_NODE_HEADER_SIZE];
+		char * ptr = header + 2;
+		udcSeek(data->udc, offsets[index]);
+		udcMustRead(data->udc, header, CIR_NODE_HEADER_SIZE);
+		int itemSize = header[0] ? CIR_LEAF_ITEM_SIZE : CIR_BRANCH_ITEM_SIZE;
+		int items = memReadBits16(&ptr, tree->isSwapped);
+		nodes[index] = (char *) needLargeMem(CIR_NODE_HEADER_SIZE + items * itemSize);
+		memcpy(nodes[index], header, CIR_NODE_HEADER_SIZE);
+		udcMustRead(data->udc, nodes[index] + CIR_NODE_HEADER_SIZE, items * itemSize);
+	}
+	return nodes;
+}
+
+// The tree is descended one level at a time, all leaves being at the same depth,
+// so that the blocks come out in file order
+static void findRegionBlocks(BigFileReaderData * data, struct cirTreeFile * tree, bits32 chromId, struct fileOffsetSize *** tail) {
+	bits64 * offsets = (bits64 *) calloc(1, sizeof(bits64));
+	int count = 1;
+
+	offsets[0] = tree->rootOffset;
+	while (count) {
+		char ** nodes = readIndexNodes(data, tree, offsets, count);
+		bits64 * children = NULL;
+		int childCount = 0, childCapacity = 0;
+		int node, index;
+
+		for (node = 0; node < count; node++) {
+			char * item = nodes[node];
+			bool isLeaf = *(item++);
+			item++; // Reserved
+			int items = memReadBits16(&item, tree->isSwapped);
+
+			for (index = 0; index < items; index++) {
+				bits32 startChromId = memReadBits32(&item, tree->isSwapped);
+				bits32 startBase = memReadBits32(&item, tree->isSwapped);
+				bits32 endChromId = memReadBits32(&item, tree->isSwapped);
+				bits32 endBase = memReadBits32(&item, tree->isSwapped);
+				bits64 childOffset = memReadBits64(&item, tree->isSwapped);
+				bits64 size = isLeaf ? memReadBits64(&item, tree->isSwapped) : 0;
+
+				if (!itemOverlapsRegions(data, chromId, startChromId, startBase, endChromId, endBase))
+					continue;
+				if (isLeaf) {
+					struct fileOffsetSize * block;
+					AllocVar(block);
+					block->offset = childOffset;
+					block->size = size;
+					**tail = block;
+					*tail = &block->next;
+				} else {
+					if (childCount == childCapacity) {
+						childCapacity = childCapacity ? 2 * childCapacity : 16;
+						children = (bits64 *) realloc(children, childCapacity * sizeof(bits64));
+					}
+					children[childCount++] = childOffset;
+				}
+			}
+			freeMem(nodes[node]);
+		}
+
+		free(nodes);
+		free(offsets);
+		offsets = children;
+		count = childCount;
+	}
+	free(offsets);
+}
+
+static bool downloadBigRegions(BigFileReaderData * data) {
+	struct cirTreeFile * tree = (struct cirTreeFile *) data->bwf->unzoomedCir;
+	struct fileOffsetSize * blockList = NULL;
+	struct fileOffsetSize ** tail = &blockList;
+	bits32 chromId;
+
+	data->regionIndex = 0;
+	if (!findChromId(data, data->chrom, &chromId))
+		return false;
+	findRegionBlocks(data, tree, chromId, &tail);
+	return downloadBlockList(data, data->chrom, blockList);
+}
+
+//////////////////////////////////////////////////////
+// Reverse reads
+//
+// The blocks overlapping the region are listed in
+// file order, hence by position, and read from the
+// last one. The records of a block are decoded in
+// order as usual, but held back until the whole block
+// is decoded, then pushed from the last one, so that
+// only one block is ever held in memory.
+//////////////////////////////////////////////////////
+
+static void holdReversedRecord(BigFileReaderData * data, int start, int finish, double value, int strand) {
+	if (data->reverseCount == data->reverseCapacity) {
+		data->reverseCapacity = data->reverseCapacity ? 2 * data->reverseCapacity : 1024;
+		data->reverseStarts = (int *) realloc(data->reverseStarts, data->reverseCapacity * sizeof(int));
+		data->reverseFinishes = (int *) realloc(data->reverseFinishes, data->reverseCapacity * sizeof(int));
+		data->reverseStrands = (int *) realloc(data->reverseStrands, data->reverseCapacity * sizeof(int));
+		data->reverseValues = (double *) realloc(data->reverseValues, data->reverseCapacity * sizeof(double));
+	}
+	data->reverseStarts[data->reverseCount] = start;
+	data->reverseFinishes[data->reverseCount] = finish;
+	data->reverseStrands[data->reverseCount] = strand;
+	data->reverseValues[data->reverseCount] = value;
+	data->reverseCount++;
+}
+
+// The records are clipped to the start of the region here, as there is no
+// going back to skip them once popped
+static bool pushReversedBlock(BigFileReaderData * data) {
+	int index, start;
+
+	for (index = data->reverseCount - 1; index >= 0; index--) {
+		if (data->reverseFinishes[index] <= data->start)
+			continue;
+		start = data->reverseStarts[index] > data->start ? data->reverseStarts[index] : data->start;
+		if (pushStrandedValuesToBuffer(data->bufferedReaderData, data->chrom, start, data->reverseFinishes[index], data->reverseValues[index], data->reverseStrands[index])) {
+			data->reverseCount = 0;
+			return true;
+		}
+	}
+	data->reverseCount = 0;
+	return false;
+}
+
+static bool downloadReversedRegion(BigFileReaderData * data) {
+	struct fileOffsetSize * blockList = sharedBigFileBlocks(data->shared, data->chrom, data->start, data->stop);
+	slReverse(&blockList);
+	data->reverseCount = 0;
+	return downloadBlockList(data, data->chrom, blockList);
+}
+
+bool pushBigFileRecord(BigFileReaderData * data, int start, int finish, double value, int strand) {
+	if (data->reverse) {
+		holdReversedRecord(data, start, finish, value, strand);
+		return false;
+	}
+	if (data->regionCount) {
+		// Records come sorted by start
+		while (data->regionIndex < data->regionCount && data->regionFinishes[data->regionIndex] <= start)
+			data->regionIndex++;
+		if (data->regionIndex == data->regionCount || data->regionStarts[data->regionIndex] >= finish)
+			return false;
+	}
+	return pushStrandedValuesToBuffer(data->bufferedReaderData, data->chrom, start, finish, value, strand);
+}
+
 static void downloadFullGenome(BigFileReaderData * data) {
-	struct bbiChromInfo *chromList = bbiChromList(data->bwf);
+	struct bbiChromInfo *chromList = data->chromList;
 	struct bbiChromInfo *chrom;
+	struct bbiChromInfo ** chroms;
+	char ** names;
+	int * order;
+	int count = 0, index;
+
+	// The index lists chromosomes in lexicographic order
+	for (chrom = chromList; chrom; chrom = chrom->next)
+		count++;
+	chroms = (struct bbiChromInfo **) calloc(count + 1, sizeof(struct bbiChromInfo *));
+	names = (char **) calloc(count + 1, sizeof(char *));
+	for (chrom = chromList, index = 0; chrom; chrom = chrom->next, index++) {
+		chroms[index] = chrom;
+		names[index] = chrom->name;
+	}
+	order = sortChromosomes(names, count);
 
-	for (chrom = chromList; chrom; chrom = chrom->next) 
-		if (downloadBigRegion(data, chrom->name, 0, chrom->size))
+	for (index = 0; index < count; index++) {
+		chrom = chroms[order ? order[index] : index];
+		char * name = internChromosome(chrom->name);
+		int start = 0;
+		if (data->fromChrom) {
+			int chrom_cmp = compareChroms(name, data->fromChrom);
+			if (chrom_cmp < 0)
+				continue;
+			else if (chrom_cmp == 0 && data->fromStart > 0)
+				start = data->fromStart;
+		}
+		if (downloadBigRegion(data, name, start, chrom->size))
 			break;
+	}
 
-	// TODO free chromList memory... yes but labels lost! Need to be copied out first....
-	//bbiChromInfoFreeList(&(data->chromList));
+	free(order);
+	free(names);
+	free(chroms);
 }
 
 void * downloadBigFile(void * args) {
@@ -107,6 +690,10 @@ void * downloadBigFile(void * args) {
 
 	if (!data->chrom)
 		downloadFullGenome(data);
+	else if (data->reverse)
+		downloadReversedRegion(data);
+	else if (data->regionCount)
+		downloadBigRegions(data);
 	else 
 		downloadBigRegion(data, data->chrom, data->start, data->stop);
 
@@ -114,34 +701,147 @@ void * downloadBigFile(void * args) {
 	return NULL;
 }
 
-void BigFileReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+static void restartBigFileReader(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	BigFileReaderData * data = (BigFileReaderData *) wi->data; 
 
-	if (data->bufferedReaderData) {
-		killBufferedReader(data->bufferedReaderData);
-		free(data->bufferedReaderData);
-		data->bufferedReaderData = NULL;
-	}
 	data->chrom = chrom;
 	data->start = start;
 	data->stop = finish;
+	data->seeked = true;
 	launchBufferedReader(&downloadBigFile, data, &(data->bufferedReaderData));
 	wi->done = false;
 	BigFileReaderPop(wi);
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && wi->finish <= start))) 
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish <= start))) 
 		BigFileReaderPop(wi);
 
-	if (!wi->done && strcmp(chrom, wi->chrom) == 0 && wi->start < start)
+	if (!wi->done && compareChroms(chrom, wi->chrom) == 0 && wi->start < start)
 		wi->start = start;
 
 }
 
+void BigFileReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data; 
+
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
+	data->regionCount = 0;
+	data->reverse = false;
+	restartBigFileReader(wi, chrom, start, finish);
+}
+
+// The records come out by decreasing start, already clipped to the region
+void BigFileReaderSeekReverse(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data; 
+
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
+	data->regionCount = 0;
+	data->reverse = true;
+	data->chrom = (char *) chrom;
+	data->start = start;
+	data->stop = finish;
+	data->seeked = true;
+	launchBufferedReader(&downloadBigFile, data, &(data->bufferedReaderData));
+	wi->done = false;
+	BigFileReaderPop(wi);
+}
+
+// The regions are merged where they overlap or touch
+void BigFileReaderSeekRegions(WiggleIterator * wi, const char * chrom, const int * starts, const int * finishes, int count) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data; 
+	int index;
+
+	// The downloader reads the regions
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
+
+	if (count > data->regionCapacity) {
+		data->regionCapacity = count;
+		data->regionStarts = (int *) realloc(data->regionStarts, count * sizeof(int));
+		data->regionFinishes = (int *) realloc(data->regionFinishes, count * sizeof(int));
+	}
+
+	data->regionCount = 0;
+	data->reverse = false;
+	for (index = 0; index < count; index++) {
+		if (data->regionCount && starts[index] <= data->regionFinishes[data->regionCount - 1]) {
+			if (finishes[index] > data->regionFinishes[data->regionCount - 1])
+				data->regionFinishes[data->regionCount - 1] = finishes[index];
+		} else {
+			data->regionStarts[data->regionCount] = starts[index];
+			data->regionFinishes[data->regionCount] = finishes[index];
+			data->regionCount++;
+		}
+	}
+
+	restartBigFileReader(wi, chrom, data->regionStarts[0], data->regionFinishes[data->regionCount - 1]);
+}
+
+// Targets within the blocks already downloaded are found in place. Beyond
+// them, the download restarts from the block index, instead of decoding all
+// the blocks in between. Whole genome downloads carry on over the following
+// chromosomes, seeked downloads still stop at the end of their region.
+void BigFileReaderSkipTo(WiggleIterator * wi, const char * chrom, int start) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data; 
+
+	if (BufferedReaderSkipTo(wi, data->bufferedReaderData, chrom, start))
+		return;
+
+	// Batched seeks only read the blocks of their regions anyway
+	if (!data->regionCount) {
+		if (data->seeked && compareChroms(chrom, data->chrom) != 0) {
+			wi->done = true;
+			return;
+		}
+		stopBufferedReader(data->bufferedReaderData);
+		if (data->seeked) {
+			if (start > data->start)
+				data->start = start;
+		} else {
+			data->chrom = NULL;
+			data->fromChrom = (char *) chrom;
+			// Blocks are looked up in 0-based coordinates
+			data->fromStart = start - 1;
+		}
+		launchBufferedReader(&downloadBigFile, data, &(data->bufferedReaderData));
+		BigFileReaderPop(wi);
+	}
+
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish <= start))) 
+		BigFileReaderPop(wi);
+}
+
 void BigFileReaderPop(WiggleIterator * wi) {
 	BigFileReaderData * data = (BigFileReaderData *) wi->data;
 	BufferedReaderPop(wi, data->bufferedReaderData);
 }
 
+void openBigFileReaderData(BigFileReaderData * data, char * filename, bool bigBed) {
+	data->filename = filename;
+	data->shared = openSharedBigFile(filename, bigBed);
+	data->bwf = data->shared->bwf;
+	data->isSwapped = data->bwf->isSwapped;
+	data->chromList = data->shared->chromList;
+	data->udc = udcFileOpen(filename, udcDefaultDir());
+	data->asyncFd = openAsyncFile(filename);
+	data->uncompressBuf = (char *) needLargeMem(data->bwf->uncompressBufSize);
+}
+
 void BigFileReaderCloseFile(BigFileReaderData * data) {
-	bbiFileClose(&(data->bwf));
+	udcFileClose(&(data->udc));
+	closeAsyncFile(data->asyncFd);
+	freeMem(data->uncompressBuf);
+	data->uncompressBuf = NULL;
+	free(data->reverseStarts);
+	free(data->reverseFinishes);
+	free(data->reverseStrands);
+	free(data->reverseValues);
+	data->reverseStarts = data->reverseFinishes = data->reverseStrands = NULL;
+	data->reverseValues = NULL;
+	data->reverseCapacity = 0;
+	data->chromList = NULL;
+	data->bwf = NULL;
+	closeSharedBigFile(data->shared);
+	data->shared = NULL;
 }
@@ -19,6 +19,7 @@
 
 #include "wiggleIterator.h"
 #include "bufferedReader.h"
+#include "sharedBigFiles.h"
 
 // Kent library headers
 #include "common.h"
@@ -35,24 +36,64 @@ typedef struct bigFileReaderData_st {
 	char * filename;
 	char * chrom;
 	int start, stop;
+	// Set once seeked, the downloads are then limited to a region
+	bool seeked;
+	// Whole genome downloads start there if set, see BigFileReaderSkipTo
+	char * fromChrom;
+	int fromStart;
 	bool (*readBuffer)(struct bigFileReaderData_st *);
+	// BigBed files: whether the score column is the value, instead of 1
+	bool readScore;
+	// BigBed files: whether only the coordinates are read, when the values and
+	// strands are ignored downstream
+	bool coordinatesOnly;
 
 	// Output of downloader
 	BufferedReaderData * bufferedReaderData;
 
-	// BigFile variables
+	// BigFile variables, the header being shared with the other readers of the file
+	SharedBigFile * shared;
 	struct bbiFile* bwf;
+	// Own handle, for the data blocks and index nodes
 	struct udcFile *udc;
+	// Local files are read asynchronously with this descriptor if not -1
+	int asyncFd;
 	boolean isSwapped;
 
+	// Regions of a batched seek, sorted and disjoint, see BigFileReaderSeekRegions
+	int * regionStarts, * regionFinishes;
+	int regionCount, regionCapacity;
+	// First region which may overlap the next record read
+	int regionIndex;
+	// Set by BigFileReaderSeekReverse: the blocks are read from the last one,
+	// the records of each block held here, then pushed from the last one
+	bool reverse;
+	int * reverseStarts, * reverseFinishes, * reverseStrands;
+	double * reverseValues;
+	int reverseCount, reverseCapacity;
+	// Chromosome ids, owned by the shared file
+	struct bbiChromInfo * chromList;
+
+	// BigWig files: bounds of the values, from the header
+	bool hasValueRange;
+	double minValue, maxValue;
+
 	// Buffer data
 	char *uncompressBuf;
 	char *blockEnd;
 } BigFileReaderData;
 
 void openBigFile(BigFileReaderData * data);
+// Opens the shared header and the own handles of the reader
+void openBigFileReaderData(BigFileReaderData * data, char * filename, bool bigBed);
+void BigFileReaderCloseFile(BigFileReaderData * data);
 void * downloadBigFile(void * data);
 void BigFileReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish);
+void BigFileReaderSeekRegions(WiggleIterator * wi, const char * chrom, const int * starts, const int * finishes, int count);
+void BigFileReaderSkipTo(WiggleIterator * wi, const char * chrom, int start);
+void BigFileReaderSeekReverse(WiggleIterator * wi, const char * chrom, int start, int finish);
+// Pushes a record to the buffer, unless it falls between the regions of a batched seek
+bool pushBigFileRecord(BigFileReaderData * data, int start, int finish, double value, int strand);
 void BigFileReaderPop(WiggleIterator * wi);
 void killDownloader(BigFileReaderData * data);
 #endif
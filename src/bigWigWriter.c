@@ -0,0 +1,1023 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BigWig files written in a single pass: sections of bedGraph items
+// are compressed on worker threads and appended to the file as they
+// fill up, while the zoom levels are accumulated on the fly into
+// temporary files. Indices, zoom levels and chromosome list are
+// written once the data is exhausted, then the header is filled in.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bigWigWriter.h"
+#include "partials.h"
+#include "tracer.h"
+
+// Kent library headers
+#include "common.h"
+#include "zlibFace.h"
+#include "cirTree.h"
+#include "bPlusTree.h"
+
+static const bits32 BIGWIG_SIGNATURE = 0x888FFC26;
+static const bits16 BBI_VERSION = 4;
+#define MAX_ZOOM_LEVELS 10
+static const int ZOOM_INCREMENT = 4;
+static const int ITEMS_PER_SLOT = 1024;
+static const int INDEX_BLOCK_SIZE = 256;
+static const int HEADER_SIZE = 64;
+static const int ZOOM_HEADER_SIZE = 24;
+static const int TOTAL_SUMMARY_SIZE = 40;
+static const int SECTION_HEADER_SIZE = 24;
+static const int SECTION_ITEM_SIZE = 12;
+static const UBYTE BEDGRAPH_SECTION = 1;
+// Number of blocks compressed in parallel
+#define BLOCK_BATCH 64
+static int COMPRESSION_THREADS = 4;
+
+void setCompressionThreads(int value) {
+	if (value < 1) {
+		fprintf(stderr, "Number of compression threads must be positive: %i\n", value);
+		raiseError();
+	}
+	COMPRESSION_THREADS = value;
+}
+
+int getCompressionThreads() {
+	return COMPRESSION_THREADS;
+}
+
+bool isBigWigFilename(const char * filename) {
+	size_t length = strlen(filename);
+	return (length > 3 && !strcmp(filename + length - 3, ".bw"))
+		|| (length > 7 && !strcmp(filename + length - 7, ".bigWig"))
+		|| (length > 7 && !strcmp(filename + length - 7, ".bigwig"));
+}
+
+//////////////////////////////////////////////////////
+// Data structures
+//////////////////////////////////////////////////////
+
+// Block of the file, before and after compression
+typedef struct outputBlock_st {
+	bits32 chromId, start, end;
+	char * buffer;
+	size_t size;
+	char * compressed;
+	size_t compressedSize;
+} OutputBlock;
+
+// Leaf of an R tree index
+typedef struct indexEntry_st {
+	bits32 chromId, start, end;
+	bits64 offset;
+} IndexEntry;
+
+typedef struct indexList_st {
+	IndexEntry * entries;
+	bits64 count, capacity;
+} IndexList;
+
+// Summary of a range, 0-based half open
+typedef struct summary_st {
+	bits32 chromId, start, end;
+	bits64 validCount;
+	double min, max, sum, sumSquares;
+} Summary;
+
+// Zoom record, as stored in the file
+typedef struct zoomRecord_st {
+	bits32 chromId, start, end, validCount;
+	float min, max, sum, sumSquares;
+} ZoomRecord;
+
+typedef struct zoomLevel_st {
+	bits32 reduction;
+	// Finished records
+	FILE * records;
+	bits64 count;
+	// Record being accumulated, within bin number 'bin'
+	Summary current;
+	bits64 bin;
+	bool open;
+	// Location in the file
+	bits64 dataOffset, indexOffset;
+} ZoomLevel;
+
+typedef struct chromEntry_st {
+	char * name;
+	// Id and size, in the order expected in the chromosome tree
+	bits32 values[2];
+} ChromEntry;
+
+struct bigWigWriter_st {
+	FILE * file;
+	bool finished;
+	// Writes a region of a partial file, see writeBigWigPartialSection
+	bool partial;
+	bits64 dataOffset, dataEnd, indexOffset, chromTreeOffset;
+	bits32 sectionCount;
+	size_t maxBlockSize;
+
+	// Chromosomes, in order of appearance
+	ChromEntry * chroms;
+	int chromCount, chromCapacity;
+	char * lastChrom;
+	bits32 lastFinish;
+
+	// Section being filled
+	bits32 * starts;
+	bits32 * ends;
+	float * values;
+	int itemCount;
+
+	// Sections waiting for compression
+	OutputBlock batch[BLOCK_BATCH];
+	int batchCount;
+	IndexList index;
+
+	// Zoom levels, set up when the first section is closed
+	ZoomLevel zooms[MAX_ZOOM_LEVELS];
+	int zoomCount;
+	// Reductions requested by the caller, if any
+	bits32 reductions[MAX_ZOOM_LEVELS];
+	int reductionCount;
+	Summary total;
+};
+
+//////////////////////////////////////////////////////
+// Low level output
+//////////////////////////////////////////////////////
+
+static void writeBytes(BigWigWriter * writer, const void * data, size_t size) {
+	if (fwrite(data, 1, size, writer->file) != size) {
+		fprintf(stderr, "Could not write to BigWig file\n");
+		raiseError();
+	}
+}
+
+static void writeBits16(BigWigWriter * writer, bits16 value) {
+	writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeBits32(BigWigWriter * writer, bits32 value) {
+	writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeBits64(BigWigWriter * writer, bits64 value) {
+	writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeDouble(BigWigWriter * writer, double value) {
+	writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeZeros(BigWigWriter * writer, size_t size) {
+	char zeros[256];
+	memset(zeros, 0, sizeof(zeros));
+	while (size > 0) {
+		size_t length = size < sizeof(zeros) ? size : sizeof(zeros);
+		writeBytes(writer, zeros, length);
+		size -= length;
+	}
+}
+
+static bits64 filePosition(BigWigWriter * writer) {
+	return (bits64) ftell(writer->file);
+}
+
+static void seekFile(BigWigWriter * writer, bits64 offset) {
+	if (fseek(writer->file, offset, SEEK_SET)) {
+		fprintf(stderr, "Could not seek within BigWig file, it must be written to a regular file\n");
+		raiseError();
+	}
+}
+
+static void * packBits32(void * ptr, bits32 value) {
+	memcpy(ptr, &value, sizeof(value));
+	return (char *) ptr + sizeof(value);
+}
+
+static void * packFloat(void * ptr, float value) {
+	memcpy(ptr, &value, sizeof(value));
+	return (char *) ptr + sizeof(value);
+}
+
+//////////////////////////////////////////////////////
+// Parallel compression
+//////////////////////////////////////////////////////
+
+typedef struct compressionJob_st {
+	OutputBlock * blocks;
+	int first, count, stride;
+} CompressionJob;
+
+static void compressBlock(OutputBlock * block) {
+	size_t bufferSize = zCompBufSize(block->size);
+	block->compressed = (char *) malloc(bufferSize);
+	if (!block->compressed) {
+		fprintf(stderr, "Could not allocate %zu bytes\n", bufferSize);
+		raiseError();
+	}
+	block->compressedSize = zCompress(block->buffer, block->size, block->compressed, bufferSize);
+}
+
+static void * runCompressionJob(void * args) {
+	CompressionJob * job = (CompressionJob *) args;
+	if (job->first)
+		nameTraceThread("compress");
+	double start = traceClock();
+	int i;
+	for (i = job->first; i < job->count; i += job->stride)
+		compressBlock(job->blocks + i);
+	traceSpan("compress", start);
+	return NULL;
+}
+
+static void compressBlocks(OutputBlock * blocks, int count) {
+	pthread_t threads[BLOCK_BATCH];
+	CompressionJob jobs[BLOCK_BATCH];
+	int threadCount = COMPRESSION_THREADS < count ? COMPRESSION_THREADS : count;
+	int i;
+
+	// The calling thread takes the first share
+	for (i = 0; i < threadCount; i++) {
+		jobs[i].blocks = blocks;
+		jobs[i].first = i;
+		jobs[i].count = count;
+		jobs[i].stride = threadCount;
+	}
+	for (i = 1; i < threadCount; i++) {
+		int err = pthread_create(threads + i, NULL, &runCompressionJob, jobs + i);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			raiseError();
+		}
+	}
+	if (threadCount > 0)
+		runCompressionJob(jobs);
+	for (i = 1; i < threadCount; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void addIndexEntry(IndexList * index, OutputBlock * block, bits64 offset) {
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? 2 * index->capacity : 1024;
+		index->entries = (IndexEntry *) realloc(index->entries, index->capacity * sizeof(IndexEntry));
+	}
+	IndexEntry * entry = index->entries + index->count++;
+	entry->chromId = block->chromId;
+	entry->start = block->start;
+	entry->end = block->end;
+	entry->offset = offset;
+}
+
+// Compresses the blocks, then writes them in order
+static void writeBlocks(BigWigWriter * writer, OutputBlock * blocks, int count, IndexList * index) {
+	int i;
+
+	compressBlocks(blocks, count);
+	for (i = 0; i < count; i++) {
+		addIndexEntry(index, blocks + i, filePosition(writer));
+		writeBytes(writer, blocks[i].compressed, blocks[i].compressedSize);
+		if (blocks[i].size > writer->maxBlockSize)
+			writer->maxBlockSize = blocks[i].size;
+		free(blocks[i].buffer);
+		free(blocks[i].compressed);
+	}
+}
+
+static struct cirTreeRange indexEntryRange(const void * va, void * context) {
+	const IndexEntry * entry = (const IndexEntry *) va;
+	struct cirTreeRange range;
+	range.chromIx = entry->chromId;
+	range.start = entry->start;
+	range.end = entry->end;
+	return range;
+}
+
+static bits64 indexEntryOffset(const void * va, void * context) {
+	return ((const IndexEntry *) va)->offset;
+}
+
+static void writeIndex(BigWigWriter * writer, IndexList * index, bits64 endOffset) {
+	cirTreeFileBulkIndexToOpenFile(index->entries, sizeof(IndexEntry), index->count, INDEX_BLOCK_SIZE, 1, NULL, &indexEntryRange, &indexEntryOffset, endOffset, writer->file);
+}
+
+//////////////////////////////////////////////////////
+// Zoom levels
+//////////////////////////////////////////////////////
+
+static void mergeSummary(Summary * summary, Summary * piece) {
+	summary->end = piece->end;
+	summary->validCount += piece->validCount;
+	if (piece->min < summary->min)
+		summary->min = piece->min;
+	if (piece->max > summary->max)
+		summary->max = piece->max;
+	summary->sum += piece->sum;
+	summary->sumSquares += piece->sumSquares;
+}
+
+static void addToZoomLevel(BigWigWriter * writer, int level, Summary * piece);
+
+static void closeZoomRecord(BigWigWriter * writer, int level) {
+	ZoomLevel * zoom = writer->zooms + level;
+	ZoomRecord record;
+
+	if (!zoom->open)
+		return;
+	zoom->open = false;
+
+	record.chromId = zoom->current.chromId;
+	record.start = zoom->current.start;
+	record.end = zoom->current.end;
+	record.validCount = zoom->current.validCount;
+	record.min = zoom->current.min;
+	record.max = zoom->current.max;
+	record.sum = zoom->current.sum;
+	record.sumSquares = zoom->current.sumSquares;
+	if (fwrite(&record, sizeof(record), 1, zoom->records) != 1) {
+		fprintf(stderr, "Could not write to temporary file\n");
+		raiseError();
+	}
+	zoom->count++;
+
+	// Bins of the next level are unions of bins of this level
+	if (level + 1 < writer->zoomCount)
+		addToZoomLevel(writer, level + 1, &zoom->current);
+}
+
+static void addToZoomLevel(BigWigWriter * writer, int level, Summary * piece) {
+	ZoomLevel * zoom = writer->zooms + level;
+	bits64 bin = piece->start / zoom->reduction;
+
+	if (zoom->open && (zoom->current.chromId != piece->chromId || zoom->bin != bin))
+		closeZoomRecord(writer, level);
+
+	if (zoom->open)
+		mergeSummary(&zoom->current, piece);
+	else {
+		zoom->current = *piece;
+		zoom->bin = bin;
+		zoom->open = true;
+	}
+}
+
+static void closeZoomRecords(BigWigWriter * writer) {
+	int level;
+	for (level = 0; level < writer->zoomCount; level++)
+		closeZoomRecord(writer, level);
+}
+
+static void openZoomLevels(BigWigWriter * writer, bits64 reduction) {
+	// A partial file only holds the finest level, the others are computed when merging
+	int maxLevels = writer->partial ? 1 : MAX_ZOOM_LEVELS;
+
+	for (writer->zoomCount = 0; writer->zoomCount < maxLevels && reduction < 0x80000000ULL; writer->zoomCount++) {
+		ZoomLevel * zoom = writer->zooms + writer->zoomCount;
+		if (writer->reductionCount) {
+			if (writer->zoomCount == writer->reductionCount)
+				break;
+			reduction = writer->reductions[writer->zoomCount];
+		}
+		zoom->reduction = reduction;
+		if (!(zoom->records = tmpfile())) {
+			fprintf(stderr, "Could not create temporary file\n");
+			raiseError();
+		}
+		reduction *= ZOOM_INCREMENT;
+	}
+}
+
+// The coarsest zoom level is about ten times the typical item span,
+// unless the reductions were set
+static void createZoomLevels(BigWigWriter * writer) {
+	bits64 span = 0;
+	bits64 reduction;
+	int i;
+
+	for (i = 0; i < writer->itemCount; i++)
+		span += writer->ends[i] - writer->starts[i];
+	reduction = writer->itemCount ? 10 * span / writer->itemCount : 10;
+	if (reduction < 10)
+		reduction = 10;
+	// Shards round down to 10 times a power of the increment, so that the
+	// bins of the finer shards fit in those of the coarser ones
+	if (writer->partial) {
+		bits64 rounded = 10;
+		while (rounded * ZOOM_INCREMENT <= reduction)
+			rounded *= ZOOM_INCREMENT;
+		reduction = rounded;
+	}
+	openZoomLevels(writer, reduction);
+}
+
+void setBigWigZoomLevels(BigWigWriter * writer, int * reductions, int count) {
+	int level;
+
+	if (count > MAX_ZOOM_LEVELS) {
+		fprintf(stderr, "A BigWig file cannot have more than %i zoom levels\n", MAX_ZOOM_LEVELS);
+		raiseError();
+	}
+	for (level = 0; level < count; level++) {
+		// Bins of each level are unions of bins of the previous level
+		if (reductions[level] < 1 || (level > 0 && (reductions[level] <= reductions[level - 1] || reductions[level] % reductions[level - 1]))) {
+			fprintf(stderr, "BigWig zoom levels must be increasing multiples of each other: %i\n", reductions[level]);
+			raiseError();
+		}
+		writer->reductions[level] = reductions[level];
+	}
+	writer->reductionCount = count;
+}
+
+static void addItemToZoomLevels(BigWigWriter * writer, bits32 chromId, bits32 start, bits32 end, double value) {
+	bits64 reduction = writer->zooms[0].reduction;
+	bits64 position, binEnd;
+	Summary piece;
+
+	piece.chromId = chromId;
+	piece.min = piece.max = value;
+	for (position = start; position < end; position = binEnd) {
+		binEnd = (position / reduction + 1) * reduction;
+		if (binEnd > end)
+			binEnd = end;
+		piece.start = position;
+		piece.end = binEnd;
+		piece.validCount = binEnd - position;
+		piece.sum = value * piece.validCount;
+		piece.sumSquares = value * value * piece.validCount;
+		addToZoomLevel(writer, 0, &piece);
+	}
+}
+
+// Zoom records are packed into blocks which do not cross chromosomes
+static void writeZoomLevel(BigWigWriter * writer, ZoomLevel * zoom) {
+	OutputBlock blocks[BLOCK_BATCH];
+	IndexList index;
+	ZoomRecord record;
+	int blockCount = 0;
+	OutputBlock * block = NULL;
+	char * ptr = NULL;
+	int items = 0;
+
+	memset(&index, 0, sizeof(index));
+	zoom->dataOffset = filePosition(writer);
+	writeBits32(writer, zoom->count);
+
+	rewind(zoom->records);
+	while (fread(&record, sizeof(record), 1, zoom->records) == 1) {
+		if (block && (items == ITEMS_PER_SLOT || record.chromId != block->chromId)) {
+			block->size = ptr - block->buffer;
+			if (++blockCount == BLOCK_BATCH) {
+				writeBlocks(writer, blocks, blockCount, &index);
+				blockCount = 0;
+			}
+			block = NULL;
+		}
+		if (!block) {
+			block = blocks + blockCount;
+			block->chromId = record.chromId;
+			block->start = record.start;
+			block->buffer = ptr = (char *) malloc(ITEMS_PER_SLOT * sizeof(ZoomRecord));
+			items = 0;
+		}
+		memcpy(ptr, &record, sizeof(record));
+		ptr += sizeof(record);
+		block->end = record.end;
+		items++;
+	}
+	if (block) {
+		block->size = ptr - block->buffer;
+		blockCount++;
+	}
+	if (blockCount)
+		writeBlocks(writer, blocks, blockCount, &index);
+	// Further records are appended if the writer is reopened
+	fseek(zoom->records, 0, SEEK_END);
+
+	zoom->indexOffset = filePosition(writer);
+	writeIndex(writer, &index, zoom->indexOffset);
+	free(index.entries);
+}
+
+// Keep levels as long as they halve the number of records, or all the
+// levels which were requested
+static int usefulZoomLevels(BigWigWriter * writer) {
+	int level;
+	for (level = 0; level < writer->zoomCount; level++) {
+		if (writer->zooms[level].count == 0)
+			break;
+		if (level > 0 && !writer->reductionCount && 2 * writer->zooms[level].count > writer->zooms[level - 1].count)
+			break;
+	}
+	return level;
+}
+
+//////////////////////////////////////////////////////
+// Sections
+//////////////////////////////////////////////////////
+
+static void flushBatch(BigWigWriter * writer) {
+	if (writer->batchCount) {
+		writeBlocks(writer, writer->batch, writer->batchCount, &writer->index);
+		writer->batchCount = 0;
+	}
+}
+
+static void closeSection(BigWigWriter * writer) {
+	bits32 chromId;
+	OutputBlock * block;
+	void * ptr;
+	int i;
+
+	if (writer->itemCount == 0)
+		return;
+	chromId = writer->chroms[writer->chromCount - 1].values[0];
+
+	if (!writer->zoomCount)
+		createZoomLevels(writer);
+	for (i = 0; i < writer->itemCount; i++)
+		addItemToZoomLevels(writer, chromId, writer->starts[i], writer->ends[i], writer->values[i]);
+
+	block = writer->batch + writer->batchCount++;
+	block->chromId = chromId;
+	block->start = writer->starts[0];
+	block->end = writer->ends[writer->itemCount - 1];
+	block->size = SECTION_HEADER_SIZE + writer->itemCount * SECTION_ITEM_SIZE;
+	block->buffer = (char *) malloc(block->size);
+
+	ptr = packBits32(block->buffer, chromId);
+	ptr = packBits32(ptr, block->start);
+	ptr = packBits32(ptr, block->end);
+	// Item step and span are unused in bedGraph sections
+	ptr = packBits32(ptr, 0);
+	ptr = packBits32(ptr, 0);
+	memset(ptr, 0, 2);
+	*((UBYTE *) ptr) = BEDGRAPH_SECTION;
+	ptr = (char *) ptr + 2;
+	bits16 count = writer->itemCount;
+	memcpy(ptr, &count, sizeof(count));
+	ptr = (char *) ptr + sizeof(count);
+
+	for (i = 0; i < writer->itemCount; i++) {
+		ptr = packBits32(ptr, writer->starts[i]);
+		ptr = packBits32(ptr, writer->ends[i]);
+		ptr = packFloat(ptr, writer->values[i]);
+	}
+
+	writer->sectionCount++;
+	writer->itemCount = 0;
+	if (writer->batchCount == BLOCK_BATCH)
+		flushBatch(writer);
+}
+
+static void addChrom(BigWigWriter * writer, char * chrom) {
+	if (writer->lastChrom && compareChroms(writer->lastChrom, chrom) >= 0) {
+		fprintf(stderr, "Cannot write BigWig file: %s appears after %s, the data is not sorted\n", chrom, writer->lastChrom);
+		raiseError();
+	}
+	if (writer->chromCount == writer->chromCapacity) {
+		writer->chromCapacity = writer->chromCapacity ? 2 * writer->chromCapacity : 64;
+		writer->chroms = (ChromEntry *) realloc(writer->chroms, writer->chromCapacity * sizeof(ChromEntry));
+	}
+	writer->chroms[writer->chromCount].name = chrom;
+	writer->chroms[writer->chromCount].values[0] = writer->chromCount;
+	writer->chroms[writer->chromCount].values[1] = 0;
+	writer->chromCount++;
+	writer->lastChrom = chrom;
+	writer->lastFinish = 0;
+}
+
+//////////////////////////////////////////////////////
+// Chromosome tree
+//////////////////////////////////////////////////////
+
+// Set for the key callback of each index, by each thread writing one
+static __thread bits32 chromKeySize;
+
+static int compareChromEntries(const void * a, const void * b) {
+	return strcmp(((const ChromEntry *) a)->name, ((const ChromEntry *) b)->name);
+}
+
+static void chromEntryKey(const void * va, char * keyBuf) {
+	strncpy(keyBuf, ((const ChromEntry *) va)->name, chromKeySize);
+}
+
+static void * chromEntryValue(const void * va) {
+	return ((ChromEntry *) va)->values;
+}
+
+static void writeChromTree(BigWigWriter * writer) {
+	ChromEntry * sorted = (ChromEntry *) calloc(writer->chromCount ? writer->chromCount : 1, sizeof(ChromEntry));
+	int i;
+
+	memcpy(sorted, writer->chroms, writer->chromCount * sizeof(ChromEntry));
+	qsort(sorted, writer->chromCount, sizeof(ChromEntry), &compareChromEntries);
+
+	// Only the writing thread uses the key size
+	chromKeySize = 1;
+	for (i = 0; i < writer->chromCount; i++)
+		if (strlen(sorted[i].name) > chromKeySize)
+			chromKeySize = strlen(sorted[i].name);
+
+	writer->chromTreeOffset = filePosition(writer);
+	bptFileBulkIndexToOpenFile(sorted, sizeof(ChromEntry), writer->chromCount, INDEX_BLOCK_SIZE, &chromEntryKey, chromKeySize, &chromEntryValue, sizeof(sorted[0].values), writer->file);
+	free(sorted);
+}
+
+//////////////////////////////////////////////////////
+// Public functions
+//////////////////////////////////////////////////////
+
+static BigWigWriter * newBigWigWriter(FILE * file) {
+	BigWigWriter * writer = (BigWigWriter *) calloc(1, sizeof(BigWigWriter));
+	writer->file = file;
+	writer->starts = (bits32 *) calloc(ITEMS_PER_SLOT, sizeof(bits32));
+	writer->ends = (bits32 *) calloc(ITEMS_PER_SLOT, sizeof(bits32));
+	writer->values = (float *) calloc(ITEMS_PER_SLOT, sizeof(float));
+	return writer;
+}
+
+BigWigWriter * openBigWigWriter(FILE * file) {
+	BigWigWriter * writer = newBigWigWriter(file);
+
+	// Header, zoom headers and total summary are filled in at the end
+	writeZeros(writer, HEADER_SIZE + MAX_ZOOM_LEVELS * ZOOM_HEADER_SIZE + TOTAL_SUMMARY_SIZE);
+	writer->dataOffset = filePosition(writer);
+	writeBits32(writer, 0);
+	return writer;
+}
+
+void addBigWigValue(BigWigWriter * writer, char * chrom, int start, int finish, double value) {
+	// BigWig coordinates are 0-based
+	bits32 start0 = start - 1;
+	bits32 end0 = finish - 1;
+
+	if (isnan(value) || finish <= start)
+		return;
+
+	// Resume writing after the data
+	if (writer->finished) {
+		fflush(writer->file);
+		if (ftruncate(fileno(writer->file), writer->dataEnd)) {
+			fprintf(stderr, "Could not truncate BigWig file\n");
+			raiseError();
+		}
+		seekFile(writer, writer->dataEnd);
+		writer->finished = false;
+	}
+
+	if (chrom != writer->lastChrom) {
+		closeSection(writer);
+		addChrom(writer, chrom);
+	} else if (start0 < writer->lastFinish) {
+		fprintf(stderr, "Cannot write BigWig file: %s:%i-%i overlaps or precedes the previous value, the data is not sorted\n", chrom, start, finish);
+		raiseError();
+	} else if (writer->itemCount == ITEMS_PER_SLOT)
+		closeSection(writer);
+
+	writer->starts[writer->itemCount] = start0;
+	writer->ends[writer->itemCount] = end0;
+	writer->values[writer->itemCount] = value;
+	writer->itemCount++;
+	writer->lastFinish = end0;
+	// Chromosome lengths are unknown, extend them to the data
+	writer->chroms[writer->chromCount - 1].values[1] = end0;
+
+	if (writer->total.validCount == 0 || value < writer->total.min)
+		writer->total.min = value;
+	if (writer->total.validCount == 0 || value > writer->total.max)
+		writer->total.max = value;
+	writer->total.validCount += end0 - start0;
+	writer->total.sum += value * (end0 - start0);
+	writer->total.sumSquares += value * value * (end0 - start0);
+}
+
+void finishBigWigWriter(BigWigWriter * writer) {
+	int level, zoomLevels;
+
+	if (writer->finished)
+		return;
+
+	closeSection(writer);
+	flushBatch(writer);
+	closeZoomRecords(writer);
+	writer->dataEnd = filePosition(writer);
+
+	writer->indexOffset = writer->dataEnd;
+	writeIndex(writer, &writer->index, writer->indexOffset);
+
+	zoomLevels = usefulZoomLevels(writer);
+	for (level = 0; level < zoomLevels; level++)
+		writeZoomLevel(writer, writer->zooms + level);
+	if (zoomLevels && writer->maxBlockSize < ITEMS_PER_SLOT * sizeof(ZoomRecord))
+		writer->maxBlockSize = ITEMS_PER_SLOT * sizeof(ZoomRecord);
+
+	writeChromTree(writer);
+	writeBits32(writer, BIGWIG_SIGNATURE);
+
+	// Header
+	seekFile(writer, 0);
+	writeBits32(writer, BIGWIG_SIGNATURE);
+	writeBits16(writer, BBI_VERSION);
+	writeBits16(writer, zoomLevels);
+	writeBits64(writer, writer->chromTreeOffset);
+	writeBits64(writer, writer->dataOffset);
+	writeBits64(writer, writer->indexOffset);
+	// Field counts and autoSql are only used by BigBed files
+	writeBits16(writer, 0);
+	writeBits16(writer, 0);
+	writeBits64(writer, 0);
+	writeBits64(writer, HEADER_SIZE + MAX_ZOOM_LEVELS * ZOOM_HEADER_SIZE);
+	writeBits32(writer, writer->maxBlockSize);
+	writeBits64(writer, 0);
+
+	for (level = 0; level < zoomLevels; level++) {
+		writeBits32(writer, writer->zooms[level].reduction);
+		writeBits32(writer, 0);
+		writeBits64(writer, writer->zooms[level].dataOffset);
+		writeBits64(writer, writer->zooms[level].indexOffset);
+	}
+	writeZeros(writer, (MAX_ZOOM_LEVELS - zoomLevels) * ZOOM_HEADER_SIZE);
+
+	writeBits64(writer, writer->total.validCount);
+	writeDouble(writer, writer->total.min);
+	writeDouble(writer, writer->total.max);
+	writeDouble(writer, writer->total.sum);
+	writeDouble(writer, writer->total.sumSquares);
+	writeBits32(writer, writer->sectionCount);
+
+	fseek(writer->file, 0, SEEK_END);
+	fflush(writer->file);
+	writer->finished = true;
+}
+
+WiggleIterator * BigWigWriterInput(WiggleIterator * iter) {
+	// Overlapping regions are merged, as in all other non-overlapping contexts
+	return CompressionWiggleIterator(NonOverlappingWiggleIterator(iter));
+}
+
+//////////////////////////////////////////////////////
+// Partial results
+//
+// A section holds the name, rank and length of the
+// chromosome, the finest zoom reduction, the largest
+// uncompressed block, the number of blocks, of bytes of
+// data and of zoom records, the total summary, then the
+// extent and compressed size of each block, the blocks
+// and the zoom records.
+//////////////////////////////////////////////////////
+
+typedef struct partialBlock_st {
+	bits32 start, end;
+	bits64 size;
+} PartialBlock;
+
+static void copyBytes(FILE * destination, FILE * source, bits64 size) {
+	char buffer[65536];
+
+	while (size > 0) {
+		size_t length = size < sizeof(buffer) ? size : sizeof(buffer);
+		readPartialValues(source, buffer, 1, length);
+		writePartialValues(destination, buffer, 1, length);
+		size -= length;
+	}
+}
+
+void writeBigWigPartialSection(FILE * file, const char * chrom, int chromId, int chromLength, FILE * records) {
+	FILE * blocks = tmpfile();
+	BigWigWriter * writer;
+	PartialRecord record;
+	int32_t length = strlen(chrom);
+	int32_t header[4];
+	int64_t counts[3];
+	bits64 i;
+
+	if (!blocks) {
+		fprintf(stderr, "Could not create temporary file\n");
+		raiseError();
+	}
+	writer = newBigWigWriter(blocks);
+	writer->partial = true;
+	addChrom(writer, (char *) chrom);
+	writer->chroms[0].values[0] = chromId;
+
+	rewind(records);
+	while (fread(&record, sizeof(record), 1, records) == 1)
+		addBigWigValue(writer, (char *) chrom, record.start, record.finish, record.value);
+	closeSection(writer);
+	flushBatch(writer);
+	closeZoomRecords(writer);
+
+	header[0] = chromId;
+	header[1] = chromLength;
+	header[2] = writer->zoomCount ? writer->zooms[0].reduction : 0;
+	header[3] = writer->maxBlockSize;
+	counts[0] = writer->index.count;
+	counts[1] = filePosition(writer);
+	counts[2] = writer->zoomCount ? writer->zooms[0].count : 0;
+	writePartialValues(file, &length, sizeof(length), 1);
+	writePartialValues(file, chrom, 1, length);
+	writePartialValues(file, header, sizeof(int32_t), 4);
+	writePartialValues(file, counts, sizeof(int64_t), 3);
+	writePartialValues(file, &writer->total, sizeof(Summary), 1);
+
+	// Blocks were written back to back from the start of the temporary file
+	for (i = 0; i < writer->index.count; i++) {
+		PartialBlock block;
+		block.start = writer->index.entries[i].start;
+		block.end = writer->index.entries[i].end;
+		block.size = (i + 1 < writer->index.count ? writer->index.entries[i + 1].offset : (bits64) counts[1]) - writer->index.entries[i].offset;
+		writePartialValues(file, &block, sizeof(block), 1);
+	}
+	rewind(blocks);
+	copyBytes(file, blocks, counts[1]);
+	if (writer->zoomCount) {
+		rewind(writer->zooms[0].records);
+		copyBytes(file, writer->zooms[0].records, counts[2] * sizeof(ZoomRecord));
+		fclose(writer->zooms[0].records);
+	}
+
+	fclose(blocks);
+	free(writer->index.entries);
+	free(writer->chroms);
+	free(writer->starts);
+	free(writer->ends);
+	free(writer->values);
+	free(writer);
+}
+
+// Returns false at the end of the file
+static bool copyBigWigPartialSection(BigWigWriter * writer, FILE * file, FILE * zoomRecords, bits32 * reduction) {
+	int32_t length;
+	int32_t header[4];
+	int64_t counts[3];
+	Summary total;
+	PartialBlock * blocks;
+	char * name, * chrom;
+	bits64 offset;
+	int64_t i;
+
+	if (fread(&length, sizeof(length), 1, file) != 1)
+		return false;
+	if (length <= 0) {
+		fprintf(stderr, "Corrupted partial results file\n");
+		raiseError();
+	}
+	name = (char *) calloc(length + 1, 1);
+	readPartialValues(file, name, 1, length);
+	chrom = internChromosome(name);
+	free(name);
+	readPartialValues(file, header, sizeof(int32_t), 4);
+	readPartialValues(file, counts, sizeof(int64_t), 3);
+	readPartialValues(file, &total, sizeof(Summary), 1);
+	if (counts[0] < 0 || counts[1] < 0 || counts[2] < 0) {
+		fprintf(stderr, "Corrupted partial results file\n");
+		raiseError();
+	}
+
+	// Chromosomes cut into several shards appear once
+	if (chrom != writer->lastChrom) {
+		addChrom(writer, chrom);
+		writer->chroms[writer->chromCount - 1].values[0] = header[0];
+		writer->chroms[writer->chromCount - 1].values[1] = header[1];
+	}
+
+	blocks = (PartialBlock *) calloc(counts[0] ? counts[0] : 1, sizeof(PartialBlock));
+	readPartialValues(file, blocks, sizeof(PartialBlock), counts[0]);
+	offset = filePosition(writer);
+	for (i = 0; i < counts[0]; i++) {
+		OutputBlock block;
+		block.chromId = header[0];
+		block.start = blocks[i].start;
+		block.end = blocks[i].end;
+		addIndexEntry(&writer->index, &block, offset);
+		offset += blocks[i].size;
+	}
+	free(blocks);
+	// The data blocks are copied as they are, without decompression
+	copyBytes(writer->file, file, counts[1]);
+	writer->sectionCount += counts[0];
+	if (header[3] > writer->maxBlockSize)
+		writer->maxBlockSize = header[3];
+
+	if (total.validCount) {
+		if (writer->total.validCount == 0 || total.min < writer->total.min)
+			writer->total.min = total.min;
+		if (writer->total.validCount == 0 || total.max > writer->total.max)
+			writer->total.max = total.max;
+		writer->total.validCount += total.validCount;
+		writer->total.sum += total.sum;
+		writer->total.sumSquares += total.sumSquares;
+	}
+
+	if (counts[2] && header[2] > *reduction)
+		*reduction = header[2];
+	copyBytes(zoomRecords, file, counts[2] * sizeof(ZoomRecord));
+	return true;
+}
+
+void mergeBigWigPartials(FILE * output, FILE ** files, int count) {
+	BigWigWriter * writer = openBigWigWriter(output);
+	FILE * zoomRecords = tmpfile();
+	bits32 reduction = 0;
+	ZoomRecord record;
+	Summary piece;
+	int i;
+
+	if (!zoomRecords) {
+		fprintf(stderr, "Could not create temporary file\n");
+		raiseError();
+	}
+	for (i = 0; i < count; i++) {
+		while (copyBigWigPartialSection(writer, files[i], zoomRecords, &reduction));
+		fclose(files[i]);
+	}
+	free(files);
+
+	// The finest level is that of the coarsest shard, its bins hold those
+	// of the other shards. The coarser levels are computed from it.
+	if (reduction) {
+		openZoomLevels(writer, reduction);
+		rewind(zoomRecords);
+		while (fread(&record, sizeof(record), 1, zoomRecords) == 1) {
+			piece.chromId = record.chromId;
+			piece.start = record.start;
+			piece.end = record.end;
+			piece.validCount = record.validCount;
+			piece.min = record.min;
+			piece.max = record.max;
+			piece.sum = record.sum;
+			piece.sumSquares = record.sumSquares;
+			addToZoomLevel(writer, 0, &piece);
+		}
+	}
+	fclose(zoomRecords);
+	finishBigWigWriter(writer);
+}
+
+//////////////////////////////////////////////////////
+// Tee operator
+//////////////////////////////////////////////////////
+
+typedef struct bigWigTeeData_st {
+	WiggleIterator * iter;
+	BigWigWriter * writer;
+} BigWigTeeData;
+
+void BigWigTeeWiggleIteratorPop(WiggleIterator * wi) {
+	BigWigTeeData * data = (BigWigTeeData *) wi->data;
+	WiggleIterator * iter = data->iter;
+
+	if (!iter->done) {
+		wi->chrom = iter->chrom;
+		wi->start = iter->start;
+		wi->finish = iter->finish;
+		wi->value = iter->value;
+		addBigWigValue(data->writer, iter->chrom, iter->start, iter->finish, iter->value);
+		pop(iter);
+	} else {
+		finishBigWigWriter(data->writer);
+		wi->done = true;
+	}
+}
+
+void BigWigTeeWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BigWigTeeData * data = (BigWigTeeData *) wi->data;
+	seek(data->iter, chrom, start, finish);
+	wi->done = false;
+	pop(wi);
+}
+
+static WiggleIterator * newBigWigTeeWiggleIterator(WiggleIterator * i, FILE * outfile, int * reductions, int count) {
+	BigWigTeeData * data = (BigWigTeeData *) calloc(1, sizeof(BigWigTeeData));
+	data->iter = BigWigWriterInput(i);
+	data->writer = openBigWigWriter(outfile);
+	if (count)
+		setBigWigZoomLevels(data->writer, reductions, count);
+	return newWiggleIterator(data, &BigWigTeeWiggleIteratorPop, &BigWigTeeWiggleIteratorSeek, i->default_value);
+}
+
+WiggleIterator * BigWigTeeWiggleIterator(WiggleIterator * i, FILE * outfile) {
+	return newBigWigTeeWiggleIterator(i, outfile, NULL, 0);
+}
+
+WiggleIterator * ZoomedBigWigTeeWiggleIterator(WiggleIterator * i, FILE * outfile, int * reductions, int count) {
+	return newBigWigTeeWiggleIterator(i, outfile, reductions, count);
+}
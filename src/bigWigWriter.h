@@ -0,0 +1,47 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BIG_WIG_WRITER_H_
+#define _BIG_WIG_WRITER_H_
+
+#include <stdio.h>
+#include "wiggleIterator.h"
+
+typedef struct bigWigWriter_st BigWigWriter;
+
+// Values must arrive sorted, in 1-based half open coordinates
+BigWigWriter * openBigWigWriter(FILE * file);
+void addBigWigValue(BigWigWriter * writer, char * chrom, int start, int finish, double value);
+// Zoom levels of the given reductions, in bases, instead of the default ones
+void setBigWigZoomLevels(BigWigWriter * writer, int * reductions, int count);
+// Writes the indices and zoom levels. Adding values afterwards reopens the file.
+void finishBigWigWriter(BigWigWriter * writer);
+
+// Sections of BigWig partial files, see --shard: the values of a region,
+// stored as PartialRecords in the records file, are compressed into data
+// blocks, along with the finest zoom level of the region. The rank of the
+// chromosome in the chromosome sizes is its id in the BigWig file.
+void writeBigWigPartialSection(FILE * file, const char * chrom, int chromId, int chromLength, FILE * records);
+// Writes the sections of the partial files, in order, into a BigWig file,
+// then closes and frees the files. The data blocks are copied as they are,
+// only the index and the zoom levels are computed.
+void mergeBigWigPartials(FILE * output, FILE ** files, int count);
+
+// Reformats an iterator into non-overlapping runs, as BigWig files require
+WiggleIterator * BigWigWriterInput(WiggleIterator * iter);
+bool isBigWigFilename(const char * filename);
+// Also used by BGZF outputs
+int getCompressionThreads();
+
+#endif
@@ -12,70 +12,122 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+
 // Local header
 #include "bigFileReader.h"
+#include "asyncReads.h"
 
-bool readBigWigBuffer(BigFileReaderData * data) {
+// Fields are copied as is when the file has the byte order of the machine
+static inline bits32 readBits32(char ** ptr, bool isSwapped) {
+	bits32 value;
+	if (isSwapped)
+		return memReadBits32(ptr, isSwapped);
+	memcpy(&value, *ptr, sizeof(value));
+	*ptr += sizeof(value);
+	return value;
+}
+
+static inline float readFloat(char ** ptr, bool isSwapped) {
+	float value;
+	if (isSwapped)
+		return memReadFloat(ptr, isSwapped);
+	memcpy(&value, *ptr, sizeof(value));
+	*ptr += sizeof(value);
+	return value;
+}
+
+// Decodes items first to first + count - 1 of a section, one loop per section type
+static void decodeBigWigItems(struct bwgSectionHead * head, char ** ptr, bool isSwapped, int first, int count, int * starts, int * finishes, StoredValue * values) {
+	int i;
+
+	// +1 because BigWig coords are 0-based...
+	switch (head->type) {
+	case bwgTypeBedGraph:
+		for (i = 0; i < count; i++) {
+			starts[i] = readBits32(ptr, isSwapped) + 1;
+			finishes[i] = readBits32(ptr, isSwapped) + 1;
+			values[i] = readFloat(ptr, isSwapped);
+		}
+		break;
+	case bwgTypeVariableStep:
+		for (i = 0; i < count; i++) {
+			starts[i] = readBits32(ptr, isSwapped) + 1;
+			finishes[i] = starts[i] + head->itemSpan;
+			values[i] = readFloat(ptr, isSwapped);
+		}
+		break;
+	case bwgTypeFixedStep:
+		for (i = 0; i < count; i++) {
+			starts[i] = head->start + 1 + (first + i) * head->itemStep;
+			finishes[i] = starts[i] + head->itemSpan;
+			values[i] = readFloat(ptr, isSwapped);
+		}
+		break;
+	}
+}
+
+// Number of the count items decoded above which start before stop, whose ends are clipped to it
+static int clipBigWigItems(int stop, int count, int * starts, int * finishes) {
 	int i;
-	int start, finish;
-	double value;
+
+	if (stop <= 0)
+		return count;
+	for (i = 0; i < count; i++) {
+		if (starts[i] >= stop)
+			return i;
+		if (finishes[i] > stop)
+			finishes[i] = stop;
+	}
+	return count;
+}
+
+// Items outside the regions being read, or of reversed blocks, are pushed one by one
+#define ITEM_BATCH 1024
+
+static bool filterBigWigSection(BigFileReaderData * data, struct bwgSectionHead * head, char * blockPt) {
+	int starts[ITEM_BATCH], finishes[ITEM_BATCH];
+	StoredValue values[ITEM_BATCH];
+	int first, count, kept, i;
+
+	for (first = 0; first < head->itemCount; first += count) {
+		count = head->itemCount - first < ITEM_BATCH ? head->itemCount - first : ITEM_BATCH;
+		decodeBigWigItems(head, &blockPt, data->isSwapped, first, count, starts, finishes, values);
+		kept = clipBigWigItems(data->stop, count, starts, finishes);
+		for (i = 0; i < kept; i++)
+			if (pushBigFileRecord(data, starts[i], finishes[i], values[i], 0))
+				return true;
+		if (kept < count)
+			return true;
+	}
+	return false;
+}
+
+// Otherwise they are decoded straight into the buffer
+bool readBigWigBuffer(BigFileReaderData * data) {
 	char *blockPt = data->uncompressBuf;
 	struct bwgSectionHead head;
-	start = finish = 0;
+	int first, count, kept;
+	int * starts, * finishes;
+	StoredValue * values;
 	
 	bwgSectionHeadFromMem(&(blockPt), &(head), data->isSwapped);
+	if (head.type != bwgTypeBedGraph && head.type != bwgTypeVariableStep && head.type != bwgTypeFixedStep) {
+		fprintf(stderr, "Unrecognized head type in Wiggle file\n");
+		raiseError();
+	}
 
-        for (i = 0; i < head.itemCount; i++) {
-		switch (head.type)
-		    {
-		    case bwgTypeBedGraph:
-			{
-			// +1 because BigWig coords are 0-based...
-			start = memReadBits32(&(blockPt), data->isSwapped) + 1;
-			finish = memReadBits32(&(blockPt), data->isSwapped) + 1;
-			value = memReadFloat(&(blockPt), data->isSwapped);
-			break;
-			}
-		    case bwgTypeVariableStep:
-			{
-			// +1 because BigWig coords are 0-based...
-			start = memReadBits32(&(blockPt), data->isSwapped) + 1;
-			finish = start + head.itemSpan;
-			value = memReadFloat(&(blockPt), data->isSwapped);
-			break;
-			}
-		    case bwgTypeFixedStep:
-			{
-			if (i==0) 
-			    {
-			    // +1 because BigWig coords are 0-based...
-			    start = head.start + 1;
-			    finish = start + head.itemSpan;
-			    value = memReadFloat(&(blockPt), data->isSwapped);
-			    }
-			else
-			    {
-			    start += head.itemStep;
-			    finish += head.itemStep;
-			    value = memReadFloat(&(blockPt), data->isSwapped);
-			    }
-			break;
-			}
-		    default:
-			{
-			fprintf(stderr, "Unrecognized head type in Wiggle file\n");
-			exit(1);
-			}
-		    }
-		if (data->stop > 0) {
-			if (start >= data->stop) {
-				return true;
-			} else if (finish > data->stop) {
-				finish = data->stop;
-			}
-		}
+	if (data->regionCount || data->reverse)
+		return filterBigWigSection(data, &head, blockPt);
 
-		if (pushValuesToBuffer(data->bufferedReaderData, data->chrom, start, finish, value))
+	for (first = 0; first < head.itemCount; first += count) {
+		count = reserveBufferedRecords(data->bufferedReaderData, head.itemCount - first, &starts, &finishes, &values);
+		if (count == 0)
+			return true;
+		decodeBigWigItems(&head, &blockPt, data->isSwapped, first, count, starts, finishes, values);
+		kept = clipBigWigItems(data->stop, count, starts, finishes);
+		commitBufferedRecords(data->bufferedReaderData, data->chrom, kept);
+		if (kept < count)
 			return true;
 	}
 
@@ -83,19 +135,64 @@ bool readBigWigBuffer(BigFileReaderData * data) {
 }
 
 static void openBigWigFile(BigFileReaderData * data, char * filename, bool holdFire) {
-	data->filename = filename;
-	data->bwf = bigWigFileOpen(data->filename);
-	data->isSwapped = data->bwf->isSwapped;
-	bbiAttachUnzoomedCir(data->bwf);
-	data->udc = data->bwf->udc;
+	openBigFileReaderData(data, filename, false);
 	data->readBuffer = &readBigWigBuffer;
-	data->uncompressBuf = (char *) needLargeMem(data->bwf->uncompressBufSize);
+	data->hasValueRange = data->shared->hasValueRange;
+	data->minValue = data->shared->minValue;
+	data->maxValue = data->shared->maxValue;
 	if (!holdFire)
 		launchBufferedReader(&downloadBigFile, data, &(data->bufferedReaderData));
 }
 
+// Summaries are read from the coarsest zoom level fine enough for the bins
+static bool BigWiggleReaderSummarize(WiggleIterator * wi, const char * chrom, int start, int finish, RegionSummary * summaries, int count) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data;
+	struct bbiSummaryElement * elements = (struct bbiSummaryElement *) calloc(count, sizeof(struct bbiSummaryElement));
+	int i;
+
+	// Summaries replace the records, the stream must be sought again afterwards
+	if (data->bufferedReaderData)
+		stopBufferedReader(data->bufferedReaderData);
+	wi->done = true;
+
+	// -1 because BigWig coords are 0-based...
+	summarizeSharedBigFile(data->shared, (char *) chrom, start - 1, finish - 1, count, elements);
+
+	for (i = 0; i < count; i++) {
+		summaries[i].validCount = elements[i].validCount;
+		summaries[i].min = elements[i].minVal;
+		summaries[i].max = elements[i].maxVal;
+		summaries[i].sum = elements[i].sumData;
+		summaries[i].sumSquares = elements[i].sumSquares;
+	}
+
+	free(elements);
+	return true;
+}
+
+// BigWig records are unstranded
+static void BigWiggleReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data;
+	BufferedReaderPopBatch(wi, data->bufferedReaderData, batch);
+}
+
+static bool BigWiggleReaderValueRange(WiggleIterator * wi, double * min, double * max) {
+	BigFileReaderData * data = (BigFileReaderData *) wi->data;
+	*min = data->minValue;
+	*max = data->maxValue;
+	return data->hasValueRange;
+}
+
 WiggleIterator * BigWiggleReader(char * f, bool holdFire) {
 	BigFileReaderData * data = (BigFileReaderData *) calloc(1, sizeof(BigFileReaderData));
 	openBigWigFile(data, f, holdFire);
-	return newWiggleIterator(data, &BigFileReaderPop, &BigFileReaderSeek, 0);
+	WiggleIterator * new = newWiggleIterator(data, &BigFileReaderPop, &BigFileReaderSeek, 0);
+	new->summarize = &BigWiggleReaderSummarize;
+	new->valueRange = &BigWiggleReaderValueRange;
+	new->popBatch = &BigWiggleReaderPopBatch;
+	new->seekRegions = &BigFileReaderSeekRegions;
+	new->skipTo = &BigFileReaderSkipTo;
+	new->seekReverse = &BigFileReaderSeekReverse;
+	new->seekCost = readerSeekCost(f, true);
+	return new;
 }	
@@ -0,0 +1,650 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "bitMask.h"
+#include "chromosomes.h"
+
+#define CHUNK_BITS 16
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNK_WORDS (CHUNK_SIZE / 64)
+// Runs take 4 bytes each, so from this many on a bitmap is smaller
+#define MAX_RUNS (CHUNK_WORDS * 2)
+
+typedef struct maskChunk_st {
+	// Bitmap of the chunk, NULL if it is stored as runs
+	uint64_t * words;
+	// First and last offsets of each run, in order
+	uint16_t * runs;
+	int runCount;
+} MaskChunk;
+
+typedef struct chromMask_st {
+	char * chrom;
+	MaskChunk * chunks;
+	int chunkCount;
+	int chunkCapacity;
+} ChromMask;
+
+struct bitMask_st {
+	// Sorted by compareChroms
+	ChromMask * chroms;
+	int count;
+	int capacity;
+};
+
+static const MaskChunk emptyChunk = {NULL, NULL, 0};
+
+enum maskOperation {MASK_AND, MASK_OR, MASK_AND_NOT};
+
+//////////////////////////////////////////////////////
+// Bitmaps
+//////////////////////////////////////////////////////
+
+// Sets the bits from first to last included
+static void setBits(uint64_t * words, int first, int last) {
+	int firstWord = first >> 6, lastWord = last >> 6;
+	uint64_t head = ~0ULL << (first & 63);
+	uint64_t tail = ~0ULL >> (63 - (last & 63));
+	int i;
+
+	if (firstWord == lastWord) {
+		words[firstWord] |= head & tail;
+		return;
+	}
+	words[firstWord] |= head;
+	for (i = firstWord + 1; i < lastWord; i++)
+		words[i] = ~0ULL;
+	words[lastWord] |= tail;
+}
+
+// Number of bits set from first to last included
+static long long countBits(const uint64_t * words, int first, int last) {
+	int firstWord = first >> 6, lastWord = last >> 6;
+	uint64_t head = ~0ULL << (first & 63);
+	uint64_t tail = ~0ULL >> (63 - (last & 63));
+	long long count;
+	int i;
+
+	if (firstWord == lastWord)
+		return __builtin_popcountll(words[firstWord] & head & tail);
+	count = __builtin_popcountll(words[firstWord] & head) + __builtin_popcountll(words[lastWord] & tail);
+	for (i = firstWord + 1; i < lastWord; i++)
+		count += __builtin_popcountll(words[i]);
+	return count;
+}
+
+// First offset from offset whose bit is set, or clear if flip is all ones.
+// CHUNK_SIZE if there is none.
+static int nextBit(const uint64_t * words, int offset, uint64_t flip) {
+	int index = offset >> 6;
+	uint64_t word;
+
+	if (offset >= CHUNK_SIZE)
+		return CHUNK_SIZE;
+	word = (words[index] ^ flip) & (~0ULL << (offset & 63));
+	while (!word) {
+		if (++index == CHUNK_WORDS)
+			return CHUNK_SIZE;
+		word = words[index] ^ flip;
+	}
+	return index * 64 + __builtin_ctzll(word);
+}
+
+// Last offset up to offset whose bit is set, or clear if flip is all ones.
+// -1 if there is none.
+static int previousBit(const uint64_t * words, int offset, uint64_t flip) {
+	int index = offset >> 6;
+	uint64_t word = (words[index] ^ flip) & (~0ULL >> (63 - (offset & 63)));
+
+	while (!word) {
+		if (--index < 0)
+			return -1;
+		word = words[index] ^ flip;
+	}
+	return index * 64 + 63 - __builtin_clzll(word);
+}
+
+//////////////////////////////////////////////////////
+// Chunks
+//////////////////////////////////////////////////////
+
+static bool isEmptyChunk(const MaskChunk * chunk) {
+	return !chunk->words && !chunk->runCount;
+}
+
+static void expandChunk(const MaskChunk * chunk, uint64_t * words) {
+	int i;
+
+	if (chunk->words) {
+		memcpy(words, chunk->words, CHUNK_WORDS * sizeof(uint64_t));
+		return;
+	}
+	memset(words, 0, CHUNK_WORDS * sizeof(uint64_t));
+	for (i = 0; i < chunk->runCount; i++)
+		setBits(words, chunk->runs[2 * i], chunk->runs[2 * i + 1]);
+}
+
+// Stores the bitmap in the chunk, as runs if they take less space
+static void packChunk(MaskChunk * chunk, const uint64_t * words) {
+	uint64_t carry = 0;
+	int i, runCount = 0, offset, end;
+
+	// A run starts on each bit set after a clear one
+	for (i = 0; i < CHUNK_WORDS; i++) {
+		runCount += __builtin_popcountll(words[i] & ~((words[i] << 1) | carry));
+		carry = words[i] >> 63;
+	}
+
+	chunk->words = NULL;
+	chunk->runs = NULL;
+	chunk->runCount = 0;
+	if (runCount >= MAX_RUNS) {
+		chunk->words = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+		memcpy(chunk->words, words, CHUNK_WORDS * sizeof(uint64_t));
+		return;
+	}
+	if (runCount)
+		chunk->runs = (uint16_t *) malloc(2 * runCount * sizeof(uint16_t));
+	for (offset = nextBit(words, 0, 0); offset < CHUNK_SIZE; offset = nextBit(words, end, 0)) {
+		end = nextBit(words, offset, ~0ULL);
+		chunk->runs[2 * chunk->runCount] = offset;
+		chunk->runs[2 * chunk->runCount + 1] = end - 1;
+		chunk->runCount++;
+	}
+}
+
+static void copyChunk(MaskChunk * dest, const MaskChunk * src) {
+	*dest = *src;
+	if (src->words) {
+		dest->words = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+		memcpy(dest->words, src->words, CHUNK_WORDS * sizeof(uint64_t));
+	} else if (src->runCount) {
+		dest->runs = (uint16_t *) malloc(2 * src->runCount * sizeof(uint16_t));
+		memcpy(dest->runs, src->runs, 2 * src->runCount * sizeof(uint16_t));
+	}
+}
+
+// Index of the first run which ends at or after offset
+static int findRun(const MaskChunk * chunk, int offset) {
+	int low = 0, high = chunk->runCount;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (chunk->runs[2 * middle + 1] < offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// First offset from offset in the chunk, CHUNK_SIZE if there is none
+static int chunkNextSet(const MaskChunk * chunk, int offset) {
+	int run;
+
+	if (chunk->words)
+		return nextBit(chunk->words, offset, 0);
+	if ((run = findRun(chunk, offset)) == chunk->runCount)
+		return CHUNK_SIZE;
+	return chunk->runs[2 * run] > offset ? chunk->runs[2 * run] : offset;
+}
+
+// First offset after offset, which is in the chunk, which is not
+static int chunkNextClear(const MaskChunk * chunk, int offset) {
+	if (chunk->words)
+		return nextBit(chunk->words, offset, ~0ULL);
+	return chunk->runs[2 * findRun(chunk, offset) + 1] + 1;
+}
+
+// First offset of the run of the chunk which holds offset
+static int chunkRunStart(const MaskChunk * chunk, int offset) {
+	if (chunk->words)
+		return previousBit(chunk->words, offset, ~0ULL) + 1;
+	return chunk->runs[2 * findRun(chunk, offset)];
+}
+
+// Number of offsets from first to last included in the chunk
+static long long countChunk(const MaskChunk * chunk, int first, int last) {
+	long long count = 0;
+	int run;
+
+	if (chunk->words)
+		return countBits(chunk->words, first, last);
+	for (run = findRun(chunk, first); run < chunk->runCount && chunk->runs[2 * run] <= last; run++) {
+		int from = chunk->runs[2 * run] > first ? chunk->runs[2 * run] : first;
+		int to = chunk->runs[2 * run + 1] < last ? chunk->runs[2 * run + 1] : last;
+		count += to - from + 1;
+	}
+	return count;
+}
+
+//////////////////////////////////////////////////////
+// Masks
+//////////////////////////////////////////////////////
+
+static ChromMask * addChromMask(BitMask * mask, char * chrom, int chunkCount) {
+	ChromMask * chromMask;
+
+	if (mask->count == mask->capacity) {
+		mask->capacity = mask->capacity ? 2 * mask->capacity : 32;
+		mask->chroms = (ChromMask *) realloc(mask->chroms, mask->capacity * sizeof(ChromMask));
+	}
+	chromMask = mask->chroms + mask->count++;
+	chromMask->chrom = chrom;
+	chromMask->chunkCount = chunkCount;
+	chromMask->chunkCapacity = chunkCount;
+	chromMask->chunks = (MaskChunk *) calloc(chunkCount ? chunkCount : 1, sizeof(MaskChunk));
+	return chromMask;
+}
+
+static const ChromMask * findChromMask(const BitMask * mask, const char * chrom) {
+	int low = 0, high = mask->count;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+		int cmp = compareChroms(mask->chroms[middle].chrom, chrom);
+		if (cmp == 0)
+			return mask->chroms + middle;
+		else if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return NULL;
+}
+
+static const MaskChunk * getChunk(const ChromMask * chromMask, int index) {
+	if (!chromMask || index >= chromMask->chunkCount)
+		return &emptyChunk;
+	return chromMask->chunks + index;
+}
+
+// While a mask is built, its chunks are plain bitmaps until packed
+static MaskChunk * openChunk(ChromMask * chromMask, int index) {
+	MaskChunk * chunk;
+
+	if (index >= chromMask->chunkCapacity) {
+		int capacity = 2 * chromMask->chunkCapacity > index ? 2 * chromMask->chunkCapacity : index + 1;
+		chromMask->chunks = (MaskChunk *) realloc(chromMask->chunks, capacity * sizeof(MaskChunk));
+		memset(chromMask->chunks + chromMask->chunkCapacity, 0, (capacity - chromMask->chunkCapacity) * sizeof(MaskChunk));
+		chromMask->chunkCapacity = capacity;
+	}
+	if (index >= chromMask->chunkCount)
+		chromMask->chunkCount = index + 1;
+	chunk = chromMask->chunks + index;
+	if (!chunk->words)
+		chunk->words = (uint64_t *) calloc(CHUNK_WORDS, sizeof(uint64_t));
+	return chunk;
+}
+
+static void packChunks(ChromMask * chromMask, int from, int to) {
+	int index;
+
+	for (index = from; index < to && index < chromMask->chunkCount; index++) {
+		MaskChunk * chunk = chromMask->chunks + index;
+		uint64_t * words = chunk->words;
+		if (words) {
+			packChunk(chunk, words);
+			free(words);
+		}
+	}
+}
+
+// Records come sorted by start, so the chunks before the start of a record
+// are complete and get packed
+BitMask * newBitMask(WiggleIterator * iter) {
+	BitMask * mask = (BitMask *) calloc(1, sizeof(BitMask));
+	ChromMask * current = NULL;
+	int packed = 0;
+	int index;
+
+	for (; !iter->done; pop(iter)) {
+		if (iter->value == 0 || isnan(iter->value) || iter->finish <= iter->start)
+			continue;
+		if (!current || strcmp(current->chrom, iter->chrom)) {
+			if (current && compareChroms(current->chrom, iter->chrom) > 0) {
+				fprintf(stderr, "Cannot mask unsorted input: %s comes after %s\n", iter->chrom, current->chrom);
+				raiseError();
+			}
+			if (current)
+				packChunks(current, packed, current->chunkCount);
+			current = addChromMask(mask, internChromosome(iter->chrom), 0);
+			packed = 0;
+		}
+
+		index = iter->start >> CHUNK_BITS;
+		if (index > packed) {
+			packChunks(current, packed, index);
+			packed = index;
+		}
+		for (; index <= (iter->finish - 1) >> CHUNK_BITS; index++) {
+			int base = index << CHUNK_BITS;
+			int first = iter->start > base ? iter->start - base : 0;
+			int last = iter->finish - 1 < base + CHUNK_SIZE - 1 ? iter->finish - 1 - base : CHUNK_SIZE - 1;
+			setBits(openChunk(current, index)->words, first, last);
+		}
+	}
+	if (current)
+		packChunks(current, packed, current->chunkCount);
+	return mask;
+}
+
+static void combineChromMasks(ChromMask * result, const ChromMask * A, const ChromMask * B, enum maskOperation operation, uint64_t * wordsA, uint64_t * wordsB) {
+	int index, i;
+
+	for (index = 0; index < result->chunkCount; index++) {
+		const MaskChunk * chunkA = getChunk(A, index);
+		const MaskChunk * chunkB = getChunk(B, index);
+
+		if (isEmptyChunk(chunkA) && operation != MASK_OR)
+			continue;
+		if (isEmptyChunk(chunkB)) {
+			if (operation != MASK_AND)
+				copyChunk(result->chunks + index, chunkA);
+			continue;
+		}
+		if (isEmptyChunk(chunkA)) {
+			copyChunk(result->chunks + index, chunkB);
+			continue;
+		}
+
+		expandChunk(chunkA, wordsA);
+		expandChunk(chunkB, wordsB);
+		switch (operation) {
+		case MASK_AND:
+			for (i = 0; i < CHUNK_WORDS; i++)
+				wordsA[i] &= wordsB[i];
+			break;
+		case MASK_OR:
+			for (i = 0; i < CHUNK_WORDS; i++)
+				wordsA[i] |= wordsB[i];
+			break;
+		case MASK_AND_NOT:
+			for (i = 0; i < CHUNK_WORDS; i++)
+				wordsA[i] &= ~wordsB[i];
+			break;
+		}
+		packChunk(result->chunks + index, wordsA);
+	}
+}
+
+static BitMask * combineBitMasks(const BitMask * A, const BitMask * B, enum maskOperation operation) {
+	BitMask * result = (BitMask *) calloc(1, sizeof(BitMask));
+	uint64_t * wordsA = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+	uint64_t * wordsB = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+	int indexA = 0, indexB = 0;
+
+	while (indexA < A->count || indexB < B->count) {
+		int cmp;
+		const ChromMask * chromA = NULL;
+		const ChromMask * chromB = NULL;
+		int countA, countB, count;
+
+		if (indexA == A->count)
+			cmp = 1;
+		else if (indexB == B->count)
+			cmp = -1;
+		else
+			cmp = compareChroms(A->chroms[indexA].chrom, B->chroms[indexB].chrom);
+		if (cmp <= 0)
+			chromA = A->chroms + indexA++;
+		if (cmp >= 0)
+			chromB = B->chroms + indexB++;
+
+		if (!chromA && operation != MASK_OR)
+			continue;
+		if (!chromB && operation == MASK_AND)
+			continue;
+		countA = chromA ? chromA->chunkCount : 0;
+		countB = chromB ? chromB->chunkCount : 0;
+		if (operation == MASK_AND)
+			count = countA < countB ? countA : countB;
+		else if (operation == MASK_OR)
+			count = countA > countB ? countA : countB;
+		else
+			count = countA;
+		combineChromMasks(addChromMask(result, chromA ? chromA->chrom : chromB->chrom, count), chromA, chromB, operation, wordsA, wordsB);
+	}
+
+	free(wordsA);
+	free(wordsB);
+	return result;
+}
+
+BitMask * andBitMasks(const BitMask * A, const BitMask * B) {
+	return combineBitMasks(A, B, MASK_AND);
+}
+
+BitMask * orBitMasks(const BitMask * A, const BitMask * B) {
+	return combineBitMasks(A, B, MASK_OR);
+}
+
+BitMask * andNotBitMasks(const BitMask * A, const BitMask * B) {
+	return combineBitMasks(A, B, MASK_AND_NOT);
+}
+
+long long countBitMask(const BitMask * mask, const char * chrom, int start, int finish) {
+	const ChromMask * chromMask = findChromMask(mask, chrom);
+	long long count = 0;
+	int index;
+
+	if (!chromMask || finish <= start)
+		return 0;
+	for (index = start >> CHUNK_BITS; index <= (finish - 1) >> CHUNK_BITS && index < chromMask->chunkCount; index++) {
+		int base = index << CHUNK_BITS;
+		int first = start > base ? start - base : 0;
+		int last = finish - 1 < base + CHUNK_SIZE - 1 ? finish - 1 - base : CHUNK_SIZE - 1;
+		count += countChunk(chromMask->chunks + index, first, last);
+	}
+	return count;
+}
+
+//////////////////////////////////////////////////////
+// Mask iterator
+//////////////////////////////////////////////////////
+
+typedef struct bitMaskIteratorData_st {
+	BitMask * mask;
+	int chrom;
+	// Next position looked at
+	int position;
+	// Set once seeked, the positions are then limited to a region
+	bool limited;
+	int start, stop;
+} BitMaskIteratorData;
+
+// First position from position in the mask, -1 if there is none
+static int nextSetPosition(const ChromMask * chromMask, int position) {
+	int index;
+
+	for (index = position >> CHUNK_BITS; index < chromMask->chunkCount; index++) {
+		int from = index == position >> CHUNK_BITS ? position & (CHUNK_SIZE - 1) : 0;
+		int offset = chunkNextSet(chromMask->chunks + index, from);
+		if (offset < CHUNK_SIZE)
+			return (index << CHUNK_BITS) + offset;
+	}
+	return -1;
+}
+
+// First position after position, which is in the mask, which is not.
+// Runs carry on across the chunks.
+static int nextClearPosition(const ChromMask * chromMask, int position) {
+	int index = position >> CHUNK_BITS;
+	int offset = chunkNextClear(chromMask->chunks + index, position & (CHUNK_SIZE - 1));
+
+	while (offset == CHUNK_SIZE) {
+		if (++index == chromMask->chunkCount || chunkNextSet(chromMask->chunks + index, 0) != 0)
+			return index << CHUNK_BITS;
+		offset = chunkNextClear(chromMask->chunks + index, 0);
+	}
+	return (index << CHUNK_BITS) + offset;
+}
+
+// First position of the run which holds position
+static int runStartPosition(const ChromMask * chromMask, int position) {
+	int index = position >> CHUNK_BITS;
+	int offset = chunkRunStart(chromMask->chunks + index, position & (CHUNK_SIZE - 1));
+
+	while (offset == 0 && index > 0 && countChunk(chromMask->chunks + index - 1, CHUNK_SIZE - 1, CHUNK_SIZE - 1))
+		offset = chunkRunStart(chromMask->chunks + --index, CHUNK_SIZE - 1);
+	return (index << CHUNK_BITS) + offset;
+}
+
+static void BitMaskIteratorPop(WiggleIterator * wi) {
+	BitMaskIteratorData * data = (BitMaskIteratorData *) wi->data;
+	BitMask * mask = data->mask;
+	int start;
+
+	while (data->chrom < mask->count) {
+		ChromMask * chromMask = mask->chroms + data->chrom;
+		start = nextSetPosition(chromMask, data->position);
+		if (start >= 0 && !(data->limited && start >= data->stop)) {
+			wi->chrom = chromMask->chrom;
+			wi->start = start;
+			wi->finish = nextClearPosition(chromMask, start);
+			if (data->limited && wi->finish > data->stop)
+				wi->finish = data->stop;
+			wi->value = 1;
+			data->position = wi->finish;
+			return;
+		}
+		if (data->limited)
+			break;
+		data->chrom++;
+		data->position = 0;
+	}
+	wi->done = true;
+}
+
+static void BitMaskIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BitMaskIteratorData * data = (BitMaskIteratorData *) wi->data;
+	const ChromMask * chromMask = findChromMask(data->mask, chrom);
+
+	wi->done = false;
+	data->limited = true;
+	data->start = start;
+	data->stop = finish;
+	data->position = start;
+	if (!chromMask) {
+		wi->done = true;
+		return;
+	}
+	data->chrom = chromMask - data->mask->chroms;
+	BitMaskIteratorPop(wi);
+}
+
+// The record which holds chrom:start, if any, is left whole
+static void BitMaskIteratorSkipTo(WiggleIterator * wi, const char * chrom, int start) {
+	BitMaskIteratorData * data = (BitMaskIteratorData *) wi->data;
+	BitMask * mask = data->mask;
+	int cmp, low, high;
+
+	if (wi->done || (cmp = compareChroms(wi->chrom, chrom)) > 0 || (cmp == 0 && wi->finish > start))
+		return;
+	if (cmp < 0) {
+		if (data->limited) {
+			wi->done = true;
+			return;
+		}
+		// First chromosome from chrom on
+		low = data->chrom;
+		high = mask->count;
+		while (low < high) {
+			int middle = (low + high) / 2;
+			if (compareChroms(mask->chroms[middle].chrom, chrom) < 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		data->chrom = low;
+		data->position = 0;
+		if (low == mask->count || compareChroms(mask->chroms[low].chrom, chrom) > 0) {
+			BitMaskIteratorPop(wi);
+			return;
+		}
+	}
+
+	data->position = start;
+	BitMaskIteratorPop(wi);
+	if (!wi->done && wi->start == start) {
+		wi->start = runStartPosition(mask->chroms + data->chrom, start);
+		if (data->limited && wi->start < data->start)
+			wi->start = data->start;
+	}
+}
+
+// Summaries are exact, the positions in each bin are counted
+static bool BitMaskIteratorSummarize(WiggleIterator * wi, const char * chrom, int start, int finish, RegionSummary * summaries, int count) {
+	BitMaskIteratorData * data = (BitMaskIteratorData *) wi->data;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int binStart = start + (int) ((finish - start) * (long long) i / count);
+		int binFinish = start + (int) ((finish - start) * (long long) (i + 1) / count);
+		double covered = countBitMask(data->mask, chrom, binStart, binFinish);
+		summaries[i].validCount = covered;
+		summaries[i].sum = covered;
+		summaries[i].sumSquares = covered;
+		summaries[i].min = covered ? 1 : 0;
+		summaries[i].max = covered ? 1 : 0;
+	}
+	return true;
+}
+
+WiggleIterator * BitMaskIterator(BitMask * mask) {
+	BitMaskIteratorData * data = (BitMaskIteratorData *) calloc(1, sizeof(BitMaskIteratorData));
+	data->mask = mask;
+	WiggleIterator * res = newWiggleIterator(data, &BitMaskIteratorPop, &BitMaskIteratorSeek, 0);
+	res->summarize = &BitMaskIteratorSummarize;
+	res->skipTo = &BitMaskIteratorSkipTo;
+	res->compressed = true;
+	return res;
+}
+
+BitMask * iteratorBitMask(WiggleIterator * iter) {
+	if (iter->pop != &BitMaskIteratorPop)
+		return NULL;
+	return ((BitMaskIteratorData *) iter->data)->mask;
+}
+
+//////////////////////////////////////////////////////
+// Mask operators
+//////////////////////////////////////////////////////
+
+// Masks are combined as they are, other inputs are read into a mask first
+static BitMask * readBitMask(WiggleIterator * iter) {
+	BitMask * mask = iteratorBitMask(iter);
+	return mask ? mask : newBitMask(iter);
+}
+
+WiggleIterator * MaskWiggleIterator(WiggleIterator * iter) {
+	return BitMaskIterator(readBitMask(iter));
+}
+
+WiggleIterator * AndMaskWiggleIterator(WiggleIterator * A, WiggleIterator * B) {
+	return BitMaskIterator(andBitMasks(readBitMask(A), readBitMask(B)));
+}
+
+WiggleIterator * OrMaskWiggleIterator(WiggleIterator * A, WiggleIterator * B) {
+	return BitMaskIterator(orBitMasks(readBitMask(A), readBitMask(B)));
+}
+
+WiggleIterator * AndNotMaskWiggleIterator(WiggleIterator * A, WiggleIterator * B) {
+	return BitMaskIterator(andNotBitMasks(readBitMask(A), readBitMask(B)));
+}
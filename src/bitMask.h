@@ -0,0 +1,43 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BIT_MASK_H_
+#define _BIT_MASK_H_
+
+// Masks of positions, read once from an iterator and combined in memory
+//
+// Each chromosome is cut into chunks of 2^16 bases, stored as sorted runs
+// when they have few, as a bitmap of 1024 words otherwise. Masks are
+// combined and counted one word at a time, runs being expanded on the fly.
+
+#include "wiggleIterator.h"
+
+typedef struct bitMask_st BitMask;
+
+// Positions where the iterator is non-zero and not NaN, the iterator is
+// read to the end
+BitMask * newBitMask(WiggleIterator * iter);
+BitMask * andBitMasks(const BitMask * A, const BitMask * B);
+BitMask * orBitMasks(const BitMask * A, const BitMask * B);
+// Positions of A which are not in B
+BitMask * andNotBitMasks(const BitMask * A, const BitMask * B);
+// Number of positions of chrom:start-finish in the mask
+long long countBitMask(const BitMask * mask, const char * chrom, int start, int finish);
+
+// Contiguous positions of the mask, with value 1
+WiggleIterator * BitMaskIterator(BitMask * mask);
+// Mask read by an iterator made by BitMaskIterator, NULL for other iterators
+BitMask * iteratorBitMask(WiggleIterator * iter);
+
+#endif
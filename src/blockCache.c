@@ -0,0 +1,262 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/types.h>
+
+#include "wiggletools.h"
+#include "blockCache.h"
+
+static char * cacheDirectory = NULL;
+static long long cacheMaxSize = 0;
+// Bytes stored by this process since the last pruning
+static long long storedSincePrune = 0;
+static long long hits = 0, misses = 0, hitBytes = 0, missBytes = 0;
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Room for any path under the cache directory
+#define CACHE_PATH_LENGTH (PATH_MAX + 128)
+// Temporary files older than this were left by a crashed writer
+#define STALE_TMP_SECONDS 3600
+
+void setBlockCache(char * directory, long long maxSize) {
+	if (mkdir(directory, 0777) && errno != EEXIST) {
+		fprintf(stderr, "Could not create cache directory %s\n", directory);
+		raiseError();
+	}
+	cacheDirectory = directory;
+	cacheMaxSize = maxSize;
+	// Prune on first store
+	storedSincePrune = maxSize;
+}
+
+void printBlockCacheStatistics(FILE * file) {
+	fprintf(file, "Block cache: %lli hits (%lli bytes), %lli misses (%lli bytes)\n", hits, hitBytes, misses, missBytes);
+}
+
+int useBlockCache(const char * filename) {
+	return cacheDirectory != NULL && strstr(filename, "://") != NULL;
+}
+
+// FNV-1a
+static unsigned long long hashFilename(const char * filename) {
+	unsigned long long hash = 14695981039346656037ULL;
+	const char * ptr;
+	for (ptr = filename; *ptr; ptr++) {
+		hash ^= (unsigned char) *ptr;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+int cachedFilePath(char * path, int length, const char * filename, const char * suffix) {
+	if (!cacheDirectory)
+		return 0;
+	int written = snprintf(path, length, "%s/%016llx%s", cacheDirectory, hashFilename(filename), suffix);
+	return written >= 0 && written < length;
+}
+
+// Returns 0 if the path does not fit, the block then bypasses the cache
+static int blockPath(char * path, int length, const char * filename, unsigned long long version, unsigned long long offset, unsigned long long size) {
+	int written = snprintf(path, length, "%s/%016llx/%016llx-%llu-%llu", cacheDirectory, hashFilename(filename), version, offset, size);
+	return written >= 0 && written < length;
+}
+
+int readCachedBlock(const char * filename, unsigned long long version, unsigned long long offset, unsigned long long size, char * buffer) {
+	char path[CACHE_PATH_LENGTH];
+	unsigned long long done = 0;
+	int fd;
+
+	if (!blockPath(path, sizeof(path), filename, version, offset, size) || (fd = open(path, O_RDONLY)) < 0) {
+		__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&missBytes, size, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	while (done < size) {
+		ssize_t count = read(fd, buffer + done, size - done);
+		if (count <= 0)
+			break;
+		done += count;
+	}
+
+	if (done < size) {
+		// Truncated by a crash, or deleted under our feet
+		close(fd);
+		__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&missBytes, size, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// Mark as recently used
+	futimens(fd, NULL);
+	close(fd);
+	__atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hitBytes, size, __ATOMIC_RELAXED);
+	return 1;
+}
+
+//////////////////////////////////////////////////////
+// Eviction
+//////////////////////////////////////////////////////
+
+typedef struct cachedFile_st {
+	char * path;
+	// Nanoseconds since the epoch, blocks are often written within the same second
+	long long mtime;
+	long long size;
+} CachedFile;
+
+static int compareCachedFiles(const void * A, const void * B) {
+	const CachedFile * a = (const CachedFile *) A;
+	const CachedFile * b = (const CachedFile *) B;
+	if (a->mtime < b->mtime)
+		return -1;
+	else if (a->mtime > b->mtime)
+		return 1;
+	else
+		return 0;
+}
+
+static void listCachedFiles(const char * directory, CachedFile ** files, int * count, int * capacity, long long * total) {
+	DIR * dir = opendir(directory);
+	struct dirent * entry;
+	struct stat st;
+	char path[CACHE_PATH_LENGTH];
+	int written;
+
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		written = snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		if (written < 0 || written >= (int) sizeof(path))
+			continue;
+		// Temporary files are being written, unless a crash left them behind
+		if (strncmp(entry->d_name, ".tmp-", 5) == 0) {
+			if (stat(path, &st) == 0 && st.st_mtime + STALE_TMP_SECONDS < time(NULL))
+				unlink(path);
+			continue;
+		}
+		// Skip ., .. and the lock
+		if (entry->d_name[0] == '.')
+			continue;
+		if (stat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			listCachedFiles(path, files, count, capacity, total);
+			continue;
+		}
+		if (*count == *capacity) {
+			*capacity = *capacity ? 2 * *capacity : 1024;
+			*files = (CachedFile *) realloc(*files, *capacity * sizeof(CachedFile));
+		}
+		(*files)[*count].path = strdup(path);
+		(*files)[*count].mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		(*files)[*count].size = st.st_size;
+		(*count)++;
+		*total += st.st_size;
+	}
+
+	closedir(dir);
+}
+
+// Deletes the least recently used blocks until the cache is back below 90% of its cap
+static void pruneCache() {
+	char path[CACHE_PATH_LENGTH];
+	CachedFile * files = NULL;
+	int count = 0, capacity = 0, i;
+	long long total = 0;
+
+	// Only one process prunes at a time, the others carry on
+	snprintf(path, sizeof(path), "%s/.lock", cacheDirectory);
+	int lock = open(path, O_CREAT | O_RDWR, 0666);
+	if (lock < 0)
+		return;
+	if (flock(lock, LOCK_EX | LOCK_NB)) {
+		close(lock);
+		return;
+	}
+
+	listCachedFiles(cacheDirectory, &files, &count, &capacity, &total);
+	if (total > cacheMaxSize) {
+		qsort(files, count, sizeof(CachedFile), &compareCachedFiles);
+		for (i = 0; i < count && total > cacheMaxSize * 0.9; i++)
+			if (!unlink(files[i].path))
+				total -= files[i].size;
+	}
+
+	for (i = 0; i < count; i++)
+		free(files[i].path);
+	free(files);
+	flock(lock, LOCK_UN);
+	close(lock);
+}
+
+//////////////////////////////////////////////////////
+// Storage
+//////////////////////////////////////////////////////
+
+void storeCachedBlock(const char * filename, unsigned long long version, unsigned long long offset, unsigned long long size, const char * buffer) {
+	static int tmpCounter = 0;
+	char path[CACHE_PATH_LENGTH], tmpPath[CACHE_PATH_LENGTH];
+	unsigned long long done = 0;
+	int fd, written;
+
+	// The cache is an optimisation, not worth failing over
+	if (!blockPath(path, sizeof(path), filename, version, offset, size))
+		return;
+	snprintf(path, sizeof(path), "%s/%016llx", cacheDirectory, hashFilename(filename));
+	mkdir(path, 0777);
+
+	written = snprintf(tmpPath, sizeof(tmpPath), "%s/.tmp-%i-%i", path, (int) getpid(), __atomic_add_fetch(&tmpCounter, 1, __ATOMIC_RELAXED));
+	if (written < 0 || written >= (int) sizeof(tmpPath) || (fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0666)) < 0)
+		return;
+
+	while (done < size) {
+		ssize_t count = write(fd, buffer + done, size - done);
+		if (count <= 0)
+			break;
+		done += count;
+	}
+	close(fd);
+
+	blockPath(path, sizeof(path), filename, version, offset, size);
+	if (done < size || rename(tmpPath, path)) {
+		unlink(tmpPath);
+		return;
+	}
+
+	// Check the disk usage every tenth of the cap
+	pthread_mutex_lock(&cacheMutex);
+	storedSincePrune += size;
+	bool prune = storedSincePrune * 10 >= cacheMaxSize;
+	if (prune)
+		storedSincePrune = 0;
+	pthread_mutex_unlock(&cacheMutex);
+
+	if (prune)
+		pruneCache();
+}
@@ -0,0 +1,39 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+// On-disk cache of the data blocks of remote BigWig and BigBed files
+//
+// Each block is stored in its own file, named after the file URL, version, offset
+// and size, under the cache directory. The version stamps the remote copy, e.g. 
+// with its modification time, so the blocks of a file replaced on the server are
+// no longer read. Files are written under a temporary name then renamed, so that
+// concurrent processes sharing the directory only ever see complete blocks.
+// Reading a block refreshes its modification time, and when the directory grows 
+// beyond its size cap, the least recently used blocks are deleted, along with
+// the temporary files left over by crashed writers.
+
+// Whether blocks of this file go through the cache (cache enabled and file remote)
+int useBlockCache(const char * filename);
+// Copies the cached block into buffer, returns 0 on a miss
+int readCachedBlock(const char * filename, unsigned long long version, unsigned long long offset, unsigned long long size, char * buffer);
+void storeCachedBlock(const char * filename, unsigned long long version, unsigned long long offset, unsigned long long size, const char * buffer);
+// Path of a file kept in the cache directory about filename, e.g. its index, 
+// named after filename and suffix. Returns 0 if there is no cache directory,
+// or if the path does not fit.
+int cachedFilePath(char * path, int length, const char * filename, const char * suffix);
+
+#endif
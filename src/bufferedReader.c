@@ -12,172 +12,667 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+
 #include "bufferedReader.h"
+#include "packedRecords.h"
+#include "profiler.h"
+#include "tracer.h"
+#include "memoryUsage.h"
+#include "largeBuffers.h"
+#include "ioScheduler.h"
+#include "errors.h"
 
 static int MAX_HEAD_START = 3;
 static int BLOCK_SIZE = 10000;
+// Number of polls before a waiting thread goes to sleep
+static const int SPIN_COUNT = 2000;
+// Bounds of the ring, in blocks: one being written, one being read, and the head start in between
+#define MIN_BLOCKS 2
+#define MAX_BLOCKS 64
+// Records of the decoders which fill the columns themselves, see reserveBufferedRecords
+#define RESERVED_RECORDS 1024
+
+void setMaxHeadStart(int value) {
+	if (value < 0) {
+		fprintf(stderr, "Maximum head start cannot be negative: %i\n", value);
+		raiseError();
+	}
+	if (value > MAX_BLOCKS - MIN_BLOCKS) {
+		fprintf(stderr, "Maximum head start cannot exceed %i: %i\n", MAX_BLOCKS - MIN_BLOCKS, value);
+		raiseError();
+	}
+	MAX_HEAD_START = value;
+}
+
+void setBlockSize(int value) {
+	if (value < 1) {
+		fprintf(stderr, "Block size must be positive: %i\n", value);
+		raiseError();
+	}
+	BLOCK_SIZE = value;
+}
 
+// The records are packed, see packedRecords.h, which takes about a third
+// of the memory of columns, so that readers can read further ahead
 typedef struct blockData_st {
-	char **chrom;
-	int * start;
-	int * finish;
-	double * value;
+	unsigned char * bytes;
 	int count;
-	struct blockData_st * next;
+	// Last record, for the reader to skip the whole block
+	char * lastChrom;
+	int lastFinish;
+	// Index of the block it last held, which is free once the reader went past it
+	long index;
 } BlockData;
 
+// The downloader hands blocks to the reader through a ring of
+// pointers, block i lying in ring[i % MAX_BLOCKS]. Only the downloader
+// moves head, only the reader moves tail, so the indices need no lock.
+// The mutex and condition are only used to put a thread to sleep after
+// spinning for a while.
+//
+// The downloader owns the blocks, and stays at most capacity blocks 
+// ahead of the reader. It picks any block which the reader went past,
+// and allocates new blocks while the memory budget allows. The first
+// block which does not fit caps the capacity to the blocks allocated.
+//
+// The capacity starts at the maximum head start, and then follows the
+// rates of the two sides. When the reader has to wait for a block 
+// although the downloader is the faster on average, the download is
+// bursty, e.g. over a network file system, and the capacity doubles.
+// When the downloader is the faster and keeps waiting for room, the 
+// capacity shrinks by one block at a time, which with thousands of 
+// readers saves most of the buffers.
+//
+// The downloader thread outlives each download: after a seek, the
+// next download is handed to the same thread together with the 
+// blocks already allocated. With the shared I/O threads, the 
+// downloader is instead a task of the I/O scheduler, which parks 
+// rather than sleeps while the ring is full.
 struct bufferedReaderData_st {
 	pthread_t downloaderThreadID;
-	BlockData * blockData, *lastBlockData;
-	pthread_mutex_t count_mutex;
-	pthread_cond_t count_cond;
+	IoTask * task;
+	// Job queue of the downloader thread, protected by jobMutex
+	pthread_mutex_t jobMutex;
+	pthread_cond_t jobCond;
+	void * (* job)(void *);
+	void * jobData;
+	bool quit;
+	// Set if the job was launched within catchErrors, its errors are then raised again by the reader
+	bool forwardErrors;
+	int failed;
+	// Blocks allocated by the downloader
+	BlockData * blocks[MAX_BLOCKS];
 	int blockCount;
+	BlockData * ring[MAX_BLOCKS];
+	int capacity, blockSize;
+	// NUMA node of the blocks, that of the thread which created the reader
+	int node;
+	// Nanoseconds spent filling and reading a block, averaged
+	long long produceTime, consumeTime;
+	// Waits since the last change of capacity: of the reader for a block, of the downloader for room
+	int starved, blocked;
+	// Number of blocks completed by the downloader
+	long head;
+	// Number of blocks released by the reader
+	long tail;
+	int finished, stopped, sleepers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// Downloader side
+	BlockData * writeBlock;
+	PackedCursor writeCursor;
+	double writeStart;
+	// Columns handed out by reserveBufferedRecords
+	int * reservedStarts, * reservedFinishes;
+	StoredValue * reservedValues;
+	// Reader side
+	BlockData * readBlock;
+	PackedCursor readCursor;
 	int readIndex;
+	double readStart;
 	void * readerData;
 	bool killed;
+	// Bytes read by the downloader
+	long long bytes;
 };
 
-static bool declareNewBlock(BufferedReaderData * data) {
-	pthread_mutex_lock(&data->count_mutex);
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
 
-	if (data->blockCount > MAX_HEAD_START) {
-		pthread_cond_wait(&data->count_cond, &data->count_mutex);
-	} 
-	if (data->blockCount < 0) {
-		pthread_mutex_unlock(&data->count_mutex);
+static void waitFor(BufferedReaderData * data, bool (*ready)(BufferedReaderData *)) {
+	int spins;
+	for (spins = 0; spins < SPIN_COUNT; spins++) {
+		if (ready(data))
+			return;
+		cpuRelax();
+	}
+
+	pthread_mutex_lock(&data->mutex);
+	__atomic_add_fetch(&data->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (!ready(data))
+		pthread_cond_wait(&data->cond, &data->mutex);
+	__atomic_sub_fetch(&data->sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&data->mutex);
+}
+
+// Must follow a sequentially consistent store to one of the shared flags
+static void wakeSleepers(BufferedReaderData * data) {
+	if (__atomic_load_n(&data->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&data->mutex);
+		pthread_cond_broadcast(&data->cond);
+		pthread_mutex_unlock(&data->mutex);
+	}
+	if (data->task)
+		wakeIoTask(data->task);
+}
+
+//////////////////////////////////////////////////////
+// Downloader side
+//////////////////////////////////////////////////////
+
+static bool roomToWrite(BufferedReaderData * data) {
+	return __atomic_load_n(&data->stopped, __ATOMIC_SEQ_CST) 
+		|| data->head - __atomic_load_n(&data->tail, __ATOMIC_SEQ_CST) < data->capacity;
+}
+
+static bool roomToWriteTask(void * data) {
+	return roomToWrite((BufferedReaderData *) data);
+}
+
+static void waitForRoom(BufferedReaderData * data) {
+	double start = traceClock();
+	if (!roomToWrite(data))
+		data->blocked++;
+	if (data->task)
+		parkIoTask(data->task, &roomToWriteTask);
+	else
+		waitFor(data, &roomToWrite);
+	traceSpan("wait for room", start);
+}
+
+static long long blockBytes(BufferedReaderData * data) {
+	return data->blockSize * (long long) PACKED_RECORD_BYTES + MAX_PACKED_RECORD_SIZE;
+}
+
+// Records which still fit in the block being written
+static int roomInBlock(BufferedReaderData * data) {
+	unsigned char * end = data->writeBlock->bytes + blockBytes(data) - MAX_PACKED_RECORD_SIZE;
+	long long room = (end - data->writeCursor.ptr) / (long long) MAX_PACKED_RECORD_SIZE + 1;
+	if (data->writeCursor.ptr > end)
+		return 0;
+	return room < data->blockSize - data->writeBlock->count ? (int) room : data->blockSize - data->writeBlock->count;
+}
+
+static void averageTime(long long * average, double seconds) {
+	long long nanoseconds = (long long) (seconds * 1e9);
+	long long previous = __atomic_load_n(average, __ATOMIC_SEQ_CST);
+	__atomic_store_n(average, previous ? (7 * previous + nanoseconds) / 8 : nanoseconds, __ATOMIC_SEQ_CST);
+}
+
+static void adaptCapacity(BufferedReaderData * data) {
+	long long produceTime = data->produceTime;
+	long long consumeTime = __atomic_load_n(&data->consumeTime, __ATOMIC_SEQ_CST);
+	int capacity = data->capacity;
+
+	if (produceTime > consumeTime) {
+		// A longer head start would not keep up with the reader anyway
+		__atomic_store_n(&data->starved, 0, __ATOMIC_SEQ_CST);
+		data->blocked = 0;
+	} else if (__atomic_exchange_n(&data->starved, 0, __ATOMIC_SEQ_CST)) {
+		capacity = 2 * capacity < MAX_BLOCKS ? 2 * capacity : MAX_BLOCKS;
+		data->blocked = 0;
+	} else if (data->blocked >= capacity && capacity > MIN_BLOCKS) {
+		capacity--;
+		data->blocked = 0;
+	}
+	__atomic_store_n(&data->capacity, capacity, __ATOMIC_SEQ_CST);
+}
+
+// Returns a block the reader went past, if any
+static BlockData * freeBlock(BufferedReaderData * data) {
+	long tail = __atomic_load_n(&data->tail, __ATOMIC_SEQ_CST);
+	int i;
+	for (i = 0; i < data->blockCount; i++)
+		if (data->blocks[i]->index < tail)
+			return data->blocks[i];
+	return NULL;
+}
+
+static BlockData * allocateBlock(BufferedReaderData * data) {
+	BlockData * block = (BlockData *) calloc(1, sizeof(BlockData));
+	block->bytes = (unsigned char *) allocateLargeBuffer(blockBytes(data), data->node);
+	countMemory(MEMORY_BUFFERS, blockBytes(data));
+	data->blocks[data->blockCount++] = block;
+	return block;
+}
+
+static void destroyBlock(BufferedReaderData * data, BlockData * block) {
+	int i;
+	for (i = 0; data->blocks[i] != block; i++);
+	data->blocks[i] = data->blocks[--data->blockCount];
+	countMemory(MEMORY_BUFFERS, -blockBytes(data));
+	freeLargeBuffer(block->bytes, blockBytes(data));
+	free(block);
+}
+
+static bool claimBlock(BufferedReaderData * data) {
+	BlockData * block;
+
+	adaptCapacity(data);
+	waitForRoom(data);
+	if (__atomic_load_n(&data->stopped, __ATOMIC_SEQ_CST))
 		return true;
+
+	// Releases the blocks beyond a reduced capacity
+	while (data->blockCount > data->capacity && (block = freeBlock(data)))
+		destroyBlock(data, block);
+
+	// Unless a block is free, all the blocks are in use, and fewer than the capacity
+	block = freeBlock(data);
+	if (block == NULL && data->blockCount >= MIN_BLOCKS && !memoryFits(blockBytes(data))) {
+		__atomic_store_n(&data->capacity, data->blockCount, __ATOMIC_SEQ_CST);
+		waitForRoom(data);
+		if (__atomic_load_n(&data->stopped, __ATOMIC_SEQ_CST))
+			return true;
+		block = freeBlock(data);
 	}
-	data->blockCount++;
-	pthread_cond_signal(&data->count_cond);
-	pthread_mutex_unlock(&data->count_mutex);
+	if (block == NULL)
+		block = allocateBlock(data);
+
+	block->count = 0;
+	block->index = data->head;
+	startPackedCursor(&data->writeCursor, block->bytes);
+	data->ring[data->head % MAX_BLOCKS] = block;
+	data->writeBlock = block;
+	data->writeStart = profileClock();
 	return false;
 }
 
-static BlockData * createBlockData() {
-	BlockData * new = (BlockData * ) calloc(1, sizeof(BlockData));
-	new->chrom = (char **) calloc(BLOCK_SIZE, sizeof(char*));
-	new->start = (int *) calloc(BLOCK_SIZE, sizeof(int));
-	new->finish = (int *) calloc(BLOCK_SIZE, sizeof(int));
-	new->value = (double *) calloc(BLOCK_SIZE, sizeof(double));
-	return new;
+static void publishBlock(BufferedReaderData * data) {
+	averageTime(&data->produceTime, profileClock() - data->writeStart);
+	traceSpan("produce block", data->writeStart);
+	data->writeBlock = NULL;
+	__atomic_store_n(&data->head, data->head + 1, __ATOMIC_SEQ_CST);
+	wakeSleepers(data);
+	// Gives its turn to the downloads whose readers are closer to starving
+	if (data->task)
+		yieldIoTask(data->task);
 }
 
-bool pushValuesToBuffer(BufferedReaderData * data, char * chrom, int start, int finish, double value) {
+static void packBufferedRecord(BufferedReaderData * data, char * chrom, int start, int finish, StoredValue value, int strand) {
+	BlockData * block = data->writeBlock;
+	packRecord(&data->writeCursor, chrom, start, finish, value, strand);
+	block->lastChrom = chrom;
+	block->lastFinish = finish;
+	block->count++;
+}
 
-	if (data->blockData == NULL)
-		data->lastBlockData = data->blockData = createBlockData();
-	else if (data->lastBlockData->count == BLOCK_SIZE) {
-		data->lastBlockData->next = createBlockData();
-		data->lastBlockData = data->lastBlockData->next;
-		if (declareNewBlock(data))
+bool pushStrandedValuesToBuffer(BufferedReaderData * data, char * chrom, int start, int finish, double value, int strand) {
+	if (data->writeBlock == NULL || roomInBlock(data) == 0) {
+		if (data->writeBlock)
+			publishBlock(data);
+		if (claimBlock(data))
 			return true;
 	}
 
-	int index = data->lastBlockData->count;
-	data->lastBlockData->chrom[index] = chrom;
-	data->lastBlockData->start[index] = start;
-	data->lastBlockData->finish[index] = finish;
-	data->lastBlockData->value[index] = value;
-	data->lastBlockData->count++;
+	packBufferedRecord(data, chrom, start, finish, value, strand);
 	return false;
 }
 
+// The records are decoded into columns of their own, then packed on commit
+int reserveBufferedRecords(BufferedReaderData * data, int count, int ** starts, int ** finishes, StoredValue ** values) {
+	int room;
+
+	if (data->writeBlock == NULL || roomInBlock(data) == 0) {
+		if (data->writeBlock)
+			publishBlock(data);
+		if (claimBlock(data))
+			return 0;
+	}
+	if (!data->reservedStarts) {
+		data->reservedStarts = (int *) malloc(RESERVED_RECORDS * sizeof(int));
+		data->reservedFinishes = (int *) malloc(RESERVED_RECORDS * sizeof(int));
+		data->reservedValues = (StoredValue *) malloc(RESERVED_RECORDS * sizeof(StoredValue));
+	}
+
+	*starts = data->reservedStarts;
+	*finishes = data->reservedFinishes;
+	*values = data->reservedValues;
+	room = roomInBlock(data);
+	if (room > RESERVED_RECORDS)
+		room = RESERVED_RECORDS;
+	return count < room ? count : room;
+}
+
+void commitBufferedRecords(BufferedReaderData * data, char * chrom, int count) {
+	int i;
+	for (i = 0; i < count; i++)
+		packBufferedRecord(data, chrom, data->reservedStarts[i], data->reservedFinishes[i], data->reservedValues[i], 0);
+}
+
+bool pushValuesToBuffer(BufferedReaderData * data, char * chrom, int start, int finish, double value) {
+	return pushStrandedValuesToBuffer(data, chrom, start, finish, value, 0);
+}
+
 void endBufferedSignal(BufferedReaderData * data) {
-	declareNewBlock(data);
-	declareNewBlock(data);
+	if (data->writeBlock)
+		publishBlock(data);
+	__atomic_store_n(&data->finished, true, __ATOMIC_SEQ_CST);
+	wakeSleepers(data);
 }
 
-static void destroyBlockData(BlockData * data) {
-	free(data->chrom);
-	free(data->start);
-	free(data->finish);
-	free(data->value);
-	free(data);
+//////////////////////////////////////////////////////
+// Reader side
+//////////////////////////////////////////////////////
+
+static bool blockAvailable(BufferedReaderData * data) {
+	return __atomic_load_n(&data->head, __ATOMIC_SEQ_CST) > data->tail 
+		|| __atomic_load_n(&data->finished, __ATOMIC_SEQ_CST);
 }
 
-static void waitForNextBlock(BufferedReaderData * data) {
-	pthread_mutex_lock(&data->count_mutex);
-	// Check whether allowed to step forward
-	if (data->blockCount == 0) {
-		pthread_cond_wait(&data->count_cond, &data->count_mutex);
-	}
-	// Signal freed memory
-	data->blockCount--;
-	pthread_cond_signal(&data->count_cond);
-	pthread_mutex_unlock(&data->count_mutex);
+// Returns NULL once the downloader is finished and all blocks were read
+static BlockData * waitForNextBlock(BufferedReaderData * data) {
+	double start = traceClock();
+	waitFor(data, &blockAvailable);
+	traceSpan("wait for block", start);
+	// The finished flag is set after the last block is published
+	if (__atomic_load_n(&data->head, __ATOMIC_SEQ_CST) > data->tail)
+		return data->ring[data->tail % MAX_BLOCKS];
+	return NULL;
+}
+
+static void releaseBlock(BufferedReaderData * data) {
+	__atomic_store_n(&data->tail, data->tail + 1, __ATOMIC_SEQ_CST);
+	wakeSleepers(data);
 }
 
-static void goToNextBlock(BufferedReaderData * data) {
-	BlockData * prevBlockData = data->blockData;
-	data->blockData = data->blockData->next;
+static void startReadBlock(BufferedReaderData * data, BlockData * block) {
+	data->readBlock = block;
 	data->readIndex = 0;
-	destroyBlockData(prevBlockData);
+	if (block)
+		startPackedCursor(&data->readCursor, block->bytes);
+	data->readStart = profileClock();
 }
 
-void launchBufferedReader(void * (* readFileFunction)(void *), void * f_data, BufferedReaderData ** buf_data) {
+//////////////////////////////////////////////////////
+// Downloader thread
+//////////////////////////////////////////////////////
+
+static void runJobBody(void * args) {
+	BufferedReaderData * data = (BufferedReaderData *) args;
+	data->job(data->jobData);
+}
+
+static void runJob(BufferedReaderData * data) {
+	if (!data->forwardErrors)
+		data->job(data->jobData);
+	else if (!catchErrors(&runJobBody, data)) {
+		__atomic_store_n(&data->failed, true, __ATOMIC_SEQ_CST);
+		endBufferedSignal(data);
+	}
+}
+
+static void * runDownloader(void * args) {
+	BufferedReaderData * data = (BufferedReaderData *) args;
+	nameTraceThread("download");
+
+	pthread_mutex_lock(&data->jobMutex);
+	while (true) {
+		while (!data->job && !data->quit)
+			pthread_cond_wait(&data->jobCond, &data->jobMutex);
+		if (data->quit)
+			break;
+
+		pthread_mutex_unlock(&data->jobMutex);
+		runJob(data);
+		pthread_mutex_lock(&data->jobMutex);
+
+		data->job = NULL;
+		pthread_cond_broadcast(&data->jobCond);
+	}
+	pthread_mutex_unlock(&data->jobMutex);
+	return NULL;
+}
+
+// Download as a task of the shared I/O threads
+static void runDownloaderTask(void * args) {
+	BufferedReaderData * data = (BufferedReaderData *) args;
+
+	runJob(data);
+
+	pthread_mutex_lock(&data->jobMutex);
+	data->job = NULL;
+	pthread_cond_broadcast(&data->jobCond);
+	pthread_mutex_unlock(&data->jobMutex);
+}
+
+// Blocks ready for the reader, the fewer the more urgent the download
+static int downloadBacklog(void * args) {
+	BufferedReaderData * data = (BufferedReaderData *) args;
+	return (int) (__atomic_load_n(&data->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&data->tail, __ATOMIC_SEQ_CST));
+}
+
+static BufferedReaderData * createBufferedReader() {
 	BufferedReaderData * data = calloc(1, sizeof(BufferedReaderData));
-	*buf_data = data;
-	data->readIndex = 0;
-	data->readerData = f_data;
+	data->capacity = MAX_HEAD_START + MIN_BLOCKS;
+	data->blockSize = BLOCK_SIZE;
+	data->node = localNode();
+
+	pthread_mutex_init(&data->mutex, NULL);
+	pthread_cond_init(&data->cond, NULL);
+	pthread_mutex_init(&data->jobMutex, NULL);
+	pthread_cond_init(&data->jobCond, NULL);
 
-	pthread_mutex_init(&data->count_mutex, NULL);
-	pthread_cond_init(&data->count_cond, NULL);
+	if (sharedIoThreads()) {
+		data->task = newIoTask(data, &downloadBacklog);
+		return data;
+	}
 
-	int err = pthread_create(&(data->downloaderThreadID), NULL, readFileFunction, f_data);
+	int err = pthread_create(&(data->downloaderThreadID), NULL, &runDownloader, data);
 	if (err) {
 		fprintf(stderr, "Could not create new thread %i\n", err);
 		abort();
 	}
+	return data;
+}
+
+void launchBufferedReader(void * (* readFileFunction)(void *), void * f_data, BufferedReaderData ** buf_data) {
+	BufferedReaderData * data = *buf_data;
+
+	if (data && data->killed) {
+		free(data);
+		data = NULL;
+	}
+	if (data)
+		stopBufferedReader(data);
+	else
+		*buf_data = data = createBufferedReader();
+
+	data->readIndex = 0;
+	data->readerData = f_data;
+	data->forwardErrors = catchingErrors();
 
-	waitForNextBlock(data);
+	pthread_mutex_lock(&data->jobMutex);
+	data->job = readFileFunction;
+	data->jobData = f_data;
+	pthread_cond_broadcast(&data->jobCond);
+	pthread_mutex_unlock(&data->jobMutex);
+	if (data->task)
+		startIoTask(data->task, &runDownloaderTask);
+
+	startReadBlock(data, waitForNextBlock(data));
 }
 
-void killBufferedReader(BufferedReaderData * data) {
+void stopBufferedReader(BufferedReaderData * data) {
+	int i;
+
 	if (data->killed)
 		return;
 
-	pthread_mutex_lock(&data->count_mutex);
-	data->blockCount = -1;
-	// Send a signal in case the slave is waiting somewhere
-	pthread_cond_signal(&data->count_cond);
-	pthread_mutex_unlock(&data->count_mutex);
-	pthread_join(data->downloaderThreadID, NULL);
+	// Unblock the downloader in case it is waiting for room
+	__atomic_store_n(&data->stopped, true, __ATOMIC_SEQ_CST);
+	wakeSleepers(data);
+
+	pthread_mutex_lock(&data->jobMutex);
+	while (data->job)
+		pthread_cond_wait(&data->jobCond, &data->jobMutex);
+	pthread_mutex_unlock(&data->jobMutex);
 
-	pthread_mutex_destroy(&data->count_mutex);
-	pthread_cond_destroy(&data->count_cond);
+	// The downloader is idle, the ring can be reset for the next job
+	for (i = 0; i < data->blockCount; i++)
+		data->blocks[i]->index = -1;
+	data->head = data->tail = 0;
+	data->finished = data->stopped = false;
+	data->writeBlock = NULL;
+	data->readBlock = NULL;
+	data->readIndex = 0;
+}
+
+void killBufferedReader(BufferedReaderData * data) {
+	if (data->killed)
+		return;
 
-	while (data->blockData) {
-		BlockData * prevData = data->blockData;
-		data->blockData = data->blockData->next;
-		destroyBlockData(prevData);
+	stopBufferedReader(data);
+	if (data->task) {
+		destroyIoTask(data->task);
+		data->task = NULL;
+	} else {
+		pthread_mutex_lock(&data->jobMutex);
+		data->quit = true;
+		pthread_cond_broadcast(&data->jobCond);
+		pthread_mutex_unlock(&data->jobMutex);
+		pthread_join(data->downloaderThreadID, NULL);
 	}
 
-	data->lastBlockData = NULL;
-	data->blockCount = 0;
+	pthread_mutex_destroy(&data->mutex);
+	pthread_cond_destroy(&data->cond);
+	pthread_mutex_destroy(&data->jobMutex);
+	pthread_cond_destroy(&data->jobCond);
+
+	while (data->blockCount)
+		destroyBlock(data, data->blocks[0]);
+	free(data->reservedStarts);
+	free(data->reservedFinishes);
+	free(data->reservedValues);
+	data->reservedStarts = data->reservedFinishes = NULL;
+	data->reservedValues = NULL;
+	data->readBlock = NULL;
+	data->writeBlock = NULL;
 	data->killed = true;
 }
 
+void countBufferedBytes(BufferedReaderData * data, long long bytes) {
+	__atomic_add_fetch(&data->bytes, bytes, __ATOMIC_SEQ_CST);
+}
+
 void BufferedReaderPop(WiggleIterator * wi, BufferedReaderData * data) {
 	if (wi->done)
 		return;
-	else if (data == NULL || data->blockData == NULL) {
+	else if (data == NULL || data->readBlock == NULL) {
+		if (data && __atomic_load_n(&data->failed, __ATOMIC_SEQ_CST))
+			raiseError();
 		wi->done = true;
 		return;
-	} else if (data->readIndex == data->blockData->count) {
-		waitForNextBlock(data);
-		goToNextBlock(data);
-		if (data->blockData == NULL) {
-			killBufferedReader(data);
+	}
+	
+	while (data->readIndex == data->readBlock->count) {
+		averageTime(&data->consumeTime, profileClock() - data->readStart);
+		traceSpan("consume block", data->readStart);
+		releaseBlock(data);
+		if (!blockAvailable(data))
+			__atomic_add_fetch(&data->starved, 1, __ATOMIC_SEQ_CST);
+		if (wi->profile) {
+			double start = profileClock();
+			startReadBlock(data, waitForNextBlock(data));
+			wi->profile->blockedTime += profileClock() - start;
+			wi->profile->bytes = __atomic_load_n(&data->bytes, __ATOMIC_SEQ_CST);
+			wi->profile->headStart = __atomic_load_n(&data->capacity, __ATOMIC_SEQ_CST) - MIN_BLOCKS;
+			wi->profile->blockSize = data->blockSize;
+			wi->profile->queuedBlocks = __atomic_load_n(&data->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&data->tail, __ATOMIC_SEQ_CST);
+		} else
+			startReadBlock(data, waitForNextBlock(data));
+		if (data->readBlock == NULL) {
+			if (__atomic_load_n(&data->failed, __ATOMIC_SEQ_CST))
+				raiseError();
+			// Keep the thread and blocks for the next seek
+			stopBufferedReader(data);
 			wi->done = true;
 			return;
 		}
 	} 
 
-	int index = data->readIndex;
-	wi->chrom = data->blockData->chrom[index];
-	wi->start = data->blockData->start[index];
-	wi->finish = data->blockData->finish[index];
-	wi->value = (double) data->blockData->value[index];
+	unpackRecord(&data->readCursor, &wi->chrom, &wi->start, &wi->finish, &wi->value, &wi->strand);
 	data->readIndex++;
 }
 
+static bool recordLags(const char * recordChrom, int recordFinish, const char * chrom, int start) {
+	int chrom_cmp = compareChroms(recordChrom, chrom);
+	return chrom_cmp < 0 || (chrom_cmp == 0 && recordFinish <= start);
+}
+
+// Whole blocks are released while their last record lags, then the block
+// which holds the target is unpacked up to it
+bool BufferedReaderSkipTo(WiggleIterator * wi, BufferedReaderData * data, const char * chrom, int start) {
+	PackedCursor cursor;
+	char * recordChrom;
+	int recordStart, recordFinish, strand;
+	double value;
+
+	if (wi->done || data == NULL || data->readBlock == NULL)
+		return true;
+
+	while (data->readIndex == data->readBlock->count || recordLags(data->readBlock->lastChrom, data->readBlock->lastFinish, chrom, start)) {
+		// The finished flag is read first, as it is set after the last block is published
+		int finished = __atomic_load_n(&data->finished, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&data->head, __ATOMIC_SEQ_CST) <= data->tail + 1) {
+			if (!finished)
+				return false;
+			// Nothing left past the target
+			data->readIndex = data->readBlock->count;
+			BufferedReaderPop(wi, data);
+			return true;
+		}
+		averageTime(&data->consumeTime, profileClock() - data->readStart);
+		traceSpan("consume block", data->readStart);
+		releaseBlock(data);
+		startReadBlock(data, data->ring[data->tail % MAX_BLOCKS]);
+	}
+
+	// The last record does not lag, so the loop stops within the block
+	while (true) {
+		cursor = data->readCursor;
+		unpackRecord(&cursor, &recordChrom, &recordStart, &recordFinish, &value, &strand);
+		if (!recordLags(recordChrom, recordFinish, chrom, start))
+			break;
+		data->readCursor = cursor;
+		data->readIndex++;
+	}
+	BufferedReaderPop(wi, data);
+	return true;
+}
+
+// The records left in the current block are copied in one go, only the
+// move to the next block goes through BufferedReaderPop. Strands are 
+// dropped, as in all batches, so only unstranded readers use this.
+void BufferedReaderPopBatch(WiggleIterator * wi, BufferedReaderData * data, SpanBatch * batch) {
+	while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+		pushSpanBatch(batch, wi);
+
+		BlockData * block = data->readBlock;
+		int count = block->count - data->readIndex;
+		if (count > SPAN_BATCH_SIZE - batch->count)
+			count = SPAN_BATCH_SIZE - batch->count;
+		int index, strand;
+		for (index = 0; index < count; index++) {
+			unpackRecord(&data->readCursor, batch->chroms + batch->count, batch->starts + batch->count, batch->finishes + batch->count, batch->values + batch->count, &strand);
+			batch->count++;
+		}
+		data->readIndex += count;
+
+		BufferedReaderPop(wi, data);
+	}
+}
@@ -24,7 +24,22 @@ typedef struct bufferedReaderData_st BufferedReaderData;
 
 void launchBufferedReader(void * (* readFileFunction)(void *), void * f_data, BufferedReaderData ** buf_data);
 bool pushValuesToBuffer(BufferedReaderData * data, char * chrom, int start, int finish, double value);
+// strand is 1 for +, -1 for -, 0 if unstranded
+bool pushStrandedValuesToBuffer(BufferedReaderData * data, char * chrom, int start, int finish, double value, int strand);
+// Columns for up to count records, for decoders which fill them themselves, packed into the
+// block being written on commit. Returns the number of records which fit, 0 if the download was stopped.
+int reserveBufferedRecords(BufferedReaderData * data, int count, int ** starts, int ** finishes, StoredValue ** values);
+// Adds the first count records reserved above, all unstranded on chrom
+void commitBufferedRecords(BufferedReaderData * data, char * chrom, int count);
 void endBufferedSignal(BufferedReaderData * data);
+void stopBufferedReader(BufferedReaderData * data);
 void killBufferedReader(BufferedReaderData * data);
 void BufferedReaderPop(WiggleIterator * wi, BufferedReaderData * data);
+void BufferedReaderPopBatch(WiggleIterator * wi, BufferedReaderData * data, SpanBatch * batch);
+// Drops the records which end at or before chrom:start, within the blocks already downloaded.
+// Only valid if the records are sorted by finish. Returns false if the downloaded blocks
+// run out first, the download then has to be restarted from chrom:start.
+bool BufferedReaderSkipTo(WiggleIterator * wi, BufferedReaderData * data, const char * chrom, int start);
+// Called by the downloader, reported by the profiler
+void countBufferedBytes(BufferedReaderData * data, long long bytes);
 #endif
@@ -0,0 +1,262 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "sam.h"
+#include "chromosomes.h"
+#include "errors.h"
+
+typedef struct chromosome_st {
+	struct chromosome_st * next;
+	int id;
+	char name[];
+} Chromosome;
+
+static Chromosome ** table = NULL;
+static int tableSize = 0;
+static Chromosome ** chromosomes = NULL;
+static int count = 0;
+static int maxCount = 0;
+// Readers intern labels from their own threads
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hashLabel(const char * name, int length) {
+	unsigned int hash = 5381;
+	int i;
+	for (i = 0; i < length; i++)
+		hash = hash * 33 + name[i];
+	return hash;
+}
+
+static void resizeTable() {
+	int newSize = tableSize ? tableSize * 2 : 64;
+	Chromosome ** newTable = (Chromosome **) calloc(newSize, sizeof(Chromosome *));
+	if (!newTable) {
+		fprintf(stderr, "Could not allocate chromosome table\n");
+		raiseError();
+	}
+	int i;
+	for (i = 0; i < count; i++) {
+		unsigned int slot = hashLabel(chromosomes[i]->name, strlen(chromosomes[i]->name)) % newSize;
+		chromosomes[i]->next = newTable[slot];
+		newTable[slot] = chromosomes[i];
+	}
+	free(table);
+	table = newTable;
+	tableSize = newSize;
+}
+
+static Chromosome * createChromosome(const char * name, int length) {
+	Chromosome * new = (Chromosome *) calloc(1, sizeof(Chromosome) + length + 1);
+	if (!new) {
+		fprintf(stderr, "Could not allocate chromosome label %.*s\n", length, name);
+		raiseError();
+	}
+	memcpy(new->name, name, length);
+	new->id = count;
+
+	if (count == maxCount) {
+		maxCount = maxCount ? maxCount * 2 : 64;
+		chromosomes = (Chromosome **) realloc(chromosomes, maxCount * sizeof(Chromosome *));
+	}
+	chromosomes[count++] = new;
+
+	if (count > tableSize)
+		resizeTable();
+	else {
+		unsigned int slot = hashLabel(name, length) % tableSize;
+		new->next = table[slot];
+		table[slot] = new;
+	}
+	return new;
+}
+
+char * internChromosomeN(const char * name, int length) {
+	Chromosome * chrom = NULL;
+
+	pthread_mutex_lock(&mutex);
+	if (tableSize)
+		for (chrom = table[hashLabel(name, length) % tableSize]; chrom; chrom = chrom->next)
+			if (!strncmp(chrom->name, name, length) && chrom->name[length] == '\0')
+				break;
+	if (!chrom)
+		chrom = createChromosome(name, length);
+	pthread_mutex_unlock(&mutex);
+
+	return chrom->name;
+}
+
+char * internChromosome(const char * name) {
+	return internChromosomeN(name, strlen(name));
+}
+
+int chromosomeID(const char * chrom) {
+	return ((Chromosome *) (chrom - offsetof(Chromosome, name)))->id;
+}
+
+char * chromosomeName(int id) {
+	char * res;
+	pthread_mutex_lock(&mutex);
+	res = chromosomes[id]->name;
+	pthread_mutex_unlock(&mutex);
+	return res;
+}
+
+int chromosomeCount() {
+	return count;
+}
+
+//////////////////////////////////////////////////////
+// Genome order
+//////////////////////////////////////////////////////
+
+// Rank of each chromosome of the order. The table does not change once 
+// set, so it is read without locks, and labels need not be interned.
+typedef struct rank_st {
+	struct rank_st * next;
+	int rank;
+	char name[];
+} Rank;
+
+static Rank ** ranks = NULL;
+static int rankTableSize = 0;
+
+static int chromosomeRank(const char * name) {
+	Rank * rank;
+	for (rank = ranks[hashLabel(name, strlen(name)) % rankTableSize]; rank; rank = rank->next)
+		if (!strcmp(rank->name, name))
+			return rank->rank;
+	return -1;
+}
+
+int compareChroms(const char * chromA, const char * chromB) {
+	if (chromA == chromB)
+		return 0;
+	if (rankTableSize) {
+		int rankA = chromosomeRank(chromA);
+		int rankB = chromosomeRank(chromB);
+		// Chromosomes outside of the order come after it
+		if (rankA != rankB)
+			return rankA < 0 ? 1 : rankB < 0 ? -1 : rankA < rankB ? -1 : 1;
+	}
+	return strcmp(chromA, chromB);
+}
+
+void orderChromosomes(char ** names, int count) {
+	int i, rankCount = 0;
+
+	rankTableSize = 2 * count + 1;
+	ranks = (Rank **) calloc(rankTableSize, sizeof(Rank *));
+	for (i = 0; i < count; i++) {
+		unsigned int slot = hashLabel(names[i], strlen(names[i])) % rankTableSize;
+		Rank * rank;
+		if (chromosomeRank(names[i]) >= 0)
+			continue;
+		rank = (Rank *) calloc(1, sizeof(Rank) + strlen(names[i]) + 1);
+		strcpy(rank->name, names[i]);
+		rank->rank = rankCount++;
+		rank->next = ranks[slot];
+		ranks[slot] = rank;
+	}
+}
+
+static void readBamChromosomeOrder(char * filename) {
+	bamFile file = bam_open(filename, "r");
+	bam_header_t * header;
+
+	if (!file) {
+		fprintf(stderr, "Could not open chromosome order file %s\n", filename);
+		raiseError();
+	}
+	header = bam_header_read(file);
+	orderChromosomes(header->target_name, header->n_targets);
+	bam_header_destroy(header);
+	bam_close(file);
+}
+
+// First column of a text file, e.g. chromosome sizes
+static void readTextChromosomeOrder(char * filename) {
+	FILE * file = fopen(filename, "r");
+	char line[5000];
+	char chrom[5000];
+	char ** names = NULL;
+	int count = 0, max = 0, i;
+
+	if (!file) {
+		fprintf(stderr, "Could not open chromosome order file %s\n", filename);
+		raiseError();
+	}
+	while (fgets(line, 5000, file)) {
+		if (line[0] == '#' || sscanf(line, "%s", chrom) != 1)
+			continue;
+		if (count == max) {
+			max = max ? 2 * max : 64;
+			names = (char **) realloc(names, max * sizeof(char *));
+		}
+		names[count++] = strdup(chrom);
+	}
+	fclose(file);
+
+	orderChromosomes(names, count);
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+void setChromosomeOrder(char * filename) {
+	int length = strlen(filename);
+	if (length > 4 && !strcmp(filename + length - 4, ".bam"))
+		readBamChromosomeOrder(filename);
+	else
+		readTextChromosomeOrder(filename);
+}
+
+typedef struct rankedName_st {
+	char * name;
+	int index;
+} RankedName;
+
+static int compareRankedNames(const void * A, const void * B) {
+	int cmp = compareChroms(((RankedName *) A)->name, ((RankedName *) B)->name);
+	return cmp ? cmp : ((RankedName *) A)->index - ((RankedName *) B)->index;
+}
+
+int * sortChromosomes(char ** names, int count) {
+	RankedName * sorted;
+	int * order;
+	int i;
+
+	for (i = 1; i < count; i++)
+		if (compareChroms(names[i-1], names[i]) > 0)
+			break;
+	if (i >= count)
+		return NULL;
+
+	sorted = (RankedName *) calloc(count, sizeof(RankedName));
+	for (i = 0; i < count; i++) {
+		sorted[i].name = names[i];
+		sorted[i].index = i;
+	}
+	qsort(sorted, count, sizeof(RankedName), compareRankedNames);
+	order = (int *) calloc(count, sizeof(int));
+	for (i = 0; i < count; i++)
+		order[i] = sorted[i].index;
+	free(sorted);
+	return order;
+}
@@ -0,0 +1,43 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _CHROMOSOMES_H_
+#define _CHROMOSOMES_H_
+
+// Global chromosome dictionary
+//
+// Every chromosome label handed out by the readers is interned here, so that 
+// all iterators share the same string for a given chromosome. Two labels
+// designate the same chromosome iff the pointers are equal, and labels are 
+// never freed.
+
+// Returns the shared copy of the label, creating it if necessary (thread safe)
+char * internChromosome(const char * name);
+// Same, from the first length characters of a non terminated string
+char * internChromosomeN(const char * name, int length);
+// Small integer ID of an interned label, in order of first appearance
+int chromosomeID(const char * chrom);
+// Inverse of the above
+char * chromosomeName(int id);
+int chromosomeCount();
+// Sort order of labels, same sign as strcmp: the genome order if one
+// was set, lexicographic otherwise
+int compareChroms(const char * chromA, const char * chromB);
+// Sets the genome order, before any reader is opened. Chromosomes outside
+// of it come after, in lexicographic order.
+void orderChromosomes(char ** names, int count);
+// Indices of the labels in genome order, NULL if they already are
+int * sortChromosomes(char ** names, int count);
+
+#endif
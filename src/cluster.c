@@ -0,0 +1,700 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "wiggletools.h"
+
+//////////////////////////////////////////////////////
+// Multi-node runs
+//
+// The coordinator listens on a TCP port and hands out
+// the shards of the program, as cut by --shard, one at
+// a time to the workers which connect to it, so that
+// the faster nodes take on more shards. A worker runs
+// each shard in a forked child, and streams its partial
+// results back as they are printed. The coordinator
+// keeps them in local temporary files, then merges
+// them into the output of the program. The shard of a
+// worker which disconnects, or goes silent for longer
+// than the timeout, is handed out again.
+//
+// Workers run the programs they are sent, so both ends
+// prove that they know the shared secret before any
+// job: a worker sends a hello with a random challenge,
+// the coordinator answers with its own challenge and
+// the HMAC of both, and the worker with the HMAC of 
+// both in the reverse order, each labelled by its side.
+//
+// Messages are in the byte order of the machines, which
+// must match. The coordinator then sends a job: the 
+// shard, the number of shards and the number of 
+// strings, then the chromosome sizes and the words of
+// the program, each preceded by its length. A shard of
+// 0 means that all are done, and a negative shard that
+// the worker should keep waiting. The worker answers 
+// with chunks of partial results, each preceded by its
+// length, and a length of 0 on success or -1 on 
+// failure. A length of -2 only shows that the shard is
+// still running.
+//////////////////////////////////////////////////////
+
+static const char workerMagic[8] = "WTWORK2";
+static const uint32_t byteOrderMark = 0x01020304;
+#define CHUNK_SIZE 65536
+// Workers may be started before the coordinator, once a second
+#define CONNECT_ATTEMPTS 60
+#define CHALLENGE_SIZE 32
+#define MAX_SECRET_SIZE 4096
+// Either end gives up on a silent connection after TIMEOUT_SECONDS, 
+// and sends a keepalive every KEEPALIVE_SECONDS while it has nothing else
+#define TIMEOUT_SECONDS 60
+#define KEEPALIVE_SECONDS 10
+#define KEEPALIVE -2
+#define SHA256_SIZE 32
+
+enum jobState {JOB_PENDING, JOB_RUNNING, JOB_DONE};
+
+typedef struct coordinator_st {
+	int argc;
+	char ** argv;
+	char * secret;
+	int secretLength;
+	char * chromSizes;
+	int32_t chromSizesLength;
+	int shards;
+	enum jobState * states;
+	// Received partial results, by shard
+	FILE ** partials;
+	int done;
+	// Protects the above
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} Coordinator;
+
+typedef struct connection_st {
+	Coordinator * coordinator;
+	int socket;
+	char host[NI_MAXHOST];
+} Connection;
+
+//////////////////////////////////////////////////////
+// Messages
+//////////////////////////////////////////////////////
+
+// Return false if the other end is gone
+static bool sendBytes(int socket, const void * data, size_t size) {
+	const char * ptr = (const char *) data;
+
+	while (size > 0) {
+		ssize_t sent = send(socket, ptr, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		ptr += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool receiveBytes(int socket, void * data, size_t size) {
+	char * ptr = (char *) data;
+
+	while (size > 0) {
+		ssize_t received = recv(socket, ptr, size, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return false;
+		ptr += received;
+		size -= received;
+	}
+	return true;
+}
+
+static bool sendString(int socket, const char * string, int32_t length) {
+	return sendBytes(socket, &length, sizeof(length)) && sendBytes(socket, string, length);
+}
+
+// Returns NULL if the other end is gone
+static char * receiveString(int socket) {
+	int32_t length;
+	char * string;
+
+	if (!receiveBytes(socket, &length, sizeof(length)) || length < 0)
+		return NULL;
+	string = (char *) calloc(length + 1, 1);
+	if (!receiveBytes(socket, string, length)) {
+		free(string);
+		return NULL;
+	}
+	return string;
+}
+
+static void setTimeouts(int socket) {
+	struct timeval timeout = {TIMEOUT_SECONDS, 0};
+
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+//////////////////////////////////////////////////////
+// Shared secret
+//////////////////////////////////////////////////////
+
+// The whole file, trailing newlines excluded
+static char * readSharedSecret(char * filename, int * length) {
+	FILE * file = fopen(filename, "rb");
+	char * secret = (char *) calloc(MAX_SECRET_SIZE + 1, 1);
+
+	if (!file) {
+		fprintf(stderr, "Could not open secret file %s\n", filename);
+		raiseError();
+	}
+	*length = fread(secret, 1, MAX_SECRET_SIZE + 1, file);
+	fclose(file);
+	if (*length > MAX_SECRET_SIZE) {
+		fprintf(stderr, "Secret file %s is longer than %i bytes\n", filename, MAX_SECRET_SIZE);
+		raiseError();
+	}
+	while (*length > 0 && (secret[*length - 1] == '\n' || secret[*length - 1] == '\r'))
+		secret[--*length] = 0;
+	if (*length == 0) {
+		fprintf(stderr, "Secret file %s is empty\n", filename);
+		raiseError();
+	}
+	return secret;
+}
+
+static void newChallenge(unsigned char * challenge) {
+	if (RAND_bytes(challenge, CHALLENGE_SIZE) != 1) {
+		fprintf(stderr, "wiggletools: could not draw a random challenge\n");
+		raiseError();
+	}
+}
+
+// HMAC-SHA256 of the side, then of the challenges in order
+static void proveSecret(char * secret, int secretLength, char side, const unsigned char * first, const unsigned char * second, unsigned char * proof) {
+	unsigned char message[1 + 2 * CHALLENGE_SIZE];
+	unsigned int length = EVP_MAX_MD_SIZE;
+
+	message[0] = side;
+	memcpy(message + 1, first, CHALLENGE_SIZE);
+	memcpy(message + 1 + CHALLENGE_SIZE, second, CHALLENGE_SIZE);
+	if (!HMAC(EVP_sha256(), secret, secretLength, message, sizeof(message), proof, &length)) {
+		fprintf(stderr, "wiggletools: could not compute the proof of the secret\n");
+		raiseError();
+	}
+}
+
+static bool checkProof(char * secret, int secretLength, char side, const unsigned char * first, const unsigned char * second, const unsigned char * proof) {
+	unsigned char expected[EVP_MAX_MD_SIZE];
+
+	proveSecret(secret, secretLength, side, first, second, expected);
+	return CRYPTO_memcmp(expected, proof, SHA256_SIZE) == 0;
+}
+
+//////////////////////////////////////////////////////
+// Coordinator
+//////////////////////////////////////////////////////
+
+// Returns the index of a pending shard, -1 once all are done, or
+// KEEPALIVE if the other workers still hold all of the rest
+static int takeJob(Coordinator * coordinator) {
+	struct timespec deadline;
+	int shard;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += KEEPALIVE_SECONDS;
+	pthread_mutex_lock(&coordinator->mutex);
+	while (coordinator->done < coordinator->shards) {
+		for (shard = 0; shard < coordinator->shards; shard++) {
+			if (coordinator->states[shard] == JOB_PENDING) {
+				coordinator->states[shard] = JOB_RUNNING;
+				pthread_mutex_unlock(&coordinator->mutex);
+				return shard;
+			}
+		}
+		// Other workers may still drop theirs
+		if (pthread_cond_timedwait(&coordinator->cond, &coordinator->mutex, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&coordinator->mutex);
+			return KEEPALIVE;
+		}
+	}
+	pthread_mutex_unlock(&coordinator->mutex);
+	return -1;
+}
+
+static void finishJob(Coordinator * coordinator, int shard, FILE * partial) {
+	pthread_mutex_lock(&coordinator->mutex);
+	if (partial) {
+		coordinator->states[shard] = JOB_DONE;
+		coordinator->partials[shard] = partial;
+		coordinator->done++;
+	} else
+		coordinator->states[shard] = JOB_PENDING;
+	pthread_cond_broadcast(&coordinator->cond);
+	pthread_mutex_unlock(&coordinator->mutex);
+}
+
+static bool sendJob(int socket, Coordinator * coordinator, int shard) {
+	int32_t header[3] = {shard + 1, coordinator->shards, coordinator->argc + 1};
+	int i;
+
+	if (!sendBytes(socket, header, sizeof(header)) || !sendString(socket, coordinator->chromSizes, coordinator->chromSizesLength))
+		return false;
+	for (i = 0; i < coordinator->argc; i++)
+		if (!sendString(socket, coordinator->argv[i], strlen(coordinator->argv[i])))
+			return false;
+	return true;
+}
+
+// Returns false if the worker is gone, else sets whether the shard succeeded
+static bool receivePartial(int socket, FILE * partial, bool * success) {
+	char buffer[CHUNK_SIZE];
+	int32_t length;
+
+	while (receiveBytes(socket, &length, sizeof(length))) {
+		if (length == KEEPALIVE)
+			continue;
+		if (length <= 0) {
+			*success = length == 0;
+			return true;
+		}
+		if (length > CHUNK_SIZE || !receiveBytes(socket, buffer, length))
+			return false;
+		if (fwrite(buffer, 1, length, partial) != length) {
+			fprintf(stderr, "Could not write to temporary file\n");
+			raiseError();
+		}
+	}
+	return false;
+}
+
+// The worker proves that it knows the secret after the coordinator did
+static bool isWorker(int socket, Coordinator * coordinator) {
+	char hello[sizeof(workerMagic)];
+	uint32_t mark;
+	unsigned char workerChallenge[CHALLENGE_SIZE], challenge[CHALLENGE_SIZE];
+	unsigned char proof[EVP_MAX_MD_SIZE];
+
+	if (!receiveBytes(socket, hello, sizeof(hello)) || memcmp(hello, workerMagic, sizeof(workerMagic))
+		|| !receiveBytes(socket, &mark, sizeof(mark)) || mark != byteOrderMark
+		|| !receiveBytes(socket, workerChallenge, CHALLENGE_SIZE))
+		return false;
+	newChallenge(challenge);
+	proveSecret(coordinator->secret, coordinator->secretLength, 'C', challenge, workerChallenge, proof);
+	return sendBytes(socket, challenge, CHALLENGE_SIZE) && sendBytes(socket, proof, SHA256_SIZE)
+		&& receiveBytes(socket, proof, SHA256_SIZE)
+		&& checkProof(coordinator->secret, coordinator->secretLength, 'W', workerChallenge, challenge, proof);
+}
+
+static void * runConnection(void * args) {
+	Connection * connection = (Connection *) args;
+	Coordinator * coordinator = connection->coordinator;
+	int32_t farewell[3] = {0, 0, 0};
+	int32_t keepalive[3] = {KEEPALIVE, 0, 0};
+	int shard;
+
+	if (!isWorker(connection->socket, coordinator)) {
+		fprintf(stderr, "wiggletools: ignoring connection from %s, not a compatible worker with the same secret\n", connection->host);
+		close(connection->socket);
+		free(connection);
+		return NULL;
+	}
+
+	while ((shard = takeJob(coordinator)) != -1) {
+		FILE * partial;
+		bool success;
+
+		if (shard == KEEPALIVE) {
+			if (sendBytes(connection->socket, keepalive, sizeof(keepalive)))
+				continue;
+			fprintf(stderr, "wiggletools: lost idle worker %s\n", connection->host);
+			close(connection->socket);
+			free(connection);
+			return NULL;
+		}
+		if (!(partial = tmpfile())) {
+			fprintf(stderr, "Could not create temporary file\n");
+			raiseError();
+		}
+		if (sendJob(connection->socket, coordinator, shard) && receivePartial(connection->socket, partial, &success)) {
+			// The program fails the same way on any worker
+			if (!success) {
+				fprintf(stderr, "wiggletools: shard %i/%i failed on worker %s\n", shard + 1, coordinator->shards, connection->host);
+				raiseError();
+			}
+			finishJob(coordinator, shard, partial);
+		} else {
+			fprintf(stderr, "wiggletools: lost worker %s, shard %i/%i is handed out again\n", connection->host, shard + 1, coordinator->shards);
+			fclose(partial);
+			finishJob(coordinator, shard, NULL);
+			close(connection->socket);
+			free(connection);
+			return NULL;
+		}
+	}
+
+	sendBytes(connection->socket, farewell, sizeof(farewell));
+	close(connection->socket);
+	free(connection);
+	return NULL;
+}
+
+static char * readChromSizesFile(char * filename, int32_t * length) {
+	FILE * file = fopen(filename, "rb");
+	char * contents;
+	long size;
+
+	if (!file || fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || size > INT32_MAX) {
+		fprintf(stderr, "Could not read chromosome sizes file %s\n", filename);
+		raiseError();
+	}
+	rewind(file);
+	contents = (char *) malloc(size + 1);
+	if (fread(contents, 1, size, file) != size) {
+		fprintf(stderr, "Could not read chromosome sizes file %s\n", filename);
+		raiseError();
+	}
+	fclose(file);
+	*length = size;
+	return contents;
+}
+
+// bindAddress is a host name or numeric address, or "*" for all interfaces
+static int listenOnPort(char * bindAddress, int port) {
+	struct addrinfo hints, * addresses, * address;
+	char service[16];
+	int server = -1, yes = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	sprintf(service, "%i", port);
+	if (getaddrinfo(strcmp(bindAddress, "*") ? bindAddress : NULL, service, &hints, &addresses)) {
+		fprintf(stderr, "Could not listen on %s port %i\n", bindAddress, port);
+		raiseError();
+	}
+	for (address = addresses; address; address = address->ai_next) {
+		server = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (server < 0)
+			continue;
+		setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (!bind(server, address->ai_addr, address->ai_addrlen) && !listen(server, 64))
+			break;
+		close(server);
+		server = -1;
+	}
+	freeaddrinfo(addresses);
+	if (server < 0) {
+		fprintf(stderr, "Could not listen on %s port %i\n", bindAddress, port);
+		raiseError();
+	}
+	return server;
+}
+
+static void acceptWorker(Coordinator * coordinator, int server) {
+	struct sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	Connection * connection;
+	pthread_t thread;
+	int socket, err;
+
+	if ((socket = accept(server, (struct sockaddr *) &address, &length)) < 0)
+		return;
+	// Also bounds the handshake of stray connections
+	setTimeouts(socket);
+	connection = (Connection *) calloc(1, sizeof(Connection));
+	connection->coordinator = coordinator;
+	connection->socket = socket;
+	if (getnameinfo((struct sockaddr *) &address, length, connection->host, sizeof(connection->host), NULL, 0, NI_NUMERICHOST))
+		strcpy(connection->host, "unknown");
+	if ((err = pthread_create(&thread, NULL, &runConnection, connection))) {
+		fprintf(stderr, "Could not create new thread %i\n", err);
+		raiseError();
+	}
+	pthread_detach(thread);
+}
+
+// The named output of the program, as with --threads, else stdout
+static char * programOutput(int argc, char ** argv) {
+	static const char * named[] = {"write", "write_bg", "histogram", "top", NULL};
+	int i;
+
+	for (i = 0; argc > 1 && named[i]; i++)
+		if (strcmp(argv[0], named[i]) == 0)
+			return argv[1];
+	return "-";
+}
+
+void coordinateShards(int argc, char ** argv, char * chromSizesFile, char * bindAddress, int port, int shards, char * secretFile) {
+	Coordinator * coordinator = (Coordinator *) calloc(1, sizeof(Coordinator));
+	struct pollfd listening;
+	char * output;
+	FILE * file;
+	bool done = false;
+
+	if (argc < 1) {
+		fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+		raiseError();
+	}
+	if (shards < 1) {
+		fprintf(stderr, "wiggletools: invalid number of shards: %i\n", shards);
+		raiseError();
+	}
+	// Caught before the workers fail on every shard
+	if (strcmp(argv[0], "do") == 0 || strcmp(argv[0], "apply_paste") == 0) {
+		fprintf(stderr, "wiggletools: %s cannot be run on shards\n", argv[0]);
+		raiseError();
+	}
+
+	coordinator->argc = argc;
+	coordinator->argv = argv;
+	coordinator->shards = shards;
+	coordinator->secret = readSharedSecret(secretFile, &coordinator->secretLength);
+	coordinator->chromSizes = readChromSizesFile(chromSizesFile, &coordinator->chromSizesLength);
+	coordinator->states = (enum jobState *) calloc(shards, sizeof(enum jobState));
+	coordinator->partials = (FILE **) calloc(shards, sizeof(FILE *));
+	pthread_mutex_init(&coordinator->mutex, NULL);
+	pthread_cond_init(&coordinator->cond, NULL);
+	// Before any work, so as not to find out at the end. The file is only
+	// created then, as the workers take the existing files for inputs.
+	output = programOutput(argc, argv);
+	if (strcmp(output, "-") && access(output, F_OK) == 0) {
+		fprintf(stderr, "File %s already exists, please delete it if you want to overwrite it.\n", output);
+		raiseError();
+	}
+
+	listening.fd = listenOnPort(bindAddress, port);
+	listening.events = POLLIN;
+	while (!done) {
+		if (poll(&listening, 1, 1000) > 0)
+			acceptWorker(coordinator, listening.fd);
+		pthread_mutex_lock(&coordinator->mutex);
+		done = coordinator->done == coordinator->shards;
+		pthread_mutex_unlock(&coordinator->mutex);
+	}
+	close(listening.fd);
+
+	file = openOutputFile(output);
+	writeMergedPartials(output, file, coordinator->partials, shards);
+}
+
+//////////////////////////////////////////////////////
+// Worker
+//////////////////////////////////////////////////////
+
+static int connectToCoordinator(char * address) {
+	char * colon = strrchr(address, ':');
+	char * host;
+	struct addrinfo hints, * addresses, * candidate;
+	int attempt, connection = -1;
+
+	if (!colon || colon == address || !colon[1]) {
+		fprintf(stderr, "wiggletools: the coordinator must be given as host:port: %s\n", address);
+		raiseError();
+	}
+	host = strndup(address, colon - address);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	for (attempt = 0; attempt < CONNECT_ATTEMPTS && connection < 0; attempt++) {
+		if (attempt)
+			sleep(1);
+		if (getaddrinfo(host, colon + 1, &hints, &addresses))
+			continue;
+		for (candidate = addresses; candidate && connection < 0; candidate = candidate->ai_next) {
+			connection = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+			if (connection >= 0 && connect(connection, candidate->ai_addr, candidate->ai_addrlen)) {
+				close(connection);
+				connection = -1;
+			}
+		}
+		freeaddrinfo(addresses);
+	}
+	free(host);
+	if (connection < 0) {
+		fprintf(stderr, "wiggletools: could not connect to coordinator %s\n", address);
+		raiseError();
+	}
+	return connection;
+}
+
+static char * writeChromSizes(char * contents) {
+	char * path = strdup("/tmp/wiggletools_chrom_sizes_XXXXXX");
+	int fd = mkstemp(path);
+	size_t length = strlen(contents);
+
+	if (fd < 0 || write(fd, contents, length) != length) {
+		fprintf(stderr, "Could not write temporary chromosome sizes file %s\n", path);
+		raiseError();
+	}
+	close(fd);
+	return path;
+}
+
+static void lostCoordinator(pid_t child, char * chromSizesFile) {
+	int status;
+
+	kill(child, SIGTERM);
+	while (waitpid(child, &status, 0) < 0 && errno == EINTR);
+	unlink(chromSizesFile);
+	fprintf(stderr, "wiggletools: lost the coordinator\n");
+	raiseError();
+}
+
+// The coordinator must prove that it knows the secret before the worker does
+static void greetCoordinator(int connection, char * secret, int secretLength) {
+	unsigned char challenge[CHALLENGE_SIZE], coordinatorChallenge[CHALLENGE_SIZE];
+	unsigned char proof[EVP_MAX_MD_SIZE];
+
+	newChallenge(challenge);
+	if (!sendBytes(connection, workerMagic, sizeof(workerMagic)) || !sendBytes(connection, &byteOrderMark, sizeof(byteOrderMark))
+		|| !sendBytes(connection, challenge, CHALLENGE_SIZE)
+		|| !receiveBytes(connection, coordinatorChallenge, CHALLENGE_SIZE) || !receiveBytes(connection, proof, SHA256_SIZE)) {
+		fprintf(stderr, "wiggletools: lost the coordinator\n");
+		raiseError();
+	}
+	if (!checkProof(secret, secretLength, 'C', coordinatorChallenge, challenge, proof)) {
+		fprintf(stderr, "wiggletools: the coordinator does not have the same secret\n");
+		raiseError();
+	}
+	proveSecret(secret, secretLength, 'W', challenge, coordinatorChallenge, proof);
+	if (!sendBytes(connection, proof, SHA256_SIZE)) {
+		fprintf(stderr, "wiggletools: lost the coordinator\n");
+		raiseError();
+	}
+}
+
+// The child prints the partial results of the shard into a pipe, which
+// the worker forwards chunk by chunk
+static void runJob(int connection, int shard, int shards, char ** words, int count, char * chromSizes, int threads) {
+	char * chromSizesFile = writeChromSizes(chromSizes);
+	char buffer[CHUNK_SIZE];
+	int32_t length;
+	int pipes[2], status;
+	pid_t child;
+
+	if (pipe(pipes)) {
+		fprintf(stderr, "wiggletools: could not create pipe\n");
+		raiseError();
+	}
+	fflush(stdout);
+	fflush(stderr);
+	child = fork();
+	if (child < 0) {
+		fprintf(stderr, "wiggletools: could not fork for shard %i/%i\n", shard, shards);
+		raiseError();
+	} else if (child == 0) {
+		close(connection);
+		close(pipes[0]);
+		if (dup2(pipes[1], STDOUT_FILENO) < 0) {
+			fprintf(stderr, "wiggletools: could not redirect output\n");
+			raiseError();
+		}
+		close(pipes[1]);
+		rollYourOwnShard(count, words, threads, chromSizesFile, shard, shards);
+		fflush(stdout);
+		exit(0);
+	}
+
+	close(pipes[1]);
+	for (;;) {
+		struct pollfd output = {pipes[0], POLLIN, 0};
+		ssize_t received;
+		int ready = poll(&output, 1, KEEPALIVE_SECONDS * 1000);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready == 0) {
+			length = KEEPALIVE;
+			if (!sendBytes(connection, &length, sizeof(length)))
+				lostCoordinator(child, chromSizesFile);
+			continue;
+		}
+		received = read(pipes[0], buffer, sizeof(buffer));
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			break;
+		length = received;
+		if (!sendBytes(connection, &length, sizeof(length)) || !sendBytes(connection, buffer, length))
+			lostCoordinator(child, chromSizesFile);
+	}
+	close(pipes[0]);
+	while (waitpid(child, &status, 0) < 0 && errno == EINTR);
+	unlink(chromSizesFile);
+	free(chromSizesFile);
+
+	length = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+	if (!sendBytes(connection, &length, sizeof(length))) {
+		fprintf(stderr, "wiggletools: lost the coordinator\n");
+		raiseError();
+	}
+}
+
+void runShardWorker(char * address, int threads, char * secretFile) {
+	int secretLength;
+	char * secret = readSharedSecret(secretFile, &secretLength);
+	int connection = connectToCoordinator(address);
+	int32_t header[3];
+	char ** strings;
+	int i;
+
+	setTimeouts(connection);
+	greetCoordinator(connection, secret, secretLength);
+
+	// The coordinator may simply hang up once all shards are done
+	while (receiveBytes(connection, header, sizeof(header)) && header[0] != 0) {
+		if (header[0] == KEEPALIVE)
+			continue;
+		if (header[0] < 0 || header[2] < 2) {
+			fprintf(stderr, "wiggletools: invalid job from the coordinator\n");
+			raiseError();
+		}
+		strings = (char **) calloc(header[2], sizeof(char *));
+		for (i = 0; i < header[2]; i++) {
+			if (!(strings[i] = receiveString(connection))) {
+				fprintf(stderr, "wiggletools: lost the coordinator\n");
+				raiseError();
+			}
+		}
+		runJob(connection, header[0], header[1], strings + 1, header[2] - 1, strings[0], threads);
+		for (i = 0; i < header[2]; i++)
+			free(strings[i]);
+		free(strings);
+	}
+	close(connection);
+}
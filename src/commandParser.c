@@ -13,13 +13,31 @@
 // limitations under the License.
 
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 // Local header
 #include "multiplexer.h"
-
-bool holdFire = false;
+#include "bigWigWriter.h"
+#include "bgzfWriter.h"
+#include "profiler.h"
+#include "fanOut.h"
+#include "partials.h"
+#include "trackCache.h"
+#include "integerTrack.h"
+#include "matrixStore.h"
+#include "npyWriter.h"
+#include "workEstimates.h"
+#include "largeBuffers.h"
+#include "textBuffer.h"
+#include "errors.h"
+
+// The parser state is per thread, so that several threads can parse programs at once
+static __thread bool holdFire = false;
 
 void printHelp() {
 
@@ -31,8 +49,9 @@ puts("");
 puts("This library parses wiggle files and executes various operations on them streaming through lazy evaluators.");
 puts("");
 puts("Inputs:");
-puts("\tThe program takes in Wig, BigWig, BedGraph, Bed, BigBed, Bam, VCF, and BCF files, which are distinguished thanks to their suffix (.wig, (.bw|.bigWig|.bigwig), .bg, .bed, .bb, .bam, .vcf, .bcf respectively).");
+puts("\tThe program takes in Wig, BigWig, BedGraph, Bed, BigBed, Bam, Cram, VCF, and BCF files, which are distinguished thanks to their suffix (.wig, (.bw|.bigWig|.bigwig), .bg, .bed, .bb, .bam, .cram, .vcf, .bcf respectively). Wig, BedGraph, Bed and VCF files can be gzipped (e.g. .bg.gz), and tabix indexed.");
 puts("\tNote that wiggletools assumes that every bam file has an index .bai file next to it.");
+puts("\tBam files are read as coverage, counting every read that covers each base. Use pileup (in_filename) for samtools pileup depths instead.");
 puts("");
 puts("Outputs:");
 puts("\tThe program outputs a wiggle file in stdout unless the output is squashed");
@@ -40,39 +59,65 @@ puts("");
 puts("Command line:");
 puts("\twiggletools --help");
 puts("\twiggletools program");
+puts("\twiggletools [--checkpoint (file) [--resume]] [--threads (int)] --chrom_sizes (file) [--shard (int)/(int) | --sample (float)] program");
+puts("\twiggletools --chrom_sizes (file) [--bind (address)] --secret (file) --coordinate (port) (int) program");
+puts("\twiggletools [--threads (int)] --worker (host):(port) --secret (file)");
+puts("\twiggletools [--cache (directory)] [--cache_size (int MB)] [--cache_stats] [--coverage_sidecars] [--precision (int)] [--compact_wig] [--apply_threads (int)] [--format_threads (int)] [--write_threads (int)] [--open_threads (int)] [--io_threads (int)] [--async_reads (int)] [--fetch_connections (int)] [--bgzf_threads (int)] [--parse_threads (int)] [--inflate_threads (int)] [--sort_memory (int MB)] [--result_cache (int MB)] [--correlation_threads (int)] [--max_memory (int MB)] [--huge_pages] [--numa] [--chrom_order (file)] [--memory_stats] [--profile] [--trace (file)] [--progress (seconds)] [--status_file (file)] ... ");
 puts("");
 puts("Program grammar:");
-puts("\tprogram = (iterator) | do (iterator) | (extraction) | (statistic) | run (file)");
-puts("\titerator = (in_filename) | (unary_operator) (iterator) | (binary_operator) (iterator) (iterator) | (reducer) (multiplex) | (setComparison) (multiplex_list) | print (output) (statistic)");
-puts("\tunary_operator = unit | coverage | write (output) | write_bg (ouput) | smooth (int) | exp | ln | log (float) | pow (float) | offset (float) | scale (float) | gt (float) | lt (float) | default (float) | isZero | extend (int) | (statistic)");
-puts("\toutput = (out_filename) | -");
-puts("\tin_filename = *.wig | *.bw | *.bed | *.bb | *.bg | *.bam | *.vcf | *.bcf");
+puts("\tprogram = (iterator) | do (iterator) | (extraction) | (statistic) | batch (regions) (iterator|statistic) | run (file) | serve (socket)");
+puts("\tregions = (chrom):(start)-(finish)[,(chrom):(start)-(finish)]*");
+puts("\tfile = (program) [(;|newline) (program)]*");
+puts("\titerator = (in_filename) | (unary_operator) (iterator) | (binary_operator) (iterator) (iterator) | (reducer) (multiplex) | (setComparison) (multiplex_list) | print (output) (statistic) | bam (bam_filter)* (in_filename) | pileup (in_filename) | vcf (vcf_field) (in_filename) | score (in_filename) | select (int) (multiplex) | lincomb (weights) (multiplex)");
+puts("\tunary_operator = unit | coverage | fragments (int) | write (output) | write_bg (ouput) | write_pyramid (output) (widths) (bin_statistic) | cache (output|memo_name) | smooth (int) | gaussian (float) | abs | exp | ln | log (float) | pow (float) | offset (float) | scale (float) | gt (float) | lt (float) | default (float) | isZero | extend (int) | bin (int) (bin_statistic) | roll (int) (roll_statistic) | mask | (statistic)");
+puts("\tbin_statistic = sum | mean | max | min | coverage");
+puts("\twidths = (int)[,(int)]*");
+puts("\troll_statistic = max | min | median");
+puts("\toutput = (out_filename) | -\t(filenames ending in .bw or .bigWig are written as BigWig, .gz as BGZF with a tabix index for BedGraphs)");
+puts("\tbam_filter = -q (min_mapping_quality) | -f (required_flags) | -F (excluded_flags) | -s (+|-) | -e (fragment_length)");
+puts("\tvcf_field = QUAL | INFO/(key) | FORMAT/(key), FORMAT/GT being read as the count of non reference alleles");
+puts("\tin_filename = *.wig | *.bw | *.bed | *.bb | *.bg | *.bam | *.cram | *.vcf | *.bcf | *.wig.gz | *.bg.gz | *.bed.gz | *.vcf.gz");
 puts("\tstatistic = (statistic_function) (iterator) | ndpearson (multiplex) (multiplex)");
-puts("\tstatistic_function = AUC | meanI | varI | minI | maxI | stddevI | CVI | pearson (iterator)");
-puts("\tbinary_operator = diff | ratio | overlaps | trim | noverlaps | nearest | apply (statistic) | fillIn");
+puts("\tstatistic_function = AUC | meanI | varI | minI | maxI | stddevI | CVI | quantileI (float) | pearson (iterator)");
+puts("\tbinary_operator = diff | ratio | overlaps | trim | noverlaps | nearest | and | or | andnot | apply (statistic) [zoom] [fillIn] | fillIn | roll (int) pearson");
 puts("\treducer = cat | sum | product | mean | var | stddev | entropy | CV | median | min | max");
-puts("\tsetComparison = ttest | ftest | wilcoxon");
+puts("\tsetComparison = ttest [test_output] [permute (int)] | ftest [test_output] [permute (int)] | wilcoxon [permute (int)]");
+puts("\ttest_output = statistic | below (float)");
 puts("\tmultiplex_list = (multiplex) | (multiplex) : (multiplex_list)");
-puts("\tmultiplex = (iterator_list) | map (unary_operator) (multiplex) | strict (multiplex)");
+puts("\tmultiplex = (iterator_list) | map (unary_operator) (multiplex) | strict (multiplex) | vcf_samples FORMAT/(key) (in_filename) | bam_strands (bam_filter)* (in_filename) | lincomb (weights)[:(weights)]* (multiplex) | annotate (overlaps|nearest|values) (iterator) (iterator_list)");
+puts("\tweights = (float)[,(float)]*\t(one weight per input of the multiplex)");
 puts("\titerator_list = (iterator) | (iterator) : (iterator_list)");
-puts("\textraction = profile (output) (int) (iterator) (iterator) | profiles (output) (int) (iterator) (iterator) | histogram (output) (width) (iterator_list) | mwrite (output) (multiplex) | mwrite_bg (output) (multiplex)");
-puts("\t\t| apply_paste (out_filename) (statistic) (bed_file) (iterator)");
+puts("\textraction = profile (output) [zoom] (int) (iterator) (iterator) | profiles (output) [zoom] (int) (iterator) (iterator) | histogram (output) (width) (iterator_list) | top (output) (int) (iterator) | correlations (output) (multiplex) | mwrite (output) (multiplex) | mwrite_bg (output) (multiplex) | mwrite_matrix (output) (multiplex) | mappend_matrix (matrix) (multiplex)");
+puts("\t\t| [seek (chrom) (start) (finish)] apply_paste (out_filename) (statistic) [zoom] [fillIn] (bed_file) (iterator_list)");
+puts("\t\t| partial (output) (partial) | merge_partials (output) (partial_filenames) | compact_matrix (matrix)");
+puts("\tpartial = (statistic) | histogram (width) (iterator_list) | top (int) (iterator) | profile [zoom] (int) (iterator) (iterator) | merge_partials (partial_filenames)");
 
 }
 
+// Command line being parsed
+static __thread char ** tokens;
+static __thread int tokenCount;
+static __thread int tokenIndex;
+// Tokens over which files are shared, see readFile
+static __thread char ** sharedTokens;
+static __thread int sharedTokenCount;
+
+static void resetSharedFiles();
+static FILE * standardOutput();
+
 static char * nextToken(int argc, char ** argv) {
-	static int count;
-	static char ** ptr;
-	static int index;
 	if (argv) {
-		ptr = argv;
-		count = argc;
-		index = 0;
+		tokens = argv;
+		tokenCount = argc;
+		tokenIndex = 0;
+		sharedTokens = argv;
+		sharedTokenCount = argc;
+		resetSharedFiles();
 	}
-	if (index == count)
+	if (tokenIndex == tokenCount)
 		return NULL;
 	else
-		return ptr[index++];
+		return tokens[tokenIndex++];
 }
 
 static char * needNextToken() {
@@ -81,28 +126,185 @@ static char * needNextToken() {
 		return token;
 	} else {
 		fprintf(stderr, "wiggletools: Unexpected end of command line\n");
-		exit(1);
+		raiseError();
 	}
 }
 
 static WiggleIterator * readIteratorToken(char * token);
+static void skipIteratorToken(char * token);
 
 static WiggleIterator * readIterator() {
 	return readIteratorToken(needNextToken());
 }
 
+// Token of the last file opened by readIteratorToken
+static __thread char * lastFileToken = NULL;
+
+//////////////////////////////////////////////////////
+// Shared files
+//////////////////////////////////////////////////////
+
+// A file named several times in the command, e.g. ratio x.bw mean x.bw y.bw, 
+// is read once, and its records are fanned out to each of the iterators
+typedef struct sharedFile_st {
+	char * filename;
+	bool holdFire;
+	FanOut * fanOut;
+} SharedFile;
+
+static __thread SharedFile * sharedFiles = NULL;
+static __thread int sharedFileCount = 0;
+static __thread int maxSharedFiles = 0;
+
+static void resetSharedFiles() {
+	sharedFileCount = 0;
+}
+
+static int countTokens(char * token) {
+	int i, count = 0;
+	for (i = 0; i < sharedTokenCount; i++)
+		if (strcmp(sharedTokens[i], token) == 0)
+			count++;
+	return count;
+}
+
+static WiggleIterator * readFile(char * token) {
+	int i, count;
+
+	lastFileToken = token;
+	// Standard input cannot be opened twice
+	if (strcmp(token, "-") == 0 || (count = countTokens(token)) < 2)
+		return SmartReader(token, holdFire);
+
+	for (i = 0; i < sharedFileCount; i++)
+		if (strcmp(sharedFiles[i].filename, token) == 0 && sharedFiles[i].holdFire == holdFire)
+			return FanOutWiggleIterator(sharedFiles[i].fanOut);
+
+	if (sharedFileCount == maxSharedFiles) {
+		maxSharedFiles = maxSharedFiles ? 2 * maxSharedFiles : 8;
+		sharedFiles = (SharedFile *) realloc(sharedFiles, maxSharedFiles * sizeof(SharedFile));
+	}
+	sharedFiles[sharedFileCount].filename = token;
+	sharedFiles[sharedFileCount].holdFire = holdFire;
+	sharedFiles[sharedFileCount].fanOut = newFanOut(token, holdFire, count);
+	return FanOutWiggleIterator(sharedFiles[sharedFileCount++].fanOut);
+}
+
+// Opens a second reader on an indexed file to prefetch regions, if the 
+// iterator read from token is just that file
+static WiggleIterator * readPrefetchReader(char * token) {
+	if (token == lastFileToken && isIndexedFile(token)) {
+		WiggleIterator * prefetch = SmartReader(token, true);
+		nameProfile(prefetch->profile, "prefetch");
+		return prefetch;
+	}
+	return NULL;
+}
+
+// No second reader is opened when the results come from the zoom levels
+static WiggleIterator * readApplyPrefetchReader(char * token, bool zoom, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator * data) {
+	if (zoom && canZoomApply(statistics, count, data))
+		return NULL;
+	return readPrefetchReader(token);
+}
+
+//////////////////////////////////////////////////////
+// Concurrent opening
+//////////////////////////////////////////////////////
+
+// Opening an indexed file reads its header and index, then its first block
+// unless the reader holds fire. Remote files cost a round trip for each, so 
+// the files of a list, e.g. mean a.bw b.bw c.bw, are opened on a few threads.
+static int openThreads = 16;
+
+void setOpenThreads(int threads) {
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of file opening threads: %i\n", threads);
+		raiseError();
+	}
+	openThreads = threads;
+}
+
+typedef struct fileOpening_st {
+	char ** filenames;
+	WiggleIterator ** iters;
+	int count;
+	int next;
+	bool holdFire;
+} FileOpening;
+
+static void * openFiles(void * args) {
+	FileOpening * opening = (FileOpening *) args;
+	int index;
+
+	while ((index = __atomic_fetch_add(&opening->next, 1, __ATOMIC_SEQ_CST)) < opening->count)
+		opening->iters[index] = SmartReader(opening->filenames[index], opening->holdFire);
+	return NULL;
+}
+
+// Files read by a single iterator, which readFile opens with SmartReader
+static bool isConcurrentFileToken(char * token) {
+	return isIndexedFile(token) && countTokens(token) < 2;
+}
+
+// Number of file tokens opened concurrently from token, the last one read
+static int fileRunLength(char * token) {
+	int first = tokenIndex - 1, count = 0;
+
+	if (openThreads < 2 || first < 0 || tokens[first] != token)
+		return 0;
+	while (first + count < tokenCount && isConcurrentFileToken(tokens[first + count]))
+		count++;
+	// A single file is simply opened in place
+	return count > 1 ? count : 0;
+}
+
+// Opens the files of the run, and moves on to the last one
+static void openFileRun(WiggleIterator ** iters, int count) {
+	FileOpening opening;
+	pthread_t * threads;
+	int i, threadCount = count < openThreads ? count : openThreads;
+
+	opening.filenames = tokens + tokenIndex - 1;
+	opening.iters = iters;
+	opening.count = count;
+	opening.next = 0;
+	opening.holdFire = holdFire;
+	threads = (pthread_t *) calloc(threadCount, sizeof(pthread_t));
+	for (i = 0; i < threadCount; i++) {
+		if (pthread_create(threads + i, NULL, &openFiles, &opening)) {
+			fprintf(stderr, "Could not create file opening thread\n");
+			raiseError();
+		}
+	}
+	for (i = 0; i < threadCount; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < count; i++)
+		nameProfile(iters[i]->profile, opening.filenames[i]);
+	lastFileToken = opening.filenames[count - 1];
+	tokenIndex += count - 1;
+}
+
 static WiggleIterator ** readFileList(int * count, char * firstToken) {
 	size_t buffer_size = 8;
 	char * token;
 	int i =0;
+	int run;
 	WiggleIterator ** iters = (WiggleIterator **) calloc(buffer_size, sizeof(WiggleIterator*));
 
 	for (token = firstToken; token != NULL && strcmp(token, ":"); token = nextToken(0,0)) {
-		if (i == buffer_size) {
-			buffer_size *= 2;
+		run = fileRunLength(token);
+		if (i + (run ? run : 1) > buffer_size) {
+			buffer_size = 2 * buffer_size > i + run ? 2 * buffer_size : i + run;
 			iters = (WiggleIterator **) realloc(iters, buffer_size * sizeof(WiggleIterator*));
 		}
-		iters[i++] = readIteratorToken(token);
+		if (run) {
+			openFileRun(iters + i, run);
+			i += run;
+		} else
+			iters[i++] = readIteratorToken(token);
 	}
 	*count = i;
 	return iters;
@@ -110,6 +312,38 @@ static WiggleIterator ** readFileList(int * count, char * firstToken) {
 
 static WiggleIterator ** readIteratorList(int * count, bool * strict);
 
+static BinStatistic readBinStatistic() {
+	char * token = needNextToken();
+
+	if (strcmp(token, "sum") == 0)
+		return BIN_SUM;
+	else if (strcmp(token, "mean") == 0)
+		return BIN_MEAN;
+	else if (strcmp(token, "max") == 0)
+		return BIN_MAX;
+	else if (strcmp(token, "min") == 0)
+		return BIN_MIN;
+	else if (strcmp(token, "coverage") == 0)
+		return BIN_COVERAGE;
+	fprintf(stderr, "Unknown bin statistic: %s\n", token);
+	raiseError();
+}
+
+static RollingStatistic parseRollingStatistic(char * token) {
+	if (strcmp(token, "max") == 0)
+		return ROLLING_MAX;
+	else if (strcmp(token, "min") == 0)
+		return ROLLING_MIN;
+	else if (strcmp(token, "median") == 0)
+		return ROLLING_MEDIAN;
+	fprintf(stderr, "Unknown rolling statistic: %s\n", token);
+	raiseError();
+}
+
+static RollingStatistic readRollingStatistic() {
+	return parseRollingStatistic(needNextToken());
+}
+
 static WiggleIterator ** readMappedIteratorList(int * count, bool * strict) {
 	char * token = needNextToken();
 	WiggleIterator ** iters;
@@ -128,6 +362,23 @@ static WiggleIterator ** readMappedIteratorList(int * count, bool * strict) {
 		iters = readIteratorList(count, strict);
 		for (i = 0; i < *count; i++)
 			iters[i] = SmoothWiggleIterator(iters[i], width);
+	} else if (strcmp(token, "gaussian") == 0) {
+		double sigma = atof(needNextToken());
+		iters = readIteratorList(count, strict);
+		for (i = 0; i < *count; i++)
+			iters[i] = GaussianWiggleIterator(iters[i], sigma);
+	} else if (strcmp(token, "bin") == 0) {
+		int width = atoi(needNextToken());
+		BinStatistic statistic = readBinStatistic();
+		iters = readIteratorList(count, strict);
+		for (i = 0; i < *count; i++)
+			iters[i] = BinWiggleIterator(iters[i], width, statistic);
+	} else if (strcmp(token, "roll") == 0) {
+		int width = atoi(needNextToken());
+		RollingStatistic statistic = readRollingStatistic();
+		iters = readIteratorList(count, strict);
+		for (i = 0; i < *count; i++)
+			iters[i] = RollingWiggleIterator(iters[i], width, statistic);
 	} else if (strcmp(token, "exp") == 0) {
 		iters = readIteratorList(count, strict);
 		for (i = 0; i < *count; i++)
@@ -178,7 +429,7 @@ static WiggleIterator ** readMappedIteratorList(int * count, bool * strict) {
 			iters[i] = DefaultValueWiggleIterator(iters[i], scalar);
 	} else {
 		fprintf(stderr, "Unary function unkown: %s\n", token);
-		exit(1);
+		raiseError();
 	}
 
 	return iters;
@@ -207,7 +458,7 @@ static void noTokensLeft() {
 			remainder = nextToken(0,0);
 		}
 		fprintf(stderr, "\n");
-		exit(1);
+		raiseError();
 	}
 }
 
@@ -218,21 +469,24 @@ static WiggleIterator ** readLastIteratorList(int * count) {
 	return res;
 }
 
-static FILE * readOutputFilename() {
-	char * filename = needNextToken();
+FILE * openOutputFile(char * filename) {
 	if (strcmp(filename, "-")) {
 		if( access( filename, F_OK ) == 0 ) {
 			fprintf(stderr, "File %s already exists, please delete it if you want to overwrite it.\n", filename);
-			exit(1);
+			raiseError();
 		}
 		FILE * file = fopen(filename, "w");
 		if (!file) {
 			fprintf(stderr, "Could not open output file %s.\n", filename);
-			exit(1);
+			raiseError();
 		}
 		return file;
 	} else 
-		return stdout;
+		return standardOutput();
+}
+
+static FILE * readOutputFilename() {
+	return openOutputFile(needNextToken());
 }
 
 typedef WiggleIterator * (*statisticCreator)(WiggleIterator *);
@@ -257,6 +511,8 @@ static statisticCreator * readStatisticList(char ** token, int * count) {
 			statistics[(*count)++] = &MaxIntegrator;
 		else if (strcmp(*token, "minI") == 0)
 			statistics[(*count)++] = &MinIntegrator;
+		else if (strcmp(*token, "quantileI") == 0)
+			statistics[(*count)++] = quantileIntegratorCreator(atof(needNextToken()));
 		else
 			break;
 
@@ -270,41 +526,74 @@ static statisticCreator * readStatisticList(char ** token, int * count) {
 
 	if (*count == 0) {
 		fprintf(stderr, "Name of function to be applied unrecognized: %s\n", *token);
-		exit(1);
+		raiseError();
 	}
 
 	return statistics;
 }
 
+// Reads the optional fillIn and zoom keywords of apply commands
+static char * readApplyOptions(char * token, bool * strict, bool * zoom) {
+	while (true) {
+		if (strcmp(token, "fillIn") == 0)
+			*strict = false;
+		else if (strcmp(token, "zoom") == 0)
+			*zoom = true;
+		else
+			return token;
+		token = needNextToken();
+	}
+}
+
 static Multiplexer * readApply() {
 	char * token = needNextToken();
 	bool strict = true;
+	bool zoom = false;
 	int count;
 	statisticCreator * statistics = readStatisticList(&token, &count);
-
-	if (strcmp(token, "fillIn") == 0) {
-		strict = false;
-		token = needNextToken();
-	}
+	token = readApplyOptions(token, &strict, &zoom);
 
 	WiggleIterator * regions = readIteratorToken(token);
-	WiggleIterator * data = readIterator();
+	token = needNextToken();
+	WiggleIterator * data = readIteratorToken(token);
 
-	return ApplyMultiplexer(regions, statistics, count, data, strict);
+	return ApplyMultiplexerFull(regions, statistics, count, data, strict, zoom, readApplyPrefetchReader(token, zoom, statistics, count, data));
 }
 
 
 static Multiplexer * readMultiplexer();
+static Multiplexer * readLinearCombination();
+static Multiplexer * readAnnotation();
+static char * readBamFilters(int * minMapQ, int * requiredFlags, int * excludedFlags, int * strand, int * extension);
 
-static Multiplexer * readMultiplexerToken(char * token) {
+static Multiplexer * parseMultiplexerToken(char * token) {
 	if (strcmp(token, "mwrite") == 0) {
 		FILE * file = readOutputFilename();
 		return TeeMultiplexer(readMultiplexer(), file, false, holdFire);
 	} else if (strcmp(token, "mwrite_bg") == 0) {
 		FILE * file = readOutputFilename();
 		return TeeMultiplexer(readMultiplexer(), file, true, holdFire);
+	} else if (strcmp(token, "mwrite_matrix") == 0) {
+		FILE * file = readOutputFilename();
+		return MatrixTeeMultiplexer(readMultiplexer(), file, holdFire);
+	} else if (strcmp(token, "mappend_matrix") == 0) {
+		char * filename = needNextToken();
+		return MatrixAppendMultiplexer(readMultiplexer(), filename, holdFire);
 	} else if (strcmp(token, "apply") == 0) {
 		return readApply();
+	} else if (strcmp(token, "vcf_samples") == 0) {
+		char * field = needNextToken();
+		return VcfSampleMultiplexer(needNextToken(), field);
+	} else if (strcmp(token, "lincomb") == 0) {
+		return readLinearCombination();
+	} else if (strcmp(token, "annotate") == 0) {
+		return readAnnotation();
+	} else if (strcmp(token, "bam_strands") == 0) {
+		int minMapQ, requiredFlags, excludedFlags;
+		char * filename = readBamFilters(&minMapQ, &requiredFlags, &excludedFlags, NULL, NULL);
+		return BamStrandsMultiplexer(filename, minMapQ, requiredFlags, excludedFlags);
+	} else if (isMatrixFilename(token)) {
+		return MatrixMultiplexer(token);
 	} else {
 		int count = 0; 
 		bool strict = false;
@@ -313,6 +602,14 @@ static Multiplexer * readMultiplexerToken(char * token) {
 	}
 }
 
+static Multiplexer * readMultiplexerToken(char * token) {
+	Multiplexer * multi = parseMultiplexerToken(token);
+	// Plain lists of iterators are folded into the operator reading them
+	if (strcmp(token, "mwrite") == 0 || strcmp(token, "mwrite_bg") == 0 || strcmp(token, "mwrite_matrix") == 0 || strcmp(token, "mappend_matrix") == 0 || strcmp(token, "apply") == 0 || strcmp(token, "lincomb") == 0 || strcmp(token, "annotate") == 0)
+		nameProfile(multi->profile, token);
+	return multi;
+}
+
 static Multiplexer * readLastMultiplexerToken(char * token) {
 	Multiplexer * res = readMultiplexerToken(token);
 	noTokensLeft();
@@ -324,13 +621,12 @@ static Multiplexer * readMultiplexer() {
 	return readMultiplexerToken(token);
 }
 
-static Multiplexer ** readMultiplexerList(int * count) {
+static Multiplexer ** readMultiplexerListToken(int * count, char * token) {
 	size_t buffer_size = 8;
-	char * token;
 	Multiplexer ** multis = (Multiplexer **) calloc(buffer_size, sizeof(Multiplexer*));
 	*count = 0;
 
-	for (token = nextToken(0,0); token != NULL && strcmp(token, ":"); token = nextToken(0,0)) {
+	for (; token != NULL && strcmp(token, ":"); token = nextToken(0,0)) {
 		if (*count == buffer_size) {
 			buffer_size *= 2;
 			multis = (Multiplexer **) realloc(multis, buffer_size * sizeof(Multiplexer*));
@@ -340,20 +636,156 @@ static Multiplexer ** readMultiplexerList(int * count) {
 	return multis;
 }
 
-static Multiset * readMultiset() {
+static Multiset * readMultisetToken(char * token) {
 	int count = 0; 
-	Multiplexer ** multis = readMultiplexerList(&count);
+	Multiplexer ** multis = readMultiplexerListToken(&count, token);
 	return newMultiset(multis, count);
 }
 
+// The format of the output is set by the suffix of its filename
+static WiggleIterator * openTee(WiggleIterator * iter, char * filename, FILE * file, bool bedGraph) {
+	if (isTrackCacheFilename(filename))
+		return TrackCacheTeeWiggleIterator(iter, file);
+	if (isIntegerTrackFilename(filename))
+		return IntegerTrackTeeWiggleIterator(iter, file);
+	if (isBigWigFilename(filename))
+		return BigWigTeeWiggleIterator(iter, file);
+	if (isBgzfFilename(filename))
+		return BgzfTeeWiggleIterator(iter, file, filename, bedGraph, holdFire);
+	return TeeWiggleIterator(iter, file, bedGraph, holdFire);
+}
+
 static WiggleIterator * readTee() {
-	FILE * file = readOutputFilename();
-	return TeeWiggleIterator(readIterator(), file, false, holdFire);
+	char * filename = needNextToken();
+	FILE * file = openOutputFile(filename);
+	return openTee(readIterator(), filename, file, false);
 }
 
 static WiggleIterator * readBGTee() {
-	FILE * file = readOutputFilename();
-	return TeeWiggleIterator(readIterator(), file, true, holdFire);
+	char * filename = needNextToken();
+	FILE * file = openOutputFile(filename);
+	return openTee(readIterator(), filename, file, true);
+}
+
+// Increasing widths, separated by commas
+static int * parsePyramidWidths(char * token, int * count) {
+	int * widths = NULL;
+	int capacity = 0;
+	char * ptr = token, * end;
+
+	*count = 0;
+	while (true) {
+		long width = strtol(ptr, &end, 10);
+		if (end == ptr || width < 1 || width > INT_MAX || (*end != ',' && *end != '\0') || (*count && width <= widths[*count - 1])) {
+			fprintf(stderr, "Invalid pyramid widths, must be increasing positive integers: %s\n", token);
+			raiseError();
+		}
+		if (*count == capacity) {
+			capacity = capacity ? 2 * capacity : 8;
+			widths = (int *) realloc(widths, capacity * sizeof(int));
+		}
+		widths[(*count)++] = width;
+		if (*end == '\0')
+			return widths;
+		ptr = end + 1;
+	}
+}
+
+// Inserts the width before the suffixes of the file name, e.g. out.100.bg.gz
+static char * pyramidFilename(char * filename, int width) {
+	char * base = strrchr(filename, '/');
+	char * suffix = strchr(base ? base + 1 : filename, '.');
+	size_t prefix = suffix ? suffix - filename : strlen(filename);
+	char * name = (char *) calloc(prefix + strlen(filename + prefix) + 16, sizeof(char));
+
+	memcpy(name, filename, prefix);
+	sprintf(name + prefix, ".%i%s", width, filename + prefix);
+	return name;
+}
+
+// A BigWig file stores the finest width as data and the others as zoom
+// levels, any other format gets one file per width
+static WiggleIterator * readPyramidTee() {
+	char * filename = needNextToken();
+	int count, level;
+	int * widths = parsePyramidWidths(needNextToken(), &count);
+	BinStatistic statistic = readBinStatistic();
+	WiggleIterator * source = readIterator();
+
+	if (!strcmp(filename, "-")) {
+		fprintf(stderr, "A pyramid cannot be written to standard output\n");
+		raiseError();
+	}
+
+	if (isBigWigFilename(filename)) {
+		// Zoom records are computed from the data, then from each other
+		for (level = 1; level < count; level++) {
+			if (widths[level] % widths[level - 1]) {
+				fprintf(stderr, "The widths of a BigWig pyramid must be multiples of each other: %i, %i\n", widths[level - 1], widths[level]);
+				raiseError();
+			}
+		}
+		FILE * file = openOutputFile(filename);
+		// At single base resolution, binning leaves the values unchanged
+		if (widths[0] > 1 || statistic == BIN_COVERAGE)
+			source = BinWiggleIterator(source, widths[0], statistic);
+		return ZoomedBigWigTeeWiggleIterator(source, file, widths + 1, count - 1);
+	}
+
+	Pyramid * pyramid = newPyramid(source);
+	for (level = 0; level < count; level++) {
+		char * name = pyramidFilename(filename, widths[level]);
+		FILE * file = openOutputFile(name);
+		addPyramidLevel(pyramid, openTee(PyramidBinWiggleIterator(pyramid, widths[level], statistic), name, file, false));
+	}
+	free(widths);
+	return PyramidWiggleIterator(pyramid);
+}
+
+static unsigned long long hashBytes(unsigned long long hash, const void * bytes, size_t length) {
+	const unsigned char * ptr = (const unsigned char *) bytes;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= ptr[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Fingerprint of the tokens from first to last excluded, and of the files they name
+static unsigned long long hashExpression(int first, int last) {
+	unsigned long long hash = 14695981039346656037ULL;
+	struct stat info;
+	int i;
+
+	for (i = first; i < last; i++) {
+		hash = hashBytes(hash, tokens[i], strlen(tokens[i]) + 1);
+		if (stat(tokens[i], &info) == 0) {
+			long long stamps[3] = {info.st_mtim.tv_sec, info.st_mtim.tv_nsec, info.st_size};
+			hash = hashBytes(hash, stamps, sizeof(stamps));
+		}
+	}
+	return hash;
+}
+
+// Without the .wtc suffix, the name is that of a memo: the records of the
+// iterator are stored the first time round, then read back as long as the
+// expression and the files it reads are unchanged
+static WiggleIterator * readTrackCacheTee() {
+	char * filename = needNextToken();
+	int first = tokenIndex;
+	char * memo;
+
+	if (isTrackCacheFilename(filename) || strcmp(filename, "-") == 0)
+		return TrackCacheTeeWiggleIterator(readIterator(), openOutputFile(filename));
+
+	skipIteratorToken(needNextToken());
+	memo = (char *) malloc(strlen(filename) + 32);
+	sprintf(memo, "%s.%016llx.wtc", filename, hashExpression(first, tokenIndex));
+	if (access(memo, R_OK) == 0)
+		return TrackCacheReader(memo);
+	tokenIndex = first;
+	return TrackCacheMemoWiggleIterator(readIterator(), memo);
 }
 
 static WiggleIterator * readLastIteratorToken(char * token) {
@@ -366,7 +798,7 @@ static WiggleIterator * readLastIteratorToken(char * token) {
 			remainder = nextToken(0,0);
 		}
 		fprintf(stderr, "\n");
-		exit(1);
+		raiseError();
 	}
 	return iter;
 }
@@ -380,9 +812,9 @@ static WiggleIterator * readSmooth() {
 	return SmoothWiggleIterator(readIterator(), width);
 }
 
-static WiggleIterator * readPow() {
-	double base = atof(needNextToken());
-	return PowerWiggleIterator(readIterator(), base);
+static WiggleIterator * readGaussian() {
+	double sigma = atof(needNextToken());
+	return GaussianWiggleIterator(readIterator(), sigma);
 }
 
 static WiggleIterator * readExtend() {
@@ -390,6 +822,24 @@ static WiggleIterator * readExtend() {
 	return ExtendWiggleIterator(readIterator(), extension);
 }
 
+static WiggleIterator * readBin() {
+	int width = atoi(needNextToken());
+	BinStatistic statistic = readBinStatistic();
+	return BinWiggleIterator(readIterator(), width, statistic);
+}
+
+static WiggleIterator * readRoll() {
+	int width = atoi(needNextToken());
+	char * token = needNextToken();
+	if (strcmp(token, "pearson") == 0) {
+		WiggleIterator * iterX = readIterator();
+		WiggleIterator * iterY = readIterator();
+		return RollingPearsonWiggleIterator(iterX, iterY, width);
+	}
+	RollingStatistic statistic = parseRollingStatistic(token);
+	return RollingWiggleIterator(readIterator(), width, statistic);
+}
+
 static WiggleIterator * readOverlap() {
 	WiggleIterator * mask = readIterator();
 	WiggleIterator * source = readIterator();
@@ -414,43 +864,209 @@ static WiggleIterator * readNearest() {
 	return NearestWiggleIterator(source, mask);
 }
 
-static WiggleIterator * readGt() {
-	double cutoff = atof(needNextToken());
-	return HighPassFilterWiggleIterator(readIterator(), cutoff);
+// Masks read their inputs to the end straight away
+static WiggleIterator * readMaskInput() {
+	bool fire = holdFire;
+	WiggleIterator * iter;
+
+	holdFire = false;
+	iter = readIterator();
+	holdFire = fire;
+	return iter;
+}
+
+static WiggleIterator * readMask() {
+	return MaskWiggleIterator(readMaskInput());
 }
 
-static WiggleIterator * readLt() {
-	double cutoff = atof(needNextToken());
-	return HighPassFilterWiggleIterator(ScaleWiggleIterator(readIterator(), -1), -cutoff);
+static WiggleIterator * readAndMask() {
+	WiggleIterator * A = readMaskInput();
+	return AndMaskWiggleIterator(A, readMaskInput());
 }
 
-static WiggleIterator * readDefault() {
-	double value = atof(needNextToken());
-	return DefaultValueWiggleIterator(readIterator(), value);
+static WiggleIterator * readOrMask() {
+	WiggleIterator * A = readMaskInput();
+	return OrMaskWiggleIterator(A, readMaskInput());
 }
 
-static WiggleIterator * readScale() {
-	double scalar = atof(needNextToken());
-	return ScaleWiggleIterator(readIterator(), scalar);
+static WiggleIterator * readAndNotMask() {
+	WiggleIterator * A = readMaskInput();
+	return AndNotMaskWiggleIterator(A, readMaskInput());
 }
 
-static WiggleIterator * readShift() {
-	double scalar = atof(needNextToken());
-	return ShiftWiggleIterator(readIterator(), scalar);
+// Length of the list of plain files about to be read, 0 if it holds anything else
+static int plainFileListLength() {
+	int i;
+
+	for (i = tokenIndex; i < tokenCount && strcmp(tokens[i], ":"); i++)
+		if (strcmp(tokens[i], "-") == 0 || !isWiggleFilename(tokens[i]) || countTokens(tokens[i]) > 1 || access(tokens[i], R_OK))
+			return 0;
+	return i - tokenIndex;
 }
 
-static WiggleIterator * readExp() {
-	return NaturalExpWiggleIterator(readIterator());
+// Very long lists of files are reduced by groups, NULL otherwise
+static WiggleIterator * readGroupedReduction(GroupedReducer reducer) {
+	int count = plainFileListLength();
+	char ** filenames = tokens + tokenIndex;
+
+	if (!isGroupedReduction(count))
+		return NULL;
+	tokenIndex += count;
+	// Skips the colon closing the list
+	if (tokenIndex < tokenCount)
+		tokenIndex++;
+	return GroupedReduction(filenames, count, reducer);
 }
 
 static WiggleIterator * readSum() {
-	return SumReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_SUM);
+	return res ? res : SumReduction(readMultiplexer());
 }
 
 static WiggleIterator * readFillIn() {
 	return FillInReduction(readMultiplexer());
 }
 
+// Skips an input of a multiplex: files are not even opened, other iterators 
+// are parsed but never started
+static void skipIteratorToken(char * token) {
+	bool fire = holdFire;
+
+	if (isWiggleFilename(token) && countTokens(token) < 2)
+		return;
+	holdFire = true;
+	readIteratorToken(token);
+	holdFire = fire;
+}
+
+// Plain lists of iterators whose inputs can be read on their own
+static bool isPlainListToken(char * token) {
+	return strcmp(token, "mwrite") && strcmp(token, "mwrite_bg") && strcmp(token, "mwrite_matrix") && strcmp(token, "mappend_matrix") && strcmp(token, "apply") && strcmp(token, "vcf_samples") && strcmp(token, "bam_strands") && strcmp(token, "map") && strcmp(token, "strict") && strcmp(token, "lincomb") && strcmp(token, "annotate") && !isMatrixFilename(token);
+}
+
+// Vectors of weights separated by colons, their weights by commas, 
+// e.g. 0.3,1.2,0.7:1,1,1
+static double * parseWeights(char * token, int * vectorCount, int * length) {
+	double * weights = NULL;
+	int count = 0, capacity = 0, vectorLength = 0;
+	char * ptr = token, * end;
+
+	*vectorCount = 0;
+	*length = 0;
+	while (true) {
+		double weight = strtod(ptr, &end);
+		if (end == ptr) {
+			fprintf(stderr, "Invalid weights: %s\n", token);
+			raiseError();
+		}
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 16;
+			weights = (double *) realloc(weights, capacity * sizeof(double));
+		}
+		weights[count++] = weight;
+		vectorLength++;
+		if (*end == ',') {
+			ptr = end + 1;
+			continue;
+		} else if (*end != ':' && *end != '\0') {
+			fprintf(stderr, "Invalid weights: %s\n", token);
+			raiseError();
+		}
+
+		if (*vectorCount && vectorLength != *length) {
+			fprintf(stderr, "The vectors of weights differ in length: %s\n", token);
+			raiseError();
+		}
+		*length = vectorLength;
+		(*vectorCount)++;
+		vectorLength = 0;
+		if (*end == '\0')
+			return weights;
+		ptr = end + 1;
+	}
+}
+
+static Multiplexer * readLinearCombination() {
+	int vectorCount, length;
+	char * token = needNextToken();
+	double * weights = parseWeights(token, &vectorCount, &length);
+	Multiplexer * multi = readMultiplexer();
+
+	if (length != multi->count) {
+		fprintf(stderr, "Linear combination of %i inputs with %i weights: %s\n", multi->count, length, token);
+		raiseError();
+	}
+	return LinearCombinationMultiplexer(multi, weights, vectorCount);
+}
+
+static Multiplexer * readAnnotation() {
+	char * token = needNextToken();
+	bool nearest = false, values = false;
+	bool strict;
+	int count;
+	WiggleIterator * signal;
+	WiggleIterator ** masks;
+
+	if (strcmp(token, "nearest") == 0)
+		nearest = true;
+	else if (strcmp(token, "values") == 0)
+		values = true;
+	else if (strcmp(token, "overlaps")) {
+		fprintf(stderr, "Signals are annotated with overlaps, nearest or values, not %s\n", token);
+		raiseError();
+	}
+	signal = readIterator();
+	masks = readIteratorList(&count, &strict);
+	if (values)
+		return LookupMultiplexer(signal, masks, count);
+	return AnnotationMultiplexer(signal, masks, count, nearest);
+}
+
+static WiggleIterator * readLinearCombinationReduction() {
+	Multiplexer * multi = readLinearCombination();
+
+	if (multi->count != 1) {
+		fprintf(stderr, "Several vectors of weights make a multiplex, e.g. for mwrite_bg, not a single track\n");
+		raiseError();
+	}
+	return SelectReduction(multi, 0);
+}
+
+static WiggleIterator * readSelect() {
+	int index = atoi(needNextToken());
+	char * token = needNextToken();
+	WiggleIterator * selected = NULL;
+	Multiplexer * multi;
+	int i;
+
+	if (index < 1) {
+		fprintf(stderr, "Inputs are selected from 1 onwards, got %i\n", index);
+		raiseError();
+	}
+
+	// Only the selected input of a plain list is read
+	if (isPlainListToken(token)) {
+		for (i = 1; token != NULL && strcmp(token, ":"); token = nextToken(0,0), i++) {
+			if (i == index)
+				selected = readIteratorToken(token);
+			else
+				skipIteratorToken(token);
+		}
+		if (selected == NULL) {
+			fprintf(stderr, "Cannot select input %i out of %i\n", index, i - 1);
+			raiseError();
+		}
+		return selected;
+	}
+
+	multi = readMultiplexerToken(token);
+	if (index > multi->count) {
+		fprintf(stderr, "Cannot select input %i out of %i\n", index, multi->count);
+		raiseError();
+	}
+	return SelectReduction(multi, index - 1);
+}
+
 static char ** getListOfFilenames(int * count, char * first) {
 	int length = 1000;
 	char ** filenames = calloc(sizeof(char*), length);
@@ -472,7 +1088,7 @@ static char ** getListOfFilenames(int * count, char * first) {
 static WiggleIterator * readCat() {
 	int count = 0;
 	char ** filenames = getListOfFilenames(&count, NULL);
-	return CatWiggleIterator(filenames, count);
+	return CatWiggleIterator(filenames, count, holdFire);
 }
 
 static WiggleIterator * readProduct() {
@@ -480,23 +1096,28 @@ static WiggleIterator * readProduct() {
 }
 
 static WiggleIterator * readMin() {
-	return MinReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_MIN);
+	return res ? res : MinReduction(readMultiplexer());
 }
 
 static WiggleIterator * readMax() {
-	return MaxReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_MAX);
+	return res ? res : MaxReduction(readMultiplexer());
 }
 
 static WiggleIterator * readMean() {
-	return MeanReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_MEAN);
+	return res ? res : MeanReduction(readMultiplexer());
 }
 
 static WiggleIterator * readVariance() {
-	return VarianceReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_VARIANCE);
+	return res ? res : VarianceReduction(readMultiplexer());
 }
 
 static WiggleIterator * readStdDev() {
-	return StdDevReduction(readMultiplexer());
+	WiggleIterator * res = readGroupedReduction(GROUPED_STDDEV);
+	return res ? res : StdDevReduction(readMultiplexer());
 }
 
 static WiggleIterator * readEntropy() {
@@ -512,17 +1133,109 @@ static WiggleIterator * readMedian() {
 }
 
 static WiggleIterator * readUnit() {
-	return UnitWiggleIterator(readIterator());
+	char * token = needNextToken();
+	WiggleIterator * iter;
+
+	// Units only need the coordinates of a file no other iterator reads
+	if (strcmp(token, "-") && isWiggleFilename(token) && countTokens(token) < 2) {
+		lastFileToken = token;
+		iter = CoordinatesReader(token, holdFire);
+		nameProfile(iter->profile, token);
+		return UnitWiggleIterator(iter);
+	}
+	return UnitWiggleIterator(readIteratorToken(token));
 }
 
 static WiggleIterator * readSam() {
 	return SamReader(needNextToken());
 }
 
+static WiggleIterator * readVcf() {
+	char * field = needNextToken();
+	return VcfValueReader(needNextToken(), field, holdFire);
+}
+
+static WiggleIterator * readScore() {
+	char * filename = needNextToken();
+	size_t length = strlen(filename);
+
+	if (length < 3 || strcmp(filename + length - 3, ".bb")) {
+		fprintf(stderr, "Scores can only be read from BigBed files, not %s\n", filename);
+		raiseError();
+	}
+	return BigBedScoreReader(filename, holdFire);
+}
+
+// Returns the filename after the read filters, strand and extension are NULL if they cannot be set
+static char * readBamFilters(int * minMapQ, int * requiredFlags, int * excludedFlags, int * strand, int * extension) {
+	char * token;
+
+	*minMapQ = 0;
+	*requiredFlags = 0;
+	// Unmapped, secondary, QC failed and duplicate reads
+	*excludedFlags = 0x704;
+	if (strand)
+		*strand = 0;
+	// Read coverage by default
+	if (extension)
+		*extension = -1;
+
+	for (token = needNextToken(); token[0] == '-' && token[1] != '\0'; token = needNextToken()) {
+		if (!strcmp(token, "-q"))
+			*minMapQ = atoi(needNextToken());
+		else if (!strcmp(token, "-f"))
+			*requiredFlags = strtol(needNextToken(), NULL, 0);
+		else if (!strcmp(token, "-F"))
+			*excludedFlags = strtol(needNextToken(), NULL, 0);
+		else if (strand && !strcmp(token, "-s")) {
+			token = needNextToken();
+			if (!strcmp(token, "+"))
+				*strand = 1;
+			else if (!strcmp(token, "-"))
+				*strand = -1;
+			else {
+				fprintf(stderr, "Strand must be + or -, not %s\n", token);
+				raiseError();
+			}
+		} else if (extension && !strcmp(token, "-e")) {
+			if ((*extension = atoi(needNextToken())) < 0) {
+				fprintf(stderr, "Fragment length cannot be negative: %i\n", *extension);
+				raiseError();
+			}
+		} else {
+			fprintf(stderr, "Unknown BAM read filter: %s\n", token);
+			raiseError();
+		}
+	}
+
+	return token;
+}
+
+static WiggleIterator * readBam() {
+	int minMapQ, requiredFlags, excludedFlags, strand, extension;
+	char * filename = readBamFilters(&minMapQ, &requiredFlags, &excludedFlags, &strand, &extension);
+	return BamCoverageReader(filename, holdFire, minMapQ, requiredFlags, excludedFlags, strand, extension);
+}
+
+static WiggleIterator * readPileup() {
+	return BamReader(needNextToken(), holdFire);
+}
+
+// The coverage of extended records is counted in one sweep
 static WiggleIterator * readCoverage() {
+	if (tokenIndex < tokenCount && !strcmp(tokens[tokenIndex], "extend")) {
+		tokenIndex++;
+		int extension = atoi(needNextToken());
+		return ExtendedCoverageWiggleIterator(readIterator(), extension, false);
+	}
 	return CoverageWiggleIterator(readIterator());
 }
 
+static WiggleIterator * readFragments() {
+	int length = atoi(needNextToken());
+	return ExtendedCoverageWiggleIterator(readIterator(), length, true);
+}
+
 static WiggleIterator * readPrint() {
 	FILE * file = readOutputFilename();
 	WiggleIterator * wi = readIterator();
@@ -559,37 +1272,90 @@ static WiggleIterator * readSeek() {
 	char * chrom = needNextToken();
 	int start = atoi(needNextToken());
 	int finish = atoi(needNextToken());
-	holdFire = true;
+	bool fire = holdFire;
 
+	// Readers only start once they know the region
+	holdFire = true;
 	WiggleIterator * iter = readIterator();
+	holdFire = fire;
 	seek(iter, chrom, start, finish);
 	return iter;
 }
 
-static WiggleIterator * readNaturalLog() {
-	return NaturalLogWiggleIterator(readIterator());
+// Reads the optional permutation count of the set comparisons, and returns the next token.
+// permutations is 0 unless requested
+static char * readPermutations(char * token, int * permutations) {
+	*permutations = 0;
+	if (strcmp(token, "permute") == 0) {
+		*permutations = atoi(needNextToken());
+		if (*permutations < 1) {
+			fprintf(stderr, "Invalid number of permutations: %i\n", *permutations);
+			raiseError();
+		}
+		token = needNextToken();
+	}
+	return token;
 }
 
-static WiggleIterator * readLog() {
-	double base = atof(needNextToken());
-	return LogWiggleIterator(readIterator(), base);
+// Reads the optional output keywords of the t-test and the F-test, and returns the next token.
+// alpha is NAN unless calls were requested
+static char * readTestOutput(bool * statistic, double * alpha, int * permutations) {
+	char * token = needNextToken();
+	*statistic = false;
+	*alpha = NAN;
+	if (strcmp(token, "statistic") == 0) {
+		*statistic = true;
+		token = needNextToken();
+	} else if (strcmp(token, "below") == 0) {
+		*alpha = atof(needNextToken());
+		token = needNextToken();
+	}
+	token = readPermutations(token, permutations);
+	if (*permutations && (*statistic || !isnan(*alpha))) {
+		fprintf(stderr, "Permutation tests only output p-values\n");
+		raiseError();
+	}
+	return token;
 }
 
 static WiggleIterator * readTTest() {
 	Multiplexer ** multis = calloc(2, sizeof(Multiplexer *));
-	multis[0] = readMultiplexer();
+	bool statistic;
+	double alpha;
+	int permutations;
+	multis[0] = readMultiplexerToken(readTestOutput(&statistic, &alpha, &permutations));
 	multis[1] = readMultiplexer();
-	return TTestReduction(newMultiset(multis, 2));
+	Multiset * multi = newMultiset(multis, 2);
+	if (permutations)
+		return TTestPermutationReduction(multi, permutations);
+	else if (statistic)
+		return TTestStatisticReduction(multi);
+	else if (!isnan(alpha))
+		return TTestCallReduction(multi, alpha);
+	return TTestReduction(multi);
 }
 
 static WiggleIterator * readFTest() {
-	return FTestReduction(readMultiset());
+	bool statistic;
+	double alpha;
+	int permutations;
+	Multiset * multi = readMultisetToken(readTestOutput(&statistic, &alpha, &permutations));
+	if (permutations)
+		return FTestPermutationReduction(multi, permutations);
+	else if (statistic)
+		return FTestStatisticReduction(multi);
+	else if (!isnan(alpha))
+		return FTestCallReduction(multi, alpha);
+	return FTestReduction(multi);
 }
 
 static WiggleIterator * readMWUTest() {
 	Multiplexer ** multis = calloc(2, sizeof(Multiplexer *));
-	multis[0] = readMultiplexer();
+	int permutations;
+	multis[0] = readMultiplexerToken(readPermutations(needNextToken(), &permutations));
 	multis[1] = readMultiplexer();
+	if (permutations)
+		return MWUPermutationReduction(newMultiset(multis, 2), permutations);
 	return MWUReduction(newMultiset(multis, 2));
 }
 
@@ -605,6 +1371,11 @@ static WiggleIterator * readMinIntegrator() {
 	return MinIntegrator(readIterator());
 }
 
+static WiggleIterator * readQuantileIntegrator() {
+	double quantile = atof(needNextToken());
+	return QuantileIntegrator(readIterator(), quantile);
+}
+
 static WiggleIterator * readVarianceIntegrator() {
 	return VarianceIntegrator(readIterator());	
 }
@@ -634,29 +1405,107 @@ static WiggleIterator * readAUC() {
 	return AUCIntegrator(readLastIterator());
 }
 
-static WiggleIterator * readIsZero() {
-	return IsZero(readIterator());	
+//////////////////////////////////////////////////////
+// Scalar operator chains
+//////////////////////////////////////////////////////
+
+static bool isScalarOperatorToken(char * token) {
+	return strcmp(token, "scale") == 0 || strcmp(token, "offset") == 0 || strcmp(token, "abs") == 0 || strcmp(token, "exp") == 0 || strcmp(token, "ln") == 0 || strcmp(token, "log") == 0 || strcmp(token, "pow") == 0 || strcmp(token, "gt") == 0 || strcmp(token, "lt") == 0 || strcmp(token, "default") == 0 || strcmp(token, "isZero") == 0;
 }
 
-static WiggleIterator * readIteratorToken(char * token) {
+static void appendScalarOp(ScalarOp ** ops, int * count, int * max, ScalarOperation operation, double scalar) {
+	if (*count == *max) {
+		*max = *max ? 2 * *max : 8;
+		*ops = (ScalarOp *) realloc(*ops, *max * sizeof(ScalarOp));
+	}
+	(*ops)[*count].operation = operation;
+	(*ops)[*count].scalar = scalar;
+	(*count)++;
+}
+
+// Consecutive scalar operators, e.g. scale 2 offset 1 log 10, are evaluated 
+// by a single iterator instead of one iterator per operator
+static WiggleIterator * readScalarChain(char * token) {
+	ScalarOp * ops = NULL;
+	int count = 0, max = 0, i;
+	char name[1024] = "";
+	WiggleIterator * iter;
+
+	// The operators are read outermost first
+	for (; isScalarOperatorToken(token); token = needNextToken()) {
+		if (strlen(name) + strlen(token) + 2 < sizeof(name)) {
+			if (name[0])
+				strcat(name, "+");
+			strcat(name, token);
+		}
+		if (strcmp(token, "scale") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_SCALE, atof(needNextToken()));
+		else if (strcmp(token, "offset") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_SHIFT, atof(needNextToken()));
+		else if (strcmp(token, "abs") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_ABS, 0);
+		else if (strcmp(token, "exp") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_EXP, 0);
+		else if (strcmp(token, "ln") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_LN, 0);
+		else if (strcmp(token, "log") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_LOG, atof(needNextToken()));
+		else if (strcmp(token, "pow") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_POW, atof(needNextToken()));
+		else if (strcmp(token, "gt") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_GT, atof(needNextToken()));
+		else if (strcmp(token, "lt") == 0) {
+			appendScalarOp(&ops, &count, &max, SCALAR_GT, -atof(needNextToken()));
+			appendScalarOp(&ops, &count, &max, SCALAR_SCALE, -1);
+		} else if (strcmp(token, "default") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_DEFAULT, atof(needNextToken()));
+		else if (strcmp(token, "isZero") == 0)
+			appendScalarOp(&ops, &count, &max, SCALAR_IS_ZERO, 0);
+	}
+
+	for (i = 0; i < count / 2; i++) {
+		ScalarOp swap = ops[i];
+		ops[i] = ops[count - 1 - i];
+		ops[count - 1 - i] = swap;
+	}
+
+	iter = FusedScalarWiggleIterator(readIteratorToken(token), ops, count);
+	free(ops);
+	nameProfile(iter->profile, name);
+	return iter;
+}
+
+static WiggleIterator * parseIteratorToken(char * token) {
 	if (strcmp(token, "cat") == 0)
 		return readCat();
-	if (strcmp(token, "scale") == 0)
-		return readScale();
-	if (strcmp(token, "offset") == 0)
-		return readShift();
+	if (isScalarOperatorToken(token))
+		return readScalarChain(token);
 	if (strcmp(token, "unit") == 0)
 		return readUnit();
 	if (strcmp(token, "sam") == 0)
 		return readSam();
+	if (strcmp(token, "bam") == 0)
+		return readBam();
+	if (strcmp(token, "pileup") == 0)
+		return readPileup();
+	if (strcmp(token, "vcf") == 0)
+		return readVcf();
+	if (strcmp(token, "score") == 0)
+		return readScore();
 	if (strcmp(token, "coverage") == 0)
 		return readCoverage();
+	if (strcmp(token, "fragments") == 0)
+		return readFragments();
 	if (strcmp(token, "print") == 0)
 		return readPrint();
 	if (strcmp(token, "sum") == 0)
 		return readSum();
 	if (strcmp(token, "fillIn") == 0)
 		return readFillIn();
+	if (strcmp(token, "select") == 0)
+		return readSelect();
+	if (strcmp(token, "lincomb") == 0)
+		return readLinearCombinationReduction();
 	if (strcmp(token, "mult") == 0)
 		return readProduct();
 	if (strcmp(token, "diff") == 0)
@@ -685,24 +1534,20 @@ static WiggleIterator * readIteratorToken(char * token) {
 		return readTee();
 	if (strcmp(token, "write_bg") == 0)
 		return readBGTee();
+	if (strcmp(token, "write_pyramid") == 0)
+		return readPyramidTee();
+	if (strcmp(token, "cache") == 0)
+		return readTrackCacheTee();
 	if (strcmp(token, "smooth") == 0)
 		return readSmooth();
-	if (strcmp(token, "exp") == 0)
-		return readExp();
-	if (strcmp(token, "ln") == 0)
-		return readNaturalLog();
-	if (strcmp(token, "log") == 0)
-		return readLog();
-	if (strcmp(token, "pow") == 0)
-		return readPow();
+	if (strcmp(token, "gaussian") == 0)
+		return readGaussian();
 	if (strcmp(token, "extend") == 0)
 		return readExtend();
-	if (strcmp(token, "gt") == 0)
-		return readGt();
-	if (strcmp(token, "lt") == 0)
-		return readLt();
-	if (strcmp(token, "default") == 0)
-		return readDefault();
+	if (strcmp(token, "bin") == 0)
+		return readBin();
+	if (strcmp(token, "roll") == 0)
+		return readRoll();
 	if (strcmp(token, "overlaps") == 0)
 		return readOverlap();
 	if (strcmp(token, "trim") == 0)
@@ -711,6 +1556,14 @@ static WiggleIterator * readIteratorToken(char * token) {
 		return readNoverlap();
 	if (strcmp(token, "nearest") == 0)
 		return readNearest();
+	if (strcmp(token, "mask") == 0)
+		return readMask();
+	if (strcmp(token, "and") == 0)
+		return readAndMask();
+	if (strcmp(token, "or") == 0)
+		return readOrMask();
+	if (strcmp(token, "andnot") == 0)
+		return readAndNotMask();
 	if (strcmp(token, "ttest") == 0)
 		return readTTest();
 	if (strcmp(token, "ftest") == 0)
@@ -725,6 +1578,8 @@ static WiggleIterator * readIteratorToken(char * token) {
 		return readMaxIntegrator();
 	if (strcmp(token, "minI") == 0)
 		return readMinIntegrator();
+	if (strcmp(token, "quantileI") == 0)
+		return readQuantileIntegrator();
 	if (strcmp(token, "varI") == 0)
 		return readVarianceIntegrator();
 	if (strcmp(token, "stddevI") == 0)
@@ -735,33 +1590,79 @@ static WiggleIterator * readIteratorToken(char * token) {
 		return readPearson();
 	if (strcmp(token, "ndpearson") == 0) 
 		return readNDPearson();
-	if (strcmp(token, "isZero") == 0) 
-		return readIsZero();
 	if (strcmp(token, "apply") == 0) 
 		return SelectReduction(readApply(), 0);
 
-	return SmartReader(token, holdFire);
+	return readFile(token);
 
 }
 
-static void readProfile() {
-	FILE * file = readOutputFilename();
+// Operators are named after their token in profiling reports
+static WiggleIterator * readIteratorToken(char * token) {
+	WiggleIterator * iter = parseIteratorToken(token);
+	nameProfile(iter->profile, token);
+	return iter;
+}
 
-	int width = atoi(needNextToken());
+static int readProfileWidth(bool * zoom) {
+	char * token = needNextToken();
+	*zoom = false;
+	if (strcmp(token, "zoom") == 0) {
+		*zoom = true;
+		token = needNextToken();
+	}
+	return atoi(token);
+}
+
+static Multiplexer * readProfileMultiplexer(int * width) {
+	bool zoom;
+	*width = readProfileWidth(&zoom);
 	WiggleIterator * regions = readIterator();
-	WiggleIterator * wig = readLastIterator();
-	Multiplexer * profiles = ProfileMultiplexer(regions, width, wig);
+	char * token = needNextToken();
+	WiggleIterator * wig = readLastIteratorToken(token);
+	Multiplexer * profiles = ProfileMultiplexerFull(regions, *width, wig, zoom, readApplyPrefetchReader(token, zoom, NULL, 0, wig));
+	nameProfile(profiles->profile, "profile");
+	return profiles;
+}
+
+// Sum of the profiles of all the regions
+static double * sumProfiles(Multiplexer * profiles, int width) {
 	double * profile = calloc(width, sizeof(double));
 
 	for (; !profiles->done; popMultiplexer(profiles))
 		addProfile(profile, profiles->values, width);
 
+	return profile;
+}
+
+static double * readProfileSum(int * width) {
+	Multiplexer * profiles = readProfileMultiplexer(width);
+	return sumProfiles(profiles, *width);
+}
+
+static void printProfileSum(FILE * file, double * profile, int width) {
 	int i;
 	for (i = 0; i < width; i++)
 		fprintf(file, "%i\t%lf\n", i, profile[i]);
+}
 
+// A .npy output holds the profile as a vector of float32
+static void readProfile() {
+	char * filename = needNextToken();
+	FILE * file = isNpyFilename(filename) ? NULL : openOutputFile(filename);
+	int width;
+	Multiplexer * profiles = readProfileMultiplexer(&width);
+	NpyFile * npy = file ? NULL : openNpyFile(filename, width, true);
+	double * profile = sumProfiles(profiles, width);
+
+	if (npy) {
+		writeNpyRow(npy, profile);
+		closeNpyFile(npy);
+	} else {
+		printProfileSum(file, profile, width);
+		fclose(file);
+	}
 	free(profile);
-	fclose(file);
 }
 
 static void fprintfProfile(FILE * file, double * profile, int width) {
@@ -773,19 +1674,43 @@ static void fprintfProfile(FILE * file, double * profile, int width) {
 	fprintf(file, "\n");
 }
 
+// A .npy output holds the profiles as a matrix of float32, one row per
+// region, and the regions are listed in a text file alongside, with the
+// .regions suffix, in the first three columns of the text output
 static void readProfiles() {
-	FILE * file = readOutputFilename();
-
-	int width = atoi(needNextToken());
+	char * filename = needNextToken();
+	FILE * file;
+	NpyFile * npy = NULL;
+
+	bool zoom;
+	int width = readProfileWidth(&zoom);
+	if (isNpyFilename(filename)) {
+		char * regionsFilename = (char *) calloc(strlen(filename) + strlen(".regions") + 1, sizeof(char));
+		npy = openNpyFile(filename, width, false);
+		sprintf(regionsFilename, "%s.regions", filename);
+		file = openOutputFile(regionsFilename);
+		free(regionsFilename);
+	} else
+		file = openOutputFile(filename);
 	WiggleIterator * regions = readIterator();
-	WiggleIterator * wig = readLastIterator();
+	char * token = needNextToken();
+	WiggleIterator * wig = readLastIteratorToken(token);
 	Multiplexer * profiles;
 
-	for (profiles = ProfileMultiplexer(regions, width, wig); !profiles->done; popMultiplexer(profiles)) {
-		fprintf(file, "%s\t%i\t%i\t", profiles->chrom, profiles->start, profiles->finish);
-		fprintfProfile(file, profiles->values, width);
+	profiles = ProfileMultiplexerFull(regions, width, wig, zoom, readApplyPrefetchReader(token, zoom, NULL, 0, wig));
+	nameProfile(profiles->profile, "profiles");
+	for (; !profiles->done; popMultiplexer(profiles)) {
+		if (npy) {
+			fprintf(file, "%s\t%i\t%i\n", profiles->chrom, profiles->start, profiles->finish);
+			writeNpyRow(npy, profiles->values);
+		} else {
+			fprintf(file, "%s\t%i\t%i\t", profiles->chrom, profiles->start, profiles->finish);
+			fprintfProfile(file, profiles->values, width);
+		}
 	}
 
+	if (npy)
+		closeNpyFile(npy);
 	fclose(file);
 }
 
@@ -799,92 +1724,1961 @@ static void readHistogram() {
 	fclose(file);
 }
 
-static Multiplexer * readApplyPaste() {
-	FILE * outfile = readOutputFilename();
+static void readTop() {
+	FILE * file = readOutputFilename();
+	int count = atoi(needNextToken());
+	TopRegions * top = topRegions(readLastIterator(), count);
+	printTopRegions(top, file);
+	fclose(file);
+}
+
+static void readCorrelations() {
+	FILE * file = readOutputFilename();
+	Multiplexer * multi = readLastMultiplexerToken(needNextToken());
+	printCorrelations(multi, file);
+	fclose(file);
+}
+
+// Reads the arguments of apply_paste after the output file, from token onwards
+static Multiplexer * readApplyPasteToken(FILE * outfile, char * token) {
 	bool strict = true;
+	bool zoom = false;
 	int count;
-	char * token = needNextToken();
 	statisticCreator * statistics = readStatisticList(&token, &count);
-
-	if (strcmp(token, "fillIn") == 0) {
-		strict = false;
-		token = needNextToken();
-	}
+	token = readApplyOptions(token, &strict, &zoom);
 
 	char * infilename = token;
 	FILE * infile = fopen(token, "r");
 	if (!infile) {
 	       fprintf(stderr, "Could not open %s.\n", token);
-	       exit(1);
+	       raiseError();
+	}
+
+	WiggleIterator * regions = SmartReader(infilename, holdFire);
+	nameProfile(regions->profile, infilename);
+	token = needNextToken();
+	int datasetCount;
+	bool listStrict = false;
+	WiggleIterator ** datasets = readIteratorListToken(&datasetCount, &listStrict, token);
+	noTokensLeft();
+	Multiplexer * apply;
+	// Several inputs share a single pass over the regions
+	if (datasetCount == 1)
+		apply = ApplyMultiplexerFull(regions, statistics, count, datasets[0], strict, zoom, readApplyPrefetchReader(token, zoom, statistics, count, datasets[0]));
+	else
+		apply = MultiApplyMultiplexer(regions, statistics, count, datasets, datasetCount, strict, zoom, holdFire);
+	free(datasets);
+	nameProfile(apply->profile, "apply_paste");
+	return PasteMultiplexer(apply, infile, outfile, holdFire);
+}
+
+static Multiplexer * readApplyPaste() {
+	FILE * outfile = readOutputFilename();
+	return readApplyPasteToken(outfile, needNextToken());
+}
+
+static bool isStatistic(char * token) {
+	return strcmp(token, "AUC") == 0 || strcmp(token, "meanI") == 0 || strcmp(token, "varI") == 0 || strcmp(token, "stddevI") == 0 || strcmp(token, "CVI") == 0 || strcmp(token, "maxI") == 0 || strcmp(token, "minI") == 0 || strcmp(token, "quantileI") == 0 || strcmp(token, "pearson") == 0 || strcmp(token, "ndpearson") == 0;
+}
+
+//////////////////////////////////////////////////////
+// Partial results
+//
+// partial dumps the state of a statistic, histogram or 
+// profile computed over part of the data (e.g. one 
+// chromosome) into a binary file. merge_partials 
+// combines such files into the output which the command
+// would have produced over all the data. The tracks
+// computed over shards of the genome are also 
+// stitched back together by merge_partials.
+//////////////////////////////////////////////////////
+
+// Left open, positioned on its first section
+typedef struct partialTrack_st {
+	FILE * file;
+	int shard;
+} PartialTrack;
+
+typedef struct partial_st {
+	PartialKind kind;
+	WiggleIterator * statistics;
+	Histogram * histogram;
+	TopRegions * top;
+	double * profile;
+	int width;
+	PartialTrack * tracks;
+	int trackCount;
+	bool bedGraph;
+} Partial;
+
+static Partial * loadPartialFile(FILE * file, const char * filename) {
+	Partial * partial = (Partial *) calloc(1, sizeof(Partial));
+	partial->kind = readPartialHeader(file, filename);
+	if (partial->kind == PARTIAL_TRACK) {
+		partial->tracks = (PartialTrack *) calloc(1, sizeof(PartialTrack));
+		partial->tracks->file = file;
+		readPartialTrackHeader(file, &partial->tracks->shard, &partial->bedGraph);
+		partial->trackCount = 1;
+		return partial;
+	} else if (partial->kind == PARTIAL_BIGWIG) {
+		partial->tracks = (PartialTrack *) calloc(1, sizeof(PartialTrack));
+		partial->tracks->file = file;
+		readPartialBigWigHeader(file, &partial->tracks->shard);
+		partial->trackCount = 1;
+		return partial;
+	} else if (partial->kind == PARTIAL_STATISTICS)
+		partial->statistics = loadStatistics(file);
+	else if (partial->kind == PARTIAL_HISTOGRAM)
+		partial->histogram = loadHistogram(file);
+	else if (partial->kind == PARTIAL_TOP)
+		partial->top = loadTopRegions(file);
+	else {
+		int32_t width;
+		readPartialValues(file, &width, sizeof(width), 1);
+		if (width <= 0) {
+			fprintf(stderr, "Corrupted partial results file %s\n", filename);
+			raiseError();
+		}
+		partial->width = width;
+		partial->profile = calloc(width, sizeof(double));
+		readPartialValues(file, partial->profile, sizeof(double), width);
+	}
+
+	if (fgetc(file) != EOF) {
+		fprintf(stderr, "Unexpected data at the end of %s\n", filename);
+		raiseError();
+	}
+	fclose(file);
+	return partial;
+}
+
+static Partial * loadPartial(char * filename) {
+	FILE * file = fopen(filename, "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s.\n", filename);
+		raiseError();
+	}
+	return loadPartialFile(file, filename);
+}
+
+static int comparePartialTracks(const void * A, const void * B) {
+	return ((PartialTrack *) A)->shard - ((PartialTrack *) B)->shard;
+}
+
+// Files of consecutive shards, in genome order
+static FILE ** sortPartialTracks(Partial * partial) {
+	FILE ** files = (FILE **) calloc(partial->trackCount, sizeof(FILE *));
+	int i;
+
+	qsort(partial->tracks, partial->trackCount, sizeof(PartialTrack), comparePartialTracks);
+	for (i = 0; i < partial->trackCount; i++) {
+		if (i > 0 && partial->tracks[i].shard == partial->tracks[i-1].shard) {
+			fprintf(stderr, "Partial results of shard %i were given twice\n", partial->tracks[i].shard);
+			raiseError();
+		}
+		files[i] = partial->tracks[i].file;
+	}
+	return files;
+}
+
+static void dumpPartial(Partial * partial, FILE * file) {
+	if (partial->kind == PARTIAL_TRACK) {
+		FILE ** files = sortPartialTracks(partial);
+		int i;
+		writePartialTrackHeader(file, partial->tracks[0].shard, partial->bedGraph);
+		for (i = 0; i < partial->trackCount; i++)
+			copyPartialTrackSections(file, files[i]);
+		free(files);
+		return;
+	} else if (partial->kind == PARTIAL_BIGWIG) {
+		FILE ** files = sortPartialTracks(partial);
+		int i;
+		writePartialBigWigHeader(file, partial->tracks[0].shard);
+		for (i = 0; i < partial->trackCount; i++)
+			copyPartialTrackSections(file, files[i]);
+		free(files);
+		return;
+	}
+
+	writePartialHeader(file, partial->kind);
+	if (partial->kind == PARTIAL_STATISTICS)
+		dumpStatistics(partial->statistics, file);
+	else if (partial->kind == PARTIAL_HISTOGRAM)
+		dumpHistogram(partial->histogram, file);
+	else if (partial->kind == PARTIAL_TOP)
+		dumpTopRegions(partial->top, file);
+	else {
+		int32_t width = partial->width;
+		writePartialValues(file, &width, sizeof(width), 1);
+		writePartialValues(file, partial->profile, sizeof(double), width);
+	}
+}
+
+static void mergePartials(Partial * A, Partial * B) {
+	if (A->kind != B->kind) {
+		fprintf(stderr, "Cannot merge different types of partial results\n");
+		raiseError();
+	}
+
+	if (A->kind == PARTIAL_STATISTICS)
+		mergeStatistics(A->statistics, B->statistics);
+	else if (A->kind == PARTIAL_HISTOGRAM)
+		mergeHistograms(A->histogram, B->histogram);
+	else if (A->kind == PARTIAL_TOP)
+		mergeTopRegions(A->top, B->top);
+	else if (A->kind == PARTIAL_TRACK || A->kind == PARTIAL_BIGWIG) {
+		A->tracks = (PartialTrack *) realloc(A->tracks, (A->trackCount + B->trackCount) * sizeof(PartialTrack));
+		memcpy(A->tracks + A->trackCount, B->tracks, B->trackCount * sizeof(PartialTrack));
+		A->trackCount += B->trackCount;
+	} else {
+		if (A->width != B->width) {
+			fprintf(stderr, "Cannot merge profiles of different widths\n");
+			raiseError();
+		}
+		addProfile(A->profile, B->profile, A->width);
 	}
+}
+
+static Partial * readMergedPartials() {
+	Partial * merged = loadPartial(needNextToken());
+	char * token;
+
+	while ((token = nextToken(0, 0)))
+		mergePartials(merged, loadPartial(token));
+	return merged;
+}
+
+static void printMergedPartial(Partial * partial, char * filename, FILE * file) {
+	if (partial->kind == PARTIAL_TRACK) {
+		WiggleIterator * track = PartialTrackReader(sortPartialTracks(partial), partial->trackCount);
+		runWiggleIterator(openTee(track, filename, file, partial->bedGraph));
+		// The BGZF writer closes its own file
+		if (isBgzfFilename(filename))
+			return;
+	} else if (partial->kind == PARTIAL_BIGWIG) {
+		if (!isBigWigFilename(filename)) {
+			fprintf(stderr, "Partial results of a BigWig file can only be merged into a BigWig file: %s\n", filename);
+			raiseError();
+		}
+		mergeBigWigPartials(file, sortPartialTracks(partial), partial->trackCount);
+	} else if (partial->kind == PARTIAL_STATISTICS)
+		runWiggleIterator(PrintStatisticsWiggleIterator(partial->statistics, file));
+	else if (partial->kind == PARTIAL_HISTOGRAM)
+		print_histogram(partial->histogram, file);
+	else if (partial->kind == PARTIAL_TOP)
+		printTopRegions(partial->top, file);
+	else
+		printProfileSum(file, partial->profile, partial->width);
 
-	return PasteMultiplexer(ApplyMultiplexer(SmartReader(infilename, holdFire), statistics, count, readLastIterator(), strict), infile, outfile, false);
+	if (file != stdout)
+		fclose(file);
+}
+
+static void readMergePartials() {
+	char * filename = needNextToken();
+	FILE * file = openOutputFile(filename);
+	printMergedPartial(readMergedPartials(), filename, file);
+}
+
+void writeMergedPartials(char * filename, FILE * file, FILE ** partials, int count) {
+	Partial * merged = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		Partial * partial;
+		rewind(partials[i]);
+		partial = loadPartialFile(partials[i], "partial results of a worker");
+		if (merged)
+			mergePartials(merged, partial);
+		else
+			merged = partial;
+	}
+	if (merged)
+		printMergedPartial(merged, filename, file);
+	else if (file != stdout)
+		fclose(file);
+}
+
+static void readPartial() {
+	FILE * file = readOutputFilename();
+	Partial * partial = (Partial *) calloc(1, sizeof(Partial));
+	char * token = needNextToken();
+
+	if (isStatistic(token)) {
+		partial->kind = PARTIAL_STATISTICS;
+		partial->statistics = readLastIteratorToken(token);
+		runWiggleIterator(partial->statistics);
+	} else if (strcmp(token, "histogram") == 0) {
+		partial->kind = PARTIAL_HISTOGRAM;
+		int width = atoi(needNextToken());
+		int count = 0;
+		WiggleIterator ** iters = readLastIteratorList(&count);
+		partial->histogram = histogram(iters, count, width);
+	} else if (strcmp(token, "top") == 0) {
+		partial->kind = PARTIAL_TOP;
+		int count = atoi(needNextToken());
+		partial->top = topRegions(readLastIterator(), count);
+	} else if (strcmp(token, "profile") == 0) {
+		partial->kind = PARTIAL_PROFILE;
+		partial->profile = readProfileSum(&partial->width);
+	} else if (strcmp(token, "merge_partials") == 0)
+		partial = readMergedPartials();
+	else {
+		fprintf(stderr, "Cannot store partial results of %s\n", token);
+		raiseError();
+	}
+
+	dumpPartial(partial, file);
+	if (file != stdout)
+		fclose(file);
+}
+
+//////////////////////////////////////////////////////
+// Programs
+//
+// A program file holds commands separated by newlines 
+// or semicolons. Consecutive commands are run as a 
+// batch: the files named in several of them are read 
+// once, as shared files, and the outputs of all the 
+// commands are driven by a single scan of the genome, 
+// which always advances the one furthest behind. A 
+// command which names a file written earlier in the 
+// batch starts a new batch. The standard output of each
+// command is buffered, then printed in command order.
+//////////////////////////////////////////////////////
+
+typedef struct programCommand_st {
+	char ** words;
+	int first, count;
+	// Standard output, written through a copy of the buffer's descriptor
+	FILE * buffer;
+	FILE * output;
+	// Printed into file at the end of the scan
+	Histogram * histogram;
+	TopRegions * top;
+	FILE * file;
+} ProgramCommand;
+
+// An iterator or multiplexer driven by the scan
+typedef struct programStep_st {
+	WiggleIterator * iter;
+	Multiplexer * multi;
+	// Fed with the records of iter, if set
+	Histogram * histogram;
+	int row;
+	TopRegions * top;
+} ProgramStep;
+
+typedef struct programScan_st {
+	ProgramStep * steps;
+	int count, max;
+	SpanBatch * batch;
+} ProgramScan;
+
+static __thread ProgramCommand * currentCommand = NULL;
+
+static FILE * standardOutput() {
+	if (!currentCommand)
+		return stdout;
+	if (!currentCommand->output) {
+		currentCommand->buffer = tmpfile();
+		if (!currentCommand->buffer || !(currentCommand->output = fdopen(dup(fileno(currentCommand->buffer)), "w"))) {
+			fprintf(stderr, "Could not create temporary file\n");
+			raiseError();
+		}
+	}
+	return currentCommand->output;
+}
+
+static void printCommandOutput(ProgramCommand * command, FILE * out) {
+	char buffer[65536];
+	size_t length;
+
+	if (!command->buffer)
+		return;
+	// The copy given to the command may already be closed
+	fflush(NULL);
+	fseek(command->buffer, 0, SEEK_SET);
+	while ((length = fread(buffer, 1, sizeof(buffer), command->buffer)))
+		fwrite(buffer, 1, length, out);
+	fclose(command->buffer);
+	command->buffer = NULL;
+}
+
+// Commands which do not reduce to iterators or multiplexers are run on their own
+static bool isScannedCommand(char * token) {
+	static const char * unscanned[] = {"correlations", "profile", "profiles", "partial", "merge_partials", "compact_matrix", "seek", "batch", "run", "serve", NULL};
+	int i;
+	for (i = 0; unscanned[i]; i++)
+		if (strcmp(token, unscanned[i]) == 0)
+			return false;
+	return true;
+}
+
+static void addProgramStep(ProgramScan * scan, WiggleIterator * iter, Multiplexer * multi) {
+	if (scan->count == scan->max) {
+		scan->max = scan->max ? 2 * scan->max : 16;
+		scan->steps = (ProgramStep *) realloc(scan->steps, scan->max * sizeof(ProgramStep));
+	}
+	memset(scan->steps + scan->count, 0, sizeof(ProgramStep));
+	scan->steps[scan->count].iter = iter;
+	scan->steps[scan->count++].multi = multi;
+}
+
+// Parses the command, as rollYourOwn would, but leaves it to the scan
+static void readScannedCommand(ProgramScan * scan, ProgramCommand * command) {
+	char * token = needNextToken();
+
+	if (strcmp(token, "do") == 0)
+		addProgramStep(scan, readLastIterator(), NULL);
+	else if (strncmp(token, "write", 5) == 0 || strcmp(token, "cache") == 0 || strcmp(token, "print") == 0)
+		addProgramStep(scan, readLastIteratorToken(token), NULL);
+	else if (strncmp(token, "mwrite", 6) == 0 || strcmp(token, "mappend_matrix") == 0)
+		addProgramStep(scan, NULL, readLastMultiplexerToken(token));
+	else if (strcmp(token, "apply_paste") == 0)
+		addProgramStep(scan, NULL, readApplyPaste());
+	else if (strcmp(token, "histogram") == 0) {
+		int row, count = 0;
+		command->file = readOutputFilename();
+		int width = atoi(needNextToken());
+		WiggleIterator ** iters = readLastIteratorList(&count);
+		command->histogram = emptyHistogram(iters, count, width);
+		for (row = 0; row < count; row++) {
+			addProgramStep(scan, iters[row], NULL);
+			scan->steps[scan->count - 1].histogram = command->histogram;
+			scan->steps[scan->count - 1].row = row;
+		}
+	} else if (strcmp(token, "top") == 0) {
+		command->file = readOutputFilename();
+		int count = atoi(needNextToken());
+		addProgramStep(scan, readLastIterator(), NULL);
+		command->top = scan->steps[scan->count - 1].top = newTopRegions(count);
+	} else if (isStatistic(token))
+		addProgramStep(scan, PrintStatisticsWiggleIterator(readLastIteratorToken(token), standardOutput()), NULL);
+	else
+		addProgramStep(scan, TeeWiggleIterator(readLastIteratorToken(token), standardOutput(), false, false), NULL);
+}
+
+static bool isProgramStepDone(ProgramStep * step) {
+	return step->multi ? step->multi->done : step->iter->done;
+}
+
+// Whether step A is behind step B in the genome
+static bool programStepLags(ProgramStep * A, ProgramStep * B) {
+	char * chromA = A->multi ? A->multi->chrom : A->iter->chrom;
+	char * chromB = B->multi ? B->multi->chrom : B->iter->chrom;
+	int startA = A->multi ? A->multi->start : A->iter->start;
+	int startB = B->multi ? B->multi->start : B->iter->start;
+	int cmp;
+
+	if (!chromA || !chromB)
+		return !chromA && chromB;
+	cmp = compareChroms(chromA, chromB);
+	return cmp < 0 || (cmp == 0 && startA < startB);
+}
+
+static void popProgramStep(ProgramStep * step, SpanBatch * batch) {
+	if (step->multi)
+		popMultiplexer(step->multi);
+	else if (step->histogram) {
+		batch->count = 0;
+		popBatch(step->iter, batch);
+		addBatchToHistogram(step->histogram, batch, step->row);
+	} else if (step->top) {
+		addTopRegion(step->top, step->iter->chrom, step->iter->start, step->iter->finish, step->iter->value);
+		pop(step->iter);
+	} else if (step->iter->popBatch) {
+		batch->count = 0;
+		popBatch(step->iter, batch);
+	} else
+		pop(step->iter);
+}
+
+static void runProgramScan(ProgramScan * scan) {
+	ProgramStep * next;
+	int i;
+
+	scan->batch = newSpanBatch();
+	do {
+		next = NULL;
+		for (i = 0; i < scan->count; i++)
+			if (!isProgramStepDone(scan->steps + i) && (!next || programStepLags(scan->steps + i, next)))
+				next = scan->steps + i;
+		if (next)
+			popProgramStep(next, scan->batch);
+	} while (next);
+	destroySpanBatch(scan->batch);
+}
+
+static void runProgramBatch(ProgramCommand * commands, int count) {
+	ProgramScan scan;
+	char ** words;
+	int i, wordCount = 0;
+
+	// The other commands do not share their files
+	for (i = 0; i < count; i++) {
+		if (!isScannedCommand(commands[i].words[0])) {
+			currentCommand = commands + i;
+			rollYourOwn(commands[i].count, commands[i].words);
+		}
+	}
+
+	words = (char **) calloc(commands[count - 1].words + commands[count - 1].count - commands[0].words, sizeof(char *));
+	for (i = 0; i < count; i++)
+		if (isScannedCommand(commands[i].words[0])) {
+			memcpy(words + wordCount, commands[i].words, commands[i].count * sizeof(char *));
+			wordCount += commands[i].count;
+		}
+	sharedTokens = words;
+	sharedTokenCount = wordCount;
+	resetSharedFiles();
+
+	memset(&scan, 0, sizeof(ProgramScan));
+	for (i = 0; i < count; i++) {
+		if (isScannedCommand(commands[i].words[0])) {
+			currentCommand = commands + i;
+			tokens = commands[i].words;
+			tokenCount = commands[i].count;
+			tokenIndex = 0;
+			readScannedCommand(&scan, commands + i);
+		}
+	}
+	currentCommand = NULL;
+	runProgramScan(&scan);
+
+	for (i = 0; i < count; i++) {
+		if (commands[i].histogram)
+			print_histogram(commands[i].histogram, commands[i].file);
+		else if (commands[i].top)
+			printTopRegions(commands[i].top, commands[i].file);
+		else
+			continue;
+		fclose(commands[i].file);
+	}
+	free(scan.steps);
+	free(words);
+	sharedTokenCount = 0;
+}
+
+static bool isNumberToken(char * token) {
+	char * end;
+	strtod(token, &end);
+	return *end == '\0';
+}
+
+// Names of files which do not exist yet, hence maybe written by the program
+static bool isNewFileToken(char * token) {
+	return strcmp(token, "-") && !strstr(token, "://") && (strchr(token, '.') || strchr(token, '/')) && !isNumberToken(token) && access(token, F_OK) != 0;
+}
+
+static bool commandNamesToken(ProgramCommand * command, char * token) {
+	int i;
+	for (i = 0; i < command->count; i++)
+		if (strcmp(command->words[i], token) == 0)
+			return true;
+	return false;
+}
+
+// Whether the command names a new file which an earlier command of the batch names too
+static bool dependsOnBatch(ProgramCommand * commands, int first, int index) {
+	int i, j;
+	for (i = 0; i < commands[index].count; i++)
+		if (isNewFileToken(commands[index].words[i]))
+			for (j = first; j < index; j++)
+				if (commandNamesToken(commands + j, commands[index].words[i]))
+					return true;
+	return false;
+}
+
+static void runProgram(ProgramCommand * commands, int count) {
+	ProgramCommand * caller = currentCommand;
+	int * batches = (int *) calloc(count + 1, sizeof(int));
+	int i, batchCount = 0;
+
+	// The batches are planned before any of them creates its files
+	for (i = 1; i < count; i++)
+		if (dependsOnBatch(commands, batches[batchCount], i))
+			batches[++batchCount] = i;
+	batches[++batchCount] = count;
+
+	for (i = 0; i < batchCount; i++) {
+		int j;
+		runProgramBatch(commands + batches[i], batches[i+1] - batches[i]);
+		// Printed into the output of the run command, if any
+		currentCommand = caller;
+		for (j = batches[i]; j < batches[i+1]; j++)
+			printCommandOutput(commands + j, standardOutput());
+	}
+	free(batches);
 }
 
 void parseFile(char * filename) {
 	FILE * file = fopen(filename, "r");
 	if (!file) {
 		fprintf(stderr, "Could not open file %s.\n", filename);
-		exit(1);
+		raiseError();
 	}
 
 	// Read content
 	fseek(file, 0, SEEK_END);
 	long length = ftell(file);
 	fseek(file, 0, SEEK_SET);
-	char * buffer = calloc(length, sizeof(char));
+	char * buffer = calloc(length + 1, sizeof(char));
 	if (!buffer) {
 		fprintf(stderr, "Calloc error.\n");
-		exit(1);
+		raiseError();
 	}
 	fread(buffer, 1, length, file);
 	fclose(file);
 
-	// Break up into strings
+	// Break up into strings, and the strings into commands
 	int wordCount = 0;
 	int arrayLength = 8;
 	char ** words = calloc(arrayLength, sizeof(char *));
-	char * token;
-	for (token = strtok(buffer, " \t\n\r"); token; token = strtok(NULL, " \t\r\n")) {
-		if (strlen(token)) {
+	int commandCount = 0;
+	int maxCommands = 8;
+	ProgramCommand * commands = calloc(maxCommands, sizeof(ProgramCommand));
+	int commandStart = 0;
+	char * pos;
+	for (pos = buffer; pos <= buffer + length; pos++) {
+		bool endOfCommand = pos == buffer + length || *pos == '\n' || *pos == ';';
+		if (endOfCommand || *pos == ' ' || *pos == '\t' || *pos == '\r')
+			*pos = '\0';
+		else if (pos == buffer || pos[-1] == '\0') {
 			if (wordCount >= arrayLength) {
 				arrayLength *= 2;
-				words = realloc(words, arrayLength * sizeof(char));
+				words = realloc(words, arrayLength * sizeof(char *));
 			}
-			words[wordCount++] = token;
+			words[wordCount++] = pos;
+		}
+
+		if (endOfCommand && wordCount > commandStart) {
+			if (commandCount == maxCommands) {
+				maxCommands *= 2;
+				commands = realloc(commands, maxCommands * sizeof(ProgramCommand));
+			}
+			memset(commands + commandCount, 0, sizeof(ProgramCommand));
+			commands[commandCount].first = commandStart;
+			commands[commandCount++].count = wordCount - commandStart;
+			commandStart = wordCount;
 		}
 	}
 
 	// Run program
-	rollYourOwn(wordCount, words);
+	if (commandCount == 0) {
+		fprintf(stderr, "No command in file %s.\n", filename);
+		raiseError();
+	} else if (commandCount == 1)
+		rollYourOwn(wordCount, words);
+	else {
+		int i;
+		for (i = 0; i < commandCount; i++)
+			commands[i].words = words + commands[i].first;
+		runProgram(commands, commandCount);
+	}
+	free(commands);
 	free(words);
 	free(buffer);
 }
 
+// At the top level, seek can also restrict apply_paste to the regions within its bounds
+static void readTopLevelSeek() {
+	char * chrom = needNextToken();
+	int start = atoi(needNextToken());
+	int finish = atoi(needNextToken());
+	holdFire = true;
+
+	char * token = needNextToken();
+	if (strcmp(token, "apply_paste") == 0) {
+		Multiplexer * paste = readApplyPaste();
+		seekMultiplexer(paste, chrom, start, finish);
+		runMultiplexer(paste);
+	} else {
+		WiggleIterator * iter = readIteratorToken(token);
+		seek(iter, chrom, start, finish);
+		runWiggleIterator(TeeWiggleIterator(iter, standardOutput(), false, false));
+	}
+}
+
+//////////////////////////////////////////////////////
+// Batches of regions
+//
+// The program is parsed once, then seeked to each 
+// region in genome order, so that the readers sweep 
+// forward across the regions. The output of each region 
+// comes under a comment line which repeats the region.
+//////////////////////////////////////////////////////
+
+typedef struct batchRegion_st {
+	char * text;
+	char * chrom;
+	int start;
+	int finish;
+} BatchRegion;
+
+static int compareBatchRegions(const void * A, const void * B) {
+	const BatchRegion * regionA = (const BatchRegion *) A;
+	const BatchRegion * regionB = (const BatchRegion *) B;
+	int cmp = compareChroms(regionA->chrom, regionB->chrom);
+	if (cmp)
+		return cmp;
+	return regionA->start - regionB->start;
+}
+
+// chrom:start-finish[,chrom:start-finish]*, with the coordinates of seek
+static BatchRegion * readBatchRegions(char * token, int * count) {
+	char * list = strdup(token);
+	char * text, * save;
+	int max = 16;
+	BatchRegion * regions = (BatchRegion *) calloc(max, sizeof(BatchRegion));
+
+	*count = 0;
+	for (text = strtok_r(list, ",", &save); text; text = strtok_r(NULL, ",", &save)) {
+		char * colon = strrchr(text, ':');
+		int start, finish;
+		if (!colon || colon == text || sscanf(colon + 1, "%i-%i", &start, &finish) != 2) {
+			fprintf(stderr, "wiggletools: invalid region in batch: %s\n", text);
+			raiseError();
+		}
+		if (*count == max) {
+			max *= 2;
+			regions = (BatchRegion *) realloc(regions, max * sizeof(BatchRegion));
+		}
+		regions[*count].text = text;
+		regions[*count].chrom = internChromosomeN(text, colon - text);
+		regions[*count].start = start;
+		regions[*count].finish = finish;
+		(*count)++;
+	}
+	qsort(regions, *count, sizeof(BatchRegion), compareBatchRegions);
+	return regions;
+}
+
+static void readBatch() {
+	int count, i;
+	BatchRegion * regions = readBatchRegions(needNextToken(), &count);
+	FILE * output = standardOutput();
+	WiggleIterator * iter;
+	holdFire = true;
+
+	// As at the top level
+	char * token = needNextToken();
+	if (strcmp(token, "do") == 0)
+		iter = readLastIterator();
+	else if (strncmp(token, "write", 5) == 0 || strcmp(token, "cache") == 0 || strcmp(token, "print") == 0)
+		iter = readLastIteratorToken(token);
+	else if (isStatistic(token))
+		iter = PrintStatisticsWiggleIterator(readLastIteratorToken(token), output);
+	else
+		iter = TeeWiggleIterator(readLastIteratorToken(token), output, false, true);
+
+	for (i = 0; i < count; i++) {
+		fprintf(output, "# %s\n", regions[i].text);
+		seek(iter, regions[i].chrom, regions[i].start, regions[i].finish);
+		runWiggleIterator(iter);
+		fflush(output);
+	}
+	free(regions);
+}
+
+WiggleIterator * parseIterator(int argc, char ** argv, bool hold) {
+	WiggleIterator * iter;
+	bool previous = holdFire;
+
+	holdFire = hold;
+	iter = readLastIteratorToken(nextToken(argc, argv));
+	holdFire = previous;
+	return iter;
+}
+
+WiggleIterator ** parseIteratorList(int argc, char ** argv, bool hold, int * count) {
+	WiggleIterator ** iters;
+	bool previous = holdFire;
+	bool strict = false;
+
+	holdFire = hold;
+	iters = readIteratorListToken(count, &strict, nextToken(argc, argv));
+	noTokensLeft();
+	holdFire = previous;
+	return iters;
+}
+
 void rollYourOwn(int argc, char ** argv) {
 	char * token = nextToken(argc, argv);
 	if (strcmp(token, "do") == 0)
 		runWiggleIterator(readLastIterator());
-	else if (strncmp(token, "write", 5) == 0)
+	else if (strncmp(token, "write", 5) == 0 || strcmp(token, "cache") == 0)
 		runWiggleIterator(readLastIteratorToken(token));
-	else if (strncmp(token, "mwrite", 6) == 0)
+	else if (strncmp(token, "mwrite", 6) == 0 || strcmp(token, "mappend_matrix") == 0)
 		runMultiplexer(readLastMultiplexerToken(token));
 	else if (strcmp(token, "apply_paste") == 0)
 		runMultiplexer(readApplyPaste());
 	else if (strcmp(token, "histogram") == 0)
 		readHistogram();
+	else if (strcmp(token, "top") == 0)
+		readTop();
+	else if (strcmp(token, "correlations") == 0)
+		readCorrelations();
 	else if (strcmp(token, "profile") == 0)
 		readProfile();
 	else if (strcmp(token, "profiles") == 0)
 		readProfiles();
 	else if (strcmp(token, "print") == 0)
 		runWiggleIterator(readLastIteratorToken(token));
-	else if (strcmp(token, "AUC") == 0 || strcmp(token, "meanI") == 0 || strcmp(token, "varI") == 0 || strcmp(token, "stddevI") == 0 || strcmp(token, "CVI") == 0 || strcmp(token, "maxI") == 0 || strcmp(token, "minI") == 0 || strcmp(token, "pearson") == 0 || strcmp(token, "ndpearson") == 0)
-		runWiggleIterator(PrintStatisticsWiggleIterator(readLastIteratorToken(token), stdout));
+	else if (strcmp(token, "partial") == 0)
+		readPartial();
+	else if (strcmp(token, "merge_partials") == 0)
+		readMergePartials();
+	else if (strcmp(token, "compact_matrix") == 0) {
+		char * filename = needNextToken();
+		noTokensLeft();
+		compactMatrix(filename);
+	}
+	else if (isStatistic(token))
+		runWiggleIterator(PrintStatisticsWiggleIterator(readLastIteratorToken(token), standardOutput()));
 	else if (strcmp(token, "seek") == 0)
-		toStdout(readSeek(), false, false);
+		readTopLevelSeek();
+	else if (strcmp(token, "batch") == 0)
+		readBatch();
 	else if (strcmp(token, "run") == 0)
 		parseFile(needNextToken());
+	else if (strcmp(token, "serve") == 0)
+		serve(needNextToken());
 	else
-		toStdout(readLastIteratorToken(token), false, false);	
+		runWiggleIterator(TeeWiggleIterator(readLastIteratorToken(token), standardOutput(), false, false));
+}
+
+//////////////////////////////////////////////////////
+// Multithreaded execution
+//
+// The program is parsed once per chromosome, and each 
+// copy is seeked to its chromosome, then run by a pool 
+// of threads. Text outputs are buffered in temporary 
+// files, then copied in chromosome order to the final 
+// output, through a BGZF writer for .gz files. BigWig 
+// outputs are buffered as raw values, and written by the
+// main thread. Statistics, histograms and top regions
+// are merged in memory.
+//
+// A shard of the genome, run with --shard, is split the
+// same way, but its results are dumped as a partial file,
+// to be merged with those of the other shards.
+//
+// With --checkpoint, each chromosome whose results were
+// stitched is recorded, with the statistics, histogram or
+// top regions merged so far, once the output is synced to
+// disk. A run resumed from the checkpoint cuts the output
+// back to its length then, and skips those chromosomes.
+//
+// With --sample, the shards are the windows of a sample 
+// of the genome, see below, and the results of each 
+// stratum are kept apart until the end.
+//////////////////////////////////////////////////////
+
+enum shardMode {SHARD_DO, SHARD_WRITE, SHARD_STATISTICS, SHARD_HISTOGRAM, SHARD_TOP, SHARD_PASTE};
+
+typedef struct shard_st {
+	char * chrom;
+	int start;
+	int finish;
+	// Rank and length of the chromosome in the chromosome sizes, for BigWig partials
+	int chromId;
+	int chromLength;
+	// Estimated, see orderShards
+	double work;
+	FILE * output;
+	WiggleIterator * statistics;
+	Histogram * histogram;
+	TopRegions * top;
+	bool done;
+	// Of the sample, see readGenomeSample
+	int stratum;
+} Shard;
+
+typedef struct shardPool_st {
+	int argc;
+	char ** argv;
+	enum shardMode mode;
+	bool bedGraph;
+	BigWigWriter * bigWig;
+	BgzfWriter * bgzf;
+	// Partial results of a shard of the genome
+	FILE * partial;
+	int shardNumber;
+	// Outputs buffered as raw values, for BigWig files and partial results
+	bool rawValues;
+	// Partial results of a BigWig output, already compressed
+	bool bigWigPartial;
+	Shard * shards;
+	int count;
+	// Order in which the shards are run
+	int * order;
+	int next;
+	// Command line, and the checkpoint of the run resumed, if any
+	char * command;
+	Checkpoint * resumed;
+	// Sampled estimates: the number of strata, and the bases sampled in each, out of the genome
+	int strata;
+	long long * sampled;
+	long long genome;
+	double fraction;
+	// Threads started, spread over the NUMA nodes in turn
+	int threadCount;
+	// Protects the above, the shards are also parsed one at a time
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} ShardPool;
+
+static char * checkpointFilename = NULL;
+static bool resumeFromCheckpoint = false;
+
+void setCheckpoint(char * filename, bool resume) {
+	checkpointFilename = filename;
+	resumeFromCheckpoint = resume;
+}
+
+static int compareShards(const void * A, const void * B) {
+	return compareChroms(((Shard *) A)->chrom, ((Shard *) B)->chrom);
+}
+
+static Shard * readChromSizes(char * filename, int * count) {
+	FILE * file = fopen(filename, "r");
+	char line[5000];
+	char chrom[5000];
+	int length;
+	int max = 100;
+	Shard * shards = (Shard *) calloc(max, sizeof(Shard));
+
+	if (!file) {
+		fprintf(stderr, "Could not open chromosome sizes file %s\n", filename);
+		raiseError();
+	}
+
+	*count = 0;
+	while (fgets(line, 5000, file)) {
+		if (sscanf(line, "%s\t%i", chrom, &length) != 2)
+			continue;
+		if (*count == max) {
+			max *= 2;
+			shards = (Shard *) realloc(shards, max * sizeof(Shard));
+		}
+		memset(shards + *count, 0, sizeof(Shard));
+		shards[*count].chrom = internChromosome(chrom);
+		shards[*count].start = 1;
+		shards[*count].finish = length + 1;
+		(*count)++;
+	}
+	fclose(file);
+
+	// Same order as the sorted input files
+	qsort(shards, *count, sizeof(Shard), compareShards);
+	return shards;
+}
+
+//////////////////////////////////////////////////////
+// Balancing the shards
+//
+// The work over a region is estimated as its share of the
+// length of the genome, plus its share of the data of each
+// input file of the program whose index can tell, see 
+// workEstimates.h. The stretches of --shard are cut so as 
+// to carry equal work, and the threads take on the 
+// heaviest shards first.
+//////////////////////////////////////////////////////
+
+// Bins of the estimates, per stretch of the genome
+#define BINS_PER_SHARD 32
+
+typedef struct workPlan_st {
+	WorkEstimator ** estimators;
+	// Data of each input over the whole genome
+	double * totals;
+	int count;
+	long long genome;
+} WorkPlan;
+
+static WorkPlan * openWorkPlan(int argc, char ** argv, Shard * chroms, int chromCount) {
+	WorkPlan * plan = (WorkPlan *) calloc(1, sizeof(WorkPlan));
+	int i, j;
+
+	for (i = 0; i < chromCount; i++)
+		plan->genome += chroms[i].finish - chroms[i].start;
+
+	// Outputs cannot exist yet, so the existing files are inputs
+	plan->estimators = (WorkEstimator **) calloc(argc, sizeof(WorkEstimator *));
+	plan->totals = (double *) calloc(argc, sizeof(double));
+	for (i = 0; i < argc; i++) {
+		WorkEstimator * estimator = openWorkEstimator(argv[i]);
+		if (!estimator)
+			continue;
+		for (j = 0; j < chromCount; j++)
+			estimateWork(estimator, chroms[j].chrom, chroms[j].start, chroms[j].finish, plan->totals + plan->count, 1);
+		if (plan->totals[plan->count] > 0)
+			plan->estimators[plan->count++] = estimator;
+		else
+			closeWorkEstimator(estimator);
+	}
+	return plan;
+}
+
+static void closeWorkPlan(WorkPlan * plan) {
+	int i;
+
+	for (i = 0; i < plan->count; i++)
+		closeWorkEstimator(plan->estimators[i]);
+	free(plan->estimators);
+	free(plan->totals);
+	free(plan);
+}
+
+// Work over count equal bins of the region
+static void estimateRegionWork(WorkPlan * plan, const char * chrom, int start, int finish, double * work, int count) {
+	double * data = (double *) calloc(count, sizeof(double));
+	int i, j;
+
+	for (j = 0; j < count; j++)
+		work[j] = (finish - start) / (double) count / plan->genome;
+	for (i = 0; i < plan->count; i++) {
+		memset(data, 0, count * sizeof(double));
+		if (estimateWork(plan->estimators[i], chrom, start, finish, data, count))
+			for (j = 0; j < count; j++)
+				work[j] += data[j] / plan->totals[i];
+	}
+	free(data);
+}
+
+// Offsets in the genome, with its chromosomes in order, of the limits 
+// between total stretches of equal work. Each stretch holds at least one base.
+static long long * cutGenome(WorkPlan * plan, Shard * chroms, int chromCount, int total) {
+	long long * cuts = (long long *) calloc(total + 1, sizeof(long long));
+	long long binWidth = plan->genome / (BINS_PER_SHARD * total);
+	long long offset = 0;
+	double cumulated = 0, * work;
+	int chrom, bin, bins, cut = 1;
+
+	if (binWidth < 1)
+		binWidth = 1;
+	work = (double *) calloc(plan->genome / binWidth + chromCount, sizeof(double));
+
+	for (chrom = 0; chrom < chromCount; chrom++) {
+		long long length = chroms[chrom].finish - chroms[chrom].start;
+		bins = (length + binWidth - 1) / binWidth;
+		if (bins == 0)
+			continue;
+		estimateRegionWork(plan, chroms[chrom].chrom, chroms[chrom].start, chroms[chrom].finish, work, bins);
+		for (bin = 0; bin < bins; bin++) {
+			long long binStart = offset + bin * length / bins;
+			long long binFinish = offset + (bin + 1) * length / bins;
+			// Whole work of the genome is 1 + 1 per input with data
+			for (; cut < total && cumulated + work[bin] >= (1. + plan->count) * cut / total; cut++) {
+				double ratio = work[bin] > 0 ? ((1. + plan->count) * cut / total - cumulated) / work[bin] : 0;
+				cuts[cut] = binStart + (long long) (ratio * (binFinish - binStart) + 0.5);
+			}
+			cumulated += work[bin];
+		}
+		offset += length;
+	}
+	free(work);
+
+	// Rounding errors may leave cuts unset at the very end
+	for (; cut < total; cut++)
+		cuts[cut] = plan->genome;
+	cuts[total] = plan->genome;
+	for (cut = 1; cut < total; cut++) {
+		if (cuts[cut] <= cuts[cut-1])
+			cuts[cut] = cuts[cut-1] + 1;
+		if (cuts[cut] > plan->genome - (total - cut))
+			cuts[cut] = plan->genome - (total - cut);
+	}
+	return cuts;
+}
+
+// Regions of stretch number index (from 0) of the above
+static Shard * readGenomeShard(char * filename, int argc, char ** argv, int index, int total, int * count) {
+	int chromCount, i;
+	Shard * chroms = readChromSizes(filename, &chromCount);
+	Shard * regions = (Shard *) calloc(chromCount, sizeof(Shard));
+	WorkPlan * plan = openWorkPlan(argc, argv, chroms, chromCount);
+	long long offset = 0, first, last, * cuts;
+
+	if (plan->genome < total) {
+		fprintf(stderr, "wiggletools: cannot cut %lli bases into %i shards\n", plan->genome, total);
+		raiseError();
+	}
+	cuts = cutGenome(plan, chroms, chromCount, total);
+	first = cuts[index];
+	last = cuts[index + 1];
+	free(cuts);
+	closeWorkPlan(plan);
+
+	*count = 0;
+	for (i = 0; i < chromCount; i++) {
+		long long length = chroms[i].finish - chroms[i].start;
+		long long start = first > offset ? first : offset;
+		long long finish = last < offset + length ? last : offset + length;
+		if (start < finish) {
+			regions[*count].chrom = chroms[i].chrom;
+			regions[*count].start = 1 + start - offset;
+			regions[*count].finish = 1 + finish - offset;
+			regions[*count].chromId = i;
+			regions[*count].chromLength = length;
+			(*count)++;
+		}
+		offset += length;
+	}
+	free(chroms);
+	return regions;
+}
+
+static int compareShardWork(const void * A, const void * B) {
+	double workA = (*(Shard **) A)->work;
+	double workB = (*(Shard **) B)->work;
+	return (workA < workB) - (workA > workB);
+}
+
+// Longest processing time first: the threads are less likely to wait for one long shard at the end
+static void orderShards(ShardPool * pool) {
+	WorkPlan * plan = openWorkPlan(pool->argc, pool->argv, pool->shards, pool->count);
+	Shard ** sorted = (Shard **) calloc(pool->count, sizeof(Shard *));
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		sorted[i] = pool->shards + i;
+		estimateRegionWork(plan, sorted[i]->chrom, sorted[i]->start, sorted[i]->finish, &sorted[i]->work, 1);
+	}
+	closeWorkPlan(plan);
+	qsort(sorted, pool->count, sizeof(Shard *), compareShardWork);
+
+	pool->order = (int *) calloc(pool->count, sizeof(int));
+	for (i = 0; i < pool->count; i++)
+		pool->order[i] = sorted[i] - pool->shards;
+	free(sorted);
+}
+
+static void openShardOutput(Shard * shard) {
+	if (!(shard->output = tmpfile())) {
+		fprintf(stderr, "Could not create temporary file\n");
+		raiseError();
+	}
+}
+
+// Called within the pool's lock
+static WiggleIterator * readShardIterator(ShardPool * pool, Shard * shard) {
+	WiggleIterator * iter;
+
+	switch (pool->mode) {
+	case SHARD_DO:
+		return readLastIteratorToken(nextToken(pool->argc - 1, pool->argv + 1));
+	case SHARD_WRITE:
+		openShardOutput(shard);
+		if (!strcmp(pool->argv[0], "write") || !strcmp(pool->argv[0], "write_bg"))
+			iter = readLastIteratorToken(nextToken(pool->argc - 2, pool->argv + 2));
+		else
+			iter = readLastIteratorToken(nextToken(pool->argc, pool->argv));
+		if (pool->bigWig || pool->bigWigPartial)
+			return BigWigWriterInput(iter);
+		else if (pool->partial)
+			return iter;
+		return TeeWiggleIterator(iter, shard->output, pool->bedGraph, true);
+	case SHARD_STATISTICS:
+		return shard->statistics = readLastIteratorToken(nextToken(pool->argc, pool->argv));
+	default:
+		return NULL;
+	}
+}
+
+static void dumpShardValues(WiggleIterator * iter, FILE * output) {
+	PartialRecord value;
+
+	for (; !iter->done; pop(iter)) {
+		value.start = iter->start;
+		value.finish = iter->finish;
+		value.value = iter->value;
+		if (fwrite(&value, sizeof(value), 1, output) != 1) {
+			fprintf(stderr, "Could not write to temporary file\n");
+			raiseError();
+		}
+	}
+}
+
+static void copyShardValues(Shard * shard, BigWigWriter * writer) {
+	PartialRecord value;
+
+	rewind(shard->output);
+	while (fread(&value, sizeof(value), 1, shard->output) == 1)
+		addBigWigValue(writer, shard->chrom, value.start, value.finish, value.value);
+	fclose(shard->output);
+}
+
+static void runShard(ShardPool * pool, Shard * shard) {
+	if (pool->mode == SHARD_HISTOGRAM) {
+		int count, i;
+		bool strict = false;
+		lockUntilError(&pool->mutex);
+		WiggleIterator ** iters = readIteratorListToken(&count, &strict, nextToken(pool->argc - 3, pool->argv + 3));
+		noTokensLeft();
+		unlockUntilError(&pool->mutex);
+
+		// Bins widened on each chromosome apart could only be merged approximately
+		if (!histogramRangeKnown(iters, count)) {
+			fprintf(stderr, "wiggletools: histogram can only be split between threads or shards if the range of values of all its inputs is known beforehand, e.g. from BigWig files\n");
+			raiseError();
+		}
+
+		for (i = 0; i < count; i++)
+			seek(iters[i], shard->chrom, shard->start, shard->finish);
+		shard->histogram = histogram(iters, count, atoi(pool->argv[2]));
+	} else if (pool->mode == SHARD_TOP) {
+		lockUntilError(&pool->mutex);
+		WiggleIterator * iter = readLastIteratorToken(nextToken(pool->argc - 3, pool->argv + 3));
+		unlockUntilError(&pool->mutex);
+
+		seek(iter, shard->chrom, shard->start, shard->finish);
+		shard->top = topRegions(iter, atoi(pool->argv[2]));
+	} else if (pool->mode == SHARD_PASTE) {
+		// Each shard pastes its chromosome's lines from its own copy of the file
+		lockUntilError(&pool->mutex);
+		openShardOutput(shard);
+		Multiplexer * paste = readApplyPasteToken(shard->output, nextToken(pool->argc - 2, pool->argv + 2));
+		unlockUntilError(&pool->mutex);
+
+		seekMultiplexer(paste, shard->chrom, shard->start, shard->finish);
+		runMultiplexer(paste);
+		fflush(shard->output);
+	} else {
+		lockUntilError(&pool->mutex);
+		WiggleIterator * iter = readShardIterator(pool, shard);
+		unlockUntilError(&pool->mutex);
+
+		seek(iter, shard->chrom, shard->start, shard->finish);
+		if (pool->rawValues)
+			dumpShardValues(iter, shard->output);
+		else
+			runWiggleIterator(iter);
+		if (shard->output)
+			fflush(shard->output);
+	}
+}
+
+static void * runShards(void * args) {
+	ShardPool * pool = (ShardPool *) args;
+	// Nothing is read before the first seek
+	holdFire = true;
+	pinThreadToNode(__atomic_fetch_add(&pool->threadCount, 1, __ATOMIC_SEQ_CST));
+
+	while (true) {
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->next == pool->count) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		Shard * shard = pool->shards + pool->order[pool->next++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		// Completed before the checkpoint
+		if (shard->done)
+			continue;
+		runShard(pool, shard);
+
+		pthread_mutex_lock(&pool->mutex);
+		shard->done = true;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+static void waitForShard(ShardPool * pool, Shard * shard) {
+	pthread_mutex_lock(&pool->mutex);
+	while (!shard->done)
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void copyShardOutput(Shard * shard, FILE * output, BgzfWriter * bgzf) {
+	char buffer[65536];
+	size_t length;
+
+	rewind(shard->output);
+	while ((length = fread(buffer, 1, sizeof(buffer), shard->output))) {
+		if (bgzf)
+			writeBgzf(bgzf, buffer, length);
+		else
+			fwrite(buffer, 1, length, output);
+	}
+	fclose(shard->output);
+}
+
+// Outputs nested within the program would be written by all the threads at once
+static void checkParallelisable(int argc, char ** argv) {
+	static const char * topLevelOnly[] = {"write", "write_bg", "histogram", "top", "apply_paste", NULL};
+	static const char * forbidden[] = {"write_pyramid", "mwrite", "mwrite_bg", "mwrite_matrix", "mappend_matrix", "compact_matrix", "print", "profile", "profiles", "seek", "batch", "run", "serve", "partial", "merge_partials", "cache", "correlations", NULL};
+	int i, j;
+
+	for (i = 0; i < argc; i++) {
+		bool allowed = true;
+		for (j = 0; forbidden[j]; j++)
+			if (strcmp(argv[i], forbidden[j]) == 0)
+				allowed = false;
+		for (j = 0; i > 0 && topLevelOnly[j]; j++)
+			if (strcmp(argv[i], topLevelOnly[j]) == 0)
+				allowed = false;
+		if (!allowed) {
+			fprintf(stderr, "wiggletools: %s cannot be run in multithreaded mode\n", argv[i]);
+			raiseError();
+		}
+	}
+}
+
+//////////////////////////////////////////////////////
+// Checkpoints
+//////////////////////////////////////////////////////
+
+static char * joinCommand(int argc, char ** argv) {
+	int length = 1, i;
+	char * command;
+
+	for (i = 0; i < argc; i++)
+		length += strlen(argv[i]) + 1;
+	command = (char *) calloc(length, 1);
+	for (i = 0; i < argc; i++) {
+		if (i)
+			strcat(command, " ");
+		strcat(command, argv[i]);
+	}
+	return command;
+}
+
+// Returns the checkpoint file, at the partial results, if the run resumes
+static FILE * readPoolCheckpoint(ShardPool * pool) {
+	FILE * file;
+
+	pool->command = joinCommand(pool->argc, pool->argv);
+	// No checkpoint yet: the run starts afresh
+	if (!resumeFromCheckpoint || !(file = fopen(checkpointFilename, "rb")))
+		return NULL;
+
+	pool->resumed = (Checkpoint *) calloc(1, sizeof(Checkpoint));
+	readCheckpointHeader(file, checkpointFilename, pool->resumed);
+	if (strcmp(pool->resumed->command, pool->command)) {
+		fprintf(stderr, "wiggletools: checkpoint %s was written by another program: %s\n", checkpointFilename, pool->resumed->command);
+		raiseError();
+	}
+	if (pool->resumed->regions != pool->count) {
+		fprintf(stderr, "wiggletools: checkpoint %s was written over %i chromosomes, not %i\n", checkpointFilename, pool->resumed->regions, pool->count);
+		raiseError();
+	}
+	return file;
+}
+
+// The output of a resumed run is cut back to its length at the checkpoint, then appended to
+static FILE * openPoolOutput(ShardPool * pool, char * filename) {
+	FILE * file;
+
+	if (!pool->resumed || strcmp(filename, "-") == 0)
+		return openOutputFile(filename);
+	if (!(file = fopen(filename, "r+"))) {
+		fprintf(stderr, "Could not reopen output file %s to resume\n", filename);
+		raiseError();
+	}
+	if (ftruncate(fileno(file), pool->resumed->outputLength) || fseeko(file, 0, SEEK_END)) {
+		fprintf(stderr, "Could not cut output file %s back to its checkpoint\n", filename);
+		raiseError();
+	}
+	return file;
+}
+
+static bool hasPartialResults(ShardPool * pool) {
+	return pool->mode == SHARD_STATISTICS || pool->mode == SHARD_HISTOGRAM || pool->mode == SHARD_TOP;
+}
+
+static void loadCheckpointResults(ShardPool * pool, FILE * file) {
+	PartialKind kind = readPartialHeader(file, checkpointFilename);
+
+	if (pool->mode == SHARD_STATISTICS && kind == PARTIAL_STATISTICS)
+		pool->shards[0].statistics = loadStatistics(file);
+	else if (pool->mode == SHARD_HISTOGRAM && kind == PARTIAL_HISTOGRAM)
+		pool->shards[0].histogram = loadHistogram(file);
+	else if (pool->mode == SHARD_TOP && kind == PARTIAL_TOP)
+		pool->shards[0].top = loadTopRegions(file);
+	else {
+		fprintf(stderr, "Corrupted checkpoint file %s\n", checkpointFilename);
+		raiseError();
+	}
+}
+
+// Statistics are merged into those of the checkpoint in the form they are loaded in
+static WiggleIterator * reloadStatistics(WiggleIterator * statistics) {
+	WiggleIterator * res;
+	FILE * file = tmpfile();
+
+	if (!file) {
+		fprintf(stderr, "Could not create temporary file\n");
+		raiseError();
+	}
+	dumpStatistics(statistics, file);
+	rewind(file);
+	res = loadStatistics(file);
+	fclose(file);
+	return res;
+}
+
+static void syncFile(FILE * file) {
+	if (fflush(file) || fsync(fileno(file))) {
+		fprintf(stderr, "Could not sync output to disk\n");
+		raiseError();
+	}
+}
+
+// Written to a temporary file, then renamed, so that a crash leaves the previous checkpoint whole
+static void writePoolCheckpoint(ShardPool * pool, FILE * output, int completed) {
+	Checkpoint checkpoint;
+	char * tmpFilename = (char *) malloc(strlen(checkpointFilename) + 5);
+	FILE * file;
+
+	checkpoint.command = pool->command;
+	checkpoint.regions = pool->count;
+	checkpoint.completed = completed;
+	checkpoint.outputLength = 0;
+	checkpoint.hasPartial = completed > 0 && hasPartialResults(pool);
+	// The results of statistics, histograms and top regions are only written at the end
+	if (output && (pool->mode == SHARD_WRITE || pool->mode == SHARD_PASTE)) {
+		syncFile(output);
+		checkpoint.outputLength = ftello(output);
+	}
+
+	sprintf(tmpFilename, "%s.tmp", checkpointFilename);
+	if (!(file = fopen(tmpFilename, "wb"))) {
+		fprintf(stderr, "Could not open checkpoint file %s\n", tmpFilename);
+		raiseError();
+	}
+	writeCheckpointHeader(file, &checkpoint);
+	if (checkpoint.hasPartial && pool->mode == SHARD_STATISTICS) {
+		writePartialHeader(file, PARTIAL_STATISTICS);
+		dumpStatistics(pool->shards[0].statistics, file);
+	} else if (checkpoint.hasPartial && pool->mode == SHARD_HISTOGRAM) {
+		writePartialHeader(file, PARTIAL_HISTOGRAM);
+		dumpHistogram(pool->shards[0].histogram, file);
+	} else if (checkpoint.hasPartial && pool->mode == SHARD_TOP) {
+		writePartialHeader(file, PARTIAL_TOP);
+		dumpTopRegions(pool->shards[0].top, file);
+	}
+	syncFile(file);
+	fclose(file);
+	if (rename(tmpFilename, checkpointFilename)) {
+		fprintf(stderr, "Could not write checkpoint file %s\n", checkpointFilename);
+		raiseError();
+	}
+	free(tmpFilename);
+}
+
+// Returns the number of chromosomes already completed
+static int startCheckpoints(ShardPool * pool, FILE * output, FILE * resumed) {
+	int completed = pool->resumed ? pool->resumed->completed : 0;
+	int i;
+
+	if (pool->partial) {
+		fprintf(stderr, "wiggletools: a shard cannot be checkpointed\n");
+		raiseError();
+	} else if (pool->strata) {
+		fprintf(stderr, "wiggletools: a sample cannot be checkpointed\n");
+		raiseError();
+	} else if (pool->bigWig || pool->bgzf) {
+		fprintf(stderr, "wiggletools: BigWig and bgzipped outputs cannot be checkpointed\n");
+		raiseError();
+	} else if ((pool->mode == SHARD_WRITE || pool->mode == SHARD_PASTE) && output == stdout) {
+		fprintf(stderr, "wiggletools: the output must be a file to be checkpointed\n");
+		raiseError();
+	}
+
+	if (resumed) {
+		if (pool->resumed->hasPartial)
+			loadCheckpointResults(pool, resumed);
+		fclose(resumed);
+	}
+	for (i = 0; i < completed; i++)
+		pool->shards[i].done = true;
+	writePoolCheckpoint(pool, output, completed);
+	return completed;
+}
+
+//////////////////////////////////////////////////////
+// Sampled estimates
+//
+// The genome, as the chromosomes of the chromosome sizes
+// file laid end to end, is cut into equal strata, and a 
+// window of each, covering the fraction sampled, is 
+// placed at random within it. The windows are run as the
+// shards of a multithreaded run, seeking each input to 
+// them, so that only the data within them is read from 
+// indexed files. A window which straddles chromosomes is 
+// split into several shards of the same stratum.
+//
+// Totals (AUC, span, histogram counts) are scaled up 
+// from the bases sampled to the whole genome, the other
+// statistics are estimated as they are over the sample. 
+// The confidence intervals are those of the delete-a-
+// stratum jackknife, shrunk by the finite population 
+// correction, so that the full genome has none.
+//////////////////////////////////////////////////////
+
+#define SAMPLE_STRATA 100
+// The strata are fewer if the windows would be shorter than this
+#define SAMPLE_MIN_WINDOW 1000
+// The jackknife leaves one stratum out of at least two
+#define SAMPLE_MIN_STRATA 3
+// The same windows are drawn at each run
+#define SAMPLE_SEED 20160401
+// ~95% confidence intervals
+#define SAMPLE_Z 1.96
+
+static void readGenomeSample(ShardPool * pool, char * filename, double fraction) {
+	int chromCount, max = SAMPLE_STRATA + 1, i, k;
+	Shard * chroms = readChromSizes(filename, &chromCount);
+	long long * offsets = (long long *) calloc(chromCount + 1, sizeof(long long));
+
+	if (!(fraction > 0 && fraction <= 1)) {
+		fprintf(stderr, "wiggletools: invalid sample fraction: %f\n", fraction);
+		raiseError();
+	}
+	for (i = 0; i < chromCount; i++)
+		offsets[i + 1] = offsets[i] + chroms[i].finish - chroms[i].start;
+	pool->genome = offsets[chromCount];
+	pool->fraction = fraction;
+	pool->strata = SAMPLE_STRATA;
+	while (pool->strata > SAMPLE_MIN_STRATA && fraction * pool->genome / pool->strata < SAMPLE_MIN_WINDOW)
+		pool->strata--;
+	if (pool->genome < pool->strata) {
+		fprintf(stderr, "wiggletools: cannot cut %lli bases into %i strata\n", pool->genome, pool->strata);
+		raiseError();
+	}
+
+	srand48(SAMPLE_SEED);
+	pool->sampled = (long long *) calloc(pool->strata, sizeof(long long));
+	pool->shards = (Shard *) calloc(max, sizeof(Shard));
+	pool->count = 0;
+	for (k = 0; k < pool->strata; k++) {
+		long long first = pool->genome * k / pool->strata;
+		long long length = pool->genome * (k + 1) / pool->strata - first;
+		long long window = llround(fraction * length);
+		if (window < 1)
+			window = 1;
+		long long start = first + (long long) (drand48() * (length - window + 1));
+		long long finish = start + window;
+		pool->sampled[k] = window;
+
+		for (i = 0; i < chromCount; i++) {
+			long long from = start > offsets[i] ? start : offsets[i];
+			long long to = finish < offsets[i + 1] ? finish : offsets[i + 1];
+			if (from >= to)
+				continue;
+			if (pool->count == max) {
+				max *= 2;
+				pool->shards = (Shard *) realloc(pool->shards, max * sizeof(Shard));
+			}
+			memset(pool->shards + pool->count, 0, sizeof(Shard));
+			pool->shards[pool->count].chrom = chroms[i].chrom;
+			pool->shards[pool->count].start = 1 + from - offsets[i];
+			pool->shards[pool->count].finish = 1 + to - offsets[i];
+			pool->shards[pool->count].chromId = i;
+			pool->shards[pool->count].chromLength = offsets[i + 1] - offsets[i];
+			pool->shards[pool->count].stratum = k;
+			pool->count++;
+		}
+	}
+	free(offsets);
+	free(chroms);
+}
+
+// The first shard of each stratum, into which the others were merged
+static Shard ** sampleStrata(ShardPool * pool) {
+	Shard ** strata = (Shard **) calloc(pool->strata, sizeof(Shard *));
+	int i;
+
+	for (i = pool->count - 1; i >= 0; i--)
+		strata[pool->shards[i].stratum] = pool->shards + i;
+	return strata;
+}
+
+// Scales the totals up from the bases sampled outside of stratum skipped, if any, to the genome
+static double sampleScale(ShardPool * pool, int skipped) {
+	long long sampled = 0;
+	int k;
+
+	for (k = 0; k < pool->strata; k++)
+		if (k != skipped)
+			sampled += pool->sampled[k];
+	return (double) pool->genome / sampled;
+}
+
+// Half width of the confidence interval, from the estimates without each stratum in turn
+static double jackknifeMargin(ShardPool * pool, double * replicates) {
+	double mean = 0, squares = 0;
+	int k;
+
+	// Nothing left out, even where a stratum holds no data
+	if (pool->fraction == 1)
+		return 0;
+	for (k = 0; k < pool->strata; k++)
+		mean += replicates[k];
+	mean /= pool->strata;
+	for (k = 0; k < pool->strata; k++)
+		squares += (replicates[k] - mean) * (replicates[k] - mean);
+	return SAMPLE_Z * sqrt((1 - pool->fraction) * (pool->strata - 1) * squares / pool->strata);
+}
+
+// Statistics of all the strata but skipped, if any, loaded afresh as merging consumes them
+static double * mergeSampleStatistics(ShardPool * pool, FILE * file, off_t * offsets, int skipped, StatisticKind * kinds) {
+	WiggleIterator * merged = NULL;
+	double * results;
+	int count, j, k;
+
+	for (k = 0; k < pool->strata; k++) {
+		if (k == skipped)
+			continue;
+		if (fseeko(file, offsets[k], SEEK_SET)) {
+			fprintf(stderr, "Could not read temporary file\n");
+			raiseError();
+		}
+		WiggleIterator * statistics = loadStatistics(file);
+		if (merged)
+			mergeStatistics(merged, statistics);
+		else
+			merged = statistics;
+	}
+	results = statisticResults(merged, &count);
+	for (j = 0; j < count; j++)
+		if (kinds[j] == STATISTIC_TOTAL)
+			results[j] *= sampleScale(pool, skipped);
+	return results;
+}
+
+// Formatted as track values, with --precision. Only the extrema of integer
+// valued inputs are integers, the other estimates are scaled or averaged.
+static void printSampleLine(double * values, StatisticKind * kinds, int count, bool integral) {
+	char number[MAX_NUMBER_LENGTH];
+	int j;
+
+	for (j = 0; j < count; j++) {
+		if (integral && kinds[j] == STATISTIC_EXTREMUM && fabs(values[j]) <= INT_MAX)
+			formatInt(number, (int) values[j]);
+		else
+			formatDouble(number, values[j]);
+		printf(j ? "\t%s" : "%s", number);
+	}
+	printf("\n");
+}
+
+// The estimates, then their lower and upper bounds, one line each
+static void printSampleStatistics(ShardPool * pool) {
+	Shard ** strata = sampleStrata(pool);
+	off_t * offsets = (off_t *) calloc(pool->strata, sizeof(off_t));
+	FILE * file = tmpfile();
+	StatisticKind * kinds;
+	double ** replicates = (double **) calloc(pool->strata, sizeof(double *));
+	double * estimates, * lower, * upper, * column;
+	int count, j, k;
+
+	if (!file) {
+		fprintf(stderr, "Could not create temporary file\n");
+		raiseError();
+	}
+	kinds = statisticKinds(strata[0]->statistics, &count);
+	for (k = 0; k < pool->strata; k++) {
+		offsets[k] = ftello(file);
+		dumpStatistics(strata[k]->statistics, file);
+	}
+
+	estimates = mergeSampleStatistics(pool, file, offsets, -1, kinds);
+	for (k = 0; k < pool->strata; k++)
+		replicates[k] = mergeSampleStatistics(pool, file, offsets, k, kinds);
+	fclose(file);
+
+	lower = (double *) calloc(count, sizeof(double));
+	upper = (double *) calloc(count, sizeof(double));
+	column = (double *) calloc(pool->strata, sizeof(double));
+	for (j = 0; j < count; j++) {
+		double margin;
+		for (k = 0; k < pool->strata; k++)
+			column[k] = replicates[k][j];
+		// The sample says little of the extrema of the genome
+		margin = kinds[j] == STATISTIC_EXTREMUM ? NAN : jackknifeMargin(pool, column);
+		lower[j] = estimates[j] - margin;
+		upper[j] = estimates[j] + margin;
+	}
+	printSampleLine(estimates, kinds, count, strata[0]->statistics->integral);
+	printSampleLine(lower, kinds, count, strata[0]->statistics->integral);
+	printSampleLine(upper, kinds, count, strata[0]->statistics->integral);
+
+	for (k = 0; k < pool->strata; k++)
+		free(replicates[k]);
+	free(replicates);
+	free(estimates);
+	free(lower);
+	free(upper);
+	free(column);
+	free(kinds);
+	free(offsets);
+	free(strata);
+}
+
+// Each bin: its centre, then the estimated count, and its lower and upper bounds, for each input
+static void printSampleHistogram(ShardPool * pool, FILE * output) {
+	Shard ** strata = sampleStrata(pool);
+	Histogram * total = emptyHistogramLike(strata[0]->histogram);
+	Histogram ** rebinned = (Histogram **) calloc(pool->strata, sizeof(Histogram *));
+	double * replicates = (double *) calloc(pool->strata, sizeof(double));
+	double scale = sampleScale(pool, -1);
+	double min, max;
+	int width, rows, row, column, k;
+
+	// All the strata are counted over the same bins
+	for (k = 0; k < pool->strata; k++)
+		mergeHistograms(total, strata[k]->histogram);
+	for (k = 0; k < pool->strata; k++) {
+		rebinned[k] = emptyHistogramLike(total);
+		mergeHistograms(rebinned[k], strata[k]->histogram);
+	}
+	histogramRow(total, 0, &width, &min, &max);
+	rows = histogramRowCount(total);
+
+	for (column = 0; column < width; column++) {
+		fprintf(output, "%f", min + (max - min) / width * (column + 0.5));
+		for (row = 0; row < rows; row++) {
+			double sum = 0, estimate, margin;
+			for (k = 0; k < pool->strata; k++)
+				sum += histogramRow(rebinned[k], row, &width, &min, &max)[column];
+			for (k = 0; k < pool->strata; k++)
+				replicates[k] = (sum - histogramRow(rebinned[k], row, &width, &min, &max)[column]) * sampleScale(pool, k);
+			estimate = sum * scale;
+			margin = jackknifeMargin(pool, replicates);
+			fprintf(output, "\t%f\t%f\t%f", estimate, estimate > margin ? estimate - margin : 0, estimate + margin);
+		}
+		fprintf(output, "\n");
+	}
+
+	for (k = 0; k < pool->strata; k++)
+		destroyHistogram(rebinned[k]);
+	free(rebinned);
+	destroyHistogram(total);
+	free(replicates);
+	free(strata);
+}
+
+static void runShardPool(ShardPool * pool, int threads) {
+	FILE * output = stdout;
+	FILE * resumed = NULL;
+	pthread_t * threadIDs;
+	int argc = pool->argc;
+	char ** argv = pool->argv;
+	int completed = 0;
+	Shard * merged = pool->shards;
+	int i;
+
+	if (threads < 1) {
+		fprintf(stderr, "wiggletools: invalid number of threads: %i\n", threads);
+		raiseError();
+	}
+	if (argc < 1) {
+		fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+		raiseError();
+	}
+	checkParallelisable(argc, argv);
+	// Before the outputs are created
+	orderShards(pool);
+	if (checkpointFilename)
+		resumed = readPoolCheckpoint(pool);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	if (strcmp(argv[0], "do") == 0) {
+		if (pool->partial) {
+			fprintf(stderr, "wiggletools: do has no results to store for a shard\n");
+			raiseError();
+		}
+		pool->mode = SHARD_DO;
+	} else if (strcmp(argv[0], "write") == 0 || strcmp(argv[0], "write_bg") == 0) {
+		pool->mode = SHARD_WRITE;
+		pool->bedGraph = strcmp(argv[0], "write_bg") == 0;
+		if (argc < 2) {
+			fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+			raiseError();
+		}
+		nextToken(argc, argv);
+		char * filename = needNextToken();
+		// The output of a shard is named when merging the partial results,
+		// only BigWig shards are written as such
+		if (pool->partial) {
+			pool->rawValues = true;
+			pool->bigWigPartial = isBigWigFilename(filename);
+		}
+		else if (isTrackCacheFilename(filename)) {
+			fprintf(stderr, "wiggletools: track cache files cannot be written in multithreaded mode\n");
+			raiseError();
+		} else if (isIntegerTrackFilename(filename)) {
+			fprintf(stderr, "wiggletools: integer track files cannot be written in multithreaded mode\n");
+			raiseError();
+		} else {
+			output = openPoolOutput(pool, filename);
+			if (isBigWigFilename(filename)) {
+				pool->bigWig = openBigWigWriter(output);
+				pool->rawValues = true;
+			} else if (isBgzfFilename(filename)) {
+				// The writer takes over the file
+				pool->bgzf = openBgzfWriter(output, filename, pool->bedGraph);
+				output = NULL;
+			}
+		}
+	} else if (isStatistic(argv[0]))
+		pool->mode = SHARD_STATISTICS;
+	else if (strcmp(argv[0], "histogram") == 0) {
+		pool->mode = SHARD_HISTOGRAM;
+		if (argc < 4) {
+			fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+			raiseError();
+		}
+		nextToken(argc, argv);
+		if (!pool->partial)
+			output = openPoolOutput(pool, needNextToken());
+	} else if (strcmp(argv[0], "top") == 0) {
+		pool->mode = SHARD_TOP;
+		if (argc < 4) {
+			fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+			raiseError();
+		}
+		nextToken(argc, argv);
+		if (!pool->partial)
+			output = openPoolOutput(pool, needNextToken());
+	} else if (strcmp(argv[0], "apply_paste") == 0) {
+		// The regions which straddle two shards would be pasted twice
+		if (pool->partial) {
+			fprintf(stderr, "wiggletools: apply_paste cannot be run on a shard\n");
+			raiseError();
+		}
+		pool->mode = SHARD_PASTE;
+		if (argc < 2) {
+			fprintf(stderr, "wiggletools: Unexpected end of command line\n");
+			raiseError();
+		}
+		nextToken(argc, argv);
+		output = openPoolOutput(pool, needNextToken());
+	} else {
+		pool->mode = SHARD_WRITE;
+		pool->rawValues = pool->partial != NULL;
+	}
+
+	if (pool->strata && pool->mode != SHARD_STATISTICS && pool->mode != SHARD_HISTOGRAM) {
+		fprintf(stderr, "wiggletools: only statistics and histograms can be estimated from a sample\n");
+		raiseError();
+	}
+	if (pool->bigWigPartial)
+		writePartialBigWigHeader(pool->partial, pool->shardNumber);
+	else if (pool->partial && pool->mode == SHARD_WRITE)
+		writePartialTrackHeader(pool->partial, pool->shardNumber, pool->bedGraph);
+	if (checkpointFilename)
+		completed = startCheckpoints(pool, output, resumed);
+
+	if (threads > pool->count)
+		threads = pool->count;
+	threadIDs = (pthread_t *) calloc(threads, sizeof(pthread_t));
+	for (i = 0; i < threads; i++) {
+		int err = pthread_create(threadIDs + i, NULL, &runShards, pool);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			raiseError();
+		}
+	}
+
+	// Stitch results in order as they become available, 
+	// each stratum of a sample apart
+	for (i = completed; i < pool->count; i++) {
+		Shard * shard = pool->shards + i;
+		waitForShard(pool, shard);
+		if (pool->strata && (i == 0 || shard->stratum != shard[-1].stratum))
+			merged = shard;
+		if (shard->output && pool->bigWig)
+			copyShardValues(shard, pool->bigWig);
+		else if (shard->output && pool->bigWigPartial) {
+			writeBigWigPartialSection(pool->partial, shard->chrom, shard->chromId, shard->chromLength, shard->output);
+			fclose(shard->output);
+		} else if (shard->output && pool->partial) {
+			writePartialTrackSection(pool->partial, shard->chrom, shard->output);
+			fclose(shard->output);
+		} else if (shard->output)
+			copyShardOutput(shard, output, pool->bgzf);
+		else if (shard != merged && shard->statistics && pool->resumed && pool->resumed->hasPartial)
+			mergeStatistics(merged->statistics, reloadStatistics(shard->statistics));
+		else if (shard != merged && shard->statistics)
+			mergeStatistics(merged->statistics, shard->statistics);
+		else if (shard != merged && shard->histogram)
+			mergeHistograms(merged->histogram, shard->histogram);
+		else if (shard != merged && shard->top)
+			mergeTopRegions(merged->top, shard->top);
+		if (checkpointFilename)
+			writePoolCheckpoint(pool, output, i + 1);
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(threadIDs[i], NULL);
+	free(threadIDs);
+
+	if (pool->count && pool->mode == SHARD_STATISTICS && pool->partial) {
+		writePartialHeader(pool->partial, PARTIAL_STATISTICS);
+		dumpStatistics(pool->shards[0].statistics, pool->partial);
+	} else if (pool->count && pool->mode == SHARD_HISTOGRAM && pool->partial) {
+		writePartialHeader(pool->partial, PARTIAL_HISTOGRAM);
+		dumpHistogram(pool->shards[0].histogram, pool->partial);
+	} else if (pool->count && pool->mode == SHARD_TOP && pool->partial) {
+		writePartialHeader(pool->partial, PARTIAL_TOP);
+		dumpTopRegions(pool->shards[0].top, pool->partial);
+	} else if (pool->count && pool->mode == SHARD_STATISTICS && pool->strata)
+		printSampleStatistics(pool);
+	else if (pool->count && pool->mode == SHARD_HISTOGRAM && pool->strata)
+		printSampleHistogram(pool, output);
+	else if (pool->count && pool->mode == SHARD_STATISTICS)
+		runWiggleIterator(PrintStatisticsWiggleIterator(pool->shards[0].statistics, stdout));
+	else if (pool->count && pool->mode == SHARD_HISTOGRAM)
+		print_histogram(pool->shards[0].histogram, output);
+	else if (pool->count && pool->mode == SHARD_TOP)
+		printTopRegions(pool->shards[0].top, output);
+	else if (pool->bigWig)
+		finishBigWigWriter(pool->bigWig);
+	else if (pool->bgzf)
+		finishBgzfWriter(pool->bgzf);
+
+	if (output && output != stdout)
+		fclose(output);
+	// The run is complete
+	if (checkpointFilename)
+		remove(checkpointFilename);
+}
+
+void rollYourOwnInParallel(int argc, char ** argv, int threads, char * chromSizesFile) {
+	ShardPool * pool = (ShardPool *) calloc(1, sizeof(ShardPool));
+	pool->argc = argc;
+	pool->argv = argv;
+	pool->shards = readChromSizes(chromSizesFile, &pool->count);
+	runShardPool(pool, threads);
+}
+
+void rollYourOwnShard(int argc, char ** argv, int threads, char * chromSizesFile, int shard, int shards) {
+	ShardPool * pool = (ShardPool *) calloc(1, sizeof(ShardPool));
+
+	if (shard < 1 || shard > shards) {
+		fprintf(stderr, "wiggletools: invalid shard: %i/%i\n", shard, shards);
+		raiseError();
+	}
+	pool->argc = argc;
+	pool->argv = argv;
+	pool->shards = readGenomeShard(chromSizesFile, argc, argv, shard - 1, shards, &pool->count);
+	pool->partial = stdout;
+	pool->shardNumber = shard;
+	runShardPool(pool, threads);
+}
+
+void rollYourOwnSample(int argc, char ** argv, int threads, char * chromSizesFile, double fraction) {
+	ShardPool * pool = (ShardPool *) calloc(1, sizeof(ShardPool));
+	pool->argc = argc;
+	pool->argv = argv;
+	readGenomeSample(pool, chromSizesFile, fraction);
+	runShardPool(pool, threads);
 }
@@ -0,0 +1,167 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <gsl/gsl_cblas.h>
+
+#include "multiplexer.h"
+#include "memoryUsage.h"
+
+// Segments accumulated before each update of the co-moments
+#define CORRELATION_BATCH 512
+
+static int CORRELATION_THREADS = 1;
+
+void setCorrelationThreads(int value) {
+	if (value < 1) {
+		fprintf(stderr, "Number of correlation threads must be positive: %i\n", value);
+		raiseError();
+	}
+	CORRELATION_THREADS = value;
+}
+
+// Co-moments of all pairs of inputs, weighted by span length
+//
+// Each segment contributes sqrt(length) * (values - shift) as a row of
+// the batch W, shift being the values of the first segment, to avoid
+// cancellations. Each full batch updates the co-moments with W'W, a
+// rank-k update done by the BLAS, whose upper triangle is cut into column
+// blocks of equal areas for the threads.
+typedef struct correlationData_st {
+	int count;
+	double * shift;
+	double * batch;
+	int batchCount;
+	// Upper triangle of the sums of products, and sums, of the shifted values
+	double * products;
+	double * sums;
+	double span;
+} CorrelationData;
+
+typedef struct correlationBlock_st {
+	CorrelationData * data;
+	int start, finish;
+} CorrelationBlock;
+
+// Columns start to finish of the upper triangle
+static void * updateCorrelationBlock(void * args) {
+	CorrelationBlock * block = (CorrelationBlock *) args;
+	CorrelationData * data = block->data;
+	int width = block->finish - block->start;
+
+	if (width == 0)
+		return NULL;
+	// Above the diagonal block
+	if (block->start)
+		cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, block->start, width, data->batchCount, 1, data->batch, data->count, data->batch + block->start, data->count, 1, data->products + block->start, data->count);
+	cblas_dsyrk(CblasRowMajor, CblasUpper, CblasTrans, width, data->batchCount, 1, data->batch + block->start, data->count, 1, data->products + block->start * (data->count + 1), data->count);
+	return NULL;
+}
+
+static void flushCorrelationBatch(CorrelationData * data) {
+	int threads = CORRELATION_THREADS < data->count ? CORRELATION_THREADS : 1;
+	int i;
+
+	if (data->batchCount == 0)
+		return;
+
+	CorrelationBlock * blocks = (CorrelationBlock *) calloc(threads, sizeof(CorrelationBlock));
+	pthread_t * threadIDs = (pthread_t *) calloc(threads, sizeof(pthread_t));
+
+	// Column j holds j + 1 entries of the triangle
+	for (i = 0; i < threads; i++) {
+		blocks[i].data = data;
+		blocks[i].start = i ? blocks[i-1].finish : 0;
+		blocks[i].finish = i == threads - 1 ? data->count : (int) (data->count * sqrt((i + 1) / (double) threads));
+	}
+	for (i = 1; i < threads; i++) {
+		int err = pthread_create(&threadIDs[i], NULL, &updateCorrelationBlock, blocks + i);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			abort();
+		}
+	}
+	updateCorrelationBlock(blocks);
+	for (i = 1; i < threads; i++)
+		pthread_join(threadIDs[i], NULL);
+
+	free(blocks);
+	free(threadIDs);
+	data->batchCount = 0;
+}
+
+static void addCorrelationSegment(CorrelationData * data, Multiplexer * multi) {
+	double length = multi->finish - multi->start;
+	double weight = sqrt(length);
+	double * row = data->batch + data->batchCount * data->count;
+	int i;
+
+	if (data->span == 0)
+		for (i = 0; i < data->count; i++)
+			data->shift[i] = isfinite(multi->values[i]) ? multi->values[i] : 0;
+
+	for (i = 0; i < data->count; i++) {
+		double value = multi->values[i] - data->shift[i];
+		row[i] = weight * value;
+		data->sums[i] += length * value;
+	}
+	data->span += length;
+
+	if (++data->batchCount == CORRELATION_BATCH)
+		flushCorrelationBatch(data);
+}
+
+void printCorrelations(Multiplexer * multi, FILE * file) {
+	CorrelationData * data = (CorrelationData *) calloc(1, sizeof(CorrelationData));
+	int count = multi->count;
+	long long bytes = (count * (long long) count + count * (long long) CORRELATION_BATCH) * sizeof(double);
+	int i, j;
+
+	data->count = count;
+	data->shift = (double *) calloc(count, sizeof(double));
+	data->sums = (double *) calloc(count, sizeof(double));
+	data->batch = (double *) calloc(count * (size_t) CORRELATION_BATCH, sizeof(double));
+	data->products = (double *) calloc(count * (size_t) count, sizeof(double));
+	countMemory(MEMORY_REDUCERS, bytes);
+
+	for (; !multi->done; popMultiplexer(multi))
+		addCorrelationSegment(data, multi);
+	flushCorrelationBatch(data);
+
+	// Co-moments about the means, from the upper triangle
+	for (i = 0; i < count; i++)
+		for (j = i; j < count; j++)
+			data->products[i * count + j] -= data->sums[i] * data->sums[j] / data->span;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < count; j++) {
+			int low = i < j ? i : j;
+			int high = i < j ? j : i;
+			double product = data->products[low * count + low] * data->products[high * count + high];
+			double correlation = product > 0 ? data->products[low * count + high] / sqrt(product) : NAN;
+			fprintf(file, j ? "\t%f" : "%f", correlation);
+		}
+		fprintf(file, "\n");
+	}
+
+	countMemory(MEMORY_REDUCERS, -bytes);
+	free(data->shift);
+	free(data->sums);
+	free(data->batch);
+	free(data->products);
+	free(data);
+}
@@ -0,0 +1,1596 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "cramReader.h"
+
+//////////////////////////////////////////////////////
+// CRAM layout
+//
+// A CRAM file is a sequence of containers, each made of
+// a compression header, which gives the encoding of each
+// data series, and of slices. A slice holds a core block,
+// read bit by bit, and external blocks, read byte by byte,
+// each data series being encoded in one or the other.
+// Versions 2.1 and 3.x are read, the latter only differing
+// by checksums and the width of their record counters.
+//////////////////////////////////////////////////////
+
+#define CRAM_FILE_DEFINITION 26
+#define CRAM_FILE_BUFFER (1024 * 1024)
+// Container headers are read in one go, then parsed
+#define CRAM_CONTAINER_HEADER 1024
+#define CRAM_BLOCK_HEADER 17
+
+// Block compression methods
+#define CRAM_RAW 0
+#define CRAM_GZIP 1
+#define CRAM_RANS 4
+
+// Block content types
+#define CRAM_FILE_HEADER 0
+#define CRAM_SLICE_HEADER 2
+#define CRAM_EXTERNAL_DATA 4
+#define CRAM_CORE_DATA 5
+
+// Encodings
+#define CRAM_NULL_ENCODING 0
+#define CRAM_EXTERNAL 1
+#define CRAM_HUFFMAN 3
+#define CRAM_BYTE_ARRAY_LEN 4
+#define CRAM_BYTE_ARRAY_STOP 5
+#define CRAM_BETA 6
+#define CRAM_SUBEXP 7
+#define CRAM_GAMMA 9
+
+// CRAM flags of a record (CF)
+#define CRAM_QUALITY_ARRAY 0x1
+#define CRAM_DETACHED 0x2
+#define CRAM_MATE_DOWNSTREAM 0x4
+#define CRAM_NO_SEQUENCE 0x8
+
+// Multi-reference slices give the target of each record
+#define CRAM_MULTIPLE_REFERENCES -2
+
+// Data series, named by two letters in the compression header
+enum {
+	CRAM_BF, CRAM_CF, CRAM_RI, CRAM_RL, CRAM_AP, CRAM_RG, CRAM_RN, CRAM_MF, CRAM_NS, CRAM_NP, CRAM_TS, CRAM_NF, CRAM_TL,
+	CRAM_FN, CRAM_FC, CRAM_FP, CRAM_DL, CRAM_BB, CRAM_QQ, CRAM_BS, CRAM_IN, CRAM_RS, CRAM_PD, CRAM_HC, CRAM_SC, CRAM_MQ,
+	CRAM_BA, CRAM_QS, CRAM_SERIES
+};
+static const char * seriesNames = "BFCFRIRLAPRGRNMFNSNPTSNFTLFNFCFPDLBBQQBSINRSPDHCSCMQBAQS";
+
+// Read groups, names, bases and qualities do not place reads on the genome:
+// they are skipped when their blocks hold nothing else
+static bool isOptionalSeries(int series) {
+	return series == CRAM_RG || series == CRAM_RN || series == CRAM_QQ || series == CRAM_BS || series == CRAM_BA || series == CRAM_QS;
+}
+
+// Series of single bytes, which can be skipped over in an external block
+static bool isByteSeries(int series) {
+	return series == CRAM_BS || series == CRAM_BA || series == CRAM_QS;
+}
+
+//////////////////////////////////////////////////////
+// Data structures
+//////////////////////////////////////////////////////
+
+// Reads through a buffer. Reads past its end return zeros and set the
+// overrun flag, which is checked after each record.
+typedef struct cramCursor_st {
+	const unsigned char * data;
+	int size, position;
+	// Next bit of the current byte, for the core block
+	int bit;
+	bool overrun;
+} CramCursor;
+
+typedef struct cramCodec_st {
+	int encoding;
+	// EXTERNAL and BYTE_ARRAY_STOP, index of the block among those of the compression header
+	int block;
+	int stop;
+	// BETA, SUBEXP and GAMMA
+	int offset, bits;
+	// HUFFMAN, canonical codes sorted by length then symbol, with their
+	// lengths and the index past the last code of the same length
+	int symbolCount;
+	int * symbols, * lengths, * ends;
+	unsigned int * codes;
+	// BYTE_ARRAY_LEN
+	struct cramCodec_st * lengthCodec, * valueCodec;
+} CramCodec;
+
+typedef struct cramCompression_st {
+	// Offset of the container, -1 if none is parsed
+	long long container;
+	bool readNames, deltaPositions;
+	CramCodec * series[CRAM_SERIES];
+	bool skipped[CRAM_SERIES];
+	// Tags by id, then the tags of each tag line as indices among them
+	int tagCount;
+	int * tagIds;
+	CramCodec ** tagCodecs;
+	bool * tagsSkipped;
+	int lineCount;
+	int * lineStarts, * lineTags;
+	// Content ids of the external blocks, and whether they are read rather than skipped
+	int blockCount, blockCapacity;
+	int * contentIds;
+	bool * blocksRead;
+} CramCompression;
+
+typedef struct cramContainer_st {
+	// Offsets of the container and of its first block
+	long long offset, body;
+	int length;
+	int recordCount;
+	int landmarkCount;
+	int * landmarks;
+} CramContainer;
+
+typedef struct cramBlock_st {
+	int method, contentType, contentId;
+	int size, rawSize;
+	// Offset of the data in the file, and of the next block
+	long long offset, next;
+	unsigned char * data;
+	bool present, loaded;
+	CramCursor cursor;
+} CramBlock;
+
+typedef struct cramRecord_st {
+	int tid, pos, end, flag, mapq;
+	// Template length, INT_MIN until worked out from the mates
+	int tlen;
+	// Next segment of the template in the slice, -1 if none
+	int mate;
+	int cigar, cigarCount;
+} CramRecord;
+
+typedef struct cramIndexEntry_st {
+	int tid, start, span;
+	long long container;
+	int slice;
+} CramIndexEntry;
+
+struct cramIterator_st {
+	int tid, beg, end;
+	// Slices overlapping the region, in file order
+	int count, next;
+	long long * containers;
+	int * slices;
+	bool done;
+};
+
+struct cramFile_st {
+	char * filename;
+	FILE * file;
+	int major;
+	bam_header_t * header;
+	// Container in hand, and where the next one starts when reading through the file
+	CramContainer container;
+	int nextSlice;
+	long long nextContainer;
+	CramCompression compression;
+	// Blocks of the slice in hand, one for each content id of the compression header
+	CramBlock * blocks;
+	int blockCapacity;
+	CramBlock core;
+	// Records of the slice in hand
+	CramRecord * records;
+	int recordCount, recordCapacity, nextRecord;
+	uint32_t * cigar;
+	int cigarCount, cigarCapacity;
+	// Slices of the .crai index
+	CramIndexEntry * index;
+	int indexCount;
+	bool indexed;
+};
+
+static void invalidCram(CramFile * cram, const char * message) {
+	fprintf(stderr, "Invalid CRAM file %s: %s\n", cram->filename, message);
+	raiseError();
+}
+
+//////////////////////////////////////////////////////
+// Cursors
+//////////////////////////////////////////////////////
+
+static void setCursor(CramCursor * cursor, const unsigned char * data, int size) {
+	cursor->data = data;
+	cursor->size = size;
+	cursor->position = 0;
+	cursor->bit = 7;
+	cursor->overrun = false;
+}
+
+static int cursorByte(CramCursor * cursor) {
+	if (cursor->position >= cursor->size) {
+		cursor->overrun = true;
+		return 0;
+	}
+	return cursor->data[cursor->position++];
+}
+
+static unsigned int cursorInt32(CramCursor * cursor) {
+	unsigned int value = cursorByte(cursor);
+	value |= cursorByte(cursor) << 8;
+	value |= cursorByte(cursor) << 16;
+	return value | (unsigned int) cursorByte(cursor) << 24;
+}
+
+// Integers of 1 to 5 bytes, the number of leading 1 bits of the first
+// byte telling how many bytes follow
+static int cursorItf8(CramCursor * cursor) {
+	unsigned int first = cursorByte(cursor);
+	unsigned int value;
+
+	if (first < 0x80)
+		return first;
+	else if (first < 0xC0)
+		return ((first & 0x3F) << 8) | cursorByte(cursor);
+	else if (first < 0xE0) {
+		value = (first & 0x1F) << 16;
+		value |= cursorByte(cursor) << 8;
+		return value | cursorByte(cursor);
+	} else if (first < 0xF0) {
+		value = (first & 0x0F) << 24;
+		value |= cursorByte(cursor) << 16;
+		value |= cursorByte(cursor) << 8;
+		return value | cursorByte(cursor);
+	} else {
+		value = (first & 0x0F) << 28;
+		value |= cursorByte(cursor) << 20;
+		value |= cursorByte(cursor) << 12;
+		value |= cursorByte(cursor) << 4;
+		return (int) (value | (cursorByte(cursor) & 0x0F));
+	}
+}
+
+// Integers of 1 to 9 bytes, likewise
+static long long cursorLtf8(CramCursor * cursor) {
+	unsigned int first = cursorByte(cursor);
+	unsigned long long value;
+	int count, bit;
+
+	if (first == 0xFF)
+		count = 8;
+	else
+		for (count = 0, bit = 0x80; first & bit; bit >>= 1)
+			count++;
+	value = count < 7 ? first & (0xFF >> (count + 1)) : 0;
+	while (count--)
+		value = (value << 8) | cursorByte(cursor);
+	return (long long) value;
+}
+
+static int cursorBit(CramCursor * cursor) {
+	int value;
+
+	if (cursor->position >= cursor->size) {
+		cursor->overrun = true;
+		return 0;
+	}
+	value = (cursor->data[cursor->position] >> cursor->bit) & 1;
+	if (cursor->bit-- == 0) {
+		cursor->bit = 7;
+		cursor->position++;
+	}
+	return value;
+}
+
+static unsigned int cursorBits(CramCursor * cursor, int count) {
+	unsigned int value = 0;
+	while (count--)
+		value = (value << 1) | cursorBit(cursor);
+	return value;
+}
+
+//////////////////////////////////////////////////////
+// rANS decompression
+//
+// Blocks compressed with the 4x8 rANS codec of CRAM 3
+// are decoded from four interleaved states, with 12-bit
+// frequencies of order 0, or of order 1 given the
+// previous byte of each of four quarters of the output.
+//////////////////////////////////////////////////////
+
+#define RANS_SHIFT 12
+#define RANS_TOTAL (1 << RANS_SHIFT)
+#define RANS_LOW (1u << 23)
+
+// Frequencies of a table, run length encoded over consecutive symbols
+static bool readRansFrequencies(CramCursor * cursor, int * frequencies, int * cumulative, unsigned char * lookup) {
+	int symbol = cursorByte(cursor);
+	int run = 0, total = 0, frequency;
+
+	do {
+		if ((frequency = cursorByte(cursor)) >= 128)
+			frequency = ((frequency & 127) << 8) | cursorByte(cursor);
+		if (total + frequency > RANS_TOTAL)
+			return false;
+		frequencies[symbol] = frequency;
+		cumulative[symbol] = total;
+		memset(lookup + total, symbol, frequency);
+		total += frequency;
+
+		if (!run && cursor->position < cursor->size && symbol + 1 == cursor->data[cursor->position]) {
+			symbol = cursorByte(cursor);
+			run = cursorByte(cursor);
+		} else if (run) {
+			run--;
+			symbol++;
+		} else
+			symbol = cursorByte(cursor);
+	} while (symbol && symbol < 256 && !cursor->overrun);
+	return symbol == 0 && !cursor->overrun;
+}
+
+static void renormalizeRans(CramCursor * cursor, unsigned int * state) {
+	while (*state < RANS_LOW)
+		*state = (*state << 8) | cursorByte(cursor);
+}
+
+static unsigned char decodeRans(CramCursor * cursor, unsigned int * state, int * frequencies, int * cumulative, unsigned char * lookup) {
+	unsigned int slot = *state & (RANS_TOTAL - 1);
+	unsigned char symbol = lookup[slot];
+	*state = frequencies[symbol] * (*state >> RANS_SHIFT) + slot - cumulative[symbol];
+	renormalizeRans(cursor, state);
+	return symbol;
+}
+
+static bool decodeRansOrder0(CramCursor * cursor, unsigned char * out, int size) {
+	int frequencies[256], cumulative[256];
+	unsigned char lookup[RANS_TOTAL];
+	unsigned int states[4];
+	int i, j, last = size & ~3;
+
+	if (!readRansFrequencies(cursor, frequencies, cumulative, lookup))
+		return false;
+	for (j = 0; j < 4; j++)
+		states[j] = cursorInt32(cursor);
+	for (i = 0; i < last; i += 4)
+		for (j = 0; j < 4; j++)
+			out[i + j] = decodeRans(cursor, states + j, frequencies, cumulative, lookup);
+	// The last bytes come from the final states
+	for (j = 0; i + j < size; j++)
+		out[i + j] = lookup[states[j] & (RANS_TOTAL - 1)];
+	return !cursor->overrun;
+}
+
+static bool decodeRansOrder1(CramCursor * cursor, unsigned char * out, int size) {
+	int * frequencies = (int *) calloc(256 * 256, sizeof(int));
+	int * cumulative = (int *) calloc(256 * 256, sizeof(int));
+	unsigned char * lookup = (unsigned char *) calloc(256, RANS_TOTAL);
+	int context = cursorByte(cursor), run = 0;
+	int contexts[4] = {0, 0, 0, 0};
+	int positions[4];
+	unsigned int states[4];
+	int quarter = size >> 2;
+	int i, j;
+	bool valid = true;
+
+	do {
+		if (!(valid = readRansFrequencies(cursor, frequencies + context * 256, cumulative + context * 256, lookup + context * RANS_TOTAL)))
+			break;
+		if (!run && cursor->position < cursor->size && context + 1 == cursor->data[cursor->position]) {
+			context = cursorByte(cursor);
+			run = cursorByte(cursor);
+		} else if (run) {
+			run--;
+			context++;
+		} else
+			context = cursorByte(cursor);
+	} while (context && context < 256 && !cursor->overrun);
+	valid = valid && context == 0;
+
+	if (valid) {
+		for (j = 0; j < 4; j++) {
+			states[j] = cursorInt32(cursor);
+			positions[j] = j * quarter;
+		}
+		for (i = 0; i < quarter; i++)
+			for (j = 0; j < 4; j++) {
+				int c = contexts[j];
+				contexts[j] = out[positions[j]++] = decodeRans(cursor, states + j, frequencies + c * 256, cumulative + c * 256, lookup + c * RANS_TOTAL);
+			}
+		// The last quarter takes the remainder
+		while (positions[3] < size) {
+			int c = contexts[3];
+			contexts[3] = out[positions[3]++] = decodeRans(cursor, states + 3, frequencies + c * 256, cumulative + c * 256, lookup + c * RANS_TOTAL);
+		}
+	}
+
+	free(frequencies);
+	free(cumulative);
+	free(lookup);
+	return valid && !cursor->overrun;
+}
+
+static bool decompressRans(const unsigned char * in, int inSize, unsigned char * out, int outSize) {
+	CramCursor cursor;
+	int order;
+
+	setCursor(&cursor, in, inSize);
+	order = cursorByte(&cursor);
+	cursorInt32(&cursor);
+	if ((int) cursorInt32(&cursor) != outSize)
+		return false;
+	if (outSize == 0)
+		return true;
+	return order ? decodeRansOrder1(&cursor, out, outSize) : decodeRansOrder0(&cursor, out, outSize);
+}
+
+//////////////////////////////////////////////////////
+// Blocks
+//////////////////////////////////////////////////////
+
+static size_t readAt(CramFile * cram, long long offset, void * buffer, size_t size) {
+	if (fseeko(cram->file, offset, SEEK_SET))
+		return 0;
+	return fread(buffer, 1, size, cram->file);
+}
+
+static bool readBlockHeader(CramFile * cram, long long offset, CramBlock * block) {
+	unsigned char header[CRAM_BLOCK_HEADER];
+	CramCursor cursor;
+
+	setCursor(&cursor, header, readAt(cram, offset, header, CRAM_BLOCK_HEADER));
+	block->method = cursorByte(&cursor);
+	block->contentType = cursorByte(&cursor);
+	block->contentId = cursorItf8(&cursor);
+	block->size = cursorItf8(&cursor);
+	block->rawSize = cursorItf8(&cursor);
+	if (cursor.overrun || block->size < 0 || block->rawSize < 0)
+		return false;
+	block->offset = offset + cursor.position;
+	// Blocks end with a CRC32 since CRAM 3
+	block->next = block->offset + block->size + (cram->major >= 3 ? 4 : 0);
+	block->present = true;
+	return true;
+}
+
+static void loadBlock(CramFile * cram, CramBlock * block) {
+	unsigned char * compressed;
+	int position = block->cursor.position;
+	bool valid = true;
+	z_stream stream;
+
+	block->loaded = true;
+	if (!block->present) {
+		// Series which no record of the slice uses
+		setCursor(&block->cursor, NULL, 0);
+		return;
+	}
+
+	compressed = (unsigned char *) malloc(block->size + 1);
+	if (readAt(cram, block->offset, compressed, block->size) != block->size)
+		invalidCram(cram, "truncated block");
+
+	if (block->method == CRAM_RAW) {
+		block->data = compressed;
+		block->rawSize = block->size;
+	} else {
+		block->data = (unsigned char *) malloc(block->rawSize + 1);
+		if (block->method == CRAM_GZIP) {
+			memset(&stream, 0, sizeof(z_stream));
+			stream.next_in = compressed;
+			stream.avail_in = block->size;
+			stream.next_out = block->data;
+			stream.avail_out = block->rawSize;
+			valid = inflateInit2(&stream, 15 + 32) == Z_OK && inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == block->rawSize;
+			inflateEnd(&stream);
+		} else if (block->method == CRAM_RANS)
+			valid = decompressRans(compressed, block->size, block->data, block->rawSize);
+		else {
+			fprintf(stderr, "Cannot read CRAM file %s: blocks compressed with method %i are not supported, only raw, gzip and rANS (4x8)\n", cram->filename, block->method);
+			raiseError();
+		}
+		free(compressed);
+		if (!valid)
+			invalidCram(cram, "corrupted block");
+	}
+
+	setCursor(&block->cursor, block->data, block->rawSize);
+	// Fixed width values may have been skipped over before the block was needed
+	block->cursor.position = position;
+}
+
+static void clearBlock(CramBlock * block) {
+	free(block->data);
+	memset(block, 0, sizeof(CramBlock));
+}
+
+static CramCursor * blockCursor(CramFile * cram, CramBlock * block) {
+	if (!block->loaded)
+		loadBlock(cram, block);
+	return &block->cursor;
+}
+
+//////////////////////////////////////////////////////
+// Codecs
+//////////////////////////////////////////////////////
+
+static int blockSlot(CramCompression * compression, int contentId) {
+	int i;
+	for (i = 0; i < compression->blockCount; i++)
+		if (compression->contentIds[i] == contentId)
+			return i;
+	if (compression->blockCount == compression->blockCapacity) {
+		compression->blockCapacity = compression->blockCapacity ? 2 * compression->blockCapacity : 32;
+		compression->contentIds = (int *) realloc(compression->contentIds, compression->blockCapacity * sizeof(int));
+		compression->blocksRead = (bool *) realloc(compression->blocksRead, compression->blockCapacity * sizeof(bool));
+	}
+	compression->contentIds[compression->blockCount] = contentId;
+	compression->blocksRead[compression->blockCount] = false;
+	return compression->blockCount++;
+}
+
+static int compareHuffmanCodes(const void * A, const void * B) {
+	const int * a = (const int *) A, * b = (const int *) B;
+	return a[1] != b[1] ? a[1] - b[1] : a[0] - b[0];
+}
+
+static void buildHuffmanCodes(CramFile * cram, CramCodec * codec) {
+	int count = codec->symbolCount;
+	int * pairs = (int *) malloc(2 * count * sizeof(int));
+	unsigned int code = 0;
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		pairs[2 * i] = codec->symbols[i];
+		pairs[2 * i + 1] = codec->lengths[i];
+		if (codec->lengths[i] < 0 || codec->lengths[i] > 31)
+			invalidCram(cram, "Huffman code too long");
+	}
+	qsort(pairs, count, 2 * sizeof(int), compareHuffmanCodes);
+
+	codec->codes = (unsigned int *) malloc(count * sizeof(unsigned int));
+	codec->ends = (int *) malloc(count * sizeof(int));
+	for (i = 0; i < count; i++) {
+		codec->symbols[i] = pairs[2 * i];
+		if (i > 0)
+			code = (code + 1) << (pairs[2 * i + 1] - codec->lengths[i - 1]);
+		codec->lengths[i] = pairs[2 * i + 1];
+		codec->codes[i] = code;
+	}
+	for (i = 0; i < count; i = j) {
+		for (j = i; j < count && codec->lengths[j] == codec->lengths[i]; j++)
+			;
+		codec->ends[i] = j;
+	}
+	free(pairs);
+}
+
+static CramCodec * readCodec(CramFile * cram, CramCompression * compression, CramCursor * cursor) {
+	CramCodec * codec = (CramCodec *) calloc(1, sizeof(CramCodec));
+	CramCursor parameters;
+	int size, i;
+
+	codec->encoding = cursorItf8(cursor);
+	size = cursorItf8(cursor);
+	if (size < 0 || cursor->position + size > cursor->size)
+		invalidCram(cram, "truncated compression header");
+	setCursor(&parameters, cursor->data + cursor->position, size);
+	cursor->position += size;
+
+	switch (codec->encoding) {
+		case CRAM_NULL_ENCODING:
+			break;
+		case CRAM_EXTERNAL:
+			codec->block = blockSlot(compression, cursorItf8(&parameters));
+			break;
+		case CRAM_HUFFMAN:
+			codec->symbolCount = cursorItf8(&parameters);
+			if (codec->symbolCount < 1 || codec->symbolCount > size)
+				invalidCram(cram, "invalid Huffman code");
+			codec->symbols = (int *) malloc(codec->symbolCount * sizeof(int));
+			codec->lengths = (int *) malloc(codec->symbolCount * sizeof(int));
+			for (i = 0; i < codec->symbolCount; i++)
+				codec->symbols[i] = cursorItf8(&parameters);
+			if (cursorItf8(&parameters) != codec->symbolCount)
+				invalidCram(cram, "invalid Huffman code");
+			for (i = 0; i < codec->symbolCount; i++)
+				codec->lengths[i] = cursorItf8(&parameters);
+			buildHuffmanCodes(cram, codec);
+			break;
+		case CRAM_BYTE_ARRAY_LEN:
+			codec->lengthCodec = readCodec(cram, compression, &parameters);
+			codec->valueCodec = readCodec(cram, compression, &parameters);
+			break;
+		case CRAM_BYTE_ARRAY_STOP:
+			codec->stop = cursorByte(&parameters);
+			codec->block = blockSlot(compression, cursorItf8(&parameters));
+			break;
+		case CRAM_BETA:
+		case CRAM_SUBEXP:
+			codec->offset = cursorItf8(&parameters);
+			codec->bits = cursorItf8(&parameters);
+			if (codec->bits < 0 || codec->bits > 32)
+				invalidCram(cram, "invalid encoding parameters");
+			break;
+		case CRAM_GAMMA:
+			codec->offset = cursorItf8(&parameters);
+			break;
+		default:
+			fprintf(stderr, "Cannot read CRAM file %s: encoding %i is not supported\n", cram->filename, codec->encoding);
+			raiseError();
+	}
+	if (parameters.overrun)
+		invalidCram(cram, "truncated encoding parameters");
+	return codec;
+}
+
+static void freeCodec(CramCodec * codec) {
+	if (!codec)
+		return;
+	freeCodec(codec->lengthCodec);
+	freeCodec(codec->valueCodec);
+	free(codec->symbols);
+	free(codec->lengths);
+	free(codec->ends);
+	free(codec->codes);
+	free(codec);
+}
+
+static int decodeHuffman(CramFile * cram, CramCodec * codec) {
+	CramCursor * core = &cram->core.cursor;
+	unsigned int code = 0;
+	int i, length = 0;
+
+	// A single symbol takes no bits
+	if (codec->lengths[0] == 0)
+		return codec->symbols[0];
+	for (i = 0; i < codec->symbolCount && !core->overrun; i = codec->ends[i]) {
+		while (length < codec->lengths[i]) {
+			code = (code << 1) | cursorBit(core);
+			length++;
+		}
+		// Codes of a same length are consecutive
+		if (code >= codec->codes[i] && code - codec->codes[i] < codec->ends[i] - i)
+			return codec->symbols[i + code - codec->codes[i]];
+	}
+	core->overrun = true;
+	return 0;
+}
+
+static int decodeSubexp(CramCursor * core, CramCodec * codec) {
+	int ones = 0, bits;
+	unsigned int value;
+
+	while (cursorBit(core) && !core->overrun)
+		ones++;
+	bits = ones ? ones + codec->bits - 1 : codec->bits;
+	value = cursorBits(core, bits);
+	if (ones)
+		value += 1u << bits;
+	return (int) value - codec->offset;
+}
+
+static int decodeGamma(CramCursor * core, CramCodec * codec) {
+	int zeros = 0;
+
+	while (!cursorBit(core) && !core->overrun)
+		zeros++;
+	return (int) ((1u << zeros) | cursorBits(core, zeros)) - codec->offset;
+}
+
+// Integers, or single bytes if byte is true
+static int decodeValue(CramFile * cram, CramCodec * codec, bool byte) {
+	CramCursor * cursor;
+
+	switch (codec->encoding) {
+		case CRAM_EXTERNAL:
+			cursor = blockCursor(cram, cram->blocks + codec->block);
+			return byte ? cursorByte(cursor) : cursorItf8(cursor);
+		case CRAM_HUFFMAN:
+			return decodeHuffman(cram, codec);
+		case CRAM_BETA:
+			return (int) cursorBits(&cram->core.cursor, codec->bits) - codec->offset;
+		case CRAM_SUBEXP:
+			return decodeSubexp(&cram->core.cursor, codec);
+		case CRAM_GAMMA:
+			return decodeGamma(&cram->core.cursor, codec);
+		default:
+			invalidCram(cram, "values cannot be read with this encoding");
+	}
+	return 0;
+}
+
+static CramCodec * seriesCodec(CramFile * cram, int series) {
+	CramCodec * codec = cram->compression.series[series];
+	if (!codec) {
+		fprintf(stderr, "Invalid CRAM file %s: no encoding for data series %.2s\n", cram->filename, seriesNames + 2 * series);
+		raiseError();
+	}
+	return codec;
+}
+
+static int decodeSeries(CramFile * cram, int series) {
+	return decodeValue(cram, seriesCodec(cram, series), false);
+}
+
+// Bytes in external blocks are skipped over without reading the block
+static void skipBytes(CramFile * cram, CramCodec * codec, int count) {
+	if (codec->encoding == CRAM_EXTERNAL)
+		cram->blocks[codec->block].cursor.position += count;
+	else
+		while (count-- > 0)
+			decodeValue(cram, codec, true);
+}
+
+// Returns the length of the array
+static int skipByteArray(CramFile * cram, CramCodec * codec) {
+	CramCursor * cursor;
+	int length;
+
+	switch (codec->encoding) {
+		case CRAM_BYTE_ARRAY_LEN:
+			length = decodeValue(cram, codec->lengthCodec, false);
+			if (length < 0)
+				invalidCram(cram, "negative array length");
+			skipBytes(cram, codec->valueCodec, length);
+			return length;
+		case CRAM_BYTE_ARRAY_STOP:
+			cursor = blockCursor(cram, cram->blocks + codec->block);
+			for (length = 0; cursorByte(cursor) != codec->stop && !cursor->overrun; length++)
+				;
+			return length;
+		default:
+			invalidCram(cram, "arrays cannot be read with this encoding");
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////
+// Skipped data series
+//
+// A series which does not place reads is skipped, i.e.
+// not even decoded, unless it reads the core block, or
+// shares an external block with a series which is. Its
+// blocks are then neither read nor decompressed. Series
+// of bytes of a known length are skipped over, so their
+// blocks need not be read either.
+//////////////////////////////////////////////////////
+
+static void markReadBlocks(CramCompression * compression, CramCodec * codec, bool fixedWidth) {
+	if (!codec)
+		return;
+	else if (codec->encoding == CRAM_EXTERNAL && !fixedWidth)
+		compression->blocksRead[codec->block] = true;
+	else if (codec->encoding == CRAM_BYTE_ARRAY_STOP)
+		compression->blocksRead[codec->block] = true;
+	else if (codec->encoding == CRAM_BYTE_ARRAY_LEN) {
+		markReadBlocks(compression, codec->lengthCodec, false);
+		markReadBlocks(compression, codec->valueCodec, true);
+	}
+}
+
+static bool readsCore(CramCodec * codec) {
+	switch (codec->encoding) {
+		case CRAM_NULL_ENCODING:
+		case CRAM_EXTERNAL:
+		case CRAM_BYTE_ARRAY_STOP:
+			return false;
+		case CRAM_BYTE_ARRAY_LEN:
+			return readsCore(codec->lengthCodec) || readsCore(codec->valueCodec);
+		case CRAM_HUFFMAN:
+			return codec->lengths[0] != 0;
+		default:
+			return true;
+	}
+}
+
+static bool sharesBlocks(CramCompression * compression, CramCodec * codec) {
+	if (codec->encoding == CRAM_EXTERNAL || codec->encoding == CRAM_BYTE_ARRAY_STOP)
+		return compression->blocksRead[codec->block];
+	else if (codec->encoding == CRAM_BYTE_ARRAY_LEN)
+		return sharesBlocks(compression, codec->lengthCodec) || sharesBlocks(compression, codec->valueCodec);
+	return false;
+}
+
+// Returns true if the series is decoded after all
+static bool keepSeries(CramCompression * compression, CramCodec * codec, bool * skipped, bool fixedWidth) {
+	if (!*skipped || !codec || !(readsCore(codec) || sharesBlocks(compression, codec)))
+		return false;
+	*skipped = false;
+	markReadBlocks(compression, codec, fixedWidth);
+	return true;
+}
+
+static void chooseSkippedSeries(CramCompression * compression) {
+	bool kept;
+	int i;
+
+	for (i = 0; i < CRAM_SERIES; i++) {
+		compression->skipped[i] = isOptionalSeries(i);
+		if (!compression->skipped[i])
+			markReadBlocks(compression, compression->series[i], false);
+	}
+	for (i = 0; i < compression->tagCount; i++)
+		compression->tagsSkipped[i] = true;
+
+	// Series kept for their blocks may in turn share blocks with others
+	do {
+		kept = false;
+		for (i = 0; i < CRAM_SERIES; i++)
+			kept |= keepSeries(compression, compression->series[i], compression->skipped + i, isByteSeries(i));
+		for (i = 0; i < compression->tagCount; i++)
+			kept |= keepSeries(compression, compression->tagCodecs[i], compression->tagsSkipped + i, false);
+	} while (kept);
+}
+
+//////////////////////////////////////////////////////
+// Compression headers
+//////////////////////////////////////////////////////
+
+static void clearCompression(CramCompression * compression) {
+	int i;
+
+	for (i = 0; i < CRAM_SERIES; i++)
+		freeCodec(compression->series[i]);
+	for (i = 0; i < compression->tagCount; i++)
+		freeCodec(compression->tagCodecs[i]);
+	free(compression->tagIds);
+	free(compression->tagCodecs);
+	free(compression->tagsSkipped);
+	free(compression->lineStarts);
+	free(compression->lineTags);
+	free(compression->contentIds);
+	free(compression->blocksRead);
+	memset(compression, 0, sizeof(CramCompression));
+	compression->container = -1;
+}
+
+static int tagIndex(CramCompression * compression, int id) {
+	int i;
+	for (i = 0; i < compression->tagCount; i++)
+		if (compression->tagIds[i] == id)
+			return i;
+	return -1;
+}
+
+// The tag dictionary lists the tags of each tag line, three bytes per tag, each line ending with a 0
+static void readTagDictionary(CramFile * cram, CramCompression * compression, const unsigned char * dictionary, int length) {
+	int i, count = 0, lineCount = 0;
+
+	for (i = 0; i < length; i++)
+		if (dictionary[i] == 0)
+			lineCount++;
+	compression->lineStarts = (int *) calloc(lineCount + 1, sizeof(int));
+	compression->lineTags = (int *) calloc(length / 3 + 1, sizeof(int));
+	for (i = 0; i < length; ) {
+		if (dictionary[i] == 0) {
+			compression->lineStarts[++compression->lineCount] = count;
+			i++;
+		} else if (i + 3 <= length) {
+			// Resolved into tag indices once the tag encodings are read
+			compression->lineTags[count++] = (dictionary[i] << 16) | (dictionary[i + 1] << 8) | dictionary[i + 2];
+			i += 3;
+		} else
+			invalidCram(cram, "invalid tag dictionary");
+	}
+}
+
+static void readCompressionHeader(CramFile * cram, CramBlock * block) {
+	CramCompression * compression = &cram->compression;
+	CramCursor * cursor = blockCursor(cram, block);
+	const unsigned char * dictionary = NULL;
+	int dictionaryLength = 0;
+	int count, i, series;
+	char key[2];
+
+	compression->readNames = true;
+	compression->deltaPositions = true;
+
+	// Preservation map
+	cursorItf8(cursor);
+	count = cursorItf8(cursor);
+	for (i = 0; i < count && !cursor->overrun; i++) {
+		key[0] = cursorByte(cursor);
+		key[1] = cursorByte(cursor);
+		if (!strncmp(key, "RN", 2))
+			compression->readNames = cursorByte(cursor);
+		else if (!strncmp(key, "AP", 2))
+			compression->deltaPositions = cursorByte(cursor);
+		else if (!strncmp(key, "RR", 2))
+			cursorByte(cursor);
+		else if (!strncmp(key, "SM", 2))
+			cursor->position += 5;
+		else if (!strncmp(key, "TD", 2)) {
+			dictionaryLength = cursorItf8(cursor);
+			dictionary = cursor->data + cursor->position;
+			cursor->position += dictionaryLength;
+			if (dictionaryLength < 0 || cursor->position > cursor->size)
+				invalidCram(cram, "truncated tag dictionary");
+		} else
+			invalidCram(cram, "unknown preservation key");
+	}
+
+	// Data series encodings, unknown series are ignored
+	cursorItf8(cursor);
+	count = cursorItf8(cursor);
+	for (i = 0; i < count && !cursor->overrun; i++) {
+		CramCodec * codec;
+		key[0] = cursorByte(cursor);
+		key[1] = cursorByte(cursor);
+		codec = readCodec(cram, compression, cursor);
+		for (series = 0; series < CRAM_SERIES && strncmp(key, seriesNames + 2 * series, 2); series++)
+			;
+		if (series < CRAM_SERIES && !compression->series[series])
+			compression->series[series] = codec;
+		else
+			freeCodec(codec);
+	}
+
+	// Tag encodings
+	cursorItf8(cursor);
+	count = cursorItf8(cursor);
+	if (count < 0 || count > cursor->size)
+		invalidCram(cram, "invalid tag encodings");
+	compression->tagIds = (int *) calloc(count + 1, sizeof(int));
+	compression->tagCodecs = (CramCodec **) calloc(count + 1, sizeof(CramCodec *));
+	compression->tagsSkipped = (bool *) calloc(count + 1, sizeof(bool));
+	for (i = 0; i < count && !cursor->overrun; i++) {
+		compression->tagIds[i] = cursorItf8(cursor);
+		compression->tagCodecs[i] = readCodec(cram, compression, cursor);
+		compression->tagCount++;
+	}
+	if (cursor->overrun)
+		invalidCram(cram, "truncated compression header");
+
+	// Without a dictionary, the records have a single line of no tags
+	if (dictionary)
+		readTagDictionary(cram, compression, dictionary, dictionaryLength);
+	else
+		readTagDictionary(cram, compression, (const unsigned char *) "", 1);
+	for (i = 0; i < compression->lineStarts[compression->lineCount]; i++)
+		if ((compression->lineTags[i] = tagIndex(compression, compression->lineTags[i])) < 0)
+			invalidCram(cram, "no encoding for a tag of the dictionary");
+
+	chooseSkippedSeries(compression);
+}
+
+//////////////////////////////////////////////////////
+// Containers
+//////////////////////////////////////////////////////
+
+// Returns false at the end of the file
+static bool readContainer(CramFile * cram, long long offset, CramContainer * container) {
+	unsigned char header[CRAM_CONTAINER_HEADER];
+	size_t length = readAt(cram, offset, header, CRAM_CONTAINER_HEADER);
+	CramCursor cursor;
+	int i;
+
+	if (length < 4)
+		return false;
+	setCursor(&cursor, header, length);
+	container->offset = offset;
+	container->length = cursorInt32(&cursor);
+	cursorItf8(&cursor);
+	cursorItf8(&cursor);
+	cursorItf8(&cursor);
+	container->recordCount = cursorItf8(&cursor);
+	if (cram->major >= 3)
+		cursorLtf8(&cursor);
+	else
+		cursorItf8(&cursor);
+	cursorLtf8(&cursor);
+	cursorItf8(&cursor);
+	container->landmarkCount = cursorItf8(&cursor);
+	if (container->landmarkCount < 0 || container->landmarkCount > CRAM_CONTAINER_HEADER)
+		invalidCram(cram, "invalid container header");
+	container->landmarks = (int *) realloc(container->landmarks, (container->landmarkCount + 1) * sizeof(int));
+	for (i = 0; i < container->landmarkCount; i++)
+		container->landmarks[i] = cursorItf8(&cursor);
+	if (cram->major >= 3)
+		cursorInt32(&cursor);
+	if (cursor.overrun || container->length < 0)
+		invalidCram(cram, "truncated container header");
+	container->body = offset + cursor.position;
+	return true;
+}
+
+// Reads the compression header, unless the container is already in hand
+static bool loadContainer(CramFile * cram, long long offset) {
+	CramBlock block;
+
+	if (cram->compression.container == offset)
+		return true;
+	if (!readContainer(cram, offset, &cram->container))
+		return false;
+	clearCompression(&cram->compression);
+	cram->nextSlice = 0;
+	cram->nextContainer = cram->container.body + cram->container.length;
+	// The end of file container has no slices
+	if (cram->container.recordCount == 0 || cram->container.landmarkCount == 0) {
+		cram->container.landmarkCount = 0;
+		return true;
+	}
+
+	memset(&block, 0, sizeof(CramBlock));
+	if (!readBlockHeader(cram, cram->container.body, &block))
+		invalidCram(cram, "truncated compression header");
+	readCompressionHeader(cram, &block);
+	clearBlock(&block);
+	cram->compression.container = offset;
+	return true;
+}
+
+//////////////////////////////////////////////////////
+// Records
+//////////////////////////////////////////////////////
+
+static void addCigar(CramFile * cram, CramRecord * record, int operation, int length) {
+	if (length <= 0)
+		return;
+	if (record->cigarCount && (cram->cigar[cram->cigarCount - 1] & BAM_CIGAR_MASK) == operation) {
+		cram->cigar[cram->cigarCount - 1] += length << BAM_CIGAR_SHIFT;
+	} else {
+		if (cram->cigarCount == cram->cigarCapacity) {
+			cram->cigarCapacity = cram->cigarCapacity ? 2 * cram->cigarCapacity : 1024;
+			cram->cigar = (uint32_t *) realloc(cram->cigar, cram->cigarCapacity * sizeof(uint32_t));
+		}
+		cram->cigar[cram->cigarCount++] = (length << BAM_CIGAR_SHIFT) | operation;
+		record->cigarCount++;
+	}
+	if (operation == BAM_CMATCH || operation == BAM_CDEL || operation == BAM_CREF_SKIP)
+		record->end += length;
+}
+
+// Bases between features match the reference
+static void readFeatures(CramFile * cram, CramRecord * record, int readLength) {
+	CramCompression * compression = &cram->compression;
+	int count = decodeSeries(cram, CRAM_FN);
+	int next = 1, position = 0;
+	int i, code;
+
+	if (count < 0)
+		invalidCram(cram, "negative feature count");
+	for (i = 0; i < count && !cram->core.cursor.overrun; i++) {
+		code = decodeValue(cram, seriesCodec(cram, CRAM_FC), true);
+		position += decodeSeries(cram, CRAM_FP);
+		if (position > next) {
+			addCigar(cram, record, BAM_CMATCH, position - next);
+			next = position;
+		}
+		switch (code) {
+			case 'X':
+				if (!compression->skipped[CRAM_BS])
+					skipBytes(cram, seriesCodec(cram, CRAM_BS), 1);
+				addCigar(cram, record, BAM_CMATCH, 1);
+				next++;
+				break;
+			case 'B':
+				if (!compression->skipped[CRAM_BA])
+					skipBytes(cram, seriesCodec(cram, CRAM_BA), 1);
+				if (!compression->skipped[CRAM_QS])
+					skipBytes(cram, seriesCodec(cram, CRAM_QS), 1);
+				addCigar(cram, record, BAM_CMATCH, 1);
+				next++;
+				break;
+			case 'b': {
+				int length = skipByteArray(cram, seriesCodec(cram, CRAM_BB));
+				addCigar(cram, record, BAM_CMATCH, length);
+				next += length;
+				break;
+			}
+			case 'q':
+				if (!compression->skipped[CRAM_QQ])
+					skipByteArray(cram, seriesCodec(cram, CRAM_QQ));
+				break;
+			case 'Q':
+				if (!compression->skipped[CRAM_QS])
+					skipBytes(cram, seriesCodec(cram, CRAM_QS), 1);
+				break;
+			case 'I': {
+				int length = skipByteArray(cram, seriesCodec(cram, CRAM_IN));
+				addCigar(cram, record, BAM_CINS, length);
+				next += length;
+				break;
+			}
+			case 'i':
+				if (!compression->skipped[CRAM_BA])
+					skipBytes(cram, seriesCodec(cram, CRAM_BA), 1);
+				addCigar(cram, record, BAM_CINS, 1);
+				next++;
+				break;
+			case 'S': {
+				int length = skipByteArray(cram, seriesCodec(cram, CRAM_SC));
+				addCigar(cram, record, BAM_CSOFT_CLIP, length);
+				next += length;
+				break;
+			}
+			case 'D':
+				addCigar(cram, record, BAM_CDEL, decodeSeries(cram, CRAM_DL));
+				break;
+			case 'N':
+				addCigar(cram, record, BAM_CREF_SKIP, decodeSeries(cram, CRAM_RS));
+				break;
+			case 'H':
+				addCigar(cram, record, BAM_CHARD_CLIP, decodeSeries(cram, CRAM_HC));
+				break;
+			case 'P':
+				addCigar(cram, record, BAM_CPAD, decodeSeries(cram, CRAM_PD));
+				break;
+			default:
+				invalidCram(cram, "unknown read feature");
+		}
+	}
+	addCigar(cram, record, BAM_CMATCH, readLength - next + 1);
+}
+
+static CramRecord * newRecord(CramFile * cram) {
+	CramRecord * record;
+
+	if (cram->recordCount == cram->recordCapacity) {
+		cram->recordCapacity = cram->recordCapacity ? 2 * cram->recordCapacity : 1024;
+		cram->records = (CramRecord *) realloc(cram->records, cram->recordCapacity * sizeof(CramRecord));
+	}
+	record = cram->records + cram->recordCount++;
+	memset(record, 0, sizeof(CramRecord));
+	record->cigar = cram->cigarCount;
+	record->mate = -1;
+	return record;
+}
+
+static bool overrun(CramFile * cram) {
+	int i;
+	if (cram->core.cursor.overrun)
+		return true;
+	for (i = 0; i < cram->compression.blockCount; i++)
+		if (cram->blocks[i].cursor.overrun)
+			return true;
+	return false;
+}
+
+static void readRecord(CramFile * cram, int index, int sliceTid, int * lastPosition) {
+	CramCompression * compression = &cram->compression;
+	CramRecord * record = newRecord(cram);
+	int flags, cramFlags, readLength, position, line, i;
+
+	record->flag = flags = decodeSeries(cram, CRAM_BF);
+	cramFlags = decodeSeries(cram, CRAM_CF);
+	record->tid = sliceTid == CRAM_MULTIPLE_REFERENCES ? decodeSeries(cram, CRAM_RI) : sliceTid;
+	readLength = decodeSeries(cram, CRAM_RL);
+	position = decodeSeries(cram, CRAM_AP);
+	if (compression->deltaPositions)
+		position += *lastPosition;
+	*lastPosition = position;
+	// 1-based in CRAM files
+	record->pos = record->end = position - 1;
+	if (!compression->skipped[CRAM_RG])
+		decodeSeries(cram, CRAM_RG);
+	if (compression->readNames && !compression->skipped[CRAM_RN])
+		skipByteArray(cram, seriesCodec(cram, CRAM_RN));
+
+	// Mates
+	record->tlen = INT_MIN;
+	if (cramFlags & CRAM_DETACHED) {
+		decodeSeries(cram, CRAM_MF);
+		if (!compression->readNames && !compression->skipped[CRAM_RN])
+			skipByteArray(cram, seriesCodec(cram, CRAM_RN));
+		decodeSeries(cram, CRAM_NS);
+		decodeSeries(cram, CRAM_NP);
+		record->tlen = decodeSeries(cram, CRAM_TS);
+	} else if (cramFlags & CRAM_MATE_DOWNSTREAM)
+		record->mate = index + 1 + decodeSeries(cram, CRAM_NF);
+
+	// Tags
+	line = decodeSeries(cram, CRAM_TL);
+	if (line < 0 || line >= compression->lineCount)
+		invalidCram(cram, "invalid tag line");
+	for (i = compression->lineStarts[line]; i < compression->lineStarts[line + 1]; i++)
+		if (!compression->tagsSkipped[compression->lineTags[i]])
+			skipByteArray(cram, compression->tagCodecs[compression->lineTags[i]]);
+
+	if (!(flags & BAM_FUNMAP)) {
+		readFeatures(cram, record, readLength);
+		record->mapq = decodeSeries(cram, CRAM_MQ);
+	} else if (!(cramFlags & CRAM_NO_SEQUENCE) && !compression->skipped[CRAM_BA])
+		skipBytes(cram, seriesCodec(cram, CRAM_BA), readLength);
+	if ((cramFlags & CRAM_QUALITY_ARRAY) && !compression->skipped[CRAM_QS])
+		skipBytes(cram, seriesCodec(cram, CRAM_QS), readLength);
+
+	if (overrun(cram))
+		invalidCram(cram, "truncated slice");
+}
+
+// Template lengths of the mates within the slice, from the leftmost start to
+// the rightmost end, positive at the leftmost segment
+static void resolveMates(CramFile * cram) {
+	CramRecord * records = cram->records;
+	int index, mate, left, right, leftCount, tlen;
+	bool sameTarget;
+
+	for (index = 0; index < cram->recordCount; index++) {
+		if (records[index].tlen != INT_MIN)
+			continue;
+		if (records[index].mate < 0) {
+			records[index].tlen = 0;
+			continue;
+		}
+
+		left = records[index].pos;
+		right = records[index].end;
+		leftCount = 0;
+		sameTarget = true;
+		for (mate = index; mate >= 0; mate = records[mate].mate) {
+			if (records[mate].mate >= 0 && (records[mate].mate <= mate || records[mate].mate >= cram->recordCount))
+				invalidCram(cram, "invalid mate");
+			if (records[mate].pos < left) {
+				left = records[mate].pos;
+				leftCount = 1;
+			} else if (records[mate].pos == left)
+				leftCount++;
+			if (records[mate].end > right)
+				right = records[mate].end;
+			sameTarget &= records[mate].tid == records[index].tid;
+		}
+
+		tlen = right - left;
+		for (mate = index; mate >= 0; mate = records[mate].mate) {
+			if (!sameTarget)
+				records[mate].tlen = 0;
+			else if (records[mate].pos == left && (leftCount == 1 || (records[mate].flag & BAM_FREAD1)))
+				records[mate].tlen = tlen;
+			else
+				records[mate].tlen = -tlen;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////
+// Slices
+//////////////////////////////////////////////////////
+
+static void readSlice(CramFile * cram, long long offset) {
+	CramCompression * compression = &cram->compression;
+	CramBlock header, block;
+	CramCursor * cursor;
+	int sliceTid, start, recordCount, blockCount, lastPosition;
+	int i, slot;
+	long long next;
+
+	for (i = 0; i < cram->blockCapacity; i++)
+		clearBlock(cram->blocks + i);
+	clearBlock(&cram->core);
+	if (cram->blockCapacity < compression->blockCount) {
+		cram->blocks = (CramBlock *) realloc(cram->blocks, compression->blockCount * sizeof(CramBlock));
+		memset(cram->blocks + cram->blockCapacity, 0, (compression->blockCount - cram->blockCapacity) * sizeof(CramBlock));
+		cram->blockCapacity = compression->blockCount;
+	}
+	cram->recordCount = cram->nextRecord = cram->cigarCount = 0;
+
+	memset(&header, 0, sizeof(CramBlock));
+	if (!readBlockHeader(cram, offset, &header) || header.contentType != CRAM_SLICE_HEADER)
+		invalidCram(cram, "missing slice header");
+	cursor = blockCursor(cram, &header);
+	sliceTid = cursorItf8(cursor);
+	start = cursorItf8(cursor);
+	cursorItf8(cursor);
+	recordCount = cursorItf8(cursor);
+	if (cram->major >= 3)
+		cursorLtf8(cursor);
+	else
+		cursorItf8(cursor);
+	blockCount = cursorItf8(cursor);
+	if (cursor->overrun || recordCount < 0)
+		invalidCram(cram, "truncated slice header");
+	next = header.next;
+	clearBlock(&header);
+
+	// Only the blocks of the series which are read get loaded now, the others
+	// only if some record turns out to need them
+	for (i = 0; i < blockCount; i++) {
+		memset(&block, 0, sizeof(CramBlock));
+		if (!readBlockHeader(cram, next, &block))
+			invalidCram(cram, "truncated slice");
+		next = block.next;
+		if (block.contentType == CRAM_CORE_DATA) {
+			cram->core = block;
+			loadBlock(cram, &cram->core);
+		} else if (block.contentType == CRAM_EXTERNAL_DATA) {
+			for (slot = 0; slot < compression->blockCount && compression->contentIds[slot] != block.contentId; slot++)
+				;
+			if (slot == compression->blockCount)
+				continue;
+			cram->blocks[slot] = block;
+			if (compression->blocksRead[slot])
+				loadBlock(cram, cram->blocks + slot);
+		}
+	}
+	if (!cram->core.loaded)
+		loadBlock(cram, &cram->core);
+
+	lastPosition = start;
+	for (i = 0; i < recordCount; i++)
+		readRecord(cram, i, sliceTid, &lastPosition);
+	resolveMates(cram);
+}
+
+static void copyRecord(CramFile * cram, CramRecord * record, bam1_t * b) {
+	int length = record->cigarCount * sizeof(uint32_t);
+
+	if (b->m_data < length) {
+		b->m_data = length;
+		kroundup32(b->m_data);
+		b->data = (uint8_t *) realloc(b->data, b->m_data);
+	}
+	memcpy(b->data, cram->cigar + record->cigar, length);
+	b->data_len = length;
+	b->l_aux = 0;
+	memset(&b->core, 0, sizeof(bam1_core_t));
+	b->core.tid = record->tid;
+	b->core.pos = record->pos;
+	b->core.qual = record->mapq;
+	b->core.flag = record->flag;
+	b->core.n_cigar = record->cigarCount;
+	b->core.mtid = -1;
+	b->core.mpos = -1;
+	b->core.isize = record->tlen;
+}
+
+//////////////////////////////////////////////////////
+// Index
+//////////////////////////////////////////////////////
+
+// Gzipped lines of: target, start, span, container offset, slice offset and slice size
+static void readCramIndex(CramFile * cram) {
+	char * filename = (char *) malloc(strlen(cram->filename) + 6);
+	long long container;
+	int capacity = 0, tid, start, span, slice, size;
+	char line[1024];
+	gzFile file;
+
+	sprintf(filename, "%s.crai", cram->filename);
+	file = gzopen(filename, "r");
+	free(filename);
+	if (!file)
+		return;
+	while (gzgets(file, line, sizeof(line))) {
+		if (sscanf(line, "%i\t%i\t%i\t%lli\t%i\t%i", &tid, &start, &span, &container, &slice, &size) != 6)
+			continue;
+		if (cram->indexCount == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			cram->index = (CramIndexEntry *) realloc(cram->index, capacity * sizeof(CramIndexEntry));
+		}
+		cram->index[cram->indexCount].tid = tid;
+		cram->index[cram->indexCount].start = start;
+		cram->index[cram->indexCount].span = span;
+		cram->index[cram->indexCount].container = container;
+		cram->index[cram->indexCount].slice = slice;
+		cram->indexCount++;
+	}
+	gzclose(file);
+	cram->indexed = true;
+}
+
+bool hasCramIndex(CramFile * cram) {
+	return cram->indexed;
+}
+
+static int compareIndexEntries(const void * A, const void * B) {
+	const CramIndexEntry * a = (const CramIndexEntry *) A, * b = (const CramIndexEntry *) B;
+	if (a->container != b->container)
+		return a->container < b->container ? -1 : 1;
+	return a->slice - b->slice;
+}
+
+CramIterator * queryCramFile(CramFile * cram, int tid, int beg, int end) {
+	CramIterator * iter = (CramIterator *) calloc(1, sizeof(CramIterator));
+	CramIndexEntry * entries = (CramIndexEntry *) calloc(cram->indexCount + 1, sizeof(CramIndexEntry));
+	int i, count = 0;
+
+	iter->tid = tid;
+	iter->beg = beg;
+	iter->end = end;
+	// Spans are 1-based
+	for (i = 0; i < cram->indexCount; i++)
+		if (cram->index[i].tid == tid && cram->index[i].start - 1 < end && cram->index[i].start - 1 + cram->index[i].span > beg)
+			entries[count++] = cram->index[i];
+	qsort(entries, count, sizeof(CramIndexEntry), compareIndexEntries);
+
+	iter->containers = (long long *) calloc(count + 1, sizeof(long long));
+	iter->slices = (int *) calloc(count + 1, sizeof(int));
+	for (i = 0; i < count; i++) {
+		if (iter->count && iter->containers[iter->count - 1] == entries[i].container && iter->slices[iter->count - 1] == entries[i].slice)
+			continue;
+		iter->containers[iter->count] = entries[i].container;
+		iter->slices[iter->count] = entries[i].slice;
+		iter->count++;
+	}
+	free(entries);
+
+	// The slice in hand is read again from the start
+	cram->recordCount = cram->nextRecord = 0;
+	return iter;
+}
+
+void destroyCramIterator(CramIterator * iter) {
+	free(iter->containers);
+	free(iter->slices);
+	free(iter);
+}
+
+//////////////////////////////////////////////////////
+// Reading
+//////////////////////////////////////////////////////
+
+static bool nextSlice(CramFile * cram, CramIterator * iter) {
+	if (iter) {
+		if (iter->next == iter->count)
+			return false;
+		if (!loadContainer(cram, iter->containers[iter->next]))
+			invalidCram(cram, "index points past the end of the file");
+		readSlice(cram, cram->container.body + iter->slices[iter->next++]);
+		return true;
+	}
+
+	while (cram->nextSlice == cram->container.landmarkCount) {
+		cram->compression.container = -1;
+		if (!loadContainer(cram, cram->nextContainer))
+			return false;
+	}
+	readSlice(cram, cram->container.body + cram->container.landmarks[cram->nextSlice++]);
+	return true;
+}
+
+bool readCramRecord(CramFile * cram, CramIterator * iter, bam1_t * b) {
+	CramRecord * record;
+
+	while (!iter || !iter->done) {
+		while (cram->nextRecord == cram->recordCount)
+			if (!nextSlice(cram, iter))
+				return false;
+		record = cram->records + cram->nextRecord++;
+		if (!iter) {
+			copyRecord(cram, record, b);
+			return true;
+		}
+
+		// As bam_iter_read, alignments overlapping the region
+		if (record->tid != iter->tid)
+			continue;
+		if (record->pos >= iter->end) {
+			iter->done = true;
+			break;
+		}
+		if ((record->cigarCount ? record->end : record->pos + 1) > iter->beg) {
+			copyRecord(cram, record, b);
+			return true;
+		}
+	}
+	return false;
+}
+
+//////////////////////////////////////////////////////
+// Files
+//////////////////////////////////////////////////////
+
+// Targets of the @SQ lines
+static void parseSamHeader(CramFile * cram, char * text) {
+	bam_header_t * header = cram->header;
+	char * line, * field, * name, * save = NULL, * fieldSave;
+	int capacity = 0;
+	unsigned int length;
+
+	for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, "@SQ\t", 4))
+			continue;
+		name = NULL;
+		length = 0;
+		for (field = strtok_r(line + 4, "\t", &fieldSave); field; field = strtok_r(NULL, "\t", &fieldSave)) {
+			if (!strncmp(field, "SN:", 3))
+				name = field + 3;
+			else if (!strncmp(field, "LN:", 3))
+				length = strtoul(field + 3, NULL, 10);
+		}
+		if (!name)
+			invalidCram(cram, "@SQ line without a name");
+		if (header->n_targets == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			header->target_name = (char **) realloc(header->target_name, capacity * sizeof(char *));
+			header->target_len = (uint32_t *) realloc(header->target_len, capacity * sizeof(uint32_t));
+		}
+		header->target_name[header->n_targets] = strdup(name);
+		header->target_len[header->n_targets] = length;
+		header->n_targets++;
+	}
+}
+
+static void readSamHeader(CramFile * cram) {
+	CramContainer container;
+	CramBlock block;
+	CramCursor * cursor;
+	char * text;
+	int length;
+
+	memset(&container, 0, sizeof(CramContainer));
+	memset(&block, 0, sizeof(CramBlock));
+	if (!readContainer(cram, CRAM_FILE_DEFINITION, &container) || !readBlockHeader(cram, container.body, &block) || block.contentType != CRAM_FILE_HEADER)
+		invalidCram(cram, "missing SAM header");
+	cursor = blockCursor(cram, &block);
+	length = cursorInt32(cursor);
+	if (length < 0 || cursor->position + length > cursor->size)
+		invalidCram(cram, "truncated SAM header");
+	text = (char *) malloc(length + 1);
+	memcpy(text, cursor->data + cursor->position, length);
+	text[length] = '\0';
+
+	cram->header = bam_header_init();
+	parseSamHeader(cram, text);
+	free(text);
+	clearBlock(&block);
+	cram->nextContainer = container.body + container.length;
+	free(container.landmarks);
+}
+
+bool isCramFilename(char * filename) {
+	size_t length = strlen(filename);
+	return length > 5 && !strcmp(filename + length - 5, ".cram");
+}
+
+CramFile * openCramFile(char * filename) {
+	CramFile * cram = (CramFile *) calloc(1, sizeof(CramFile));
+	unsigned char definition[CRAM_FILE_DEFINITION];
+
+	cram->filename = filename;
+	if (!(cram->file = fopen(filename, "rb"))) {
+		fprintf(stderr, "Could not open input file %s\n", filename);
+		raiseError();
+	}
+	setvbuf(cram->file, NULL, _IOFBF, CRAM_FILE_BUFFER);
+	if (fread(definition, 1, CRAM_FILE_DEFINITION, cram->file) != CRAM_FILE_DEFINITION || memcmp(definition, "CRAM", 4))
+		invalidCram(cram, "not a CRAM file");
+	cram->major = definition[4];
+	if (cram->major < 2 || cram->major > 3) {
+		fprintf(stderr, "Cannot read CRAM file %s: version %i.%i is not supported, only 2.1 and 3.x\n", filename, definition[4], definition[5]);
+		raiseError();
+	}
+	cram->compression.container = -1;
+
+	readSamHeader(cram);
+	readCramIndex(cram);
+	return cram;
+}
+
+bam_header_t * cramHeader(CramFile * cram) {
+	return cram->header;
+}
+
+void closeCramFile(CramFile * cram) {
+	int i;
+
+	for (i = 0; i < cram->blockCapacity; i++)
+		clearBlock(cram->blocks + i);
+	clearBlock(&cram->core);
+	clearCompression(&cram->compression);
+	fclose(cram->file);
+	bam_header_destroy(cram->header);
+	free(cram->container.landmarks);
+	free(cram->blocks);
+	free(cram->records);
+	free(cram->cigar);
+	free(cram->index);
+	free(cram);
+}
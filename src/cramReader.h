@@ -0,0 +1,49 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _CRAM_READER_H_
+#define _CRAM_READER_H_
+
+// Alignments of a CRAM file, as read by the BAM coverage reader
+//
+// Only the data series which place reads on the genome are decoded: flags,
+// positions, read lengths, read features and mapping qualities. Read names,
+// bases, quality scores and tags are skipped, and so are the blocks which
+// hold nothing else: they are neither decompressed, nor even read from disk.
+// Coverage does not depend on bases, so the reference is never fetched.
+// Records come out as BAM records with only their core fields and CIGAR,
+// rebuilt from the read features.
+
+#include "sam.h"
+#include "wiggletools.h"
+
+typedef struct cramFile_st CramFile;
+typedef struct cramIterator_st CramIterator;
+
+// Files with a .cram suffix
+bool isCramFilename(char * filename);
+CramFile * openCramFile(char * filename);
+void closeCramFile(CramFile * cram);
+// Targets of the SAM header, as in a BAM header
+bam_header_t * cramHeader(CramFile * cram);
+// Whether a .crai index was found next to the file
+bool hasCramIndex(CramFile * cram);
+// Alignments of target tid overlapping [beg, end), 0-based, as bam_iter_query
+CramIterator * queryCramFile(CramFile * cram, int tid, int beg, int end);
+void destroyCramIterator(CramIterator * iter);
+// Reads the next alignment of the query, or of the file if iter is NULL, as bam_iter_read.
+// Returns false at the end.
+bool readCramRecord(CramFile * cram, CramIterator * iter, bam1_t * b);
+
+#endif
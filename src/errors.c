@@ -0,0 +1,116 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "errors.h"
+
+// Kent library
+#include "common.h"
+#include "errAbort.h"
+
+// Mutexes taken with lockUntilError under one handler, at most
+#define MAX_HELD_LOCKS 16
+
+typedef struct errorHandler_st {
+	jmp_buf jump;
+	// Released by raiseError, innermost last
+	pthread_mutex_t * locks[MAX_HELD_LOCKS];
+	int lockCount;
+	struct errorHandler_st * outer;
+} ErrorHandler;
+
+// Innermost catchErrors of the thread, NULL if none
+static __thread ErrorHandler * handler = NULL;
+
+// errAbort calls the abort handler on top of the stack of the thread, then 
+// exits if it returns, which raiseError does not when errors are caught
+static void abortToHandler() {
+	raiseError();
+}
+
+// The Kent abort handler is on the stack of the thread while its errors are caught
+static void setHandler(ErrorHandler * next) {
+	if (!handler && next)
+		pushAbortHandler(&abortToHandler);
+	else if (handler && !next)
+		popAbortHandler();
+	handler = next;
+}
+
+void raiseError() {
+	if (handler) {
+		while (handler->lockCount > 0)
+			pthread_mutex_unlock(handler->locks[--handler->lockCount]);
+		longjmp(handler->jump, 1);
+	}
+	exit(1);
+}
+
+bool catchErrors(void (*function)(void *), void * args) {
+	ErrorHandler caught;
+	ErrorHandler * outer = handler;
+
+	caught.lockCount = 0;
+	caught.outer = outer;
+	setHandler(&caught);
+	if (setjmp(caught.jump)) {
+		setHandler(outer);
+		return false;
+	}
+	function(args);
+	setHandler(outer);
+	return true;
+}
+
+bool catchingErrors() {
+	return handler != NULL;
+}
+
+void * swapErrorHandler(void * next) {
+	ErrorHandler * previous = handler;
+	setHandler((ErrorHandler *) next);
+	return previous;
+}
+
+void lockUntilError(pthread_mutex_t * mutex) {
+	pthread_mutex_lock(mutex);
+	if (!handler)
+		return;
+	if (handler->lockCount == MAX_HELD_LOCKS) {
+		fprintf(stderr, "wiggletools: more than %i locks held at once\n", MAX_HELD_LOCKS);
+		abort();
+	}
+	handler->locks[handler->lockCount++] = mutex;
+}
+
+// The lock may have been taken under an outer handler
+void unlockUntilError(pthread_mutex_t * mutex) {
+	ErrorHandler * owner;
+	int index;
+
+	for (owner = handler; owner; owner = owner->outer) {
+		for (index = owner->lockCount - 1; index >= 0 && owner->locks[index] != mutex; index--)
+			;
+		if (index >= 0) {
+			owner->lockCount--;
+			for (; index < owner->lockCount; index++)
+				owner->locks[index] = owner->locks[index + 1];
+			break;
+		}
+	}
+	pthread_mutex_unlock(mutex);
+}
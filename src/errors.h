@@ -0,0 +1,38 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _ERRORS_H_
+#define _ERRORS_H_
+
+#include <pthread.h>
+
+#include "wiggletools.h"
+
+// Errors of the library, see catchErrors in wiggletools.h
+//
+// Each thread has its innermost catchErrors as handler. Tasks of the I/O
+// threads have their own, which the workers swap in and out as they switch
+// between tasks.
+
+void * swapErrorHandler(void * handler);
+// Whether the errors of the calling thread are caught
+bool catchingErrors();
+
+// Errors jump out of the functions which raise them, so the mutexes which
+// may be held at the time are taken and released with these: raiseError
+// then releases those taken under the handler it jumps to.
+void lockUntilError(pthread_mutex_t * mutex);
+void unlockUntilError(pthread_mutex_t * mutex);
+
+#endif
@@ -0,0 +1,179 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <math.h>
+
+#include "exactSum.h"
+#include "partials.h"
+
+//////////////////////////////////////////////////////
+// Exact sums
+//
+// A product of a double by a 32 bit weight spans at
+// most 4 digits, which are added or subtracted
+// separately. The sum is normalised, i.e. carries are
+// propagated so that all digits but the top one are in
+// [0, 2^32), before any digit could overflow, and
+// before being read. The top digit holds the sign.
+//////////////////////////////////////////////////////
+
+// Each addition adds less than 2^32 to a digit
+#define EXACT_SUM_MAX_PENDING (1 << 30)
+
+void clearExactSum(ExactSum * sum) {
+	if (sum->low <= sum->high)
+		memset(sum->digits + sum->low, 0, (sum->high - sum->low + 1) * sizeof(int64_t));
+	sum->low = EXACT_SUM_DIGITS;
+	sum->high = -1;
+	sum->pending = 0;
+	sum->special = 0;
+}
+
+static void normaliseExactSum(ExactSum * sum) {
+	int i;
+
+	// The top digit is left alone once within 32 bits, sign included
+	for (i = sum->low; i < sum->high || (i < EXACT_SUM_DIGITS - 1 && (uint64_t) ((sum->digits[i] >> 32) + 1) > 1); i++) {
+		sum->digits[i + 1] += sum->digits[i] >> 32;
+		sum->digits[i] &= 0xFFFFFFFF;
+	}
+	if (i > sum->high)
+		sum->high = i;
+	sum->pending = 0;
+}
+
+void addExactProduct(ExactSum * sum, double value, int weight) {
+	uint64_t bits, mantissa;
+	unsigned __int128 product;
+	int64_t sign;
+	uint32_t magnitude;
+	int exponent, position, index;
+
+	memcpy(&bits, &value, sizeof(bits));
+	exponent = (bits >> 52) & 0x7FF;
+	mantissa = bits & ((1ULL << 52) - 1);
+	if (exponent == 0x7FF) {
+		sum->special += value * weight;
+		return;
+	}
+	if (exponent)
+		mantissa |= 1ULL << 52;
+	else
+		exponent = 1;
+	if (!mantissa || !weight)
+		return;
+
+	// value = mantissa * 2^(exponent - 1075)
+	sign = (bits >> 63) == (weight < 0) ? 1 : -1;
+	position = exponent - 1075 + EXACT_SUM_FRACTION_BITS;
+	index = position / 32;
+	magnitude = weight < 0 ? -(uint32_t) weight : (uint32_t) weight;
+	product = ((unsigned __int128) mantissa * magnitude) << (position % 32);
+	sum->digits[index] += sign * (int64_t) (uint32_t) product;
+	sum->digits[index + 1] += sign * (int64_t) (uint32_t) (product >> 32);
+	sum->digits[index + 2] += sign * (int64_t) (uint32_t) (product >> 64);
+	sum->digits[index + 3] += sign * (int64_t) (uint32_t) (product >> 96);
+	if (index < sum->low)
+		sum->low = index;
+	if (index + 3 > sum->high)
+		sum->high = index + 3;
+	if (++sum->pending == EXACT_SUM_MAX_PENDING)
+		normaliseExactSum(sum);
+}
+
+void addExactSum(ExactSum * sum, ExactSum * other) {
+	int i;
+
+	sum->special += other->special;
+	if (other->low > other->high)
+		return;
+	normaliseExactSum(other);
+	for (i = other->low; i <= other->high; i++)
+		sum->digits[i] += other->digits[i];
+	if (other->low < sum->low)
+		sum->low = other->low;
+	if (other->high > sum->high)
+		sum->high = other->high;
+	if (++sum->pending == EXACT_SUM_MAX_PENDING)
+		normaliseExactSum(sum);
+}
+
+// The three top non zero digits hold at least 65 significant bits, the
+// lower ones only matter as a sticky bit, for ties
+double exactSumValue(ExactSum * sum) {
+	int64_t digits[EXACT_SUM_DIGITS];
+	unsigned __int128 head = 0;
+	bool negative;
+	int i, top, bottom;
+
+	if (sum->special)
+		return sum->special;
+	if (sum->low > sum->high)
+		return 0;
+	normaliseExactSum(sum);
+
+	// Magnitude, normalised again after negation
+	negative = sum->digits[sum->high] < 0;
+	for (i = sum->low; i <= sum->high; i++)
+		digits[i] = negative ? -sum->digits[i] : sum->digits[i];
+	for (i = sum->low; i < sum->high; i++) {
+		digits[i + 1] += digits[i] >> 32;
+		digits[i] &= 0xFFFFFFFF;
+	}
+
+	for (top = sum->high; top >= sum->low && !digits[top]; top--);
+	if (top < sum->low)
+		return 0;
+	bottom = top - 2 > sum->low ? top - 2 : sum->low;
+	for (i = top; i >= bottom; i--)
+		head = (head << 32) | (uint64_t) digits[i];
+	for (i = sum->low; i < bottom; i++)
+		if (digits[i])
+			head |= 1;
+	return ldexp(negative ? -(double) head : (double) head, 32 * bottom - EXACT_SUM_FRACTION_BITS);
+}
+
+//////////////////////////////////////////////////////
+// Partial results
+//////////////////////////////////////////////////////
+
+void dumpExactSum(ExactSum * sum, FILE * file) {
+	int32_t range[2];
+
+	if (sum->low <= sum->high)
+		normaliseExactSum(sum);
+	range[0] = sum->low;
+	range[1] = sum->high;
+	writePartialValues(file, range, sizeof(int32_t), 2);
+	if (sum->low <= sum->high)
+		writePartialValues(file, sum->digits + sum->low, sizeof(int64_t), sum->high - sum->low + 1);
+	writePartialValues(file, &sum->special, sizeof(double), 1);
+}
+
+void loadExactSum(ExactSum * sum, FILE * file) {
+	int32_t range[2];
+
+	clearExactSum(sum);
+	readPartialValues(file, range, sizeof(int32_t), 2);
+	if (range[0] < 0 || range[1] >= EXACT_SUM_DIGITS) {
+		fprintf(stderr, "Corrupted sum in partial results file\n");
+		raiseError();
+	}
+	sum->low = range[0];
+	sum->high = range[1];
+	if (sum->low <= sum->high)
+		readPartialValues(file, sum->digits + sum->low, sizeof(int64_t), sum->high - sum->low + 1);
+	readPartialValues(file, &sum->special, sizeof(double), 1);
+}
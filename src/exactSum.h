@@ -0,0 +1,52 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _EXACT_SUM_H_
+#define _EXACT_SUM_H_
+
+// Exact sums of doubles weighted by integers
+//
+// The sum is a fixed point number wide enough to hold any such product
+// without rounding, in 32 bit digits which are each stored in 64 bits, so
+// that carries can wait for a billion additions. As nothing is rounded
+// until the value is read, a sum does not depend on the order in which
+// its terms were added, nor on how they were split between threads or
+// shards. Infinite and NaN terms are summed apart, as doubles.
+
+#include <stdio.h>
+#include <stdint.h>
+#include "wiggletools.h"
+
+// Digit i weighs 2^(32 i - EXACT_SUM_FRACTION_BITS), down to the smallest
+// subnormal, up to 64 bits above the largest product
+#define EXACT_SUM_FRACTION_BITS 1088
+#define EXACT_SUM_DIGITS 72
+
+typedef struct exactSum_st {
+	int64_t digits[EXACT_SUM_DIGITS];
+	// Range of the digits which may be non zero
+	int low, high;
+	int pending;
+	double special;
+} ExactSum;
+
+void clearExactSum(ExactSum * sum);
+void addExactProduct(ExactSum * sum, double value, int weight);
+void addExactSum(ExactSum * sum, ExactSum * other);
+// Correctly rounded
+double exactSumValue(ExactSum * sum);
+void dumpExactSum(ExactSum * sum, FILE * file);
+void loadExactSum(ExactSum * sum, FILE * file);
+
+#endif
@@ -0,0 +1,373 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wiggleIterator.h"
+#include "fanOut.h"
+#include "errors.h"
+
+// Maximum number of records buffered between the first and the last consumer
+#define FAN_OUT_LOOKAHEAD 65536
+
+typedef struct fanOutRecord_st {
+	char * chrom;
+	int start;
+	int finish;
+	double value;
+	int strand;
+} FanOutRecord;
+
+typedef struct fanOutConsumer_st {
+	FanOut * fanOut;
+	WiggleIterator * iter;
+	// Sequence number of the next record to be read, counted from the last seek
+	long long next;
+	// Set when another consumer seeked the reader away from the stream
+	// this consumer was reading, which is described below
+	bool stale;
+	// Whether records are kept in case this consumer seeks the same region
+	bool waiting;
+	bool seeked;
+	const char * chrom;
+	int start, finish;
+	// Own reader, once the consumer stopped following the others
+	WiggleIterator * clone;
+	WiggleIterator * summaryReader;
+} FanOutConsumer;
+
+struct fanOut_st {
+	char * filename;
+	bool holdFire;
+	WiggleIterator * source;
+	// Ring buffer of the records from sequence number base onwards
+	FanOutRecord * records;
+	int first, count, capacity;
+	long long base;
+	// Last region the source was seeked to
+	bool seeked;
+	const char * chrom;
+	int start, finish;
+	FanOutConsumer ** consumers;
+	int consumerCount, maxConsumers;
+	// Records are kept until all the expected consumers exist
+	int expected;
+	pthread_mutex_t mutex;
+};
+
+FanOut * newFanOut(char * filename, bool holdFire, int expected) {
+	FanOut * fanOut = (FanOut *) calloc(1, sizeof(FanOut));
+	fanOut->filename = filename;
+	fanOut->holdFire = holdFire;
+	fanOut->source = SmartReader(filename, holdFire);
+	fanOut->capacity = 64;
+	fanOut->records = (FanOutRecord *) calloc(fanOut->capacity, sizeof(FanOutRecord));
+	fanOut->expected = expected;
+	pthread_mutex_init(&fanOut->mutex, NULL);
+	return fanOut;
+}
+
+//////////////////////////////////////////////////////
+// Buffer
+//////////////////////////////////////////////////////
+
+static FanOutRecord * fanOutRecord(FanOut * fanOut, long long sequence) {
+	return fanOut->records + (fanOut->first + (int) (sequence - fanOut->base)) % fanOut->capacity;
+}
+
+static void bufferSourceRecord(FanOut * fanOut) {
+	WiggleIterator * source = fanOut->source;
+	FanOutRecord * record;
+
+	if (fanOut->count == fanOut->capacity) {
+		FanOutRecord * records = (FanOutRecord *) calloc(2 * fanOut->capacity, sizeof(FanOutRecord));
+		int tail = fanOut->capacity - fanOut->first;
+		memcpy(records, fanOut->records + fanOut->first, tail * sizeof(FanOutRecord));
+		memcpy(records + tail, fanOut->records, fanOut->first * sizeof(FanOutRecord));
+		free(fanOut->records);
+		fanOut->records = records;
+		fanOut->first = 0;
+		fanOut->capacity *= 2;
+	}
+
+	record = fanOutRecord(fanOut, fanOut->base + fanOut->count++);
+	record->chrom = source->chrom;
+	record->start = source->start;
+	record->finish = source->finish;
+	record->value = source->value;
+	record->strand = source->strand;
+	pop(source);
+}
+
+// Consumers which finished reading their region do not hold the buffer back
+static bool isActiveConsumer(FanOutConsumer * consumer) {
+	return !consumer->clone && !consumer->stale && !(consumer->iter && consumer->iter->done);
+}
+
+// Drops the records which all the consumers have read
+static void trimFanOut(FanOut * fanOut) {
+	long long min = fanOut->base + fanOut->count;
+	int i;
+
+	if (fanOut->consumerCount < fanOut->expected)
+		return;
+	for (i = 0; i < fanOut->consumerCount; i++) {
+		FanOutConsumer * consumer = fanOut->consumers[i];
+		if (consumer->stale && consumer->waiting && fanOut->base == 0)
+			return;
+		if (isActiveConsumer(consumer) && consumer->next < min)
+			min = consumer->next;
+	}
+
+	fanOut->first = (fanOut->first + (int) (min - fanOut->base)) % fanOut->capacity;
+	fanOut->count -= (int) (min - fanOut->base);
+	fanOut->base = min;
+}
+
+//////////////////////////////////////////////////////
+// Detached consumers
+//////////////////////////////////////////////////////
+
+// Opens a reader on the stream the consumer was reading, and skips the records already read
+static void detachConsumer(FanOut * fanOut, FanOutConsumer * consumer) {
+	WiggleIterator * clone;
+	long long i;
+
+	// Held readers only start on their first seek
+	clone = SmartReader(fanOut->filename, consumer->seeked || fanOut->holdFire);
+	if (consumer->seeked)
+		seek(clone, consumer->chrom, consumer->start, consumer->finish);
+	for (i = 0; i < consumer->next; i++)
+		pop(clone);
+	consumer->clone = clone;
+	consumer->stale = false;
+}
+
+static void saveStream(FanOut * fanOut, FanOutConsumer * consumer) {
+	consumer->seeked = fanOut->seeked;
+	consumer->chrom = fanOut->chrom;
+	consumer->start = fanOut->start;
+	consumer->finish = fanOut->finish;
+}
+
+// The buffer is full: the consumers furthest behind get their own reader
+static void detachLaggards(FanOut * fanOut) {
+	long long min = fanOut->base + fanOut->count;
+	int i;
+
+	fanOut->expected = 0;
+	for (i = 0; i < fanOut->consumerCount; i++) {
+		FanOutConsumer * consumer = fanOut->consumers[i];
+		consumer->waiting = false;
+		if (isActiveConsumer(consumer) && consumer->next < min)
+			min = consumer->next;
+	}
+
+	for (i = 0; i < fanOut->consumerCount; i++) {
+		FanOutConsumer * consumer = fanOut->consumers[i];
+		if (isActiveConsumer(consumer) && consumer->next == min && min < fanOut->base + fanOut->count) {
+			saveStream(fanOut, consumer);
+			detachConsumer(fanOut, consumer);
+		}
+	}
+	trimFanOut(fanOut);
+}
+
+static void popClone(WiggleIterator * wi, WiggleIterator * clone) {
+	if (clone->done)
+		wi->done = true;
+	else {
+		wi->chrom = clone->chrom;
+		wi->start = clone->start;
+		wi->finish = clone->finish;
+		wi->value = clone->value;
+		wi->strand = clone->strand;
+		pop(clone);
+	}
+}
+
+//////////////////////////////////////////////////////
+// Consumers
+//////////////////////////////////////////////////////
+
+// Called within the lock. Returns false if the consumer needs to read from its own reader.
+static bool prepareConsumer(FanOut * fanOut, FanOutConsumer * consumer) {
+	if (consumer->stale)
+		detachConsumer(fanOut, consumer);
+	else if (!consumer->clone && consumer->next == fanOut->base + fanOut->count && !fanOut->source->done && fanOut->count == FAN_OUT_LOOKAHEAD)
+		detachLaggards(fanOut);
+	return !consumer->clone;
+}
+
+static void FanOutWiggleIteratorPop(WiggleIterator * wi) {
+	FanOutConsumer * consumer = (FanOutConsumer *) wi->data;
+	FanOut * fanOut = consumer->fanOut;
+	FanOutRecord * record;
+
+	lockUntilError(&fanOut->mutex);
+	if (!prepareConsumer(fanOut, consumer)) {
+		unlockUntilError(&fanOut->mutex);
+		popClone(wi, consumer->clone);
+		return;
+	}
+
+	if (consumer->next == fanOut->base + fanOut->count) {
+		if (fanOut->source->done) {
+			wi->done = true;
+			unlockUntilError(&fanOut->mutex);
+			return;
+		}
+		bufferSourceRecord(fanOut);
+	}
+
+	record = fanOutRecord(fanOut, consumer->next++);
+	wi->chrom = record->chrom;
+	wi->start = record->start;
+	wi->finish = record->finish;
+	wi->value = record->value;
+	wi->strand = record->strand;
+	trimFanOut(fanOut);
+	unlockUntilError(&fanOut->mutex);
+}
+
+// Copies the buffered records within a single lock
+static void FanOutWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	FanOutConsumer * consumer = (FanOutConsumer *) wi->data;
+	FanOut * fanOut = consumer->fanOut;
+
+	pushSpanBatch(batch, wi);
+	lockUntilError(&fanOut->mutex);
+	if (prepareConsumer(fanOut, consumer)) {
+		while (batch->count < SPAN_BATCH_SIZE) {
+			FanOutRecord * record;
+			int index;
+
+			if (consumer->next == fanOut->base + fanOut->count) {
+				if (fanOut->source->done || fanOut->count == FAN_OUT_LOOKAHEAD)
+					break;
+				bufferSourceRecord(fanOut);
+			}
+			record = fanOutRecord(fanOut, consumer->next++);
+			index = batch->count++;
+			batch->chroms[index] = record->chrom;
+			batch->starts[index] = record->start;
+			batch->finishes[index] = record->finish;
+			batch->values[index] = record->value;
+		}
+		trimFanOut(fanOut);
+	}
+	unlockUntilError(&fanOut->mutex);
+	FanOutWiggleIteratorPop(wi);
+}
+
+static bool hasOtherActiveConsumers(FanOut * fanOut, FanOutConsumer * consumer) {
+	int i;
+	for (i = 0; i < fanOut->consumerCount; i++)
+		if (fanOut->consumers[i] != consumer && isActiveConsumer(fanOut->consumers[i]))
+			return true;
+	return false;
+}
+
+static void FanOutWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	FanOutConsumer * consumer = (FanOutConsumer *) wi->data;
+	FanOut * fanOut = consumer->fanOut;
+	int i;
+
+	lockUntilError(&fanOut->mutex);
+	if (!consumer->clone) {
+		bool sameRegion = fanOut->seeked && fanOut->chrom == chrom && fanOut->start == start && fanOut->finish == finish;
+		if (sameRegion && fanOut->base == 0) {
+			// Another consumer already seeked this region
+			consumer->stale = false;
+			consumer->next = 0;
+		} else if (sameRegion && hasOtherActiveConsumers(fanOut, consumer)) {
+			// The start of the region was already dropped
+			consumer->clone = SmartReader(fanOut->filename, true);
+			consumer->stale = false;
+		} else {
+			for (i = 0; i < fanOut->consumerCount; i++) {
+				FanOutConsumer * other = fanOut->consumers[i];
+				if (other != consumer && !other->clone && !other->stale) {
+					saveStream(fanOut, other);
+					other->stale = true;
+					other->waiting = true;
+				}
+			}
+			seek(fanOut->source, chrom, start, finish);
+			fanOut->first = 0;
+			fanOut->count = 0;
+			fanOut->base = 0;
+			fanOut->seeked = true;
+			fanOut->chrom = chrom;
+			fanOut->start = start;
+			fanOut->finish = finish;
+			consumer->stale = false;
+			consumer->next = 0;
+		}
+	}
+	unlockUntilError(&fanOut->mutex);
+
+	if (consumer->clone)
+		seek(consumer->clone, chrom, start, finish);
+	FanOutWiggleIteratorPop(wi);
+}
+
+// Summaries are computed on a separate reader, which leaves the buffer untouched
+static bool FanOutWiggleIteratorSummarize(WiggleIterator * wi, const char * chrom, int start, int finish, RegionSummary * summaries, int count) {
+	FanOutConsumer * consumer = (FanOutConsumer *) wi->data;
+	if (!consumer->summaryReader)
+		consumer->summaryReader = SmartReader(consumer->fanOut->filename, true);
+	wi->done = true;
+	return consumer->summaryReader->summarize(consumer->summaryReader, chrom, start, finish, summaries, count);
+}
+
+static bool FanOutWiggleIteratorValueRange(WiggleIterator * wi, double * min, double * max) {
+	FanOutConsumer * consumer = (FanOutConsumer *) wi->data;
+	WiggleIterator * source = consumer->fanOut->source;
+	return source->valueRange(source, min, max);
+}
+
+WiggleIterator * FanOutWiggleIterator(FanOut * fanOut) {
+	FanOutConsumer * consumer = (FanOutConsumer *) calloc(1, sizeof(FanOutConsumer));
+	WiggleIterator * new;
+
+	consumer->fanOut = fanOut;
+	lockUntilError(&fanOut->mutex);
+	if (fanOut->consumerCount == fanOut->maxConsumers) {
+		fanOut->maxConsumers = fanOut->maxConsumers ? 2 * fanOut->maxConsumers : 4;
+		fanOut->consumers = (FanOutConsumer **) realloc(fanOut->consumers, fanOut->maxConsumers * sizeof(FanOutConsumer *));
+	}
+	fanOut->consumers[fanOut->consumerCount++] = consumer;
+	// Too late to read the stream from the buffer
+	if (fanOut->base > 0) {
+		saveStream(fanOut, consumer);
+		consumer->stale = true;
+	}
+	unlockUntilError(&fanOut->mutex);
+
+	new = newWiggleIterator(consumer, &FanOutWiggleIteratorPop, &FanOutWiggleIteratorSeek, fanOut->source->default_value);
+	new->popBatch = &FanOutWiggleIteratorPopBatch;
+	new->overlaps = fanOut->source->overlaps;
+	new->compressed = fanOut->source->compressed;
+	if (fanOut->source->summarize)
+		new->summarize = &FanOutWiggleIteratorSummarize;
+	if (fanOut->source->valueRange)
+		new->valueRange = &FanOutWiggleIteratorValueRange;
+	lockUntilError(&fanOut->mutex);
+	consumer->iter = new;
+	unlockUntilError(&fanOut->mutex);
+	return new;
+}
@@ -0,0 +1,33 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _FAN_OUT_H_
+#define _FAN_OUT_H_
+
+#include "wiggletools.h"
+
+// A single reader on a file, whose records are buffered for several consumers
+//
+// Consumers which stay within a bounded distance of each other, and which
+// are seeked to the same regions, read the file only once. A consumer which
+// falls too far behind, or which keeps reading a region after another
+// consumer seeked elsewhere, opens its own reader on the file, and skips
+// the records it had already read, so the output is unchanged.
+typedef struct fanOut_st FanOut;
+
+// expected is the number of consumers which are going to be created
+FanOut * newFanOut(char * filename, bool holdFire, int expected);
+WiggleIterator * FanOutWiggleIterator(FanOut * fanOut);
+
+#endif
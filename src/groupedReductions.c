@@ -0,0 +1,584 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "multiplexer.h"
+#include "reducerKernels.h"
+#include "trackCache.h"
+
+//////////////////////////////////////////////////////
+// Grouped reductions
+//
+// A reduction over thousands of files cannot keep them
+// all open at once, each with its reader threads. The
+// files are instead reduced by groups of GROUP_SIZE,
+// each in a child process, which releases its files
+// and threads when it exits. A group stores the state
+// of the reduction (e.g. the sum of its values) at each
+// position of its own multiplexer into track cache
+// files, and the result is computed by a multiplexer
+// over the states of all the groups.
+//
+// The children are fresh processes running --group_pass
+// with the options of the parent, as forking a process
+// whose other threads may hold locks is unsafe. The
+// groups of a reduction are run once per process, when
+// it is first parsed, and their files are removed when
+// the process exits.
+//////////////////////////////////////////////////////
+
+#define GROUP_SIZE 64
+#define MAX_STATES 4
+#define MAX_GROUP_PASSES 8
+
+static const char * reducerNames[] = {"sum", "mean", "max", "min", "var", "stddev"};
+
+// The state of a group where none of its inputs are in play, and the sum,
+// squared deviations and extrema of the default values of its inputs
+typedef struct groupSummary_st {
+	double defaults[MAX_STATES];
+	double sum, squares, max, min;
+	int finite, integral;
+} GroupSummary;
+
+typedef struct groupedFiles_st {
+	GroupedReducer reducer;
+	char ** filenames;
+	int count;
+	int groups;
+	// Of the states of each group, in order, then of the summaries
+	char ** paths;
+	GroupSummary * summaries;
+	bool failed;
+	struct groupedFiles_st * next;
+} GroupedFiles;
+
+static pthread_mutex_t groupedFilesMutex = PTHREAD_MUTEX_INITIALIZER;
+static GroupedFiles * groupedFiles = NULL;
+static pid_t groupedFilesOwner;
+static char ** passOptions = NULL;
+static int passOptionCount = 0;
+
+void setGroupPassOptions(char ** options, int count) {
+	passOptions = options;
+	passOptionCount = count;
+}
+
+bool isGroupedReduction(int count) {
+	return count > GROUPED_REDUCTION_MIN_INPUTS;
+}
+
+static int stateCount(GroupedReducer reducer) {
+	return reducer == GROUPED_VARIANCE || reducer == GROUPED_STDDEV ? 4 : 1;
+}
+
+//////////////////////////////////////////////////////
+// States of a group
+//////////////////////////////////////////////////////
+
+// The first input of all counts as 0 when it is not in play, as in MaxReduction
+static double groupExtreme(const double * values, const bool * inplay, int count, bool first, bool max) {
+	const ReducerKernels * kernels = reducerKernels();
+	double res = first && !inplay[0] ? 0 : values[0];
+	double rest;
+
+	if (count == 1)
+		return res;
+	rest = max ? kernels->max(values + 1, count - 1) : kernels->min(values + 1, count - 1);
+	if (isnan(res) || isnan(rest))
+		return NAN;
+	return (max ? rest > res : rest < res) ? rest : res;
+}
+
+// The variance only counts the inputs in play, as in VarianceReduction, the
+// standard deviation all of them, as in StdDevReduction. The states are the
+// sum of the values cast to float, then the count, mean and squared
+// deviations of the values counted.
+static void groupDeviations(const double * values, const bool * inplay, int count, bool inplayOnly, double * states) {
+	double sum = 0, mean, squares = 0;
+	int i, counted = 0;
+
+	states[0] = reducerKernels()->floatSum(values, count);
+	for (i = 0; i < count; i++) {
+		if (!inplayOnly || inplay[i]) {
+			sum += values[i];
+			counted++;
+		}
+	}
+	mean = counted ? sum / counted : 0;
+	for (i = 0; i < count; i++)
+		if (!inplayOnly || inplay[i])
+			squares += (values[i] - mean) * (values[i] - mean);
+	states[1] = counted;
+	states[2] = mean;
+	states[3] = squares;
+}
+
+static void groupStates(GroupedReducer reducer, const double * values, const bool * inplay, int count, bool first, double * states) {
+	switch (reducer) {
+	case GROUPED_SUM:
+	case GROUPED_MEAN:
+		states[0] = reducerKernels()->sum(values, count);
+		break;
+	case GROUPED_MAX:
+	case GROUPED_MIN:
+		states[0] = groupExtreme(values, inplay, count, first, reducer == GROUPED_MAX);
+		break;
+	default:
+		groupDeviations(values, inplay, count, reducer == GROUPED_VARIANCE, states);
+	}
+}
+
+static void summariseDefaults(GroupSummary * summary, GroupedReducer reducer, Multiplexer * multi, bool first) {
+	bool * inplay = (bool *) calloc(multi->count, sizeof(bool));
+	double mean;
+	int i;
+
+	groupStates(reducer, multi->default_values, inplay, multi->count, first, summary->defaults);
+	free(inplay);
+
+	summary->sum = 0;
+	summary->max = -INFINITY;
+	summary->min = INFINITY;
+	for (i = 0; i < multi->count; i++) {
+		double value = multi->default_values[i];
+		summary->sum += value;
+		if (isnan(value) || isnan(summary->max))
+			summary->max = summary->min = NAN;
+		else {
+			summary->max = value > summary->max ? value : summary->max;
+			summary->min = value < summary->min ? value : summary->min;
+		}
+	}
+	mean = summary->sum / multi->count;
+	summary->squares = 0;
+	for (i = 0; i < multi->count; i++)
+		summary->squares += (multi->default_values[i] - mean) * (multi->default_values[i] - mean);
+	summary->finite = multi->finite;
+	summary->integral = multi->integral && reducer != GROUPED_VARIANCE && reducer != GROUPED_STDDEV && reducer != GROUPED_MEAN;
+}
+
+//////////////////////////////////////////////////////
+// Group passes, in the child processes
+//////////////////////////////////////////////////////
+
+typedef struct groupPass_st {
+	GroupedReducer reducer;
+	bool first;
+	char * summaryPath;
+	char ** statePaths;
+	char ** filenames;
+	int count;
+} GroupPass;
+
+static FILE * openGroupFile(char * path) {
+	FILE * file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Could not open temporary file %s\n", path);
+		raiseError();
+	}
+	return file;
+}
+
+static void closeGroupFile(FILE * file, char * path) {
+	if (fclose(file)) {
+		fprintf(stderr, "Could not write temporary file %s\n", path);
+		raiseError();
+	}
+}
+
+static void reduceGroup(void * args) {
+	GroupPass * pass = (GroupPass *) args;
+	int states = stateCount(pass->reducer);
+	WiggleIterator ** iters = (WiggleIterator **) calloc(pass->count, sizeof(WiggleIterator *));
+	TrackCacheWriter * writers[MAX_STATES];
+	FILE * files[MAX_STATES];
+	double values[MAX_STATES];
+	GroupSummary summary;
+	Multiplexer * multi;
+	FILE * file;
+	int i;
+
+	for (i = 0; i < pass->count; i++)
+		iters[i] = SmartReader(pass->filenames[i], false);
+	multi = newMultiplexer(iters, pass->count, false);
+	summariseDefaults(&summary, pass->reducer, multi, pass->first);
+	for (i = 0; i < states; i++) {
+		files[i] = openGroupFile(pass->statePaths[i]);
+		writers[i] = openTrackCacheWriter(files[i], false, summary.finite, summary.integral);
+	}
+
+	for (; !multi->done; popMultiplexer(multi)) {
+		groupStates(pass->reducer, multi->values, multi->inplay, multi->count, pass->first, values);
+		for (i = 0; i < states; i++)
+			addTrackCacheValue(writers[i], multi->chrom, multi->start, multi->finish, values[i]);
+	}
+
+	for (i = 0; i < states; i++) {
+		finishTrackCacheWriter(writers[i]);
+		closeGroupFile(files[i], pass->statePaths[i]);
+		free(writers[i]);
+	}
+	file = openGroupFile(pass->summaryPath);
+	if (fwrite(&summary, sizeof(summary), 1, file) != 1) {
+		fprintf(stderr, "Could not write temporary file %s\n", pass->summaryPath);
+		raiseError();
+	}
+	closeGroupFile(file, pass->summaryPath);
+}
+
+// Arguments: reducer, first or rest, summary file, state files, input files
+void runGroupPass(int argc, char ** argv) {
+	GroupPass pass;
+	int reducer;
+
+	memset(&pass, 0, sizeof(pass));
+	for (reducer = 0; reducer <= GROUPED_STDDEV; reducer++)
+		if (argc > 0 && strcmp(argv[0], reducerNames[reducer]) == 0)
+			break;
+	if (reducer > GROUPED_STDDEV || argc < 4 + stateCount(reducer)) {
+		fprintf(stderr, "Usage: wiggletools --group_pass reducer first|rest summary_file state_files input_files\n");
+		raiseError();
+	}
+	pass.reducer = reducer;
+	pass.first = strcmp(argv[1], "first") == 0;
+	pass.summaryPath = argv[2];
+	pass.statePaths = argv + 3;
+	pass.filenames = argv + 3 + stateCount(reducer);
+	pass.count = argc - 3 - stateCount(reducer);
+	reduceGroup(&pass);
+}
+
+//////////////////////////////////////////////////////
+// Running the groups
+//////////////////////////////////////////////////////
+
+static char * temporaryPath() {
+	const char * directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char * path = (char *) malloc(strlen(directory) + 32);
+	int fd;
+
+	sprintf(path, "%s/wiggletools_group_XXXXXX", directory);
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "Could not create temporary file %s\n", path);
+		raiseError();
+	}
+	close(fd);
+	return path;
+}
+
+// Forked workers exit without removing the files of their parent
+static void removeGroupedFiles() {
+	GroupedFiles * files;
+	int i;
+
+	if (getpid() != groupedFilesOwner)
+		return;
+	for (files = groupedFiles; files; files = files->next)
+		for (i = 0; i < files->groups * (stateCount(files->reducer) + 1); i++)
+			if (files->paths[i])
+				unlink(files->paths[i]);
+}
+
+static char ** groupPassArguments(GroupedFiles * files, int group) {
+	int states = stateCount(files->reducer);
+	int first = group * GROUP_SIZE;
+	int count = files->count - first < GROUP_SIZE ? files->count - first : GROUP_SIZE;
+	char ** argv = (char **) calloc(passOptionCount + count + states + 7, sizeof(char *));
+	int argc = 0, i;
+
+	argv[argc++] = "wiggletools";
+	for (i = 0; i < passOptionCount; i++)
+		argv[argc++] = passOptions[i];
+	argv[argc++] = "--group_pass";
+	argv[argc++] = (char *) reducerNames[files->reducer];
+	argv[argc++] = group ? "rest" : "first";
+	argv[argc++] = files->paths[files->groups * states + group];
+	for (i = 0; i < states; i++)
+		argv[argc++] = files->paths[group * states + i];
+	for (i = 0; i < count; i++)
+		argv[argc++] = files->filenames[first + i];
+	return argv;
+}
+
+// The arguments are built before forking, the child only executes
+static pid_t startGroupPass(char ** argv) {
+	pid_t child;
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((child = fork()) < 0) {
+		fprintf(stderr, "Could not fork a group pass\n");
+		raiseError();
+	} else if (child == 0) {
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	return child;
+}
+
+static void readGroupSummary(GroupSummary * summary, char * path) {
+	FILE * file = fopen(path, "rb");
+	if (!file || fread(summary, sizeof(GroupSummary), 1, file) != 1) {
+		fprintf(stderr, "Could not read temporary file %s\n", path);
+		raiseError();
+	}
+	fclose(file);
+}
+
+// Lets the other group passes finish before the error ends the process
+static void failGroups(GroupedFiles * files, int group, int running) {
+	int status;
+
+	for (; running; running--)
+		wait(&status);
+	fprintf(stderr, "Could not reduce the group of files starting with %s\n", files->filenames[group * GROUP_SIZE]);
+	raiseError();
+}
+
+static void runGroups(void * args) {
+	GroupedFiles * files = (GroupedFiles *) args;
+	int states = stateCount(files->reducer);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int passes = cpus < 1 ? 1 : cpus > MAX_GROUP_PASSES ? MAX_GROUP_PASSES : cpus;
+	pid_t * children = (pid_t *) calloc(files->groups, sizeof(pid_t));
+	char *** arguments = (char ***) calloc(files->groups, sizeof(char **));
+	int next = 0, running = 0, group, status, i;
+	pid_t child;
+
+	for (i = 0; i < files->groups * (states + 1); i++)
+		files->paths[i] = temporaryPath();
+	for (group = 0; group < files->groups; group++)
+		arguments[group] = groupPassArguments(files, group);
+
+	while (next < files->groups || running) {
+		if (next < files->groups && running < passes) {
+			children[next] = startGroupPass(arguments[next]);
+			next++;
+			running++;
+			continue;
+		}
+		if ((child = waitpid(-1, &status, 0)) < 0) {
+			fprintf(stderr, "Could not wait for a group pass\n");
+			raiseError();
+		}
+		for (group = 0; group < next && children[group] != child; group++);
+		if (group == next)
+			continue;
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failGroups(files, group, running);
+		readGroupSummary(files->summaries + group, files->paths[files->groups * states + group]);
+	}
+
+	for (group = 0; group < files->groups; group++)
+		free(arguments[group]);
+	free(arguments);
+	free(children);
+}
+
+static bool sameGroupedFiles(GroupedFiles * files, char ** filenames, int count, GroupedReducer reducer) {
+	int i;
+
+	if (files->reducer != reducer || files->count != count)
+		return false;
+	for (i = 0; i < count; i++)
+		if (strcmp(files->filenames[i], filenames[i]))
+			return false;
+	return true;
+}
+
+// Each thread of a multithreaded run parses the program, the groups are run by the first
+static GroupedFiles * findGroupedFiles(char ** filenames, int count, GroupedReducer reducer) {
+	GroupedFiles * files;
+
+	pthread_mutex_lock(&groupedFilesMutex);
+	for (files = groupedFiles; files; files = files->next)
+		if (sameGroupedFiles(files, filenames, count, reducer))
+			break;
+	if (!files) {
+		files = (GroupedFiles *) calloc(1, sizeof(GroupedFiles));
+		files->reducer = reducer;
+		files->filenames = filenames;
+		files->count = count;
+		files->groups = (count + GROUP_SIZE - 1) / GROUP_SIZE;
+		files->paths = (char **) calloc(files->groups * (stateCount(reducer) + 1), sizeof(char *));
+		files->summaries = (GroupSummary *) calloc(files->groups, sizeof(GroupSummary));
+		if (!groupedFiles) {
+			groupedFilesOwner = getpid();
+			atexit(&removeGroupedFiles);
+		}
+		files->next = groupedFiles;
+		groupedFiles = files;
+		files->failed = !catchErrors(&runGroups, files);
+	}
+	pthread_mutex_unlock(&groupedFilesMutex);
+	if (files->failed)
+		raiseError();
+	return files;
+}
+
+//////////////////////////////////////////////////////
+// Reduction over the groups
+//////////////////////////////////////////////////////
+
+typedef struct groupedReductionData_st {
+	Multiplexer * multi;
+	GroupedReducer reducer;
+	int groups;
+	int count;
+} GroupedReductionData;
+
+static double extremeOfGroups(const double * values, int groups, bool max) {
+	double res = values[0];
+	int i;
+
+	for (i = 1; i < groups; i++) {
+		if (isnan(values[i]))
+			return NAN;
+		if (max ? values[i] > res : values[i] < res)
+			res = values[i];
+	}
+	return res;
+}
+
+// Each group adds its own squared deviations, and those of its mean from
+// the overall mean, which is that of the values cast to float
+static double deviationsOfGroups(const double * values, int groups, int count) {
+	double floatSum = 0, mean, squares = 0;
+	int i;
+
+	for (i = 0; i < groups; i++)
+		floatSum += values[4 * i];
+	if (isnan(floatSum))
+		return NAN;
+	mean = floatSum / count;
+	for (i = 0; i < groups; i++) {
+		const double * states = values + 4 * i;
+		squares += states[3] + states[1] * (states[2] - mean) * (states[2] - mean);
+	}
+	return squares / count;
+}
+
+static double reduceGroups(GroupedReducer reducer, const double * values, int groups, int count) {
+	double sum = 0;
+	int i;
+
+	switch (reducer) {
+	case GROUPED_SUM:
+	case GROUPED_MEAN:
+		for (i = 0; i < groups; i++)
+			sum += values[i];
+		return reducer == GROUPED_SUM || isnan(sum) ? sum : sum / count;
+	case GROUPED_MAX:
+	case GROUPED_MIN:
+		return extremeOfGroups(values, groups, reducer == GROUPED_MAX);
+	case GROUPED_VARIANCE:
+		return deviationsOfGroups(values, groups, count);
+	default:
+		return sqrt(deviationsOfGroups(values, groups, count));
+	}
+}
+
+static void GroupedReductionPop(WiggleIterator * wi) {
+	GroupedReductionData * data = (GroupedReductionData *) wi->data;
+	Multiplexer * multi = data->multi;
+
+	if (wi->done)
+		return;
+	if (multi->done) {
+		wi->done = true;
+		return;
+	}
+	wi->chrom = multi->chrom;
+	wi->start = multi->start;
+	wi->finish = multi->finish;
+	wi->value = reduceGroups(data->reducer, multi->values, data->groups, data->count);
+	popMultiplexer(multi);
+}
+
+static void GroupedReductionSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	seekMultiplexer(((GroupedReductionData *) wi->data)->multi, chrom, start, finish);
+	pop(wi);
+}
+
+// As computed by the reducers over all the default values
+static double groupedDefault(GroupedFiles * files) {
+	double sum = 0, squares = 0, mean, max = -INFINITY, min = INFINITY;
+	int i;
+
+	for (i = 0; i < files->groups; i++)
+		sum += files->summaries[i].sum;
+	mean = sum / files->count;
+	for (i = 0; i < files->groups; i++) {
+		GroupSummary * summary = files->summaries + i;
+		int size = i < files->groups - 1 ? GROUP_SIZE : files->count - i * GROUP_SIZE;
+		double groupMean = summary->sum / size;
+		squares += summary->squares + size * (groupMean - mean) * (groupMean - mean);
+		if (isnan(summary->max) || isnan(max))
+			max = min = NAN;
+		else {
+			max = summary->max > max ? summary->max : max;
+			min = summary->min < min ? summary->min : min;
+		}
+	}
+
+	switch (files->reducer) {
+	case GROUPED_SUM:
+		return sum;
+	case GROUPED_MEAN:
+		return (float) mean;
+	case GROUPED_MAX:
+		return max;
+	case GROUPED_MIN:
+		return min;
+	case GROUPED_VARIANCE:
+		return isnan(sum) ? NAN : squares / files->count;
+	default:
+		return isnan(sum) ? NAN : sqrt(squares / files->count);
+	}
+}
+
+WiggleIterator * GroupedReduction(char ** filenames, int count, GroupedReducer reducer) {
+	GroupedFiles * files = findGroupedFiles(filenames, count, reducer);
+	GroupedReductionData * data = (GroupedReductionData *) calloc(1, sizeof(GroupedReductionData));
+	int states = stateCount(reducer);
+	WiggleIterator ** iters = (WiggleIterator **) calloc(files->groups * states, sizeof(WiggleIterator *));
+	WiggleIterator * res;
+	bool finite = true, integral = true;
+	int i;
+
+	for (i = 0; i < files->groups * states; i++) {
+		iters[i] = TrackCacheReader(files->paths[i]);
+		iters[i]->default_value = files->summaries[i / states].defaults[i % states];
+		finite &= files->summaries[i / states].finite;
+		integral &= files->summaries[i / states].integral;
+	}
+	data->multi = newMultiplexer(iters, files->groups * states, false);
+	data->reducer = reducer;
+	data->groups = files->groups;
+	data->count = count;
+	res = newWiggleIterator(data, &GroupedReductionPop, &GroupedReductionSeek, groupedDefault(files));
+	res->finite = finite && reducer != GROUPED_VARIANCE && reducer != GROUPED_STDDEV;
+	res->integral = integral;
+	return res;
+}
@@ -0,0 +1,226 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "indexHeap.h"
+#include "errors.h"
+
+// Below this capacity, a linear scan beats heap maintenance
+#define LINEAR_SCAN_MAX 8
+#define ARITY 4
+
+struct indexHeap_st {
+	int capacity;
+	int size;
+	int * keys;
+	int * indices;
+	// Of ih_extractmins
+	int * tiePositions, * ties;
+};
+
+IndexHeap * ih_makeheap(int capacity) {
+	IndexHeap * new = (IndexHeap *) calloc(1, sizeof(IndexHeap));
+	new->capacity = capacity;
+	new->keys = (int *) calloc(capacity, sizeof(int));
+	new->indices = (int *) calloc(capacity, sizeof(int));
+	new->tiePositions = (int *) calloc(capacity, sizeof(int));
+	new->ties = (int *) calloc(capacity, sizeof(int));
+	if (!new->keys || !new->indices || !new->tiePositions || !new->ties) {
+		fprintf(stderr, "Could not allocate heap of capacity %i\n", capacity);
+		raiseError();
+	}
+	return new;
+}
+
+void ih_deleteheap(IndexHeap * heap) {
+	free(heap->keys);
+	free(heap->indices);
+	free(heap->tiePositions);
+	free(heap->ties);
+	free(heap);
+}
+
+void ih_clear(IndexHeap * heap) {
+	heap->size = 0;
+}
+
+int ih_empty(IndexHeap * heap) {
+	return heap->size == 0;
+}
+
+int ih_notempty(IndexHeap * heap) {
+	return heap->size > 0;
+}
+
+static int lessThan(IndexHeap * heap, int a, int b) {
+	return heap->keys[a] < heap->keys[b] || (heap->keys[a] == heap->keys[b] && heap->indices[a] < heap->indices[b]);
+}
+
+static void swap(IndexHeap * heap, int a, int b) {
+	int key = heap->keys[a];
+	int index = heap->indices[a];
+	heap->keys[a] = heap->keys[b];
+	heap->indices[a] = heap->indices[b];
+	heap->keys[b] = key;
+	heap->indices[b] = index;
+}
+
+//////////////////////////////////////////////////////
+// Linear scan
+//////////////////////////////////////////////////////
+
+static int linearMinPosition(IndexHeap * heap) {
+	int res = 0;
+	int i;
+	for (i = 1; i < heap->size; i++)
+		if (lessThan(heap, i, res))
+			res = i;
+	return res;
+}
+
+//////////////////////////////////////////////////////
+// 4-ary heap
+//////////////////////////////////////////////////////
+
+static void siftUp(IndexHeap * heap, int pos) {
+	while (pos > 0) {
+		int parent = (pos - 1) / ARITY;
+		if (!lessThan(heap, pos, parent))
+			break;
+		swap(heap, pos, parent);
+		pos = parent;
+	}
+}
+
+static void siftDown(IndexHeap * heap, int pos) {
+	for (;;) {
+		int first = pos * ARITY + 1;
+		int last = first + ARITY;
+		int smallest = pos;
+		int child;
+
+		if (last > heap->size)
+			last = heap->size;
+		for (child = first; child < last; child++)
+			if (lessThan(heap, child, smallest))
+				smallest = child;
+
+		if (smallest == pos)
+			break;
+		swap(heap, pos, smallest);
+		pos = smallest;
+	}
+}
+
+// Floyd's construction, in linear time
+static void heapify(IndexHeap * heap) {
+	int pos;
+	for (pos = (heap->size - 2) / ARITY; pos >= 0; pos--)
+		siftDown(heap, pos);
+}
+
+// The entries with the minimum key form a subtree under the root, which is
+// walked breadth first
+static int findTies(IndexHeap * heap) {
+	int key = heap->keys[0];
+	int count = 1, next, child, last;
+
+	heap->tiePositions[0] = 0;
+	for (next = 0; next < count; next++) {
+		child = heap->tiePositions[next] * ARITY + 1;
+		last = child + ARITY < heap->size ? child + ARITY : heap->size;
+		for (; child < last; child++)
+			if (heap->keys[child] == key)
+				heap->tiePositions[count++] = child;
+	}
+	return count;
+}
+
+static int compareInts(const void * A, const void * B) {
+	int a = *(const int *) A, b = *(const int *) B;
+	return a < b ? -1 : a > b;
+}
+
+//////////////////////////////////////////////////////
+// Public functions
+//////////////////////////////////////////////////////
+
+void ih_insert(IndexHeap * heap, int key, int index) {
+	if (heap->size == heap->capacity) {
+		fprintf(stderr, "Heap overflow: capacity %i exceeded\n", heap->capacity);
+		raiseError();
+	}
+	heap->keys[heap->size] = key;
+	heap->indices[heap->size] = index;
+	heap->size++;
+	if (heap->capacity > LINEAR_SCAN_MAX)
+		siftUp(heap, heap->size - 1);
+}
+
+int ih_min(IndexHeap * heap) {
+	if (heap->capacity > LINEAR_SCAN_MAX)
+		return heap->keys[0];
+	else
+		return heap->keys[linearMinPosition(heap)];
+}
+
+int ih_extractmin(IndexHeap * heap) {
+	int pos = heap->capacity > LINEAR_SCAN_MAX ? 0 : linearMinPosition(heap);
+	int res = heap->indices[pos];
+
+	heap->size--;
+	heap->keys[pos] = heap->keys[heap->size];
+	heap->indices[pos] = heap->indices[heap->size];
+	if (heap->capacity > LINEAR_SCAN_MAX && heap->size)
+		siftDown(heap, 0);
+
+	return res;
+}
+
+// When many inputs of a multiplexer share their breakpoints, e.g. binned
+// tracks, most of the heap goes at each step: rebuilding the rest in one go
+// beats sifting down once per entry
+int ih_extractmins(IndexHeap * heap, int ** indices) {
+	int count, i, kept, tie;
+
+	*indices = heap->ties;
+	if (heap->size == 0)
+		return 0;
+	if (heap->capacity <= LINEAR_SCAN_MAX || (count = findTies(heap)) * ARITY < heap->size) {
+		int key = ih_min(heap);
+		for (count = 0; heap->size && ih_min(heap) == key; count++)
+			heap->ties[count] = ih_extractmin(heap);
+		return count;
+	}
+
+	for (i = 0; i < count; i++)
+		heap->ties[i] = heap->indices[heap->tiePositions[i]];
+	qsort(heap->ties, count, sizeof(int), compareInts);
+	qsort(heap->tiePositions, count, sizeof(int), compareInts);
+	for (i = 0, kept = 0, tie = 0; i < heap->size; i++) {
+		if (tie < count && heap->tiePositions[tie] == i) {
+			tie++;
+			continue;
+		}
+		heap->keys[kept] = heap->keys[i];
+		heap->indices[kept] = heap->indices[i];
+		kept++;
+	}
+	heap->size = kept;
+	heapify(heap);
+	return count;
+}
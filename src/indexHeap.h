@@ -0,0 +1,38 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _INDEX_HEAP_H_
+#define _INDEX_HEAP_H_
+
+// Bounded priority queue of (key, index) pairs, where each index in
+// [0, capacity) is present at most once. Ties are broken by index.
+// Stored in flat arrays, as a 4-ary heap, or as an unsorted list
+// scanned linearly when the capacity is small.
+typedef struct indexHeap_st IndexHeap;
+
+IndexHeap *ih_makeheap(int capacity);
+void ih_insert(IndexHeap *, int key, int index);
+int ih_empty(IndexHeap *);
+int ih_notempty(IndexHeap *);
+int ih_min(IndexHeap *);
+int ih_extractmin(IndexHeap *);
+// Extracts all the entries with the minimum key at once, in the order of
+// successive ih_extractmin calls, into an array owned by the heap, which
+// is valid until the next call. Returns their number.
+int ih_extractmins(IndexHeap *, int ** indices);
+void ih_clear(IndexHeap *);
+void ih_deleteheap(IndexHeap *);
+
+#endif
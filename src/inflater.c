@@ -0,0 +1,334 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "wiggletools.h"
+#include "inflater.h"
+#include "memoryUsage.h"
+#include "tracer.h"
+
+// Uncompressed size of a BGZF member at most
+#define BGZF_BLOCK_SIZE 0x10000
+// Blocks of a plain gzipped file
+#define GZIP_BLOCK_SIZE (1024 * 1024)
+#define GZIP_WINDOW 4
+// BGZF members inflated ahead per thread
+#define BGZF_BLOCKS_PER_THREAD 8
+
+typedef struct inflatedBlock_st {
+	int64_t index;
+	bool ready;
+	bool failed;
+	char * data;
+	size_t length;
+} InflatedBlock;
+
+struct inflater_st {
+	char * filename;
+	// BGZF members are read from the file, and inflated outside the read lock
+	FILE * file;
+	// Other files are read through zlib
+	gzFile gz_file;
+	size_t blockSize;
+	// Block i goes to slot i % window. Blocks up to held + window - 1 can be
+	// inflated, held being the block read by the reader.
+	InflatedBlock * slots;
+	int window;
+	int64_t nextBlock;
+	int64_t held;
+	bool holding;
+	// Set once the end of the file is read
+	bool ended;
+	int64_t blockCount;
+	bool stop;
+	pthread_mutex_t readLock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t * threads;
+	int threadCount;
+};
+
+static int inflateThreads = 4;
+
+void setInflateThreads(int threads) {
+	if (threads < 0) {
+		fprintf(stderr, "Number of inflating threads cannot be negative: %i\n", threads);
+		raiseError();
+	}
+	inflateThreads = threads;
+}
+
+int inflatingAhead() {
+	return inflateThreads > 0;
+}
+
+//////////////////////////////////////////////////////
+// BGZF members
+//////////////////////////////////////////////////////
+
+static unsigned int littleEndian(unsigned char * bytes, int length) {
+	unsigned int value = 0;
+	int i;
+
+	for (i = length - 1; i >= 0; i--)
+		value = (value << 8) | bytes[i];
+	return value;
+}
+
+// Size of the BGZF member starting with this gzip header, 0 if the header
+// has no BGZF field
+static size_t bgzfMemberSize(unsigned char * header, unsigned char * extra, int extraLength) {
+	int pos = 0;
+
+	if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4))
+		return 0;
+	while (pos + 4 <= extraLength) {
+		int length = littleEndian(extra + pos + 2, 2);
+		if (extra[pos] == 'B' && extra[pos + 1] == 'C' && length == 2 && pos + 6 <= extraLength)
+			return littleEndian(extra + pos + 4, 2) + 1;
+		pos += 4 + length;
+	}
+	return 0;
+}
+
+static bool isBgzf(FILE * file) {
+	unsigned char header[18];
+	bool bgzf = fread(header, 1, 18, file) == 18 && bgzfMemberSize(header, header + 12, littleEndian(header + 10, 2) < 6 ? littleEndian(header + 10, 2) : 6) > 0;
+	rewind(file);
+	return bgzf;
+}
+
+// Reads the deflated data and trailer of the next member into buffer.
+// Returns its length, 0 at the end of the file, -1 if the file is corrupted.
+static int readBgzfMember(FILE * file, unsigned char * buffer) {
+	unsigned char header[12];
+	size_t read = fread(header, 1, 12, file), extraLength, size;
+
+	if (read == 0)
+		return 0;
+	extraLength = littleEndian(header + 10, 2);
+	if (read < 12 || fread(buffer, 1, extraLength, file) != extraLength)
+		return -1;
+	size = bgzfMemberSize(header, buffer, extraLength);
+	if (size < 12 + extraLength + 8 || size > BGZF_BLOCK_SIZE)
+		return -1;
+	size -= 12 + extraLength;
+	if (fread(buffer, 1, size, file) != size)
+		return -1;
+	return size;
+}
+
+static bool inflateBgzfMember(z_stream * stream, unsigned char * member, int length, InflatedBlock * block) {
+	unsigned int crc = littleEndian(member + length - 8, 4);
+	unsigned int size = littleEndian(member + length - 4, 4);
+
+	if (size > BGZF_BLOCK_SIZE || inflateReset(stream) != Z_OK)
+		return false;
+	stream->next_in = member;
+	stream->avail_in = length - 8;
+	stream->next_out = (unsigned char *) block->data;
+	stream->avail_out = BGZF_BLOCK_SIZE;
+	if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != size)
+		return false;
+	block->length = size;
+	return crc32(crc32(0L, Z_NULL, 0), (unsigned char *) block->data, size) == crc;
+}
+
+//////////////////////////////////////////////////////
+// Inflating threads
+//////////////////////////////////////////////////////
+
+// Blocks are numbered as they are read, under the read lock, so that their
+// order is the file order whichever thread inflates them
+static void * runInflateThread(void * args) {
+	Inflater * inflater = (Inflater *) args;
+	unsigned char * member = inflater->file ? (unsigned char *) malloc(BGZF_BLOCK_SIZE) : NULL;
+	z_stream stream;
+
+	nameTraceThread("inflate");
+	memset(&stream, 0, sizeof(z_stream));
+	if (member && inflateInit2(&stream, -15) != Z_OK) {
+		free(member);
+		member = NULL;
+	}
+
+	while (true) {
+		int length = 0;
+		bool failed = false;
+
+		pthread_mutex_lock(&inflater->readLock);
+		pthread_mutex_lock(&inflater->lock);
+		while (!inflater->stop && !inflater->ended && inflater->nextBlock >= inflater->held + inflater->window)
+			pthread_cond_wait(&inflater->cond, &inflater->lock);
+		if (inflater->stop || inflater->ended) {
+			pthread_mutex_unlock(&inflater->lock);
+			pthread_mutex_unlock(&inflater->readLock);
+			break;
+		}
+		int64_t index = inflater->nextBlock++;
+		InflatedBlock * block = inflater->slots + index % inflater->window;
+		pthread_mutex_unlock(&inflater->lock);
+
+		if (!inflater->file)
+			length = gzread(inflater->gz_file, block->data, inflater->blockSize);
+		else if (member)
+			length = readBgzfMember(inflater->file, member);
+		else
+			length = -1;
+
+		// The end of the file is marked before the next block is read
+		if (length <= 0) {
+			pthread_mutex_lock(&inflater->lock);
+			inflater->ended = true;
+			inflater->blockCount = length == 0 ? index : index + 1;
+			block->index = index;
+			block->failed = true;
+			block->ready = length < 0;
+			pthread_cond_broadcast(&inflater->cond);
+			pthread_mutex_unlock(&inflater->lock);
+			pthread_mutex_unlock(&inflater->readLock);
+			break;
+		}
+		pthread_mutex_unlock(&inflater->readLock);
+
+		if (!inflater->file)
+			block->length = length;
+		else {
+			double start = traceClock();
+			failed = !inflateBgzfMember(&stream, member, length, block);
+			traceSpan("inflate", start);
+		}
+
+		pthread_mutex_lock(&inflater->lock);
+		block->index = index;
+		block->failed = failed;
+		block->ready = true;
+		pthread_cond_broadcast(&inflater->cond);
+		pthread_mutex_unlock(&inflater->lock);
+	}
+
+	if (member) {
+		inflateEnd(&stream);
+		free(member);
+	}
+	return NULL;
+}
+
+//////////////////////////////////////////////////////
+// Reading
+//////////////////////////////////////////////////////
+
+char * nextInflatedBlock(Inflater * inflater, size_t * length) {
+	InflatedBlock * block;
+
+	pthread_mutex_lock(&inflater->lock);
+	if (inflater->holding) {
+		inflater->slots[inflater->held % inflater->window].ready = false;
+		inflater->held++;
+		inflater->holding = false;
+		pthread_cond_broadcast(&inflater->cond);
+	}
+	block = inflater->slots + inflater->held % inflater->window;
+	double start = traceClock();
+	while (!(block->ready && block->index == inflater->held) && !(inflater->ended && inflater->held >= inflater->blockCount))
+		pthread_cond_wait(&inflater->cond, &inflater->lock);
+	traceSpan("wait for inflated block", start);
+	if (!(block->ready && block->index == inflater->held)) {
+		pthread_mutex_unlock(&inflater->lock);
+		return NULL;
+	}
+	inflater->holding = true;
+	pthread_mutex_unlock(&inflater->lock);
+
+	if (block->failed) {
+		fprintf(stderr, "Corrupted compressed file %s\n", inflater->filename);
+		raiseError();
+	}
+	*length = block->length;
+	return block->data;
+}
+
+Inflater * newInflater(char * filename) {
+	Inflater * inflater = (Inflater *) calloc(1, sizeof(Inflater));
+	int i;
+
+	if (!(inflater->file = fopen(filename, "rb"))) {
+		free(inflater);
+		return NULL;
+	}
+	if (isBgzf(inflater->file)) {
+		inflater->blockSize = BGZF_BLOCK_SIZE;
+		inflater->threadCount = inflateThreads;
+		inflater->window = BGZF_BLOCKS_PER_THREAD * inflateThreads;
+	} else {
+		fclose(inflater->file);
+		inflater->file = NULL;
+		if (!(inflater->gz_file = gzopen(filename, "r"))) {
+			free(inflater);
+			return NULL;
+		}
+		inflater->blockSize = GZIP_BLOCK_SIZE;
+		inflater->threadCount = 1;
+		inflater->window = GZIP_WINDOW;
+	}
+
+	inflater->filename = filename;
+	inflater->slots = (InflatedBlock *) calloc(inflater->window, sizeof(InflatedBlock));
+	for (i = 0; i < inflater->window; i++)
+		inflater->slots[i].data = (char *) malloc(inflater->blockSize);
+	countMemory(MEMORY_READERS, inflater->window * inflater->blockSize);
+	pthread_mutex_init(&inflater->readLock, NULL);
+	pthread_mutex_init(&inflater->lock, NULL);
+	pthread_cond_init(&inflater->cond, NULL);
+	inflater->threads = (pthread_t *) calloc(inflater->threadCount, sizeof(pthread_t));
+	for (i = 0; i < inflater->threadCount; i++) {
+		if (pthread_create(inflater->threads + i, NULL, &runInflateThread, inflater)) {
+			fprintf(stderr, "Could not create inflating thread\n");
+			raiseError();
+		}
+	}
+	return inflater;
+}
+
+void destroyInflater(Inflater * inflater) {
+	int i;
+
+	pthread_mutex_lock(&inflater->lock);
+	inflater->stop = true;
+	pthread_cond_broadcast(&inflater->cond);
+	pthread_mutex_unlock(&inflater->lock);
+	for (i = 0; i < inflater->threadCount; i++)
+		pthread_join(inflater->threads[i], NULL);
+
+	for (i = 0; i < inflater->window; i++)
+		free(inflater->slots[i].data);
+	countMemory(MEMORY_READERS, -(long long) (inflater->window * inflater->blockSize));
+	free(inflater->slots);
+	free(inflater->threads);
+	if (inflater->file)
+		fclose(inflater->file);
+	if (inflater->gz_file)
+		gzclose(inflater->gz_file);
+	pthread_mutex_destroy(&inflater->readLock);
+	pthread_mutex_destroy(&inflater->lock);
+	pthread_cond_destroy(&inflater->cond);
+	free(inflater);
+}
@@ -0,0 +1,38 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _INFLATER_H_
+#define _INFLATER_H_
+
+#include <stddef.h>
+
+// Gzipped files inflated ahead of their reader
+//
+// The members of a bgzipped file are independent, and are inflated on a
+// few threads at once. Other gzipped files are inflated on one thread.
+// Either way, the inflated bytes come out in blocks, in file order.
+
+typedef struct inflater_st Inflater;
+
+// Returns NULL if the file cannot be opened
+Inflater * newInflater(char * filename);
+// Next block of inflated bytes, valid until the next call. Returns NULL at
+// the end of the file. Raises an error if the file is corrupted.
+char * nextInflatedBlock(Inflater * inflater, size_t * length);
+void destroyInflater(Inflater * inflater);
+// Whether files are inflated ahead (see setInflateThreads)
+int inflatingAhead();
+
+#endif
@@ -0,0 +1,596 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "integerTrack.h"
+
+static const char magic[8] = "WTINTEG";
+// Reads differently on a machine of the other endianness
+static const uint32_t byteOrderMark = 0x01020304;
+#define HEADER_SIZE 16
+#define TRAILER_SIZE 32
+// Records per block, small enough for a seek to decode a block quickly
+#define INTEGER_BLOCK_SIZE 4096
+// Bytes of a varint of 64 bits
+#define MAX_VARINT_SIZE 10
+// Beyond this, doubles do not hold all the integers
+#define MAX_INTEGER_VALUE 9007199254740992.0
+
+typedef struct integerBlock_st {
+	int64_t offset;
+	int32_t size;
+	int32_t count;
+	int32_t lastFinish;
+	int32_t padding;
+} IntegerBlock;
+
+typedef struct integerChrom_st {
+	int32_t name;
+	int32_t firstBlock;
+	int32_t blockCount;
+	int32_t padding;
+} IntegerChrom;
+
+bool isIntegerTrackFilename(const char * filename) {
+	size_t length = strlen(filename);
+	return length > 4 && !strcmp(filename + length - 4, ".wti");
+}
+
+//////////////////////////////////////////////////////
+// Writer
+//////////////////////////////////////////////////////
+
+struct integerTrackWriter_st {
+	FILE * file;
+	int64_t offset;
+	bool finished;
+	// Block being filled
+	unsigned char buffer[INTEGER_BLOCK_SIZE * 3 * MAX_VARINT_SIZE];
+	int size;
+	int count;
+	int lastFinish;
+	int64_t lastValue;
+	// Index
+	IntegerBlock * blocks;
+	int blockCount, maxBlocks;
+	IntegerChrom * chroms;
+	char ** labels;
+	int chromCount, maxChroms;
+};
+
+static void writeIntegerTrackBytes(IntegerTrackWriter * writer, const void * values, size_t size, size_t count) {
+	if (fwrite(values, size, count, writer->file) != count) {
+		fprintf(stderr, "Could not write integer track file\n");
+		raiseError();
+	}
+	writer->offset += size * count;
+}
+
+IntegerTrackWriter * openIntegerTrackWriter(FILE * file) {
+	IntegerTrackWriter * writer = (IntegerTrackWriter *) calloc(1, sizeof(IntegerTrackWriter));
+	int32_t flags = 0;
+	if (!writer) {
+		fprintf(stderr, "Could not allocate integer track writer\n");
+		raiseError();
+	}
+	writer->file = file;
+	writeIntegerTrackBytes(writer, magic, 1, sizeof(magic));
+	writeIntegerTrackBytes(writer, &byteOrderMark, sizeof(byteOrderMark), 1);
+	writeIntegerTrackBytes(writer, &flags, sizeof(flags), 1);
+	return writer;
+}
+
+static void writeIntegerTrackPadding(IntegerTrackWriter * writer) {
+	static const char zeros[8] = {0};
+	if (writer->offset % 8)
+		writeIntegerTrackBytes(writer, zeros, 1, 8 - writer->offset % 8);
+}
+
+static void flushIntegerBlock(IntegerTrackWriter * writer) {
+	IntegerBlock * block;
+
+	if (writer->count == 0)
+		return;
+	if (writer->blockCount == writer->maxBlocks) {
+		writer->maxBlocks = writer->maxBlocks ? 2 * writer->maxBlocks : 64;
+		writer->blocks = (IntegerBlock *) realloc(writer->blocks, writer->maxBlocks * sizeof(IntegerBlock));
+	}
+	block = writer->blocks + writer->blockCount++;
+	block->offset = writer->offset;
+	block->size = writer->size;
+	block->count = writer->count;
+	block->lastFinish = writer->lastFinish;
+	block->padding = 0;
+	writer->chroms[writer->chromCount - 1].blockCount++;
+
+	writeIntegerTrackBytes(writer, writer->buffer, 1, writer->size);
+	writeIntegerTrackPadding(writer);
+	writer->size = 0;
+	writer->count = 0;
+	writer->lastFinish = 0;
+	writer->lastValue = 0;
+}
+
+// The reader looks chromosomes up by binary search
+static void addIntegerChrom(IntegerTrackWriter * writer, char * chrom) {
+	if (writer->chromCount && compareChroms(chrom, writer->labels[writer->chromCount - 1]) <= 0) {
+		fprintf(stderr, "Integer track input is not sorted: chromosome %s comes after %s\n", chrom, writer->labels[writer->chromCount - 1]);
+		raiseError();
+	}
+	if (writer->chromCount == writer->maxChroms) {
+		writer->maxChroms = writer->maxChroms ? 2 * writer->maxChroms : 64;
+		writer->chroms = (IntegerChrom *) realloc(writer->chroms, writer->maxChroms * sizeof(IntegerChrom));
+		writer->labels = (char **) realloc(writer->labels, writer->maxChroms * sizeof(char *));
+	}
+	writer->labels[writer->chromCount] = chrom;
+	writer->chroms[writer->chromCount].firstBlock = writer->blockCount;
+	writer->chroms[writer->chromCount].blockCount = 0;
+	writer->chroms[writer->chromCount].padding = 0;
+	writer->chromCount++;
+}
+
+static void packVarint(IntegerTrackWriter * writer, uint64_t value) {
+	while (value >= 0x80) {
+		writer->buffer[writer->size++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	writer->buffer[writer->size++] = value;
+}
+
+void addIntegerTrackValue(IntegerTrackWriter * writer, char * chrom, int start, int finish, double value) {
+	int64_t integer, delta;
+
+	if (writer->finished) {
+		fprintf(stderr, "Cannot add records to a finished integer track file\n");
+		raiseError();
+	}
+	if (isnan(value) || finish <= start)
+		return;
+	if (value != floor(value) || fabs(value) > MAX_INTEGER_VALUE) {
+		fprintf(stderr, "Integer track files only store integer values: %s:%i-%i has value %lf\n", chrom, start - 1, finish - 1, value);
+		raiseError();
+	}
+
+	if (writer->chromCount == 0 || writer->labels[writer->chromCount - 1] != chrom) {
+		flushIntegerBlock(writer);
+		addIntegerChrom(writer, chrom);
+	} else if (start < writer->lastFinish) {
+		fprintf(stderr, "Integer track input is not sorted or overlaps: %s:%i comes after %s:%i\n", chrom, start, chrom, writer->lastFinish);
+		raiseError();
+	}
+
+	integer = (int64_t) value;
+	delta = integer - writer->lastValue;
+	packVarint(writer, start - writer->lastFinish);
+	packVarint(writer, finish - start);
+	packVarint(writer, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+	writer->lastFinish = finish;
+	writer->lastValue = integer;
+	if (++writer->count == INTEGER_BLOCK_SIZE)
+		flushIntegerBlock(writer);
+}
+
+void finishIntegerTrackWriter(IntegerTrackWriter * writer) {
+	int64_t blockTable, chromTable;
+	int32_t count;
+	int i, names = 0;
+
+	flushIntegerBlock(writer);
+
+	blockTable = writer->offset;
+	writeIntegerTrackBytes(writer, writer->blocks, sizeof(IntegerBlock), writer->blockCount);
+
+	chromTable = writer->offset;
+	for (i = 0; i < writer->chromCount; i++) {
+		writer->chroms[i].name = names;
+		names += strlen(writer->labels[i]) + 1;
+	}
+	writeIntegerTrackBytes(writer, writer->chroms, sizeof(IntegerChrom), writer->chromCount);
+	for (i = 0; i < writer->chromCount; i++)
+		writeIntegerTrackBytes(writer, writer->labels[i], 1, strlen(writer->labels[i]) + 1);
+	writeIntegerTrackPadding(writer);
+
+	writeIntegerTrackBytes(writer, &blockTable, sizeof(blockTable), 1);
+	writeIntegerTrackBytes(writer, &chromTable, sizeof(chromTable), 1);
+	count = writer->blockCount;
+	writeIntegerTrackBytes(writer, &count, sizeof(count), 1);
+	count = writer->chromCount;
+	writeIntegerTrackBytes(writer, &count, sizeof(count), 1);
+	writeIntegerTrackBytes(writer, magic, 1, sizeof(magic));
+	fflush(writer->file);
+	writer->finished = true;
+}
+
+//////////////////////////////////////////////////////
+// Tee operator
+//////////////////////////////////////////////////////
+
+typedef struct integerTrackTeeData_st {
+	WiggleIterator * iter;
+	IntegerTrackWriter * writer;
+	// Memos are written to a temporary file, renamed once complete
+	char * filename;
+	char * tmpFilename;
+} IntegerTrackTeeData;
+
+static void publishIntegerTrackMemo(IntegerTrackTeeData * data) {
+	finishIntegerTrackWriter(data->writer);
+	if (fclose(data->writer->file) || rename(data->tmpFilename, data->filename))
+		// Another process may have published it first, nothing is lost
+		unlink(data->tmpFilename);
+	free(data->writer);
+	data->writer = NULL;
+}
+
+// A memo of the regions seeked would pass for the whole track
+static void abandonIntegerTrackMemo(IntegerTrackTeeData * data) {
+	fclose(data->writer->file);
+	unlink(data->tmpFilename);
+	free(data->writer);
+	data->writer = NULL;
+}
+
+static void IntegerTrackTeeWiggleIteratorPop(WiggleIterator * wi) {
+	IntegerTrackTeeData * data = (IntegerTrackTeeData *) wi->data;
+	WiggleIterator * iter = data->iter;
+
+	if (!iter->done) {
+		wi->chrom = iter->chrom;
+		wi->start = iter->start;
+		wi->finish = iter->finish;
+		wi->value = iter->value;
+		if (data->writer)
+			addIntegerTrackValue(data->writer, iter->chrom, iter->start, iter->finish, iter->value);
+		pop(iter);
+	} else {
+		if (data->writer && data->filename)
+			publishIntegerTrackMemo(data);
+		else if (data->writer && !data->writer->finished)
+			finishIntegerTrackWriter(data->writer);
+		wi->done = true;
+	}
+}
+
+static void IntegerTrackTeeWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	IntegerTrackTeeData * data = (IntegerTrackTeeData *) wi->data;
+	if (data->writer && data->filename)
+		abandonIntegerTrackMemo(data);
+	seek(data->iter, chrom, start, finish);
+	wi->done = false;
+	pop(wi);
+}
+
+// Overlapping regions are merged, and runs of equal values joined, so that
+// each record costs a few bytes
+WiggleIterator * IntegerTrackTeeWiggleIterator(WiggleIterator * i, FILE * outfile) {
+	IntegerTrackTeeData * data = (IntegerTrackTeeData *) calloc(1, sizeof(IntegerTrackTeeData));
+	data->iter = CompressionWiggleIterator(NonOverlappingWiggleIterator(i));
+	data->writer = openIntegerTrackWriter(outfile);
+	WiggleIterator * res = newWiggleIterator(data, &IntegerTrackTeeWiggleIteratorPop, &IntegerTrackTeeWiggleIteratorSeek, i->default_value);
+	res->finite = i->finite;
+	res->integral = i->integral;
+	return res;
+}
+
+// Same, but the file is only written if the iterator is run to the end
+// without a seek. Memos which cannot be written are skipped silently.
+WiggleIterator * IntegerTrackMemoWiggleIterator(WiggleIterator * i, char * filename) {
+	static int memoCount = 0;
+	IntegerTrackTeeData * data;
+	FILE * file;
+
+	char * tmpFilename = (char *) malloc(strlen(filename) + 48);
+	sprintf(tmpFilename, "%s.tmp-%i-%i", filename, (int) getpid(), __atomic_add_fetch(&memoCount, 1, __ATOMIC_RELAXED));
+	if (!(file = fopen(tmpFilename, "wb"))) {
+		free(tmpFilename);
+		return i;
+	}
+	data = (IntegerTrackTeeData *) calloc(1, sizeof(IntegerTrackTeeData));
+	data->iter = CompressionWiggleIterator(NonOverlappingWiggleIterator(i));
+	data->writer = openIntegerTrackWriter(file);
+	data->filename = filename;
+	data->tmpFilename = tmpFilename;
+	WiggleIterator * res = newWiggleIterator(data, &IntegerTrackTeeWiggleIteratorPop, &IntegerTrackTeeWiggleIteratorSeek, i->default_value);
+	res->finite = i->finite;
+	res->integral = i->integral;
+	return res;
+}
+
+//////////////////////////////////////////////////////
+// Reader
+//////////////////////////////////////////////////////
+
+typedef struct integerTrackReaderData_st {
+	char * filename;
+	const char * map;
+	size_t size;
+	const IntegerBlock * blocks;
+	int blockCount;
+	const IntegerChrom * chroms;
+	char ** labels;
+	int chromCount;
+	// Current block, and next record within it
+	int chrom;
+	int block;
+	int index;
+	int count;
+	const unsigned char * ptr;
+	const unsigned char * end;
+	int lastFinish;
+	int64_t lastValue;
+	// Set by a seek, the records are then trimmed to [start, stop) on chromosome chrom
+	bool limited;
+	int start;
+	int stop;
+} IntegerTrackReaderData;
+
+static void corruptedIntegerTrack(IntegerTrackReaderData * data) {
+	fprintf(stderr, "Corrupted integer track file %s\n", data->filename);
+	raiseError();
+}
+
+static void loadIntegerBlock(IntegerTrackReaderData * data, int block) {
+	const IntegerBlock * entry = data->blocks + block;
+	data->block = block;
+	data->index = 0;
+	data->count = entry->count;
+	data->ptr = (const unsigned char *) data->map + entry->offset;
+	data->end = data->ptr + entry->size;
+	data->lastFinish = 0;
+	data->lastValue = 0;
+}
+
+// Returns false at the end of the file, or of the chromosome of a seek
+static bool nextIntegerBlock(IntegerTrackReaderData * data) {
+	const IntegerChrom * chrom = data->chroms + data->chrom;
+	if (!data->blockCount)
+		return false;
+	if (data->block + 1 == chrom->firstBlock + chrom->blockCount) {
+		if (data->limited || data->chrom + 1 == data->chromCount)
+			return false;
+		data->chrom++;
+	}
+	loadIntegerBlock(data, data->block + 1);
+	return true;
+}
+
+static uint64_t unpackVarint(IntegerTrackReaderData * data) {
+	uint64_t value = 0;
+	int shift;
+
+	for (shift = 0; data->ptr < data->end && shift < 64; shift += 7) {
+		unsigned char byte = *data->ptr++;
+		value |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	corruptedIntegerTrack(data);
+	return 0;
+}
+
+// Next record of the current block
+static void unpackIntegerRecord(IntegerTrackReaderData * data, int * start, int * finish, double * value) {
+	uint64_t gap = unpackVarint(data);
+	uint64_t length = unpackVarint(data);
+	uint64_t delta = unpackVarint(data);
+
+	if (gap > INT32_MAX || length == 0 || length > INT32_MAX || data->lastFinish + gap + length > INT32_MAX)
+		corruptedIntegerTrack(data);
+	*start = data->lastFinish + gap;
+	*finish = *start + length;
+	data->lastFinish = *finish;
+	data->lastValue += (int64_t) (delta >> 1) ^ -(int64_t) (delta & 1);
+	*value = data->lastValue;
+	data->index++;
+}
+
+static void IntegerTrackReaderPop(WiggleIterator * wi) {
+	IntegerTrackReaderData * data = (IntegerTrackReaderData *) wi->data;
+	int start, finish;
+	double value;
+
+	while (true) {
+		if (data->index == data->count && !nextIntegerBlock(data)) {
+			wi->done = true;
+			return;
+		}
+
+		unpackIntegerRecord(data, &start, &finish, &value);
+		if (data->limited) {
+			if (start >= data->stop) {
+				wi->done = true;
+				return;
+			}
+			// Only records before the first of the region are skipped
+			if (finish <= data->start)
+				continue;
+			if (start < data->start)
+				start = data->start;
+			if (finish > data->stop)
+				finish = data->stop;
+		}
+
+		wi->chrom = data->labels[data->chrom];
+		wi->start = start;
+		wi->finish = finish;
+		wi->value = value;
+		return;
+	}
+}
+
+// Records which need no trimming are decoded straight into the batch
+static void IntegerTrackReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	IntegerTrackReaderData * data = (IntegerTrackReaderData *) wi->data;
+
+	while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+		pushSpanBatch(batch, wi);
+		while (batch->count < SPAN_BATCH_SIZE && data->index < data->count) {
+			// The record is left for pop if it needs trimming
+			const unsigned char * ptr = data->ptr;
+			int lastFinish = data->lastFinish;
+			int64_t lastValue = data->lastValue;
+			int index = batch->count;
+			unpackIntegerRecord(data, batch->starts + index, batch->finishes + index, batch->values + index);
+			if (data->limited && batch->finishes[index] > data->stop) {
+				data->ptr = ptr;
+				data->lastFinish = lastFinish;
+				data->lastValue = lastValue;
+				data->index--;
+				break;
+			}
+			batch->chroms[index] = data->labels[data->chrom];
+			batch->count++;
+		}
+		IntegerTrackReaderPop(wi);
+	}
+}
+
+static int findIntegerChrom(IntegerTrackReaderData * data, const char * chrom) {
+	int low = 0, high = data->chromCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		int cmp = compareChroms(data->labels[middle], chrom);
+		if (cmp == 0)
+			return middle;
+		else if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+static void IntegerTrackReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	IntegerTrackReaderData * data = (IntegerTrackReaderData *) wi->data;
+	int index = findIntegerChrom(data, chrom);
+	const IntegerChrom * entry;
+	int low, high;
+
+	wi->done = false;
+	data->limited = true;
+	data->start = start;
+	data->stop = finish;
+	if (index < 0) {
+		wi->done = true;
+		return;
+	}
+	data->chrom = index;
+	entry = data->chroms + index;
+
+	// First block which reaches past start, pop skips the records before it
+	low = entry->firstBlock;
+	high = entry->firstBlock + entry->blockCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (data->blocks[middle].lastFinish <= start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == entry->firstBlock + entry->blockCount) {
+		wi->done = true;
+		return;
+	}
+	loadIntegerBlock(data, low);
+	IntegerTrackReaderPop(wi);
+}
+
+static void openIntegerTrack(IntegerTrackReaderData * data) {
+	struct stat info;
+	int64_t blockTable, chromTable;
+	int32_t blockCount, chromCount;
+	uint32_t mark;
+	const char * trailer;
+	const char * names;
+	int i, file;
+
+	if ((file = open(data->filename, O_RDONLY)) < 0 || fstat(file, &info)) {
+		fprintf(stderr, "Could not open integer track file %s\n", data->filename);
+		raiseError();
+	}
+	data->size = info.st_size;
+	if (data->size < HEADER_SIZE + TRAILER_SIZE)
+		corruptedIntegerTrack(data);
+	if ((data->map = mmap(NULL, data->size, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not map integer track file %s\n", data->filename);
+		raiseError();
+	}
+	close(file);
+
+	trailer = data->map + data->size - TRAILER_SIZE;
+	if (memcmp(data->map, magic, sizeof(magic)) || memcmp(trailer + 24, magic, sizeof(magic))) {
+		fprintf(stderr, "%s is not a complete wiggletools integer track file\n", data->filename);
+		raiseError();
+	}
+	memcpy(&mark, data->map + 8, sizeof(mark));
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", data->filename);
+		raiseError();
+	}
+
+	memcpy(&blockTable, trailer, sizeof(blockTable));
+	memcpy(&chromTable, trailer + 8, sizeof(chromTable));
+	memcpy(&blockCount, trailer + 16, sizeof(blockCount));
+	memcpy(&chromCount, trailer + 20, sizeof(chromCount));
+	if (blockCount < 0 || chromCount < 0 || blockTable < HEADER_SIZE || blockTable % 8
+	    || chromTable != blockTable + blockCount * (int64_t) sizeof(IntegerBlock)
+	    || chromTable + chromCount * (int64_t) sizeof(IntegerChrom) > (int64_t) data->size - TRAILER_SIZE)
+		corruptedIntegerTrack(data);
+	data->blocks = (const IntegerBlock *) (data->map + blockTable);
+	data->blockCount = blockCount;
+	data->chroms = (const IntegerChrom *) (data->map + chromTable);
+	data->chromCount = chromCount;
+
+	for (i = 0; i < blockCount; i++)
+		if (data->blocks[i].offset < HEADER_SIZE || data->blocks[i].count <= 0 || data->blocks[i].size < 3 * data->blocks[i].count || data->blocks[i].offset + data->blocks[i].size > blockTable)
+			corruptedIntegerTrack(data);
+
+	names = (const char *) (data->chroms + chromCount);
+	data->labels = (char **) calloc(chromCount, sizeof(char *));
+	for (i = 0; i < chromCount; i++) {
+		const IntegerChrom * chrom = data->chroms + i;
+		if (chrom->name < 0 || names + chrom->name >= data->map + data->size - TRAILER_SIZE || !memchr(names + chrom->name, '\0', data->map + data->size - TRAILER_SIZE - names - chrom->name)
+		    || chrom->blockCount <= 0 || chrom->firstBlock < 0 || chrom->firstBlock + chrom->blockCount > blockCount)
+			corruptedIntegerTrack(data);
+		data->labels[i] = internChromosome(names + chrom->name);
+	}
+
+	// Chromosomes are looked up by binary search
+	for (i = 1; i < chromCount; i++)
+		if (compareChroms(data->labels[i-1], data->labels[i]) >= 0) {
+			fprintf(stderr, "Integer track %s was written in another chromosome order: %s comes after %s\n", data->filename, data->labels[i], data->labels[i-1]);
+			raiseError();
+		}
+}
+
+WiggleIterator * IntegerTrackReader(char * filename) {
+	IntegerTrackReaderData * data = (IntegerTrackReaderData *) calloc(1, sizeof(IntegerTrackReaderData));
+	data->filename = filename;
+	openIntegerTrack(data);
+	if (data->blockCount)
+		loadIntegerBlock(data, 0);
+	WiggleIterator * res = newWiggleIterator(data, &IntegerTrackReaderPop, &IntegerTrackReaderSeek, 0);
+	res->popBatch = &IntegerTrackReaderPopBatch;
+	res->finite = true;
+	res->integral = true;
+	return res;
+}
@@ -0,0 +1,51 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _INTEGER_TRACK_H_
+#define _INTEGER_TRACK_H_
+
+// Integer track files (.wti), compact copies of integer valued tracks,
+// such as read coverage
+//
+// Each record is stored as three varints: the gap since the finish of the
+// previous record, its length, and the change of value since the previous
+// record, zig-zag encoded. Each block restarts from position 0 and value 0,
+// so that it can be decoded on its own. A footer, written once the data is
+// exhausted, indexes the blocks by chromosome:
+//
+// header    magic (8 bytes), byte order mark, flags (int32 each)
+// blocks    varints, padded to 8 bytes
+// blocks    offset (int64), size in bytes, record count, last finish,
+//           padding (int32 each)
+// chroms    name offset, first block, block count, padding (int32 each)
+// names     NUL terminated, padded to 8 bytes
+// trailer   block table offset, chromosome table offset (int64 each),
+//           block count, chromosome count (int32 each), magic (8 bytes)
+//
+// Coordinates are stored as the iterators hold them, 1-based half open.
+// The records do not overlap, and NaN values are not stored.
+
+#include <stdio.h>
+#include "wiggleIterator.h"
+
+typedef struct integerTrackWriter_st IntegerTrackWriter;
+
+// Records must arrive sorted and not overlap, with integer values
+IntegerTrackWriter * openIntegerTrackWriter(FILE * file);
+void addIntegerTrackValue(IntegerTrackWriter * writer, char * chrom, int start, int finish, double value);
+void finishIntegerTrackWriter(IntegerTrackWriter * writer);
+
+bool isIntegerTrackFilename(const char * filename);
+
+#endif
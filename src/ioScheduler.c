@@ -0,0 +1,302 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SANITIZE_THREAD__
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#include "ioScheduler.h"
+#include "errors.h"
+#include "tracer.h"
+
+// Number of worker threads, 0 for a thread per reader
+static int IO_THREADS = 16;
+// Stacks are only backed by memory as they are used, as for threads
+static const size_t STACK_SIZE = 8 * 1024 * 1024;
+
+void setIoThreads(int value) {
+	if (value < 0) {
+		fprintf(stderr, "Number of I/O threads cannot be negative: %i\n", value);
+		raiseError();
+	}
+	IO_THREADS = value;
+}
+
+bool sharedIoThreads() {
+	return IO_THREADS > 0;
+}
+
+// Why a task switched back to its worker
+enum taskSwitch {
+	TASK_PARKING,
+	TASK_YIELDING,
+	TASK_DONE
+};
+
+struct ioTask_st {
+	ucontext_t context;
+	// Context of the worker currently running the task
+	ucontext_t * worker;
+	char * stack;
+	void (*run)(void *);
+	void * data;
+	int (*backlog)(void *);
+	bool (*ready)(void *);
+	void * readyArg;
+	// Only read by the worker, once the task switched back to it
+	int reason;
+	// From start to completion, protected by the mutex
+	bool busy;
+	// Set while the task waits to be woken, accessed atomically
+	bool parked;
+	// Innermost catchErrors of the task, while it is switched out
+	void * errorHandler;
+	struct ioTask_st * next;
+#ifdef __SANITIZE_THREAD__
+	void * fiber;
+	void * workerFiber;
+#endif
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+// Signalled when a task completes
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+// Tasks ready to run, protected by the mutex
+static IoTask * readyHead = NULL, * readyTail = NULL;
+// Length of that list, also read without the mutex
+static int readyCount = 0;
+static int workerCount = 0;
+// Task which the worker is about to start, read by taskEntry
+static __thread IoTask * startingTask = NULL;
+// Task which the worker is running
+static __thread IoTask * runningTask = NULL;
+
+//////////////////////////////////////////////////////
+// Ready queue
+//////////////////////////////////////////////////////
+
+// Must be called with the mutex held
+static void enqueueTask(IoTask * task) {
+	task->next = NULL;
+	if (readyTail)
+		readyTail->next = task;
+	else
+		readyHead = task;
+	readyTail = task;
+	__atomic_add_fetch(&readyCount, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&cond);
+}
+
+// Must be called with the mutex held. Amongst tasks with the same backlog,
+// the first one queued goes first
+static IoTask * dequeueMostUrgentTask() {
+	IoTask * task, * prev = NULL, * best = NULL, * bestPrev = NULL;
+	int backlog, bestBacklog = INT_MAX;
+
+	for (task = readyHead; task; prev = task, task = task->next) {
+		backlog = task->backlog(task->data);
+		if (backlog < bestBacklog) {
+			best = task;
+			bestPrev = prev;
+			bestBacklog = backlog;
+			if (backlog == 0)
+				break;
+		}
+	}
+
+	if (bestPrev)
+		bestPrev->next = best->next;
+	else
+		readyHead = best->next;
+	if (readyTail == best)
+		readyTail = bestPrev;
+	__atomic_sub_fetch(&readyCount, 1, __ATOMIC_SEQ_CST);
+	return best;
+}
+
+//////////////////////////////////////////////////////
+// Context switches
+//////////////////////////////////////////////////////
+
+static void switchToTask(IoTask * task, ucontext_t * worker) {
+	void * workerHandler = swapErrorHandler(task->errorHandler);
+	task->worker = worker;
+	startingTask = task;
+#ifdef __SANITIZE_THREAD__
+	task->workerFiber = __tsan_get_current_fiber();
+	__tsan_switch_to_fiber(task->fiber, 0);
+#endif
+	runningTask = task;
+	swapcontext(worker, &task->context);
+	runningTask = NULL;
+	task->errorHandler = swapErrorHandler(workerHandler);
+}
+
+static void switchToWorker(IoTask * task, int reason) {
+	task->reason = reason;
+#ifdef __SANITIZE_THREAD__
+	__tsan_switch_to_fiber(task->workerFiber, 0);
+#endif
+	swapcontext(&task->context, task->worker);
+}
+
+static void taskEntry() {
+	IoTask * task = startingTask;
+	task->run(task->data);
+	// The context is made anew by the next start, so this never returns
+	switchToWorker(task, TASK_DONE);
+}
+
+//////////////////////////////////////////////////////
+// Workers
+//////////////////////////////////////////////////////
+
+static void * runWorker(void * args) {
+	ucontext_t context;
+	IoTask * task;
+
+	nameTraceThread("io");
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (readyHead == NULL)
+			pthread_cond_wait(&cond, &mutex);
+		task = dequeueMostUrgentTask();
+		pthread_mutex_unlock(&mutex);
+
+		switchToTask(task, &context);
+
+		pthread_mutex_lock(&mutex);
+		if (task->reason == TASK_PARKING) {
+			// Pairs with wakeIoTask: either the waker sees the flag, or the condition holds here
+			__atomic_store_n(&task->parked, true, __ATOMIC_SEQ_CST);
+			if (task->ready(task->readyArg) && __atomic_exchange_n(&task->parked, false, __ATOMIC_SEQ_CST))
+				enqueueTask(task);
+		} else if (task->reason == TASK_YIELDING)
+			enqueueTask(task);
+		else {
+			task->busy = false;
+			pthread_cond_broadcast(&idleCond);
+		}
+	}
+	return NULL;
+}
+
+static void startWorkers() {
+	pthread_mutex_lock(&mutex);
+	while (workerCount < IO_THREADS) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, &runWorker, NULL);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			abort();
+		}
+		pthread_detach(thread);
+		workerCount++;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+//////////////////////////////////////////////////////
+// Tasks
+//////////////////////////////////////////////////////
+
+IoTask * newIoTask(void * data, int (*backlog)(void *)) {
+	IoTask * task = (IoTask *) calloc(1, sizeof(IoTask));
+	task->data = data;
+	task->backlog = backlog;
+	task->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (task->stack == MAP_FAILED) {
+		fprintf(stderr, "Could not allocate the stack of an I/O task\n");
+		raiseError();
+	}
+	// Guard page, so that an overflow faults instead of corrupting memory
+	mprotect(task->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+#ifdef __SANITIZE_THREAD__
+	task->fiber = __tsan_create_fiber(0);
+#endif
+	return task;
+}
+
+// The previous run may have completed without switching back to its worker yet
+static void waitForIdleTask(IoTask * task) {
+	while (task->busy)
+		pthread_cond_wait(&idleCond, &mutex);
+}
+
+void destroyIoTask(IoTask * task) {
+	pthread_mutex_lock(&mutex);
+	waitForIdleTask(task);
+	pthread_mutex_unlock(&mutex);
+#ifdef __SANITIZE_THREAD__
+	__tsan_destroy_fiber(task->fiber);
+#endif
+	munmap(task->stack, STACK_SIZE);
+	free(task);
+}
+
+void startIoTask(IoTask * task, void (*run)(void *)) {
+	startWorkers();
+	pthread_mutex_lock(&mutex);
+	waitForIdleTask(task);
+	task->busy = true;
+	pthread_mutex_unlock(&mutex);
+
+	getcontext(&task->context);
+	task->context.uc_stack.ss_sp = task->stack;
+	task->context.uc_stack.ss_size = STACK_SIZE;
+	task->context.uc_link = NULL;
+	makecontext(&task->context, &taskEntry, 0);
+	task->run = run;
+
+	pthread_mutex_lock(&mutex);
+	enqueueTask(task);
+	pthread_mutex_unlock(&mutex);
+}
+
+void parkIoTask(IoTask * task, bool (*ready)(void *)) {
+	parkIoTaskOn(task, ready, task->data);
+}
+
+void parkIoTaskOn(IoTask * task, bool (*ready)(void *), void * arg) {
+	task->ready = ready;
+	task->readyArg = arg;
+	while (!ready(arg))
+		switchToWorker(task, TASK_PARKING);
+}
+
+void yieldIoTask(IoTask * task) {
+	if (__atomic_load_n(&readyCount, __ATOMIC_SEQ_CST))
+		switchToWorker(task, TASK_YIELDING);
+}
+
+IoTask * currentIoTask() {
+	return runningTask;
+}
+
+void wakeIoTask(IoTask * task) {
+	if (!__atomic_load_n(&task->parked, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&mutex);
+	if (__atomic_exchange_n(&task->parked, false, __ATOMIC_SEQ_CST))
+		enqueueTask(task);
+	pthread_mutex_unlock(&mutex);
+}
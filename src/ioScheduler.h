@@ -0,0 +1,51 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _IO_SCHEDULER_H_
+#define _IO_SCHEDULER_H_
+
+#include "wiggletools.h"
+
+// Shared pool of threads running the downloads of the buffered readers
+//
+// Each download runs as a task with its own stack, which a worker thread
+// resumes until the task has to wait for its consumer to make room. The
+// task is then parked, freeing the worker, until its consumer wakes it.
+// Tasks also step aside after each block they publish, and the worker 
+// resumes first the task whose consumer has the fewest blocks left to 
+// read. Thousands of readers thus share a handful of threads.
+typedef struct ioTask_st IoTask;
+
+// Whether readers share the pool, rather than each run their own thread
+bool sharedIoThreads();
+// backlog returns the blocks left for the consumer, the fewer the more urgent
+IoTask * newIoTask(void * data, int (*backlog)(void *));
+void destroyIoTask(IoTask * task);
+// Has run(data) executed by the pool, once the previous run completed
+void startIoTask(IoTask * task, void (*run)(void *));
+
+// Called from within the task:
+// Parks the task until ready(data) holds, see wakeIoTask
+void parkIoTask(IoTask * task, bool (*ready)(void *));
+// Same, until ready(arg) holds
+void parkIoTaskOn(IoTask * task, bool (*ready)(void *), void * arg);
+// Lets the other tasks run if some are waiting
+void yieldIoTask(IoTask * task);
+// Task running on this thread, NULL outside of the pool
+IoTask * currentIoTask();
+
+// Called by any thread once the condition a parked task waits for may hold
+void wakeIoTask(IoTask * task);
+
+#endif
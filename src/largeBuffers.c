@@ -0,0 +1,177 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// For the CPU affinity of threads
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "largeBuffers.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAX_NODES 1024
+// Memory policy of mbind, as in numaif.h
+#define PREFERRED_NODE_POLICY 1
+
+static bool hugePages = false;
+static bool numa = false;
+// NUMA nodes with CPUs, read when pinning the first thread
+static pthread_once_t nodesRead = PTHREAD_ONCE_INIT;
+static int nodes[MAX_NODES];
+static cpu_set_t nodeCPUs[MAX_NODES];
+static int nodeCount = 0;
+static __thread int currentNode = -1;
+
+void setHugePages(bool value) {
+	hugePages = value;
+}
+
+void setNuma(bool value) {
+	numa = value;
+}
+
+//////////////////////////////////////////////////////
+// Nodes
+//////////////////////////////////////////////////////
+
+// Parses a CPU list, e.g. 0-31,64-95
+static bool readCPUList(FILE * file, cpu_set_t * set) {
+	int first, last;
+	bool found = false;
+	char separator;
+
+	CPU_ZERO(set);
+	while (fscanf(file, "%i", &first) == 1) {
+		last = first;
+		if ((separator = fgetc(file)) == '-') {
+			if (fscanf(file, "%i", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++) {
+			CPU_SET(first, set);
+			found = true;
+		}
+		if (separator != ',')
+			break;
+	}
+	return found;
+}
+
+static void readNodes() {
+	char filename[100];
+	FILE * file;
+	int node;
+
+	for (node = 0; node < MAX_NODES; node++) {
+		snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%i/cpulist", node);
+		if (!(file = fopen(filename, "r")))
+			continue;
+		// Nodes of memory only are skipped
+		if (readCPUList(file, nodeCPUs + nodeCount))
+			nodes[nodeCount++] = node;
+		fclose(file);
+	}
+}
+
+int localNode() {
+	return currentNode;
+}
+
+void pinThreadToNode(int index) {
+	int err;
+
+	if (!numa)
+		return;
+	pthread_once(&nodesRead, &readNodes);
+	if (nodeCount < 2)
+		return;
+
+	index %= nodeCount;
+	// Threads created from now on inherit the affinity
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), nodeCPUs + index))) {
+		fprintf(stderr, "Could not pin thread to NUMA node %i: %s\n", nodes[index], strerror(err));
+		return;
+	}
+	currentNode = nodes[index];
+}
+
+//////////////////////////////////////////////////////
+// Buffers
+//////////////////////////////////////////////////////
+
+static bool isMapped(size_t bytes) {
+	return (hugePages || numa) && bytes >= HUGE_PAGE_SIZE;
+}
+
+static size_t mappedSize(size_t bytes) {
+	return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// Only the pages touched afterwards are placed, so the policy is set before
+static void placeBuffer(void * buffer, size_t bytes, int node) {
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	// Not fatal, e.g. within a container which forbids it
+	syscall(SYS_mbind, buffer, bytes, PREFERRED_NODE_POLICY, mask, MAX_NODES, 0);
+}
+
+// Mapped with a huge page of slack, trimmed to a boundary of huge pages, so
+// that the whole buffer can be backed by huge pages
+void * allocateLargeBuffer(size_t bytes, int node) {
+	size_t size;
+	char * map, * buffer;
+
+	if (!isMapped(bytes)) {
+		if (!(buffer = calloc(1, bytes))) {
+			fprintf(stderr, "Could not allocate %zu bytes\n", bytes);
+			raiseError();
+		}
+		return buffer;
+	}
+
+	size = mappedSize(bytes);
+	if ((map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not map %zu bytes\n", size);
+		raiseError();
+	}
+	buffer = (char *) (((uintptr_t) map + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+	if (buffer > map)
+		munmap(map, buffer - map);
+	munmap(buffer + size, map + HUGE_PAGE_SIZE - buffer);
+
+	if (hugePages)
+		madvise(buffer, size, MADV_HUGEPAGE);
+	if (node >= 0)
+		placeBuffer(buffer, size, node);
+	return buffer;
+}
+
+void freeLargeBuffer(void * buffer, size_t bytes) {
+	if (!buffer)
+		return;
+	if (isMapped(bytes))
+		munmap(buffer, mappedSize(bytes));
+	else
+		free(buffer);
+}
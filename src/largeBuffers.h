@@ -0,0 +1,40 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _LARGE_BUFFERS_H_
+#define _LARGE_BUFFERS_H_
+
+#include <stdlib.h>
+#include "wiggletools.h"
+
+// Placement of the large buffers: blocks read ahead, blocks waiting to be 
+// written and matrix rows
+//
+// With --huge_pages, buffers of at least a huge page are mapped apart and 
+// backed by transparent huge pages, which spares the TLB. With --numa, the
+// threads of a multithreaded run are pinned to the NUMA nodes in turn, and
+// the buffers of their readers and writers are placed on their node, 
+// whichever thread fills them first. Smaller buffers are left to malloc.
+
+// NUMA node of the calling thread, -1 if it is not pinned
+int localNode();
+// Pins the calling thread to the CPUs of a node, the index-th in turn. 
+// Does nothing unless --numa is set and the machine has several nodes.
+void pinThreadToNode(int index);
+// Zeroed buffer, placed on node if not -1
+void * allocateLargeBuffer(size_t bytes, int node);
+// The size must be that given to allocateLargeBuffer
+void freeLargeBuffer(void * buffer, size_t bytes);
+
+#endif
@@ -0,0 +1,455 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <tabix.h>
+
+#include "lineReader.h"
+#include "inflater.h"
+#include "lineSorter.h"
+#include "profiler.h"
+#include "memoryUsage.h"
+
+struct lineReader_st {
+	// Stream mode
+	FILE * file;
+	char * buffer;
+	size_t bufferSize;
+	// Mapped mode
+	char * map;
+	size_t mapLength;
+	char * pos;
+	char * mapEnd;
+	// Compressed mode, inflated in place or ahead
+	gzFile gz_file;
+	char * filename;
+	Inflater * inflater;
+	char * inflated;
+	char * inflatedEnd;
+	// Indexed mode, once seeked
+	tabix_t * tabix_file;
+	ti_iter_t tabix_iterator;
+	int seeked;
+	// Sorted mode, all lines read into a sorter
+	LineSorter * sorter;
+};
+
+//////////////////////////////////////////////////////
+// Opening and closing
+//////////////////////////////////////////////////////
+
+static int mapLineReader(LineReader * reader, char * filename) {
+	struct stat info;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	reader->map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (reader->map == MAP_FAILED) {
+		reader->map = NULL;
+		return 0;
+	}
+	madvise(reader->map, info.st_size, MADV_SEQUENTIAL);
+	reader->mapLength = info.st_size;
+	reader->pos = reader->map;
+	reader->mapEnd = reader->map + info.st_size;
+	return 1;
+}
+
+static int isCompressed(char * filename) {
+	size_t length = strlen(filename);
+	return length > 3 && !strcmp(filename + length - 3, ".gz");
+}
+
+static int openCompressedLineReader(LineReader * reader, char * filename) {
+	char * index = (char *) calloc(strlen(filename) + 5, sizeof(char));
+	sprintf(index, "%s.tbi", filename);
+	if (!access(index, R_OK) && !(reader->tabix_file = ti_open(filename, index))) {
+		fprintf(stderr, "Could not open tabix index %s\n", index);
+		raiseError();
+	}
+	free(index);
+
+	if (inflatingAhead()) {
+		reader->filename = filename;
+		return (reader->inflater = newInflater(filename)) != NULL;
+	}
+	return (reader->gz_file = gzopen(filename, "r")) != NULL;
+}
+
+LineReader * newLineReader(char * filename) {
+	LineReader * reader = (LineReader *) calloc(1, sizeof(LineReader));
+
+	if (isCompressed(filename)) {
+		if (!openCompressedLineReader(reader, filename)) {
+			destroyLineReader(reader);
+			return NULL;
+		}
+	} else if (strcmp(filename, "-")) {
+		int mapped = mapLineReader(reader, filename);
+		if (mapped < 0) {
+			free(reader);
+			return NULL;
+		} else if (mapped)
+			return reader;
+		else if (!(reader->file = fopen(filename, "r"))) {
+			free(reader);
+			return NULL;
+		}
+	} else
+		reader->file = stdin;
+
+	return reader;
+}
+
+// Tabix indexed files are sorted already
+LineReader * newSortingLineReader(char * filename, int chromColumn, int positionColumn) {
+	LineReader * input = newLineReader(filename);
+	if (!input || input->tabix_file)
+		return input;
+
+	LineReader * reader = (LineReader *) calloc(1, sizeof(LineReader));
+	reader->sorter = newLineSorter(input, filename, chromColumn, positionColumn);
+	return reader;
+}
+
+void destroyLineReader(LineReader * reader) {
+	if (reader->sorter)
+		destroyLineSorter(reader->sorter);
+	if (reader->map)
+		munmap(reader->map, reader->mapLength);
+	if (reader->file && reader->file != stdin)
+		fclose(reader->file);
+	if (reader->tabix_iterator)
+		ti_iter_destroy(reader->tabix_iterator);
+	if (reader->tabix_file)
+		ti_close(reader->tabix_file);
+	if (reader->gz_file)
+		gzclose(reader->gz_file);
+	if (reader->inflater)
+		destroyInflater(reader->inflater);
+	if (reader->buffer)
+		countMemory(MEMORY_READERS, -(long long) reader->bufferSize);
+	free(reader->buffer);
+	free(reader);
+}
+
+// gzgets stops at the end of the buffer, which must grow until the whole line fits
+static char * readCompressedLine(LineReader * reader, char ** end) {
+	size_t length = 0;
+	int read = 0;
+
+	if (!reader->buffer) {
+		reader->bufferSize = 1000;
+		reader->buffer = (char *) calloc(reader->bufferSize, sizeof(char));
+		countMemory(MEMORY_READERS, reader->bufferSize);
+	}
+
+	while (gzgets(reader->gz_file, reader->buffer + length, reader->bufferSize - length)) {
+		read = 1;
+		length += strlen(reader->buffer + length);
+		if (reader->buffer[length - 1] == '\n') {
+			length--;
+			break;
+		} else if (length < reader->bufferSize - 1)
+			// End of file without a final newline
+			break;
+		countMemory(MEMORY_READERS, reader->bufferSize);
+		reader->bufferSize *= 2;
+		reader->buffer = (char *) realloc(reader->buffer, reader->bufferSize);
+	}
+
+	if (!read)
+		return NULL;
+	*end = reader->buffer + length;
+	return reader->buffer;
+}
+
+// Lines are returned in place, unless they run over the end of a block
+static char * readInflatedLine(LineReader * reader, char ** end) {
+	size_t length = 0, size, chunk;
+	char * start, * newline;
+
+	while (true) {
+		if (reader->inflated == reader->inflatedEnd) {
+			if (!(reader->inflated = nextInflatedBlock(reader->inflater, &size))) {
+				reader->inflatedEnd = NULL;
+				if (length == 0)
+					return NULL;
+				// End of file without a final newline
+				break;
+			}
+			reader->inflatedEnd = reader->inflated + size;
+			continue;
+		}
+
+		newline = memchr(reader->inflated, '\n', reader->inflatedEnd - reader->inflated);
+		if (newline && length == 0) {
+			start = reader->inflated;
+			reader->inflated = newline + 1;
+			*end = newline;
+			return start;
+		}
+
+		chunk = (newline ? newline : reader->inflatedEnd) - reader->inflated;
+		if (length + chunk > reader->bufferSize) {
+			countMemory(MEMORY_READERS, length + chunk - reader->bufferSize);
+			reader->bufferSize = length + chunk;
+			reader->buffer = (char *) realloc(reader->buffer, reader->bufferSize);
+		}
+		memcpy(reader->buffer + length, reader->inflated, chunk);
+		length += chunk;
+		reader->inflated += chunk;
+		if (newline) {
+			reader->inflated++;
+			break;
+		}
+	}
+
+	*end = reader->buffer + length;
+	return reader->buffer;
+}
+
+static char * readIndexedLine(LineReader * reader, char ** end) {
+	int length;
+	char * line;
+
+	if (!reader->tabix_iterator || !(line = (char *) ti_read(reader->tabix_file, reader->tabix_iterator, &length)))
+		return NULL;
+	*end = line + length;
+	return line;
+}
+
+int seekLineReader(LineReader * reader, const char * chrom, int start, int finish) {
+	if (!reader->tabix_file)
+		return 0;
+
+	if (reader->tabix_iterator)
+		ti_iter_destroy(reader->tabix_iterator);
+	// Tabix regions are 0-based, half open
+	reader->tabix_iterator = ti_query(reader->tabix_file, chrom, start > 0 ? start - 1 : 0, finish > 0 ? finish : 1 << 29);
+	reader->seeked = 1;
+	return 1;
+}
+
+int lineReaderJumps(LineReader * reader) {
+	return reader->tabix_file || reader->map;
+}
+
+int rewindLineReader(LineReader * reader) {
+	if (reader->sorter) {
+		rewindLineSorter(reader->sorter);
+		return 1;
+	}
+
+	if (reader->tabix_iterator)
+		ti_iter_destroy(reader->tabix_iterator);
+	reader->tabix_iterator = NULL;
+	reader->seeked = 0;
+
+	if (reader->gz_file)
+		return gzrewind(reader->gz_file) == 0;
+	else if (reader->inflater) {
+		destroyInflater(reader->inflater);
+		reader->inflated = reader->inflatedEnd = NULL;
+		return (reader->inflater = newInflater(reader->filename)) != NULL;
+	} else if (reader->map) {
+		reader->pos = reader->map;
+		return 1;
+	} else if (reader->file != stdin)
+		return fseek(reader->file, 0, SEEK_SET) == 0;
+	else
+		return 0;
+}
+
+char * mappedLines(LineReader * reader, char ** end) {
+	if (!reader->map || reader->seeked)
+		return NULL;
+	*end = reader->mapEnd;
+	return reader->map;
+}
+
+long long lineReaderOffset(LineReader * reader) {
+	if (!reader->map || reader->seeked)
+		return -1;
+	return reader->pos - reader->map;
+}
+
+int jumpLineReader(LineReader * reader, long long offset) {
+	if (!reader->map || reader->seeked)
+		return 0;
+	reader->pos = reader->map + offset;
+	return 1;
+}
+
+static char * readLine(LineReader * reader, char ** end) {
+	char * start;
+
+	if (reader->sorter)
+		return nextSortedLine(reader->sorter, end);
+	else if (reader->seeked) 
+		return readIndexedLine(reader, end);
+	else if (reader->gz_file)
+		return readCompressedLine(reader, end);
+	else if (reader->inflater)
+		return readInflatedLine(reader, end);
+	else if (reader->map) {
+		if (reader->pos >= reader->mapEnd)
+			return NULL;
+		start = reader->pos;
+		*end = memchr(start, '\n', reader->mapEnd - start);
+		if (*end)
+			reader->pos = *end + 1;
+		else 
+			reader->pos = *end = reader->mapEnd;
+	} else {
+		ssize_t length = getline(&reader->buffer, &reader->bufferSize, reader->file);
+		if (length < 0)
+			return NULL;
+		start = reader->buffer;
+		*end = start + length;
+		if (length && start[length - 1] == '\n')
+			(*end)--;
+	}
+
+	return start;
+}
+
+char * readNextLine(LineReader * reader, char ** end) {
+	char * start = readLine(reader, end);
+	// Sorted lines were counted as the sorter read them
+	if (start && !reader->sorter)
+		countProfileBytes(*end - start + 1);
+	return start;
+}
+
+//////////////////////////////////////////////////////
+// Parsers
+//////////////////////////////////////////////////////
+
+// Largest exact powers of ten in double precision
+static const double powersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+// Mantissas of up to 15 digits are exact doubles
+#define MAX_FAST_DIGITS 15
+#define MAX_FAST_EXPONENT 22
+
+static void skipBlanks(char ** ptr, char * end) {
+	while (*ptr < end && (**ptr == ' ' || **ptr == '\t'))
+		(*ptr)++;
+}
+
+int tokenLength(char ** ptr, char * end) {
+	char * pos;
+	skipBlanks(ptr, end);
+	for (pos = *ptr; pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r'; pos++)
+		continue;
+	return pos - *ptr;
+}
+
+int parseInteger(char ** ptr, char * end, int * value) {
+	char * pos;
+	int negative = 0;
+	long res = 0;
+
+	skipBlanks(ptr, end);
+	pos = *ptr;
+	if (pos < end && (*pos == '-' || *pos == '+'))
+		negative = *(pos++) == '-';
+	if (pos == end || *pos < '0' || *pos > '9')
+		return 0;
+	for (; pos < end && *pos >= '0' && *pos <= '9'; pos++)
+		res = res * 10 + (*pos - '0');
+
+	*value = negative ? -res : res;
+	*ptr = pos;
+	return 1;
+}
+
+// Slow but exact, for long mantissas, large exponents, nan, inf etc.
+static int parseDoubleWithStrtod(char ** ptr, char * end, double * value) {
+	char buffer[256];
+	char * stop;
+	int length = tokenLength(ptr, end);
+
+	if (length >= sizeof(buffer))
+		length = sizeof(buffer) - 1;
+	memcpy(buffer, *ptr, length);
+	buffer[length] = '\0';
+
+	double res = strtod(buffer, &stop);
+	if (stop == buffer)
+		return 0;
+	*value = res;
+	*ptr += stop - buffer;
+	return 1;
+}
+
+int parseDouble(char ** ptr, char * end, double * value) {
+	char * pos;
+	int negative = 0;
+	int digits = 0;
+	int exponent = 0;
+	uint64_t mantissa = 0;
+
+	skipBlanks(ptr, end);
+	pos = *ptr;
+	if (pos < end && (*pos == '-' || *pos == '+'))
+		negative = *(pos++) == '-';
+
+	for (; pos < end && *pos >= '0' && *pos <= '9'; pos++, digits++)
+		mantissa = mantissa * 10 + (*pos - '0');
+	if (pos < end && *pos == '.')
+		for (pos++; pos < end && *pos >= '0' && *pos <= '9'; pos++, digits++, exponent--)
+			mantissa = mantissa * 10 + (*pos - '0');
+
+	if (!digits || digits > MAX_FAST_DIGITS)
+		return parseDoubleWithStrtod(ptr, end, value);
+
+	if (pos < end && (*pos == 'e' || *pos == 'E')) {
+		char * exponentPos = pos + 1;
+		int explicitExponent;
+		if (exponentPos == end || *exponentPos == ' ' || *exponentPos == '\t' || !parseInteger(&exponentPos, end, &explicitExponent))
+			return parseDoubleWithStrtod(ptr, end, value);
+		exponent += explicitExponent;
+		pos = exponentPos;
+	}
+
+	if (exponent < -MAX_FAST_EXPONENT || exponent > MAX_FAST_EXPONENT)
+		return parseDoubleWithStrtod(ptr, end, value);
+
+	double res = (double) mantissa;
+	if (exponent < 0)
+		res /= powersOfTen[-exponent];
+	else
+		res *= powersOfTen[exponent];
+
+	*value = negative ? -res : res;
+	*ptr = pos;
+	return 1;
+}
@@ -0,0 +1,68 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _LINE_READER_H_
+#define _LINE_READER_H_
+
+// Line by line access to text files
+//
+// Regular files are memory mapped and lines are returned in place,
+// so they are NOT null terminated: each line runs from the returned
+// pointer to *end (excluded, newline stripped). Streams (stdin, pipes)
+// are read with getline into a growing buffer, .gz files through zlib. 
+// Lines have no length limit. 
+//
+// Bgzipped files with a tabix index (file.gz.tbi) can also jump directly
+// to a region.
+
+typedef struct lineReader_st LineReader;
+
+// Returns NULL if the file cannot be opened, "-" is stdin
+LineReader * newLineReader(char * filename);
+// Same, with the lines sorted by the chromosome in column chromColumn
+// then the integer in column positionColumn (0-based columns), see
+// lineSorter.h. Blank lines and comments are dropped.
+LineReader * newSortingLineReader(char * filename, int chromColumn, int positionColumn);
+// Whether unsorted inputs are to be sorted, see --sort_memory
+int sortingLines();
+// Returns NULL at end of file
+char * readNextLine(LineReader * reader, char ** end);
+void destroyLineReader(LineReader * reader);
+// Only returns the lines which overlap the region (1-based coordinates).
+// Returns 0 and does nothing if the file is not indexed.
+int seekLineReader(LineReader * reader, const char * chrom, int start, int finish);
+// Whether seeks can jump over the lines before the region: tabix indexed
+// files, and memory mapped ones through their offset index
+int lineReaderJumps(LineReader * reader);
+// Back to the first line. Returns 0 if not possible (e.g. stdin)
+int rewindLineReader(LineReader * reader);
+// The whole file, from the returned pointer to *end, if it is memory mapped,
+// else NULL. It stays valid until the reader is destroyed.
+char * mappedLines(LineReader * reader, char ** end);
+// Offset in a memory mapped file of the next line to be read, -1 if not mapped
+long long lineReaderOffset(LineReader * reader);
+// Carries on reading from offset, which must start a line of a memory mapped
+// file, see offsetIndex.h. Returns 0 and does nothing if the file is not mapped.
+int jumpLineReader(LineReader * reader, long long offset);
+
+// Token parsers: skip leading blanks, read a number if possible and advance
+// *ptr past it. They never read beyond end. Return 0 if no number was found, 
+// leaving *value untouched.
+int parseInteger(char ** ptr, char * end, int * value);
+int parseDouble(char ** ptr, char * end, double * value);
+// Skip leading blanks then return the length of the next token
+int tokenLength(char ** ptr, char * end);
+
+#endif
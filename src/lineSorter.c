@@ -0,0 +1,459 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "wiggletools.h"
+#include "lineSorter.h"
+#include "chromosomes.h"
+#include "memoryUsage.h"
+
+// Bytes of text and keys held by a run, 0 if inputs are not sorted
+static long long sortMemory = 0;
+
+void setSortMemory(int megabytes) {
+	if (megabytes < 0) {
+		fprintf(stderr, "Sort memory cannot be negative: %i\n", megabytes);
+		raiseError();
+	}
+	sortMemory = (long long) megabytes * 1024 * 1024;
+}
+
+int sortingLines() {
+	return sortMemory > 0;
+}
+
+typedef struct sortedLine_st {
+	// Chromosome rank in the high bits, position in the low bits
+	uint64_t key;
+	size_t offset;
+	size_t length;
+} SortedLine;
+
+// A spilled run, read back one line at a time
+typedef struct sortRun_st {
+	FILE * file;
+	char * buffer;
+	size_t bufferSize;
+	char * line;
+	char * end;
+	char * chrom;
+	int position;
+} SortRun;
+
+struct lineSorter_st {
+	char * filename;
+	int chromColumn;
+	int positionColumn;
+	// Run being read
+	char * text;
+	size_t textLength;
+	size_t textCapacity;
+	SortedLine * lines;
+	size_t count;
+	size_t capacity;
+	long long counted;
+	// Chromosomes of the run, by order of appearance, and a hash table
+	// from their interned names to that order
+	char ** chroms;
+	int chromCount;
+	int chromCapacity;
+	int * chromTable;
+	int tableMask;
+	char * lastChrom;
+	int lastId;
+	// Next line, if the file fitted in a single run
+	size_t next;
+	// Spilled runs, merged through a binary heap
+	SortRun * runs;
+	int runCount;
+	int * heap;
+	int heapCount;
+	int current;
+};
+
+//////////////////////////////////////////////////////
+// Keys
+//////////////////////////////////////////////////////
+
+static void parseSortKey(LineSorter * sorter, char * line, char * end, char ** chrom, int * chromLength, int * position) {
+	char * ptr = line;
+	int last = sorter->chromColumn > sorter->positionColumn ? sorter->chromColumn : sorter->positionColumn;
+	int column, length;
+	bool positioned = false;
+
+	for (column = 0; column <= last; column++) {
+		if (!(length = tokenLength(&ptr, end)))
+			break;
+		if (column == sorter->chromColumn) {
+			*chrom = ptr;
+			*chromLength = length;
+		} else if (column == sorter->positionColumn) {
+			char * number = ptr;
+			positioned = parseInteger(&number, ptr + length, position);
+		}
+		ptr += length;
+	}
+
+	if (column <= last || !positioned) {
+		fprintf(stderr, "Malformed line in file %s:\n%.*s\n", sorter->filename, (int) (end - line), line);
+		raiseError();
+	}
+}
+
+static char * internSortChrom(LineSorter * sorter, char * name, int length) {
+	if (sorter->lastChrom && !strncmp(sorter->lastChrom, name, length) && sorter->lastChrom[length] == '\0')
+		return sorter->lastChrom;
+	return internChromosomeN(name, length);
+}
+
+static int chromSlot(LineSorter * sorter, char * chrom) {
+	return (int) (((uintptr_t) chrom * 0x9E3779B97F4A7C15ULL) >> 32) & sorter->tableMask;
+}
+
+static void growChromTable(LineSorter * sorter) {
+	int size = sorter->chromTable ? 2 * (sorter->tableMask + 1) : 64;
+	int id, slot;
+
+	free(sorter->chromTable);
+	sorter->chromTable = (int *) malloc(size * sizeof(int));
+	memset(sorter->chromTable, -1, size * sizeof(int));
+	sorter->tableMask = size - 1;
+	for (id = 0; id < sorter->chromCount; id++) {
+		for (slot = chromSlot(sorter, sorter->chroms[id]); sorter->chromTable[slot] >= 0; slot = (slot + 1) & sorter->tableMask);
+		sorter->chromTable[slot] = id;
+	}
+}
+
+// Order of first appearance in the run
+static int chromId(LineSorter * sorter, char * chrom) {
+	int slot;
+
+	if (chrom == sorter->lastChrom)
+		return sorter->lastId;
+
+	for (slot = chromSlot(sorter, chrom); sorter->chromTable[slot] >= 0; slot = (slot + 1) & sorter->tableMask)
+		if (sorter->chroms[sorter->chromTable[slot]] == chrom)
+			break;
+
+	if (sorter->chromTable[slot] < 0) {
+		if (sorter->chromCount == sorter->chromCapacity) {
+			sorter->chromCapacity *= 2;
+			sorter->chroms = (char **) realloc(sorter->chroms, sorter->chromCapacity * sizeof(char *));
+		}
+		sorter->chroms[sorter->chromCount] = chrom;
+		sorter->chromTable[slot] = sorter->chromCount++;
+		if (2 * sorter->chromCount > sorter->tableMask)
+			growChromTable(sorter);
+		sorter->lastId = sorter->chromCount - 1;
+	} else
+		sorter->lastId = sorter->chromTable[slot];
+
+	sorter->lastChrom = chrom;
+	return sorter->lastId;
+}
+
+//////////////////////////////////////////////////////
+// Runs
+//////////////////////////////////////////////////////
+
+static void countSortMemory(LineSorter * sorter) {
+	long long bytes = sorter->textCapacity + 2 * sorter->capacity * sizeof(SortedLine);
+	countMemory(MEMORY_READERS, bytes - sorter->counted);
+	sorter->counted = bytes;
+}
+
+static void addSortLine(LineSorter * sorter, char * line, char * end) {
+	char * name, * chrom;
+	int length, position;
+	size_t size = end - line;
+
+	parseSortKey(sorter, line, end, &name, &length, &position);
+	chrom = internSortChrom(sorter, name, length);
+
+	if (sorter->textLength + size > sorter->textCapacity) {
+		while (sorter->textLength + size > sorter->textCapacity)
+			sorter->textCapacity *= 2;
+		sorter->text = (char *) realloc(sorter->text, sorter->textCapacity);
+		countSortMemory(sorter);
+	}
+	if (sorter->count == sorter->capacity) {
+		sorter->capacity *= 2;
+		sorter->lines = (SortedLine *) realloc(sorter->lines, sorter->capacity * sizeof(SortedLine));
+		countSortMemory(sorter);
+	}
+	if (!sorter->text || !sorter->lines) {
+		fprintf(stderr, "Could not allocate memory to sort %s\n", sorter->filename);
+		raiseError();
+	}
+
+	memcpy(sorter->text + sorter->textLength, line, size);
+	SortedLine * sorted = sorter->lines + sorter->count++;
+	// The sign bit is flipped so that unsigned keys follow signed positions
+	sorted->key = ((uint64_t) chromId(sorter, chrom) << 32) | ((uint32_t) position ^ 0x80000000U);
+	sorted->offset = sorter->textLength;
+	sorted->length = size;
+	sorter->textLength += size;
+}
+
+static int compareChromNames(const void * a, const void * b) {
+	return compareChroms(*(char * const *) a, *(char * const *) b);
+}
+
+// Replaces the chromosome ids by ranks, then sorts the keys one byte at a
+// time, least significant first, skipping the bytes which are the same in
+// all keys
+static void sortRun(LineSorter * sorter) {
+	char ** order = (char **) malloc(sorter->chromCount * sizeof(char *));
+	uint64_t * ranks = (uint64_t *) malloc(sorter->chromCount * sizeof(uint64_t));
+	SortedLine * scratch = (SortedLine *) malloc(sorter->count * sizeof(SortedLine));
+	SortedLine * from = sorter->lines, * to = scratch, * swap;
+	size_t counts[256], index;
+	int id, byte, digit;
+
+	if (!order || !ranks || !scratch) {
+		fprintf(stderr, "Could not allocate memory to sort %s\n", sorter->filename);
+		raiseError();
+	}
+
+	memcpy(order, sorter->chroms, sorter->chromCount * sizeof(char *));
+	qsort(order, sorter->chromCount, sizeof(char *), compareChromNames);
+	for (id = 0; id < sorter->chromCount; id++)
+		ranks[chromId(sorter, order[id])] = (uint64_t) id << 32;
+	for (index = 0; index < sorter->count; index++)
+		from[index].key = ranks[from[index].key >> 32] | (from[index].key & 0xFFFFFFFFU);
+
+	for (byte = 0; byte < 8; byte++) {
+		size_t total = 0;
+		memset(counts, 0, sizeof(counts));
+		for (index = 0; index < sorter->count; index++)
+			counts[(from[index].key >> (8 * byte)) & 0xFF]++;
+		if (counts[(from[0].key >> (8 * byte)) & 0xFF] == sorter->count)
+			continue;
+		for (digit = 0; digit < 256; digit++) {
+			size_t bucket = counts[digit];
+			counts[digit] = total;
+			total += bucket;
+		}
+		for (index = 0; index < sorter->count; index++)
+			to[counts[(from[index].key >> (8 * byte)) & 0xFF]++] = from[index];
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != sorter->lines)
+		memcpy(sorter->lines, from, sorter->count * sizeof(SortedLine));
+	free(scratch);
+	free(ranks);
+	free(order);
+}
+
+static void clearRun(LineSorter * sorter) {
+	sorter->textLength = 0;
+	sorter->count = 0;
+	sorter->chromCount = 0;
+	sorter->lastChrom = NULL;
+	memset(sorter->chromTable, -1, (sorter->tableMask + 1) * sizeof(int));
+}
+
+static void spillRun(LineSorter * sorter) {
+	SortRun * run;
+	size_t index;
+
+	sortRun(sorter);
+	sorter->runs = (SortRun *) realloc(sorter->runs, (sorter->runCount + 1) * sizeof(SortRun));
+	run = sorter->runs + sorter->runCount++;
+	memset(run, 0, sizeof(SortRun));
+	if (!(run->file = tmpfile())) {
+		fprintf(stderr, "Could not create a temporary file to sort %s\n", sorter->filename);
+		raiseError();
+	}
+	for (index = 0; index < sorter->count; index++) {
+		fwrite(sorter->text + sorter->lines[index].offset, 1, sorter->lines[index].length, run->file);
+		fputc('\n', run->file);
+	}
+	if (ferror(run->file)) {
+		fprintf(stderr, "Could not write a temporary file to sort %s\n", sorter->filename);
+		raiseError();
+	}
+	clearRun(sorter);
+}
+
+//////////////////////////////////////////////////////
+// Merging
+//////////////////////////////////////////////////////
+
+static bool readRunLine(LineSorter * sorter, SortRun * run) {
+	ssize_t length = getline(&run->buffer, &run->bufferSize, run->file);
+	int chromLength;
+	char * name;
+
+	if (length <= 0)
+		return false;
+	run->line = run->buffer;
+	run->end = run->buffer + length - 1;
+	parseSortKey(sorter, run->line, run->end, &name, &chromLength, &run->position);
+	run->chrom = internSortChrom(sorter, name, chromLength);
+	sorter->lastChrom = run->chrom;
+	return true;
+}
+
+// Earlier runs come first on ties, as they hold earlier lines
+static bool runBefore(LineSorter * sorter, int a, int b) {
+	SortRun * runA = sorter->runs + a;
+	SortRun * runB = sorter->runs + b;
+	if (runA->chrom != runB->chrom) {
+		int comparison = compareChroms(runA->chrom, runB->chrom);
+		if (comparison)
+			return comparison < 0;
+	}
+	if (runA->position != runB->position)
+		return runA->position < runB->position;
+	return a < b;
+}
+
+static void siftDown(LineSorter * sorter, int index) {
+	int * heap = sorter->heap;
+	while (true) {
+		int smallest = index, child = 2 * index + 1;
+		if (child < sorter->heapCount && runBefore(sorter, heap[child], heap[smallest]))
+			smallest = child;
+		if (child + 1 < sorter->heapCount && runBefore(sorter, heap[child + 1], heap[smallest]))
+			smallest = child + 1;
+		if (smallest == index)
+			return;
+		int swap = heap[index];
+		heap[index] = heap[smallest];
+		heap[smallest] = swap;
+		index = smallest;
+	}
+}
+
+static void startMerge(LineSorter * sorter) {
+	int run, index;
+
+	sorter->heapCount = 0;
+	sorter->current = -1;
+	for (run = 0; run < sorter->runCount; run++) {
+		rewind(sorter->runs[run].file);
+		if (readRunLine(sorter, sorter->runs + run))
+			sorter->heap[sorter->heapCount++] = run;
+	}
+	for (index = sorter->heapCount / 2 - 1; index >= 0; index--)
+		siftDown(sorter, index);
+}
+
+//////////////////////////////////////////////////////
+// Public functions
+//////////////////////////////////////////////////////
+
+LineSorter * newLineSorter(LineReader * input, char * filename, int chromColumn, int positionColumn) {
+	LineSorter * sorter = (LineSorter *) calloc(1, sizeof(LineSorter));
+	char * line, * end;
+
+	sorter->filename = filename;
+	sorter->chromColumn = chromColumn;
+	sorter->positionColumn = positionColumn;
+	sorter->textCapacity = 1 << 16;
+	sorter->text = (char *) malloc(sorter->textCapacity);
+	sorter->capacity = 1024;
+	sorter->lines = (SortedLine *) malloc(sorter->capacity * sizeof(SortedLine));
+	sorter->chromCapacity = 16;
+	sorter->chroms = (char **) malloc(sorter->chromCapacity * sizeof(char *));
+	growChromTable(sorter);
+	countSortMemory(sorter);
+
+	while ((line = readNextLine(input, &end))) {
+		if (line == end || line[0] == '#' || line[0] == '@')
+			continue;
+		if (sorter->count && sorter->textLength + (end - line) + 2 * (sorter->count + 1) * sizeof(SortedLine) > sortMemory)
+			spillRun(sorter);
+		addSortLine(sorter, line, end);
+	}
+	destroyLineReader(input);
+
+	if (sorter->runCount) {
+		if (sorter->count)
+			spillRun(sorter);
+		// Only the read buffers of the runs are needed to merge them
+		free(sorter->text);
+		free(sorter->lines);
+		sorter->text = NULL;
+		sorter->lines = NULL;
+		sorter->textCapacity = sorter->capacity = 0;
+		countSortMemory(sorter);
+		sorter->heap = (int *) malloc(sorter->runCount * sizeof(int));
+		startMerge(sorter);
+	} else if (sorter->count)
+		sortRun(sorter);
+
+	return sorter;
+}
+
+char * nextSortedLine(LineSorter * sorter, char ** end) {
+	SortRun * run;
+
+	if (!sorter->runCount) {
+		SortedLine * sorted;
+		if (sorter->next == sorter->count)
+			return NULL;
+		sorted = sorter->lines + sorter->next++;
+		*end = sorter->text + sorted->offset + sorted->length;
+		return sorter->text + sorted->offset;
+	}
+
+	// The line returned last is replaced by the next one of its run
+	if (sorter->current >= 0) {
+		if (!readRunLine(sorter, sorter->runs + sorter->current))
+			sorter->heap[0] = sorter->heap[--sorter->heapCount];
+		siftDown(sorter, 0);
+		sorter->current = -1;
+	}
+	if (!sorter->heapCount)
+		return NULL;
+
+	sorter->current = sorter->heap[0];
+	run = sorter->runs + sorter->current;
+	*end = run->end;
+	return run->line;
+}
+
+void rewindLineSorter(LineSorter * sorter) {
+	if (sorter->runCount)
+		startMerge(sorter);
+	else
+		sorter->next = 0;
+}
+
+void destroyLineSorter(LineSorter * sorter) {
+	int run;
+
+	for (run = 0; run < sorter->runCount; run++) {
+		fclose(sorter->runs[run].file);
+		free(sorter->runs[run].buffer);
+	}
+	sorter->textCapacity = sorter->capacity = 0;
+	countSortMemory(sorter);
+	free(sorter->runs);
+	free(sorter->heap);
+	free(sorter->text);
+	free(sorter->lines);
+	free(sorter->chroms);
+	free(sorter->chromTable);
+	free(sorter);
+}
@@ -0,0 +1,39 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _LINE_SORTER_H_
+#define _LINE_SORTER_H_
+
+// External merge sort of the lines of a text file, by chromosome then
+// position
+//
+// The lines are read in runs which fit in the sort memory. Each run is
+// radix sorted on (chromosome rank, position) keys, and if the file holds
+// more than one run, spilled to a temporary file. The runs are then merged
+// line by line. Ties keep the order of the file.
+//
+// Blank lines and comments (starting with # or @) are dropped.
+
+#include "lineReader.h"
+
+typedef struct lineSorter_st LineSorter;
+
+// Reads all of the input, then destroys it. Columns are 0-based.
+LineSorter * newLineSorter(LineReader * input, char * filename, int chromColumn, int positionColumn);
+// Lines stay valid until the next call, returns NULL once all are read
+char * nextSortedLine(LineSorter * sorter, char ** end);
+void rewindLineSorter(LineSorter * sorter);
+void destroyLineSorter(LineSorter * sorter);
+
+#endif
@@ -0,0 +1,124 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_cblas.h>
+
+#include "multiplexer.h"
+#include "memoryUsage.h"
+
+// Positions of the input read before each product with the weights
+#define LINEAR_COMBINATION_BATCH 512
+
+// Weighted sums of the inputs, one per vector of weights
+//
+// The values of the input at successive positions are stacked as the rows
+// of a batch B, which the BLAS multiplies with the weights W, one vector
+// per row, into the results BW' of the whole batch at once.
+typedef struct linearCombinationData_st {
+	Multiplexer * input;
+	int count;
+	int vectorCount;
+	double * weights;
+	// Positions of the batch
+	char ** chroms;
+	int * starts;
+	int * finishes;
+	double * batch;
+	double * results;
+	int batchCount;
+	int next;
+} LinearCombinationData;
+
+static void fillLinearCombinationBatch(LinearCombinationData * data) {
+	Multiplexer * input = data->input;
+
+	for (data->batchCount = 0; data->batchCount < LINEAR_COMBINATION_BATCH && !input->done; data->batchCount++) {
+		data->chroms[data->batchCount] = input->chrom;
+		data->starts[data->batchCount] = input->start;
+		data->finishes[data->batchCount] = input->finish;
+		memcpy(data->batch + data->batchCount * (size_t) data->count, input->values, data->count * sizeof(double));
+		popMultiplexer(input);
+	}
+	data->next = 0;
+
+	if (data->batchCount == 0)
+		return;
+	else if (data->vectorCount == 1)
+		cblas_dgemv(CblasRowMajor, CblasNoTrans, data->batchCount, data->count, 1, data->batch, data->count, data->weights, 1, 0, data->results, 1);
+	else
+		cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, data->batchCount, data->vectorCount, data->count, 1, data->batch, data->count, data->weights, data->count, 0, data->results, data->vectorCount);
+}
+
+static void LinearCombinationPop(Multiplexer * multi) {
+	LinearCombinationData * data = (LinearCombinationData *) multi->data;
+
+	if (data->next == data->batchCount)
+		fillLinearCombinationBatch(data);
+	if (data->batchCount == 0) {
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = data->chroms[data->next];
+	multi->start = data->starts[data->next];
+	multi->finish = data->finishes[data->next];
+	memcpy(multi->values, data->results + data->next * (size_t) data->vectorCount, data->vectorCount * sizeof(double));
+	data->next++;
+}
+
+static void LinearCombinationSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	LinearCombinationData * data = (LinearCombinationData *) multi->data;
+
+	seekMultiplexer(data->input, chrom, start, finish);
+	data->batchCount = data->next = 0;
+	multi->done = false;
+	LinearCombinationPop(multi);
+}
+
+// The weights are vectorCount rows of multi->count values
+Multiplexer * LinearCombinationMultiplexer(Multiplexer * input, double * weights, int vectorCount) {
+	LinearCombinationData * data = (LinearCombinationData *) calloc(1, sizeof(LinearCombinationData));
+	int i, j;
+
+	if (vectorCount < 1) {
+		fprintf(stderr, "A linear combination needs at least one vector of weights\n");
+		raiseError();
+	}
+	data->input = input;
+	data->count = input->count;
+	data->vectorCount = vectorCount;
+	data->weights = weights;
+	data->chroms = (char **) calloc(LINEAR_COMBINATION_BATCH, sizeof(char *));
+	data->starts = (int *) calloc(LINEAR_COMBINATION_BATCH, sizeof(int));
+	data->finishes = (int *) calloc(LINEAR_COMBINATION_BATCH, sizeof(int));
+	data->batch = (double *) calloc(LINEAR_COMBINATION_BATCH * (size_t) input->count, sizeof(double));
+	data->results = (double *) calloc(LINEAR_COMBINATION_BATCH * (size_t) vectorCount, sizeof(double));
+	countMemory(MEMORY_REDUCERS, LINEAR_COMBINATION_BATCH * (long long) (input->count + vectorCount) * sizeof(double));
+
+	Multiplexer * new = newCoreMultiplexer(data, vectorCount, &LinearCombinationPop, &LinearCombinationSeek);
+	for (i = 0; i < vectorCount; i++) {
+		double value = 0;
+		for (j = 0; j < input->count; j++)
+			value += weights[i * input->count + j] * input->default_values[j];
+		new->default_values[i] = value;
+		new->inplay[i] = true;
+	}
+	new->inplay_count = vectorCount;
+	popMultiplexer(new);
+	return new;
+}
@@ -20,6 +20,13 @@
 
 // Local header
 #include "multiplexer.h"
+#include "textBuffer.h"
+#include "memoryUsage.h"
+#include "largeBuffers.h"
+#include "matrixStore.h"
+#include "pasteIndex.h"
+#include "outputQueue.h"
+#include "tracer.h"
 
 //////////////////////////////////////////////////////
 // Tee operator
@@ -28,31 +35,90 @@
 #define BLOCK_LENGTH 10000 
 #define MAX_OUT_BLOCKS 2
 
+// Threads formatting the blocks of text outputs, besides the writer
+static int formatThreads = 1;
+
+void setFormatThreads(int threads) {
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of formatting threads: %i\n", threads);
+		raiseError();
+	}
+	formatThreads = threads;
+}
+
+enum formatState {FORMAT_NONE, FORMAT_QUEUED, FORMAT_RUNNING, FORMAT_DONE};
+
 typedef struct BlockData_st {
 	char * chroms[BLOCK_LENGTH];
 	int starts[BLOCK_LENGTH];
 	int finishes[BLOCK_LENGTH];
-	double * values;
+	StoredValue * values;
+	// Only kept for matrix files
+	bool * inplay;
 	int count;
 	int width;
 	bool bedGraph;
-	struct BlockData_st * next;
+	// Text formatted ahead of the writer
+	enum formatState formatState;
+	char * text;
+	size_t textLength;
+	struct BlockData_st * nextJob;
 } BlockData;
 
 typedef struct TeeMultiplexerData_st {
 	FILE * infile;
 	FILE * outfile;
 	Multiplexer * in;
-	BlockData * dataBlocks;
+	// Block being filled
 	BlockData * lastBlock;
-	int count;
-	pthread_t threadID;
-	pthread_mutex_t continue_mutex;
-	pthread_cond_t continue_cond;
-	bool done;
+	// Blocks the writer may lag behind, fewer if the memory budget is tight
+	int maxOutBlocks;
+	OutputSink * sink;
+	// Set between the launch of the writer and the end of the records
+	bool writing;
 	bool bedGraph;
+	// Set when writing a matrix file instead of text
+	MatrixWriter * matrix;
+	// Formatting threads, see formatBlocks
+	pthread_t * formatters;
+	int formatterCount;
+	BlockData * firstJob;
+	BlockData * lastJob;
+	int runningJobs;
+	bool stopFormatters;
+	pthread_mutex_t formatMutex;
+	pthread_cond_t formatCond;
 } TeeMultiplexerData;
 
+static long long blockBytes(int width, bool matrix) {
+	return sizeof(BlockData) + BLOCK_LENGTH * width * (long long) (sizeof(StoredValue) + (matrix ? sizeof(bool) : 0));
+}
+
+static BlockData * newBlock(TeeMultiplexerData * data, int width) {
+	BlockData * block = (BlockData*) calloc(1, sizeof(BlockData));
+	block->values = (StoredValue*) allocateLargeBuffer(BLOCK_LENGTH * width * sizeof(StoredValue), localNode());
+	if (data->matrix)
+		block->inplay = (bool*) allocateLargeBuffer(BLOCK_LENGTH * width * sizeof(bool), localNode());
+	block->width = width;
+	block->bedGraph = data->bedGraph;
+	countMemory(MEMORY_WRITERS, blockBytes(width, data->matrix != NULL));
+	return block;
+}
+
+static void freeBlock(BlockData * block) {
+	countMemory(MEMORY_WRITERS, -blockBytes(block->width, block->inplay != NULL));
+	free(block->text);
+	freeLargeBuffer(block->values, BLOCK_LENGTH * block->width * sizeof(StoredValue));
+	freeLargeBuffer(block->inplay, BLOCK_LENGTH * block->width * sizeof(bool));
+	free(block);
+}
+
+static void writeMatrixBlock(MatrixWriter * matrix, BlockData * block) {
+	int i;
+	for (i = 0; i < block->count; i++)
+		addMatrixRow(matrix, block->chroms[i], block->starts[i], block->finishes[i], block->values + i * block->width, block->inplay + i * block->width);
+}
+
 static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 	int i, j;
 	bool pointByPoint = false;
@@ -60,11 +126,13 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 	char ** chromPtr = block->chroms;
 	int * startPtr = block->starts;
 	int * finishPtr = block->finishes;
-	double * valuePtr = block->values;
+	StoredValue * valuePtr = block->values;
 	char * lastChrom = NULL;
 	int lastFinish = -1;
 	char buffer[5000];
+	TextBuffer * out = (TextBuffer *) malloc(sizeof(TextBuffer));
 
+	initTextBuffer(out, outfile, NULL);
 	for (i = 0; i < block->count; i++) {
 		// Change mode
 		if (!block->bedGraph && *finishPtr - *startPtr < 2 && !pointByPoint) {
@@ -75,36 +143,49 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 		}
 
 		if (pointByPoint) {
-			if (makeHeader || (pointByPoint && (lastChrom != *chromPtr || *startPtr > lastFinish)))
-				fprintf(outfile, "fixedStep chrom=%s start=%i step=1\n", *chromPtr, *startPtr);
+			if (makeHeader || (pointByPoint && (lastChrom != *chromPtr || *startPtr > lastFinish))) {
+				writeString(out, "fixedStep chrom=");
+				writeString(out, *chromPtr);
+				writeString(out, " start=");
+				writeInt(out, *startPtr);
+				writeString(out, " step=1\n");
+			}
 			makeHeader = false;
 			for (j = 0; j < *finishPtr - *startPtr; j++) {
 				int k;
-				double * ptr = valuePtr;
-				for (k = 0; k < block->width; k++)
-					fprintf(outfile, "\t%lf", *(ptr++));
-				fprintf(outfile, "\n");
+				StoredValue * ptr = valuePtr;
+				for (k = 0; k < block->width; k++) {
+					writeChar(out, '\t');
+					writeDouble(out, *(ptr++));
+				}
+				writeChar(out, '\n');
 			}
 			valuePtr += block->width;
 		} else if (!infile) {
 			// Careful bedgraph lines are 0 based
-			fprintf(outfile, "%s\t%i\t%i", *chromPtr, *startPtr-1, *finishPtr-1);
+			writeString(out, *chromPtr);
+			writeChar(out, '\t');
+			writeInt(out, *startPtr-1);
+			writeChar(out, '\t');
+			writeInt(out, *finishPtr-1);
 			int k;
-			for (k = 0; k < block->width; k++)
-				fprintf(outfile, "\t%lf", *(valuePtr++));
-			fprintf(outfile, "\n");
+			for (k = 0; k < block->width; k++) {
+				writeChar(out, '\t');
+				writeDouble(out, *(valuePtr++));
+			}
+			writeChar(out, '\n');
 		} else {
 			// Read next line in infile
 			if (!fgets(buffer, 5000, infile)) {
 				fprintf(stderr, "Could not paste data to file lines, inconsistent number of lines.\n");
-				exit(1);
+				raiseError();
 			}
 
 			// Skip empty lines and metadata lines:
 			while (! (strlen(buffer) && strncmp(buffer, "track", 5) && strncmp(buffer, "browser", 7))) {
 				if (!fgets(buffer, 5000, infile)) {
 					fprintf(stderr, "Could not paste data to file lines, inconsistent number of lines.\n");
-					exit(1);
+					raiseError();
 				}
 			}
 
@@ -118,10 +199,12 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 			}
 
 			// Print out
-			fprintf(outfile, "%s", buffer);
-			for (k = 0; k < block->width; k++)
-				fprintf(outfile, "\t%lf", *(valuePtr++));
-			fprintf(outfile, "\n");
+			writeString(out, buffer);
+			for (k = 0; k < block->width; k++) {
+				writeChar(out, '\t');
+				writeDouble(out, *(valuePtr++));
+			}
+			writeChar(out, '\n');
 		}
 
 		lastChrom = *chromPtr;
@@ -130,50 +213,178 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 		startPtr++;
 		finishPtr++;
 	}
+	flushTextBuffer(out);
+	free(out);
 }
 
-static bool goToNextBlock(TeeMultiplexerData * data) {
-	BlockData * ptr = data->dataBlocks;
-	static int i = 0;
-	i++;
-
-	pthread_mutex_lock(&data->continue_mutex);
-	// Received kill signal
-	if (data->count < 0)
-		return true;
-
-	// Check that there is work left
-	data->count--;
-	if (data->count == 0 && !data->done) 
-		pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-	pthread_cond_signal(&data->continue_cond);
-	pthread_mutex_unlock(&data->continue_mutex);
-
-	// Step forward
-	data->dataBlocks = data->dataBlocks->next;
-	free(ptr->values);
-	free(ptr);
-	return false;
+//////////////////////////////////////////////////////
+// Formatting threads
+//
+// The blocks of mwrite and mwrite_bg do not depend on
+// each other, so with several formatting threads each
+// block is queued once full, and formatted by the 
+// workers into its own text. The writer thread still 
+// writes the blocks in order: it waits for the first 
+// block, or formats it itself if no worker has picked 
+// it up yet. Pasted lines are read from the file in 
+// order, so apply_paste is formatted by the writer.
+//////////////////////////////////////////////////////
+
+static void formatBlock(BlockData * block) {
+	FILE * memory = open_memstream(&block->text, &block->textLength);
+	if (!memory) {
+		fprintf(stderr, "Could not allocate formatting buffer\n");
+		raiseError();
+	}
+	printBlock(NULL, memory, block);
+	fclose(memory);
+}
+
+// Called with the mutex locked
+static BlockData * takeFormatJob(TeeMultiplexerData * data) {
+	BlockData * job = data->firstJob;
+	data->firstJob = job->nextJob;
+	if (!data->firstJob)
+		data->lastJob = NULL;
+	job->formatState = FORMAT_RUNNING;
+	data->runningJobs++;
+	return job;
 }
 
-static void * printToFile(void * args) {
+static void * formatBlocks(void * args) {
 	TeeMultiplexerData * data = (TeeMultiplexerData *) args;
 
-	// Wait for first block to arrive
-	pthread_mutex_lock(&data->continue_mutex);
-	if (data->count == 0 && !data->done) 
-		pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-	pthread_mutex_unlock(&data->continue_mutex);
+	nameTraceThread("format");
+	pthread_mutex_lock(&data->formatMutex);
+	while (true) {
+		while (!data->firstJob && !data->stopFormatters)
+			pthread_cond_wait(&data->formatCond, &data->formatMutex);
+		if (data->stopFormatters)
+			break;
+		BlockData * job = takeFormatJob(data);
+		pthread_mutex_unlock(&data->formatMutex);
+		double start = traceClock();
+		formatBlock(job);
+		traceSpan("format block", start);
+		pthread_mutex_lock(&data->formatMutex);
+		job->formatState = FORMAT_DONE;
+		data->runningJobs--;
+		pthread_cond_broadcast(&data->formatCond);
+	}
+	pthread_mutex_unlock(&data->formatMutex);
+	return NULL;
+}
+
+static void launchFormatters(TeeMultiplexerData * data) {
+	int i;
+	pthread_mutex_init(&data->formatMutex, NULL);
+	pthread_cond_init(&data->formatCond, NULL);
+	data->stopFormatters = false;
+	data->formatterCount = formatThreads - 1;
+	data->formatters = (pthread_t *) calloc(data->formatterCount, sizeof(pthread_t));
+	for (i = 0; i < data->formatterCount; i++) {
+		if (pthread_create(data->formatters + i, NULL, &formatBlocks, data)) {
+			fprintf(stderr, "Could not create formatting thread\n");
+			raiseError();
+		}
+	}
+}
+
+static void queueFormatJob(TeeMultiplexerData * data, BlockData * block) {
+	if (!data->formatters)
+		launchFormatters(data);
+	pthread_mutex_lock(&data->formatMutex);
+	block->formatState = FORMAT_QUEUED;
+	if (data->lastJob)
+		data->lastJob->nextJob = block;
+	else
+		data->firstJob = block;
+	data->lastJob = block;
+	pthread_cond_signal(&data->formatCond);
+	pthread_mutex_unlock(&data->formatMutex);
+}
 
-	if (data->count < 0)
-		return NULL;
+// Takes a block out of the queue, or waits for its formatting to complete
+static void dropFormatJob(TeeMultiplexerData * data, BlockData * block) {
+	BlockData ** previous;
 
-	while(data->dataBlocks) {
-		printBlock(data->infile, data->outfile, data->dataBlocks);
-		if (goToNextBlock(data))
-			return NULL;
+	if (!data->formatters)
+		return;
+	pthread_mutex_lock(&data->formatMutex);
+	if (block->formatState == FORMAT_QUEUED) {
+		for (previous = &data->firstJob; *previous != block; previous = &((*previous)->nextJob))
+			;
+		*previous = block->nextJob;
+		if (data->lastJob == block)
+			for (data->lastJob = data->firstJob; data->lastJob && data->lastJob->nextJob; data->lastJob = data->lastJob->nextJob)
+				;
+		block->formatState = FORMAT_NONE;
+	}
+	while (block->formatState == FORMAT_RUNNING)
+		pthread_cond_wait(&data->formatCond, &data->formatMutex);
+	pthread_mutex_unlock(&data->formatMutex);
+}
+
+static void stopFormatters(TeeMultiplexerData * data) {
+	int i;
+	if (!data->formatters)
+		return;
+	pthread_mutex_lock(&data->formatMutex);
+	data->stopFormatters = true;
+	pthread_cond_broadcast(&data->formatCond);
+	pthread_mutex_unlock(&data->formatMutex);
+	for (i = 0; i < data->formatterCount; i++)
+		pthread_join(data->formatters[i], NULL);
+	free(data->formatters);
+	data->formatters = NULL;
+	pthread_cond_destroy(&data->formatCond);
+	pthread_mutex_destroy(&data->formatMutex);
+}
+
+static void writeFormattedBlock(TeeMultiplexerData * data, BlockData * block) {
+	if (data->formatters) {
+		pthread_mutex_lock(&data->formatMutex);
+		// Blocks are queued in order, so the first block is the first job
+		if (block->formatState == FORMAT_QUEUED)
+			takeFormatJob(data);
+		else
+			while (block->formatState == FORMAT_RUNNING)
+				pthread_cond_wait(&data->formatCond, &data->formatMutex);
+		pthread_mutex_unlock(&data->formatMutex);
+
+		if (block->formatState != FORMAT_DONE) {
+			formatBlock(block);
+			pthread_mutex_lock(&data->formatMutex);
+			if (block->formatState == FORMAT_RUNNING)
+				data->runningJobs--;
+			block->formatState = FORMAT_DONE;
+			pthread_cond_broadcast(&data->formatCond);
+			pthread_mutex_unlock(&data->formatMutex);
+		}
+	} else
+		formatBlock(block);
+
+	if (fwrite(block->text, 1, block->textLength, data->outfile) != block->textLength) {
+		fprintf(stderr, "Could not write to output file\n");
+		raiseError();
 	}
-	return NULL;
+}
+
+static void writeBlock(void * args, void * block) {
+	TeeMultiplexerData * data = (TeeMultiplexerData *) args;
+	if (data->matrix)
+		writeMatrixBlock(data->matrix, (BlockData *) block);
+	else if (formatThreads > 1 && !data->infile)
+		writeFormattedBlock(data, (BlockData *) block);
+	else
+		printBlock(data->infile, data->outfile, (BlockData *) block);
+}
+
+// Blocks dropped by a seek may still be queued for formatting
+static void releaseBlock(void * args, void * block) {
+	TeeMultiplexerData * data = (TeeMultiplexerData *) args;
+	dropFormatJob(data, (BlockData *) block);
+	freeBlock((BlockData *) block);
 }
 
 static void TeeMultiplexerPop(Multiplexer * multi) {
@@ -186,91 +397,61 @@ static void TeeMultiplexerPop(Multiplexer * multi) {
 		// No need to copy values, pointer points to the source multipliexers values' array
 		//multi->value = in->value;
 
-		if (data->threadID) {
+		if (data->writing) {
 			int index = data->lastBlock->count;
 			data->lastBlock->chroms[index] =  in->chrom;
 			data->lastBlock->starts[index] =  in->start;
 			data->lastBlock->finishes[index] =  in->finish;
 			int i;
-			double * ptr = data->lastBlock->values + (index * multi->count);
+			StoredValue * ptr = data->lastBlock->values + (index * multi->count);
 			for (i = 0; i < multi->count; i++)
 				*(ptr++) = in->values[i];
+			if (data->matrix)
+				memcpy(data->lastBlock->inplay + (index * multi->count), in->inplay, multi->count * sizeof(bool));
 
 			if (++data->lastBlock->count >= BLOCK_LENGTH) {
-				// Communications
-				pthread_mutex_lock(&data->continue_mutex);
-				data->count++;
-				pthread_cond_signal(&data->continue_cond);
-				if (data->count > MAX_OUT_BLOCKS)
-					pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-				pthread_mutex_unlock(&data->continue_mutex);
-
-				data->lastBlock->next = (BlockData*) calloc(1, sizeof(BlockData));
-				data->lastBlock->next->values = (double*) calloc(BLOCK_LENGTH * multi->count, sizeof(double));
-				data->lastBlock->next->width = in->count;
-				data->lastBlock = data->lastBlock->next;
-				data->lastBlock->bedGraph = data->bedGraph;
+				if (formatThreads > 1 && !data->infile && !data->matrix)
+					queueFormatJob(data, data->lastBlock);
+
+				queueOutputBlock(data->sink, data->lastBlock);
+				data->lastBlock = newBlock(data, multi->count);
 			}
 		}
 		popMultiplexer(in);
-	} else if (data->threadID) {
-		pthread_mutex_lock(&data->continue_mutex);
-		data->count++;
-		data->done = true;
-		pthread_cond_signal(&data->continue_cond);
-		pthread_mutex_unlock(&data->continue_mutex);
+	} else if (data->writing) {
+		queueOutputBlock(data->sink, data->lastBlock);
+		data->lastBlock = NULL;
 		multi->done = true;
-		pthread_join(data->threadID, NULL);
+		finishOutputSink(data->sink);
+		data->writing = false;
+		stopFormatters(data);
+		if (data->matrix)
+			finishMatrixWriter(data->matrix);
 	}
 }
 
+// The blocks are written by the shared writer threads, see outputQueue.h
 static void launchWriter(TeeMultiplexerData * data, int width) {
-	// Initialize variables
-	data->count = 0;
-	data->done = false;
-	pthread_cond_init(&data->continue_cond, NULL);
-	pthread_mutex_init(&data->continue_mutex, NULL);
-	data->dataBlocks = data->lastBlock = (BlockData*) calloc(1, sizeof(BlockData));
-	data->dataBlocks->values = (double*) calloc(BLOCK_LENGTH * width, sizeof(double));
-	data->dataBlocks->width = width;
-	data->lastBlock->bedGraph = data->bedGraph;
-
-	// Launch pthread
-	int err = pthread_create(&data->threadID, NULL, &printToFile, data);
-	if (err) {
-		fprintf(stderr, "Could not create new thread %i\n", err);
-		exit(1);
-	}
+	// Each formatting thread works on a block of its own
+	data->maxOutBlocks = MAX_OUT_BLOCKS + (data->matrix || data->infile ? 0 : formatThreads - 1);
+	while (data->maxOutBlocks > MAX_OUT_BLOCKS && !memoryFits((data->maxOutBlocks + 2) * blockBytes(width, data->matrix != NULL)))
+		data->maxOutBlocks--;
+	if (!memoryFits((data->maxOutBlocks + 2) * blockBytes(width, data->matrix != NULL)))
+		data->maxOutBlocks = 1;
+	if (!data->sink)
+		data->sink = newOutputSink(data, &writeBlock, &releaseBlock, data->maxOutBlocks);
+	data->lastBlock = newBlock(data, width);
+	data->writing = true;
 }
 
 static void killWriter(TeeMultiplexerData * data) {
-	BlockData * block;
-	
-	if (!data->threadID)
+	if (!data->writing)
 		return;
 
-	// Set trap
-	pthread_mutex_lock(&data->continue_mutex);
-	data->count = -1;
-	pthread_cond_signal(&data->continue_cond);
-	pthread_mutex_unlock(&data->continue_mutex);
-
-	// Wait for the catch
-	pthread_join(data->threadID, NULL);
-
-	// Clear variables
-	pthread_cond_destroy(&data->continue_cond);
-	pthread_mutex_destroy(&data->continue_mutex);
-
-	while (data->dataBlocks) {
-		block = data->dataBlocks;
-		data->dataBlocks = block->next;
-		free(block->values);
-		free(block);
-	}
-
-	data->dataBlocks = NULL;
+	cancelOutputSink(data->sink);
+	freeBlock(data->lastBlock);
 	data->lastBlock = NULL;
+	data->writing = false;
 }
 
 static void TeeMultiplexerSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
@@ -278,6 +459,8 @@ static void TeeMultiplexerSeek(Multiplexer * multi, const char * chrom, int star
 	killWriter(data);
 	fflush(data->outfile);
 	seekMultiplexer(data->in, chrom, start, finish);
+	if (data->infile)
+		seekPasteFile(data->infile, chrom, start);
 	multi->done = false;
 	launchWriter(data, multi->count);
 	popMultiplexer(multi);
@@ -296,10 +479,41 @@ Multiplexer * TeeMultiplexer(Multiplexer * in, FILE * outfile, bool bedGraph, bo
 	res->values = in->values;
 	res->inplay = in->inplay;
 	res->default_values = in->default_values;
+	res->finite = in->finite;
+	res->integral = in->integral;
 	popMultiplexer(res);
 	return res;
 }
 
+static Multiplexer * newMatrixTee(Multiplexer * in, MatrixWriter * writer, bool holdFire) {
+	TeeMultiplexerData * data = (TeeMultiplexerData *) calloc(1, sizeof(TeeMultiplexerData));
+	data->in = in;
+	data->outfile = matrixWriterFile(writer);
+	data->matrix = writer;
+	// Hold fire means that you wait for the first seek before doing any writing
+	if (!holdFire)
+		launchWriter(data, in->count);
+
+	Multiplexer * res = newCoreMultiplexer(data, in->count, &TeeMultiplexerPop, &TeeMultiplexerSeek);
+	res->values = in->values;
+	res->inplay = in->inplay;
+	res->default_values = in->default_values;
+	res->finite = in->finite;
+	res->integral = in->integral;
+	popMultiplexer(res);
+	return res;
+}
+
+// Same as above, but the rows are stored in a matrix file
+Multiplexer * MatrixTeeMultiplexer(Multiplexer * in, FILE * outfile, bool holdFire) {
+	return newMatrixTee(in, openMatrixWriter(outfile, in->count, in->default_values), holdFire);
+}
+
+// Same, but the columns are appended to an existing matrix file
+Multiplexer * MatrixAppendMultiplexer(Multiplexer * in, char * filename, bool holdFire) {
+	return newMatrixTee(in, openMatrixDelta(filename, in->count, in->default_values), holdFire);
+}
+
 void toStdoutMultiplexer(Multiplexer * in, bool bedGraph, bool holdFire) {
 	runMultiplexer(TeeMultiplexer(in, stdout, bedGraph, holdFire));
 }
@@ -321,6 +535,8 @@ Multiplexer * PasteMultiplexer(Multiplexer * in, FILE * infile, FILE * outfile,
 	Multiplexer * res = newCoreMultiplexer(data, in->count, &TeeMultiplexerPop, &TeeMultiplexerSeek);
 	res->values = in->values;
 	res->default_values = in->default_values;
+	res->finite = in->finite;
+	res->integral = in->integral;
 	res->inplay = in->inplay;
 	popMultiplexer(res);
 	return res;
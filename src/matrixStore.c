@@ -0,0 +1,694 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "matrixStore.h"
+#include "multiSet.h"
+#include "memoryUsage.h"
+#include "largeBuffers.h"
+
+static const char magic[8] = "WTMATRIX";
+// Reads differently on a machine of the other endianness
+static const uint32_t byteOrderMark = 0x01020304;
+static const int32_t FLOAT_VALUES_FLAG = 1;
+#define HEADER_SIZE 24
+#define TRAILER_SIZE 32
+// Rows per block
+#define MATRIX_BLOCK_SIZE 8192
+
+typedef struct matrixBlock_st {
+	int64_t offset;
+	int32_t count;
+	int32_t finish;
+} MatrixBlock;
+
+typedef struct matrixChrom_st {
+	int32_t name;
+	int32_t firstBlock;
+	int32_t blockCount;
+	int32_t padding;
+} MatrixChrom;
+
+bool isMatrixFilename(const char * filename) {
+	size_t length = strlen(filename);
+	return length > 4 && !strcmp(filename + length - 4, ".wtm");
+}
+
+static int64_t headerSize(int width) {
+	return HEADER_SIZE + width * (int64_t) sizeof(double);
+}
+
+static int64_t rowBytes(int width) {
+	return 2 * sizeof(int32_t) + width * (int64_t) (sizeof(StoredValue) + sizeof(char));
+}
+
+//////////////////////////////////////////////////////
+// Writer
+//////////////////////////////////////////////////////
+
+struct matrixWriter_st {
+	FILE * file;
+	int64_t offset;
+	int width;
+	bool finished;
+	// Written under a temporary name, renamed to filename once complete
+	char * filename;
+	char * temporary;
+	// Block being filled
+	int32_t * starts;
+	int32_t * finishes;
+	StoredValue * values;
+	char * inplay;
+	int count;
+	// Index
+	MatrixBlock * blocks;
+	int blockCount, maxBlocks;
+	MatrixChrom * chroms;
+	char ** labels;
+	int chromCount, maxChroms;
+	int lastFinish;
+};
+
+static void writeMatrixValues(MatrixWriter * writer, const void * values, size_t size, size_t count) {
+	if (fwrite(values, size, count, writer->file) != count) {
+		fprintf(stderr, "Could not write matrix file\n");
+		raiseError();
+	}
+	writer->offset += size * count;
+}
+
+static void writeMatrixPadding(MatrixWriter * writer) {
+	static const char zeros[8] = {0};
+	if (writer->offset % 8)
+		writeMatrixValues(writer, zeros, 1, 8 - writer->offset % 8);
+}
+
+static MatrixWriter * startMatrixWriter(FILE * file, int width, const double * default_values, int absorbed) {
+	MatrixWriter * writer = (MatrixWriter *) calloc(1, sizeof(MatrixWriter));
+	int32_t value = width;
+	int32_t flags[2] = {sizeof(StoredValue) == sizeof(float) ? FLOAT_VALUES_FLAG : 0, absorbed};
+	if (!writer) {
+		fprintf(stderr, "Could not allocate matrix writer\n");
+		raiseError();
+	}
+	writer->file = file;
+	writer->width = width;
+	writer->starts = (int32_t *) calloc(MATRIX_BLOCK_SIZE, sizeof(int32_t));
+	writer->finishes = (int32_t *) calloc(MATRIX_BLOCK_SIZE, sizeof(int32_t));
+	writer->values = (StoredValue *) allocateLargeBuffer(MATRIX_BLOCK_SIZE * width * sizeof(StoredValue), localNode());
+	writer->inplay = (char *) allocateLargeBuffer(MATRIX_BLOCK_SIZE * width * sizeof(char), localNode());
+	if (!writer->starts || !writer->finishes || !writer->values || !writer->inplay) {
+		fprintf(stderr, "Could not allocate matrix writer\n");
+		raiseError();
+	}
+	countMemory(MEMORY_WRITERS, MATRIX_BLOCK_SIZE * rowBytes(width));
+
+	writeMatrixValues(writer, magic, 1, sizeof(magic));
+	writeMatrixValues(writer, &byteOrderMark, sizeof(byteOrderMark), 1);
+	writeMatrixValues(writer, &value, sizeof(value), 1);
+	writeMatrixValues(writer, flags, sizeof(int32_t), 2);
+	writeMatrixValues(writer, default_values, sizeof(double), width);
+	return writer;
+}
+
+MatrixWriter * openMatrixWriter(FILE * file, int width, const double * default_values) {
+	return startMatrixWriter(file, width, default_values, 0);
+}
+
+FILE * matrixWriterFile(MatrixWriter * writer) {
+	return writer->file;
+}
+
+static void flushMatrixBlock(MatrixWriter * writer) {
+	MatrixBlock * block;
+
+	if (writer->count == 0)
+		return;
+	if (writer->blockCount == writer->maxBlocks) {
+		writer->maxBlocks = writer->maxBlocks ? 2 * writer->maxBlocks : 64;
+		writer->blocks = (MatrixBlock *) realloc(writer->blocks, writer->maxBlocks * sizeof(MatrixBlock));
+	}
+	block = writer->blocks + writer->blockCount++;
+	block->offset = writer->offset;
+	block->count = writer->count;
+	block->finish = writer->lastFinish;
+	writer->chroms[writer->chromCount - 1].blockCount++;
+
+	writeMatrixValues(writer, writer->starts, sizeof(int32_t), writer->count);
+	writeMatrixValues(writer, writer->finishes, sizeof(int32_t), writer->count);
+	writeMatrixValues(writer, writer->values, sizeof(StoredValue), writer->count * writer->width);
+	writeMatrixValues(writer, writer->inplay, sizeof(char), writer->count * writer->width);
+	writeMatrixPadding(writer);
+	writer->count = 0;
+}
+
+// The reader looks chromosomes up by binary search
+static void addMatrixChrom(MatrixWriter * writer, char * chrom) {
+	if (writer->chromCount && compareChroms(chrom, writer->labels[writer->chromCount - 1]) <= 0) {
+		fprintf(stderr, "Matrix input is not sorted: chromosome %s comes after %s\n", chrom, writer->labels[writer->chromCount - 1]);
+		raiseError();
+	}
+	if (writer->chromCount == writer->maxChroms) {
+		writer->maxChroms = writer->maxChroms ? 2 * writer->maxChroms : 64;
+		writer->chroms = (MatrixChrom *) realloc(writer->chroms, writer->maxChroms * sizeof(MatrixChrom));
+		writer->labels = (char **) realloc(writer->labels, writer->maxChroms * sizeof(char *));
+	}
+	writer->labels[writer->chromCount] = chrom;
+	writer->chroms[writer->chromCount].firstBlock = writer->blockCount;
+	writer->chroms[writer->chromCount].blockCount = 0;
+	writer->chroms[writer->chromCount].padding = 0;
+	writer->chromCount++;
+	writer->lastFinish = 0;
+}
+
+void addMatrixRow(MatrixWriter * writer, char * chrom, int start, int finish, const StoredValue * values, const bool * inplay) {
+	StoredValue * row;
+	int i;
+
+	if (writer->finished) {
+		fprintf(stderr, "Cannot add rows to a finished matrix file\n");
+		raiseError();
+	}
+	if (writer->chromCount == 0 || writer->labels[writer->chromCount - 1] != chrom) {
+		flushMatrixBlock(writer);
+		addMatrixChrom(writer, chrom);
+	} else if (start < writer->lastFinish) {
+		fprintf(stderr, "Matrix input is not sorted: %s:%i comes before the end of the previous row, %s:%i\n", chrom, start, chrom, writer->lastFinish);
+		raiseError();
+	}
+
+	row = writer->values + writer->count * writer->width;
+	writer->starts[writer->count] = start;
+	writer->finishes[writer->count] = finish;
+	for (i = 0; i < writer->width; i++)
+		row[i] = values[i];
+	memcpy(writer->inplay + writer->count * writer->width, inplay, writer->width * sizeof(char));
+	writer->lastFinish = finish;
+	if (++writer->count == MATRIX_BLOCK_SIZE)
+		flushMatrixBlock(writer);
+}
+
+void finishMatrixWriter(MatrixWriter * writer) {
+	int64_t blockTable, chromTable;
+	int32_t count;
+	int i, names = 0;
+
+	flushMatrixBlock(writer);
+
+	blockTable = writer->offset;
+	writeMatrixValues(writer, writer->blocks, sizeof(MatrixBlock), writer->blockCount);
+
+	chromTable = writer->offset;
+	for (i = 0; i < writer->chromCount; i++) {
+		writer->chroms[i].name = names;
+		names += strlen(writer->labels[i]) + 1;
+	}
+	writeMatrixValues(writer, writer->chroms, sizeof(MatrixChrom), writer->chromCount);
+	for (i = 0; i < writer->chromCount; i++)
+		writeMatrixValues(writer, writer->labels[i], 1, strlen(writer->labels[i]) + 1);
+	writeMatrixPadding(writer);
+
+	writeMatrixValues(writer, &blockTable, sizeof(blockTable), 1);
+	writeMatrixValues(writer, &chromTable, sizeof(chromTable), 1);
+	count = writer->blockCount;
+	writeMatrixValues(writer, &count, sizeof(count), 1);
+	count = writer->chromCount;
+	writeMatrixValues(writer, &count, sizeof(count), 1);
+	writeMatrixValues(writer, magic, 1, sizeof(magic));
+	fflush(writer->file);
+	writer->finished = true;
+	if (writer->temporary && rename(writer->temporary, writer->filename)) {
+		fprintf(stderr, "Could not rename %s to %s\n", writer->temporary, writer->filename);
+		raiseError();
+	}
+
+	countMemory(MEMORY_WRITERS, -MATRIX_BLOCK_SIZE * rowBytes(writer->width));
+	free(writer->starts);
+	free(writer->finishes);
+	freeLargeBuffer(writer->values, MATRIX_BLOCK_SIZE * writer->width * sizeof(StoredValue));
+	freeLargeBuffer(writer->inplay, MATRIX_BLOCK_SIZE * writer->width * sizeof(char));
+	writer->starts = writer->finishes = NULL;
+	writer->values = NULL;
+	writer->inplay = NULL;
+}
+
+//////////////////////////////////////////////////////
+// Reader
+//////////////////////////////////////////////////////
+
+typedef struct matrixReaderData_st {
+	char * filename;
+	const char * map;
+	size_t size;
+	int width;
+	// Deltas merged into this file, see below
+	int absorbed;
+	const MatrixBlock * blocks;
+	int blockCount;
+	const MatrixChrom * chroms;
+	char ** labels;
+	int chromCount;
+	// Current block, and next row within it
+	int chrom;
+	int block;
+	int index;
+	int count;
+	const int32_t * starts;
+	const int32_t * finishes;
+	const StoredValue * values;
+	const char * inplay;
+	// Set by a seek, the rows are then trimmed to [start, stop) on chromosome chrom
+	bool limited;
+	int start;
+	int stop;
+} MatrixReaderData;
+
+static void corruptedMatrix(MatrixReaderData * data) {
+	fprintf(stderr, "Corrupted matrix file %s\n", data->filename);
+	raiseError();
+}
+
+static void loadMatrixBlock(MatrixReaderData * data, int block) {
+	const MatrixBlock * entry = data->blocks + block;
+	data->block = block;
+	data->index = 0;
+	data->count = entry->count;
+	data->starts = (const int32_t *) (data->map + entry->offset);
+	data->finishes = data->starts + entry->count;
+	data->values = (const StoredValue *) (data->finishes + entry->count);
+	data->inplay = (const char *) (data->values + entry->count * data->width);
+}
+
+// Returns false at the end of the file, or of the chromosome of a seek
+static bool nextMatrixBlock(MatrixReaderData * data) {
+	const MatrixChrom * chrom = data->chroms + data->chrom;
+	if (!data->blockCount)
+		return false;
+	if (data->block + 1 == chrom->firstBlock + chrom->blockCount) {
+		if (data->limited || data->chrom + 1 == data->chromCount)
+			return false;
+		data->chrom++;
+	}
+	loadMatrixBlock(data, data->block + 1);
+	return true;
+}
+
+static void MatrixMultiplexerPop(Multiplexer * multi) {
+	MatrixReaderData * data = (MatrixReaderData *) multi->data;
+	int index, i;
+	const StoredValue * values;
+	const char * inplay;
+
+	if (data->index == data->count && !nextMatrixBlock(data)) {
+		multi->done = true;
+		return;
+	}
+
+	index = data->index++;
+	multi->chrom = data->labels[data->chrom];
+	multi->start = data->starts[index];
+	multi->finish = data->finishes[index];
+	if (data->limited) {
+		if (multi->start >= data->stop) {
+			multi->done = true;
+			return;
+		}
+		if (multi->start < data->start)
+			multi->start = data->start;
+		if (multi->finish > data->stop)
+			multi->finish = data->stop;
+	}
+
+	// The rows are read whole, there is no list of changes
+	values = data->values + index * data->width;
+	inplay = data->inplay + index * data->width;
+	multi->inplay_count = 0;
+	for (i = 0; i < data->width; i++) {
+		multi->values[i] = values[i];
+		multi->inplay_count += (multi->inplay[i] = inplay[i]);
+	}
+	multi->change_count = -1;
+}
+
+static int findMatrixChrom(MatrixReaderData * data, const char * chrom) {
+	int low = 0, high = data->chromCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		int cmp = compareChroms(data->labels[middle], chrom);
+		if (cmp == 0)
+			return middle;
+		else if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+static void MatrixMultiplexerSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	MatrixReaderData * data = (MatrixReaderData *) multi->data;
+	int index = findMatrixChrom(data, chrom);
+	const MatrixChrom * entry;
+	int low, high;
+
+	multi->done = false;
+	data->limited = true;
+	data->start = start;
+	data->stop = finish;
+	if (index < 0) {
+		multi->done = true;
+		return;
+	}
+	data->chrom = index;
+	entry = data->chroms + index;
+
+	// First block, then first row, which reaches past start, rows do not overlap
+	low = entry->firstBlock;
+	high = entry->firstBlock + entry->blockCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (data->blocks[middle].finish <= start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == entry->firstBlock + entry->blockCount) {
+		multi->done = true;
+		return;
+	}
+	loadMatrixBlock(data, low);
+
+	high = data->count;
+	while (data->index < high) {
+		int middle = (data->index + high) / 2;
+		if (data->finishes[middle] <= start)
+			data->index = middle + 1;
+		else
+			high = middle;
+	}
+	MatrixMultiplexerPop(multi);
+}
+
+static void openMatrix(MatrixReaderData * data) {
+	struct stat info;
+	int64_t blockTable, chromTable, header;
+	int32_t blockCount, chromCount, width, flags;
+	uint32_t mark;
+	const char * trailer;
+	const char * names;
+	int i, file;
+
+	if ((file = open(data->filename, O_RDONLY)) < 0 || fstat(file, &info)) {
+		fprintf(stderr, "Could not open matrix file %s\n", data->filename);
+		raiseError();
+	}
+	data->size = info.st_size;
+	if (data->size < HEADER_SIZE + TRAILER_SIZE) 
+		corruptedMatrix(data);
+	if ((data->map = mmap(NULL, data->size, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not map matrix file %s\n", data->filename);
+		raiseError();
+	}
+	close(file);
+
+	trailer = data->map + data->size - TRAILER_SIZE;
+	if (memcmp(data->map, magic, sizeof(magic)) || memcmp(trailer + 24, magic, sizeof(magic))) {
+		fprintf(stderr, "%s is not a complete wiggletools matrix file\n", data->filename);
+		raiseError();
+	}
+	memcpy(&mark, data->map + 8, sizeof(mark));
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", data->filename);
+		raiseError();
+	}
+	memcpy(&width, data->map + 12, sizeof(width));
+	memcpy(&flags, data->map + 16, sizeof(flags));
+	memcpy(&data->absorbed, data->map + 20, sizeof(int32_t));
+	if (((flags & FLOAT_VALUES_FLAG) != 0) != (sizeof(StoredValue) == sizeof(float))) {
+		fprintf(stderr, "%s stores its values as %s, it must be read by a build of wiggletools which does the same\n", data->filename, flags & FLOAT_VALUES_FLAG ? "floats" : "doubles");
+		raiseError();
+	}
+	header = headerSize(width);
+	if (width <= 0 || header > (int64_t) data->size - TRAILER_SIZE)
+		corruptedMatrix(data);
+	data->width = width;
+
+	memcpy(&blockTable, trailer, sizeof(blockTable));
+	memcpy(&chromTable, trailer + 8, sizeof(chromTable));
+	memcpy(&blockCount, trailer + 16, sizeof(blockCount));
+	memcpy(&chromCount, trailer + 20, sizeof(chromCount));
+	if (blockCount < 0 || chromCount < 0 || blockTable < header || blockTable % 8
+	    || chromTable != blockTable + blockCount * (int64_t) sizeof(MatrixBlock)
+	    || chromTable + chromCount * (int64_t) sizeof(MatrixChrom) > (int64_t) data->size - TRAILER_SIZE)
+		corruptedMatrix(data);
+	data->blocks = (const MatrixBlock *) (data->map + blockTable);
+	data->blockCount = blockCount;
+	data->chroms = (const MatrixChrom *) (data->map + chromTable);
+	data->chromCount = chromCount;
+
+	for (i = 0; i < blockCount; i++)
+		if (data->blocks[i].offset < header || data->blocks[i].offset % 8 || data->blocks[i].count <= 0 || data->blocks[i].offset + rowBytes(width) * data->blocks[i].count > blockTable)
+			corruptedMatrix(data);
+
+	names = (const char *) (data->chroms + chromCount);
+	data->labels = (char **) calloc(chromCount, sizeof(char *));
+	for (i = 0; i < chromCount; i++) {
+		const MatrixChrom * chrom = data->chroms + i;
+		if (chrom->name < 0 || names + chrom->name >= data->map + data->size - TRAILER_SIZE || !memchr(names + chrom->name, '\0', data->map + data->size - TRAILER_SIZE - names - chrom->name)
+		    || chrom->blockCount <= 0 || chrom->firstBlock < 0 || chrom->firstBlock + chrom->blockCount > blockCount)
+			corruptedMatrix(data);
+		data->labels[i] = internChromosome(names + chrom->name);
+	}
+
+	// Chromosomes are looked up by binary search
+	for (i = 1; i < chromCount; i++)
+		if (compareChroms(data->labels[i-1], data->labels[i]) >= 0) {
+			fprintf(stderr, "Matrix %s was written in another chromosome order: %s comes after %s\n", data->filename, data->labels[i], data->labels[i-1]);
+			raiseError();
+		}
+}
+
+// Builds the multiplexer straight from the rows of the file, without 
+// opening or merging the tracks it was made of
+static Multiplexer * MatrixFileMultiplexer(char * filename, int * absorbed) {
+	MatrixReaderData * data = (MatrixReaderData *) calloc(1, sizeof(MatrixReaderData));
+	data->filename = filename;
+	openMatrix(data);
+	if (absorbed)
+		*absorbed = data->absorbed;
+	if (data->blockCount) 
+		loadMatrixBlock(data, 0);
+	Multiplexer * res = newCoreMultiplexer(data, data->width, &MatrixMultiplexerPop, &MatrixMultiplexerSeek);
+	memcpy(res->default_values, data->map + HEADER_SIZE, data->width * sizeof(double));
+	memcpy(res->values, res->default_values, data->width * sizeof(double));
+	popMultiplexer(res);
+	return res;
+}
+
+//////////////////////////////////////////////////////
+// Deltas
+//
+// Tracks appended to a matrix are written to delta files
+// next to it, name.wtm.1, name.wtm.2, etc., each of them
+// a matrix of the new columns only, with breakpoints of
+// its own. The reader merges the rows of the base file
+// and of its deltas as it goes, the columns of each delta
+// following those before it, so that appending tracks
+// costs nothing more than writing them.
+//
+// A delta is written under a temporary name, reserved
+// when created, then renamed once complete: readers take
+// the deltas up to the first missing one. Compaction 
+// writes the merged rows into a new base file, which is
+// renamed over the old one, and records in its header 
+// the last delta it absorbed. Readers skip those deltas,
+// which are then deleted, so that appends, compactions
+// and readers may run at the same time.
+//////////////////////////////////////////////////////
+
+typedef struct matrixSegmentsData_st {
+	Multiset * segments;
+} MatrixSegmentsData;
+
+static char * deltaFilename(const char * filename, int index, const char * suffix) {
+	char * res = (char *) calloc(strlen(filename) + strlen(suffix) + 16, sizeof(char));
+	sprintf(res, "%s.%i%s", filename, index, suffix);
+	return res;
+}
+
+static bool deltaExists(const char * filename, int index) {
+	char * delta = deltaFilename(filename, index, "");
+	bool res = access(delta, F_OK) == 0;
+	free(delta);
+	return res;
+}
+
+// Read from the header of the base file, which a compaction may replace at any time
+static int absorbedDeltas(const char * filename) {
+	char header[HEADER_SIZE];
+	uint32_t mark;
+	int32_t absorbed;
+	FILE * file = fopen(filename, "rb");
+
+	if (!file || fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE || memcmp(header, magic, sizeof(magic))) {
+		fprintf(stderr, "Cannot append to %s, which is not a wiggletools matrix file\n", filename);
+		raiseError();
+	}
+	fclose(file);
+	memcpy(&mark, header + 8, sizeof(mark));
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", filename);
+		raiseError();
+	}
+	memcpy(&absorbed, header + 20, sizeof(absorbed));
+	return absorbed;
+}
+
+static void MatrixSegmentsPop(Multiplexer * multi) {
+	Multiset * segments = ((MatrixSegmentsData *) multi->data)->segments;
+	int i, j;
+
+	if (segments->done) {
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = segments->chrom;
+	multi->start = segments->start;
+	multi->finish = segments->finish;
+	multi->inplay_count = 0;
+	for (i = 0; i < segments->count; i++) {
+		Multiplexer * segment = segments->multis[i];
+		for (j = 0; j < segment->count; j++) {
+			int column = segments->offsets[i] + j;
+			multi->values[column] = segments->row[column];
+			multi->inplay_count += (multi->inplay[column] = segments->inplay[i] && segment->inplay[j]);
+		}
+	}
+	multi->change_count = -1;
+	popMultiset(segments);
+}
+
+static void MatrixSegmentsSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	MatrixSegmentsData * data = (MatrixSegmentsData *) multi->data;
+	multi->done = false;
+	seekMultiset(data->segments, chrom, start, finish);
+	MatrixSegmentsPop(multi);
+}
+
+// The base file and its deltas, the last of which is returned in last
+static Multiplexer * openMatrixSegments(char * filename, int * absorbed, int * last) {
+	Multiplexer * base = MatrixFileMultiplexer(filename, absorbed);
+	Multiplexer ** segments;
+	int count, i;
+
+	for (*last = *absorbed; deltaExists(filename, *last + 1); (*last)++);
+	if (*last == *absorbed)
+		return base;
+
+	count = *last - *absorbed + 1;
+	segments = (Multiplexer **) calloc(count, sizeof(Multiplexer *));
+	segments[0] = base;
+	for (i = 1; i < count; i++)
+		segments[i] = MatrixFileMultiplexer(deltaFilename(filename, *absorbed + i, ""), NULL);
+
+	MatrixSegmentsData * data = (MatrixSegmentsData *) calloc(1, sizeof(MatrixSegmentsData));
+	data->segments = newMultiset(segments, count);
+	Multiplexer * res = newCoreMultiplexer(data, data->segments->offsets[count], &MatrixSegmentsPop, &MatrixSegmentsSeek);
+	for (i = 0; i < count; i++)
+		memcpy(res->default_values + data->segments->offsets[i], segments[i]->default_values, segments[i]->count * sizeof(double));
+	memcpy(res->values, res->default_values, res->count * sizeof(double));
+	popMultiplexer(res);
+	return res;
+}
+
+Multiplexer * MatrixMultiplexer(char * filename) {
+	int absorbed, last;
+	return openMatrixSegments(filename, &absorbed, &last);
+}
+
+MatrixWriter * openMatrixDelta(char * filename, int width, const double * default_values) {
+	MatrixWriter * writer;
+	char * delta, * temporary;
+	int index, file;
+
+	for (index = absorbedDeltas(filename) + 1; ; index++, free(delta), free(temporary)) {
+		delta = deltaFilename(filename, index, "");
+		temporary = deltaFilename(filename, index, ".tmp");
+		if (access(delta, F_OK) == 0)
+			continue;
+		if ((file = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+			// Reserved by another append
+			if (errno == EEXIST)
+				continue;
+			fprintf(stderr, "Could not create matrix delta %s\n", temporary);
+			raiseError();
+		}
+		// Unless a compaction absorbed that index meanwhile
+		if (index > absorbedDeltas(filename))
+			break;
+		close(file);
+		unlink(temporary);
+	}
+
+	writer = startMatrixWriter(fdopen(file, "w"), width, default_values, 0);
+	writer->filename = delta;
+	writer->temporary = temporary;
+	return writer;
+}
+
+void compactMatrix(char * filename) {
+	int absorbed, last, index, i, file;
+	Multiplexer * matrix = openMatrixSegments(filename, &absorbed, &last);
+	MatrixWriter * writer;
+	StoredValue * row;
+
+	if (last == absorbed)
+		return;
+	char * temporary = (char *) calloc(strlen(filename) + strlen(".compacting") + 1, sizeof(char));
+	sprintf(temporary, "%s.compacting", filename);
+	if ((file = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		fprintf(stderr, "Could not create %s: if no other compaction of %s is running, remove it\n", temporary, filename);
+		raiseError();
+	}
+
+	writer = startMatrixWriter(fdopen(file, "w"), matrix->count, matrix->default_values, last);
+	writer->filename = filename;
+	writer->temporary = temporary;
+	row = (StoredValue *) calloc(matrix->count, sizeof(StoredValue));
+	for (; !matrix->done; popMultiplexer(matrix)) {
+		for (i = 0; i < matrix->count; i++)
+			row[i] = matrix->values[i];
+		addMatrixRow(writer, matrix->chrom, matrix->start, matrix->finish, row, matrix->inplay);
+	}
+	finishMatrixWriter(writer);
+	fclose(writer->file);
+	free(row);
+	free(temporary);
+
+	// Readers of the new base file skip the deltas it absorbed
+	for (index = absorbed + 1; index <= last; index++) {
+		char * delta = deltaFilename(filename, index, "");
+		unlink(delta);
+		free(delta);
+	}
+}
@@ -0,0 +1,59 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _MATRIX_STORE_H_
+#define _MATRIX_STORE_H_
+
+// Matrix files (.wtm), which store the output of a multiplexer over N tracks
+//
+// The union of the breakpoints of the tracks is stored once, with a row of N
+// values and N in-play flags per segment, so that reading the matrix back
+// costs one file and no merge. The layout follows that of the track cache
+// files, with blocks of rows indexed by chromosome in a footer:
+//
+// header    magic (8 bytes), byte order mark, width, flags, deltas absorbed (int32 each),
+//           default values (double[width])
+// blocks    starts, finishes (int32[count] each), values (double[count * width],
+//           or float if flagged so), in-play flags (char[count * width]),
+//           padded to 8 bytes
+// blocks    offset (int64), count, finish of the last row (int32 each)
+// chroms    name offset, first block, block count (int32 each), padding
+// names     NUL terminated, padded to 8 bytes
+// trailer   block table offset, chromosome table offset (int64 each),
+//           block count, chromosome count (int32 each), magic (8 bytes)
+//
+// Coordinates are stored as the multiplexers hold them, 1-based half open.
+//
+// Tracks are appended as delta files, name.wtm.1, name.wtm.2, etc., matrices
+// of the new columns only which readers merge on the fly, until compacted 
+// into the base file.
+
+#include <stdio.h>
+#include "multiplexer.h"
+
+typedef struct matrixWriter_st MatrixWriter;
+
+// Rows must arrive sorted and must not overlap
+MatrixWriter * openMatrixWriter(FILE * file, int width, const double * default_values);
+void addMatrixRow(MatrixWriter * writer, char * chrom, int start, int finish, const StoredValue * values, const bool * inplay);
+void finishMatrixWriter(MatrixWriter * writer);
+FILE * matrixWriterFile(MatrixWriter * writer);
+// Writes the next delta of an existing matrix file, which appears to readers once finished
+MatrixWriter * openMatrixDelta(char * filename, int width, const double * default_values);
+// Merges the deltas of a matrix file into it
+void compactMatrix(char * filename);
+
+bool isMatrixFilename(const char * filename);
+
+#endif
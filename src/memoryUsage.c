@@ -0,0 +1,70 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "memoryUsage.h"
+
+static const char * names[MEMORY_SUBSYSTEMS] = {"readers", "buffers", "apply", "reducers", "writers"};
+static long long current[MEMORY_SUBSYSTEMS];
+static long long peak[MEMORY_SUBSYSTEMS];
+static long long total = 0;
+static long long totalPeak = 0;
+static long long budget = 0;
+
+void setMaxMemory(long long bytes) {
+	if (bytes < 0) {
+		fprintf(stderr, "Memory budget cannot be negative: %lli\n", bytes);
+		raiseError();
+	}
+	budget = bytes;
+}
+
+long long memoryBudget() {
+	return budget;
+}
+
+static void raisePeak(long long * peak, long long value) {
+	long long previous = __atomic_load_n(peak, __ATOMIC_RELAXED);
+	while (value > previous && !__atomic_compare_exchange_n(peak, &previous, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void countMemory(MemorySubsystem subsystem, long long bytes) {
+	raisePeak(&peak[subsystem], __atomic_add_fetch(&current[subsystem], bytes, __ATOMIC_RELAXED));
+	raisePeak(&totalPeak, __atomic_add_fetch(&total, bytes, __ATOMIC_RELAXED));
+}
+
+bool memoryFits(long long bytes) {
+	return !budget || __atomic_load_n(&total, __ATOMIC_RELAXED) + bytes <= budget;
+}
+
+static double megabytes(long long bytes) {
+	return bytes / (1024. * 1024.);
+}
+
+void printMemoryStatistics(FILE * file) {
+	struct rusage usage;
+	int i;
+
+	fprintf(file, "Peak memory:");
+	for (i = 0; i < MEMORY_SUBSYSTEMS; i++)
+		fprintf(file, " %s %.1fMB,", names[i], megabytes(__atomic_load_n(&peak[i], __ATOMIC_RELAXED)));
+	fprintf(file, " all counted %.1fMB", megabytes(__atomic_load_n(&totalPeak, __ATOMIC_RELAXED)));
+	// ru_maxrss is in kilobytes
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		fprintf(file, ", resident %.1fMB", usage.ru_maxrss / 1024.);
+	fprintf(file, "\n");
+}
@@ -0,0 +1,43 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _MEMORY_USAGE_H_
+#define _MEMORY_USAGE_H_
+
+#include "wiggletools.h"
+
+// Bytes held by the main consumers of memory, and budget shared by all of them
+//
+// Only the allocations which grow with the data or the command line are 
+// counted: the blocks of the readers, the regions of apply, the tables of 
+// the reducers and the blocks of the writers. Subsystems which can make do 
+// with less memory check memoryFits before growing beyond their minimum.
+
+typedef enum memorySubsystem_en {
+	MEMORY_READERS,
+	MEMORY_BUFFERS,
+	MEMORY_APPLY,
+	MEMORY_REDUCERS,
+	MEMORY_WRITERS,
+	MEMORY_SUBSYSTEMS
+} MemorySubsystem;
+
+// Bytes allocated by a subsystem, or released if negative
+void countMemory(MemorySubsystem subsystem, long long bytes);
+// True if there is no budget, or if the counted bytes plus these fit within it
+bool memoryFits(long long bytes);
+// 0 if there is no budget
+long long memoryBudget();
+
+#endif
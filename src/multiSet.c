@@ -18,15 +18,22 @@
 
 #include "multiSet.h"
 
+// A set keeps its values for as long as it is in play, so the row only
+// changes when sets enter or leave play
+static void copySetValues(Multiset * multi, int index, const double * values) {
+	memcpy(multi->row + multi->offsets[index], values, multi->multis[index]->count * sizeof(double));
+}
+
 static void popClosingMultiplexers(Multiset * multi) {
-	while (fh_notempty(multi->finishes) && fh_min(multi->finishes) == multi->finish) {
-		int index = fh_extractmin(multi->finishes);
+	while (ih_notempty(multi->finishes) && ih_min(multi->finishes) == multi->finish) {
+		int index = ih_extractmin(multi->finishes);
 		Multiplexer * multiplexer = multi->multis[index];
 		popMultiplexer(multiplexer);
+		copySetValues(multi, index, multiplexer->default_values);
 		multi->inplay[index] = false;
 		multi->inplay_count--;
-		if (!multiplexer->done && !strcmp(multiplexer->chrom, multi->chrom))
-			fh_insert(multi->starts, multiplexer->start, index);
+		if (!multiplexer->done && multiplexer->chrom == multi->chrom)
+			ih_insert(multi->starts, multiplexer->start, index);
 	}
 }
 
@@ -36,7 +43,7 @@ static void queueUpMultiplexers(Multiset * multi) {
 	Multiplexer ** muPtr = multi->multis;
 	int i; 
 	for (i = 0; i < multi->count; i++) {
-		if ((!(*muPtr)->done) && (!multi->chrom || strcmp((*muPtr)->chrom, multi->chrom) < 0))
+		if ((!(*muPtr)->done) && (!multi->chrom || compareChroms((*muPtr)->chrom, multi->chrom) < 0))
 			multi->chrom = (*muPtr)->chrom;
 		muPtr++;
 	}
@@ -50,28 +57,29 @@ static void queueUpMultiplexers(Multiset * multi) {
 	// Put those multiplexers in heap
 	muPtr = multi->multis;
 	for (i = 0; i < multi->count; i++) {
-		if ((!(*muPtr)->done) && strcmp((*muPtr)->chrom, multi->chrom) == 0)
-			fh_insert(multi->starts, (*muPtr)->start, i);
+		if ((!(*muPtr)->done) && (*muPtr)->chrom == multi->chrom)
+			ih_insert(multi->starts, (*muPtr)->start, i);
 		muPtr++;
 	}
 
 }
 
 static void admitNewMultiplexersIntoPlay(Multiset * multi) {
-	while (fh_notempty(multi->starts) && fh_min(multi->starts) == multi->start) {
-		int index = fh_extractmin(multi->starts);
+	while (ih_notempty(multi->starts) && ih_min(multi->starts) == multi->start) {
+		int index = ih_extractmin(multi->starts);
 		Multiplexer * multiplexer = multi->multis[index];
-		fh_insert(multi->finishes, multiplexer->finish, index);
+		ih_insert(multi->finishes, multiplexer->finish, index);
+		copySetValues(multi, index, multiplexer->values);
 		multi->inplay[index] = true;
 		multi->inplay_count++;
 	}
 }
 
 static void defineNewFinish(Multiset * multi) {
-	multi->finish = fh_min(multi->finishes);
+	multi->finish = ih_min(multi->finishes);
 
-	if (fh_notempty(multi->starts)) {
-		int min_start = fh_min(multi->starts);
+	if (ih_notempty(multi->starts)) {
+		int min_start = ih_min(multi->starts);
 		if (multi->finish > min_start)
 			multi->finish = min_start;
 	}
@@ -83,7 +91,7 @@ void popMultiset(Multiset * multi) {
 	// Check that there are multiplexers queued up
 	// If no multiplexers are waiting, either waiting on other chromosomes
 	// or finished.
-	if (fh_empty(multi->starts) && fh_empty(multi->finishes))
+	if (ih_empty(multi->starts) && ih_empty(multi->finishes))
 		queueUpMultiplexers(multi);
 
 	// If queues still empty
@@ -94,7 +102,7 @@ void popMultiset(Multiset * multi) {
 	if (multi->inplay_count)
 		multi->start = multi->finish;
 	else
-		multi->start = fh_min(multi->starts);
+		multi->start = ih_min(multi->starts);
 
 	admitNewMultiplexersIntoPlay(multi);
 	defineNewFinish(multi);
@@ -103,12 +111,14 @@ void popMultiset(Multiset * multi) {
 void seekMultiset(Multiset * multi, const char * chrom, int start, int finish) {
 	int i;
 	multi->done = false;
-	for (i=0; i<multi->count; i++)
+	for (i=0; i<multi->count; i++) {
 		seekMultiplexer(multi->multis[i], chrom, start, finish);
-	fh_deleteheap(multi->starts);
-	fh_deleteheap(multi->finishes);
-	multi->starts = fh_makeheap();
-	multi->finishes = fh_makeheap();
+		copySetValues(multi, i, multi->multis[i]->default_values);
+		multi->inplay[i] = false;
+	}
+	multi->inplay_count = 0;
+	ih_clear(multi->starts);
+	ih_clear(multi->finishes);
 	popMultiset(multi);
 }
 
@@ -117,12 +127,15 @@ Multiset * newMultiset(Multiplexer ** multis, int count) {
 	new->count = count;
 	new->multis = multis;
 	new->inplay = (bool *) calloc(count, sizeof(bool));
-	new->values = (double **) calloc(count, sizeof(double));
-	new->starts = fh_makeheap();
-	new->finishes = fh_makeheap();
+	new->offsets = (int *) calloc(count + 1, sizeof(int));
+	new->starts = ih_makeheap(count);
+	new->finishes = ih_makeheap(count);
 	int i;
 	for (i = 0; i < count; i++)
-		new->values[i] = multis[i]->values;
+		new->offsets[i + 1] = new->offsets[i] + multis[i]->count;
+	new->row = (double *) calloc(new->offsets[count], sizeof(double));
+	for (i = 0; i < count; i++)
+		copySetValues(new, i, multis[i]->default_values);
 	popMultiset(new);
 	return new;
 }
@@ -21,12 +21,15 @@ struct multiset_st {
 	char * chrom;
 	int start;
 	int finish;
-	double ** values;
+	// The value of each input of each set in turn, sets out of play holding
+	// their default values. The inputs of set i start at offsets[i].
+	double * row;
+	int * offsets;
 	int count, inplay_count;
 	bool *inplay;
 	Multiplexer ** multis;
 	bool done;
-	FibHeap * starts, * finishes;
+	IndexHeap * starts, * finishes;
 };
 
 void popMultiset(Multiset* multi);
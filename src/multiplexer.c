@@ -18,42 +18,105 @@
 #include <math.h>
 
 #include "multiplexer.h"
+#include "profiler.h"
 
 void popMultiplexer(Multiplexer * multi) {
-	if (!multi->done)
+	if (multi->done)
+		return;
+	else if (multi->profile)
+		profileMultiplexerPop(multi);
+	else
 		multi->pop(multi);
 }
 
 void runMultiplexer(Multiplexer * multi) {
 	while (!multi->done)
-		multi->pop(multi);
+		popMultiplexer(multi);
 }
 
 void seekMultiplexer(Multiplexer * multi, const char * chrom, int start, int finish) {
 	multi->done = false;
-	multi->seek(multi, chrom, start, finish);
+	if (multi->profile)
+		profileMultiplexerSeek(multi, chrom, start, finish);
+	else
+		multi->seek(multi, chrom, start, finish);
+}
+
+static bool multiplexerLags(Multiplexer * multi, const char * chrom, int start) {
+	int chrom_cmp = compareChroms(multi->chrom, chrom);
+	return chrom_cmp < 0 || (chrom_cmp == 0 && multi->finish <= start);
+}
+
+void skipMultiplexer(Multiplexer * multi, const char * chrom, int start) {
+	if (multi->done || !multiplexerLags(multi, chrom, start))
+		return;
+	else if (multi->skipTo)
+		multi->skipTo(multi, chrom, start);
+	while (!multi->done && multiplexerLags(multi, chrom, start))
+		popMultiplexer(multi);
+}
+
+static void recordChange(Multiplexer * multi, int index, double value, bool entered) {
+	if (multi->change_count < 0)
+		return;
+	// Strict multiplexers can go through many positions in one pop
+	if (multi->change_count == 2 * multi->count) {
+		multi->change_count = -1;
+		return;
+	}
+	MultiplexerChange * change = multi->changes + multi->change_count++;
+	change->index = index;
+	change->previous = multi->values[index];
+	change->value = value;
+	change->entered = entered;
+}
+
+static void enterPlay(Multiplexer * multi, int index) {
+	multi->inplay[index] = true;
+	if (multi->active) {
+		multi->active_positions[index] = multi->inplay_count;
+		multi->active[multi->inplay_count] = index;
+	}
+	multi->inplay_count++;
+}
+
+static void leavePlay(Multiplexer * multi, int index) {
+	multi->inplay[index] = false;
+	multi->inplay_count--;
+	if (multi->active) {
+		int last = multi->active[multi->inplay_count];
+		multi->active[multi->active_positions[index]] = last;
+		multi->active_positions[last] = multi->active_positions[index];
+	}
 }
 
 static void popClosingWiggleIterators(Multiplexer * multi) {
-	while (fh_notempty(multi->finishes) && fh_min(multi->finishes) == multi->finish) {
-		int index = fh_extractmin(multi->finishes);
+	int * indices;
+	int count, i;
+
+	if (ih_empty(multi->finishes) || ih_min(multi->finishes) != multi->finish)
+		return;
+	count = ih_extractmins(multi->finishes, &indices);
+	for (i = 0; i < count; i++) {
+		int index = indices[i];
 		WiggleIterator * wi = multi->iters[index];
 		pop(wi);
-		multi->inplay[index] = false;
-		multi->inplay_count--;
+		leavePlay(multi, index);
+		recordChange(multi, index, wi->default_value, false);
 		multi->values[index] = wi->default_value;
-		if (!wi->done && !strcmp(wi->chrom, multi->chrom))
-			fh_insert(multi->starts, wi->start, index);
+		if (!wi->done && wi->chrom == multi->chrom)
+			ih_insert(multi->starts, wi->start, index);
 	}
 }
 
-static void queueUpWiggleIterators(Multiplexer * multi) {
+// Starts before floor, on chromosome floorChrom, were already gone past
+static void queueUpWiggleIterators(Multiplexer * multi, const char * floorChrom, int floor) {
 	// Find lowest value chromosome
 	multi->chrom = NULL;
 	WiggleIterator ** muPtr = multi->iters;
 	int i; 
 	for (i = 0; i < multi->count; i++) {
-		if ((!(*muPtr)->done) && (!multi->chrom || strcmp((*muPtr)->chrom, multi->chrom) < 0))
+		if ((!(*muPtr)->done) && (!multi->chrom || compareChroms((*muPtr)->chrom, multi->chrom) < 0))
 			multi->chrom = (*muPtr)->chrom;
 		muPtr++;
 	}
@@ -67,28 +130,34 @@ static void queueUpWiggleIterators(Multiplexer * multi) {
 	// Put those wis in heap
 	muPtr = multi->iters;
 	for (i = 0; i < multi->count; i++) {
-		if ((!(*muPtr)->done) && strcmp((*muPtr)->chrom, multi->chrom) == 0)
-			fh_insert(multi->starts, (*muPtr)->start, i);
+		if ((!(*muPtr)->done) && (*muPtr)->chrom == multi->chrom)
+			ih_insert(multi->starts, (*muPtr)->chrom == floorChrom && (*muPtr)->start < floor ? floor : (*muPtr)->start, i);
 		muPtr++;
 	}
 }
 
 static void admitNewWiggleIteratorsIntoPlay(Multiplexer * multi) {
-	while (fh_notempty(multi->starts) && fh_min(multi->starts) == multi->start) {
-		int index = fh_extractmin(multi->starts);
+	int * indices;
+	int count, i;
+
+	if (ih_empty(multi->starts) || ih_min(multi->starts) != multi->start)
+		return;
+	count = ih_extractmins(multi->starts, &indices);
+	for (i = 0; i < count; i++) {
+		int index = indices[i];
 		WiggleIterator * wi = multi->iters[index];
-		fh_insert(multi->finishes, wi->finish, index);
-		multi->inplay[index] = true;
+		ih_insert(multi->finishes, wi->finish, index);
+		enterPlay(multi, index);
+		recordChange(multi, index, wi->value, true);
 		multi->values[index] = wi->value;
-		multi->inplay_count++;
 	}
 }
 
 static void defineNewFinish(Multiplexer * multi) {
-	multi->finish = fh_min(multi->finishes);
+	multi->finish = ih_min(multi->finishes);
 
-	if (fh_notempty(multi->starts)) {
-		int min_start = fh_min(multi->starts);
+	if (ih_notempty(multi->starts)) {
+		int min_start = ih_min(multi->starts);
 		if (multi->finish > min_start) {
 			multi->finish = min_start;
 		}
@@ -101,8 +170,8 @@ static bool popCoreMultiplexer2(Multiplexer * multi) {
 	// Check that there are wis queued up
 	// If no wis are waiting, either waiting on other chromosomes
 	// or finished.
-	if (fh_empty(multi->starts) && fh_empty(multi->finishes))
-		queueUpWiggleIterators(multi);
+	if (ih_empty(multi->starts) && ih_empty(multi->finishes))
+		queueUpWiggleIterators(multi, NULL, 0);
 
 	// If queues still empty
 	if (multi->done)
@@ -112,7 +181,7 @@ static bool popCoreMultiplexer2(Multiplexer * multi) {
 	if (multi->inplay_count)
 		multi->start = multi->finish;
 	else
-		multi->start = fh_min(multi->starts);
+		multi->start = ih_min(multi->starts);
 
 	admitNewWiggleIteratorsIntoPlay(multi);
 	defineNewFinish(multi);
@@ -121,6 +190,7 @@ static bool popCoreMultiplexer2(Multiplexer * multi) {
 }
 
 static void popCoreMultiplexer(Multiplexer * multi) {
+	multi->change_count = 0;
 	while (!multi->done) {
 		if (popCoreMultiplexer2(multi) || !multi->strict)
 			break;
@@ -130,13 +200,207 @@ static void popCoreMultiplexer(Multiplexer * multi) {
 static void seekCoreMultiplexer(Multiplexer * multi, const char * chrom, int start, int finish) {
 	int i;
 	multi->done = false;
-	for (i=0; i<multi->count; i++)
+	for (i=0; i<multi->count; i++) {
 		seek(multi->iters[i], chrom, start, finish);
-	fh_deleteheap(multi->starts);
-	fh_deleteheap(multi->finishes);
-	multi->starts = fh_makeheap();
-	multi->finishes = fh_makeheap();
+		multi->inplay[i] = false;
+		multi->values[i] = multi->default_values[i];
+	}
+	multi->inplay_count = 0;
+	ih_clear(multi->starts);
+	ih_clear(multi->finishes);
 	popMultiplexer(multi);
+	// The values were reset
+	multi->change_count = -1;
+}
+
+// The inputs skip, then the multiplexer starts afresh from where it was,
+// so that the records which straddle the skipped gap are not read twice
+static void skipCoreMultiplexer(Multiplexer * multi, const char * chrom, int start) {
+	char * floorChrom = multi->chrom;
+	int floor = multi->finish;
+	int i;
+
+	for (i=0; i<multi->count; i++) {
+		skipTo(multi->iters[i], chrom, start);
+		multi->inplay[i] = false;
+		multi->values[i] = multi->default_values[i];
+	}
+	multi->inplay_count = 0;
+	ih_clear(multi->starts);
+	ih_clear(multi->finishes);
+
+	queueUpWiggleIterators(multi, floorChrom, floor);
+	if (!multi->done) {
+		multi->start = ih_min(multi->starts);
+		admitNewWiggleIteratorsIntoPlay(multi);
+		defineNewFinish(multi);
+		if (multi->strict && multi->inplay_count < multi->count)
+			popCoreMultiplexer(multi);
+	}
+	// The values were reset
+	multi->change_count = -1;
+}
+
+//////////////////////////////////////////////////////
+// Two inputs
+//
+// Pairwise comparisons, e.g. diff, ratio or pearson, sweep their two 
+// inputs side by side instead of going through the heaps. The positions,
+// values and changes are the same, ties going to the first input as in 
+// the heaps.
+//////////////////////////////////////////////////////
+
+typedef struct pairQueue_st {
+	// Whether each input waits to come into play, from what start
+	bool waiting[2];
+	int starts[2];
+} PairQueue;
+
+static void popClosingPair(Multiplexer * multi, PairQueue * queue) {
+	int index;
+
+	for (index = 0; index < 2; index++) {
+		WiggleIterator * wi = multi->iters[index];
+		if (!multi->inplay[index] || wi->finish != multi->finish)
+			continue;
+		pop(wi);
+		leavePlay(multi, index);
+		recordChange(multi, index, wi->default_value, false);
+		multi->values[index] = wi->default_value;
+		if (!wi->done && wi->chrom == multi->chrom) {
+			queue->waiting[index] = true;
+			queue->starts[index] = wi->start;
+		}
+	}
+}
+
+static void queueUpPair(Multiplexer * multi, PairQueue * queue, const char * floorChrom, int floor) {
+	WiggleIterator * A = multi->iters[0];
+	WiggleIterator * B = multi->iters[1];
+	int index;
+
+	if (A->done && B->done) {
+		multi->chrom = NULL;
+		multi->done = true;
+		return;
+	} else if (B->done || (!A->done && compareChroms(A->chrom, B->chrom) <= 0))
+		multi->chrom = A->chrom;
+	else
+		multi->chrom = B->chrom;
+
+	for (index = 0; index < 2; index++) {
+		WiggleIterator * wi = multi->iters[index];
+		if (!wi->done && wi->chrom == multi->chrom) {
+			queue->waiting[index] = true;
+			queue->starts[index] = wi->chrom == floorChrom && wi->start < floor ? floor : wi->start;
+		}
+	}
+}
+
+static int firstPairStart(PairQueue * queue) {
+	if (!queue->waiting[1] || (queue->waiting[0] && queue->starts[0] <= queue->starts[1]))
+		return queue->starts[0];
+	return queue->starts[1];
+}
+
+static void admitPair(Multiplexer * multi, PairQueue * queue) {
+	int index;
+
+	for (index = 0; index < 2; index++) {
+		if (!queue->waiting[index] || queue->starts[index] != multi->start)
+			continue;
+		queue->waiting[index] = false;
+		enterPlay(multi, index);
+		recordChange(multi, index, multi->iters[index]->value, true);
+		multi->values[index] = multi->iters[index]->value;
+	}
+}
+
+static void defineNewPairFinish(Multiplexer * multi, PairQueue * queue) {
+	bool first = true;
+	int index;
+
+	for (index = 0; index < 2; index++) {
+		if (multi->inplay[index] && (first || multi->iters[index]->finish < multi->finish)) {
+			multi->finish = multi->iters[index]->finish;
+			first = false;
+		}
+	}
+	if ((queue->waiting[0] || queue->waiting[1]) && firstPairStart(queue) < multi->finish)
+		multi->finish = firstPairStart(queue);
+}
+
+static bool popPairMultiplexer2(Multiplexer * multi) {
+	PairQueue * queue = (PairQueue *) multi->data;
+
+	popClosingPair(multi, queue);
+
+	if (!queue->waiting[0] && !queue->waiting[1] && !multi->inplay_count)
+		queueUpPair(multi, queue, NULL, 0);
+
+	if (multi->done)
+		return false;
+
+	if (multi->inplay_count)
+		multi->start = multi->finish;
+	else
+		multi->start = firstPairStart(queue);
+
+	admitPair(multi, queue);
+	defineNewPairFinish(multi, queue);
+
+	return multi->inplay_count == 2;
+}
+
+static void popPairMultiplexer(Multiplexer * multi) {
+	multi->change_count = 0;
+	while (!multi->done) {
+		if (popPairMultiplexer2(multi) || !multi->strict)
+			break;
+	}
+}
+
+static void resetPair(Multiplexer * multi) {
+	PairQueue * queue = (PairQueue *) multi->data;
+	int index;
+
+	for (index = 0; index < 2; index++) {
+		multi->inplay[index] = false;
+		multi->values[index] = multi->default_values[index];
+		queue->waiting[index] = false;
+	}
+	multi->inplay_count = 0;
+}
+
+static void seekPairMultiplexer(Multiplexer * multi, const char * chrom, int start, int finish) {
+	multi->done = false;
+	seek(multi->iters[0], chrom, start, finish);
+	seek(multi->iters[1], chrom, start, finish);
+	resetPair(multi);
+	popMultiplexer(multi);
+	// The values were reset
+	multi->change_count = -1;
+}
+
+static void skipPairMultiplexer(Multiplexer * multi, const char * chrom, int start) {
+	PairQueue * queue = (PairQueue *) multi->data;
+	char * floorChrom = multi->chrom;
+	int floor = multi->finish;
+
+	skipTo(multi->iters[0], chrom, start);
+	skipTo(multi->iters[1], chrom, start);
+	resetPair(multi);
+
+	queueUpPair(multi, queue, floorChrom, floor);
+	if (!multi->done) {
+		multi->start = firstPairStart(queue);
+		admitPair(multi, queue);
+		defineNewPairFinish(multi, queue);
+		if (multi->strict && multi->inplay_count < 2)
+			popPairMultiplexer(multi);
+	}
+	// The values were reset
+	multi->change_count = -1;
 }
 
 Multiplexer * newCoreMultiplexer(void * data, int count, void (*pop)(Multiplexer *), void (*seek)(Multiplexer *, const char *, int, int)) {
@@ -145,23 +409,39 @@ Multiplexer * newCoreMultiplexer(void * data, int count, void (*pop)(Multiplexer
 	new->values = (double *) calloc(count, sizeof(double));
 	new->default_values = (double *) calloc(count, sizeof(double));
 	new->inplay = (bool *) calloc(count, sizeof(bool));
+	new->change_count = -1;
 	new->pop = pop;
 	new->seek = seek;
 	new->data = data;
-	new->starts = fh_makeheap();
-	new->finishes = fh_makeheap();
+	new->profile = newOperatorProfile();
+	new->starts = ih_makeheap(count);
+	new->finishes = ih_makeheap(count);
 	return new;
 }
 
 Multiplexer * newMultiplexer(WiggleIterator ** iters, int count, bool strict) {
-	Multiplexer * new = newCoreMultiplexer(NULL, count, popCoreMultiplexer, seekCoreMultiplexer);
+	Multiplexer * new;
+	if (count == 2)
+		new = newCoreMultiplexer(calloc(1, sizeof(PairQueue)), count, popPairMultiplexer, seekPairMultiplexer);
+	else
+		new = newCoreMultiplexer(NULL, count, popCoreMultiplexer, seekCoreMultiplexer);
 	new->strict = strict;
 	new->iters = calloc(count, sizeof(WiggleIterator *));
+	new->changes = (MultiplexerChange *) calloc(2 * count, sizeof(MultiplexerChange));
+	new->active = (int *) calloc(count, sizeof(int));
+	new->active_positions = (int *) calloc(count, sizeof(int));
+	new->finite = true;
+	new->integral = true;
 	int i;
 	for (i = 0; i < count; i++) {
 		new->iters[i] = NonOverlappingWiggleIterator(iters[i]);
+		new->finite &= new->iters[i]->finite;
+		new->integral &= new->iters[i]->integral;
 		new->default_values[i] = new->iters[i]->default_value;
 		new->values[i] = new->iters[i]->default_value;
+		// One input which skips faster than it pops is enough to skip
+		if (new->iters[i]->skipTo)
+			new->skipTo = count == 2 ? skipPairMultiplexer : skipCoreMultiplexer;
 	}
 	popMultiplexer(new);
 	return new;
@@ -16,28 +16,54 @@
 #define WIGGLE_MULTIPLEXER_H_
 
 #include "wiggleIterator.h"
-#include "fib.h"
+#include "indexHeap.h"
+
+// An input entering or leaving play
+typedef struct multiplexerChange_st {
+	int index;
+	double previous, value;
+	bool entered;
+} MultiplexerChange;
 
 struct multiplexer_st {
 	char * chrom;
 	int start;
 	int finish;
+	// The current value of each input, which is its default value when it is
+	// not in play, so that the reducers can run through them in one go
 	double * values;
 	double * default_values;
 	int count, inplay_count;
 	bool *inplay;
+	// The inplay_count indices of the inputs in play, in no particular order,
+	// and the position of each input in that list. NULL if not kept up to date.
+	int * active, * active_positions;
+	// Changes since the previous position, in order, so that reducers can
+	// update their result instead of scanning all the values.
+	// change_count is -1 when they are not known, e.g. after a seek.
+	MultiplexerChange * changes;
+	int change_count;
 	WiggleIterator ** iters;
 	bool done;
 	bool strict;
+	// No input ever holds NaN or infinite values, or other than integers,
+	// see WiggleIterator
+	bool finite, integral;
 	void (*pop)(Multiplexer *);
 	void (*seek)(Multiplexer *, const char *, int, int);
-	FibHeap * starts, *finishes;
+	// Optional, as skipTo on iterators
+	void (*skipTo)(Multiplexer *, const char *, int);
+	IndexHeap * starts, *finishes;
 	void * data;
+	// Only set when profiling
+	OperatorProfile * profile;
 };
 
 void popMultiplexer(Multiplexer * multi);
 void seekMultiplexer(Multiplexer * multi, const char * chrom, int start, int finish);
 void runMultiplexer(Multiplexer * multi);
+// Drops the positions which end at or before chrom:start, forward only
+void skipMultiplexer(Multiplexer * multi, const char * chrom, int start);
 Multiplexer * newCoreMultiplexer(void * data, int count, void (*pop)(Multiplexer *), void (*seek)(Multiplexer *, const char *, int, int));
 
 #endif
@@ -0,0 +1,106 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "npyWriter.h"
+
+// Magic, version and header length, then the header
+#define NPY_PREFIX 10
+// Total length of the header, a multiple of 64
+#define NPY_HEADER 128
+
+struct npyFile_st {
+	FILE * file;
+	char * filename;
+	int width;
+	bool vector;
+	long long rows;
+	float * row;
+};
+
+bool isNpyFilename(char * filename) {
+	size_t length = strlen(filename);
+	return length > 4 && strcmp(filename + length - 4, ".npy") == 0;
+}
+
+static bool isLittleEndian() {
+	int one = 1;
+	return *((char *) &one) == 1;
+}
+
+static void writeNpyHeader(NpyFile * npy) {
+	char header[NPY_HEADER];
+	char shape[64];
+	int length;
+
+	if (npy->vector)
+		sprintf(shape, "(%i,)", npy->width);
+	else
+		sprintf(shape, "(%lli, %i)", npy->rows, npy->width);
+
+	memcpy(header, "\x93NUMPY\x01\x00", 8);
+	header[8] = (NPY_HEADER - NPY_PREFIX) & 0xff;
+	header[9] = (NPY_HEADER - NPY_PREFIX) >> 8;
+	length = NPY_PREFIX + sprintf(header + NPY_PREFIX, "{'descr': '%cf4', 'fortran_order': False, 'shape': %s, }", isLittleEndian() ? '<' : '>', shape);
+	memset(header + length, ' ', NPY_HEADER - 1 - length);
+	header[NPY_HEADER - 1] = '\n';
+
+	if (fseek(npy->file, 0, SEEK_SET) || fwrite(header, 1, NPY_HEADER, npy->file) != NPY_HEADER) {
+		fprintf(stderr, "Could not write the header of %s\n", npy->filename);
+		raiseError();
+	}
+}
+
+NpyFile * openNpyFile(char * filename, int width, bool vector) {
+	NpyFile * npy = (NpyFile *) calloc(1, sizeof(NpyFile));
+
+	if (width < 1) {
+		fprintf(stderr, "Cannot write rows of width %i to %s\n", width, filename);
+		raiseError();
+	}
+	npy->file = openOutputFile(filename);
+	npy->filename = strdup(filename);
+	npy->width = width;
+	npy->vector = vector;
+	npy->row = (float *) calloc(width, sizeof(float));
+	writeNpyHeader(npy);
+	return npy;
+}
+
+void writeNpyRow(NpyFile * npy, double * values) {
+	int i;
+
+	if (npy->vector && npy->rows) {
+		fprintf(stderr, "Cannot write more than one row to vector %s\n", npy->filename);
+		raiseError();
+	}
+	for (i = 0; i < npy->width; i++)
+		npy->row[i] = values[i];
+	if (fwrite(npy->row, sizeof(float), npy->width, npy->file) != npy->width) {
+		fprintf(stderr, "Could not write to %s\n", npy->filename);
+		raiseError();
+	}
+	npy->rows++;
+}
+
+void closeNpyFile(NpyFile * npy) {
+	writeNpyHeader(npy);
+	fclose(npy->file);
+	free(npy->filename);
+	free(npy->row);
+	free(npy);
+}
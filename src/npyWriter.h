@@ -0,0 +1,42 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _NPY_WRITER_H_
+#define _NPY_WRITER_H_
+
+// NumPy array files (.npy), format version 1.0, of float32 values
+//
+// magic     "\x93NUMPY", version 1.0 (2 bytes)
+// header    length (uint16 little endian), then a Python dict literal with
+//           the type, order and shape of the array, padded with spaces and
+//           ended by a newline, so that the data is aligned on 64 bytes
+// data      rows of values, in C order, in the byte order of the machine
+//
+// The number of rows is only known once the last is written, so the header
+// is written with room to spare, then rewritten when the file is closed.
+// The files are loaded, or memory-mapped, by numpy.load.
+
+#include "wiggletools.h"
+
+typedef struct npyFile_st NpyFile;
+
+// Files with a .npy suffix
+bool isNpyFilename(char * filename);
+// A matrix of rows of width values, or a single vector of width values
+NpyFile * openNpyFile(char * filename, int width, bool vector);
+void writeNpyRow(NpyFile * npy, double * values);
+void closeNpyFile(NpyFile * npy);
+
+#endif
@@ -0,0 +1,298 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "objectStore.h"
+#include "ioScheduler.h"
+#include "errors.h"
+
+// Kent library headers
+#include "common.h"
+#include "udc.h"
+
+// Ranges fetched at once, which is also the number of threads of the pool
+static int FETCH_CONNECTIONS = 8;
+// Connections kept open by each thread of the pool, one per file
+#define OPEN_CONNECTIONS 8
+
+void setFetchConnections(int value) {
+	if (value < 1) {
+		fprintf(stderr, "Number of fetch connections must be positive: %i\n", value);
+		raiseError();
+	}
+	FETCH_CONNECTIONS = value;
+}
+
+int fetchConnections() {
+	return FETCH_CONNECTIONS;
+}
+
+//////////////////////////////////////////////////////
+// URLs
+//////////////////////////////////////////////////////
+
+char * objectStoreUrl(const char * filename) {
+	const char * bucket, * key;
+	const char * endpoint = getenv("AWS_ENDPOINT_URL");
+	const char * region = getenv("AWS_REGION");
+	bool gcs;
+	char * url;
+	int bucketLength;
+	size_t length;
+
+	if (!strncmp(filename, "s3://", 5))
+		gcs = false;
+	else if (!strncmp(filename, "gs://", 5))
+		gcs = true;
+	else
+		return NULL;
+
+	bucket = filename + 5;
+	key = strchr(bucket, '/');
+	if (key == NULL || key == bucket || key[1] == '\0') {
+		fprintf(stderr, "Object store URL without a bucket or an object name: %s\n", filename);
+		raiseError();
+	}
+	bucketLength = key - bucket;
+	key++;
+
+	if (region == NULL)
+		region = getenv("AWS_DEFAULT_REGION");
+	length = strlen(filename) + 64 + (endpoint ? strlen(endpoint) : 0) + (region ? strlen(region) : 0);
+	url = (char *) calloc(length, sizeof(char));
+
+	if (gcs)
+		sprintf(url, "https://storage.googleapis.com/%.*s/%s", bucketLength, bucket, key);
+	else if (endpoint && endpoint[0]) {
+		// Custom endpoints, e.g. MinIO, are addressed by path
+		int endpointLength = strlen(endpoint);
+		if (endpoint[endpointLength - 1] == '/')
+			endpointLength--;
+		sprintf(url, "%.*s/%.*s/%s", endpointLength, endpoint, bucketLength, bucket, key);
+	} else if (region && region[0])
+		sprintf(url, "https://%.*s.s3.%s.amazonaws.com/%s", bucketLength, bucket, region, key);
+	else
+		sprintf(url, "https://%.*s.s3.amazonaws.com/%s", bucketLength, bucket, key);
+	return url;
+}
+
+//////////////////////////////////////////////////////
+// Fetching pool
+//////////////////////////////////////////////////////
+
+// Ranges requested by one call to fetchRanges
+typedef struct fetchBatch_st {
+	// Parked until the batch completes, NULL if the caller waits on the condition instead
+	IoTask * task;
+	// Ranges left to fetch, accessed atomically if task is set, under the mutex otherwise
+	int pending;
+	// Set atomically if a range could not be fetched, the error is then raised again by the caller
+	int failed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} FetchBatch;
+
+typedef struct fetchJob_st {
+	const char * url;
+	RangeRequest * range;
+	FetchBatch * batch;
+	struct fetchJob_st * next;
+} FetchJob;
+
+typedef struct connection_st {
+	char * url;
+	struct udcFile * udc;
+	long long lastUse;
+} Connection;
+
+// Job run by a thread of the pool, within catchErrors
+typedef struct fetch_st {
+	Connection * connections;
+	long long clock;
+	FetchJob * job;
+} Fetch;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+static FetchJob * poolQueue = NULL, * poolQueueTail = NULL;
+static int poolThreads = 0;
+
+// Connection to url, opening it in place of the least recently used one if needed
+static struct udcFile * connectTo(Connection * connections, const char * url, long long clock) {
+	Connection * connection = connections;
+	int index;
+
+	for (index = 0; index < OPEN_CONNECTIONS; index++) {
+		if (connections[index].url && !strcmp(connections[index].url, url)) {
+			connection = connections + index;
+			break;
+		} else if (connections[index].lastUse < connection->lastUse)
+			connection = connections + index;
+	}
+
+	if (!connection->url || strcmp(connection->url, url)) {
+		if (connection->udc)
+			udcFileClose(&connection->udc);
+		free(connection->url);
+		connection->url = NULL;
+		connection->udc = udcFileOpen((char *) url, udcDefaultDir());
+		connection->url = strdup(url);
+	}
+	connection->lastUse = clock;
+	return connection->udc;
+}
+
+static void closeConnectionBody(void * args) {
+	udcFileClose(&((Connection *) args)->udc);
+}
+
+// Dropped after an error, as its state is unknown
+static void closeConnection(Connection * connections, const char * url) {
+	int index;
+
+	for (index = 0; index < OPEN_CONNECTIONS; index++) {
+		if (connections[index].url && !strcmp(connections[index].url, url)) {
+			if (connections[index].udc && !catchErrors(&closeConnectionBody, connections + index))
+				connections[index].udc = NULL;
+			free(connections[index].url);
+			connections[index].url = NULL;
+		}
+	}
+}
+
+static void fetchRange(void * args) {
+	Fetch * fetch = (Fetch *) args;
+	struct udcFile * udc = connectTo(fetch->connections, fetch->job->url, fetch->clock);
+	udcSeek(udc, fetch->job->range->offset);
+	udcMustRead(udc, fetch->job->range->buffer, fetch->job->range->size);
+}
+
+static void completeJob(FetchJob * job) {
+	FetchBatch * batch = job->batch;
+	IoTask * task = batch->task;
+
+	// The caller may drop the batch as soon as it is complete
+	if (task) {
+		if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_SEQ_CST) == 0)
+			wakeIoTask(task);
+	} else {
+		pthread_mutex_lock(&batch->mutex);
+		if (--batch->pending == 0)
+			pthread_cond_signal(&batch->cond);
+		pthread_mutex_unlock(&batch->mutex);
+	}
+}
+
+static void * runFetcher(void * args) {
+	Connection connections[OPEN_CONNECTIONS];
+	Fetch fetch;
+
+	memset(connections, 0, sizeof(connections));
+	fetch.connections = connections;
+	fetch.clock = 0;
+	for (;;) {
+		pthread_mutex_lock(&poolMutex);
+		while (poolQueue == NULL)
+			pthread_cond_wait(&poolCond, &poolMutex);
+		FetchJob * job = poolQueue;
+		poolQueue = job->next;
+		if (poolQueue == NULL)
+			poolQueueTail = NULL;
+		pthread_mutex_unlock(&poolMutex);
+
+		// A failed request, e.g. a 403 or a timeout, is reported to the caller rather than killing the process
+		fetch.clock++;
+		fetch.job = job;
+		if (!catchErrors(&fetchRange, &fetch)) {
+			closeConnection(connections, job->url);
+			__atomic_store_n(&job->batch->failed, true, __ATOMIC_SEQ_CST);
+		}
+		completeJob(job);
+	}
+	return NULL;
+}
+
+static void startFetchers() {
+	pthread_mutex_lock(&poolMutex);
+	while (poolThreads < FETCH_CONNECTIONS) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, &runFetcher, NULL);
+		if (err) {
+			fprintf(stderr, "Could not create new thread %i\n", err);
+			abort();
+		}
+		pthread_detach(thread);
+		poolThreads++;
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+static bool batchCompleted(void * args) {
+	return __atomic_load_n(&((FetchBatch *) args)->pending, __ATOMIC_SEQ_CST) == 0;
+}
+
+void fetchRanges(const char * url, RangeRequest * ranges, int count) {
+	FetchJob * jobs = (FetchJob *) calloc(count, sizeof(FetchJob));
+	FetchBatch batch;
+	int index;
+
+	if (count == 0) {
+		free(jobs);
+		return;
+	}
+
+	batch.task = currentIoTask();
+	batch.pending = count;
+	batch.failed = false;
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	for (index = 0; index < count; index++) {
+		jobs[index].url = url;
+		jobs[index].range = ranges + index;
+		jobs[index].batch = &batch;
+		jobs[index].next = index + 1 < count ? jobs + index + 1 : NULL;
+	}
+
+	startFetchers();
+	pthread_mutex_lock(&poolMutex);
+	if (poolQueueTail)
+		poolQueueTail->next = jobs;
+	else
+		poolQueue = jobs;
+	poolQueueTail = jobs + count - 1;
+	pthread_cond_broadcast(&poolCond);
+	pthread_mutex_unlock(&poolMutex);
+
+	if (batch.task)
+		parkIoTaskOn(batch.task, &batchCompleted, &batch);
+	else {
+		pthread_mutex_lock(&batch.mutex);
+		while (batch.pending)
+			pthread_cond_wait(&batch.cond, &batch.mutex);
+		pthread_mutex_unlock(&batch.mutex);
+	}
+
+	pthread_mutex_destroy(&batch.mutex);
+	pthread_cond_destroy(&batch.cond);
+	free(jobs);
+	if (__atomic_load_n(&batch.failed, __ATOMIC_SEQ_CST)) {
+		fprintf(stderr, "Could not fetch ranges of %s\n", url);
+		raiseError();
+	}
+}
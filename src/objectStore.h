@@ -0,0 +1,43 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _OBJECT_STORE_H_
+#define _OBJECT_STORE_H_
+
+// Remote files: object store URLs, and concurrent range requests
+//
+// s3:// and gs:// URLs are read over HTTPS, from the public endpoint of
+// the bucket. A pool of threads, each keeping its own connections open,
+// fetches the ranges of a remote file concurrently.
+
+// HTTPS URL of an s3://bucket/key or gs://bucket/key object, NULL for other files.
+// S3 buckets are reached through AWS_ENDPOINT_URL if set, else through their
+// AWS_REGION (or AWS_DEFAULT_REGION).
+char * objectStoreUrl(const char * filename);
+
+typedef struct rangeRequest_st {
+	unsigned long long offset;
+	unsigned long long size;
+	char * buffer;
+} RangeRequest;
+
+// Number of ranges of a remote file fetched at once, 1 to read them in turn
+int fetchConnections();
+// Fetches the ranges of a remote file concurrently, returns once all are in.
+// From an I/O task, the task parks in the meantime. The errors of the
+// fetching threads are raised again in the caller, once all have returned.
+void fetchRanges(const char * url, RangeRequest * ranges, int count);
+
+#endif
@@ -0,0 +1,239 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "wiggletools.h"
+#include "offsetIndex.h"
+#include "errors.h"
+#include "blockCache.h"
+#include "chromosomes.h"
+
+struct offsetIndex_st {
+	dev_t device;
+	ino_t inode;
+	// Of the file indexed, to tell stale sidecars
+	long long size;
+	long long mtime;
+	OffsetIndexEntry * entries;
+	int count, capacity;
+	// Chromosome and reach of the last record indexed, while building
+	const char * chrom;
+	int reach;
+	struct offsetIndex_st * next;
+};
+
+static OffsetIndex * indexes = NULL;
+static pthread_mutex_t indexMutex = PTHREAD_MUTEX_INITIALIZER;
+static const char magic[4] = {'W', 'T', 'X', '1'};
+
+//////////////////////////////////////////////////////
+// Building
+//////////////////////////////////////////////////////
+
+static OffsetIndexEntry * addEntry(OffsetIndex * index) {
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? 2 * index->capacity : 1024;
+		index->entries = (OffsetIndexEntry *) realloc(index->entries, index->capacity * sizeof(OffsetIndexEntry));
+	}
+	memset(index->entries + index->count, 0, sizeof(OffsetIndexEntry));
+	return index->entries + index->count++;
+}
+
+void indexRecord(OffsetIndex * index, long long offset, const char * chrom, int finish, int * context) {
+	if (chrom != index->chrom || offset - index->entries[index->count - 1].offset >= OFFSET_INDEX_INTERVAL) {
+		OffsetIndexEntry * entry;
+		if (chrom != index->chrom) {
+			index->chrom = chrom;
+			index->reach = 0;
+		}
+		entry = addEntry(index);
+		entry->offset = offset;
+		entry->chrom = chrom;
+		entry->reach = index->reach;
+		if (context)
+			memcpy(entry->context, context, sizeof(entry->context));
+	}
+	if (finish > index->reach)
+		index->reach = finish;
+}
+
+//////////////////////////////////////////////////////
+// Sidecar files
+//
+// A magic number, the size and modification time of
+// the file, the names of the chromosomes in the order
+// of the entries, then the entries, in native byte
+// order: the indexes are not meant to travel.
+//////////////////////////////////////////////////////
+
+static void sidecarPath(char * path, int length, const char * filename) {
+	char * absolute = realpath(filename, NULL);
+	if (!cachedFilePath(path, length, absolute ? absolute : filename, ".wtx"))
+		snprintf(path, length, "%s.wtx", filename);
+	free(absolute);
+}
+
+static bool readSidecar(OffsetIndex * index, FILE * file) {
+	char header[4];
+	long long size, mtime;
+	int chromCount, count, length, chromIndex, i;
+	char ** chroms;
+	bool ok = true;
+
+	if (fread(header, 1, 4, file) != 4 || memcmp(header, magic, 4) || fread(&size, sizeof(size), 1, file) != 1 || fread(&mtime, sizeof(mtime), 1, file) != 1)
+		return false;
+	if (size != index->size || mtime != index->mtime)
+		return false;
+	if (fread(&chromCount, sizeof(int), 1, file) != 1 || fread(&count, sizeof(int), 1, file) != 1 || chromCount < 0 || count < chromCount || count > size)
+		return false;
+
+	chroms = (char **) calloc(chromCount ? chromCount : 1, sizeof(char *));
+	for (i = 0; ok && i < chromCount; i++) {
+		char name[1024];
+		ok = fread(&length, sizeof(int), 1, file) == 1 && length > 0 && length < 1024 && fread(name, 1, length, file) == (size_t) length;
+		if (ok)
+			chroms[i] = internChromosomeN(name, length);
+	}
+
+	for (i = 0; ok && i < count; i++) {
+		OffsetIndexEntry * entry = addEntry(index);
+		ok = fread(&entry->offset, sizeof(entry->offset), 1, file) == 1
+			&& fread(&chromIndex, sizeof(int), 1, file) == 1
+			&& fread(&entry->reach, sizeof(int), 1, file) == 1
+			&& fread(entry->context, sizeof(int), OFFSET_INDEX_CONTEXT, file) == OFFSET_INDEX_CONTEXT
+			&& chromIndex >= 0 && chromIndex < chromCount && entry->offset >= 0 && entry->offset < size;
+		if (ok)
+			entry->chrom = chroms[chromIndex];
+	}
+
+	free(chroms);
+	if (!ok)
+		index->count = 0;
+	return ok;
+}
+
+static bool loadSidecar(OffsetIndex * index, const char * filename) {
+	char path[2048];
+	FILE * file;
+	bool ok;
+
+	sidecarPath(path, sizeof(path), filename);
+	if (!(file = fopen(path, "rb")))
+		return false;
+	ok = readSidecar(index, file);
+	fclose(file);
+	return ok;
+}
+
+static bool writeSidecar(OffsetIndex * index, FILE * file) {
+	int chromCount = 0, chromIndex = -1, length, i;
+	bool ok = fwrite(magic, 1, 4, file) == 4 && fwrite(&index->size, sizeof(index->size), 1, file) == 1 && fwrite(&index->mtime, sizeof(index->mtime), 1, file) == 1;
+
+	// A chromosome is listed again whenever it starts a new run of entries
+	for (i = 0; i < index->count; i++)
+		if (i == 0 || index->entries[i].chrom != index->entries[i - 1].chrom)
+			chromCount++;
+	ok = ok && fwrite(&chromCount, sizeof(int), 1, file) == 1 && fwrite(&index->count, sizeof(int), 1, file) == 1;
+	for (i = 0; ok && i < index->count; i++) {
+		if (i == 0 || index->entries[i].chrom != index->entries[i - 1].chrom) {
+			length = strlen(index->entries[i].chrom);
+			ok = fwrite(&length, sizeof(int), 1, file) == 1 && fwrite(index->entries[i].chrom, 1, length, file) == (size_t) length;
+		}
+	}
+	for (i = 0; ok && i < index->count; i++) {
+		OffsetIndexEntry * entry = index->entries + i;
+		if (i == 0 || entry->chrom != index->entries[i - 1].chrom)
+			chromIndex++;
+		ok = fwrite(&entry->offset, sizeof(entry->offset), 1, file) == 1
+			&& fwrite(&chromIndex, sizeof(int), 1, file) == 1
+			&& fwrite(&entry->reach, sizeof(int), 1, file) == 1
+			&& fwrite(entry->context, sizeof(int), OFFSET_INDEX_CONTEXT, file) == OFFSET_INDEX_CONTEXT;
+	}
+	return ok;
+}
+
+// Written under a temporary name then renamed, so that concurrent runs only
+// ever see complete indexes. The index is an optimisation, not worth failing over.
+static void saveSidecar(OffsetIndex * index, const char * filename) {
+	char path[2048], tmpPath[2100];
+	FILE * file;
+	bool ok;
+
+	sidecarPath(path, sizeof(path), filename);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp-%i", path, (int) getpid());
+	if (!(file = fopen(tmpPath, "wb")))
+		return;
+	ok = writeSidecar(index, file);
+	if (fclose(file) || !ok || rename(tmpPath, path))
+		unlink(tmpPath);
+}
+
+//////////////////////////////////////////////////////
+// Lookups
+//////////////////////////////////////////////////////
+
+OffsetIndex * getOffsetIndex(const char * filename, char * lines, char * end, OffsetIndexBuilder builder) {
+	struct stat info;
+	OffsetIndex * index;
+
+	if (end - lines < MIN_OFFSET_INDEX_SIZE || stat(filename, &info) || !S_ISREG(info.st_mode))
+		return NULL;
+
+	lockUntilError(&indexMutex);
+	for (index = indexes; index; index = index->next)
+		if (index->device == info.st_dev && index->inode == info.st_ino)
+			break;
+	if (!index) {
+		index = (OffsetIndex *) calloc(1, sizeof(OffsetIndex));
+		index->device = info.st_dev;
+		index->inode = info.st_ino;
+		index->size = info.st_size;
+		index->mtime = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+		if (!loadSidecar(index, filename)) {
+			builder(index, lines, end);
+			saveSidecar(index, filename);
+		}
+		index->next = indexes;
+		indexes = index;
+	}
+	unlockUntilError(&indexMutex);
+	return index;
+}
+
+OffsetIndexEntry * findOffsetIndexEntry(OffsetIndex * index, const char * chrom, int start) {
+	int low = 0;
+	int high = index->count;
+
+	if (!index->count)
+		return NULL;
+
+	// In a sorted file, the entries above the region come first
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		OffsetIndexEntry * entry = index->entries + middle;
+		int cmp = compareChroms(entry->chrom, chrom);
+		if (cmp < 0 || (cmp == 0 && entry->reach < start))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return index->entries + (low ? low - 1 : 0);
+}
@@ -0,0 +1,64 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OFFSET_INDEX_H_
+#define _OFFSET_INDEX_H_
+
+// Byte offsets of a few lines of a plain text wiggle, bedGraph or bed file
+//
+// Tabix needs bgzipped files, plain text files are otherwise rescanned from
+// their first line on every backward seek. On the first seek of a large,
+// memory mapped file, its records are scanned once and every record which
+// starts a chromosome, or follows the previous entry by OFFSET_INDEX_INTERVAL
+// bytes, gets an entry. Each entry keeps what the reader needs to resume
+// parsing from its line, e.g. the fixedStep or variableStep parameters in
+// force. The index is saved in the cache directory if --cache is set, else
+// next to the file as file.wtx, and reused while the file keeps the same
+// size and modification time. It is shared by all the readers of a same
+// file.
+
+#include "wiggleIterator.h"
+
+#define OFFSET_INDEX_INTERVAL (64 * 1024)
+// Smaller files are not worth indexing
+#define MIN_OFFSET_INDEX_SIZE (4 * 1024 * 1024)
+// Integers saved with each entry, which only the reader interprets
+#define OFFSET_INDEX_CONTEXT 4
+
+typedef struct offsetIndexEntry_st {
+	long long offset;
+	// Chromosome of the record on the line
+	const char * chrom;
+	// Furthest finish of the records of that chromosome above the line
+	int reach;
+	int context[OFFSET_INDEX_CONTEXT];
+} OffsetIndexEntry;
+
+typedef struct offsetIndex_st OffsetIndex;
+
+// Called by the builder with each record of the file, in order. The context is
+// the state of the reader before parsing the line at offset, it can be NULL.
+void indexRecord(OffsetIndex * index, long long offset, const char * chrom, int finish, int * context);
+// Scans lines, the whole file, into the index
+typedef void (*OffsetIndexBuilder)(OffsetIndex * index, char * lines, char * end);
+
+// Index of the file mapped at lines, loaded or built then saved. Returns NULL
+// if the file is too small to be indexed (thread safe).
+OffsetIndex * getOffsetIndex(const char * filename, char * lines, char * end, OffsetIndexBuilder builder);
+// The last entry such that no record above its line reaches start on chrom,
+// if the file is sorted: reading on from its line, only a few records are
+// skipped before the region. Returns NULL if the file holds no record.
+OffsetIndexEntry * findOffsetIndexEntry(OffsetIndex * index, const char * chrom, int start);
+
+#endif
@@ -0,0 +1,234 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "outputQueue.h"
+#include "tracer.h"
+
+// Worker threads, at most
+static int WRITE_THREADS = 4;
+// Blocks queued by all the sinks per worker thread, beyond the first block of each sink
+#define QUEUED_BLOCKS_PER_THREAD 2
+
+typedef struct queuedBlock_st {
+	void * block;
+	struct queuedBlock_st * next;
+} QueuedBlock;
+
+struct outputSink_st {
+	void * data;
+	void (*write)(void *, void *);
+	void (*release)(void *, void *);
+	int maxBlocks;
+	QueuedBlock * first, * last;
+	int queued;
+	// Whether a worker is writing a block of the sink
+	bool writing;
+	// Whether the sink is in the ready list
+	bool ready;
+	struct outputSink_st * nextReady;
+};
+
+// Protects all of the below, and the sinks
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a block is queued
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+// Broadcast when a block was written
+static pthread_cond_t roomCond = PTHREAD_COND_INITIALIZER;
+// Sinks with blocks queued and no worker writing them, in turn
+static OutputSink * readyHead = NULL;
+static OutputSink * readyTail = NULL;
+static int totalQueued = 0;
+static int workerCount = 0;
+static int idleWorkers = 0;
+
+void setWriteThreads(int threads) {
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of writing threads: %i\n", threads);
+		raiseError();
+	}
+	WRITE_THREADS = threads;
+}
+
+//////////////////////////////////////////////////////
+// Workers
+//////////////////////////////////////////////////////
+
+static void pushReady(OutputSink * sink) {
+	sink->ready = true;
+	sink->nextReady = NULL;
+	if (readyTail)
+		readyTail->nextReady = sink;
+	else
+		readyHead = sink;
+	readyTail = sink;
+}
+
+static void removeReady(OutputSink * sink) {
+	OutputSink ** previous;
+	OutputSink * other;
+
+	for (previous = &readyHead; *previous != sink; previous = &((*previous)->nextReady))
+		;
+	*previous = sink->nextReady;
+	if (readyTail == sink) {
+		readyTail = NULL;
+		for (other = readyHead; other; other = other->nextReady)
+			readyTail = other;
+	}
+	sink->ready = false;
+}
+
+static QueuedBlock * takeBlock(OutputSink * sink) {
+	QueuedBlock * queued = sink->first;
+
+	sink->first = queued->next;
+	if (!sink->first)
+		sink->last = NULL;
+	sink->queued--;
+	totalQueued--;
+	return queued;
+}
+
+// A sink leaves the ready list while its block is written, so that its
+// blocks are written in order, then goes to the back of the list
+static void * runWorker(void * args) {
+	OutputSink * sink;
+	QueuedBlock * queued;
+
+	nameTraceThread("write");
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		idleWorkers++;
+		while (!readyHead)
+			pthread_cond_wait(&workCond, &mutex);
+		idleWorkers--;
+
+		sink = readyHead;
+		removeReady(sink);
+		queued = takeBlock(sink);
+		sink->writing = true;
+		pthread_mutex_unlock(&mutex);
+
+		double start = traceClock();
+		sink->write(sink->data, queued->block);
+		traceSpan("write block", start);
+		sink->release(sink->data, queued->block);
+		free(queued);
+
+		pthread_mutex_lock(&mutex);
+		sink->writing = false;
+		if (sink->first)
+			pushReady(sink);
+		pthread_cond_broadcast(&roomCond);
+	}
+	return NULL;
+}
+
+// Called with the mutex locked
+static void startWorker() {
+	pthread_t thread;
+	int err;
+
+	if ((err = pthread_create(&thread, NULL, &runWorker, NULL))) {
+		fprintf(stderr, "Could not create new thread %i\n", err);
+		raiseError();
+	}
+	pthread_detach(thread);
+	workerCount++;
+}
+
+//////////////////////////////////////////////////////
+// Sinks
+//////////////////////////////////////////////////////
+
+OutputSink * newOutputSink(void * data, void (*write)(void *, void *), void (*release)(void *, void *), int maxBlocks) {
+	OutputSink * sink = (OutputSink *) calloc(1, sizeof(OutputSink));
+	sink->data = data;
+	sink->write = write;
+	sink->release = release;
+	sink->maxBlocks = maxBlocks;
+	return sink;
+}
+
+void destroyOutputSink(OutputSink * sink) {
+	cancelOutputSink(sink);
+	free(sink);
+}
+
+static bool roomInQueue(OutputSink * sink) {
+	int blocks = sink->queued + sink->writing;
+	return blocks <= sink->maxBlocks && (sink->queued <= 1 || totalQueued <= QUEUED_BLOCKS_PER_THREAD * WRITE_THREADS);
+}
+
+void queueOutputBlock(OutputSink * sink, void * block) {
+	QueuedBlock * queued = (QueuedBlock *) calloc(1, sizeof(QueuedBlock));
+
+	queued->block = block;
+	pthread_mutex_lock(&mutex);
+	if (sink->last)
+		sink->last->next = queued;
+	else
+		sink->first = queued;
+	sink->last = queued;
+	sink->queued++;
+	totalQueued++;
+	if (!sink->ready && !sink->writing) {
+		pushReady(sink);
+		if (idleWorkers == 0 && workerCount < WRITE_THREADS)
+			startWorker();
+		pthread_cond_signal(&workCond);
+	}
+
+	double start = traceClock();
+	while (!roomInQueue(sink))
+		pthread_cond_wait(&roomCond, &mutex);
+	traceSpan("wait for writer", start);
+	pthread_mutex_unlock(&mutex);
+}
+
+void finishOutputSink(OutputSink * sink) {
+	pthread_mutex_lock(&mutex);
+	double start = traceClock();
+	while (sink->queued || sink->writing)
+		pthread_cond_wait(&roomCond, &mutex);
+	traceSpan("wait for writer", start);
+	pthread_mutex_unlock(&mutex);
+}
+
+void cancelOutputSink(OutputSink * sink) {
+	QueuedBlock * queued, * next;
+
+	pthread_mutex_lock(&mutex);
+	if (sink->ready)
+		removeReady(sink);
+	queued = sink->first;
+	totalQueued -= sink->queued;
+	sink->first = sink->last = NULL;
+	sink->queued = 0;
+	while (sink->writing)
+		pthread_cond_wait(&roomCond, &mutex);
+	// Other producers may wait for the budget
+	pthread_cond_broadcast(&roomCond);
+	pthread_mutex_unlock(&mutex);
+
+	for (; queued; queued = next) {
+		next = queued->next;
+		sink->release(sink->data, queued->block);
+		free(queued);
+	}
+}
@@ -0,0 +1,43 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _OUTPUT_QUEUE_H_
+#define _OUTPUT_QUEUE_H_
+
+#include "wiggletools.h"
+
+// Shared pool of threads writing the blocks of the tee operators
+//
+// Each output of write, write_bg, mwrite, apply_paste etc. is a sink, to 
+// which its producer queues full blocks of records. A handful of worker 
+// threads, started once blocks are queued, write the blocks of all the 
+// sinks, those of each sink in order and one at a time. A producer waits
+// when its sink holds too many blocks, or when the queues of all sinks 
+// together exceed a budget and its own queue is not empty.
+typedef struct outputSink_st OutputSink;
+
+// write(data, block) writes a block, then release(data, block) frees it,
+// both on a worker thread. maxBlocks caps the blocks of the sink queued or
+// being written.
+OutputSink * newOutputSink(void * data, void (*write)(void *, void *), void (*release)(void *, void *), int maxBlocks);
+void destroyOutputSink(OutputSink * sink);
+// Waits for room before returning
+void queueOutputBlock(OutputSink * sink, void * block);
+// Waits until all the blocks queued are written
+void finishOutputSink(OutputSink * sink);
+// Releases the blocks queued without writing them, and waits for the 
+// block being written, if any
+void cancelOutputSink(OutputSink * sink);
+
+#endif
@@ -0,0 +1,116 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "packedRecords.h"
+
+#define STRAND_BITS 3
+#define NEW_CHROM_FLAG 4
+#define INTEGER_VALUE 0
+#define FLOAT_VALUE 8
+#define DOUBLE_VALUE 16
+#define VALUE_BITS 24
+// Beyond this, doubles do not hold all the integers
+#define MAX_INTEGER_VALUE 9007199254740992.0
+
+void startPackedCursor(PackedCursor * cursor, unsigned char * bytes) {
+	cursor->ptr = bytes;
+	cursor->chrom = NULL;
+	cursor->start = 0;
+}
+
+static void packVarint(PackedCursor * cursor, int64_t signedValue) {
+	uint64_t value = ((uint64_t) signedValue << 1) ^ (uint64_t) (signedValue >> 63);
+	while (value >= 0x80) {
+		*(cursor->ptr++) = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	*(cursor->ptr++) = (unsigned char) value;
+}
+
+static int64_t unpackVarint(PackedCursor * cursor) {
+	uint64_t value = 0;
+	int shift = 0;
+	unsigned char byte;
+	do {
+		byte = *(cursor->ptr++);
+		value |= (uint64_t) (byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// Negative zero would come back positive from an integer
+static bool isPackedAsInteger(double value) {
+	return value == rint(value) && fabs(value) <= MAX_INTEGER_VALUE && (value != 0 || !signbit(value));
+}
+
+void packRecord(PackedCursor * cursor, char * chrom, int start, int finish, StoredValue value, int strand) {
+	unsigned char * tag = cursor->ptr++;
+	double exact = value;
+	float single = (float) value;
+
+	*tag = (unsigned char) (strand + 1);
+	if (chrom != cursor->chrom) {
+		*tag |= NEW_CHROM_FLAG;
+		memcpy(cursor->ptr, &chrom, sizeof(chrom));
+		cursor->ptr += sizeof(chrom);
+		cursor->chrom = chrom;
+		cursor->start = 0;
+	}
+	packVarint(cursor, (int64_t) start - cursor->start);
+	packVarint(cursor, (int64_t) finish - start);
+	cursor->start = start;
+
+	if (isPackedAsInteger(exact))
+		packVarint(cursor, (int64_t) exact);
+	else if ((double) single == exact) {
+		*tag |= FLOAT_VALUE;
+		memcpy(cursor->ptr, &single, sizeof(single));
+		cursor->ptr += sizeof(single);
+	} else {
+		*tag |= DOUBLE_VALUE;
+		memcpy(cursor->ptr, &exact, sizeof(exact));
+		cursor->ptr += sizeof(exact);
+	}
+}
+
+void unpackRecord(PackedCursor * cursor, char ** chrom, int * start, int * finish, double * value, int * strand) {
+	unsigned char tag = *(cursor->ptr++);
+
+	if (tag & NEW_CHROM_FLAG) {
+		memcpy(&cursor->chrom, cursor->ptr, sizeof(cursor->chrom));
+		cursor->ptr += sizeof(cursor->chrom);
+		cursor->start = 0;
+	}
+	*chrom = cursor->chrom;
+	*start = cursor->start += (int) unpackVarint(cursor);
+	*finish = *start + (int) unpackVarint(cursor);
+	*strand = (int) (tag & STRAND_BITS) - 1;
+
+	if ((tag & VALUE_BITS) == INTEGER_VALUE)
+		*value = (double) unpackVarint(cursor);
+	else if ((tag & VALUE_BITS) == FLOAT_VALUE) {
+		float single;
+		memcpy(&single, cursor->ptr, sizeof(single));
+		cursor->ptr += sizeof(single);
+		*value = single;
+	} else {
+		memcpy(value, cursor->ptr, sizeof(*value));
+		cursor->ptr += sizeof(*value);
+	}
+}
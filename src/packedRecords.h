@@ -0,0 +1,50 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PACKED_RECORDS_H_
+#define _PACKED_RECORDS_H_
+
+// Records packed into a few bytes each, for the blocks queued between
+// threads, i.e. those read ahead by the downloaders and those waiting 
+// for the writers
+//
+// Each record starts with a tag byte, which holds its strand, whether a
+// new chromosome starts with it, and how its value is stored. The name
+// pointer of a new chromosome follows, then the change of start since the
+// previous record and the length of the record, as zig-zag varints, and
+// finally the value: a zig-zag varint if it is an integer, else a float if
+// that holds it exactly, else a double. Packing is lossless.
+
+#include "wiggleIterator.h"
+
+// Bytes of a record at most, tag, pointer, two varints of 32 bits and a value
+#define MAX_PACKED_RECORD_SIZE (1 + sizeof(char *) + 2 * 5 + 8)
+// Bytes per record of a block of packed records, most records taking fewer:
+// a block is full once its records, or its bytes, run out
+#define PACKED_RECORD_BYTES 8
+
+typedef struct packedCursor_st {
+	unsigned char * ptr;
+	// Of the previous record
+	char * chrom;
+	int start;
+} PackedCursor;
+
+// Starts a cursor at the first record of a block of packed records
+void startPackedCursor(PackedCursor * cursor, unsigned char * bytes);
+// strand is 1 for +, -1 for -, 0 if unstranded
+void packRecord(PackedCursor * cursor, char * chrom, int start, int finish, StoredValue value, int strand);
+void unpackRecord(PackedCursor * cursor, char ** chrom, int * start, int * finish, double * value, int * strand);
+
+#endif
@@ -0,0 +1,252 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "partials.h"
+#include "wiggleIterator.h"
+
+static const char magic[8] = "WTPART2";
+// Reads differently on a machine of the other endianness
+static const uint32_t byteOrderMark = 0x01020304;
+
+void writePartialValues(FILE * file, const void * values, size_t size, size_t count) {
+	if (fwrite(values, size, count, file) != count) {
+		fprintf(stderr, "Could not write partial results\n");
+		raiseError();
+	}
+}
+
+void readPartialValues(FILE * file, void * values, size_t size, size_t count) {
+	if (fread(values, size, count, file) != count) {
+		fprintf(stderr, "Truncated partial results file\n");
+		raiseError();
+	}
+}
+
+void writePartialHeader(FILE * file, PartialKind kind) {
+	int32_t value = kind;
+	writePartialValues(file, magic, 1, sizeof(magic));
+	writePartialValues(file, &byteOrderMark, sizeof(byteOrderMark), 1);
+	writePartialValues(file, &value, sizeof(value), 1);
+}
+
+PartialKind readPartialHeader(FILE * file, const char * filename) {
+	char buffer[sizeof(magic)];
+	uint32_t mark;
+	int32_t kind;
+
+	if (fread(buffer, 1, sizeof(buffer), file) != sizeof(buffer) || memcmp(buffer, magic, sizeof(magic))) {
+		fprintf(stderr, "%s is not a wiggletools partial results file\n", filename);
+		raiseError();
+	}
+	readPartialValues(file, &mark, sizeof(mark), 1);
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", filename);
+		raiseError();
+	}
+	readPartialValues(file, &kind, sizeof(kind), 1);
+	if (kind < PARTIAL_STATISTICS || kind > PARTIAL_BIGWIG) {
+		fprintf(stderr, "Unknown type of partial results in %s\n", filename);
+		raiseError();
+	}
+	return (PartialKind) kind;
+}
+
+//////////////////////////////////////////////////////
+// Track partials
+//////////////////////////////////////////////////////
+
+void writePartialTrackHeader(FILE * file, int shard, bool bedGraph) {
+	int32_t values[2] = {shard, bedGraph};
+	writePartialHeader(file, PARTIAL_TRACK);
+	writePartialValues(file, values, sizeof(int32_t), 2);
+}
+
+void readPartialTrackHeader(FILE * file, int * shard, bool * bedGraph) {
+	int32_t values[2];
+	readPartialValues(file, values, sizeof(int32_t), 2);
+	*shard = values[0];
+	*bedGraph = values[1];
+}
+
+void writePartialTrackSection(FILE * file, const char * chrom, FILE * records) {
+	int32_t length = strlen(chrom);
+	int64_t count;
+	char buffer[65536];
+	size_t read;
+
+	fseek(records, 0, SEEK_END);
+	count = ftell(records) / sizeof(PartialRecord);
+	rewind(records);
+	writePartialValues(file, &length, sizeof(length), 1);
+	writePartialValues(file, chrom, 1, length);
+	writePartialValues(file, &count, sizeof(count), 1);
+	while ((read = fread(buffer, 1, sizeof(buffer), records)))
+		writePartialValues(file, buffer, 1, read);
+}
+
+void copyPartialTrackSections(FILE * file, FILE * source) {
+	char buffer[65536];
+	size_t read;
+
+	while ((read = fread(buffer, 1, sizeof(buffer), source)))
+		writePartialValues(file, buffer, 1, read);
+	fclose(source);
+}
+
+typedef struct partialTrackReaderData_st {
+	FILE ** files;
+	int count;
+	int index;
+	// Next record, read ahead to join split records
+	char * chrom;
+	PartialRecord record;
+	bool available;
+	bool firstOfSection;
+	int64_t remaining;
+} PartialTrackReaderData;
+
+// Returns false at the end of the files
+static bool readPartialTrackSection(PartialTrackReaderData * data) {
+	int32_t length;
+	char * name;
+
+	while (data->index < data->count) {
+		FILE * file = data->files[data->index];
+		if (fread(&length, sizeof(length), 1, file) != 1) {
+			fclose(file);
+			data->index++;
+			continue;
+		}
+		if (length <= 0) {
+			fprintf(stderr, "Corrupted partial results file\n");
+			raiseError();
+		}
+		name = calloc(length + 1, 1);
+		readPartialValues(file, name, 1, length);
+		data->chrom = internChromosome(name);
+		free(name);
+		readPartialValues(file, &data->remaining, sizeof(data->remaining), 1);
+		return true;
+	}
+	return false;
+}
+
+static void readAheadPartialRecord(PartialTrackReaderData * data) {
+	data->firstOfSection = false;
+	while (data->remaining == 0) {
+		if (!readPartialTrackSection(data)) {
+			data->available = false;
+			return;
+		}
+		data->firstOfSection = true;
+	}
+	readPartialValues(data->files[data->index], &data->record, sizeof(PartialRecord), 1);
+	data->remaining--;
+	data->available = true;
+}
+
+static void PartialTrackReaderPop(WiggleIterator * wi) {
+	PartialTrackReaderData * data = (PartialTrackReaderData *) wi->data;
+
+	if (!data->available) {
+		wi->done = true;
+		return;
+	}
+	wi->chrom = data->chrom;
+	wi->start = data->record.start;
+	wi->finish = data->record.finish;
+	wi->value = data->record.value;
+	readAheadPartialRecord(data);
+
+	// Shards may cut through a record
+	while (data->available && data->firstOfSection && data->chrom == wi->chrom && data->record.start == wi->finish && data->record.value == wi->value) {
+		wi->finish = data->record.finish;
+		readAheadPartialRecord(data);
+	}
+}
+
+static void PartialTrackReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	fprintf(stderr, "Cannot seek in merged partial results\n");
+	raiseError();
+}
+
+WiggleIterator * PartialTrackReader(FILE ** files, int count) {
+	PartialTrackReaderData * data = (PartialTrackReaderData *) calloc(1, sizeof(PartialTrackReaderData));
+	data->files = files;
+	data->count = count;
+	readAheadPartialRecord(data);
+	return newWiggleIterator(data, &PartialTrackReaderPop, &PartialTrackReaderSeek, 0);
+}
+
+//////////////////////////////////////////////////////
+// BigWig partials
+//////////////////////////////////////////////////////
+
+void writePartialBigWigHeader(FILE * file, int shard) {
+	int32_t value = shard;
+	writePartialHeader(file, PARTIAL_BIGWIG);
+	writePartialValues(file, &value, sizeof(value), 1);
+}
+
+void readPartialBigWigHeader(FILE * file, int * shard) {
+	int32_t value;
+	readPartialValues(file, &value, sizeof(value), 1);
+	*shard = value;
+}
+
+//////////////////////////////////////////////////////
+// Checkpoints
+//////////////////////////////////////////////////////
+
+static const char checkpointMagic[8] = "WTCHKP1";
+
+void writeCheckpointHeader(FILE * file, Checkpoint * checkpoint) {
+	int32_t values[4] = {strlen(checkpoint->command), checkpoint->regions, checkpoint->completed, checkpoint->hasPartial};
+	writePartialValues(file, checkpointMagic, 1, sizeof(checkpointMagic));
+	writePartialValues(file, &byteOrderMark, sizeof(byteOrderMark), 1);
+	writePartialValues(file, values, sizeof(int32_t), 4);
+	writePartialValues(file, checkpoint->command, 1, values[0]);
+	writePartialValues(file, &checkpoint->outputLength, sizeof(int64_t), 1);
+}
+
+void readCheckpointHeader(FILE * file, const char * filename, Checkpoint * checkpoint) {
+	char buffer[sizeof(checkpointMagic)];
+	uint32_t mark;
+	int32_t values[4];
+
+	if (fread(buffer, 1, sizeof(buffer), file) != sizeof(buffer) || memcmp(buffer, checkpointMagic, sizeof(checkpointMagic))) {
+		fprintf(stderr, "%s is not a wiggletools checkpoint file\n", filename);
+		raiseError();
+	}
+	readPartialValues(file, &mark, sizeof(mark), 1);
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", filename);
+		raiseError();
+	}
+	readPartialValues(file, values, sizeof(int32_t), 4);
+	if (values[0] < 0 || values[2] < 0 || values[2] > values[1]) {
+		fprintf(stderr, "Corrupted checkpoint file %s\n", filename);
+		raiseError();
+	}
+	checkpoint->command = (char *) calloc(values[0] + 1, 1);
+	readPartialValues(file, checkpoint->command, 1, values[0]);
+	checkpoint->regions = values[1];
+	checkpoint->completed = values[2];
+	checkpoint->hasPartial = values[3];
+	readPartialValues(file, &checkpoint->outputLength, sizeof(int64_t), 1);
+}
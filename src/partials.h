@@ -0,0 +1,83 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PARTIALS_H_
+#define _PARTIALS_H_
+
+// Binary files of partial results, which are merged by merge_partials
+//
+// A partial file holds the internal state of a computation over a subset
+// of the data (e.g. one chromosome), from which the result over several
+// subsets can be computed exactly: statistics, histograms or profiles.
+// The header is followed by the state dumped by each module, in the byte
+// order of the machine.
+
+#include <stdio.h>
+#include <stdint.h>
+#include "wiggletools.h"
+
+typedef enum {PARTIAL_STATISTICS = 1, PARTIAL_HISTOGRAM, PARTIAL_PROFILE, PARTIAL_TRACK, PARTIAL_TOP, PARTIAL_BIGWIG} PartialKind;
+
+void writePartialHeader(FILE * file, PartialKind kind);
+// Exits if the file is not a partial file
+PartialKind readPartialHeader(FILE * file, const char * filename);
+// Exit on failure
+void writePartialValues(FILE * file, const void * values, size_t size, size_t count);
+void readPartialValues(FILE * file, void * values, size_t size, size_t count);
+
+// Track partials hold the records of a shard of the genome (see --shard).
+// The header is followed by the number of the shard, which sets the order
+// of the files when merging, and a flag for bedGraph outputs. Each region 
+// of the shard then has a section: the length of the chromosome name, the
+// name, the number of records, and the records, in genome order.
+typedef struct partialRecord_st {
+	int32_t start;
+	int32_t finish;
+	double value;
+} PartialRecord;
+
+void writePartialTrackHeader(FILE * file, int shard, bool bedGraph);
+void readPartialTrackHeader(FILE * file, int * shard, bool * bedGraph);
+// Copies the records stored in a temporary file as a section
+void writePartialTrackSection(FILE * file, const char * chrom, FILE * records);
+// Copies the sections left in a track partial
+void copyPartialTrackSections(FILE * file, FILE * source);
+// Reads the sections of the files one after the other, then closes them. 
+// Records split across consecutive sections are joined back.
+WiggleIterator * PartialTrackReader(FILE ** files, int count);
+
+// BigWig partials hold the regions of a shard already compressed into
+// BigWig data blocks, see writeBigWigPartialSection in bigWigWriter.h.
+// The header is followed by the number of the shard, then the sections
+// are copied over as those of track partials.
+void writePartialBigWigHeader(FILE * file, int shard);
+void readPartialBigWigHeader(FILE * file, int * shard);
+
+// Checkpoints of a run over --chrom_sizes, see --checkpoint, record the
+// program, the number of regions of the genome, how many of them, in genome
+// order, have their results in the output, and the length of the output
+// then. If the program computes statistics, a histogram or top regions, the
+// header is followed by a partial file of the results merged so far.
+typedef struct checkpoint_st {
+	char * command;
+	int regions, completed;
+	int64_t outputLength;
+	bool hasPartial;
+} Checkpoint;
+
+void writeCheckpointHeader(FILE * file, Checkpoint * checkpoint);
+// Exits if the file is not a checkpoint
+void readCheckpointHeader(FILE * file, const char * filename, Checkpoint * checkpoint);
+
+#endif
@@ -0,0 +1,146 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "wiggletools.h"
+#include "pasteIndex.h"
+#include "errors.h"
+#include "chromosomes.h"
+
+typedef struct pasteLine_st {
+	off_t offset;
+	char * chrom;
+	// 1-based, as in the BedReader
+	int finish;
+} PasteLine;
+
+typedef struct pasteIndex_st {
+	dev_t device;
+	ino_t inode;
+	PasteLine * lines;
+	int count;
+	off_t end;
+	struct pasteIndex_st * next;
+} PasteIndex;
+
+static PasteIndex * indexes = NULL;
+static pthread_mutex_t indexMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Lines which the BedReader would skip, or which printBlock would not paste to
+static bool isRegionLine(const char * line) {
+	return line[0] != '\n' && line[0] != '\r' && line[0] != '#' && strncmp(line, "track", 5) && strncmp(line, "browser", 7);
+}
+
+static bool parseRegionLine(char * line, PasteLine * dest) {
+	char * ptr = line;
+	char * end;
+
+	while (*ptr && *ptr != '\t' && *ptr != ' ' && *ptr != '\n' && *ptr != '\r')
+		ptr++;
+	if (ptr == line)
+		return false;
+	dest->chrom = internChromosomeN(line, ptr - line);
+	strtol(ptr, &end, 10);
+	if (end == ptr)
+		return false;
+	ptr = end;
+	dest->finish = strtol(ptr, &end, 10) + 1;
+	return end != ptr;
+}
+
+static PasteIndex * buildPasteIndex(FILE * file, struct stat * info) {
+	PasteIndex * index = (PasteIndex *) calloc(1, sizeof(PasteIndex));
+	int max = 1024;
+	char * line = NULL;
+	size_t lineSize = 0;
+
+	index->device = info->st_dev;
+	index->inode = info->st_ino;
+	index->lines = (PasteLine *) calloc(max, sizeof(PasteLine));
+
+	if (fseeko(file, 0, SEEK_SET)) {
+		fprintf(stderr, "Could not rewind paste file\n");
+		raiseError();
+	}
+	while (true) {
+		off_t offset = ftello(file);
+		if (getline(&line, &lineSize, file) < 0) {
+			index->end = offset;
+			break;
+		}
+		if (!isRegionLine(line))
+			continue;
+		if (index->count == max) {
+			max *= 2;
+			index->lines = (PasteLine *) realloc(index->lines, max * sizeof(PasteLine));
+		}
+		if (parseRegionLine(line, index->lines + index->count)) {
+			index->lines[index->count].offset = offset;
+			index->count++;
+		}
+	}
+	free(line);
+	return index;
+}
+
+static PasteIndex * getPasteIndex(FILE * file) {
+	struct stat info;
+	PasteIndex * index;
+
+	if (fstat(fileno(file), &info) || !S_ISREG(info.st_mode)) {
+		fprintf(stderr, "Paste files must be regular files to be seeked\n");
+		raiseError();
+	}
+
+	lockUntilError(&indexMutex);
+	for (index = indexes; index; index = index->next)
+		if (index->device == info.st_dev && index->inode == info.st_ino)
+			break;
+	if (!index) {
+		index = buildPasteIndex(file, &info);
+		index->next = indexes;
+		indexes = index;
+	}
+	unlockUntilError(&indexMutex);
+	return index;
+}
+
+void seekPasteFile(FILE * file, const char * chrom, int start) {
+	PasteIndex * index = getPasteIndex(file);
+	int low = 0;
+	int high = index->count;
+
+	// The BedReader refuses unsorted files, so the lines can be bisected down to the chromosome
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (compareChroms(index->lines[middle].chrom, chrom) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	// ... then skipped as in BedReaderSeek
+	while (low < index->count && compareChroms(index->lines[low].chrom, chrom) == 0 && index->lines[low].finish < start)
+		low++;
+
+	if (fseeko(file, low < index->count ? index->lines[low].offset : index->end, SEEK_SET)) {
+		fprintf(stderr, "Could not seek paste file\n");
+		raiseError();
+	}
+}
@@ -0,0 +1,32 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PASTE_INDEX_H_
+#define _PASTE_INDEX_H_
+
+#include <stdio.h>
+
+// Byte offsets of the lines of the files pasted by apply_paste
+//
+// A paste file is read line by line alongside the regions read from the 
+// same file. When the regions are seeked, the paste file is moved to the 
+// line of the first region returned. The lines are indexed on the first 
+// seek, and the index is shared by all the files opened on the same path
+// (one per chromosome in multithreaded mode).
+
+// Positions file on the first line which a BedReader seeked to chrom:start
+// would return, or at the end of the file if there is none (thread safe)
+void seekPasteFile(FILE * file, const char * chrom, int start);
+
+#endif
@@ -19,26 +19,66 @@
 // Local header
 #include "wiggleIterator.h"
 #include "multiplexer.h"
+#include "partials.h"
 
 //////////////////////////////////////////////////////
 // Profile summaries
 //////////////////////////////////////////////////////
 
-static void updateProfile(WiggleIterator * wig, double compression, double * profile, int profile_width, bool stranded) {
+// Each base p of a region adds value / compression to the bins from 
+// round(p * compression) to round((p + 1) * compression), or to the bin
+// round(p * compression) alone when bins are longer than a base. The
+// bins of a span are filled at once with the number of bases which 
+// round to each of them, as if the span was read base by base.
+static void addSpanToProfile(double * profile, int profile_width, double compression, int start, int finish, double value) {
+	int bin = (int) round(start * compression);
+
+	if (compression >= 1) {
+		int last = (int) round(finish * compression);
+		if (last > profile_width)
+			last = profile_width;
+		for (; bin < last; bin++)
+			profile[bin] += value / compression;
+		return;
+	}
+
+	while (start < finish && bin < profile_width) {
+		// First base of the next bin, from an estimate corrected with the same rounding
+		int next = (int) ceil((bin + 0.5) / compression);
+		while (next > start + 1 && (int) round((next - 1) * compression) > bin)
+			next--;
+		while (next < finish && (int) round(next * compression) <= bin)
+			next++;
+		if (next > finish)
+			next = finish;
+		profile[bin] += (next - start) * value / compression;
+		start = next;
+		bin++;
+	}
+}
+
+static void updateProfile(WiggleIterator * wig, int offset, int region_width, double compression, double * profile, int profile_width, bool stranded) {
 	int start, finish, pos;
 
-	if (isnan(wig->value))
+	if (!wig->finite && isnan(wig->value))
 		return;
 
 	if (!stranded || wig->strand > 0) {
-		start = (int) round(wig->start * compression);
-		finish = (int) round(wig->finish * compression); 
+		start = wig->start - offset;
+		finish = wig->finish - offset;
+		if (start < 0)
+			start = 0;
+		if (finish > region_width)
+			finish = region_width;
+		if (start < finish)
+			addSpanToProfile(profile, profile_width, compression, start, finish, wig->value);
+		return;
 	} else if (wig->strand < 0) {
-		start = (int) round(profile_width - 1 - (wig->finish * compression));
-		finish = (int) round(profile_width - 1 - (wig->start * compression)); 
+		start = (int) round(profile_width - 1 - ((wig->finish - offset) * compression));
+		finish = (int) round(profile_width - 1 - ((wig->start - offset) * compression)); 
 	} else {
 		fprintf(stderr, "Cannot provide stranded profile on non-stranded regions\n");
-		exit(1);
+		raiseError();
 	}
 
 	if (start < 0)
@@ -52,7 +92,8 @@ static void updateProfile(WiggleIterator * wig, double compression, double * pro
 		profile[pos] += wig->value / compression;
 }
 
-void regionProfile(WiggleIterator * wig, double * profile, int profile_width, int region_width, bool stranded) {
+// offset is the coordinate of the first base of the region in the records of wig
+void regionProfile(WiggleIterator * wig, double * profile, int profile_width, int offset, int region_width, bool stranded) {
 	double compression = profile_width / (double) region_width;
 	int pos;
 
@@ -60,7 +101,7 @@ void regionProfile(WiggleIterator * wig, double * profile, int profile_width, in
 		profile[pos] = 0;
 
 	for (; !wig->done; pop(wig))
-		updateProfile(wig, compression, profile, profile_width, stranded);
+		updateProfile(wig, offset, region_width, compression, profile, profile_width, stranded);
 }
 
 void addProfile(double * dest, double * source, int width) {
@@ -88,7 +129,8 @@ static void reassignColumnRight(Histogram * hist, double ratio, int column, int
 	double end = hist->width - (hist->width - column - 1) * ratio;
 	int int_end = (int) end;
 	double value = hist->values[row][column];
-	if (int_start == int_end) {
+	// The last column ends on the upper bound, past the last bin
+	if (int_start == int_end || int_end == hist->width) {
 		hist->values[row][int_start] += value;
 	} else {
 		double split =  (end - int_end) / ratio;
@@ -105,7 +147,7 @@ static void lowerMinNRows(Histogram * hist, double value) {
 		for (row = 0; row < hist->count; row++)
 			// Careful to go from high to low to avoid compound effects as
 			// you push weight to the high bins
-			for (column = hist->width; column >= 0; column--)
+			for (column = hist->width - 1; column >= 0; column--)
 				reassignColumnRight(hist, ratio, column, row);
 	} else {
 		// Copying the content of the first column to the last
@@ -145,54 +187,246 @@ static void raiseMaxNRows(Histogram * hist, double value) {
 	hist->max = value;
 }
 
-static void insertIntoHistogram(Histogram * hist, WiggleIterator * wig, int row) {
-	int column = (int) ((wig->value - hist->min) * hist->width / (hist->max - hist->min));
+static void insertIntoHistogram(Histogram * hist, double value, double weight, int row) {
+	int column = (int) ((value - hist->min) * hist->width / (hist->max - hist->min));
 	if (column == hist->width)
 		column--;
-	hist->values[row][column] += wig->finish - wig->start;
+	hist->values[row][column] += weight;
 }
 
-static void updateHistogram(Histogram * hist, WiggleIterator * wig, int row) {
-	if (wig->value > hist->max)
-		raiseMaxNRows(hist, wig->value);
-	else if (wig->value < hist->min)
-		lowerMinNRows(hist, wig->value);
+// Widens the range of the bins to cover [min, max]
+static void extendHistogram(Histogram * hist, double min, double max) {
+	if (isnan(hist->min)) {
+		hist->min = min;
+		hist->max = max;
+		return;
+	}
+
+	if (min < hist->min)
+		lowerMinNRows(hist, min);
+	if (max > hist->max)
+		raiseMaxNRows(hist, max);
+}
 
+static void addToHistogram(Histogram * hist, double value, double weight, int row) {
 	if (hist->min != hist->max)
-		insertIntoHistogram(hist, wig, row);
+		insertIntoHistogram(hist, value, weight, row);
 	else 
-		hist->values[row][0] += wig->finish - wig->start;
+		hist->values[row][0] += weight;
 }
 
-Histogram * histogram(WiggleIterator ** wigs, int count, int width) {
+// The bins are widened once for the whole batch, then each span is added with its length as weight
+static void updateHistogram(Histogram * hist, SpanBatch * batch, int row) {
+	double min = NAN, max = NAN;
+	int index;
+
+	for (index = 0; index < batch->count; index++) {
+		double value = batch->values[index];
+		if (isnan(value))
+			continue;
+		if (!(value >= min))
+			min = value;
+		if (!(value <= max))
+			max = value;
+	}
+
+	if (isnan(min))
+		return;
+	extendHistogram(hist, min, max);
+
+	for (index = 0; index < batch->count; index++)
+		if (!isnan(batch->values[index]))
+			addToHistogram(hist, batch->values[index], batch->finishes[index] - batch->starts[index], row);
+}
+
+// Bounds of the values of all the inputs, when all of them can tell beforehand. 
+// Starting from the final range spares the approximations of repeated rebinning.
+static bool histogramRange(WiggleIterator ** wigs, int count, double * min, double * max) {
+	int row;
+
+	*min = *max = NAN;
+	for (row = 0; row < count; row++) {
+		double wigMin, wigMax;
+		if (!wigs[row]->valueRange || !wigs[row]->valueRange(wigs[row], &wigMin, &wigMax))
+			return false;
+		if (!(wigMin >= *min))
+			*min = wigMin;
+		if (!(wigMax <= *max))
+			*max = wigMax;
+	}
+	return count > 0;
+}
+
+// Histograms over the same known range add up bin by bin, see mergeHistograms
+bool histogramRangeKnown(WiggleIterator ** wigs, int count) {
+	double min, max;
+	return histogramRange(wigs, count, &min, &max);
+}
+
+// Bins of the histogram start from the range of the inputs, if known
+Histogram * emptyHistogram(WiggleIterator ** wigs, int count, int width) {
 	Histogram * hist = calloc(1, sizeof(Histogram));
+	double min, max;
 	hist->count = count;
 	hist->width = width;
 	hist->values = calloc(count, sizeof(double*));
 	int row;
-	for (row = 0; row < count; row++) {
+	for (row = 0; row < count; row++)
 		hist->values[row] = calloc(width, sizeof(double));
+	hist->min = hist->max = NAN;
+
+	if (histogramRange(wigs, count, &min, &max))
+		extendHistogram(hist, min, max);
+	return hist;
+}
+
+void addBatchToHistogram(Histogram * hist, SpanBatch * batch, int row) {
+	updateHistogram(hist, batch, row);
+}
+
+Histogram * histogram(WiggleIterator ** wigs, int count, int width) {
+	Histogram * hist = emptyHistogram(wigs, count, width);
+	SpanBatch * batch = newSpanBatch();
+	int row;
+
+	for (row = 0; row < count; row++) {
 		WiggleIterator * wig = wigs[row];
-		if (row == 0) {
-			while (isnan(wig->value)) {
-				pop(wig);
-			}
-			hist->min = hist->max = wig->value;
-			hist->values[0][0] = wig->finish - wig->start;
-			pop(wig);
+		while (!wig->done) {
+			batch->count = 0;
+			popBatch(wig, batch);
+			updateHistogram(hist, batch, row);
 		}
 	}
 
-	for (row = 0; row < count; row++) {
-		WiggleIterator * wig = wigs[row];
-		for (; !wig->done; pop(wig))
-			if (!isnan(wig->value))
-				updateHistogram(hist, wig, row);
+	destroySpanBatch(batch);
+	return hist;
+}
+
+// Adds the weight of [start, finish) to the bins it overlaps, in proportion to the overlap
+static void spreadOverHistogram(Histogram * hist, double start, double finish, double weight, int row) {
+	double step = (hist->max - hist->min) / hist->width;
+	int column = (int) ((start - hist->min) / step);
+	int last = (int) ((finish - hist->min) / step);
+
+	if (column < 0)
+		column = 0;
+	if (last >= hist->width)
+		last = hist->width - 1;
+	if (column >= last) {
+		hist->values[row][last] += weight;
+		return;
+	}
+
+	for (; column <= last; column++) {
+		double binStart = hist->min + step * column;
+		double overlap = fmin(finish, binStart + step) - fmax(start, binStart);
+		if (overlap > 0)
+			hist->values[row][column] += weight * overlap / (finish - start);
+	}
+}
+
+// The bins of A are widened to cover those of B, then the content of each 
+// bin of B is shared amongst the bins of A it overlaps. Histograms which 
+// started from the same range, e.g. from the same BigWig headers, are
+// merged exactly.
+void mergeHistograms(Histogram * A, Histogram * B) {
+	int row, column;
+
+	if (A->count != B->count || A->width != B->width) {
+		fprintf(stderr, "Cannot merge histograms of different dimensions\n");
+		raiseError();
 	}
 
+	if (isnan(B->min))
+		return;
+
+	extendHistogram(A, B->min, B->max);
+
+	if (A->min == B->min && A->max == B->max) {
+		for (row = 0; row < B->count; row++)
+			for (column = 0; column < B->width; column++)
+				A->values[row][column] += B->values[row][column];
+	} else if (B->min == B->max) {
+		for (row = 0; row < B->count; row++)
+			addToHistogram(A, B->min, B->values[row][0], row);
+	} else {
+		double step = (B->max - B->min) / B->width;
+		for (row = 0; row < B->count; row++)
+			for (column = 0; column < B->width; column++)
+				if (B->values[row][column])
+					spreadOverHistogram(A, B->min + step * column, B->min + step * (column + 1), B->values[row][column], row);
+	}
+}
+
+void dumpHistogram(Histogram * hist, FILE * file) {
+	int32_t dims[2] = {hist->count, hist->width};
+	int row;
+
+	writePartialValues(file, dims, sizeof(int32_t), 2);
+	writePartialValues(file, &hist->min, sizeof(double), 1);
+	writePartialValues(file, &hist->max, sizeof(double), 1);
+	for (row = 0; row < hist->count; row++)
+		writePartialValues(file, hist->values[row], sizeof(double), hist->width);
+}
+
+Histogram * loadHistogram(FILE * file) {
+	int32_t dims[2];
+	int row;
+
+	readPartialValues(file, dims, sizeof(int32_t), 2);
+	if (dims[0] < 0 || dims[1] <= 0) {
+		fprintf(stderr, "Corrupted partial results file\n");
+		raiseError();
+	}
+
+	Histogram * hist = calloc(1, sizeof(Histogram));
+	hist->count = dims[0];
+	hist->width = dims[1];
+	readPartialValues(file, &hist->min, sizeof(double), 1);
+	readPartialValues(file, &hist->max, sizeof(double), 1);
+	hist->values = calloc(hist->count, sizeof(double*));
+	for (row = 0; row < hist->count; row++) {
+		hist->values[row] = calloc(hist->width, sizeof(double));
+		readPartialValues(file, hist->values[row], sizeof(double), hist->width);
+	}
 	return hist;
 }
 
+// Counts of one input, over width bins spread evenly from min to max
+double * histogramRow(Histogram * hist, int row, int * width, double * min, double * max) {
+	*width = hist->width;
+	*min = hist->min;
+	*max = hist->max;
+	return hist->values[row];
+}
+
+Histogram * emptyHistogramLike(Histogram * model) {
+	Histogram * hist = calloc(1, sizeof(Histogram));
+	int row;
+
+	hist->count = model->count;
+	hist->width = model->width;
+	hist->min = model->min;
+	hist->max = model->max;
+	hist->values = calloc(hist->count, sizeof(double*));
+	for (row = 0; row < hist->count; row++)
+		hist->values[row] = calloc(hist->width, sizeof(double));
+	return hist;
+}
+
+int histogramRowCount(Histogram * hist) {
+	return hist->count;
+}
+
+void destroyHistogram(Histogram * hist) {
+	int row;
+
+	for (row = 0; row < hist->count; row++)
+		free(hist->values[row]);
+	free(hist->values);
+	free(hist);
+}
+
 void normalize_histogram(Histogram * hist) {
 	double sum;
 	int column, row;
@@ -0,0 +1,57 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "errors.h"
+#include "recycleBin.h"
+
+struct pool_st {
+	RecycleBin * bin;
+	pthread_mutex_t mutex;
+};
+
+Pool * newPool(size_t size, int perChunk) {
+	Pool * pool = (Pool *) calloc(1, sizeof(Pool));
+	if (!pool) {
+		fprintf(stderr, "Could not allocate memory pool\n");
+		raiseError();
+	}
+	pool->bin = newRecycleBin(size, perChunk);
+	pthread_mutex_init(&pool->mutex, NULL);
+	return pool;
+}
+
+void destroyPool(Pool * pool) {
+	pthread_mutex_destroy(&pool->mutex);
+	destroyRecycleBin(pool->bin);
+	free(pool);
+}
+
+void * poolAllocate(Pool * pool) {
+	void * ptr;
+	lockUntilError(&pool->mutex);
+	ptr = allocatePointer(pool->bin);
+	unlockUntilError(&pool->mutex);
+	return ptr;
+}
+
+void poolRelease(Pool * pool, void * ptr) {
+	lockUntilError(&pool->mutex);
+	deallocatePointer(pool->bin, ptr);
+	unlockUntilError(&pool->mutex);
+}
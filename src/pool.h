@@ -0,0 +1,33 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+// Objects of a fixed size, recycled rather than freed
+//
+// A thin layer over a RecycleBin, with a lock, so that objects can be 
+// released by another thread than the one which allocated them. Recycled 
+// objects are not cleared. The memory is returned to the system when the 
+// pool is destroyed.
+typedef struct pool_st Pool;
+
+Pool * newPool(size_t size, int perChunk);
+void destroyPool(Pool * pool);
+void * poolAllocate(Pool * pool);
+void poolRelease(Pool * pool, void * ptr);
+
+#endif
@@ -0,0 +1,293 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "profiler.h"
+
+static bool profiling = false;
+static bool reporting = false;
+static OperatorProfile * firstProfile = NULL;
+static OperatorProfile * lastProfile = NULL;
+// Protects the list of profiles and the links between them
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+// Innermost operator being popped or seeked by this thread
+static __thread OperatorProfile * currentProfile = NULL;
+
+void enableProfiling() {
+	profiling = true;
+	reporting = true;
+}
+
+void enableProfileCounters() {
+	profiling = true;
+}
+
+OperatorProfile * newOperatorProfile() {
+	OperatorProfile * profile;
+
+	if (!profiling)
+		return NULL;
+
+	profile = (OperatorProfile *) calloc(1, sizeof(OperatorProfile));
+	pthread_mutex_lock(&profileMutex);
+	if (lastProfile)
+		lastProfile->next = profile;
+	else
+		firstProfile = profile;
+	lastProfile = profile;
+	pthread_mutex_unlock(&profileMutex);
+	return profile;
+}
+
+void nameProfile(OperatorProfile * profile, const char * name) {
+	if (profile && !profile->name)
+		profile->name = strdup(name);
+}
+
+double profileClock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void countProfileBytes(long long bytes) {
+	if (currentProfile)
+		currentProfile->bytes += bytes;
+}
+
+//////////////////////////////////////////////////////
+// Timed calls
+//////////////////////////////////////////////////////
+
+typedef struct profileFrame_st {
+	OperatorProfile * caller;
+	double start;
+} ProfileFrame;
+
+static bool isAncestor(OperatorProfile * ancestor, OperatorProfile * profile) {
+	for (; profile; profile = profile->parent)
+		if (profile == ancestor)
+			return true;
+	return false;
+}
+
+// The first operator to call another one adopts it
+static void adoptProfile(OperatorProfile * parent, OperatorProfile * child) {
+	pthread_mutex_lock(&profileMutex);
+	if (!child->parent && !isAncestor(child, parent)) {
+		if (parent->childCount == parent->maxChildren) {
+			parent->maxChildren = parent->maxChildren ? 2 * parent->maxChildren : 4;
+			parent->children = (OperatorProfile **) realloc(parent->children, parent->maxChildren * sizeof(OperatorProfile *));
+		}
+		parent->children[parent->childCount++] = child;
+		child->parent = parent;
+	}
+	pthread_mutex_unlock(&profileMutex);
+}
+
+static void enterProfile(OperatorProfile * profile, ProfileFrame * frame) {
+	frame->caller = currentProfile;
+	if (currentProfile && !profile->parent && currentProfile != profile)
+		adoptProfile(currentProfile, profile);
+	currentProfile = profile;
+	// The progress reports only need the counts
+	if (reporting)
+		frame->start = profileClock();
+}
+
+static void exitProfile(OperatorProfile * profile, ProfileFrame * frame) {
+	if (reporting) {
+		double elapsed = profileClock() - frame->start;
+		profile->time += elapsed;
+		if (frame->caller && frame->caller != profile)
+			frame->caller->childTime += elapsed;
+	}
+	currentProfile = frame->caller;
+}
+
+void profilePop(WiggleIterator * wi) {
+	OperatorProfile * profile = wi->profile;
+	ProfileFrame frame;
+
+	enterProfile(profile, &frame);
+	wi->pop(wi);
+	exitProfile(profile, &frame);
+	if (!wi->done) {
+		profile->records++;
+		profile->chrom = wi->chrom;
+		profile->position = wi->start;
+	}
+}
+
+void profilePopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	OperatorProfile * profile = wi->profile;
+	ProfileFrame frame;
+	int count = batch->count;
+
+	enterProfile(profile, &frame);
+	if (wi->popBatch)
+		wi->popBatch(wi, batch);
+	else {
+		while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+			pushSpanBatch(batch, wi);
+			wi->pop(wi);
+		}
+	}
+	exitProfile(profile, &frame);
+	profile->records += batch->count - count;
+	if (batch->count > count) {
+		profile->chrom = batch->chroms[batch->count - 1];
+		profile->position = batch->starts[batch->count - 1];
+	}
+}
+
+void profileSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	OperatorProfile * profile = wi->profile;
+	ProfileFrame frame;
+
+	enterProfile(profile, &frame);
+	wi->seek(wi, chrom, start, finish);
+	exitProfile(profile, &frame);
+	profile->seeks++;
+	if (!wi->done)
+		profile->records++;
+}
+
+void profileSeekRegions(WiggleIterator * wi, const char * chrom, const int * starts, const int * finishes, int count) {
+	OperatorProfile * profile = wi->profile;
+	ProfileFrame frame;
+
+	enterProfile(profile, &frame);
+	wi->seekRegions(wi, chrom, starts, finishes, count);
+	exitProfile(profile, &frame);
+	profile->seeks++;
+	if (!wi->done)
+		profile->records++;
+}
+
+void profileMultiplexerPop(Multiplexer * multi) {
+	OperatorProfile * profile = multi->profile;
+	ProfileFrame frame;
+
+	enterProfile(profile, &frame);
+	multi->pop(multi);
+	exitProfile(profile, &frame);
+	if (!multi->done) {
+		profile->records++;
+		profile->chrom = multi->chrom;
+		profile->position = multi->start;
+	}
+}
+
+void profileMultiplexerSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	OperatorProfile * profile = multi->profile;
+	ProfileFrame frame;
+
+	enterProfile(profile, &frame);
+	multi->seek(multi, chrom, start, finish);
+	exitProfile(profile, &frame);
+	profile->seeks++;
+	if (!multi->done)
+		profile->records++;
+}
+
+//////////////////////////////////////////////////////
+// Report
+//////////////////////////////////////////////////////
+
+OperatorProfile * lockProfiles() {
+	pthread_mutex_lock(&profileMutex);
+	return firstProfile;
+}
+
+void unlockProfiles() {
+	pthread_mutex_unlock(&profileMutex);
+}
+
+bool hasNamedProfile(OperatorProfile * profile) {
+	int i;
+	if (profile->name)
+		return true;
+	for (i = 0; i < profile->childCount; i++)
+		if (hasNamedProfile(profile->children[i]))
+			return true;
+	return false;
+}
+
+// Time spent in the operators printed under this one
+static double namedChildTime(OperatorProfile * profile) {
+	double total = 0;
+	int i;
+	for (i = 0; i < profile->childCount; i++) {
+		OperatorProfile * child = profile->children[i];
+		total += child->name ? child->time : namedChildTime(child);
+	}
+	return total;
+}
+
+void foldedCounts(OperatorProfile * profile, double * blockedTime, long long * bytes, int * headStart, int * blockSize, int * queuedBlocks) {
+	int i;
+	*blockedTime += profile->blockedTime;
+	*bytes += profile->bytes;
+	if (profile->blockSize) {
+		*headStart = profile->headStart;
+		*blockSize = profile->blockSize;
+		*queuedBlocks = profile->queuedBlocks;
+	}
+	for (i = 0; i < profile->childCount; i++)
+		if (!profile->children[i]->name)
+			foldedCounts(profile->children[i], blockedTime, bytes, headStart, blockSize, queuedBlocks);
+}
+
+// Internal operators, which were not read from a token, are folded into their parent
+static void printProfileTree(FILE * file, OperatorProfile * profile, int depth) {
+	int i;
+
+	if (profile->name) {
+		double blockedTime = 0;
+		long long bytes = 0;
+		int headStart = 0, blockSize = 0, queuedBlocks = 0;
+		char buffering[32] = "-";
+		double self = profile->time - namedChildTime(profile);
+		char label[256];
+
+		foldedCounts(profile, &blockedTime, &bytes, &headStart, &blockSize, &queuedBlocks);
+		if (blockSize)
+			snprintf(buffering, sizeof(buffering), "%i x %i", headStart, blockSize);
+		// Clock jitter
+		if (self < 0)
+			self = 0;
+		snprintf(label, sizeof(label), "%*s%s", 2 * depth, "", profile->name);
+		fprintf(file, "%-40s %12lli %8lli %10.3f %10.3f %10.3f %14lli %14s\n", label, profile->records, profile->seeks, profile->time, self, blockedTime, bytes, buffering);
+		depth++;
+	}
+	for (i = 0; i < profile->childCount; i++)
+		printProfileTree(file, profile->children[i], depth);
+}
+
+void printProfile(FILE * file) {
+	OperatorProfile * profile;
+
+	if (!reporting)
+		return;
+
+	fprintf(file, "%-40s %12s %8s %10s %10s %10s %14s %14s\n", "operator", "records", "seeks", "time (s)", "self (s)", "blocked (s)", "bytes read", "head start");
+	for (profile = firstProfile; profile; profile = profile->next)
+		if (!profile->parent && hasNamedProfile(profile))
+			printProfileTree(file, profile, 0);
+}
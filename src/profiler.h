@@ -0,0 +1,69 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+// Opt-in counters on the pops and seeks of iterators and multiplexers
+//
+// When profiling is enabled, each iterator and multiplexer gets a profile
+// at creation, and pop, seek and popBatch go through the timed wrappers
+// below. An operator whose pop is first called from within the pop of
+// another becomes its child, which rebuilds the tree of the command.
+// The parser names the operators after the tokens they were read from.
+
+#include "wiggleIterator.h"
+#include "multiplexer.h"
+
+struct operatorProfile_st {
+	char * name;
+	long long records, seeks, bytes;
+	// Seconds: spent in pop or seek, in profiled callees, and waiting for a download thread
+	double time, childTime, blockedTime;
+	// Current settings of the buffered reader, if any, and the blocks it has ready
+	int headStart, blockSize, queuedBlocks;
+	// Last position produced, read by the progress reports
+	const char * chrom;
+	int position;
+	OperatorProfile * parent;
+	OperatorProfile ** children;
+	int childCount, maxChildren;
+	// All profiles, in order of creation
+	OperatorProfile * next;
+};
+
+// Counts without printing the report, for the progress reports
+void enableProfileCounters();
+// Returns NULL unless profiling is enabled
+OperatorProfile * newOperatorProfile();
+void nameProfile(OperatorProfile * profile, const char * name);
+double profileClock();
+// Adds to the bytes read by the operator being popped on this thread
+void countProfileBytes(long long bytes);
+
+void profilePop(WiggleIterator * wi);
+void profilePopBatch(WiggleIterator * wi, SpanBatch * batch);
+void profileSeek(WiggleIterator * wi, const char * chrom, int start, int finish);
+void profileSeekRegions(WiggleIterator * wi, const char * chrom, const int * starts, const int * finishes, int count);
+void profileMultiplexerPop(Multiplexer * multi);
+void profileMultiplexerSeek(Multiplexer * multi, const char * chrom, int start, int finish);
+
+// All profiles, in order of creation, while the list is locked
+OperatorProfile * lockProfiles();
+void unlockProfiles();
+bool hasNamedProfile(OperatorProfile * profile);
+// Includes the internal operators folded into this one, e.g. the actual file reader
+void foldedCounts(OperatorProfile * profile, double * blockedTime, long long * bytes, int * headStart, int * blockSize, int * queuedBlocks);
+
+#endif
@@ -0,0 +1,286 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "profiler.h"
+
+//////////////////////////////////////////////////////
+// Progress reports
+//
+// A thread samples the operator profiles at a fixed
+// interval: the last position produced by the outermost
+// operator, its records, and the bytes read and blocks
+// queued by each input, summed over the readers of a
+// same file. The counters are read while the program
+// runs, so a report may lag a record behind.
+//////////////////////////////////////////////////////
+
+#define DEFAULT_PROGRESS_INTERVAL 10
+
+typedef struct inputProgress_st {
+	const char * name;
+	long long bytes, previousBytes;
+	int queuedBlocks;
+	bool buffered;
+} InputProgress;
+
+typedef struct progressSample_st {
+	double time;
+	long long records;
+	const char * chrom;
+	int position;
+} ProgressSample;
+
+static double progressInterval;
+static bool printing = false;
+static char * statusFilename = NULL;
+static bool running = false;
+static bool stopping = false;
+static pthread_t progressThread;
+static pthread_mutex_t progressMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progressCond = PTHREAD_COND_INITIALIZER;
+static double progressStart;
+// Only touched by the progress thread, then by finishProgress once it is joined
+static InputProgress * inputs = NULL;
+static int inputCount = 0;
+static int maxInputs = 0;
+static ProgressSample previous;
+
+//////////////////////////////////////////////////////
+// Sampling
+//////////////////////////////////////////////////////
+
+static bool hasNamedAncestor(OperatorProfile * profile) {
+	for (profile = profile->parent; profile; profile = profile->parent)
+		if (profile->name)
+			return true;
+	return false;
+}
+
+static bool isInput(OperatorProfile * profile) {
+	int i;
+	for (i = 0; i < profile->childCount; i++)
+		if (hasNamedProfile(profile->children[i]))
+			return false;
+	return true;
+}
+
+static InputProgress * findInput(const char * name) {
+	int i;
+	for (i = 0; i < inputCount; i++)
+		if (strcmp(inputs[i].name, name) == 0)
+			return inputs + i;
+
+	if (inputCount == maxInputs) {
+		maxInputs = maxInputs ? 2 * maxInputs : 8;
+		inputs = (InputProgress *) realloc(inputs, maxInputs * sizeof(InputProgress));
+	}
+	memset(inputs + inputCount, 0, sizeof(InputProgress));
+	inputs[inputCount].name = name;
+	return inputs + inputCount++;
+}
+
+static void addInput(OperatorProfile * profile) {
+	InputProgress * input = findInput(profile->name);
+	double blockedTime = 0;
+	long long bytes = 0;
+	int headStart = 0, blockSize = 0, queuedBlocks = 0;
+
+	foldedCounts(profile, &blockedTime, &bytes, &headStart, &blockSize, &queuedBlocks);
+	input->bytes += bytes;
+	if (blockSize) {
+		input->buffered = true;
+		input->queuedBlocks += queuedBlocks;
+	}
+}
+
+// The position is that of the outermost operator created last, e.g. of the
+// latest region with --threads
+static void sampleProgress(ProgressSample * sample) {
+	OperatorProfile * profile;
+	int i;
+
+	for (i = 0; i < inputCount; i++) {
+		inputs[i].previousBytes = inputs[i].bytes;
+		inputs[i].bytes = 0;
+		inputs[i].queuedBlocks = 0;
+	}
+	sample->time = profileClock();
+	sample->records = 0;
+	sample->chrom = NULL;
+	sample->position = 0;
+
+	for (profile = lockProfiles(); profile; profile = profile->next) {
+		if (!profile->name)
+			continue;
+		if (!hasNamedAncestor(profile)) {
+			sample->records += profile->records;
+			if (profile->chrom) {
+				sample->chrom = profile->chrom;
+				sample->position = profile->position;
+			}
+		}
+		if (isInput(profile))
+			addInput(profile);
+	}
+	unlockProfiles();
+}
+
+//////////////////////////////////////////////////////
+// Reports
+//////////////////////////////////////////////////////
+
+static double rate(long long count, long long previousCount, double elapsed) {
+	return elapsed > 0 ? (count - previousCount) / elapsed : 0;
+}
+
+static void printProgress(FILE * file, ProgressSample * sample) {
+	double elapsed = sample->time - previous.time;
+	int i;
+
+	fprintf(file, "Progress after %.1f s: ", sample->time - progressStart);
+	if (sample->chrom)
+		fprintf(file, "%s:%i, ", sample->chrom, sample->position);
+	fprintf(file, "%lli records (%.0f per s)\n", sample->records, rate(sample->records, previous.records, elapsed));
+	for (i = 0; i < inputCount; i++) {
+		fprintf(file, "\t%s: %lli bytes (%.0f per s)", inputs[i].name, inputs[i].bytes, rate(inputs[i].bytes, inputs[i].previousBytes, elapsed));
+		if (inputs[i].buffered)
+			fprintf(file, ", %i blocks queued", inputs[i].queuedBlocks);
+		fputc('\n', file);
+	}
+	fflush(file);
+}
+
+static void printJSONString(FILE * file, const char * string) {
+	fputc('"', file);
+	for (; *string; string++) {
+		if (*string == '"' || *string == '\\')
+			fputc('\\', file);
+		if ((unsigned char) *string < 0x20)
+			fprintf(file, "\\u%04x", *string);
+		else
+			fputc(*string, file);
+	}
+	fputc('"', file);
+}
+
+// Written to a temporary file, then renamed, so that readers never see half a status
+static void writeStatus(ProgressSample * sample, bool done) {
+	double elapsed = sample->time - previous.time;
+	char * tmpFilename = (char *) malloc(strlen(statusFilename) + 5);
+	FILE * file;
+	int i;
+
+	sprintf(tmpFilename, "%s.tmp", statusFilename);
+	if (!(file = fopen(tmpFilename, "w"))) {
+		fprintf(stderr, "Could not open status file %s\n", tmpFilename);
+		free(tmpFilename);
+		return;
+	}
+	fprintf(file, "{\"elapsed\":%.3f,\"done\":%s,", sample->time - progressStart, done ? "true" : "false");
+	if (sample->chrom) {
+		fprintf(file, "\"chrom\":");
+		printJSONString(file, sample->chrom);
+		fprintf(file, ",\"position\":%i,", sample->position);
+	}
+	fprintf(file, "\"records\":%lli,\"records_per_second\":%.1f,\"inputs\":[", sample->records, rate(sample->records, previous.records, elapsed));
+	for (i = 0; i < inputCount; i++) {
+		fprintf(file, "%s\n{\"name\":", i ? "," : "");
+		printJSONString(file, inputs[i].name);
+		fprintf(file, ",\"bytes\":%lli,\"bytes_per_second\":%.1f", inputs[i].bytes, rate(inputs[i].bytes, inputs[i].previousBytes, elapsed));
+		if (inputs[i].buffered)
+			fprintf(file, ",\"queued_blocks\":%i", inputs[i].queuedBlocks);
+		fputc('}', file);
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	if (rename(tmpFilename, statusFilename))
+		fprintf(stderr, "Could not write status file %s\n", statusFilename);
+	free(tmpFilename);
+}
+
+static void report(bool done) {
+	ProgressSample sample;
+
+	sampleProgress(&sample);
+	if (printing && !done)
+		printProgress(stderr, &sample);
+	if (statusFilename)
+		writeStatus(&sample, done);
+	previous = sample;
+}
+
+//////////////////////////////////////////////////////
+// Thread
+//////////////////////////////////////////////////////
+
+static void * runProgress(void * args) {
+	struct timespec deadline;
+	double next = progressInterval;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	pthread_mutex_lock(&progressMutex);
+	while (!stopping) {
+		struct timespec wake = deadline;
+		wake.tv_sec += (time_t) next;
+		wake.tv_nsec += (long) ((next - (time_t) next) * 1e9);
+		if (wake.tv_nsec >= 1000000000) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&progressCond, &progressMutex, &wake) && !stopping) {
+			pthread_mutex_unlock(&progressMutex);
+			report(false);
+			pthread_mutex_lock(&progressMutex);
+			next += progressInterval;
+		}
+	}
+	pthread_mutex_unlock(&progressMutex);
+	return NULL;
+}
+
+void startProgress(double interval, char * statusFile) {
+	int err;
+
+	printing = interval > 0;
+	progressInterval = interval > 0 ? interval : DEFAULT_PROGRESS_INTERVAL;
+	statusFilename = statusFile;
+	enableProfileCounters();
+	progressStart = previous.time = profileClock();
+
+	if ((err = pthread_create(&progressThread, NULL, &runProgress, NULL))) {
+		fprintf(stderr, "Could not create new thread %i\n", err);
+		raiseError();
+	}
+	running = true;
+}
+
+void finishProgress() {
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&progressMutex);
+	stopping = true;
+	pthread_cond_signal(&progressCond);
+	pthread_mutex_unlock(&progressMutex);
+	pthread_join(progressThread, NULL);
+	running = false;
+
+	report(true);
+}
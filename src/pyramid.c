@@ -0,0 +1,208 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+// Local header
+#include "wiggleIterator.h"
+
+//////////////////////////////////////////////////////
+// Pyramid
+//
+// The source is read once into a queue of records, from
+// which each level reads through its own cursor. A level
+// is a binning operator over its cursor, wrapped in a
+// writer. The pyramid passes the source through, and
+// after each record pops the levels which lag behind it,
+// so the queue only holds the records of the coarsest bin
+// being computed.
+//////////////////////////////////////////////////////
+
+typedef struct pyramidRecord_st {
+	char * chrom;
+	int start;
+	int finish;
+	double value;
+} PyramidRecord;
+
+typedef struct pyramidCursor_st {
+	Pyramid * pyramid;
+	// Index of the next record to read
+	long long next;
+} PyramidCursor;
+
+struct pyramid_st {
+	WiggleIterator * iter;
+	// Records read from the source, the oldest has index first
+	PyramidRecord * records;
+	int capacity;
+	int head;
+	int count;
+	long long first;
+	// Cursor of the records passed through
+	PyramidCursor main;
+	// Cursors of the levels, and their writers
+	PyramidCursor ** cursors;
+	WiggleIterator ** levels;
+	int levelCount;
+	int levelCapacity;
+};
+
+static PyramidRecord * pyramidRecord(Pyramid * pyramid, long long index) {
+	return pyramid->records + (pyramid->head + (index - pyramid->first)) % pyramid->capacity;
+}
+
+static bool queueSourceRecord(Pyramid * pyramid) {
+	WiggleIterator * iter = pyramid->iter;
+
+	if (iter->done)
+		return false;
+	if (pyramid->count == pyramid->capacity) {
+		PyramidRecord * records = (PyramidRecord *) calloc(2 * pyramid->capacity, sizeof(PyramidRecord));
+		long long index;
+		for (index = 0; index < pyramid->count; index++)
+			records[index] = *pyramidRecord(pyramid, pyramid->first + index);
+		free(pyramid->records);
+		pyramid->records = records;
+		pyramid->head = 0;
+		pyramid->capacity *= 2;
+	}
+	PyramidRecord * record = pyramidRecord(pyramid, pyramid->first + pyramid->count++);
+	record->chrom = iter->chrom;
+	record->start = iter->start;
+	record->finish = iter->finish;
+	record->value = iter->value;
+	pop(iter);
+	return true;
+}
+
+// Discards the records which all cursors have read
+static void forgetPyramidRecords(Pyramid * pyramid) {
+	long long oldest = pyramid->main.next;
+	int level;
+
+	for (level = 0; level < pyramid->levelCount; level++)
+		if (pyramid->cursors[level]->next < oldest)
+			oldest = pyramid->cursors[level]->next;
+	for (; pyramid->first < oldest; pyramid->first++) {
+		pyramid->head = (pyramid->head + 1) % pyramid->capacity;
+		pyramid->count--;
+	}
+}
+
+static void advancePyramidCursor(WiggleIterator * wi, PyramidCursor * cursor) {
+	Pyramid * pyramid = cursor->pyramid;
+
+	if (cursor->next == pyramid->first + pyramid->count && !queueSourceRecord(pyramid)) {
+		wi->done = true;
+		return;
+	}
+	PyramidRecord * record = pyramidRecord(pyramid, cursor->next++);
+	wi->chrom = record->chrom;
+	wi->start = record->start;
+	wi->finish = record->finish;
+	wi->value = record->value;
+}
+
+static void PyramidCursorPop(WiggleIterator * wi) {
+	advancePyramidCursor(wi, (PyramidCursor *) wi->data);
+}
+
+// The pyramid seeks the source, the levels restart from the queue
+static void PyramidCursorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	PyramidCursor * cursor = (PyramidCursor *) wi->data;
+	cursor->next = cursor->pyramid->first;
+	wi->done = false;
+	pop(wi);
+}
+
+Pyramid * newPyramid(WiggleIterator * i) {
+	Pyramid * pyramid = (Pyramid *) calloc(1, sizeof(Pyramid));
+	pyramid->iter = NonOverlappingWiggleIterator(i);
+	pyramid->capacity = 1024;
+	pyramid->records = (PyramidRecord *) calloc(pyramid->capacity, sizeof(PyramidRecord));
+	pyramid->main.pyramid = pyramid;
+	return pyramid;
+}
+
+WiggleIterator * PyramidBinWiggleIterator(Pyramid * pyramid, int width, BinStatistic statistic) {
+	PyramidCursor * cursor = (PyramidCursor *) calloc(1, sizeof(PyramidCursor));
+	cursor->pyramid = pyramid;
+	cursor->next = pyramid->first;
+
+	if (pyramid->levelCount == pyramid->levelCapacity) {
+		pyramid->levelCapacity = pyramid->levelCapacity ? 2 * pyramid->levelCapacity : 4;
+		pyramid->cursors = (PyramidCursor **) realloc(pyramid->cursors, pyramid->levelCapacity * sizeof(PyramidCursor *));
+		pyramid->levels = (WiggleIterator **) realloc(pyramid->levels, pyramid->levelCapacity * sizeof(WiggleIterator *));
+	}
+	pyramid->cursors[pyramid->levelCount] = cursor;
+	pyramid->levels[pyramid->levelCount] = NULL;
+	pyramid->levelCount++;
+
+	WiggleIterator * source = newWiggleIterator(cursor, &PyramidCursorPop, &PyramidCursorSeek, pyramid->iter->default_value);
+	return BinWiggleIterator(source, width, statistic);
+}
+
+// The writers are added in the order of their bins
+void addPyramidLevel(Pyramid * pyramid, WiggleIterator * writer) {
+	int level;
+	for (level = 0; level < pyramid->levelCount && pyramid->levels[level]; level++);
+	if (level == pyramid->levelCount) {
+		fprintf(stderr, "Pyramid level added without bins\n");
+		raiseError();
+	}
+	pyramid->levels[level] = writer;
+}
+
+static void PyramidWiggleIteratorPop(WiggleIterator * wi) {
+	Pyramid * pyramid = (Pyramid *) wi->data;
+	int level;
+
+	advancePyramidCursor(wi, &pyramid->main);
+	for (level = 0; level < pyramid->levelCount; level++) {
+		WiggleIterator * writer = pyramid->levels[level];
+		// Once the source is exhausted, the writers close their files
+		while (!writer->done && (wi->done || pyramid->cursors[level]->next < pyramid->main.next))
+			pop(writer);
+	}
+	forgetPyramidRecords(pyramid);
+}
+
+// The bins at the edges of the region only cover its part of them
+static void PyramidWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	Pyramid * pyramid = (Pyramid *) wi->data;
+	int level;
+
+	seek(pyramid->iter, chrom, start, finish);
+	pyramid->first += pyramid->count;
+	pyramid->count = 0;
+	pyramid->head = 0;
+	pyramid->main.next = pyramid->first;
+	for (level = 0; level < pyramid->levelCount; level++)
+		seek(pyramid->levels[level], chrom, start, finish);
+	wi->done = false;
+	pop(wi);
+}
+
+WiggleIterator * PyramidWiggleIterator(Pyramid * pyramid) {
+	int level;
+	for (level = 0; level < pyramid->levelCount; level++) {
+		if (!pyramid->levels[level]) {
+			fprintf(stderr, "Pyramid level without writer\n");
+			raiseError();
+		}
+	}
+	return newWiggleIterator(pyramid, &PyramidWiggleIteratorPop, &PyramidWiggleIteratorSeek, pyramid->iter->default_value);
+}
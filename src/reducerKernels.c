@@ -0,0 +1,582 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "reducerKernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define REDUCER_KERNELS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define REDUCER_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#define LANES 8
+
+//////////////////////////////////////////////////////
+// Lanes
+//////////////////////////////////////////////////////
+
+// The vector loops stop at the last multiple of LANES, the remaining values
+// go to their lanes here, then the lanes are combined in order.
+
+static double finishSum(const double * values, int i, int count, double * lanes, bool nan) {
+	double res = 0;
+	int j;
+	for (; i < count; i++) {
+		nan |= isnan(values[i]);
+		lanes[i % LANES] += values[i];
+	}
+	if (nan)
+		return NAN;
+	for (j = 0; j < LANES; j++)
+		res += lanes[j];
+	return res;
+}
+
+static double finishProduct(const double * values, int i, int count, double * lanes, bool nan) {
+	double res = 1;
+	int j;
+	for (; i < count; i++) {
+		nan |= isnan(values[i]);
+		lanes[i % LANES] *= values[i];
+	}
+	if (nan)
+		return NAN;
+	for (j = 0; j < LANES; j++)
+		res *= lanes[j];
+	return res;
+}
+
+static double finishMax(const double * values, int i, int count, double * lanes, bool nan) {
+	double res = -INFINITY;
+	int j;
+	for (; i < count; i++) {
+		nan |= isnan(values[i]);
+		if (lanes[i % LANES] < values[i])
+			lanes[i % LANES] = values[i];
+	}
+	if (nan)
+		return NAN;
+	for (j = 0; j < LANES; j++)
+		if (res < lanes[j])
+			res = lanes[j];
+	return res;
+}
+
+static double finishMin(const double * values, int i, int count, double * lanes, bool nan) {
+	double res = INFINITY;
+	int j;
+	for (; i < count; i++) {
+		nan |= isnan(values[i]);
+		if (lanes[i % LANES] > values[i])
+			lanes[i % LANES] = values[i];
+	}
+	if (nan)
+		return NAN;
+	for (j = 0; j < LANES; j++)
+		if (res > lanes[j])
+			res = lanes[j];
+	return res;
+}
+
+static double finishFloatSum(const double * values, int i, int count, double * lanes, bool nan) {
+	double res = 0;
+	int j;
+	for (; i < count; i++) {
+		float value = values[i];
+		nan |= isnan(value);
+		lanes[i % LANES] += value;
+	}
+	if (nan)
+		return NAN;
+	for (j = 0; j < LANES; j++)
+		res += lanes[j];
+	return res;
+}
+
+static double finishSquaredDeviations(const double * values, const bool * inplay, int i, int count, double mean, double * lanes) {
+	double res = 0;
+	int j;
+	for (; i < count; i++) {
+		if (!inplay || inplay[i]) {
+			double diff = mean - values[i];
+			lanes[i % LANES] += diff * diff;
+		}
+	}
+	for (j = 0; j < LANES; j++)
+		res += lanes[j];
+	return res;
+}
+
+static void fillLanes(double * lanes, double value) {
+	int j;
+	for (j = 0; j < LANES; j++)
+		lanes[j] = value;
+}
+
+//////////////////////////////////////////////////////
+// Plain C
+//////////////////////////////////////////////////////
+
+static double sumScalar(const double * values, int count) {
+	double lanes[LANES];
+	fillLanes(lanes, 0);
+	return finishSum(values, 0, count, lanes, false);
+}
+
+static double productScalar(const double * values, int count) {
+	double lanes[LANES];
+	fillLanes(lanes, 1);
+	return finishProduct(values, 0, count, lanes, false);
+}
+
+static double maxScalar(const double * values, int count) {
+	double lanes[LANES];
+	fillLanes(lanes, -INFINITY);
+	return finishMax(values, 0, count, lanes, false);
+}
+
+static double minScalar(const double * values, int count) {
+	double lanes[LANES];
+	fillLanes(lanes, INFINITY);
+	return finishMin(values, 0, count, lanes, false);
+}
+
+static double floatSumScalar(const double * values, int count) {
+	double lanes[LANES];
+	fillLanes(lanes, 0);
+	return finishFloatSum(values, 0, count, lanes, false);
+}
+
+static double squaredDeviationsScalar(const double * values, const bool * inplay, int count, double mean) {
+	double lanes[LANES];
+	fillLanes(lanes, 0);
+	return finishSquaredDeviations(values, inplay, 0, count, mean, lanes);
+}
+
+static const ReducerKernels scalarKernels = {"scalar", &sumScalar, &productScalar, &maxScalar, &minScalar, &floatSumScalar, &squaredDeviationsScalar};
+
+#ifdef REDUCER_KERNELS_X86
+
+//////////////////////////////////////////////////////
+// AVX2
+//////////////////////////////////////////////////////
+
+// Two registers of 4 lanes
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256d avx2Nans(__m256d nans, __m256d values) {
+	return _mm256_or_pd(nans, _mm256_cmp_pd(values, values, _CMP_UNORD_Q));
+}
+
+AVX2 static double sumAVX2(const double * values, int count) {
+	__m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd(), nans = _mm256_setzero_pd();
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = _mm256_loadu_pd(values + i), b = _mm256_loadu_pd(values + i + 4);
+		nans = avx2Nans(avx2Nans(nans, a), b);
+		low = _mm256_add_pd(low, a);
+		high = _mm256_add_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishSum(values, i, count, lanes, _mm256_movemask_pd(nans));
+}
+
+AVX2 static double productAVX2(const double * values, int count) {
+	__m256d low = _mm256_set1_pd(1), high = _mm256_set1_pd(1), nans = _mm256_setzero_pd();
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = _mm256_loadu_pd(values + i), b = _mm256_loadu_pd(values + i + 4);
+		nans = avx2Nans(avx2Nans(nans, a), b);
+		low = _mm256_mul_pd(low, a);
+		high = _mm256_mul_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishProduct(values, i, count, lanes, _mm256_movemask_pd(nans));
+}
+
+AVX2 static double maxAVX2(const double * values, int count) {
+	__m256d low = _mm256_set1_pd(-INFINITY), high = _mm256_set1_pd(-INFINITY), nans = _mm256_setzero_pd();
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = _mm256_loadu_pd(values + i), b = _mm256_loadu_pd(values + i + 4);
+		nans = avx2Nans(avx2Nans(nans, a), b);
+		low = _mm256_max_pd(low, a);
+		high = _mm256_max_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishMax(values, i, count, lanes, _mm256_movemask_pd(nans));
+}
+
+AVX2 static double minAVX2(const double * values, int count) {
+	__m256d low = _mm256_set1_pd(INFINITY), high = _mm256_set1_pd(INFINITY), nans = _mm256_setzero_pd();
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = _mm256_loadu_pd(values + i), b = _mm256_loadu_pd(values + i + 4);
+		nans = avx2Nans(avx2Nans(nans, a), b);
+		low = _mm256_min_pd(low, a);
+		high = _mm256_min_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishMin(values, i, count, lanes, _mm256_movemask_pd(nans));
+}
+
+AVX2 static __m256d avx2Float(__m256d values) {
+	return _mm256_cvtps_pd(_mm256_cvtpd_ps(values));
+}
+
+AVX2 static double floatSumAVX2(const double * values, int count) {
+	__m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd(), nans = _mm256_setzero_pd();
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = avx2Float(_mm256_loadu_pd(values + i)), b = avx2Float(_mm256_loadu_pd(values + i + 4));
+		nans = avx2Nans(avx2Nans(nans, a), b);
+		low = _mm256_add_pd(low, a);
+		high = _mm256_add_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishFloatSum(values, i, count, lanes, _mm256_movemask_pd(nans));
+}
+
+// All ones where the bool is set
+AVX2 static __m256d avx2Mask(const bool * inplay) {
+	int32_t bytes;
+	memcpy(&bytes, inplay, sizeof(bytes));
+	__m256i wide = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+	return _mm256_castsi256_pd(_mm256_cmpgt_epi64(wide, _mm256_setzero_si256()));
+}
+
+AVX2 static __m256d avx2Square(__m256d mean, __m256d values) {
+	__m256d diff = _mm256_sub_pd(mean, values);
+	return _mm256_mul_pd(diff, diff);
+}
+
+AVX2 static double squaredDeviationsAVX2(const double * values, const bool * inplay, int count, double mean) {
+	__m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd(), means = _mm256_set1_pd(mean);
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m256d a = avx2Square(means, _mm256_loadu_pd(values + i));
+		__m256d b = avx2Square(means, _mm256_loadu_pd(values + i + 4));
+		if (inplay) {
+			a = _mm256_and_pd(a, avx2Mask(inplay + i));
+			b = _mm256_and_pd(b, avx2Mask(inplay + i + 4));
+		}
+		low = _mm256_add_pd(low, a);
+		high = _mm256_add_pd(high, b);
+	}
+	_mm256_storeu_pd(lanes, low);
+	_mm256_storeu_pd(lanes + 4, high);
+	return finishSquaredDeviations(values, inplay, i, count, mean, lanes);
+}
+
+static const ReducerKernels avx2Kernels = {"AVX2", &sumAVX2, &productAVX2, &maxAVX2, &minAVX2, &floatSumAVX2, &squaredDeviationsAVX2};
+
+//////////////////////////////////////////////////////
+// AVX-512
+//////////////////////////////////////////////////////
+
+// One register of 8 lanes
+
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 static __mmask8 avx512Nans(__m512d values) {
+	return _mm512_cmp_pd_mask(values, values, _CMP_UNORD_Q);
+}
+
+AVX512 static double sumAVX512(const double * values, int count) {
+	__m512d acc = _mm512_setzero_pd();
+	__mmask8 nans = 0;
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m512d a = _mm512_loadu_pd(values + i);
+		nans |= avx512Nans(a);
+		acc = _mm512_add_pd(acc, a);
+	}
+	_mm512_storeu_pd(lanes, acc);
+	return finishSum(values, i, count, lanes, nans);
+}
+
+AVX512 static double productAVX512(const double * values, int count) {
+	__m512d acc = _mm512_set1_pd(1);
+	__mmask8 nans = 0;
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m512d a = _mm512_loadu_pd(values + i);
+		nans |= avx512Nans(a);
+		acc = _mm512_mul_pd(acc, a);
+	}
+	_mm512_storeu_pd(lanes, acc);
+	return finishProduct(values, i, count, lanes, nans);
+}
+
+AVX512 static double maxAVX512(const double * values, int count) {
+	__m512d acc = _mm512_set1_pd(-INFINITY);
+	__mmask8 nans = 0;
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m512d a = _mm512_loadu_pd(values + i);
+		nans |= avx512Nans(a);
+		acc = _mm512_max_pd(acc, a);
+	}
+	_mm512_storeu_pd(lanes, acc);
+	return finishMax(values, i, count, lanes, nans);
+}
+
+AVX512 static double minAVX512(const double * values, int count) {
+	__m512d acc = _mm512_set1_pd(INFINITY);
+	__mmask8 nans = 0;
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m512d a = _mm512_loadu_pd(values + i);
+		nans |= avx512Nans(a);
+		acc = _mm512_min_pd(acc, a);
+	}
+	_mm512_storeu_pd(lanes, acc);
+	return finishMin(values, i, count, lanes, nans);
+}
+
+AVX512 static double floatSumAVX512(const double * values, int count) {
+	__m512d acc = _mm512_setzero_pd();
+	__mmask8 nans = 0;
+	double lanes[LANES];
+	int i;
+	for (i = 0; i + LANES <= count; i += LANES) {
+		__m512d a = _mm512_cvtps_pd(_mm512_cvtpd_ps(_mm512_loadu_pd(values + i)));
+		nans |= avx512Nans(a);
+		acc = _mm512_add_pd(acc, a);
+	}
+	_mm512_storeu_pd(lanes, acc);
+	return finishFloatSum(values, i, count, lanes, nans);
+}
+
+AVX512 static __mmask8 avx512Mask(const bool * inplay) {
+	__mmask8 mask = 0;
+	int j;
+	for (j = 0; j < LANES; j++)
+		if (inplay[j])
+			mask |= 1 << j;
+	return mask;
+}
+
+// The explicit rounding keeps the compiler from fusing the square into the sum,
+// which would change the result compared to the other kernels.
+// The tail is loaded with a mask, value i still going to lane i % LANES.
+AVX512 static double squaredDeviationsAVX512(const double * values, const bool * inplay, int count, double mean) {
+	__m512d acc = _mm512_setzero_pd(), means = _mm512_set1_pd(mean);
+	double lanes[LANES];
+	int i, j;
+	double res = 0;
+	for (i = 0; i < count; i += LANES) {
+		__mmask8 mask = count - i >= LANES ? 0xFF : (1 << (count - i)) - 1;
+		if (inplay)
+			mask &= avx512Mask(inplay + i);
+		__m512d diff = _mm512_sub_pd(means, _mm512_maskz_loadu_pd(mask, values + i));
+		acc = _mm512_add_pd(acc, _mm512_maskz_mul_round_pd(mask, diff, diff, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+	}
+	_mm512_storeu_pd(lanes, acc);
+	for (j = 0; j < LANES; j++)
+		res += lanes[j];
+	return res;
+}
+
+static const ReducerKernels avx512Kernels = {"AVX-512", &sumAVX512, &productAVX512, &maxAVX512, &minAVX512, &floatSumAVX512, &squaredDeviationsAVX512};
+
+#endif
+
+#ifdef REDUCER_KERNELS_NEON
+
+//////////////////////////////////////////////////////
+// NEON
+//////////////////////////////////////////////////////
+
+// Four registers of 2 lanes
+
+// All ones in the lanes which have not met a NaN
+static uint64x2_t neonNans(uint64x2_t numbers, float64x2_t values) {
+	return vandq_u64(numbers, vceqq_f64(values, values));
+}
+
+static bool neonAny(uint64x2_t numbers) {
+	return !vgetq_lane_u64(numbers, 0) || !vgetq_lane_u64(numbers, 1);
+}
+
+static void neonStore(double * lanes, float64x2_t * acc) {
+	int j;
+	for (j = 0; j < 4; j++)
+		vst1q_f64(lanes + 2 * j, acc[j]);
+}
+
+static double sumNEON(const double * values, int count) {
+	float64x2_t acc[4];
+	uint64x2_t nans = vdupq_n_u64(~0ULL);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(0);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t a = vld1q_f64(values + i + 2 * j);
+			nans = neonNans(nans, a);
+			acc[j] = vaddq_f64(acc[j], a);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishSum(values, i, count, lanes, neonAny(nans));
+}
+
+static double productNEON(const double * values, int count) {
+	float64x2_t acc[4];
+	uint64x2_t nans = vdupq_n_u64(~0ULL);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(1);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t a = vld1q_f64(values + i + 2 * j);
+			nans = neonNans(nans, a);
+			acc[j] = vmulq_f64(acc[j], a);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishProduct(values, i, count, lanes, neonAny(nans));
+}
+
+static double maxNEON(const double * values, int count) {
+	float64x2_t acc[4];
+	uint64x2_t nans = vdupq_n_u64(~0ULL);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(-INFINITY);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t a = vld1q_f64(values + i + 2 * j);
+			nans = neonNans(nans, a);
+			acc[j] = vmaxq_f64(acc[j], a);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishMax(values, i, count, lanes, neonAny(nans));
+}
+
+static double minNEON(const double * values, int count) {
+	float64x2_t acc[4];
+	uint64x2_t nans = vdupq_n_u64(~0ULL);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(INFINITY);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t a = vld1q_f64(values + i + 2 * j);
+			nans = neonNans(nans, a);
+			acc[j] = vminq_f64(acc[j], a);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishMin(values, i, count, lanes, neonAny(nans));
+}
+
+static double floatSumNEON(const double * values, int count) {
+	float64x2_t acc[4];
+	uint64x2_t nans = vdupq_n_u64(~0ULL);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(0);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t a = vcvt_f64_f32(vcvt_f32_f64(vld1q_f64(values + i + 2 * j)));
+			nans = neonNans(nans, a);
+			acc[j] = vaddq_f64(acc[j], a);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishFloatSum(values, i, count, lanes, neonAny(nans));
+}
+
+static uint64x2_t neonMask(const bool * inplay) {
+	return vcombine_u64(vcreate_u64(inplay[0] ? ~0ULL : 0), vcreate_u64(inplay[1] ? ~0ULL : 0));
+}
+
+static double squaredDeviationsNEON(const double * values, const bool * inplay, int count, double mean) {
+	float64x2_t acc[4], means = vdupq_n_f64(mean);
+	double lanes[LANES];
+	int i, j;
+	for (j = 0; j < 4; j++)
+		acc[j] = vdupq_n_f64(0);
+	for (i = 0; i + LANES <= count; i += LANES) {
+		for (j = 0; j < 4; j++) {
+			float64x2_t diff = vsubq_f64(means, vld1q_f64(values + i + 2 * j));
+			float64x2_t square = vmulq_f64(diff, diff);
+			if (inplay)
+				square = vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(square), neonMask(inplay + i + 2 * j)));
+			acc[j] = vaddq_f64(acc[j], square);
+		}
+	}
+	neonStore(lanes, acc);
+	return finishSquaredDeviations(values, inplay, i, count, mean, lanes);
+}
+
+static const ReducerKernels neonKernels = {"NEON", &sumNEON, &productNEON, &maxNEON, &minNEON, &floatSumNEON, &squaredDeviationsNEON};
+
+#endif
+
+//////////////////////////////////////////////////////
+// Dispatch
+//////////////////////////////////////////////////////
+
+static const ReducerKernels * kernels = &scalarKernels;
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+static void pickReducerKernels() {
+#if defined(REDUCER_KERNELS_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		kernels = &avx512Kernels;
+	else if (__builtin_cpu_supports("avx2"))
+		kernels = &avx2Kernels;
+#elif defined(REDUCER_KERNELS_NEON)
+	// NEON is part of the base AArch64 instruction set
+	kernels = &neonKernels;
+#endif
+}
+
+const ReducerKernels * reducerKernels() {
+	pthread_once(&kernelsOnce, &pickReducerKernels);
+	return kernels;
+}
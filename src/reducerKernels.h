@@ -0,0 +1,45 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _REDUCER_KERNELS_H_
+#define _REDUCER_KERNELS_H_
+
+// Loops of the reducers over the values of a multiplexer
+//
+// The kernels are picked once at run time, amongst AVX-512, AVX2, NEON
+// and plain C implementations. All of them accumulate into the same 8
+// lanes, value i going to lane i % 8, and add up the lanes in order, so
+// the results do not depend on the instruction set. Up to 8 values, this
+// is exactly the sequential loop.
+
+#include "wiggletools.h"
+
+typedef struct reducerKernels_st {
+	const char * name;
+	// NAN if any value is NaN
+	double (*sum)(const double * values, int count);
+	double (*product)(const double * values, int count);
+	// NAN if any value is NaN, -INFINITY (resp. INFINITY) if count is 0
+	double (*max)(const double * values, int count);
+	double (*min)(const double * values, int count);
+	// Sum of the values cast to float, NAN if any is NaN
+	double (*floatSum)(const double * values, int count);
+	// Sum of (mean - value)^2, over the values in play if inplay is not NULL
+	double (*squaredDeviations)(const double * values, const bool * inplay, int count, double mean);
+} ReducerKernels;
+
+// Best kernels supported by this CPU
+const ReducerKernels * reducerKernels();
+
+#endif
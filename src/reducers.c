@@ -14,8 +14,10 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #include "multiplexer.h"
+#include "reducerKernels.h"
 
 typedef struct wiggleReducerData_st {
 	Multiplexer * multi;
@@ -27,6 +29,30 @@ void WiggleReducerSeek(WiggleIterator * iter, const char * chrom, int start, int
 	pop(iter);
 }
 
+static bool reducerLags(WiggleIterator * wi, const char * chrom, int start) {
+	int chrom_cmp = compareChroms(wi->chrom, chrom);
+	return chrom_cmp < 0 || (chrom_cmp == 0 && wi->finish <= start);
+}
+
+// Each reducer reports at most one record per position of its multiplexer
+static void WiggleReducerSkipTo(WiggleIterator * iter, const char * chrom, int start) {
+	WiggleReducerData * data = (WiggleReducerData* ) iter->data;
+	if (!reducerLags(iter, chrom, start))
+		return;
+	skipMultiplexer(data->multi, chrom, start);
+	pop(iter);
+	while (!iter->done && reducerLags(iter, chrom, start))
+		pop(iter);
+}
+
+// The data of all reducers starts with their multiplexer
+static WiggleIterator * newWiggleReducer(void * data, Multiplexer * multi, void (*pop)(WiggleIterator *), void (*seek)(WiggleIterator *, const char *, int, int), double default_value) {
+	WiggleIterator * new = newWiggleIterator(data, pop, seek, default_value);
+	if (multi->skipTo)
+		new->skipTo = &WiggleReducerSkipTo;
+	return new;
+}
+
 ////////////////////////////////////////////////////////
 // Select
 ////////////////////////////////////////////////////////
@@ -67,7 +93,7 @@ WiggleIterator * SelectReduction(Multiplexer * multi, int index) {
 	WiggleSelectData * data = (WiggleSelectData *) calloc(1, sizeof(WiggleSelectData));
 	data->multi = multi;
 	data->index = index;
-	return newWiggleIterator(data, &SelectReductionPop, &WiggleReducerSeek, multi->default_values[index]);
+	return newWiggleReducer(data, multi, &SelectReductionPop, &WiggleReducerSeek, multi->default_values[index]);
 }
 
 ////////////////////////////////////////////////////////
@@ -100,24 +126,229 @@ WiggleIterator * FillInReduction(Multiplexer * multi) {
 	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
 	if (multi->count != 2) {
 		printf("The fill in operator can only work on 2 iterators! Got %i\n", multi->count);
-		exit(1);
+		raiseError();
 	}
 	data->multi = multi;
-	WiggleIterator * res = newWiggleIterator(data, &FillInReductionPop, &WiggleReducerSeek, multi->default_values[1]);
+	WiggleIterator * res = newWiggleReducer(data, multi, &FillInReductionPop, &WiggleReducerSeek, multi->default_values[1]);
 	return res;
 }
 
+////////////////////////////////////////////////////////
+// Incremental updates
+////////////////////////////////////////////////////////
+
+// Below this many inputs, scanning all the values is as cheap as following the changes
+#define INCREMENTAL_MIN_INPUTS 64
+// Number of incremental updates between two full scans, which bound the rounding drift
+#define INCREMENTAL_RESYNC 1024
+
+typedef struct incrementalReducerData_st {
+	Multiplexer * multi;
+	// Whether the sums below are up to date with the previous position of the multiplexer
+	bool synced;
+	int steps;
+	// Sums of integers do not drift, so need no full scans
+	bool exact;
+	// Sum of the values (cast to float for the variance)
+	double sum;
+	// Sums over the inputs in play of (value - shift) and of its square,
+	// shift being the mean at the last full scan, to avoid cancellations
+	double shift, shiftedSum, shiftedSquares;
+} IncrementalReducerData;
+
+static IncrementalReducerData * newIncrementalReducerData(Multiplexer * multi) {
+	IncrementalReducerData * data = (IncrementalReducerData *) calloc(1, sizeof(IncrementalReducerData));
+	data->multi = multi;
+	return data;
+}
+
+static bool canUpdateIncrementally(IncrementalReducerData * data) {
+	Multiplexer * multi = data->multi;
+	int i;
+
+	if (!data->synced || multi->change_count < 0 || multi->change_count > multi->count / 8 || (data->steps >= INCREMENTAL_RESYNC && !data->exact))
+		return false;
+
+	// Infinities and NaNs cannot be subtracted back out
+	for (i = 0; i < multi->change_count && !multi->finite; i++)
+		if (!isfinite(multi->changes[i].previous) || !isfinite(multi->changes[i].value))
+			return false;
+
+	data->steps++;
+	return true;
+}
+
+static double incrementalSum(IncrementalReducerData * data) {
+	Multiplexer * multi = data->multi;
+	int i;
+
+	if (canUpdateIncrementally(data)) {
+		for (i = 0; i < multi->change_count; i++)
+			data->sum += multi->changes[i].value - multi->changes[i].previous;
+	} else {
+		data->sum = reducerKernels()->sum(multi->values, multi->count);
+		data->steps = 0;
+		data->synced = multi->count >= INCREMENTAL_MIN_INPUTS && isfinite(data->sum);
+	}
+	return data->sum;
+}
+
+static double incrementalVariance(IncrementalReducerData * data) {
+	Multiplexer * multi = data->multi;
+	double mean;
+	int i;
+
+	if (multi->count < 2)
+		return NAN;
+
+	if (canUpdateIncrementally(data)) {
+		for (i = 0; i < multi->change_count; i++) {
+			MultiplexerChange * change = multi->changes + i;
+			data->sum += (double) (float) change->value - (double) (float) change->previous;
+			if (change->entered) {
+				double diff = change->value - data->shift;
+				data->shiftedSum += diff;
+				data->shiftedSquares += diff * diff;
+			} else {
+				double diff = change->previous - data->shift;
+				data->shiftedSum -= diff;
+				data->shiftedSquares -= diff * diff;
+			}
+		}
+		mean = data->sum / multi->count;
+		double delta = mean - data->shift;
+		double error = data->shiftedSquares - 2 * delta * data->shiftedSum + multi->inplay_count * delta * delta;
+		return error < 0 ? 0 : error / multi->count;
+	}
+
+	const ReducerKernels * kernels = reducerKernels();
+	data->sum = kernels->floatSum(multi->values, multi->count);
+	data->steps = 0;
+	data->synced = false;
+	if (isnan(data->sum))
+		return NAN;
+
+	mean = data->sum / multi->count;
+	if (multi->count >= INCREMENTAL_MIN_INPUTS && isfinite(data->sum)) {
+		data->shift = mean;
+		data->shiftedSum = 0;
+		data->shiftedSquares = 0;
+		for (i = 0; i < multi->count; i++) {
+			if (multi->inplay[i]) {
+				double diff = multi->values[i] - mean;
+				data->shiftedSum += diff;
+				data->shiftedSquares += diff * diff;
+			}
+		}
+		data->synced = isfinite(data->shiftedSquares);
+	}
+	return kernels->squaredDeviations(multi->values, multi->inplay, multi->count, mean) / multi->count;
+}
+
+////////////////////////////////////////////////////////
+// Few inputs in play
+////////////////////////////////////////////////////////
+
+// When few of many inputs are in play, the extremes are computed over 
+// those, and over the default values which rank first amongst the others
+
+typedef struct extremeReducerData_st {
+	Multiplexer * multi;
+	// Indices of the inputs by decreasing (resp. increasing) default value, NaNs first
+	int * order;
+	// Default values, that of the first input being replaced by 0
+	double * defaults;
+} ExtremeReducerData;
+
+static bool inFewInputs(Multiplexer * multi) {
+	return multi->active && multi->count >= INCREMENTAL_MIN_INPUTS && multi->inplay_count <= multi->count / 8;
+}
+
+typedef struct rankedDefault_st {
+	double value;
+	int index;
+} RankedDefault;
+
+static int compareMaxDefaults(const void * A, const void * B) {
+	double a = ((const RankedDefault *) A)->value, b = ((const RankedDefault *) B)->value;
+	if (isnan(a) || isnan(b))
+		return isnan(b) - isnan(a);
+	return (a < b) - (a > b);
+}
+
+static int compareMinDefaults(const void * A, const void * B) {
+	double a = ((const RankedDefault *) A)->value, b = ((const RankedDefault *) B)->value;
+	if (isnan(a) || isnan(b))
+		return isnan(b) - isnan(a);
+	return (a > b) - (a < b);
+}
+
+static ExtremeReducerData * newExtremeReducerData(Multiplexer * multi, bool max) {
+	ExtremeReducerData * data = (ExtremeReducerData *) calloc(1, sizeof(ExtremeReducerData));
+	RankedDefault * ranked;
+	int i;
+
+	data->multi = multi;
+	if (multi->count < INCREMENTAL_MIN_INPUTS)
+		return data;
+	data->defaults = (double *) calloc(multi->count, sizeof(double));
+	data->order = (int *) calloc(multi->count, sizeof(int));
+	ranked = (RankedDefault *) calloc(multi->count, sizeof(RankedDefault));
+	for (i = 0; i < multi->count; i++) {
+		data->defaults[i] = i ? multi->default_values[i] : 0;
+		ranked[i].value = data->defaults[i];
+		ranked[i].index = i;
+	}
+	qsort(ranked, multi->count, sizeof(RankedDefault), max ? &compareMaxDefaults : &compareMinDefaults);
+	for (i = 0; i < multi->count; i++)
+		data->order[i] = ranked[i].index;
+	free(ranked);
+	return data;
+}
+
+// Returns false if the extreme is 0, whose sign is that of the first zero met,
+// which only a full scan finds
+static bool fewInputsExtreme(ExtremeReducerData * data, bool max, double * res) {
+	Multiplexer * multi = data->multi;
+	double extreme = max ? -INFINITY : INFINITY;
+	int i;
+
+	for (i = 0; i < multi->inplay_count; i++) {
+		double value = multi->values[multi->active[i]];
+		if (!multi->finite && isnan(value)) {
+			*res = NAN;
+			return true;
+		} else if (max ? value > extreme : value < extreme)
+			extreme = value;
+	}
+
+	// The first input out of play ranks first amongst the others
+	for (i = 0; i < multi->count && multi->inplay[data->order[i]]; i++);
+	if (i < multi->count) {
+		double value = data->defaults[data->order[i]];
+		if (!multi->finite && isnan(value)) {
+			*res = NAN;
+			return true;
+		} else if (max ? value > extreme : value < extreme)
+			extreme = value;
+	}
+
+	*res = extreme;
+	return extreme != 0;
+}
+
 ////////////////////////////////////////////////////////
 // Max
 ////////////////////////////////////////////////////////
 
 void MaxReductionPop(WiggleIterator * wi) {
 	int i;
+	double value;
 
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	ExtremeReducerData * data = (ExtremeReducerData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -128,37 +359,35 @@ void MaxReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
+	if (inFewInputs(multi) && fewInputsExtreme(data, true, &wi->value)) {
+		popMultiplexer(multi);
+		return;
+	}
+
 	if (multi->inplay[0])
 		wi->value = multi->values[0];
 	else
 		wi->value = 0;
 
-	if (isnan(wi->value)) {
+	if (!multi->finite && isnan(wi->value)) {
 		popMultiplexer(multi);
 		return;
 	}
 
-	for (i = 1; i < multi->count; i++) {
-		double value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			wi->value = NAN;
-			break;
-		}
-
-		if (wi->value < value)
-			wi->value = value;
-	}
+	value = reducerKernels()->max(multi->values + 1, multi->count - 1);
+	if (!multi->finite && isnan(value))
+		wi->value = NAN;
+	else if (value == 0 && wi->value < 0) {
+		// The sign of the zero is that of the first one met
+		for (i = 1; multi->values[i] != 0; i++);
+		wi->value = multi->values[i];
+	} else if (wi->value < value)
+		wi->value = value;
 	popMultiplexer(multi);
 }
 
 WiggleIterator * MaxReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
-	data->multi = multi;
+	ExtremeReducerData * data = newExtremeReducerData(multi, true);
 	int i;
 	double max = data->multi->default_values[0];
 	if (!isnan(max)) {
@@ -171,7 +400,10 @@ WiggleIterator * MaxReduction(Multiplexer * multi) {
 				max = data->multi->default_values[i];
 		}
 	}
-	return newWiggleIterator(data, &MaxReductionPop, &WiggleReducerSeek, max);
+	WiggleIterator * res = newWiggleReducer(data, multi, &MaxReductionPop, &WiggleReducerSeek, max);
+	res->finite = multi->finite;
+	res->integral = multi->integral;
+	return res;
 }
 
 ////////////////////////////////////////////////////////
@@ -180,11 +412,12 @@ WiggleIterator * MaxReduction(Multiplexer * multi) {
 
 void MinReductionPop(WiggleIterator * wi) {
 	int i;
+	double value;
 
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	ExtremeReducerData * data = (ExtremeReducerData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -195,37 +428,35 @@ void MinReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
+	if (inFewInputs(multi) && fewInputsExtreme(data, false, &wi->value)) {
+		popMultiplexer(multi);
+		return;
+	}
+
 	if (multi->inplay[0])
 		wi->value = multi->values[0];
 	else
 		wi->value = 0;
 
-	if (isnan(wi->value)) {
+	if (!multi->finite && isnan(wi->value)) {
 		popMultiplexer(multi);
 		return;
 	}
 
-	for (i = 1; i < multi->count; i++) {
-		double value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			wi->value = NAN;
-			break;
-		}
-
-		if (wi->value > value)
-			wi->value = value;
-	}
+	value = reducerKernels()->min(multi->values + 1, multi->count - 1);
+	if (!multi->finite && isnan(value))
+		wi->value = NAN;
+	else if (value == 0 && wi->value > 0) {
+		// The sign of the zero is that of the first one met
+		for (i = 1; multi->values[i] != 0; i++);
+		wi->value = multi->values[i];
+	} else if (wi->value > value)
+		wi->value = value;
 	popMultiplexer(multi);
 }
 
 WiggleIterator * MinReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
-	data->multi = multi;
+	ExtremeReducerData * data = newExtremeReducerData(multi, false);
 	int i;
 	double min = data->multi->default_values[0];
 	if (!isnan(min)) {
@@ -238,7 +469,10 @@ WiggleIterator * MinReduction(Multiplexer * multi) {
 				min = data->multi->default_values[i];
 		}
 	}
-	return newWiggleIterator(data, &MinReductionPop, &WiggleReducerSeek, min);
+	WiggleIterator * res = newWiggleReducer(data, multi, &MinReductionPop, &WiggleReducerSeek, min);
+	res->finite = multi->finite;
+	res->integral = multi->integral;
+	return res;
 }
 
 ////////////////////////////////////////////////////////
@@ -246,12 +480,10 @@ WiggleIterator * MinReduction(Multiplexer * multi) {
 ////////////////////////////////////////////////////////
 
 void SumReductionPop(WiggleIterator * wi) {
-	int i;
-
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	IncrementalReducerData * data = (IncrementalReducerData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -262,27 +494,13 @@ void SumReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
-	wi->value = 0;
-	for (i = 0; i < multi->count; i++) {
-		double value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			wi->value = NAN;
-			break;
-		}
-
-		wi->value += value;
-	}
+	wi->value = incrementalSum(data);
 	popMultiplexer(multi);
 }
 
 WiggleIterator * SumReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
-	data->multi = multi;
+	IncrementalReducerData * data = newIncrementalReducerData(multi);
+	data->exact = multi->integral;
 	int i;
 	double sum = 0;
 	for (i = 0; i < multi->count; i++) {
@@ -292,7 +510,10 @@ WiggleIterator * SumReduction(Multiplexer * multi) {
 		}
 		sum += data->multi->default_values[i];
 	}
-	return newWiggleIterator(data, &SumReductionPop, &WiggleReducerSeek, sum);
+	WiggleIterator * res = newWiggleReducer(data, multi, &SumReductionPop, &WiggleReducerSeek, sum);
+	res->finite = multi->finite;
+	res->integral = multi->integral;
+	return res;
 }
 
 ////////////////////////////////////////////////////////
@@ -300,8 +521,6 @@ WiggleIterator * SumReduction(Multiplexer * multi) {
 ////////////////////////////////////////////////////////
 
 void ProductReductionPop(WiggleIterator * wi) {
-	int i;
-
 	if (wi->done)
 		return;
 
@@ -316,21 +535,7 @@ void ProductReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
-	wi->value = 1;
-	for (i = 0; i < multi->count; i++) {
-		double value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			wi->value = NAN;
-			break;
-		}
-
-		wi->value *= value;
-	}
+	wi->value = reducerKernels()->product(multi->values, multi->count);
 	popMultiplexer(multi);
 }
 
@@ -346,7 +551,7 @@ WiggleIterator * ProductReduction(Multiplexer * multi) {
 		}
 		prod *= data->multi->default_values[i];
 	}
-	return newWiggleIterator(data, &ProductReductionPop, &WiggleReducerSeek, prod);
+	return newWiggleReducer(data, multi, &ProductReductionPop, &WiggleReducerSeek, prod);
 }
 
 ////////////////////////////////////////////////////////
@@ -354,12 +559,10 @@ WiggleIterator * ProductReduction(Multiplexer * multi) {
 ////////////////////////////////////////////////////////
 
 void MeanReductionPop(WiggleIterator * wi) {
-	int i;
-
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	IncrementalReducerData * data = (IncrementalReducerData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -370,29 +573,15 @@ void MeanReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
-	wi->value = 0;
-	for (i = 0; i < multi->count; i++) {
-		double value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			wi->value = NAN;
-			break;
-		}
-
-		wi->value += value;
-	}
-	if (!isnan(wi->value))
+	wi->value = incrementalSum(data);
+	if (multi->finite || !isnan(wi->value))
 		wi->value /= multi->count;
 	popMultiplexer(multi);
 }
 
 WiggleIterator * MeanReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
-	data->multi = multi;
+	IncrementalReducerData * data = newIncrementalReducerData(multi);
+	data->exact = multi->integral;
 	int i;
 	double sum = 0;
 	for (i = 0; i < multi->count; i++) {
@@ -407,7 +596,9 @@ WiggleIterator * MeanReduction(Multiplexer * multi) {
 		default_value = NAN;
 	else
 		default_value = sum/multi->count;
-	return newWiggleIterator(data, &MeanReductionPop, &WiggleReducerSeek, default_value);
+	WiggleIterator * res = newWiggleReducer(data, multi, &MeanReductionPop, &WiggleReducerSeek, default_value);
+	res->finite = multi->finite;
+	return res;
 }
 
 ////////////////////////////////////////////////////////
@@ -415,12 +606,10 @@ WiggleIterator * MeanReduction(Multiplexer * multi) {
 ////////////////////////////////////////////////////////
 
 void VarianceReductionPop(WiggleIterator * wi) {
-	int i;
-
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	IncrementalReducerData * data = (IncrementalReducerData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -431,45 +620,12 @@ void VarianceReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
-
-	double mean = 0;
-	double count = 0;
-	for (i = 0; i < multi->count; i++) {
-		float value;
-
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else 	
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			mean = NAN;
-			break;
-		}
-		mean += value;
-		count++;
-	}
-
-	if (count < 2 || isnan(mean)) {
-		wi->value = NAN;
-	} else {
-		mean /= count;
-		
-		wi->value = 0;
-		for (i = 0; i < multi->count; i++) {
-			if (multi->inplay[i]) {
-				double diff = mean - multi->values[i];
-				wi->value += diff * diff;
-			}
-		}
-		wi->value /= count;
-	}
+	wi->value = incrementalVariance(data);
 	popMultiplexer(multi);
 }
 
 WiggleIterator * VarianceReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
-	data->multi = multi;
+	IncrementalReducerData * data = newIncrementalReducerData(multi);
 	int i;
 	double sum = 0;
 	for (i = 0; i < multi->count; i++) {
@@ -490,7 +646,7 @@ WiggleIterator * VarianceReduction(Multiplexer * multi) {
 		default_value = error/multi->count;
 	}
 
-	return newWiggleIterator(data, &VarianceReductionPop, &WiggleReducerSeek, default_value);
+	return newWiggleReducer(data, multi, &VarianceReductionPop, &WiggleReducerSeek, default_value);
 }
 
 ////////////////////////////////////////////////////////
@@ -498,8 +654,7 @@ WiggleIterator * VarianceReduction(Multiplexer * multi) {
 ////////////////////////////////////////////////////////
 
 void StdDevReductionPop(WiggleIterator * wi) {
-	int i;
-	double mean, diff;
+	double mean;
 
 	if (wi->done)
 		return;
@@ -515,36 +670,14 @@ void StdDevReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
-	mean = 0;
-	for (i = 0; i < multi->count; i++) {
-		float value;
-		if (multi->inplay[i])
-			value = multi->values[i];
-		else
-			value = multi->default_values[i];
-
-		if (isnan(value)) {
-			mean = NAN;
-			break;
-		}
-
-		mean += value;
-	}
+	const ReducerKernels * kernels = reducerKernels();
+	mean = kernels->floatSum(multi->values, multi->count);
 
 	if (isnan(mean))
 		wi->value = NAN;
 	else {
 		mean /= multi->count;
-		
-		wi->value = 0;
-		for (i = 0; i < multi->count; i++) {
-			if (multi->inplay[i])
-				diff = mean - multi->values[i];
-			else
-				diff = mean - multi->default_values[i];
-			wi->value += diff * diff;
-		}
-		wi->value /= multi->count;
+		wi->value = kernels->squaredDeviations(multi->values, NULL, multi->count, mean) / multi->count;
 		wi->value = sqrt(wi->value);
 	}
 	
@@ -575,21 +708,53 @@ WiggleIterator * StdDevReduction(Multiplexer * multi) {
 		default_value = sqrt(error/multi->count);
 	}
 
-	return newWiggleIterator(data, &StdDevReductionPop, &WiggleReducerSeek, default_value);
+	return newWiggleReducer(data, multi, &StdDevReductionPop, &WiggleReducerSeek, default_value);
 }
 
 ////////////////////////////////////////////////////////
 // Shannon entropy
 ////////////////////////////////////////////////////////
 
+// The entropy only depends on the number of non-zero inputs, so it is
+// tabulated for each possible number
+typedef struct entropyData_st {
+	Multiplexer * multi;
+	double * entropies;
+	// Over the default values, to be corrected for the inputs in play
+	int positive_defaults, nan_defaults;
+} EntropyData;
+
+static void fewInputsEntropy(WiggleIterator * wi, EntropyData * data) {
+	Multiplexer * multi = data->multi;
+	int count = data->positive_defaults;
+	int nans = data->nan_defaults;
+	int i;
+
+	for (i = 0; i < multi->inplay_count; i++) {
+		int index = multi->active[i];
+		double value = multi->default_values[index];
+		if (!multi->finite && isnan(value))
+			nans--;
+		else if (value > 0)
+			count--;
+		value = multi->values[index];
+		if (!multi->finite && isnan(value))
+			nans++;
+		else if (value > 0)
+			count++;
+	}
+
+	wi->value = nans ? NAN : data->entropies[count];
+}
+
 void EntropyReductionPop(WiggleIterator * wi) {
 	int i;
-	float count = 0;
+	int count = 0;
 
 	if (wi->done)
 		return;
 
-	WiggleReducerData * data = (WiggleReducerData *) wi->data;
+	EntropyData * data = (EntropyData *) wi->data;
 	Multiplexer * multi = data->multi;
 
 	if (multi->done) {
@@ -601,6 +766,12 @@ void EntropyReductionPop(WiggleIterator * wi) {
 	wi->start = multi->start;
 	wi->finish = multi->finish;
 
+	if (inFewInputs(multi)) {
+		fewInputsEntropy(wi, data);
+		popMultiplexer(multi);
+		return;
+	}
+
 	for (i = 0; i < multi->count; i++) {
 		double value;
 		if (multi->inplay[i]) 
@@ -608,7 +779,7 @@ void EntropyReductionPop(WiggleIterator * wi) {
 		else 
 			value = multi->default_values[i];
 
-		if (isnan(value)) {
+		if (!multi->finite && isnan(value)) {
 			wi->value = NAN;
 			popMultiplexer(multi);
 			return;
@@ -616,21 +787,28 @@ void EntropyReductionPop(WiggleIterator * wi) {
 			count++;
 	}
 
-	if (count == 0 || count == multi->count)
-		wi->value = 0;
-	else {
-		double p = count / multi->count;
-		wi->value = - p * log(p) - (1-p) * log(1 - p);
-	}
-	
+	wi->value = data->entropies[count];
 	popMultiplexer(multi);
 }
 
 WiggleIterator * EntropyReduction(Multiplexer * multi) {
-	WiggleReducerData * data = (WiggleReducerData *) calloc(1, sizeof(WiggleReducerData));
+	EntropyData * data = (EntropyData *) calloc(1, sizeof(EntropyData));
 	data->multi = multi;
+	data->entropies = (double *) calloc(multi->count + 1, sizeof(double));
 
 	int i;
+	for (i = 1; i < multi->count; i++) {
+		double p = (float) i / multi->count;
+		data->entropies[i] = - p * log(p) - (1-p) * log(1 - p);
+	}
+
+	for (i = 0; i < multi->count; i++) {
+		if (isnan(multi->default_values[i]))
+			data->nan_defaults++;
+		else if (multi->default_values[i] > 0)
+			data->positive_defaults++;
+	}
+
 	int count = 0;
 	for (i = 0; i < multi->count; i++) {
 		if (isnan(multi->default_values[i])) {
@@ -643,15 +821,12 @@ WiggleIterator * EntropyReduction(Multiplexer * multi) {
 	double default_value;
 	if (count == -1)
 		default_value = NAN;
-	else {
-		double p = count / multi->count;
-		if (p)
-			default_value = - p * log(p) - (1-p) * log(1 - p);
-		else
-			default_value = 0;
-	}
+	else
+		default_value = data->entropies[count];
 
-	return newWiggleIterator(data, &StdDevReductionPop, &WiggleReducerSeek, default_value);
+	WiggleIterator * res = newWiggleReducer(data, multi, &EntropyReductionPop, &WiggleReducerSeek, default_value);
+	res->finite = multi->finite;
+	return res;
 }
 
 ////////////////////////////////////////////////////////
@@ -735,7 +910,7 @@ WiggleIterator * CVReduction(Multiplexer * multi) {
 		default_value = sqrt(error/multi->count)/mean;
 	} else
 		default_value = NAN;
-	return newWiggleIterator(data, &CVReductionPop, &WiggleReducerSeek, default_value);
+	return newWiggleReducer(data, multi, &CVReductionPop, &WiggleReducerSeek, default_value);
 }
 
 
@@ -743,9 +918,21 @@ WiggleIterator * CVReduction(Multiplexer * multi) {
 // Median
 ////////////////////////////////////////////////////////
 
+// Beyond this many changed inputs per step, selecting afresh
+// is cheaper than updating the sorted array one value at a time
+#define MEDIAN_INCREMENTAL_MAX 8
+#define MEDIAN_INSERTION_SORT_MAX 16
+
 typedef struct medianMiggleReducerData_st {
 	Multiplexer * multi;
 	double * vals;
+	// Input values at the previous step
+	double * current;
+	int nan_count;
+	// Non-NaN entries of current, in increasing order, when sorted_valid
+	double * sorted;
+	int sorted_count;
+	bool sorted_valid;
 } MedianWiggleReducerData;
 
 void MedianWiggleReducerSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
@@ -765,8 +952,121 @@ static int compDoubles(const void * A, const void * B) {
 		return 0;
 }
 
+static void insertionSortDoubles(double * vals, int count) {
+	int i, j;
+	for (i = 1; i < count; i++) {
+		double val = vals[i];
+		for (j = i; j > 0 && vals[j-1] > val; j--)
+			vals[j] = vals[j-1];
+		vals[j] = val;
+	}
+}
+
+static inline void swapDoubles(double * vals, int a, int b) {
+	double tmp = vals[a];
+	vals[a] = vals[b];
+	vals[b] = tmp;
+}
+
+// Returns the k-th smallest of NaN-free vals, which get reordered.
+// Quickselect with median of three pivots, falling back onto a sort
+// if the partitions degenerate.
+static double selectDouble(double * vals, int count, int k) {
+	int lo = 0;
+	int hi = count - 1;
+	int depth = 0;
+	int n;
+
+	for (n = count; n > 1; n >>= 1)
+		depth += 2;
+
+	while (hi - lo > MEDIAN_INSERTION_SORT_MAX) {
+		if (depth-- == 0) {
+			qsort(vals + lo, hi - lo + 1, sizeof(double), &compDoubles);
+			return vals[k];
+		}
+
+		int mid = lo + (hi - lo) / 2;
+		if (vals[mid] < vals[lo])
+			swapDoubles(vals, mid, lo);
+		if (vals[hi] < vals[lo])
+			swapDoubles(vals, hi, lo);
+		if (vals[hi] < vals[mid])
+			swapDoubles(vals, hi, mid);
+		double pivot = vals[mid];
+
+		int i = lo;
+		int j = hi;
+		while (i <= j) {
+			while (vals[i] < pivot)
+				i++;
+			while (vals[j] > pivot)
+				j--;
+			if (i <= j) {
+				swapDoubles(vals, i, j);
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			return vals[k];
+	}
+
+	insertionSortDoubles(vals + lo, hi - lo + 1);
+	return vals[k];
+}
+
+// Index of the first entry of sorted not smaller than val
+static int lowerBound(double * sorted, int count, double val) {
+	int lo = 0;
+	int hi = count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (sorted[mid] < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void rebuildSortedValues(MedianWiggleReducerData * data) {
+	int i;
+	data->sorted_count = 0;
+	for (i = 0; i < data->multi->count; i++)
+		if (data->multi->finite || !isnan(data->current[i]))
+			data->sorted[data->sorted_count++] = data->current[i];
+	qsort(data->sorted, data->sorted_count, sizeof(double), &compDoubles);
+	data->sorted_valid = true;
+}
+
+static void replaceSortedValue(MedianWiggleReducerData * data, double old, double val) {
+	int pos;
+	if (data->multi->finite || !isnan(old)) {
+		pos = lowerBound(data->sorted, data->sorted_count, old);
+		memmove(data->sorted + pos, data->sorted + pos + 1, (data->sorted_count - pos - 1) * sizeof(double));
+		data->sorted_count--;
+	}
+	if (data->multi->finite || !isnan(val)) {
+		pos = lowerBound(data->sorted, data->sorted_count, val);
+		memmove(data->sorted + pos + 1, data->sorted + pos, (data->sorted_count - pos) * sizeof(double));
+		data->sorted[pos] = val;
+		data->sorted_count++;
+	}
+}
+
+static inline bool sameDouble(Multiplexer * multi, double a, double b) {
+	return a == b || (!multi->finite && isnan(a) && isnan(b));
+}
+
 void MedianReductionPop(WiggleIterator * wi) {
 	int i;
+	int changes = 0;
 
 	if (wi->done)
 		return;
@@ -782,20 +1082,67 @@ void MedianReductionPop(WiggleIterator * wi) {
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
+
+	// Only the inputs which entered or left play can have changed
+	if (multi->active && multi->change_count >= 0 && multi->change_count <= 2 * MEDIAN_INCREMENTAL_MAX) {
+		if (!data->sorted_valid)
+			rebuildSortedValues(data);
+		for (i = 0; i < multi->change_count; i++) {
+			int index = multi->changes[i].index;
+			double value = multi->changes[i].value;
+			if (sameDouble(multi, value, data->current[index]))
+				continue;
+			if (!multi->finite)
+				data->nan_count += (isnan(value) != 0) - (isnan(data->current[index]) != 0);
+			replaceSortedValue(data, data->current[index], value);
+			data->current[index] = value;
+		}
+		if (data->nan_count)
+			wi->value = NAN;
+		else
+			wi->value = data->sorted[multi->count / 2];
+		popMultiplexer(multi);
+		return;
+	}
+
 	for (i = 0; i < multi->count; i++) {
 		if (multi->inplay[i])
 			data->vals[i] = multi->values[i];
 		else
 			data->vals[i] = multi->default_values[i];
+		if (!sameDouble(multi, data->vals[i], data->current[i]))
+			changes++;
+	}
 
-		if (isnan(data->vals[i])) {
+	if (changes <= MEDIAN_INCREMENTAL_MAX) {
+		if (!data->sorted_valid)
+			rebuildSortedValues(data);
+		for (i = 0; i < multi->count && changes; i++) {
+			if (sameDouble(multi, data->vals[i], data->current[i]))
+				continue;
+			if (!multi->finite)
+				data->nan_count += (isnan(data->vals[i]) != 0) - (isnan(data->current[i]) != 0);
+			replaceSortedValue(data, data->current[i], data->vals[i]);
+			data->current[i] = data->vals[i];
+			changes--;
+		}
+		if (data->nan_count)
 			wi->value = NAN;
-			popMultiplexer(multi);
-			return;
+		else
+			wi->value = data->sorted[multi->count / 2];
+	} else {
+		data->sorted_valid = false;
+		data->nan_count = 0;
+		for (i = 0; i < multi->count; i++) {
+			data->current[i] = data->vals[i];
+			if (!multi->finite && isnan(data->vals[i]))
+				data->nan_count++;
 		}
+		if (data->nan_count)
+			wi->value = NAN;
+		else
+			wi->value = selectDouble(data->vals, multi->count, multi->count / 2);
 	}
-	qsort(data->vals, multi->count, sizeof(double), &compDoubles);
-	wi->value = data->vals[multi->count / 2];
 	
 	popMultiplexer(multi);
 }
@@ -804,19 +1151,23 @@ WiggleIterator * MedianReduction(Multiplexer * multi) {
 	MedianWiggleReducerData * data = (MedianWiggleReducerData *) calloc(1, sizeof(MedianWiggleReducerData));
 	data->multi = multi;
 	data->vals = (double *) calloc(data->multi->count, sizeof(double));
+	data->current = (double *) calloc(data->multi->count, sizeof(double));
+	data->sorted = (double *) calloc(data->multi->count, sizeof(double));
 	int i;
 	float default_value = 0;
 	for (i = 0; i < multi->count; i++) {
 		data->vals[i] = multi->default_values[i];
-		if (isnan(data->vals[i])) {
-			default_value = NAN;
-			break;
-		}
+		data->current[i] = multi->default_values[i];
+		if (isnan(data->vals[i]))
+			data->nan_count++;
 	}
 
-	if (!isnan(default_value)) {
-		qsort(data->vals, multi->count, sizeof(double), &compDoubles);
-		default_value = data->vals[multi->count/2];
-	}
-	return newWiggleIterator(data, &MedianReductionPop, &MedianWiggleReducerSeek, default_value);
+	if (data->nan_count)
+		default_value = NAN;
+	else
+		default_value = selectDouble(data->vals, multi->count, multi->count/2);
+	WiggleIterator * res = newWiggleReducer(data, multi, &MedianReductionPop, &MedianWiggleReducerSeek, default_value);
+	res->finite = multi->finite;
+	res->integral = multi->integral;
+	return res;
 }
@@ -0,0 +1,125 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wiggleIterator.h"
+
+//////////////////////////////////////////////////////
+// Reverse iterators
+//
+// Iterators with a seekReverse function, i.e. BigWig
+// and BigBed readers and the buffered regions of apply,
+// stream the records of a region backwards. The other
+// sources are read forward over the region into memory,
+// then replayed from the last record. Either way, only
+// the region seeked is read, never the whole chromosome.
+//////////////////////////////////////////////////////
+
+typedef struct reverseData_st {
+	WiggleIterator * source;
+	// Whether the source streams the region backwards itself
+	bool streaming;
+	// Otherwise, records of the region in forward order, replayed from the last
+	char * chrom;
+	int * starts, * finishes, * strands;
+	double * values;
+	int count, capacity;
+	int index;
+} ReverseData;
+
+static void holdRecord(ReverseData * data, int start, int finish, double value, int strand) {
+	if (data->count == data->capacity) {
+		data->capacity = data->capacity ? 2 * data->capacity : 1024;
+		data->starts = (int *) realloc(data->starts, data->capacity * sizeof(int));
+		data->finishes = (int *) realloc(data->finishes, data->capacity * sizeof(int));
+		data->strands = (int *) realloc(data->strands, data->capacity * sizeof(int));
+		data->values = (double *) realloc(data->values, data->capacity * sizeof(double));
+	}
+	data->starts[data->count] = start;
+	data->finishes[data->count] = finish;
+	data->values[data->count] = value;
+	data->strands[data->count] = strand;
+	data->count++;
+}
+
+// The records are clipped to the region, as a seek may leave them whole
+static void readRegion(ReverseData * data, const char * chrom, int start, int finish) {
+	WiggleIterator * source = data->source;
+
+	data->chrom = (char *) chrom;
+	data->count = 0;
+	for (seek(source, chrom, start, finish); !source->done && source->chrom == chrom && source->start < finish; pop(source))
+		if (source->finish > start)
+			holdRecord(data, source->start > start ? source->start : start, source->finish < finish ? source->finish : finish, source->value, source->strand);
+	data->index = data->count - 1;
+}
+
+static void ReverseWiggleIteratorPop(WiggleIterator * wi) {
+	ReverseData * data = (ReverseData *) wi->data;
+	WiggleIterator * source = data->source;
+
+	if (wi->done)
+		return;
+	else if (data->streaming) {
+		if (source->done) {
+			wi->done = true;
+			return;
+		}
+		wi->chrom = source->chrom;
+		wi->start = source->start;
+		wi->finish = source->finish;
+		wi->value = source->value;
+		wi->strand = source->strand;
+		pop(source);
+	} else if (data->index < 0)
+		wi->done = true;
+	else {
+		wi->chrom = data->chrom;
+		wi->start = data->starts[data->index];
+		wi->finish = data->finishes[data->index];
+		wi->value = data->values[data->index];
+		wi->strand = data->strands[data->index];
+		data->index--;
+	}
+}
+
+static void ReverseWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	ReverseData * data = (ReverseData *) wi->data;
+	WiggleIterator * source = data->source;
+
+	data->streaming = source->seekReverse != NULL;
+	if (data->streaming) {
+		source->done = false;
+		source->seekReverse(source, chrom, start, finish);
+	} else
+		readRegion(data, chrom, start, finish);
+	wi->done = false;
+	pop(wi);
+}
+
+WiggleIterator * ReverseWiggleIterator(WiggleIterator * source) {
+	ReverseData * data = (ReverseData *) calloc(1, sizeof(ReverseData));
+	WiggleIterator * res;
+
+	data->source = source;
+	// Nothing to replay until seeked
+	data->index = -1;
+	res = newWiggleIterator(data, &ReverseWiggleIteratorPop, &ReverseWiggleIteratorSeek, source->default_value);
+	res->overlaps = source->overlaps;
+	res->finite = source->finite;
+	res->integral = source->integral;
+	return res;
+}
@@ -16,110 +16,168 @@
 #include <string.h> 
 
 #include "wiggleIterator.h"
-#include "fib.h"
+#include "lineReader.h"
+
+// The changes of depth caused by the reads loaded so far are counted in a 
+// circular window of positions, starting at the cursor. Reads arrive by order
+// of start, so once the next read starts past the cursor, the depth at the 
+// cursor is final. The window grows to the longest span of a read.
+#define MIN_WINDOW 1024
 
 typedef struct samReaderData_st {
 	char  *filename;
-	FILE * file;
-	char * chrom;
+	LineReader * reader;
+	// Region of the last seek, stop is -1 otherwise
+	const char * chrom;
 	int stop;
 
-	FibHeap * starts, * ends;
+	// Next read, not yet in the window
+	bool hasNext;
+	char * nextChrom;
+	int nextPos;
+	char * cigar, * cigarEnd;
 	char chromBuf[1000];
-	char cigar[1000];
-	int pos;
-	bool done;
+	int chromLength;
+
+	// Chromosome of the window
+	char * label;
+	int * window;
+	int mask;
+	int cursor;
+	// Last position with a change of depth in the window
+	int lastChange;
+	int depth;
 } SamReaderData;
 
-static int isSeparator(char c) {
-	char * separators = "MIDNSHPX=";
-	int i;
-
-	for (i = 0; i < 9; i++)
-		if (c == separators[i])
-			return 1;
-	return 0;
+// Returns the length of the next token and moves *ptr past it
+static int nextToken(char ** ptr, char * end, char ** token) {
+	int length = tokenLength(ptr, end);
+	*token = *ptr;
+	*ptr += length;
+	return length;
 }
 
-static char * readNextCigarBlock(char * cigar, char * block) {
-	int i;
-	int lgth = strlen(cigar);
-	for (i = 0; i < lgth && (i == 0 || !isSeparator(cigar[i-1])); i++) 
-		block[i] = cigar[i];
-	block[i] = '\0';
-
-	if (i)
-		return cigar + i;
-	else
-		return NULL;
-}
+static void readNextRead(SamReaderData * data) {
+	char * line, * end, * ptr, * chrom;
+	int length, pos;
+
+	while ((line = readNextLine(data->reader, &end))) {
+		if (line == end || line[0] == '#' || line[0] == '@')
+			continue;
+
+		// Skip name and flag
+		ptr = line;
+		nextToken(&ptr, end, &chrom);
+		nextToken(&ptr, end, &chrom);
+		length = nextToken(&ptr, end, &chrom);
+		if (!length || length >= sizeof(data->chromBuf) || !parseInteger(&ptr, end, &pos)) {
+			fprintf(stderr, "Malformed line in SAM file %s:\n%.*s\n", data->filename, (int) (end - line), line);
+			raiseError();
+		}
+		// Skip mapping quality
+		nextToken(&ptr, end, &data->cigar);
+		nextToken(&ptr, end, &data->cigar);
+		data->cigarEnd = ptr;
+
+		if (length != data->chromLength || memcmp(chrom, data->chromBuf, length)) {
+			memcpy(data->chromBuf, chrom, length);
+			data->chromBuf[length] = '\0';
+			data->chromLength = length;
+			if (data->hasNext && compareChroms(data->chromBuf, data->nextChrom) < 0) {
+				fprintf(stderr, "Sam file %s is not sorted!\nPosition %s:%i is before %s:%i\nSort it, or set --sort_memory\n", data->filename, data->chromBuf, pos, data->nextChrom, data->nextPos);
+				raiseError();
+			}
+			data->nextChrom = internChromosome(data->chromBuf);
+		} else if (pos < data->nextPos) {
+			fprintf(stderr, "Sam file %s is not sorted!\nPosition %s:%i is before %s:%i\nSort it, or set --sort_memory\n", data->filename, data->chromBuf, pos, data->nextChrom, data->nextPos);
+			raiseError();
+		}
 
-static int storeReadComponent(FibHeap * starts, FibHeap * ends, int start, char * block) {
-	int last = strlen(block) - 1;
-	char type = block[last];
-	block[last] = '\0';
-	int count = atoi(block);
-	
-	switch (type) {
-		case 'M':
-		case 'X':
-		case '=':
-		case 'D':
-			fh_insert(starts, start, 0);
-			fh_insert(ends, start + count, 0);
-		case 'N':
-			return start + count;
-		default:
-			return start;
+		data->nextPos = pos;
+		data->hasNext = true;
+		return;
 	}
+
+	data->hasNext = false;
 }
 
-static void readLine(WiggleIterator * wi) {
-	SamReaderData * data = (SamReaderData *) wi->data;
-	char line[5000];
-	char chrom[1000];
+static void growWindow(SamReaderData * data, int span) {
+	int size = data->mask + 1;
+	int * window;
 	int pos;
 
-	while (fgets(line, 5000, data->file)) {
-		if (line[0] != '#' && line[0] != EOF) {
-			sscanf(line, "%*s\t%*i\t%s\t%i\t%*i\t%s", chrom, &pos, data->cigar);
+	while (size <= span)
+		size *= 2;
+	window = (int *) calloc(size, sizeof(int));
+	if (!window) {
+		fprintf(stderr, "Could not allocate coverage window of %i bases\n", size);
+		raiseError();
+	}
+	for (pos = data->cursor; pos <= data->lastChange; pos++)
+		window[pos & (size - 1)] = data->window[pos & data->mask];
+	free(data->window);
+	data->window = window;
+	data->mask = size - 1;
+}
 
-			if (strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && pos < data->pos)) {
-				fprintf(stderr, "Sam file %s is not sorted!\nPosition %s:%i is before %s:%i\n", data->filename, chrom, pos, wi->chrom, data->pos);
-				exit(1);
-			}
+static void addSpan(SamReaderData * data, int start, int finish) {
+	if (finish - data->cursor > data->mask)
+		growWindow(data, finish - data->cursor);
+	data->window[start & data->mask]++;
+	data->window[finish & data->mask]--;
+	if (finish > data->lastChange)
+		data->lastChange = finish;
+}
 
-			strcpy(data->chromBuf, chrom);
-			data->pos = pos;
-			return;
+// Single pass over the CIGAR string, e.g. 10M2I5M100N20M
+static void addNextRead(SamReaderData * data) {
+	char * ptr = data->cigar;
+	int pos = data->nextPos;
+	int count;
+
+	while (ptr < data->cigarEnd) {
+		for (count = 0; ptr < data->cigarEnd && *ptr >= '0' && *ptr <= '9'; ptr++)
+			count = 10 * count + (*ptr - '0');
+		if (ptr == data->cigarEnd)
+			break;
+
+		switch (*(ptr++)) {
+			case 'M':
+			case 'X':
+			case '=':
+			case 'D':
+				addSpan(data, pos, pos + count);
+			case 'N':
+				pos += count;
+			default:
+				break;
 		}
 	}
-
-	data->done = true;
 }
 
-static void storeReadComponents(FibHeap * starts, FibHeap * ends, int start, char * cigar) {
-	char block[100];
-	char * ptr;
+static void loadNextReads(SamReaderData * data) {
+	while (data->hasNext && data->nextChrom == data->label && data->nextPos <= data->cursor) {
+		addNextRead(data);
+		readNextRead(data);
+	}
+}
 
-	for (ptr = readNextCigarBlock(cigar, block); ptr; ptr = readNextCigarBlock(ptr, block)) 
-		start = storeReadComponent(starts, ends, start, block);
+static int takeChange(SamReaderData * data) {
+	int * change = data->window + (data->cursor++ & data->mask);
+	int value = *change;
+	*change = 0;
+	return value;
 }
 
-static void loadNextReads(WiggleIterator * wi) {
+// Trims the current span to the region of the last seek
+static void clipToRegion(WiggleIterator * wi) {
 	SamReaderData * data = (SamReaderData *) wi->data;
 
-	if (data->chromBuf[0] == '\0')
-		readLine(wi);
-
-	if (fh_empty(data->ends) && strcmp(wi->chrom, data->chromBuf)) {
-		wi->chrom = (char *) calloc(strlen(data->chromBuf) + 1, sizeof(char));
-		strcpy(wi->chrom, data->chromBuf);
-	}
-
-	while (!data->done && !strcmp(wi->chrom, data->chromBuf) && (fh_empty(data->ends) || fh_empty(data->starts) || data->pos <= fh_min(data->ends) || data->pos <= fh_min(data->starts))) {
-		storeReadComponents(data->starts, data->ends, data->pos, data->cigar);
-		readLine(wi);
+	if (data->stop > 0) {
+		if ((wi->start >= data->stop && compareChroms(wi->chrom, data->chrom) == 0) || compareChroms(wi->chrom, data->chrom) > 0)
+			wi->done = true;
+		else if (wi->finish > data->stop)
+			wi->finish = data->stop;
 	}
 }
 
@@ -129,88 +187,82 @@ void SamReaderPop(WiggleIterator * wi) {
 	if (wi->done)
 		return;
 
-	if (wi->chrom[0] == '\0')
-		wi->value = 0;
-
-	while (fh_notempty(data->ends) && fh_min(data->ends) == wi->finish) {
-		wi->value--;
-		fh_extractmin(data->ends);
+	// First position of positive depth
+	while (true) {
+		loadNextReads(data);
+		if (data->depth == 0 && data->cursor > data->lastChange) {
+			// Nothing left in the window, jump to the next read
+			if (!data->hasNext) {
+				wi->done = true;
+				return;
+			}
+			data->label = data->nextChrom;
+			data->cursor = data->nextPos;
+			continue;
+		}
+		data->depth += takeChange(data);
+		if (data->depth > 0)
+			break;
 	}
 
-	if (wi->value < 0) {
-		fprintf(stderr, "Negative coverage at %s:%i???\n", wi->chrom, wi->finish);
-		exit(1);
+	if (data->depth < 0) {
+		fprintf(stderr, "Negative coverage at %s:%i???\n", data->label, data->cursor - 1);
+		raiseError();
 	}
 
-	loadNextReads(wi);
+	wi->chrom = data->label;
+	wi->start = data->cursor - 1;
+	wi->value = data->depth;
 
-	if (fh_notempty(data->ends)) {
-		if (wi->value)
-			wi->start = wi->finish;
-		else 
-			wi->start = fh_min(data->starts);
-
-		while (fh_notempty(data->starts) && fh_min(data->starts) == wi->start) {
-			wi->value++;
-			fh_extractmin(data->starts);
-		}
-
-		if (fh_notempty(data->starts)) 
-			wi->finish = fh_min(data->starts);
-		if (fh_notempty(data->ends) && (fh_empty(data->starts) || fh_min(data->ends) < wi->finish)) 
-			wi->finish = fh_min(data->ends);
+	// Up to the next change of depth, which exists as the reads end
+	while (true) {
+		loadNextReads(data);
+		if (data->window[data->cursor & data->mask])
+			break;
+		data->cursor++;
+	}
+	wi->finish = data->cursor;
 
-		if (data->stop > 0) {
-			if ((wi->start >= data->stop && strcmp(wi->chrom, data->chrom) == 0) || strcmp(wi->chrom, data->chrom) > 0)
-				wi->done = true;
-			else if (wi->finish > data->stop)
-				wi->finish = data->stop;
-		}
+	clipToRegion(wi);
+}
 
-		if (wi->start < 0)
-			abort();
-		if (wi->start == 0)
-			abort();
-	}
-	else {
-		fclose(data->file);
-		data->file = NULL;
-		wi->done = true;
-	}
+static void resetSamReader(SamReaderData * data) {
+	memset(data->window, 0, (data->mask + 1) * sizeof(int));
+	data->label = NULL;
+	data->cursor = 0;
+	data->lastChange = -1;
+	data->depth = 0;
+	data->hasNext = false;
+	data->chromLength = 0;
+	data->nextChrom = NULL;
+	data->nextPos = 0;
 }
 
 void SamReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	SamReaderData * data = (SamReaderData*) wi->data;
 
-	if (data->file == stdin) {
-		fprintf(stderr, "Cannot do a seek on stdin stream!\n");
-		exit(1);
-	}
-
 	data->stop = finish;
 	data->chrom = chrom;
 
-	if (!data->file || strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && start < wi->start)) {
-		if (data->file)
-			fclose(data->file);
-		if (!(data->file = fopen(data->filename, "r"))) {
-			fprintf(stderr, "Could not open input file %s\n", data->filename);
-			exit(1);
+	if (compareChroms(chrom, wi->chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && start < wi->start)) {
+		if (!rewindLineReader(data->reader)) {
+			fprintf(stderr, "Cannot do a seek on stdin stream!\n");
+			raiseError();
 		}
+		resetSamReader(data);
+		readNextRead(data);
 		wi->done = false;
 		pop(wi);
+	} else if (!wi->done || data->hasNext || data->cursor <= data->lastChange) {
+		// The current span and window remain valid when seeking forward
+		wi->done = false;
+		clipToRegion(wi);
 	}
 
-	fh_deleteheap(data->starts);
-	fh_deleteheap(data->ends);
-	data->starts = fh_makeheap();
-	data->ends = fh_makeheap();
-	data->done = true;
-	wi->value = 0;
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && wi->finish < start))) 
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish <= start))) 
 		pop(wi);
 
-	if (!wi->done && strcmp(chrom, wi->chrom) == 0 && wi->start < start)
+	if (!wi->done && compareChroms(chrom, wi->chrom) == 0 && wi->start < start)
 		wi->start = start;
 }
 
@@ -218,14 +270,17 @@ WiggleIterator * SamReader(char * filename) {
 	SamReaderData * data = (SamReaderData *) calloc(1, sizeof(SamReaderData));
 	data->filename = filename;
 	data->stop = -1;
-	data->starts = fh_makeheap();
-	data->ends = fh_makeheap();
-	if (strcmp(filename, "-")) {
-		if (!(data->file = fopen(filename, "r"))) {
-			fprintf(stderr, "Could not open input file %s\n", filename);
-			exit(1);
-		}
-	} else
-		data->file = stdin;
-	return newWiggleIterator(data, &SamReaderPop, &SamReaderSeek, 0);
+	if (!(data->reader = sortingLines() ? newSortingLineReader(filename, 2, 3) : newLineReader(filename))) {
+		fprintf(stderr, "Could not open input file %s\n", filename);
+		raiseError();
+	}
+	data->window = (int *) calloc(MIN_WINDOW, sizeof(int));
+	data->mask = MIN_WINDOW - 1;
+	resetSamReader(data);
+	readNextRead(data);
+	WiggleIterator * res = newWiggleIterator(data, &SamReaderPop, &SamReaderSeek, 0);
+	res->finite = true;
+	res->integral = true;
+	// Abutting reads can yield consecutive spans of equal depth
+	return CompressionWiggleIterator(res);
 }
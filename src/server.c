@@ -0,0 +1,761 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "matrixStore.h"
+
+//////////////////////////////////////////////////////
+// Warm readers
+//////////////////////////////////////////////////////
+
+typedef struct warmReader_st {
+	char * filename;
+	WiggleIterator * iter;
+	// Of local files, to notice those rewritten since
+	time_t modified;
+	off_t size;
+	bool taken;
+} WarmReader;
+
+static WarmReader * warmReaders = NULL;
+static int warmReaderCount = 0;
+static int maxWarmReaders = 0;
+static pthread_mutex_t warmMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool isStale(WarmReader * reader) {
+	struct stat info;
+	// Remote files cannot be checked
+	if (stat(reader->filename, &info))
+		return false;
+	return info.st_mtime != reader->modified || info.st_size != reader->size;
+}
+
+WiggleIterator * takeWarmReader(const char * filename) {
+	WiggleIterator * res = NULL;
+	int i;
+
+	pthread_mutex_lock(&warmMutex);
+	for (i = 0; i < warmReaderCount; i++) {
+		if (!warmReaders[i].taken && strcmp(warmReaders[i].filename, filename) == 0 && !isStale(warmReaders + i)) {
+			warmReaders[i].taken = true;
+			res = warmReaders[i].iter;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&warmMutex);
+	return res;
+}
+
+// Opening a reader which holds fire starts no thread, which the children 
+// forked afterwards would lack
+static void keepWarmReader(char * filename) {
+	WarmReader * reader = NULL;
+	struct stat info;
+	int i;
+
+	for (i = 0; i < warmReaderCount; i++) {
+		if (strcmp(warmReaders[i].filename, filename) == 0) {
+			if (!isStale(warmReaders + i))
+				return;
+			// The stale reader is left as it is, its header and index are lost
+			reader = warmReaders + i;
+			break;
+		}
+	}
+
+	if (!reader) {
+		if (warmReaderCount == maxWarmReaders) {
+			maxWarmReaders = maxWarmReaders ? 2 * maxWarmReaders : 16;
+			warmReaders = (WarmReader *) realloc(warmReaders, maxWarmReaders * sizeof(WarmReader));
+			if (!warmReaders) {
+				fprintf(stderr, "Could not allocate %i warm readers\n", maxWarmReaders);
+				raiseError();
+			}
+		}
+		reader = warmReaders + warmReaderCount++;
+		reader->filename = strdup(filename);
+	}
+
+	if (stat(filename, &info) == 0) {
+		reader->modified = info.st_mtime;
+		reader->size = info.st_size;
+	} else {
+		reader->modified = 0;
+		reader->size = 0;
+	}
+	reader->taken = false;
+	reader->iter = SmartReader(reader->filename, true);
+}
+
+//////////////////////////////////////////////////////
+// Result cache
+//
+// The output of each program which prints to the 
+// connection only is kept, by program, and the least 
+// recently used outputs are dropped once the cache 
+// outgrows its size. The output of each region of a 
+// batch is kept as that of a batch of that region alone, 
+// so that a tile is found whichever batch asked for it.
+// An output is dropped once one of the local files named 
+// by its program was modified.
+//////////////////////////////////////////////////////
+
+#define RESULT_BUCKETS 4096
+// Outputs longer than this share of the cache are not kept
+#define RESULT_SHARE 8
+
+typedef struct fileStamp_st {
+	char * filename;
+	time_t modified;
+	off_t size;
+} FileStamp;
+
+typedef struct cachedResult_st {
+	char * key;
+	char * data;
+	size_t length;
+	FileStamp * stamps;
+	int stampCount;
+	// Next in the bucket
+	struct cachedResult_st * next;
+	// Neighbours in the order of use
+	struct cachedResult_st * newer, * older;
+} CachedResult;
+
+// The server runs one request at a time, so these need no lock
+static CachedResult * resultBuckets[RESULT_BUCKETS];
+static CachedResult * newestResult = NULL;
+static CachedResult * oldestResult = NULL;
+static long long resultCacheSize = 64LL * 1024 * 1024;
+static long long resultCacheUsed = 0;
+
+void setResultCacheSize(int megabytes) {
+	resultCacheSize = (long long) megabytes * 1024 * 1024;
+}
+
+static unsigned int hashKey(const char * key) {
+	unsigned int hash = 5381;
+	for (; *key; key++)
+		hash = hash * 33 + (unsigned char) *key;
+	return hash % RESULT_BUCKETS;
+}
+
+// Words separated by single spaces
+static char * joinWords(char ** words, int count) {
+	int length = 1, i;
+	char * res;
+
+	for (i = 0; i < count; i++)
+		length += strlen(words[i]) + 1;
+	res = (char *) calloc(length, 1);
+	for (i = 0; i < count; i++) {
+		if (i)
+			strcat(res, " ");
+		strcat(res, words[i]);
+	}
+	return res;
+}
+
+// The files named by the program, as they are before it runs
+static void stampFile(FileStamp * stamps, int * stampCount, char * filename, struct stat * info) {
+	stamps[*stampCount].filename = filename;
+	stamps[*stampCount].modified = info->st_mtime;
+	stamps[*stampCount].size = info->st_size;
+	(*stampCount)++;
+}
+
+// The directory of a matrix file changes when deltas are appended to it
+static char * matrixDirectory(char * filename) {
+	char * slash = strrchr(filename, '/');
+	if (!slash)
+		return strdup(".");
+	return strndup(filename, slash > filename ? slash - filename : 1);
+}
+
+static FileStamp * stampFiles(char ** words, int count, int * stampCount) {
+	FileStamp * stamps = (FileStamp *) calloc(2 * count, sizeof(FileStamp));
+	struct stat info;
+	int i;
+
+	*stampCount = 0;
+	for (i = 0; i < count; i++) {
+		if (stat(words[i], &info) || !S_ISREG(info.st_mode))
+			continue;
+		stampFile(stamps, stampCount, strdup(words[i]), &info);
+		if (isMatrixFilename(words[i])) {
+			char * directory = matrixDirectory(words[i]);
+			if (stat(directory, &info))
+				free(directory);
+			else
+				stampFile(stamps, stampCount, directory, &info);
+		}
+	}
+	return stamps;
+}
+
+static bool isResultStale(CachedResult * result) {
+	struct stat info;
+	int i;
+
+	for (i = 0; i < result->stampCount; i++)
+		if (stat(result->stamps[i].filename, &info) || info.st_mtime != result->stamps[i].modified || info.st_size != result->stamps[i].size)
+			return true;
+	return false;
+}
+
+static void unlinkResult(CachedResult * result) {
+	if (result->newer)
+		result->newer->older = result->older;
+	else
+		newestResult = result->older;
+	if (result->older)
+		result->older->newer = result->newer;
+	else
+		oldestResult = result->newer;
+	result->newer = result->older = NULL;
+}
+
+static void pushResult(CachedResult * result) {
+	result->older = newestResult;
+	if (newestResult)
+		newestResult->newer = result;
+	else
+		oldestResult = result;
+	newestResult = result;
+}
+
+static void dropResult(CachedResult * result) {
+	CachedResult ** slot = resultBuckets + hashKey(result->key);
+	int i;
+
+	while (*slot != result)
+		slot = &(*slot)->next;
+	*slot = result->next;
+	unlinkResult(result);
+	resultCacheUsed -= result->length + strlen(result->key);
+	for (i = 0; i < result->stampCount; i++)
+		free(result->stamps[i].filename);
+	free(result->stamps);
+	free(result->key);
+	free(result->data);
+	free(result);
+}
+
+// Output of the program, or NULL
+static CachedResult * findResult(const char * key) {
+	CachedResult * result;
+
+	for (result = resultBuckets[hashKey(key)]; result; result = result->next) {
+		if (strcmp(result->key, key))
+			continue;
+		if (isResultStale(result)) {
+			dropResult(result);
+			return NULL;
+		}
+		unlinkResult(result);
+		pushResult(result);
+		return result;
+	}
+	return NULL;
+}
+
+// The cache takes over key and the stamps, the data is copied
+static void keepResult(char * key, char * data, size_t length, char ** words, int count) {
+	CachedResult * result;
+	unsigned int bucket = hashKey(key);
+
+	if ((long long) length * RESULT_SHARE > resultCacheSize) {
+		free(key);
+		return;
+	}
+	if ((result = findResult(key)))
+		dropResult(result);
+
+	result = (CachedResult *) calloc(1, sizeof(CachedResult));
+	result->key = key;
+	result->data = (char *) malloc(length + 1);
+	if (!result->data) {
+		fprintf(stderr, "Could not allocate cached result of %zu bytes\n", length);
+		raiseError();
+	}
+	memcpy(result->data, data, length);
+	result->length = length;
+	result->stamps = stampFiles(words, count, &result->stampCount);
+	result->next = resultBuckets[bucket];
+	resultBuckets[bucket] = result;
+	pushResult(result);
+	resultCacheUsed += length + strlen(key);
+
+	while (resultCacheUsed > resultCacheSize)
+		dropResult(oldestResult);
+}
+
+// Programs which write to files, unless to -, must be run each time
+static bool isCacheable(char ** words, int count) {
+	static const char * writers[] = {"write", "write_bg", "write_pyramid", "cache", "mwrite", "mwrite_bg", "mwrite_matrix", "mappend_matrix", "compact_matrix", "print", "histogram", "top", "profile", "profiles", "correlations", "apply_paste", "partial", "merge_partials", NULL};
+	int i, j;
+
+	if (resultCacheSize <= 0)
+		return false;
+	for (i = 0; i < count; i++) {
+		if (strcmp(words[i], "run") == 0)
+			return false;
+		for (j = 0; writers[j]; j++)
+			if (strcmp(words[i], writers[j]) == 0 && (i + 1 == count || strcmp(words[i + 1], "-")))
+				return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////
+// Requests
+//////////////////////////////////////////////////////
+
+// Requests are served one at a time, so a client which stalls is cut off
+#define REQUEST_TIMEOUT 10
+// Longest request line, e.g. a batch of regions
+#define MAX_REQUEST_LENGTH (1 << 20)
+
+// One line, the program tokens separated by white space as in a program file.
+// Returns NULL if the client stalled, hung up or sent too long a line.
+static char * readRequest(int connection) {
+	int length = 0, capacity = 1024;
+	char * buffer = (char *) malloc(capacity);
+	char * newline = NULL;
+
+	while (!newline) {
+		ssize_t bytes;
+		if (length == capacity - 1) {
+			if (capacity >= MAX_REQUEST_LENGTH) {
+				fprintf(stderr, "wiggletools serve: request longer than %i bytes\n", MAX_REQUEST_LENGTH);
+				free(buffer);
+				return NULL;
+			}
+			capacity *= 2;
+			buffer = (char *) realloc(buffer, capacity);
+		}
+		if (!buffer) {
+			fprintf(stderr, "Could not allocate request of %i bytes\n", capacity);
+			raiseError();
+		}
+		bytes = recv(connection, buffer + length, capacity - 1 - length, 0);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			fprintf(stderr, "wiggletools serve: no request received within %i seconds\n", REQUEST_TIMEOUT);
+			free(buffer);
+			return NULL;
+		}
+		if (bytes < 0) {
+			free(buffer);
+			return NULL;
+		}
+		// A last line without newline still counts, a connection closed at once, e.g. probing the socket, does not
+		if (bytes == 0 && length == 0) {
+			free(buffer);
+			return NULL;
+		} else if (bytes == 0)
+			break;
+		newline = memchr(buffer + length, '\n', bytes);
+		length += bytes;
+	}
+	// Anything after the first line is ignored
+	if (newline)
+		length = newline - buffer;
+	buffer[length] = '\0';
+	return buffer;
+}
+
+// Both ways, so that a client which stops reading does not hold up the server either
+static void setRequestTimeout(int connection) {
+	struct timeval timeout;
+
+	timeout.tv_sec = REQUEST_TIMEOUT;
+	timeout.tv_usec = 0;
+	if (setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) || setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+		fprintf(stderr, "wiggletools serve: could not set the timeout of a connection\n");
+}
+
+static char ** splitRequest(char * request, int * count) {
+	int capacity = 8;
+	char ** words = (char **) calloc(capacity, sizeof(char *));
+	char * token;
+
+	*count = 0;
+	for (token = strtok(request, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+		if (*count == capacity) {
+			capacity *= 2;
+			words = (char **) realloc(words, capacity * sizeof(char *));
+		}
+		words[(*count)++] = token;
+	}
+	return words;
+}
+
+// A client which hung up does not stop the server
+static bool sendAll(int connection, const char * data, size_t length) {
+	while (length) {
+		ssize_t bytes = send(connection, data, length, MSG_NOSIGNAL);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return false;
+		data += bytes;
+		length -= bytes;
+	}
+	return true;
+}
+
+// Output of a child, up to limit bytes, beyond which it is not kept
+typedef struct requestOutput_st {
+	char * data;
+	size_t length;
+	size_t capacity;
+	size_t limit;
+	bool overflow;
+} RequestOutput;
+
+static void addRequestOutput(RequestOutput * output, char * buffer, size_t length) {
+	if (output->overflow)
+		return;
+	if (output->length + length > output->limit) {
+		output->overflow = true;
+		free(output->data);
+		output->data = NULL;
+		return;
+	}
+	if (output->length + length > output->capacity) {
+		output->capacity = 2 * (output->length + length);
+		output->data = (char *) realloc(output->data, output->capacity);
+		if (!output->data) {
+			fprintf(stderr, "Could not allocate request output of %zu bytes\n", output->capacity);
+			raiseError();
+		}
+	}
+	memcpy(output->data + output->length, buffer, length);
+	output->length += length;
+}
+
+static void keepWarmReaders(char ** words, int count) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (isIndexedFile(words[i]))
+			keepWarmReader(words[i]);
+}
+
+// The child writes its output into a pipe, which the server forwards to the 
+// connection if asked to, and keeps. Errors go to the log of the server, and 
+// end the child only. Returns whether the program succeeded.
+static bool runRequest(int server, int connection, char ** words, int count, char * line, RequestOutput * output, bool forward) {
+	char buffer[65536];
+	int pipeline[2];
+	int status = 0;
+	pid_t child;
+
+	fflush(stdout);
+	fflush(stderr);
+	if (pipe(pipeline)) {
+		fprintf(stderr, "wiggletools serve: could not open pipe for request: %s\n", line);
+		return false;
+	}
+	child = fork();
+	if (child < 0) {
+		fprintf(stderr, "wiggletools serve: could not fork for request: %s\n", line);
+		close(pipeline[0]);
+		close(pipeline[1]);
+		return false;
+	} else if (child == 0) {
+		close(server);
+		close(connection);
+		close(pipeline[0]);
+		if (dup2(pipeline[1], STDOUT_FILENO) < 0) {
+			fprintf(stderr, "wiggletools serve: could not redirect output\n");
+			raiseError();
+		}
+		close(pipeline[1]);
+		rollYourOwn(count, words);
+		fflush(stdout);
+		exit(0);
+	}
+
+	close(pipeline[1]);
+	for (;;) {
+		ssize_t bytes = read(pipeline[0], buffer, sizeof(buffer));
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		// Still drained once the client is gone, so that the child can finish
+		if (forward && !sendAll(connection, buffer, bytes))
+			forward = false;
+		addRequestOutput(output, buffer, bytes);
+	}
+	close(pipeline[0]);
+
+	while (waitpid(child, &status, 0) < 0 && errno == EINTR);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		keepWarmReaders(words, count);
+		return true;
+	}
+	fprintf(stderr, "wiggletools serve: request failed: %s\n", line);
+	return false;
+}
+
+static void serveProgram(int server, int connection, char ** words, int count, char * line) {
+	RequestOutput output;
+	bool cacheable = isCacheable(words, count);
+	char * key = cacheable ? joinWords(words, count) : NULL;
+	CachedResult * result;
+
+	if (key && (result = findResult(key))) {
+		sendAll(connection, result->data, result->length);
+		free(key);
+		return;
+	}
+
+	memset(&output, 0, sizeof(output));
+	output.limit = cacheable ? resultCacheSize / RESULT_SHARE : 0;
+	if (runRequest(server, connection, words, count, line, &output, true) && key && !output.overflow)
+		keepResult(key, output.data, output.length, words, count);
+	else
+		free(key);
+	free(output.data);
+}
+
+typedef struct batchRegion_st {
+	char * text;
+	char * key;
+	char * data;
+	size_t length;
+	bool known;
+} BatchRegion;
+
+static void setBatchOutput(BatchRegion * region, const char * data, size_t length) {
+	region->data = (char *) malloc(length + 1);
+	if (!region->data) {
+		fprintf(stderr, "Could not allocate batch output of %zu bytes\n", length);
+		raiseError();
+	}
+	memcpy(region->data, data, length);
+	region->length = length;
+	region->known = true;
+}
+
+// The output of the batch run for the missing regions is cut at the comment 
+// line of each, see readBatch
+static void splitBatchOutput(BatchRegion * regions, int count, RequestOutput * output, char ** words, int wordCount) {
+	char * current = output->data, * end = output->data + output->length;
+	char * section = NULL;
+	int header = -1, i;
+
+	while (true) {
+		char * newline = current < end ? memchr(current, '\n', end - current) : NULL;
+		char * next = newline ? newline + 1 : end;
+		int match = -1;
+
+		if (current < end && next - current > 3 && current[0] == '#' && current[1] == ' ')
+			for (i = 0; i < count && match < 0; i++)
+				if (!regions[i].known && strlen(regions[i].text) == (size_t) (next - current - 3) && strncmp(current + 2, regions[i].text, next - current - 3) == 0)
+					match = i;
+		if (header >= 0 && (match >= 0 || current == end)) {
+			// Regions asked for twice share the output
+			for (i = 0; i < count; i++)
+				if (!regions[i].known && strcmp(regions[i].text, regions[header].text) == 0)
+					setBatchOutput(regions + i, section, current - section);
+			keepResult(strdup(regions[header].key), section, current - section, words, wordCount);
+		}
+		if (current == end)
+			break;
+		if (match >= 0) {
+			header = match;
+			section = next;
+		}
+		current = next;
+	}
+}
+
+// The regions found in the cache are copied from it, the others are run as 
+// one batch, then all are sent back in the order asked for
+static void serveBatch(int server, int connection, char ** words, int count, char * line) {
+	char * list = strdup(words[1]);
+	char * program = joinWords(words + 2, count - 2);
+	char * missing = (char *) calloc(strlen(words[1]) + 1, 1);
+	char * text, * save;
+	BatchRegion * regions = NULL;
+	int regionCount = 0, max = 0, i, j;
+	bool success = true;
+	RequestOutput output;
+
+	for (text = strtok_r(list, ",", &save); text; text = strtok_r(NULL, ",", &save)) {
+		if (regionCount == max) {
+			max = max ? 2 * max : 64;
+			regions = (BatchRegion *) realloc(regions, max * sizeof(BatchRegion));
+		}
+		memset(regions + regionCount, 0, sizeof(BatchRegion));
+		regions[regionCount].text = text;
+		regions[regionCount].key = (char *) malloc(strlen(text) + strlen(program) + 8);
+		sprintf(regions[regionCount].key, "batch %s %s", text, program);
+		regionCount++;
+	}
+
+	for (i = 0; i < regionCount; i++) {
+		CachedResult * result = findResult(regions[i].key);
+		if (result)
+			setBatchOutput(regions + i, result->data, result->length);
+	}
+
+	for (i = 0; i < regionCount; i++) {
+		if (regions[i].known)
+			continue;
+		for (j = 0; j < i; j++)
+			if (!regions[j].known && strcmp(regions[j].text, regions[i].text) == 0)
+				break;
+		if (j < i)
+			continue;
+		if (missing[0])
+			strcat(missing, ",");
+		strcat(missing, regions[i].text);
+	}
+
+	memset(&output, 0, sizeof(output));
+	output.limit = (size_t) -1;
+	if (missing[0]) {
+		char * batch = words[1];
+		words[1] = missing;
+		success = runRequest(server, connection, words, count, line, &output, false);
+		words[1] = batch;
+		if (success)
+			splitBatchOutput(regions, regionCount, &output, words + 2, count - 2);
+	}
+
+	for (i = 0; success && i < regionCount; i++) {
+		char * header = (char *) malloc(strlen(regions[i].text) + 4);
+		sprintf(header, "# %s\n", regions[i].text);
+		success = sendAll(connection, header, strlen(header)) && sendAll(connection, regions[i].data, regions[i].length);
+		free(header);
+	}
+
+	for (i = 0; i < regionCount; i++) {
+		free(regions[i].key);
+		free(regions[i].data);
+	}
+	free(regions);
+	free(output.data);
+	free(missing);
+	free(program);
+	free(list);
+}
+
+static void serveRequest(int server, int connection) {
+	char * request = readRequest(connection);
+	char * line;
+	int count;
+	char ** words;
+
+	if (!request)
+		return;
+	line = strdup(request);
+	words = splitRequest(request, &count);
+
+	if (count == 0 || strcmp(words[0], "serve") == 0)
+		fprintf(stderr, "wiggletools serve: invalid request: %s\n", line);
+	else if (strcmp(words[0], "batch") == 0 && count > 2 && isCacheable(words, count))
+		serveBatch(server, connection, words, count, line);
+	else
+		serveProgram(server, connection, words, count, line);
+
+	free(words);
+	free(request);
+	free(line);
+}
+
+// The socket left behind by a server which crashed is removed, that of a live server is not
+static void removeStaleSocket(struct sockaddr_un * address) {
+	struct stat info;
+	int probe;
+	bool refused;
+
+	if (lstat(address->sun_path, &info))
+		return;
+	if (!S_ISSOCK(info.st_mode)) {
+		fprintf(stderr, "Could not listen on %s, which is not a socket\n", address->sun_path);
+		raiseError();
+	}
+	if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "Could not open socket\n");
+		raiseError();
+	}
+	refused = connect(probe, (struct sockaddr *) address, sizeof(*address)) && errno == ECONNREFUSED;
+	close(probe);
+	if (!refused) {
+		fprintf(stderr, "Socket %s is already in use\n", address->sun_path);
+		raiseError();
+	}
+	if (unlink(address->sun_path)) {
+		fprintf(stderr, "Could not remove stale socket %s\n", address->sun_path);
+		raiseError();
+	}
+}
+
+void serve(char * socketPath) {
+	struct sockaddr_un address;
+	int server, bound;
+	mode_t mask;
+
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socketPath);
+		raiseError();
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	removeStaleSocket(&address);
+
+	server = socket(AF_UNIX, SOCK_STREAM, 0);
+	// Only the user of the server may connect to it
+	mask = umask(0177);
+	bound = server >= 0 ? bind(server, (struct sockaddr *) &address, sizeof(address)) : -1;
+	umask(mask);
+	if (server < 0 || bound || listen(server, 64)) {
+		fprintf(stderr, "Could not listen on socket %s\n", socketPath);
+		raiseError();
+	}
+
+	for (;;) {
+		int connection = accept(server, NULL, NULL);
+		if (connection < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Could not accept connection on socket %s\n", socketPath);
+			raiseError();
+		}
+		setRequestTimeout(connection);
+		serveRequest(server, connection);
+		close(connection);
+	}
+}
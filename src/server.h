@@ -0,0 +1,37 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include "wiggletools.h"
+
+// Readers kept open by wiggletools serve
+//
+// Requests are run one at a time, each in a child process forked from the 
+// server. Once a request succeeds, the server opens a reader, holding fire,
+// on each indexed file which it named, and keeps it. The children inherit 
+// the readers already open, headers and indexes loaded, and seek them 
+// instead of opening the files again. Each child can use each reader once,
+// further readers on the same file are opened afresh, and the server's 
+// readers are never moved.
+//
+// The output of each program is forwarded to the connection by the server,
+// which keeps it, see the result cache in server.c, unless the program 
+// writes to files.
+
+// Reader kept on filename, unused so far in this process, or NULL (thread safe)
+WiggleIterator * takeWarmReader(const char * filename);
+
+#endif
@@ -13,91 +13,227 @@
 // limitations under the License.
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <gsl/gsl_cdf.h>
 
 #include "multiSet.h"
+#include "memoryUsage.h"
 
-typedef struct setComparisonData_st {
-	Multiset * multi;
-} SetComparisonData;
+////////////////////////////////////////////////////////
+// Group sums
+////////////////////////////////////////////////////////
 
-void SetComparisonSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
-	SetComparisonData * data = (SetComparisonData* ) iter->data;
-	seekMultiset(data->multi, chrom, start, finish);
-	pop(iter);
+// As in reducers.c: below this many inputs, scanning all the values is as
+// cheap as following the changes, and full scans bound the rounding drift
+#define INCREMENTAL_MIN_INPUTS 64
+#define INCREMENTAL_RESYNC 1024
+
+// Sum and sum of squares of the values of a group, over the inputs in play
+// or over all of them, updated from the changes of the multiplexer
+typedef struct groupSums_st {
+	Multiplexer * multi;
+	bool inplayOnly;
+	// Whether the sums are up to date with the position below
+	bool synced;
+	int steps;
+	const char * chrom;
+	int start;
+	double sum, sumSq;
+} GroupSums;
+
+static void addToGroupSums(GroupSums * group, double value, double sign) {
+	group->sum += sign * value;
+	group->sumSq += sign * value * value;
+}
+
+// Called after each pop of the multiset, which only pops some of the groups
+static void followGroupSums(GroupSums * group) {
+	Multiplexer * multi = group->multi;
+	int i;
+
+	if (multi->chrom == group->chrom && multi->start == group->start && !multi->done)
+		return;
+	group->chrom = multi->chrom;
+	group->start = multi->start;
+
+	if (!group->synced)
+		return;
+	if (multi->done || multi->change_count < 0 || multi->change_count > multi->count / 8 || group->steps >= INCREMENTAL_RESYNC) {
+		group->synced = false;
+		return;
+	}
+	// Infinities and NaNs cannot be subtracted back out
+	for (i = 0; i < multi->change_count; i++) {
+		if (!isfinite(multi->changes[i].previous) || !isfinite(multi->changes[i].value)) {
+			group->synced = false;
+			return;
+		}
+	}
+
+	for (i = 0; i < multi->change_count; i++) {
+		MultiplexerChange * change = multi->changes + i;
+		if (!group->inplayOnly) {
+			addToGroupSums(group, change->previous, -1);
+			addToGroupSums(group, change->value, 1);
+		} else if (change->entered)
+			addToGroupSums(group, change->value, 1);
+		else
+			addToGroupSums(group, change->previous, -1);
+	}
+	group->steps++;
+}
+
+static void updateGroupSums(GroupSums * group) {
+	Multiplexer * multi = group->multi;
+	int index;
+
+	if (group->synced)
+		return;
+
+	group->sum = group->sumSq = 0;
+	for (index = 0; index < multi->count; index++) {
+		if (!group->inplayOnly || multi->inplay[index]) {
+			group->sum += multi->values[index];
+			group->sumSq += multi->values[index] * multi->values[index];
+		}
+	}
+	group->steps = 0;
+	group->synced = multi->count >= INCREMENTAL_MIN_INPUTS && isfinite(group->sumSq);
+	group->chrom = multi->chrom;
+	group->start = multi->start;
+}
+
+// A set out of play counts for the default values of its inputs, as held
+// in the row of the multiset. Its multiplexer has moved on, so the sums
+// are computed afresh once it is back in play.
+static void defaultGroupSums(GroupSums * group, const double * row) {
+	int index;
+
+	group->sum = group->sumSq = 0;
+	if (!group->inplayOnly) {
+		for (index = 0; index < group->multi->count; index++) {
+			group->sum += row[index];
+			group->sumSq += row[index] * row[index];
+		}
+	}
+	group->synced = false;
 }
 
 ////////////////////////////////////////////////////////
-// T-test
+// Common to the T-test and F-test
 ////////////////////////////////////////////////////////
 
-void TTestReductionPop(WiggleIterator * wi) {
-	if (wi->done)
-		return;
+enum testOutput {
+	TEST_PVALUE,
+	TEST_STATISTIC,
+	// 1 if the p-value is below alpha, 0 otherwise
+	TEST_CALL
+};
+
+typedef struct testData_st {
+	Multiset * multi;
+	GroupSums * groups;
+	int total_count;
+	int output;
+	double alpha;
+	// Calls: statistics above certain are significant whatever the degrees of 
+	// freedom, those at most possible are not, those in between need a p-value
+	double certain, possible;
+} TestData;
+
+static TestData * newTestData(Multiset * multi, bool inplayOnly, int output, double alpha) {
+	TestData * data = (TestData *) calloc(1, sizeof(TestData));
+	int index;
+
+	data->multi = multi;
+	data->output = output;
+	data->alpha = alpha;
+	data->groups = (GroupSums *) calloc(multi->count, sizeof(GroupSums));
+	for (index = 0; index < multi->count; index++) {
+		data->groups[index].multi = multi->multis[index];
+		data->groups[index].inplayOnly = inplayOnly;
+		data->total_count += multi->multis[index]->count;
+	}
+	return data;
+}
+
+static void popTestMultiset(TestData * data) {
+	int index;
+	popMultiset(data->multi);
+	for (index = 0; index < data->multi->count; index++)
+		followGroupSums(data->groups + index);
+}
+
+void TestSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
+	TestData * data = (TestData *) iter->data;
+	int index;
+	for (index = 0; index < data->multi->count; index++)
+		data->groups[index].synced = false;
+	seekMultiset(data->multi, chrom, start, finish);
+	pop(iter);
+}
 
-	SetComparisonData * data = (SetComparisonData *) wi->data;
+// Go to first position where both of the first two sets have at least one value
+static bool findTestPosition(WiggleIterator * wi, TestData * data) {
 	Multiset * multi = data->multi;
 
 	if (multi->done) {
 		wi->done = true;
-		return;
+		return false;
 	}
 
-	// Go to first position where both of the sets have at least one value
 	while (!multi->inplay[0] || !multi->inplay[1]) {
-		popMultiset(multi);
+		popTestMultiset(data);
 		if (multi->done) {
 			wi->done = true;
-			return;
+			return false;
 		}
 	}
 	wi->chrom = multi->chrom;
 	wi->start = multi->start;
 	wi->finish = multi->finish;
+	return true;
+}
 
-	// Compute measurements
-	double sum1, sum2, sumSq1, sumSq2;
-	int count1, count2;
-	int index;
+////////////////////////////////////////////////////////
+// T-test
+////////////////////////////////////////////////////////
 
-	sum1 = sum2 = 0;
-	sumSq1 = sumSq2 = 0;
-	count1 = multi->multis[0]->count;
-	count2 = multi->multis[1]->count;
+void TTestReductionPop(WiggleIterator * wi) {
+	if (wi->done)
+		return;
 
-	for (index = 0; index < multi->multis[0]->count; index++) {
-		if (multi->multis[0]->inplay[index]) {
-			sum1 += multi->values[0][index];
-			sumSq1 += multi->values[0][index] * multi->values[0][index];
-		}
-	}
+	TestData * data = (TestData *) wi->data;
+	Multiset * multi = data->multi;
 
-	for (index = 0; index < multi->multis[1]->count; index++) {
-		if (multi->multis[1]->inplay[index]) {
-			sum2 += multi->values[1][index];
-			sumSq2 += multi->values[1][index] * multi->values[1][index];
-		}
-	}
+	if (!findTestPosition(wi, data))
+		return;
+
+	// Compute measurements
+	int count1 = multi->multis[0]->count;
+	int count2 = multi->multis[1]->count;
 
 	// To avoid divisions by 0:
 	if (count1 == 0 || count2 == 0) {
 		wi->value = NAN;
-		popMultiset(multi);
+		popTestMultiset(data);
 		return;
 	}
 
-	double mean1 = sum1 / count1;
-	double mean2 = sum2 / count2;
-	double meanSq1 = sumSq1 / count1;
-	double meanSq2 = sumSq2 / count2;
+	updateGroupSums(data->groups);
+	updateGroupSums(data->groups + 1);
+	double mean1 = data->groups[0].sum / count1;
+	double mean2 = data->groups[1].sum / count2;
+	double meanSq1 = data->groups[0].sumSq / count1;
+	double meanSq2 = data->groups[1].sumSq / count2;
 	double var1 = meanSq1 - mean1 * mean1;
 	double var2 = meanSq2 - mean2 * mean2;
 
 	// To avoid divisions by 0:
 	if (var1 + var2 == 0) {
 		wi->value = NAN;
-		popMultiset(multi);
+		popTestMultiset(data);
 		return;
 	}
 
@@ -105,9 +241,21 @@ void TTestReductionPop(WiggleIterator * wi) {
 
 	double t = (mean1 - mean2) / sqrt(var1 / count1 + var2 / count2);
 
+	if (data->output == TEST_STATISTIC) {
+		wi->value = t;
+		popTestMultiset(data);
+		return;
+	}
+
 	if (t < 0)
 		t = -t;
 
+	if (data->output == TEST_CALL && !(t > data->possible && t <= data->certain)) {
+		wi->value = isnan(t) ? NAN : t > data->certain;
+		popTestMultiset(data);
+		return;
+	}
+
 	// Degrees of freedom
 	
 	double nu = (var1 / count1 + var2 / count2) * (var1 / count1 + var2 / count2) / ((var1 * var1) / (count1 * count1 * (count1 - 1)) + (var2 * var2) / (count2 * count2 * (count2 - 1)));
@@ -115,93 +263,79 @@ void TTestReductionPop(WiggleIterator * wi) {
 	// P-value
 
 	wi->value = 2 * gsl_cdf_tdist_Q(t, nu);
+	if (data->output == TEST_CALL)
+		wi->value = wi->value < data->alpha;
 
 	// Update inputs
-	popMultiset(multi);
+	popTestMultiset(data);
 }
 
-WiggleIterator * TTestReduction(Multiset * multi) {
-	SetComparisonData * data = (SetComparisonData *) calloc(1, sizeof(SetComparisonData));
+static WiggleIterator * newTTestReduction(Multiset * multi, int output, double alpha) {
 	if (multi->count != 2 || multi->multis[0]->count + multi->multis[1]->count < 3) {
 		puts("The t-test function only works for two sets with enough elements to compute variance");
-		exit(1);
+		raiseError();
 	}	
-	data->multi = multi;
-	return newWiggleIterator(data, &TTestReductionPop, &SetComparisonSeek, NAN);
+	TestData * data = newTestData(multi, true, output, alpha);
+	if (output == TEST_CALL) {
+		int count1 = multi->multis[0]->count;
+		int count2 = multi->multis[1]->count;
+		int smallest = count1 < count2 ? count1 : count2;
+		// Welch's degrees of freedom lie between smallest - 1 and count1 + count2 - 2
+		data->possible = gsl_cdf_tdist_Qinv(alpha / 2, count1 + count2 - 2);
+		data->certain = smallest > 1 ? gsl_cdf_tdist_Qinv(alpha / 2, smallest - 1) : INFINITY;
+	}
+	return newWiggleIterator(data, &TTestReductionPop, &TestSeek, NAN);
 }
 
+WiggleIterator * TTestReduction(Multiset * multi) {
+	return newTTestReduction(multi, TEST_PVALUE, 0);
+}
 
-////////////////////////////////////////////////////////
-// F-test
-////////////////////////////////////////////////////////
-
-typedef struct ftestData_st {
-	Multiset * multi;
-	int * counts;
-	double * means;
-	int total_count;
-} FTestData;
+WiggleIterator * TTestStatisticReduction(Multiset * multi) {
+	return newTTestReduction(multi, TEST_STATISTIC, 0);
+}
 
-void FTestSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
-	FTestData * data = (FTestData* ) iter->data;
-	seekMultiset(data->multi, chrom, start, finish);
-	pop(iter);
+WiggleIterator * TTestCallReduction(Multiset * multi, double alpha) {
+	return newTTestReduction(multi, TEST_CALL, alpha);
 }
 
+////////////////////////////////////////////////////////
+// F-test
+////////////////////////////////////////////////////////
 
 void FTestReductionPop(WiggleIterator * wi) {
 	if (wi->done)
 		return;
 
-	FTestData * data = (FTestData *) wi->data;
+	TestData * data = (TestData *) wi->data;
 	Multiset * multi = data->multi;
 
-	if (multi->done) {
-		wi->done = true;
+	if (!findTestPosition(wi, data))
 		return;
-	}
-
-	// Go to first position where both of the sets have at least one value
-	while (!multi->inplay[0] || !multi->inplay[1]) {
-		popMultiset(multi);
-		if (multi->done) {
-			wi->done = true;
-			return;
-		}
-	}
-	wi->chrom = multi->chrom;
-	wi->start = multi->start;
-	wi->finish = multi->finish;
 
-	// Compute means
+	// Compute means, the inputs out of play counting for their default value
 	double mean = 0;
 	int groups = multi->count;
-	int index, index2;
+	int index;
 	for (index = 0; index < groups; index++) {
-		Multiplexer * mplx = multi->multis[index];
-		data->means[index] = 0;
-		for (index2 = 0; index < mplx->count; index++) {
-			if (mplx->inplay[index2])
-				data->means[index] += mplx->values[index2];
-			else
-				data->means[index] += mplx->iters[index2]->default_value;
-		}
-		mean += data->means[index];
-		data->means[index] /= data->counts[index];
+		if (multi->inplay[index])
+			updateGroupSums(data->groups + index);
+		else
+			defaultGroupSums(data->groups + index, multi->row + multi->offsets[index]);
+		mean += data->groups[index].sum;
 	}
 	mean /= data->total_count;
 
 	double inter = 0;
 	double intra = 0;
 	for (index = 0; index < groups; index++) {
-		Multiplexer * mplx = multi->multis[index];
-		inter += mplx->count * (data->means[index] - mean) * (data->means[index] - mean);
-		for (index2 = 0; index < mplx->count; index++) {
-			if (mplx->inplay[index2])
-				intra += (mplx->values[index2] - data->means[index]) * (mplx->values[index2] - data->means[index]);
-			else
-				intra += (mplx->iters[index2]->default_value - data->means[index]) * (mplx->iters[index2]->default_value - data->means[index]);
-		}
+		GroupSums * group = data->groups + index;
+		int count = group->multi->count;
+		double groupMean = group->sum / count;
+		inter += count * (groupMean - mean) * (groupMean - mean);
+		// Sum of the squared deviations from the group mean
+		double deviations = group->sumSq - group->sum * groupMean;
+		intra += deviations < 0 ? 0 : deviations;
 	}
 
 	// F-statistic
@@ -210,41 +344,60 @@ void FTestReductionPop(WiggleIterator * wi) {
 	double f = inter / intra;
 
 	// P-value
-	wi->value = 2 * gsl_cdf_fdist_Q(f, multi->count - 1, data->total_count - multi->count);
+	if (data->output == TEST_STATISTIC)
+		wi->value = f;
+	else if (data->output == TEST_CALL)
+		wi->value = isnan(f) ? NAN : f > data->certain;
+	else
+		wi->value = 2 * gsl_cdf_fdist_Q(f, multi->count - 1, data->total_count - multi->count);
 
 	// Update inputs
-	popMultiset(multi);
+	popTestMultiset(data);
+}
+
+static WiggleIterator * newFTestReduction(Multiset * multi, int output, double alpha) {
+	TestData * data = newTestData(multi, false, output, alpha);
+	// The degrees of freedom are fixed, so is the threshold
+	if (output == TEST_CALL)
+		data->certain = data->possible = gsl_cdf_fdist_Qinv(alpha / 2, multi->count - 1, data->total_count - multi->count);
+	return newWiggleIterator(data, &FTestReductionPop, &TestSeek, NAN);
 }
 
 WiggleIterator * FTestReduction(Multiset * multi) {
-	FTestData * data = (FTestData *) calloc(1, sizeof(FTestData));
-	data->multi = multi;
-	data->means = calloc(multi->count, sizeof(double)); 
-	data->counts = calloc(multi->count, sizeof(int)); 
-	int index;
-	for (index = 0; index < multi->count; index++) {
-		data->counts[index] = multi->multis[index]->count;
-		data->total_count += data->counts[index];
-	}
-	return newWiggleIterator(data, &FTestReductionPop, &FTestSeek, NAN);
+	return newFTestReduction(multi, TEST_PVALUE, 0);
+}
+
+WiggleIterator * FTestStatisticReduction(Multiset * multi) {
+	return newFTestReduction(multi, TEST_STATISTIC, 0);
+}
+
+WiggleIterator * FTestCallReduction(Multiset * multi, double alpha) {
+	return newFTestReduction(multi, TEST_CALL, alpha);
 }
 
 ////////////////////////////////////////////////////////
 // Mann-Whitney U (Wilcoxon rank-sum test)
 ////////////////////////////////////////////////////////
 
-typedef struct valueSetPair_st {
-	double value;
-	bool set;
-} ValueSetPair;
+// Beyond this many changed inputs per step, sorting afresh is
+// cheaper than updating the sorted values one at a time
+#define MWU_INCREMENTAL_MAX 16
 
 typedef struct mwuData_st {
 	Multiset * multi;
 	int n1;
 	int n2;
 	int N;
-	// Pre-allocated table for sorting
-	ValueSetPair * rankingTable;
+	// Values of the inputs of both sets at the previous step, set 1 first
+	double * current;
+	int nan_count;
+	// Non-NaN entries of current for each set, in increasing order, when sorted_valid
+	double * sorted[2];
+	int sorted_count[2];
+	bool sorted_valid;
+	// Twice U1, i.e. the number of pairs where the value of set 1 is greater, ties counting
+	// for one half, over the sorted values. Kept as an integer, so updates are exact.
+	long long twiceU1;
 	// For normal approximation
 	bool normalApproximation;
 	double mu_U, sigma_U;
@@ -256,16 +409,110 @@ void MWUSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
 	pop(iter);
 }
 
-static int compareValueSetPairs(const void * A, const void * B) {
-	ValueSetPair * vspA = (ValueSetPair *) A;
-	ValueSetPair * vspB = (ValueSetPair *) B;
-	if (vspA->value < vspB->value)
+static int compareDoubles(const void * A, const void * B) {
+	double a = *(double *) A;
+	double b = *(double *) B;
+	if (a < b)
 		return -1;
-	if (vspA->value > vspB->value)
+	if (a > b)
 		return 1;
 	return 0;
 }
 
+// Index of the first entry of sorted not smaller (resp. greater) than val
+static int lowerBound(double * sorted, int count, double val) {
+	int lo = 0;
+	int hi = count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (sorted[mid] < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int upperBound(double * sorted, int count, double val) {
+	int lo = 0;
+	int hi = count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (sorted[mid] <= val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Twice the number of values of set 2 below val, ties counting for one half, or
+// of values of set 1 above val. This is what val contributes to twiceU1.
+static long long rankContribution(MWUData * data, int set, double val) {
+	double * other = data->sorted[1 - set];
+	int count = data->sorted_count[1 - set];
+	int lower = lowerBound(other, count, val);
+	int upper = upperBound(other, count, val);
+	if (set == 0)
+		return 2 * lower + (upper - lower);
+	else
+		return 2 * (count - upper) + (upper - lower);
+}
+
+static void rebuildRanks(MWUData * data) {
+	int set, index;
+
+	for (set = 0; set < 2; set++) {
+		int offset = set ? data->n1 : 0;
+		int count = set ? data->n2 : data->n1;
+		data->sorted_count[set] = 0;
+		for (index = 0; index < count; index++)
+			if (!isnan(data->current[offset + index]))
+				data->sorted[set][data->sorted_count[set]++] = data->current[offset + index];
+		qsort(data->sorted[set], data->sorted_count[set], sizeof(double), &compareDoubles);
+	}
+
+	// Merge of the two sorted sets
+	int lower = 0, upper = 0;
+	data->twiceU1 = 0;
+	for (index = 0; index < data->sorted_count[0]; index++) {
+		double val = data->sorted[0][index];
+		while (lower < data->sorted_count[1] && data->sorted[1][lower] < val)
+			lower++;
+		if (upper < lower)
+			upper = lower;
+		while (upper < data->sorted_count[1] && data->sorted[1][upper] <= val)
+			upper++;
+		data->twiceU1 += 2 * lower + (upper - lower);
+	}
+	data->sorted_valid = true;
+}
+
+static void removeRankedValue(MWUData * data, int set, double val) {
+	if (isnan(val))
+		return;
+	double * sorted = data->sorted[set];
+	int pos = lowerBound(sorted, data->sorted_count[set], val);
+	memmove(sorted + pos, sorted + pos + 1, (data->sorted_count[set] - pos - 1) * sizeof(double));
+	data->sorted_count[set]--;
+	data->twiceU1 -= rankContribution(data, set, val);
+}
+
+static void insertRankedValue(MWUData * data, int set, double val) {
+	if (isnan(val))
+		return;
+	double * sorted = data->sorted[set];
+	int pos = lowerBound(sorted, data->sorted_count[set], val);
+	memmove(sorted + pos + 1, sorted + pos, (data->sorted_count[set] - pos) * sizeof(double));
+	sorted[pos] = val;
+	data->sorted_count[set]++;
+	data->twiceU1 += rankContribution(data, set, val);
+}
+
+static inline bool sameValue(double a, double b) {
+	return a == b || (isnan(a) && isnan(b));
+}
+
 void MWUReductionPop(WiggleIterator * wi) {
 	if (wi->done)
 		return;
@@ -290,73 +537,36 @@ void MWUReductionPop(WiggleIterator * wi) {
 	wi->start = multi->start;
 	wi->finish = multi->finish;
 
-	// Compute measurements
-	int index;
-	ValueSetPair * vspPtr = data->rankingTable;
-
-	for (index = 0; index < data->n1; index++) {
-		if (multi->multis[0]->inplay[index]) 
-			vspPtr->value = multi->values[0][index];
-		else
-			vspPtr->value = multi->multis[0]->iters[index]->default_value;
-		if (isnan(vspPtr->value)) {
-			wi->value = NAN;
-			popMultiset(multi);
-			return;
-		}
-		vspPtr->set = false;
-		vspPtr++;
+	// Compute measurements, the row of the multiset being laid out as current
+	int index, changes = 0;
+
+	for (index = 0; index < data->N; index++) {
+		double val = multi->row[index];
+		double * current = data->current + index;
+		int set = index >= data->n1;
+		if (sameValue(val, *current))
+			continue;
+		data->nan_count += (isnan(val) != 0) - (isnan(*current) != 0);
+		if (data->sorted_valid && changes < MWU_INCREMENTAL_MAX) {
+			removeRankedValue(data, set, *current);
+			insertRankedValue(data, set, val);
+		} else
+			data->sorted_valid = false;
+		*current = val;
+		changes++;
 	}
 
-	for (index = 0; index < data->n2; index++) {
-		if (multi->multis[1]->inplay[index]) 
-			vspPtr->value = multi->values[1][index];
-		else
-			vspPtr->value = multi->multis[1]->iters[index]->default_value;
-		if (isnan(vspPtr->value)) {
-			wi->value = NAN;
-			popMultiset(multi);
-			return;
-		}
-		vspPtr->set = true;
-		vspPtr++;
+	if (data->nan_count) {
+		wi->value = NAN;
+		popMultiset(multi);
+		return;
 	}
 
-	qsort(data->rankingTable, data->N, sizeof(ValueSetPair), compareValueSetPairs);
+	if (!data->sorted_valid)
+		rebuildRanks(data);
 
 	// Sum of ranks of elements of set 1
-	double U1 = 0;
-	// Rolling count of elements of set 1 seen prior on the list
-	int prev = 0;
-	// Warns you when you have a tie with the previously visited Value-Set pairs
-	int ties = 0;
-	int previousTies = 0;
-	vspPtr = data->rankingTable;
-	for (index = 0; index < data->N && prev < data->n1; index++) {
-		if (!vspPtr->set) {
-			U1 += index - prev;
-			if (ties) {
-				// Look for ties on the table prior to the current position and after the last occurence of an element of set 1.
-				int index2;
-				for (index2 = index + 1; index2 < data->N && data->rankingTable[index2].value == vspPtr->value && data->rankingTable[index2].set; index2++)
-					previousTies++;
-				U1 -= previousTies / 2.0;
-				U1 += (ties - previousTies) / 2.0;
-				if (previousTies == ties)
-					previousTies = ties = 0;
-			} else {
-				int index2;
-				// Look for ties with next values
-				for (index2 = index + 1; index2 < data->N && data->rankingTable[index2].value == vspPtr->value; index2++)
-					if (data->rankingTable[index2].set)
-						ties++;
-				if (ties) 
-					U1 += ties / 2.0;
-			}
-			prev++;
-		}
-		vspPtr++;
-	}
+	double U1 = data->twiceU1 / 2.0;
 
 	if (data->normalApproximation) {
 		if (U1 > data->mu_U)
@@ -373,13 +583,21 @@ WiggleIterator * MWUReduction(Multiset * multi) {
 	MWUData * data = (MWUData *) calloc(1, sizeof(MWUData));
 	if (multi->count != 2 || multi->multis[0]->count == 0 || multi->multis[1]->count == 0) {
 		puts("The Mann-Whitney U function only works for two non-empty sets");
-		exit(1);
+		raiseError();
 	}	
 	data->multi = multi;
 	data->n1 = multi->multis[0]->count;
 	data->n2 = multi->multis[1]->count;
 	data->N = data->n1 + data->n2;
-	data->rankingTable = calloc(data->N, sizeof(ValueSetPair));
+	data->current = calloc(data->N, sizeof(double));
+	data->sorted[0] = calloc(data->n1, sizeof(double));
+	data->sorted[1] = calloc(data->n2, sizeof(double));
+	countMemory(MEMORY_REDUCERS, 2 * data->N * (long long) sizeof(double));
+	// Every input differs from the NaNs, so the first step sorts all the values
+	int index;
+	for (index = 0; index < data->N; index++)
+		data->current[index] = NAN;
+	data->nan_count = data->N;
 	if (true) {
 		// Ideally, tables could be used for small values of n1 and n2
 		data->normalApproximation = true;
@@ -388,3 +606,283 @@ WiggleIterator * MWUReduction(Multiset * multi) {
 	}
 	return newWiggleIterator(data, &MWUReductionPop, &MWUSeek, NAN);
 }
+
+////////////////////////////////////////////////////////
+// Permutation tests
+//
+// Empirical p-values, from the share of random relabellings
+// of the inputs whose statistic is at least as extreme as that
+// of the actual sets. The permutations are drawn once, from a
+// fixed seed so that the p-values are reproducible, and are
+// all evaluated at each position from the same row of values:
+// the statistics only depend on the sums of each set, which
+// are accumulated for all the permutations at once, input by
+// input, by multiplying its value with a column of 0/1 weights.
+// The Wilcoxon test sums ranks instead of values. The ranks
+// are kept in the order of the previous position, which is
+// insertion sorted again, in close to linear time when only a
+// few values changed.
+////////////////////////////////////////////////////////
+
+enum permutationTest {
+	PERMUTE_TTEST,
+	PERMUTE_FTEST,
+	PERMUTE_MWU
+};
+
+// Relative margin under which the statistic of a permutation ties with the actual one
+#define PERMUTATION_TIE 1e-9
+
+typedef struct permutationData_st {
+	Multiset * multi;
+	int test;
+	int N;
+	int groups;
+	int * sizes;
+	// Columns: the actual sets, then the permutations
+	int columns;
+	// Weight of input i in set g, 0 or 1, under each column c, at weights[(g * N + i) * columns + c],
+	// for all the sets but the last, whose sums are what remains of the totals
+	double * weights;
+	// Sums of the values of each set but the last, and sum of squares of the first, for each column
+	double * sums;
+	double * sumSqs;
+	// Wilcoxon test: inputs by increasing value, and their ranks, ties sharing their mean rank
+	int * order;
+	double * ranks;
+} PermutationData;
+
+// xorshift64*, enough to shuffle labels
+static unsigned long long nextPermutationRandom(unsigned long long * state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static void drawPermutations(PermutationData * data) {
+	unsigned char * labels = (unsigned char *) malloc(data->N);
+	unsigned long long state = 88172645463325252ULL;
+	int group, index, column;
+
+	for (column = 0; column < data->columns; column++) {
+		int input = 0;
+		for (group = 0; group < data->groups; group++)
+			for (index = 0; index < data->sizes[group]; index++)
+				labels[input++] = group;
+		// Fisher-Yates, the first column keeping the actual sets
+		if (column > 0) {
+			for (index = data->N - 1; index > 0; index--) {
+				int other = nextPermutationRandom(&state) % (index + 1);
+				unsigned char tmp = labels[index];
+				labels[index] = labels[other];
+				labels[other] = tmp;
+			}
+		}
+		for (group = 0; group < data->groups - 1; group++)
+			for (index = 0; index < data->N; index++)
+				data->weights[(group * data->N + index) * data->columns + column] = labels[index] == group;
+	}
+	free(labels);
+}
+
+static void sumPermutations(PermutationData * data, const double * values) {
+	int columns = data->columns;
+	int group, index, column;
+
+	memset(data->sums, 0, (data->groups - 1) * columns * sizeof(double));
+	memset(data->sumSqs, 0, columns * sizeof(double));
+	for (group = 0; group < data->groups - 1; group++) {
+		double * sums = data->sums + group * columns;
+		for (index = 0; index < data->N; index++) {
+			const double * weights = data->weights + (group * data->N + index) * columns;
+			double value = values[index];
+			for (column = 0; column < columns; column++)
+				sums[column] += weights[column] * value;
+			if (group == 0 && data->test == PERMUTE_TTEST) {
+				double square = value * value;
+				for (column = 0; column < columns; column++)
+					data->sumSqs[column] += weights[column] * square;
+			}
+		}
+	}
+}
+
+static void rankPermutationValues(PermutationData * data, const double * values) {
+	int * order = data->order;
+	int index, tie;
+
+	for (index = 1; index < data->N; index++) {
+		int input = order[index];
+		int slot = index;
+		while (slot > 0 && values[order[slot - 1]] > values[input]) {
+			order[slot] = order[slot - 1];
+			slot--;
+		}
+		order[slot] = input;
+	}
+	for (index = 0; index < data->N; index = tie) {
+		for (tie = index + 1; tie < data->N && values[order[tie]] == values[order[index]]; tie++)
+			;
+		// Ranks from 1, the mean of index + 1 to tie
+		double rank = (index + 1 + tie) / 2.0;
+		int i;
+		for (i = index; i < tie; i++)
+			data->ranks[order[i]] = rank;
+	}
+}
+
+// How extreme the statistic of a column is, NaN if it cannot be computed
+static double permutationScore(PermutationData * data, int column, double total, double totalSq) {
+	int columns = data->columns;
+
+	if (data->test == PERMUTE_TTEST) {
+		int count1 = data->sizes[0], count2 = data->sizes[1];
+		double mean1 = data->sums[column] / count1;
+		double mean2 = (total - data->sums[column]) / count2;
+		double var1 = data->sumSqs[column] / count1 - mean1 * mean1;
+		double var2 = (totalSq - data->sumSqs[column]) / count2 - mean2 * mean2;
+		if (var1 + var2 <= 0)
+			return NAN;
+		return fabs(mean1 - mean2) / sqrt(var1 / count1 + var2 / count2);
+	} else if (data->test == PERMUTE_FTEST) {
+		double mean = total / data->N;
+		double inter = 0, intra = totalSq, rest = total;
+		int group;
+		for (group = 0; group < data->groups; group++) {
+			double sum = group < data->groups - 1 ? data->sums[group * columns + column] : rest;
+			rest -= sum;
+			inter += data->sizes[group] * (sum / data->sizes[group] - mean) * (sum / data->sizes[group] - mean);
+			intra -= sum * sum / data->sizes[group];
+		}
+		if (intra <= 0)
+			return NAN;
+		return (inter / (data->groups - 1)) / (intra / (data->N - data->groups));
+	} else {
+		int count1 = data->sizes[0];
+		double U1 = data->sums[column] - count1 * (count1 + 1) / 2.0;
+		return fabs(U1 - count1 * (double) data->sizes[1] / 2);
+	}
+}
+
+static void PermutationReductionPop(WiggleIterator * wi) {
+	PermutationData * data = (PermutationData *) wi->data;
+	Multiset * multi = data->multi;
+	const double * values = multi->row;
+	double total = 0, totalSq = 0, observed;
+	int index, column, extreme = 0;
+
+	if (wi->done)
+		return;
+	while (!multi->done && (!multi->inplay[0] || !multi->inplay[1]))
+		popMultiset(multi);
+	if (multi->done) {
+		wi->done = true;
+		return;
+	}
+	wi->chrom = multi->chrom;
+	wi->start = multi->start;
+	wi->finish = multi->finish;
+
+	for (index = 0; index < data->N; index++) {
+		if (isnan(values[index]))
+			break;
+		total += values[index];
+		totalSq += values[index] * values[index];
+	}
+	if (index < data->N) {
+		wi->value = NAN;
+		popMultiset(multi);
+		return;
+	}
+
+	if (data->test == PERMUTE_MWU) {
+		rankPermutationValues(data, values);
+		values = data->ranks;
+		total = data->N * (data->N + 1) / 2.0;
+	}
+	sumPermutations(data, values);
+
+	observed = permutationScore(data, 0, total, totalSq);
+	if (isnan(observed))
+		wi->value = NAN;
+	else {
+		for (column = 1; column < data->columns; column++)
+			if (permutationScore(data, column, total, totalSq) >= observed * (1 - PERMUTATION_TIE))
+				extreme++;
+		wi->value = (1.0 + extreme) / data->columns;
+	}
+
+	popMultiset(multi);
+}
+
+static void PermutationReductionSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	PermutationData * data = (PermutationData *) wi->data;
+	seekMultiset(data->multi, chrom, start, finish);
+	pop(wi);
+}
+
+static WiggleIterator * newPermutationReduction(Multiset * multi, int test, int permutations) {
+	PermutationData * data = (PermutationData *) calloc(1, sizeof(PermutationData));
+	int index;
+	long long bytes;
+
+	if (permutations < 1) {
+		fprintf(stderr, "Invalid number of permutations: %i\n", permutations);
+		raiseError();
+	}
+	data->multi = multi;
+	data->test = test;
+	data->groups = multi->count;
+	data->columns = permutations + 1;
+	data->sizes = (int *) calloc(data->groups, sizeof(int));
+	for (index = 0; index < data->groups; index++) {
+		data->sizes[index] = multi->multis[index]->count;
+		data->N += data->sizes[index];
+	}
+	bytes = ((long long) (data->groups - 1) * data->N * data->columns + data->groups * data->columns) * sizeof(double);
+	if (!(data->weights = (double *) malloc((data->groups - 1) * (size_t) data->N * data->columns * sizeof(double)))) {
+		fprintf(stderr, "Could not allocate the weights of %i permutations\n", permutations);
+		raiseError();
+	}
+	data->sums = (double *) calloc((data->groups - 1) * data->columns, sizeof(double));
+	data->sumSqs = (double *) calloc(data->columns, sizeof(double));
+	data->order = (int *) malloc(data->N * sizeof(int));
+	data->ranks = (double *) malloc(data->N * sizeof(double));
+	for (index = 0; index < data->N; index++)
+		data->order[index] = index;
+	countMemory(MEMORY_REDUCERS, bytes);
+	drawPermutations(data);
+	return newWiggleIterator(data, &PermutationReductionPop, &PermutationReductionSeek, NAN);
+}
+
+WiggleIterator * TTestPermutationReduction(Multiset * multi, int permutations) {
+	if (multi->count != 2 || multi->multis[0]->count + multi->multis[1]->count < 3) {
+		puts("The t-test function only works for two sets with enough elements to compute variance");
+		raiseError();
+	}
+	return newPermutationReduction(multi, PERMUTE_TTEST, permutations);
+}
+
+WiggleIterator * FTestPermutationReduction(Multiset * multi, int permutations) {
+	int index;
+	if (multi->count < 2) {
+		puts("The F-test function needs at least two sets");
+		raiseError();
+	}
+	for (index = 0; index < multi->count; index++) {
+		if (multi->multis[index]->count == 0) {
+			puts("The F-test function only works for non-empty sets");
+			raiseError();
+		}
+	}
+	return newPermutationReduction(multi, PERMUTE_FTEST, permutations);
+}
+
+WiggleIterator * MWUPermutationReduction(Multiset * multi, int permutations) {
+	if (multi->count != 2 || multi->multis[0]->count == 0 || multi->multis[1]->count == 0) {
+		puts("The Mann-Whitney U function only works for two non-empty sets");
+		raiseError();
+	}
+	return newPermutationReduction(multi, PERMUTE_MWU, permutations);
+}
@@ -0,0 +1,153 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sharedBigFiles.h"
+#include "errors.h"
+
+// Kent library headers
+#include "bigBed.h"
+#include "bigWig.h"
+#include "udc.h"
+
+// Protects the list of open files and their reference counts
+static pthread_mutex_t sharedFilesMutex = PTHREAD_MUTEX_INITIALIZER;
+static SharedBigFile * sharedFiles = NULL;
+
+static void statSharedBigFile(SharedBigFile * file) {
+	struct stat info;
+
+	if (stat(file->filename, &info) == 0) {
+		file->modified = info.st_mtime;
+		file->size = info.st_size;
+	}
+}
+
+// The modification time sent by the server, mixed with the layout of the
+// header, which changes along with the contents even when the server sends
+// no modification time (FNV-1a)
+static unsigned long long remoteVersion(struct bbiFile * bwf) {
+	unsigned long long fields[7] = {udcUpdateTime(bwf->udc), bwf->chromTreeOffset, bwf->unzoomedDataOffset, bwf->unzoomedIndexOffset, bwf->totalSummaryOffset, bwf->uncompressBufSize, bwf->extensionOffset};
+	unsigned long long hash = 14695981039346656037ULL;
+	const unsigned char * byte = (const unsigned char *) fields;
+	size_t index;
+
+	for (index = 0; index < sizeof(fields); index++) {
+		hash ^= byte[index];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static SharedBigFile * findSharedBigFile(SharedBigFile * fresh) {
+	SharedBigFile * file;
+
+	for (file = sharedFiles; file; file = file->next)
+		if (file->bigBed == fresh->bigBed && file->modified == fresh->modified && file->size == fresh->size && strcmp(file->filename, fresh->filename) == 0)
+			return file;
+	return NULL;
+}
+
+static void freeSharedBigFile(SharedBigFile * file) {
+	if (file->chromList)
+		bbiChromInfoFreeList(&(file->chromList));
+	if (file->bwf)
+		bbiFileClose(&(file->bwf));
+	pthread_mutex_destroy(&(file->mutex));
+	free(file->filename);
+	free(file);
+}
+
+// The header is read without holding any lock, as the Kent library bails 
+// out on unreadable files. Two readers racing to open a same file may both
+// read it, the loser then drops its copy.
+SharedBigFile * openSharedBigFile(const char * filename, bool bigBed) {
+	SharedBigFile * fresh = (SharedBigFile *) calloc(1, sizeof(SharedBigFile));
+	SharedBigFile * file;
+
+	fresh->filename = strdup(filename);
+	fresh->bigBed = bigBed;
+	statSharedBigFile(fresh);
+
+	pthread_mutex_lock(&sharedFilesMutex);
+	if ((file = findSharedBigFile(fresh)))
+		file->references++;
+	pthread_mutex_unlock(&sharedFilesMutex);
+	if (file) {
+		freeSharedBigFile(fresh);
+		return file;
+	}
+
+	fresh->bwf = bigBed ? bigBedFileOpen(fresh->filename) : bigWigFileOpen(fresh->filename);
+	bbiAttachUnzoomedCir(fresh->bwf);
+	fresh->chromList = bbiChromList(fresh->bwf);
+	if (strstr(filename, "://"))
+		fresh->version = remoteVersion(fresh->bwf);
+	// Older files have no total summary, and computing one would read a zoom level
+	if (!bigBed && fresh->bwf->totalSummaryOffset) {
+		struct bbiSummaryElement total = bbiTotalSummary(fresh->bwf);
+		fresh->hasValueRange = total.validCount > 0;
+		fresh->minValue = total.minVal;
+		fresh->maxValue = total.maxVal;
+	}
+	pthread_mutex_init(&(fresh->mutex), NULL);
+	fresh->references = 1;
+
+	pthread_mutex_lock(&sharedFilesMutex);
+	if ((file = findSharedBigFile(fresh)))
+		file->references++;
+	else {
+		fresh->next = sharedFiles;
+		sharedFiles = fresh;
+	}
+	pthread_mutex_unlock(&sharedFilesMutex);
+	if (file) {
+		freeSharedBigFile(fresh);
+		return file;
+	}
+	return fresh;
+}
+
+void closeSharedBigFile(SharedBigFile * file) {
+	SharedBigFile ** previous;
+	bool last;
+
+	pthread_mutex_lock(&sharedFilesMutex);
+	if ((last = --file->references == 0)) {
+		for (previous = &sharedFiles; *previous != file; previous = &((*previous)->next))
+			;
+		*previous = file->next;
+	}
+	pthread_mutex_unlock(&sharedFilesMutex);
+	if (last)
+		freeSharedBigFile(file);
+}
+
+struct fileOffsetSize * sharedBigFileBlocks(SharedBigFile * file, char * chrom, bits32 start, bits32 end) {
+	struct fileOffsetSize * blocks;
+
+	lockUntilError(&(file->mutex));
+	blocks = bbiOverlappingBlocks(file->bwf, file->bwf->unzoomedCir, chrom, start, end, NULL);
+	unlockUntilError(&(file->mutex));
+	return blocks;
+}
+
+void summarizeSharedBigFile(SharedBigFile * file, char * chrom, bits32 start, bits32 end, int count, struct bbiSummaryElement * summaries) {
+	lockUntilError(&(file->mutex));
+	bigWigSummaryArrayExtended(file->bwf, chrom, start, end, count, summaries);
+	unlockUntilError(&(file->mutex));
+}
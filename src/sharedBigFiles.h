@@ -0,0 +1,68 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SHARED_BIG_FILES_H_
+#define _SHARED_BIG_FILES_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "wiggletools.h"
+
+// Kent library headers
+#include "common.h"
+#include "bbiFile.h"
+
+// Headers of BigWig and BigBed files, shared by their readers
+//
+// All the readers of a file within the process, e.g. the readers of each
+// region with --threads, share one bbiFile: its header, zoom levels,
+// chromosome list and R-tree index are read once, and not modified
+// afterwards. The file handle of the bbiFile is only used under the lock
+// of the shared file, for index lookups and zoom summaries; each reader 
+// reads its data blocks through a handle of its own. The shared file is 
+// closed with its last reader.
+//
+// A local file modified since it was opened is opened again rather than
+// shared, as the server keeps readers across programs.
+
+typedef struct sharedBigFile_st {
+	char * filename;
+	bool bigBed;
+	struct bbiFile * bwf;
+	// Chromosomes, as listed in the B+ tree
+	struct bbiChromInfo * chromList;
+	// BigWig files: bounds of the values, from the total summary
+	bool hasValueRange;
+	double minValue, maxValue;
+	// Local files: state when opened
+	time_t modified;
+	off_t size;
+	// Remote files: stamp of the copy on the server, see blockCache.h
+	unsigned long long version;
+	int references;
+	// Serialises the uses of the file handle of bwf
+	pthread_mutex_t mutex;
+	struct sharedBigFile_st * next;
+} SharedBigFile;
+
+SharedBigFile * openSharedBigFile(const char * filename, bool bigBed);
+void closeSharedBigFile(SharedBigFile * file);
+// Data blocks overlapping a region, see bbiOverlappingBlocks
+struct fileOffsetSize * sharedBigFileBlocks(SharedBigFile * file, char * chrom, bits32 start, bits32 end);
+// Summaries of count bins over a region, see bigWigSummaryArrayExtended
+void summarizeSharedBigFile(SharedBigFile * file, char * chrom, bits32 start, bits32 end, int count, struct bbiSummaryElement * summaries);
+
+#endif
@@ -15,11 +15,14 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 // Local header
 #include "wiggleIterator.h"
 #include "multiplexer.h"
 #include "multiSet.h"
+#include "partials.h"
+#include "exactSum.h"
 
 //////////////////////////////////////////////////////
 // Generic function for all statistics
@@ -34,71 +37,42 @@ typedef struct statData {
 	WiggleIterator * source;
 } StatData;
 
-static void StatisticSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+// Seeking restarts the computation from scratch
+static void SumSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	StatData * data = (StatData *) wi->data;
+	data->res = 0;
 	seek(data->source, chrom, start, finish);
 	pop(wi);
 }
 
-static WiggleIterator * newStatisticIterator(void * data, void (*popFunction)(WiggleIterator *), void (*seekFunction)(WiggleIterator *, const char *, int, int), double default_value, WiggleIterator * source) {
+// Batched pops: the current record, already counted, is pushed onto the
+// batch, then the source fills the rest. Returns the index of the first 
+// record which is still to be counted. The caller pops the iterator 
+// afterwards, which counts the next record of the source, as pop does,
+// so the records are counted in the same order either way.
+static int StatisticFillBatch(WiggleIterator * wi, WiggleIterator * source, SpanBatch * batch) {
+	pushSpanBatch(batch, wi);
+	int first = batch->count;
+	popBatch(source, batch);
+	return first;
+}
+
+// popBatch is optional
+static WiggleIterator * newStatisticIterator(void * data, void (*popFunction)(WiggleIterator *), void (*popBatchFunction)(WiggleIterator *, SpanBatch *), void (*seekFunction)(WiggleIterator *, const char *, int, int), double default_value, WiggleIterator * source) {
 	WiggleIterator * new = newWiggleIterator(data, popFunction, seekFunction, default_value);
+	new->popBatch = popBatchFunction;
 	new->append = source;
+	// The records are passed through
+	new->finite = source->finite;
+	new->integral = source->integral;
 	return new;
 }
 
 //////////////////////////////////////////////////////
-// Mean
-//////////////////////////////////////////////////////
-
-typedef struct meanData {
-	double res;
-	double sum;
-	double span;
-	WiggleIterator * source;
-} MeanData;
-
-static void MeanPop(WiggleIterator * wi) {
-	MeanData * data = (MeanData *) wi->data;
-
-	if (data->source->done) {
-		if (data->span > 0)
-			data->res = data->sum / data->span;
-		wi->done = true;
-		return;
-	}
-
-	wi->chrom = data->source->chrom;
-	wi->start = data->source->start;
-	wi->finish = data->source->finish;
-	wi->value = data->source->value;
-
-	if (!isnan(wi->value)) {
-		data->sum += (wi->finish - wi->start) * wi->value;
-		data->span += (wi->finish - wi->start);
-	}
-	pop(data->source);
-}
-
-static void MeanSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
-	MeanData * data = (MeanData *) wi->data;
-	seek(data->source, chrom, start, finish);
-	pop(wi);
-}
-
-WiggleIterator * MeanIntegrator(WiggleIterator * wi) {
-	MeanData * data = (MeanData *) calloc(1, sizeof(MeanData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->sum = 0;
-	data->span = 0;
-	data->res = NAN;
-	return newStatisticIterator(data, MeanPop, MeanSeek, wi->default_value, wi);
-}
-
-//////////////////////////////////////////////////////
-// AUC 
+// Span 
 //////////////////////////////////////////////////////
 
-static void AUCPop(WiggleIterator * wi) {
+static void SpanPop(WiggleIterator * wi) {
 	StatData * data = (StatData *) wi->data;
 
 	if (data->source->done) {
@@ -112,86 +86,170 @@ static void AUCPop(WiggleIterator * wi) {
 	wi->value = data->source->value;
 
 	if (!isnan(wi->value))
-		data->res += (wi->finish - wi->start) * wi->value;
+		data->res += (wi->finish - wi->start);
 
 	pop(data->source);
 }
 
-WiggleIterator * AUCIntegrator(WiggleIterator * wi) {
-	StatData * data = (StatData *) calloc(1, sizeof(StatData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = 0;
-	return newStatisticIterator(data, AUCPop, StatisticSeek, wi->default_value, wi);
-}
-
-//////////////////////////////////////////////////////
-// Span 
-//////////////////////////////////////////////////////
-
-static void SpanPop(WiggleIterator * wi) {
+static void SpanPopBatch(WiggleIterator * wi, SpanBatch * batch) {
 	StatData * data = (StatData *) wi->data;
-
-	if (data->source->done) {
-		wi->done = true;
-		return;
+	int index = StatisticFillBatch(wi, data->source, batch);
+	if (data->source->finite) {
+		for (; index < batch->count; index++)
+			data->res += (batch->finishes[index] - batch->starts[index]);
+	} else {
+		for (; index < batch->count; index++)
+			if (!isnan(batch->values[index]))
+				data->res += (batch->finishes[index] - batch->starts[index]);
 	}
-
-	wi->chrom = data->source->chrom;
-	wi->start = data->source->start;
-	wi->finish = data->source->finish;
-	wi->value = data->source->value;
-
-	if (!isnan(wi->value))
-		data->res += (wi->finish - wi->start);
-
-	pop(data->source);
+	pop(wi);
 }
 
 WiggleIterator * SpanIntegrator(WiggleIterator * wi) {
 	StatData * data = (StatData *) calloc(1, sizeof(StatData));
 	data->source = NonOverlappingWiggleIterator(wi);
 	data->res = 0;
-	return newStatisticIterator(data, SpanPop, StatisticSeek, wi->default_value, wi);
+	return newStatisticIterator(data, SpanPop, SpanPopBatch, SumSeek, wi->default_value, wi);
 }
 
 //////////////////////////////////////////////////////
-// Max 
+// Moments
+//
+// AUC, meanI, varI, stddevI, CVI, maxI and minI share 
+// a single pass over the records. The first of them 
+// built over an iterator reads it, keeping the sums of
+// the values and of their squares, each weighted by the
+// length of its record, and the extrema, as far as the
+// statistics stacked on it
+// require. The others stacked directly on it are views,
+// which pass its records through and take their result
+// from it when it is done.
 //////////////////////////////////////////////////////
 
-static void MaxPop(WiggleIterator * wi) {
-	StatData * data = (StatData *) wi->data;
+typedef enum {MOMENT_AUC, MOMENT_MEAN, MOMENT_VARIANCE, MOMENT_STDDEV, MOMENT_CV, MOMENT_MAX, MOMENT_MIN} MomentKind;
 
-	if (data->source->done) {
-		wi->done = true;
-		return;
-	}
+typedef struct momentsData_st {
+	double res;
+	MomentKind kind;
+	// Next view of the same core
+	struct momentsData_st * nextView;
+	// Of the core only
+	WiggleIterator * source;
+	bool sums, deviations, extrema;
+	// The source holds no NaN
+	bool finite;
+	long count;
+	// Exact, so that results do not depend on how the
+	// records were split between threads or shards
+	ExactSum sum, squares;
+	double max, min;
+	struct momentsData_st * views;
+	// Of the views only
+	WiggleIterator * core;
+	bool started;
+} MomentsData;
+
+static void resetMoments(MomentsData * data) {
+	MomentsData * view;
+
+	data->count = 0;
+	clearExactSum(&data->sum);
+	clearExactSum(&data->squares);
+	data->max = -INFINITY;
+	data->min = INFINITY;
+	for (view = data; view; view = view->nextView)
+		view->res = view->kind == MOMENT_AUC ? 0 : NAN;
+}
 
-	wi->chrom = data->source->chrom;
-	wi->start = data->source->start;
-	wi->finish = data->source->finish;
-	wi->value = data->source->value;
+// Returns whether the core was not keeping them yet
+static bool requireMoments(MomentsData * core, MomentKind kind) {
+	bool * flag;
+	bool required;
 
-	if (!isnan(wi->value) && (isnan(data->res) || wi->value > data->res))
-		data->res = wi->value;
+	if (kind == MOMENT_AUC || kind == MOMENT_MEAN)
+		flag = &core->sums;
+	else if (kind == MOMENT_MAX || kind == MOMENT_MIN)
+		flag = &core->extrema;
+	else
+		flag = &core->deviations;
+	required = !*flag;
+	*flag = true;
+	return required;
+}
 
-	pop(data->source);
+// S2 - S1^2 / n, with S1 and S1^2 / n in double-double
+// arithmetic, so that only the result is rounded
+static double squaredDeviations(MomentsData * core) {
+	ExactSum residual;
+	double n = core->count, high, low, meanHigh, meanLow, product;
+
+	if (core->count == 0)
+		return 0;
+	high = exactSumValue(&core->sum);
+	residual = core->sum;
+	addExactProduct(&residual, -high, 1);
+	low = exactSumValue(&residual);
+	meanHigh = high / n;
+	meanLow = (fma(-meanHigh, n, high) + low) / n;
+	product = high * meanHigh;
+
+	residual = core->squares;
+	addExactProduct(&residual, -product, 1);
+	addExactProduct(&residual, -(fma(high, meanHigh, -product) + high * meanLow + low * meanHigh), 1);
+	return exactSumValue(&residual);
 }
 
-WiggleIterator * MaxIntegrator(WiggleIterator * wi) {
-	StatData * data = (StatData *) calloc(1, sizeof(StatData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = NAN;
-	return newStatisticIterator(data, MaxPop, StatisticSeek, wi->default_value, wi);
+static double momentResult(MomentsData * core, MomentKind kind) {
+	switch (kind) {
+	case MOMENT_AUC:
+		return exactSumValue(&core->sum);
+	case MOMENT_MEAN:
+		return core->count > 0 ? exactSumValue(&core->sum) / core->count : NAN;
+	case MOMENT_VARIANCE:
+		return squaredDeviations(core) / (core->count - 1);
+	case MOMENT_STDDEV:
+		return sqrt(squaredDeviations(core) / (core->count - 1));
+	case MOMENT_CV:
+		return sqrt(squaredDeviations(core) / (core->count - 1)) / (exactSumValue(&core->sum) / core->count);
+	case MOMENT_MAX:
+		return core->count > 0 ? core->max : NAN;
+	default:
+		return core->count > 0 ? core->min : NAN;
+	}
 }
 
-//////////////////////////////////////////////////////
-// Min 
-//////////////////////////////////////////////////////
+static void finishMoments(MomentsData * core) {
+	MomentsData * view;
+	for (view = core; view; view = view->nextView)
+		view->res = momentResult(core, view->kind);
+}
 
-static void MinPop(WiggleIterator * wi) {
-	StatData * data = (StatData *) wi->data;
+static void addMoment(MomentsData * data, double value, int length) {
+	if (!data->finite && isnan(value))
+		return;
+	data->count += length;
+	// Deviations also need the sum
+	if (data->sums || data->deviations)
+		addExactProduct(&data->sum, value, length);
+	if (data->deviations) {
+		// Dekker's product, the square is the sum of both terms
+		double split = 134217729.0 * value;
+		double high = split - (split - value), low = value - high;
+		double square = value * value;
+		addExactProduct(&data->squares, square, length);
+		addExactProduct(&data->squares, ((high * high - square) + 2 * high * low) + low * low, length);
+	}
+	if (data->extrema) {
+		data->max = value > data->max ? value : data->max;
+		data->min = value < data->min ? value : data->min;
+	}
+}
+
+static void MomentsPop(WiggleIterator * wi) {
+	MomentsData * data = (MomentsData *) wi->data;
 
 	if (data->source->done) {
+		finishMoments(data);
 		wi->done = true;
 		return;
 	}
@@ -200,139 +258,135 @@ static void MinPop(WiggleIterator * wi) {
 	wi->start = data->source->start;
 	wi->finish = data->source->finish;
 	wi->value = data->source->value;
-
-	if (!isnan(wi->value) && (isnan(data->res) || wi->value < data->res))
-		data->res = wi->value;
-
+	addMoment(data, wi->value, wi->finish - wi->start);
 	pop(data->source);
 }
 
-WiggleIterator * MinIntegrator(WiggleIterator * wi) {
-	StatData * data = (StatData *) calloc(1, sizeof(StatData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = NAN;
-	return newStatisticIterator(data, MinPop, StatisticSeek, wi->default_value, wi);
+static void MomentsPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	MomentsData * data = (MomentsData *) wi->data;
+	int index = StatisticFillBatch(wi, data->source, batch);
+	for (; index < batch->count; index++)
+		addMoment(data, batch->values[index], batch->finishes[index] - batch->starts[index]);
+	pop(wi);
 }
 
-//////////////////////////////////////////////////////
-// Variance
-// See Technical supplement for explanations
-//////////////////////////////////////////////////////
-
-typedef struct varianceData {
-	double res;
-	WiggleIterator * source;
-	double T;
-	double sum;
-	long count;
-} VarianceData;
-
-static void VarianceCorePop(WiggleIterator * wi, VarianceData * data) {
-	wi->chrom = data->source->chrom;
-	wi->start = data->source->start;
-	wi->finish = data->source->finish;
-	wi->value = data->source->value;
-
-	if (isnan(wi->value))
-		return;
-
-	int length = wi->finish - wi->start;
-	if (data->count) {
-		double old_mean = data->sum / data->count;
-		double new_mean = data->sum / (data->count * length);
-		double delta_T = old_mean * new_mean - new_mean * 2 * wi->value + ((double) data->count / (data->count + length)) * wi->value * wi->value;
-		data->T += delta_T * length;
-	}
-	data->count += length;
-	data->sum += length * wi->value;
-	
-	pop(data->source);
+static void MomentsSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	resetMoments((MomentsData *) wi->data);
+	seek(((MomentsData *) wi->data)->source, chrom, start, finish);
+	pop(wi);
 }
 
-static void VariancePop(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) wi->data;
-
-	if (data->source->done) {
-		wi->done = true;
-		data->res = data->T / (data->count - 1);
-		return;
-	}
+// A view stands on the current record of its core
+static void copyMomentsRecord(WiggleIterator * wi, WiggleIterator * core) {
+	wi->chrom = core->chrom;
+	wi->start = core->start;
+	wi->finish = core->finish;
+	wi->value = core->value;
+	wi->done = core->done;
+}
 
-	VarianceCorePop(wi, data);
+// The first pop, when the view is created, does not move the core
+static void MomentsViewPop(WiggleIterator * wi) {
+	MomentsData * data = (MomentsData *) wi->data;
+	if (data->started)
+		pop(data->core);
+	data->started = true;
+	copyMomentsRecord(wi, data->core);
 }
 
-static void VarianceSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
-	VarianceData * data = (VarianceData *) wi->data;
-	seek(data->source, chrom, start, finish);
-	pop(wi);
+static void MomentsViewPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	WiggleIterator * core = ((MomentsData *) wi->data)->core;
+	popBatch(core, batch);
+	copyMomentsRecord(wi, core);
 }
 
-WiggleIterator * VarianceIntegrator(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) calloc(1, sizeof(VarianceData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = NAN;
-	return newStatisticIterator(data, VariancePop, VarianceSeek, wi->default_value, wi);
+static void MomentsViewSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	WiggleIterator * core = ((MomentsData *) wi->data)->core;
+	seek(core, chrom, start, finish);
+	copyMomentsRecord(wi, core);
 }
 
-//////////////////////////////////////////////////////
-// Standard deviation 
-//////////////////////////////////////////////////////
+static bool isMomentsIterator(WiggleIterator * wi) {
+	return wi->pop == MomentsPop || wi->pop == MomentsViewPop;
+}
 
-static void StandardDeviationPop(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) wi->data;
+static WiggleIterator * newMomentsCore(WiggleIterator * source, MomentKind kind, WiggleIterator * append) {
+	MomentsData * data = (MomentsData *) calloc(1, sizeof(MomentsData));
+	data->kind = kind;
+	data->source = source;
+	data->finite = source->finite;
+	requireMoments(data, kind);
+	resetMoments(data);
+	return newStatisticIterator(data, MomentsPop, MomentsPopBatch, MomentsSeek, append->default_value, append);
+}
 
-	if (data->source->done) {
-		wi->done = true;
-		data->res = data->T / (data->count - 1);
-		data->res = sqrt(data->res);
-		return;
+static WiggleIterator * MomentsIntegrator(WiggleIterator * wi, MomentKind kind) {
+	MomentsData * data, * core;
+	WiggleIterator * coreIterator;
+
+	if (!isMomentsIterator(wi))
+		return newMomentsCore(NonOverlappingWiggleIterator(wi), kind, wi);
+
+	coreIterator = wi->pop == MomentsPop ? wi : ((MomentsData *) wi->data)->core;
+	core = (MomentsData *) coreIterator->data;
+	data = (MomentsData *) calloc(1, sizeof(MomentsData));
+	data->kind = kind;
+	data->res = kind == MOMENT_AUC ? 0 : NAN;
+	data->core = coreIterator;
+	data->nextView = core->nextView;
+	core->nextView = data;
+	// Views are stacked before the chain is run, so the core only counted its current record
+	if (requireMoments(core, kind)) {
+		resetMoments(core);
+		if (!coreIterator->done)
+			addMoment(core, coreIterator->value, coreIterator->finish - coreIterator->start);
 	}
+	// Empty inputs are done from the start
+	if (coreIterator->done)
+		finishMoments(core);
+	return newStatisticIterator(data, MomentsViewPop, MomentsViewPopBatch, MomentsViewSeek, wi->default_value, wi);
+}
 
-	VarianceCorePop(wi, data);
+WiggleIterator * AUCIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_AUC);
 }
 
-WiggleIterator * StandardDeviationIntegrator(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) calloc(1, sizeof(VarianceData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = NAN;
-	return newStatisticIterator(data, StandardDeviationPop, VarianceSeek, wi->default_value, wi);
+WiggleIterator * MeanIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_MEAN);
 }
 
-//////////////////////////////////////////////////////
-// Coefficient of Variation
-//////////////////////////////////////////////////////
+WiggleIterator * VarianceIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_VARIANCE);
+}
 
-static void CoefficientOfVariationPop(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) wi->data;
+WiggleIterator * StandardDeviationIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_STDDEV);
+}
 
-	if (data->source->done) {
-		wi->done = true;
-		data->res = data->T / (data->count - 1);
-		data->res = sqrt(data->res);
-		data->res /= (data->sum / data->count);
-		return;
-	}
+WiggleIterator * CoefficientOfVariationIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_CV);
+}
 
-	VarianceCorePop(wi, data);
+WiggleIterator * MaxIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_MAX);
 }
 
-WiggleIterator * CoefficientOfVariationIntegrator(WiggleIterator * wi) {
-	VarianceData * data = (VarianceData *) calloc(1, sizeof(VarianceData));
-	data->source = NonOverlappingWiggleIterator(wi);
-	data->res = NAN;
-	return newStatisticIterator(data, CoefficientOfVariationPop, VarianceSeek, wi->default_value, wi);
+WiggleIterator * MinIntegrator(WiggleIterator * wi) {
+	return MomentsIntegrator(wi, MOMENT_MIN);
 }
 
 //////////////////////////////////////////////////////
 // Pearson Correlation
 //////////////////////////////////////////////////////
 
+// Co-moments are updated as the variance above
+
 typedef struct pearsonData {
 	double res;
 	Multiplexer * multi;
-	int count;
-	double sum_X;
-	double sum_Y;
+	long count;
+	double mean_X;
+	double mean_Y;
 	double T_XX;
 	double T_XY;
 	double T_YY;
@@ -340,6 +394,10 @@ typedef struct pearsonData {
 
 static void PearsonSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	PearsonData * data = (PearsonData *) wi->data;
+	data->count = 0;
+	data->mean_X = data->mean_Y = 0;
+	data->T_XX = data->T_XY = data->T_YY = 0;
+	data->res = NAN;
 	seekMultiplexer(data->multi, chrom, start, finish);
 	pop(wi);
 }
@@ -373,20 +431,14 @@ static void PearsonPop(WiggleIterator * wi) {
 		Y = multi->iters[1]->default_value;
 
 	int length = (multi->finish - multi->start);
-	if (data->count) {
-		double old_mean_X = data->sum_X / data->count;
-		double new_mean_X = data->sum_X / (data->count + length);
-		double old_mean_Y = data->sum_Y / data->count;
-		double new_mean_Y = data->sum_Y / (data->count + length);
-		double scaling_ratio = (double) data->count / (data->count + length);
-
-		data->T_XY += (new_mean_X * old_mean_Y + scaling_ratio * X * Y - new_mean_X * Y - new_mean_Y * X) * length;
-		data->T_XX += (new_mean_X * (old_mean_X - 2 * X) + scaling_ratio * X * X) * length;
-		data->T_YY += (new_mean_Y * (old_mean_Y - 2 * Y) + scaling_ratio * Y * Y) * length;
-	}
+	double delta_X = X - data->mean_X;
+	double delta_Y = Y - data->mean_Y;
 	data->count += length;
-	data->sum_X += X * length;
-	data->sum_Y += Y * length;
+	data->mean_X += delta_X * length / data->count;
+	data->mean_Y += delta_Y * length / data->count;
+	data->T_XX += delta_X * (X - data->mean_X) * length;
+	data->T_XY += delta_X * (Y - data->mean_Y) * length;
+	data->T_YY += delta_Y * (Y - data->mean_Y) * length;
 	popMultiplexer(multi);
 }
 
@@ -397,7 +449,7 @@ WiggleIterator * PearsonIntegrator(WiggleIterator * iterX, WiggleIterator * iter
 	iters[1] = NonOverlappingWiggleIterator(iterY);
 	data->multi = newMultiplexer(iters, 2, false);
 	data->res = NAN;
-	return newStatisticIterator(data, PearsonPop, PearsonSeek, iterY->default_value, iterY);
+	return newStatisticIterator(data, PearsonPop, NULL, PearsonSeek, iterY->default_value, iterY);
 }
 
 ////////////////////////////////////////////////////////
@@ -409,9 +461,9 @@ typedef struct ndpearsonData_st {
 	WiggleIterator * source;
 	Multiset * multi;
 	int rank;
-	int count;
-	double * sum_X;
-	double * sum_Y;
+	long count;
+	double * mean_X;
+	double * mean_Y;
 	double T_XX;
 	double T_XY;
 	double T_YY;
@@ -419,6 +471,12 @@ typedef struct ndpearsonData_st {
 
 void NDPearsonSeek(WiggleIterator * iter, const char * chrom, int start, int finish) {
 	NDPearsonData * data = (NDPearsonData* ) iter->data;
+	int dim;
+	data->count = 0;
+	for (dim = 0; dim < data->rank; dim++)
+		data->mean_X[dim] = data->mean_Y[dim] = 0;
+	data->T_XX = data->T_XY = data->T_YY = 0;
+	data->res = NAN;
 	seekMultiset(data->multi, chrom, start, finish);
 	pop(iter);
 }
@@ -442,37 +500,22 @@ void NDPearsonPop(WiggleIterator * wi) {
 	wi->finish = multi->finish;
 
 	int length = (multi->finish - multi->start);
-	double scaling_ratio = (double) data->count / (data->count + length);
 	int dim;
+	data->count += length;
+	const double * X = multi->row;
+	const double * Y = multi->row + multi->offsets[1];
 	for (dim = 0; dim < data->rank; dim++) {
-		double Xi, Yi;
-
-		if (multi->inplay[0])
-			Xi = multi->values[0][dim];
-		else
-			Xi = multi->multis[0]->iters[dim]->default_value;
-
-		if (multi->inplay[1])
-			Yi = multi->values[1][dim];
-		else
-			Yi = multi->multis[1]->iters[dim]->default_value;
-
-		if (data->count) {
-			double old_mean_Xi = data->sum_X[dim] / data->count;
-			double new_mean_Xi = data->sum_X[dim] / (data->count + length);
-			double old_mean_Yi = data->sum_Y[dim] / data->count;
-			double new_mean_Yi = data->sum_Y[dim] / (data->count + length);
-
-			data->T_XY += (new_mean_Xi * old_mean_Yi + scaling_ratio * Xi * Yi - new_mean_Xi * Yi - new_mean_Yi * Xi) * length;
-			data->T_XX += (new_mean_Xi * (old_mean_Xi - 2 * Xi) + scaling_ratio * Xi * Xi) * length;
-			data->T_YY += (new_mean_Yi * (old_mean_Yi - 2 * Yi) + scaling_ratio * Yi * Yi) * length;
-		}
-		data->sum_X[dim] += Xi * length;
-		data->sum_Y[dim] += Yi * length;
+		double Xi = X[dim];
+		double Yi = Y[dim];
+		double delta_Xi = Xi - data->mean_X[dim];
+		double delta_Yi = Yi - data->mean_Y[dim];
+		data->mean_X[dim] += delta_Xi * length / data->count;
+		data->mean_Y[dim] += delta_Yi * length / data->count;
+		data->T_XX += delta_Xi * (Xi - data->mean_X[dim]) * length;
+		data->T_XY += delta_Xi * (Yi - data->mean_Y[dim]) * length;
+		data->T_YY += delta_Yi * (Yi - data->mean_Y[dim]) * length;
 	}
 
-	data->count += length;
-
 	// Update inputs
 	popMultiset(multi);
 }
@@ -480,15 +523,654 @@ void NDPearsonPop(WiggleIterator * wi) {
 WiggleIterator * NDPearsonIntegrator(Multiset * multi) {
 	if (multi->count != 2 || multi->multis[0]->count != multi->multis[1]->count) {
 		fprintf(stderr, "Incorrect number of input tracks to N-dimensional Pearson correlation!\n");
-		exit(1);
+		raiseError();
 	}
 	NDPearsonData * data = (NDPearsonData *) calloc(1, sizeof(NDPearsonData));
 	data->multi = multi;
-	data->rank = multi->count;
-	data->sum_X = calloc(data->rank, sizeof(double));
-	data->sum_Y = calloc(data->rank, sizeof(double));
+	data->rank = multi->multis[0]->count;
+	data->mean_X = calloc(data->rank, sizeof(double));
+	data->mean_Y = calloc(data->rank, sizeof(double));
+	data->res = NAN;
+	return newStatisticIterator(data, NDPearsonPop, NULL, NDPearsonSeek, 0, multi->multis[0]->iters[0]);
+}
+
+//////////////////////////////////////////////////////
+// Quantile
+// t-digest of the values, each weighted by the length
+// of its record (Dunning & Ertl, 2019). Values are
+// buffered next to the centroids, then sorted and
+// merged into at most about COMPRESSION centroids,
+// finest at the tails. Digests merge by pooling their
+// centroids, so the memory is bounded whatever the 
+// size of the data.
+//////////////////////////////////////////////////////
+
+#define COMPRESSION 100
+#define CENTROID_CAPACITY (6 * COMPRESSION)
+
+typedef struct centroid_st {
+	double mean;
+	double weight;
+} Centroid;
+
+typedef struct quantileData_st {
+	double res;
+	WiggleIterator * source;
+	double quantile;
+	double min;
+	double max;
+	// Centroids, then the values buffered since the last compression
+	int merged;
+	int count;
+	Centroid centroids[CENTROID_CAPACITY];
+} QuantileData;
+
+static int compareCentroids(const void * A, const void * B) {
+	const Centroid * a = (const Centroid *) A;
+	const Centroid * b = (const Centroid *) B;
+	if (a->mean < b->mean)
+		return -1;
+	if (a->mean > b->mean)
+		return 1;
+	return 0;
+}
+
+// Scale function k1: centroids span at most one unit of k
+static double quantileScale(double q) {
+	return COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double inverseQuantileScale(double k) {
+	if (k >= COMPRESSION / 4.0)
+		return 1;
+	return (sin(k * 2 * M_PI / COMPRESSION) + 1) / 2;
+}
+
+static void compressDigest(QuantileData * data) {
+	Centroid * centroids = data->centroids;
+	double total = 0, before = 0, limit;
+	int i, last = 0;
+
+	if (data->merged == data->count)
+		return;
+
+	qsort(centroids, data->count, sizeof(Centroid), compareCentroids);
+	for (i = 0; i < data->count; i++)
+		total += centroids[i].weight;
+
+	limit = total * inverseQuantileScale(quantileScale(0) + 1);
+	for (i = 1; i < data->count; i++) {
+		double weight = centroids[last].weight + centroids[i].weight;
+		if (before + weight <= limit) {
+			centroids[last].mean += (centroids[i].mean - centroids[last].mean) * centroids[i].weight / weight;
+			centroids[last].weight = weight;
+		} else {
+			before += centroids[last].weight;
+			limit = total * inverseQuantileScale(quantileScale(before / total) + 1);
+			centroids[++last] = centroids[i];
+		}
+	}
+	data->merged = data->count = last + 1;
+}
+
+static void addToDigest(QuantileData * data, double value, double weight) {
+	if (data->count == CENTROID_CAPACITY)
+		compressDigest(data);
+	if (data->count == 0 || value < data->min)
+		data->min = value;
+	if (data->count == 0 || value > data->max)
+		data->max = value;
+	data->centroids[data->count].mean = value;
+	data->centroids[data->count].weight = weight;
+	data->count++;
+}
+
+// Interpolates between the centres of the centroids, and from the extreme values at both ends
+static double digestQuantile(QuantileData * data) {
+	Centroid * centroids = data->centroids;
+	double total = 0, target, before = 0;
+	int i;
+
+	compressDigest(data);
+	if (data->count == 0)
+		return NAN;
+	for (i = 0; i < data->count; i++)
+		total += centroids[i].weight;
+	target = data->quantile * total;
+
+	if (target <= centroids[0].weight / 2)
+		return data->min + (centroids[0].mean - data->min) * target / (centroids[0].weight / 2);
+	for (i = 0; i < data->count - 1; i++) {
+		double centre = before + centroids[i].weight / 2;
+		double next = before + centroids[i].weight + centroids[i+1].weight / 2;
+		if (target <= next)
+			return centroids[i].mean + (centroids[i+1].mean - centroids[i].mean) * (target - centre) / (next - centre);
+		before += centroids[i].weight;
+	}
+	before += centroids[i].weight / 2;
+	if (total > before)
+		return centroids[i].mean + (data->max - centroids[i].mean) * (target - before) / (total - before);
+	return data->max;
+}
+
+static void QuantilePop(WiggleIterator * wi) {
+	QuantileData * data = (QuantileData *) wi->data;
+
+	if (data->source->done) {
+		data->res = digestQuantile(data);
+		wi->done = true;
+		return;
+	}
+
+	wi->chrom = data->source->chrom;
+	wi->start = data->source->start;
+	wi->finish = data->source->finish;
+	wi->value = data->source->value;
+
+	if (!isnan(wi->value))
+		addToDigest(data, wi->value, wi->finish - wi->start);
+	pop(data->source);
+}
+
+static void QuantilePopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	QuantileData * data = (QuantileData *) wi->data;
+	int index = StatisticFillBatch(wi, data->source, batch);
+	for (; index < batch->count; index++)
+		if (!isnan(batch->values[index]))
+			addToDigest(data, batch->values[index], batch->finishes[index] - batch->starts[index]);
+	pop(wi);
+}
+
+static void QuantileSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	QuantileData * data = (QuantileData *) wi->data;
+	data->merged = data->count = 0;
+	data->res = NAN;
+	seek(data->source, chrom, start, finish);
+	pop(wi);
+}
+
+WiggleIterator * QuantileIntegrator(WiggleIterator * wi, double quantile) {
+	if (!(quantile >= 0 && quantile <= 1)) {
+		fprintf(stderr, "Quantiles are between 0 and 1, got %f\n", quantile);
+		raiseError();
+	}
+	QuantileData * data = (QuantileData *) calloc(1, sizeof(QuantileData));
+	data->source = NonOverlappingWiggleIterator(wi);
+	data->quantile = quantile;
 	data->res = NAN;
-	return newStatisticIterator(data, NDPearsonPop, NDPearsonSeek, 0, multi->multis[0]->iters[0]);
+	return newStatisticIterator(data, QuantilePop, QuantilePopBatch, QuantileSeek, wi->default_value, wi);
+}
+
+// Statistics lists hold unary creators, so each quantile gets 
+// one of a fixed set of creators
+#define QUANTILE_CREATORS 8
+
+static double creatorQuantiles[QUANTILE_CREATORS];
+static int creatorCount = 0;
+static pthread_mutex_t creatorMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define QUANTILE_CREATOR(INDEX) \
+static WiggleIterator * QuantileIntegrator##INDEX(WiggleIterator * wi) { \
+	return QuantileIntegrator(wi, creatorQuantiles[INDEX]); \
+}
+
+QUANTILE_CREATOR(0)
+QUANTILE_CREATOR(1)
+QUANTILE_CREATOR(2)
+QUANTILE_CREATOR(3)
+QUANTILE_CREATOR(4)
+QUANTILE_CREATOR(5)
+QUANTILE_CREATOR(6)
+QUANTILE_CREATOR(7)
+
+static WiggleIterator * (*quantileCreators[QUANTILE_CREATORS])(WiggleIterator *) = {QuantileIntegrator0, QuantileIntegrator1, QuantileIntegrator2, QuantileIntegrator3, QuantileIntegrator4, QuantileIntegrator5, QuantileIntegrator6, QuantileIntegrator7};
+
+WiggleIterator * (*quantileIntegratorCreator(double quantile))(WiggleIterator *) {
+	int index;
+
+	if (!(quantile >= 0 && quantile <= 1)) {
+		fprintf(stderr, "Quantiles are between 0 and 1, got %f\n", quantile);
+		raiseError();
+	}
+
+	pthread_mutex_lock(&creatorMutex);
+	for (index = 0; index < creatorCount; index++)
+		if (creatorQuantiles[index] == quantile)
+			break;
+	if (index == creatorCount && creatorCount < QUANTILE_CREATORS)
+		creatorQuantiles[creatorCount++] = quantile;
+	pthread_mutex_unlock(&creatorMutex);
+
+	if (index == QUANTILE_CREATORS) {
+		fprintf(stderr, "Cannot apply more than %i different quantiles\n", QUANTILE_CREATORS);
+		raiseError();
+	}
+	return quantileCreators[index];
+}
+
+//////////////////////////////////////////////////////
+// Merging statistics
+// Combines the results of the same statistic computed 
+// on disjoint regions, e.g. in parallel. 
+// Co-moments are merged as in Chan et al. (1979)
+//////////////////////////////////////////////////////
+
+static void mergeCoMoments(double * T, double n_A, double n_B, double delta_X, double delta_Y) {
+	if (n_A + n_B > 0)
+		*T += delta_X * delta_Y * n_A * n_B / (n_A + n_B);
+}
+
+// Mean of the union of two sets of n_A and n_B values
+static double mergeMeans(double mean_A, double n_A, double mean_B, double n_B) {
+	if (n_A + n_B > 0)
+		return mean_A + (mean_B - mean_A) * n_B / (n_A + n_B);
+	else
+		return 0;
+}
+
+// Views take their results from their core, which is merged after them
+static void mergeMomentsData(MomentsData * A, MomentsData * B) {
+	if (A->kind != B->kind) {
+		fprintf(stderr, "Cannot merge different statistics\n");
+		raiseError();
+	}
+	if (A->core)
+		return;
+	addExactSum(&A->sum, &B->sum);
+	addExactSum(&A->squares, &B->squares);
+	A->count += B->count;
+	if (B->max > A->max)
+		A->max = B->max;
+	if (B->min < A->min)
+		A->min = B->min;
+}
+
+static void mergePearsonData(PearsonData * A, PearsonData * B) {
+	double delta_X = B->mean_X - A->mean_X;
+	double delta_Y = B->mean_Y - A->mean_Y;
+	mergeCoMoments(&A->T_XX, A->count, B->count, delta_X, delta_X);
+	mergeCoMoments(&A->T_XY, A->count, B->count, delta_X, delta_Y);
+	mergeCoMoments(&A->T_YY, A->count, B->count, delta_Y, delta_Y);
+	A->T_XX += B->T_XX;
+	A->T_XY += B->T_XY;
+	A->T_YY += B->T_YY;
+	A->mean_X = mergeMeans(A->mean_X, A->count, B->mean_X, B->count);
+	A->mean_Y = mergeMeans(A->mean_Y, A->count, B->mean_Y, B->count);
+	A->count += B->count;
+}
+
+static void mergeNDPearsonData(NDPearsonData * A, NDPearsonData * B) {
+	int dim;
+	for (dim = 0; dim < A->rank; dim++) {
+		double delta_X = B->mean_X[dim] - A->mean_X[dim];
+		double delta_Y = B->mean_Y[dim] - A->mean_Y[dim];
+		mergeCoMoments(&A->T_XX, A->count, B->count, delta_X, delta_X);
+		mergeCoMoments(&A->T_XY, A->count, B->count, delta_X, delta_Y);
+		mergeCoMoments(&A->T_YY, A->count, B->count, delta_Y, delta_Y);
+		A->mean_X[dim] = mergeMeans(A->mean_X[dim], A->count, B->mean_X[dim], B->count);
+		A->mean_Y[dim] = mergeMeans(A->mean_Y[dim], A->count, B->mean_Y[dim], B->count);
+	}
+	A->T_XX += B->T_XX;
+	A->T_XY += B->T_XY;
+	A->T_YY += B->T_YY;
+	A->count += B->count;
+}
+
+// Centroids of B are pooled into A, as if they were values
+static void mergeQuantileData(QuantileData * A, QuantileData * B) {
+	int i;
+
+	if (A->quantile != B->quantile) {
+		fprintf(stderr, "Cannot merge different statistics\n");
+		raiseError();
+	}
+	for (i = 0; i < B->count; i++)
+		addToDigest(A, B->centroids[i].mean, B->centroids[i].weight);
+	if (B->count) {
+		if (B->min < A->min)
+			A->min = B->min;
+		if (B->max > A->max)
+			A->max = B->max;
+	}
+}
+
+static void mergeStatistic(WiggleIterator * A, WiggleIterator * B) {
+	if (A->pop != B->pop) {
+		fprintf(stderr, "Cannot merge different statistics\n");
+		raiseError();
+	}
+
+	if (A->pop == SpanPop)
+		((StatData *) A->data)->res += ((StatData *) B->data)->res;
+	else if (isMomentsIterator(A))
+		mergeMomentsData((MomentsData *) A->data, (MomentsData *) B->data);
+	else if (A->pop == PearsonPop)
+		mergePearsonData((PearsonData *) A->data, (PearsonData *) B->data);
+	else if (A->pop == NDPearsonPop)
+		mergeNDPearsonData((NDPearsonData *) A->data, (NDPearsonData *) B->data);
+	else if (A->pop == QuantilePop)
+		mergeQuantileData((QuantileData *) A->data, (QuantileData *) B->data);
+	else {
+		fprintf(stderr, "Cannot merge this statistic\n");
+		raiseError();
+	}
+
+	// Popping a finished statistic recomputes the final result from the merged data
+	A->done = false;
+	A->pop(A);
+}
+
+void mergeStatistics(WiggleIterator * A, WiggleIterator * B) {
+	for (; A->append && B->append; A = A->append, B = B->append)
+		mergeStatistic(A, B);
+	if (A->append || B->append) {
+		fprintf(stderr, "Cannot merge different statistics\n");
+		raiseError();
+	}
+}
+
+//////////////////////////////////////////////////////
+// Partial results
+// The state of each statistic of a chain, from which
+// the results are recomputed after merging.
+//////////////////////////////////////////////////////
+
+enum partialStatistic {PARTIAL_AUC, PARTIAL_SPAN, PARTIAL_MAX, PARTIAL_MIN, PARTIAL_MEAN, PARTIAL_VARIANCE, PARTIAL_STDDEV, PARTIAL_CV, PARTIAL_PEARSON, PARTIAL_NDPEARSON, PARTIAL_QUANTILE};
+
+// The moments are dumped one statistic at a time, and loaded as separate cores
+static void (*partialPops[])(WiggleIterator *) = {NULL, SpanPop, NULL, NULL, NULL, NULL, NULL, NULL, PearsonPop, NDPearsonPop, QuantilePop};
+static void (*partialSeeks[])(WiggleIterator *, const char *, int, int) = {NULL, SumSeek, NULL, NULL, NULL, NULL, NULL, NULL, PearsonSeek, NDPearsonSeek, QuantileSeek};
+static const int32_t momentPartials[] = {PARTIAL_AUC, PARTIAL_MEAN, PARTIAL_VARIANCE, PARTIAL_STDDEV, PARTIAL_CV, PARTIAL_MAX, PARTIAL_MIN};
+
+static void writeLong(FILE * file, long value) {
+	int64_t value64 = value;
+	writePartialValues(file, &value64, sizeof(value64), 1);
+}
+
+static long readLong(FILE * file) {
+	int64_t value64;
+	readPartialValues(file, &value64, sizeof(value64), 1);
+	return value64;
+}
+
+static void writeDouble(FILE * file, double value) {
+	writePartialValues(file, &value, sizeof(value), 1);
+}
+
+static double readDouble(FILE * file) {
+	double value;
+	readPartialValues(file, &value, sizeof(value), 1);
+	return value;
+}
+
+static void dumpMoments(WiggleIterator * wi, FILE * file) {
+	MomentsData * data = (MomentsData *) wi->data;
+	MomentsData * core = data->core ? (MomentsData *) data->core->data : data;
+	int32_t type = momentPartials[data->kind];
+
+	writePartialValues(file, &type, sizeof(type), 1);
+	if (type == PARTIAL_MAX || type == PARTIAL_MIN)
+		writeDouble(file, momentResult(core, data->kind));
+	else if (type == PARTIAL_AUC)
+		dumpExactSum(&core->sum, file);
+	else if (type == PARTIAL_MEAN) {
+		dumpExactSum(&core->sum, file);
+		writeDouble(file, core->count);
+	} else {
+		writeLong(file, core->count);
+		dumpExactSum(&core->sum, file);
+		dumpExactSum(&core->squares, file);
+	}
+}
+
+static void dumpStatistic(WiggleIterator * wi, FILE * file) {
+	int32_t type;
+
+	if (isMomentsIterator(wi)) {
+		dumpMoments(wi, file);
+		return;
+	}
+
+	for (type = 0; type <= PARTIAL_QUANTILE; type++)
+		if (partialPops[type] && wi->pop == partialPops[type])
+			break;
+	if (type > PARTIAL_QUANTILE) {
+		fprintf(stderr, "Cannot dump this statistic\n");
+		raiseError();
+	}
+	writePartialValues(file, &type, sizeof(type), 1);
+
+	if (type == PARTIAL_SPAN)
+		writeDouble(file, ((StatData *) wi->data)->res);
+	else if (type == PARTIAL_PEARSON) {
+		PearsonData * data = (PearsonData *) wi->data;
+		writeLong(file, data->count);
+		writeDouble(file, data->mean_X);
+		writeDouble(file, data->mean_Y);
+		writeDouble(file, data->T_XX);
+		writeDouble(file, data->T_XY);
+		writeDouble(file, data->T_YY);
+	} else if (type == PARTIAL_NDPEARSON) {
+		NDPearsonData * data = (NDPearsonData *) wi->data;
+		int32_t rank = data->rank;
+		writePartialValues(file, &rank, sizeof(rank), 1);
+		writeLong(file, data->count);
+		writePartialValues(file, data->mean_X, sizeof(double), rank);
+		writePartialValues(file, data->mean_Y, sizeof(double), rank);
+		writeDouble(file, data->T_XX);
+		writeDouble(file, data->T_XY);
+		writeDouble(file, data->T_YY);
+	} else {
+		QuantileData * data = (QuantileData *) wi->data;
+		int32_t count;
+		compressDigest(data);
+		count = data->count;
+		writeDouble(file, data->quantile);
+		writeDouble(file, data->min);
+		writeDouble(file, data->max);
+		writePartialValues(file, &count, sizeof(count), 1);
+		writePartialValues(file, data->centroids, sizeof(Centroid), count);
+	}
+}
+
+void dumpStatistics(WiggleIterator * wi, FILE * file) {
+	WiggleIterator * iter;
+	int32_t count = 0;
+
+	for (iter = wi; iter->append; iter = iter->append)
+		count++;
+	writePartialValues(file, &count, sizeof(count), 1);
+	for (iter = wi; iter->append; iter = iter->append)
+		dumpStatistic(iter, file);
+}
+
+static void FinishedPop(WiggleIterator * wi) {
+	wi->done = true;
+}
+
+static void FinishedSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	return;
+}
+
+// Stands in for the data of a loaded statistic, which has all been read
+static WiggleIterator * finishedIterator() {
+	return newWiggleIterator(NULL, &FinishedPop, &FinishedSeek, 0);
+}
+
+static Multiplexer * finishedMultiplexer() {
+	Multiplexer * multi = (Multiplexer *) calloc(1, sizeof(Multiplexer));
+	multi->done = true;
+	return multi;
+}
+
+static Multiset * finishedMultiset() {
+	Multiset * multi = (Multiset *) calloc(1, sizeof(Multiset));
+	multi->done = true;
+	return multi;
+}
+
+static void * loadStatisticData(int32_t type, FILE * file) {
+	if (type == PARTIAL_SPAN) {
+		StatData * data = (StatData *) calloc(1, sizeof(StatData));
+		data->res = readDouble(file);
+		data->source = finishedIterator();
+		return data;
+	} else if (type == PARTIAL_PEARSON) {
+		PearsonData * data = (PearsonData *) calloc(1, sizeof(PearsonData));
+		data->count = readLong(file);
+		data->mean_X = readDouble(file);
+		data->mean_Y = readDouble(file);
+		data->T_XX = readDouble(file);
+		data->T_XY = readDouble(file);
+		data->T_YY = readDouble(file);
+		data->res = NAN;
+		data->multi = finishedMultiplexer();
+		return data;
+	} else if (type == PARTIAL_NDPEARSON) {
+		NDPearsonData * data = (NDPearsonData *) calloc(1, sizeof(NDPearsonData));
+		int32_t rank;
+		readPartialValues(file, &rank, sizeof(rank), 1);
+		if (rank < 0) {
+			fprintf(stderr, "Corrupted partial results file\n");
+			raiseError();
+		}
+		data->rank = rank;
+		data->count = readLong(file);
+		data->mean_X = calloc(rank, sizeof(double));
+		data->mean_Y = calloc(rank, sizeof(double));
+		readPartialValues(file, data->mean_X, sizeof(double), rank);
+		readPartialValues(file, data->mean_Y, sizeof(double), rank);
+		data->T_XX = readDouble(file);
+		data->T_XY = readDouble(file);
+		data->T_YY = readDouble(file);
+		data->res = NAN;
+		data->multi = finishedMultiset();
+		return data;
+	} else if (type == PARTIAL_QUANTILE) {
+		QuantileData * data = (QuantileData *) calloc(1, sizeof(QuantileData));
+		int32_t count;
+		data->quantile = readDouble(file);
+		data->min = readDouble(file);
+		data->max = readDouble(file);
+		readPartialValues(file, &count, sizeof(count), 1);
+		if (count < 0 || count > CENTROID_CAPACITY) {
+			fprintf(stderr, "Corrupted partial results file\n");
+			raiseError();
+		}
+		readPartialValues(file, data->centroids, sizeof(Centroid), count);
+		data->merged = data->count = count;
+		data->res = NAN;
+		data->source = finishedIterator();
+		return data;
+	} else {
+		fprintf(stderr, "Unknown statistic in partial results file\n");
+		raiseError();
+	}
+}
+
+// Only the moments its statistic needs are known
+static MomentsData * loadMomentsData(MomentKind kind, FILE * file) {
+	MomentsData * data = (MomentsData *) calloc(1, sizeof(MomentsData));
+	double value;
+
+	data->kind = kind;
+	data->source = finishedIterator();
+	requireMoments(data, kind);
+	resetMoments(data);
+	if (kind == MOMENT_AUC)
+		loadExactSum(&data->sum, file);
+	else if (kind == MOMENT_MAX || kind == MOMENT_MIN) {
+		if (!isnan(value = readDouble(file))) {
+			data->max = data->min = value;
+			data->count = 1;
+		}
+	} else if (kind == MOMENT_MEAN) {
+		loadExactSum(&data->sum, file);
+		data->count = readDouble(file);
+	} else {
+		data->count = readLong(file);
+		loadExactSum(&data->sum, file);
+		loadExactSum(&data->squares, file);
+	}
+	return data;
+}
+
+static int partialMomentKind(int32_t type) {
+	int kind;
+	for (kind = 0; kind <= MOMENT_MIN; kind++)
+		if (momentPartials[kind] == type)
+			return kind;
+	return -1;
+}
+
+// Rebuilds the chain of statistics, in the same order as they were dumped
+static WiggleIterator * loadStatistic(FILE * file, int remaining) {
+	int32_t type;
+	int kind;
+
+	if (remaining == 0)
+		return finishedIterator();
+
+	readPartialValues(file, &type, sizeof(type), 1);
+	if ((kind = partialMomentKind(type)) >= 0) {
+		MomentsData * data = loadMomentsData(kind, file);
+		return newStatisticIterator(data, MomentsPop, NULL, MomentsSeek, 0, loadStatistic(file, remaining - 1));
+	}
+	void * data = loadStatisticData(type, file);
+	WiggleIterator * append = loadStatistic(file, remaining - 1);
+	return newStatisticIterator(data, partialPops[type], NULL, partialSeeks[type], 0, append);
+}
+
+WiggleIterator * loadStatistics(FILE * file) {
+	int32_t count;
+	readPartialValues(file, &count, sizeof(count), 1);
+	if (count <= 0) {
+		fprintf(stderr, "Corrupted partial results file\n");
+		raiseError();
+	}
+	return loadStatistic(file, count);
+}
+
+// Results of a chain of statistics which was run, e.g. meanI maxI x, in the order of the program
+double * statisticResults(WiggleIterator * wi, int * count) {
+	WiggleIterator * iter;
+	double * results;
+	int index = 0;
+
+	*count = 0;
+	for (iter = wi; iter->append; iter = iter->append)
+		(*count)++;
+	results = calloc(*count, sizeof(double));
+	for (iter = wi; iter->append; iter = iter->append)
+		results[index++] = *((double *) iter->data);
+	return results;
+}
+
+static StatisticKind statisticKind(WiggleIterator * wi) {
+	if (wi->pop == SpanPop)
+		return STATISTIC_TOTAL;
+	else if (isMomentsIterator(wi)) {
+		MomentKind kind = ((MomentsData *) wi->data)->kind;
+		if (kind == MOMENT_AUC)
+			return STATISTIC_TOTAL;
+		else if (kind == MOMENT_MAX || kind == MOMENT_MIN)
+			return STATISTIC_EXTREMUM;
+	}
+	return STATISTIC_AVERAGE;
+}
+
+StatisticKind * statisticKinds(WiggleIterator * wi, int * count) {
+	WiggleIterator * iter;
+	StatisticKind * kinds;
+	int index = 0;
+
+	*count = 0;
+	for (iter = wi; iter->append; iter = iter->append)
+		(*count)++;
+	kinds = calloc(*count, sizeof(StatisticKind));
+	for (iter = wi; iter->append; iter = iter->append)
+		kinds[index++] = statisticKind(iter);
+	return kinds;
 }
 
 //////////////////////////////////////////////////////
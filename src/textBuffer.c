@@ -0,0 +1,154 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "textBuffer.h"
+
+#define MAX_PRECISION 15
+
+static const double powersOfTen[MAX_PRECISION + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+// Same as %lf by default
+static int precision = 6;
+
+void setOutputPrecision(int digits) {
+	if (digits < 0 || digits > MAX_PRECISION) {
+		fprintf(stderr, "Output precision must be between 0 and %i decimals, not %i\n", MAX_PRECISION, digits);
+		raiseError();
+	}
+	precision = digits;
+}
+
+//////////////////////////////////////////////////////
+// Number formatting
+//////////////////////////////////////////////////////
+
+// Writes the digits backwards from the end of a scratch buffer
+static int formatUnsigned(char * dest, unsigned long long value, int minDigits) {
+	char digits[24];
+	char * ptr = digits + sizeof(digits);
+	int length;
+
+	do {
+		*(--ptr) = '0' + value % 10;
+		value /= 10;
+	} while (value || digits + sizeof(digits) - ptr < minDigits);
+
+	length = digits + sizeof(digits) - ptr;
+	memcpy(dest, ptr, length);
+	return length;
+}
+
+int formatInt(char * dest, int value) {
+	int length;
+	if (value < 0) {
+		dest[0] = '-';
+		length = 1 + formatUnsigned(dest + 1, - (long long) value, 1);
+	} else
+		length = formatUnsigned(dest, value, 1);
+	dest[length] = '\0';
+	return length;
+}
+
+int formatDouble(char * dest, double value) {
+	double scale = powersOfTen[precision];
+	double scaled = fabs(value) * scale;
+	double integral, fraction;
+	unsigned long long digits;
+	int length = 0;
+
+	// NaNs, infinities and numbers too large for exact integer arithmetic
+	if (!(scaled < 1e15))
+		return sprintf(dest, "%.*f", precision, value);
+
+	// The product is off by at most half an ulp, so only values close to a 
+	// rounding tie need the exact binary expansion computed by the C library
+	integral = floor(scaled);
+	fraction = scaled - integral;
+	if (fabs(fraction - 0.5) <= scaled * 1e-15)
+		return sprintf(dest, "%.*f", precision, value);
+	digits = (unsigned long long) integral + (fraction > 0.5);
+
+	if (signbit(value))
+		dest[length++] = '-';
+	length += formatUnsigned(dest + length, digits / (unsigned long long) scale, 1);
+	if (precision) {
+		dest[length++] = '.';
+		length += formatUnsigned(dest + length, digits % (unsigned long long) scale, precision);
+	}
+	dest[length] = '\0';
+	return length;
+}
+
+//////////////////////////////////////////////////////
+// Buffer
+//////////////////////////////////////////////////////
+
+void initTextBuffer(TextBuffer * out, FILE * file, BgzfWriter * bgzf) {
+	out->file = file;
+	out->bgzf = bgzf;
+	out->ptr = out->data;
+}
+
+void flushTextBuffer(TextBuffer * out) {
+	size_t length = out->ptr - out->data;
+	if (length && out->bgzf)
+		writeBgzf(out->bgzf, out->data, length);
+	else if (length && fwrite(out->data, 1, length, out->file) != length) {
+		fprintf(stderr, "Could not write to output file\n");
+		raiseError();
+	}
+	out->ptr = out->data;
+}
+
+static void reserveTextBuffer(TextBuffer * out, size_t length) {
+	if (out->ptr + length > out->data + TEXT_BUFFER_SIZE)
+		flushTextBuffer(out);
+}
+
+void writeChar(TextBuffer * out, char c) {
+	reserveTextBuffer(out, 1);
+	*(out->ptr++) = c;
+}
+
+void writeBytes(TextBuffer * out, const char * bytes, size_t length) {
+	reserveTextBuffer(out, length);
+	if (length > TEXT_BUFFER_SIZE && out->bgzf)
+		writeBgzf(out->bgzf, bytes, length);
+	else if (length > TEXT_BUFFER_SIZE) {
+		if (fwrite(bytes, 1, length, out->file) != length) {
+			fprintf(stderr, "Could not write to output file\n");
+			raiseError();
+		}
+	} else {
+		memcpy(out->ptr, bytes, length);
+		out->ptr += length;
+	}
+}
+
+void writeString(TextBuffer * out, const char * string) {
+	writeBytes(out, string, strlen(string));
+}
+
+void writeInt(TextBuffer * out, int value) {
+	reserveTextBuffer(out, MAX_NUMBER_LENGTH);
+	out->ptr += formatInt(out->ptr, value);
+}
+
+void writeDouble(TextBuffer * out, double value) {
+	reserveTextBuffer(out, MAX_NUMBER_LENGTH);
+	out->ptr += formatDouble(out->ptr, value);
+}
@@ -0,0 +1,49 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TEXT_BUFFER_H_
+#define _TEXT_BUFFER_H_
+
+#include <stdio.h>
+#include "bgzfWriter.h"
+
+// Text output formatted straight into a large buffer, which is handed to 
+// fwrite (or a BGZF writer) when full, instead of one fprintf call per field.
+
+#define TEXT_BUFFER_SIZE 65536
+// Longest string formatDouble or formatInt may produce, terminator included
+#define MAX_NUMBER_LENGTH 400
+
+typedef struct textBuffer_st {
+	FILE * file;
+	BgzfWriter * bgzf;
+	char * ptr;
+	char data[TEXT_BUFFER_SIZE];
+} TextBuffer;
+
+// Output goes to bgzf if set, to file otherwise
+void initTextBuffer(TextBuffer * out, FILE * file, BgzfWriter * bgzf);
+void flushTextBuffer(TextBuffer * out);
+void writeChar(TextBuffer * out, char c);
+void writeString(TextBuffer * out, const char * string);
+void writeBytes(TextBuffer * out, const char * bytes, size_t length);
+void writeInt(TextBuffer * out, int value);
+// Fixed point, with the number of decimals set by setOutputPrecision
+void writeDouble(TextBuffer * out, double value);
+
+// Both format into dest, which must hold MAX_NUMBER_LENGTH chars, and return the length written
+int formatInt(char * dest, int value);
+int formatDouble(char * dest, double value);
+
+#endif
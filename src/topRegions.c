@@ -0,0 +1,218 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header
+#include "wiggleIterator.h"
+#include "chromosomes.h"
+#include "partials.h"
+#include "textBuffer.h"
+
+//////////////////////////////////////////////////////
+// Top regions
+//
+// The records with the highest values are kept in a
+// min-heap of bounded size, whose root is the record to
+// drop next. Equal values rank in genome order, so the
+// records kept do not depend on how the genome was split.
+//////////////////////////////////////////////////////
+
+typedef struct topRegion_st {
+	char * chrom;
+	int start;
+	int finish;
+	double value;
+} TopRegion;
+
+struct topRegions_st {
+	int capacity;
+	int count;
+	TopRegion * heap;
+};
+
+// Whether A is dropped before B
+static bool ranksBelow(const TopRegion * A, const TopRegion * B) {
+	int cmp;
+
+	if (A->value != B->value)
+		return A->value < B->value;
+	if ((cmp = compareChroms(A->chrom, B->chrom)))
+		return cmp > 0;
+	if (A->start != B->start)
+		return A->start > B->start;
+	return A->finish > B->finish;
+}
+
+static void siftDown(TopRegions * top, int index) {
+	TopRegion * heap = top->heap;
+	TopRegion region = heap[index];
+
+	while (2 * index + 1 < top->count) {
+		int child = 2 * index + 1;
+		if (child + 1 < top->count && ranksBelow(heap + child + 1, heap + child))
+			child++;
+		if (!ranksBelow(heap + child, &region))
+			break;
+		heap[index] = heap[child];
+		index = child;
+	}
+	heap[index] = region;
+}
+
+static void siftUp(TopRegions * top, int index) {
+	TopRegion * heap = top->heap;
+	TopRegion region = heap[index];
+
+	while (index > 0 && ranksBelow(&region, heap + (index - 1) / 2)) {
+		heap[index] = heap[(index - 1) / 2];
+		index = (index - 1) / 2;
+	}
+	heap[index] = region;
+}
+
+// Chromosome names are interned only for the records which are kept
+void addTopRegion(TopRegions * top, const char * chrom, int start, int finish, double value) {
+	TopRegion region;
+
+	if (isnan(value))
+		return;
+	region.chrom = (char *) chrom;
+	region.start = start;
+	region.finish = finish;
+	region.value = value;
+
+	if (top->count < top->capacity) {
+		region.chrom = internChromosome(chrom);
+		top->heap[top->count] = region;
+		siftUp(top, top->count++);
+	} else if (top->capacity > 0 && ranksBelow(top->heap, &region)) {
+		region.chrom = internChromosome(chrom);
+		top->heap[0] = region;
+		siftDown(top, 0);
+	}
+}
+
+TopRegions * newTopRegions(int capacity) {
+	TopRegions * top = (TopRegions *) calloc(1, sizeof(TopRegions));
+	if (capacity < 1) {
+		fprintf(stderr, "The number of top regions must be positive: %i\n", capacity);
+		raiseError();
+	}
+	top->capacity = capacity;
+	top->heap = (TopRegion *) calloc(capacity, sizeof(TopRegion));
+	return top;
+}
+
+TopRegions * topRegions(WiggleIterator * iter, int capacity) {
+	TopRegions * top = newTopRegions(capacity);
+
+	for (; !iter->done; pop(iter))
+		addTopRegion(top, iter->chrom, iter->start, iter->finish, iter->value);
+	return top;
+}
+
+void mergeTopRegions(TopRegions * A, TopRegions * B) {
+	int i;
+
+	if (A->capacity != B->capacity) {
+		fprintf(stderr, "Cannot merge different numbers of top regions\n");
+		raiseError();
+	}
+	for (i = 0; i < B->count; i++)
+		addTopRegion(A, B->heap[i].chrom, B->heap[i].start, B->heap[i].finish, B->heap[i].value);
+}
+
+static int compareTopRegions(const void * A, const void * B) {
+	if (ranksBelow((const TopRegion *) B, (const TopRegion *) A))
+		return -1;
+	if (ranksBelow((const TopRegion *) A, (const TopRegion *) B))
+		return 1;
+	return 0;
+}
+
+// Highest values first, as bedGraph lines
+void printTopRegions(TopRegions * top, FILE * file) {
+	TopRegion * sorted = (TopRegion *) calloc(top->count + 1, sizeof(TopRegion));
+	TextBuffer out;
+	int i;
+
+	memcpy(sorted, top->heap, top->count * sizeof(TopRegion));
+	qsort(sorted, top->count, sizeof(TopRegion), compareTopRegions);
+
+	initTextBuffer(&out, file, NULL);
+	for (i = 0; i < top->count; i++) {
+		writeString(&out, sorted[i].chrom);
+		writeChar(&out, '\t');
+		// -1 because bedGraph coords are 0-based...
+		writeInt(&out, sorted[i].start - 1);
+		writeChar(&out, '\t');
+		writeInt(&out, sorted[i].finish - 1);
+		writeChar(&out, '\t');
+		writeDouble(&out, sorted[i].value);
+		writeChar(&out, '\n');
+	}
+	flushTextBuffer(&out);
+	free(sorted);
+}
+
+// The capacity and the number of records, then each record: the length
+// of its chromosome name, the name, its start, finish and value.
+void dumpTopRegions(TopRegions * top, FILE * file) {
+	int32_t dims[2] = {top->capacity, top->count};
+	int i;
+
+	writePartialValues(file, dims, sizeof(int32_t), 2);
+	for (i = 0; i < top->count; i++) {
+		int32_t length = strlen(top->heap[i].chrom);
+		int32_t coords[2] = {top->heap[i].start, top->heap[i].finish};
+		writePartialValues(file, &length, sizeof(int32_t), 1);
+		writePartialValues(file, top->heap[i].chrom, 1, length);
+		writePartialValues(file, coords, sizeof(int32_t), 2);
+		writePartialValues(file, &top->heap[i].value, sizeof(double), 1);
+	}
+}
+
+TopRegions * loadTopRegions(FILE * file) {
+	int32_t dims[2];
+	char * name = NULL;
+	int i;
+
+	readPartialValues(file, dims, sizeof(int32_t), 2);
+	if (dims[0] < 1 || dims[1] < 0 || dims[1] > dims[0]) {
+		fprintf(stderr, "Corrupted partial results file\n");
+		raiseError();
+	}
+
+	TopRegions * top = newTopRegions(dims[0]);
+	for (i = 0; i < dims[1]; i++) {
+		int32_t length, coords[2];
+		double value;
+		readPartialValues(file, &length, sizeof(int32_t), 1);
+		if (length <= 0) {
+			fprintf(stderr, "Corrupted partial results file\n");
+			raiseError();
+		}
+		name = (char *) realloc(name, length + 1);
+		readPartialValues(file, name, 1, length);
+		name[length] = '\0';
+		readPartialValues(file, coords, sizeof(int32_t), 2);
+		readPartialValues(file, &value, sizeof(double), 1);
+		addTopRegion(top, name, coords[0], coords[1], value);
+	}
+	free(name);
+	return top;
+}
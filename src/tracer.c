@@ -0,0 +1,160 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "tracer.h"
+#include "profiler.h"
+
+//////////////////////////////////////////////////////
+// Spans
+//
+// A thread only ever appends to its last chunk, and
+// publishes each span by incrementing the count of the
+// chunk. The spans of threads still running when the
+// trace is written are then read up to their count.
+//////////////////////////////////////////////////////
+
+#define TRACE_CHUNK_SPANS 1024
+
+typedef struct traceSpan_st {
+	const char * name;
+	double start, finish;
+} TraceSpan;
+
+typedef struct traceChunk_st {
+	TraceSpan spans[TRACE_CHUNK_SPANS];
+	int count;
+	struct traceChunk_st * next;
+} TraceChunk;
+
+typedef struct traceThread_st {
+	int id;
+	const char * name;
+	TraceChunk * first, * last;
+	struct traceThread_st * next;
+} TraceThread;
+
+static bool tracing = false;
+static FILE * traceFile = NULL;
+static double traceOrigin;
+// Protects the list of threads
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceThread * firstThread = NULL;
+static TraceThread * lastThread = NULL;
+static int threadCount = 0;
+static __thread TraceThread * currentThread = NULL;
+
+void enableTracing(char * filename) {
+	if (!(traceFile = fopen(filename, "w"))) {
+		fprintf(stderr, "Could not open trace file %s\n", filename);
+		raiseError();
+	}
+	traceOrigin = profileClock();
+	tracing = true;
+	nameTraceThread("main");
+}
+
+static TraceThread * traceThread() {
+	if (!currentThread) {
+		TraceThread * thread = (TraceThread *) calloc(1, sizeof(TraceThread));
+		pthread_mutex_lock(&traceMutex);
+		thread->id = ++threadCount;
+		if (lastThread)
+			lastThread->next = thread;
+		else
+			firstThread = thread;
+		lastThread = thread;
+		pthread_mutex_unlock(&traceMutex);
+		currentThread = thread;
+	}
+	return currentThread;
+}
+
+void nameTraceThread(const char * name) {
+	if (tracing)
+		traceThread()->name = name;
+}
+
+double traceClock() {
+	return tracing ? profileClock() : 0;
+}
+
+void traceSpan(const char * name, double start) {
+	TraceThread * thread;
+	TraceChunk * chunk;
+	TraceSpan * span;
+
+	if (!tracing)
+		return;
+
+	thread = traceThread();
+	chunk = thread->last;
+	if (!chunk || chunk->count == TRACE_CHUNK_SPANS) {
+		TraceChunk * next = (TraceChunk *) calloc(1, sizeof(TraceChunk));
+		if (chunk)
+			__atomic_store_n(&chunk->next, next, __ATOMIC_SEQ_CST);
+		else
+			__atomic_store_n(&thread->first, next, __ATOMIC_SEQ_CST);
+		thread->last = chunk = next;
+	}
+	span = chunk->spans + chunk->count;
+	span->name = name;
+	span->start = start;
+	span->finish = profileClock();
+	__atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_SEQ_CST);
+}
+
+//////////////////////////////////////////////////////
+// Report
+//////////////////////////////////////////////////////
+
+// Timestamps are in microseconds
+static void printTraceThread(TraceThread * thread, bool * first) {
+	TraceChunk * chunk;
+	int i, count;
+
+	if (thread->name) {
+		fprintf(traceFile, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}", *first ? "" : ",", thread->id, thread->name, thread->id);
+		*first = false;
+	}
+	for (chunk = __atomic_load_n(&thread->first, __ATOMIC_SEQ_CST); chunk; chunk = __atomic_load_n(&chunk->next, __ATOMIC_SEQ_CST)) {
+		count = __atomic_load_n(&chunk->count, __ATOMIC_SEQ_CST);
+		for (i = 0; i < count; i++) {
+			TraceSpan * span = chunk->spans + i;
+			fprintf(traceFile, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}", *first ? "" : ",", span->name, thread->id, (span->start - traceOrigin) * 1e6, (span->finish - span->start) * 1e6);
+			*first = false;
+		}
+	}
+}
+
+void finishTracing() {
+	TraceThread * thread;
+	bool first = true;
+
+	if (!tracing)
+		return;
+
+	pthread_mutex_lock(&traceMutex);
+	fprintf(traceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (thread = firstThread; thread; thread = thread->next)
+		printTraceThread(thread, &first);
+	fprintf(traceFile, "\n]}\n");
+	pthread_mutex_unlock(&traceMutex);
+	fclose(traceFile);
+	traceFile = NULL;
+	tracing = false;
+}
@@ -0,0 +1,36 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TRACER_H_
+#define _TRACER_H_
+
+// Opt-in timeline of the work of each thread
+//
+// When tracing is enabled, the readers, writers and worker threads record
+// timed spans: blocks produced and consumed, waits on each other, seeks,
+// decompression and output. Each thread appends its spans to its own
+// chunks, without locks. They are written as a Chrome trace (JSON) once
+// the program is done, one track per thread.
+
+#include "wiggleIterator.h"
+
+// Returns 0 unless tracing is enabled, so as to skip reading the clock
+double traceClock();
+// Span from start, as returned by traceClock, to now. The name must be a
+// string constant.
+void traceSpan(const char * name, double start);
+// Names the track of the calling thread
+void nameTraceThread(const char * name);
+
+#endif
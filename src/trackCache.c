@@ -0,0 +1,576 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trackCache.h"
+
+static const char magic[8] = "WTCACHE";
+// Reads differently on a machine of the other endianness
+static const uint32_t byteOrderMark = 0x01020304;
+static const int32_t OVERLAPS_FLAG = 1;
+static const int32_t FLOAT_VALUES_FLAG = 2;
+// As the flags of the iterator cached, see WiggleIterator
+static const int32_t FINITE_FLAG = 4;
+static const int32_t INTEGRAL_FLAG = 8;
+#define HEADER_SIZE 16
+#define TRAILER_SIZE 32
+// Records per block
+#define CACHE_BLOCK_SIZE 65536
+
+typedef struct cacheBlock_st {
+	int64_t offset;
+	int32_t count;
+	int32_t maxFinish;
+} CacheBlock;
+
+typedef struct cacheChrom_st {
+	int32_t name;
+	int32_t firstBlock;
+	int32_t blockCount;
+	int32_t padding;
+} CacheChrom;
+
+bool isTrackCacheFilename(const char * filename) {
+	size_t length = strlen(filename);
+	return length > 4 && !strcmp(filename + length - 4, ".wtc");
+}
+
+//////////////////////////////////////////////////////
+// Writer
+//////////////////////////////////////////////////////
+
+struct trackCacheWriter_st {
+	FILE * file;
+	int64_t offset;
+	bool finished;
+	// Block being filled
+	int32_t starts[CACHE_BLOCK_SIZE];
+	int32_t finishes[CACHE_BLOCK_SIZE];
+	StoredValue values[CACHE_BLOCK_SIZE];
+	int count;
+	int32_t maxFinish;
+	// Index
+	CacheBlock * blocks;
+	int blockCount, maxBlocks;
+	CacheChrom * chroms;
+	char ** labels;
+	int chromCount, maxChroms;
+	int lastStart;
+};
+
+static void writeCacheValues(TrackCacheWriter * writer, const void * values, size_t size, size_t count) {
+	if (fwrite(values, size, count, writer->file) != count) {
+		fprintf(stderr, "Could not write track cache file\n");
+		raiseError();
+	}
+	writer->offset += size * count;
+}
+
+TrackCacheWriter * openTrackCacheWriter(FILE * file, bool overlaps, bool finite, bool integral) {
+	TrackCacheWriter * writer = (TrackCacheWriter *) calloc(1, sizeof(TrackCacheWriter));
+	int32_t flags = overlaps ? OVERLAPS_FLAG : 0;
+	if (sizeof(StoredValue) == sizeof(float))
+		flags |= FLOAT_VALUES_FLAG;
+	if (finite)
+		flags |= FINITE_FLAG;
+	if (integral)
+		flags |= INTEGRAL_FLAG;
+	if (!writer) {
+		fprintf(stderr, "Could not allocate track cache writer\n");
+		raiseError();
+	}
+	writer->file = file;
+	writeCacheValues(writer, magic, 1, sizeof(magic));
+	writeCacheValues(writer, &byteOrderMark, sizeof(byteOrderMark), 1);
+	writeCacheValues(writer, &flags, sizeof(flags), 1);
+	return writer;
+}
+
+static void writeCachePadding(TrackCacheWriter * writer) {
+	static const char zeros[8] = {0};
+	if (writer->offset % 8)
+		writeCacheValues(writer, zeros, 1, 8 - writer->offset % 8);
+}
+
+static void flushCacheBlock(TrackCacheWriter * writer) {
+	CacheBlock * block;
+
+	if (writer->count == 0)
+		return;
+	if (writer->blockCount == writer->maxBlocks) {
+		writer->maxBlocks = writer->maxBlocks ? 2 * writer->maxBlocks : 64;
+		writer->blocks = (CacheBlock *) realloc(writer->blocks, writer->maxBlocks * sizeof(CacheBlock));
+	}
+	block = writer->blocks + writer->blockCount++;
+	block->offset = writer->offset;
+	block->count = writer->count;
+	block->maxFinish = writer->maxFinish;
+	writer->chroms[writer->chromCount - 1].blockCount++;
+
+	writeCacheValues(writer, writer->starts, sizeof(int32_t), writer->count);
+	writeCacheValues(writer, writer->finishes, sizeof(int32_t), writer->count);
+	writeCacheValues(writer, writer->values, sizeof(StoredValue), writer->count);
+	writeCachePadding(writer);
+	writer->count = 0;
+}
+
+// The reader looks chromosomes up by binary search
+static void addCacheChrom(TrackCacheWriter * writer, char * chrom) {
+	if (writer->chromCount && compareChroms(chrom, writer->labels[writer->chromCount - 1]) <= 0) {
+		fprintf(stderr, "Track cache input is not sorted: chromosome %s comes after %s\n", chrom, writer->labels[writer->chromCount - 1]);
+		raiseError();
+	}
+	if (writer->chromCount == writer->maxChroms) {
+		writer->maxChroms = writer->maxChroms ? 2 * writer->maxChroms : 64;
+		writer->chroms = (CacheChrom *) realloc(writer->chroms, writer->maxChroms * sizeof(CacheChrom));
+		writer->labels = (char **) realloc(writer->labels, writer->maxChroms * sizeof(char *));
+	}
+	writer->labels[writer->chromCount] = chrom;
+	writer->chroms[writer->chromCount].firstBlock = writer->blockCount;
+	writer->chroms[writer->chromCount].blockCount = 0;
+	writer->chroms[writer->chromCount].padding = 0;
+	writer->chromCount++;
+	writer->maxFinish = 0;
+	writer->lastStart = 0;
+}
+
+void addTrackCacheValue(TrackCacheWriter * writer, char * chrom, int start, int finish, double value) {
+	if (writer->finished) {
+		fprintf(stderr, "Cannot add records to a finished track cache file\n");
+		raiseError();
+	}
+	if (writer->chromCount == 0 || writer->labels[writer->chromCount - 1] != chrom) {
+		flushCacheBlock(writer);
+		addCacheChrom(writer, chrom);
+	} else if (start < writer->lastStart) {
+		fprintf(stderr, "Track cache input is not sorted: %s:%i comes after %s:%i\n", chrom, start, chrom, writer->lastStart);
+		raiseError();
+	}
+
+	writer->starts[writer->count] = start;
+	writer->finishes[writer->count] = finish;
+	writer->values[writer->count] = value;
+	writer->lastStart = start;
+	if (finish > writer->maxFinish)
+		writer->maxFinish = finish;
+	if (++writer->count == CACHE_BLOCK_SIZE)
+		flushCacheBlock(writer);
+}
+
+void finishTrackCacheWriter(TrackCacheWriter * writer) {
+	int64_t blockTable, chromTable;
+	int32_t count;
+	int i, names = 0;
+
+	flushCacheBlock(writer);
+
+	blockTable = writer->offset;
+	writeCacheValues(writer, writer->blocks, sizeof(CacheBlock), writer->blockCount);
+
+	chromTable = writer->offset;
+	for (i = 0; i < writer->chromCount; i++) {
+		writer->chroms[i].name = names;
+		names += strlen(writer->labels[i]) + 1;
+	}
+	writeCacheValues(writer, writer->chroms, sizeof(CacheChrom), writer->chromCount);
+	for (i = 0; i < writer->chromCount; i++)
+		writeCacheValues(writer, writer->labels[i], 1, strlen(writer->labels[i]) + 1);
+	writeCachePadding(writer);
+
+	writeCacheValues(writer, &blockTable, sizeof(blockTable), 1);
+	writeCacheValues(writer, &chromTable, sizeof(chromTable), 1);
+	count = writer->blockCount;
+	writeCacheValues(writer, &count, sizeof(count), 1);
+	count = writer->chromCount;
+	writeCacheValues(writer, &count, sizeof(count), 1);
+	writeCacheValues(writer, magic, 1, sizeof(magic));
+	fflush(writer->file);
+	writer->finished = true;
+}
+
+//////////////////////////////////////////////////////
+// Tee operator
+//////////////////////////////////////////////////////
+
+typedef struct trackCacheTeeData_st {
+	WiggleIterator * iter;
+	TrackCacheWriter * writer;
+	// Memos are written to a temporary file, renamed once complete
+	char * filename;
+	char * tmpFilename;
+} TrackCacheTeeData;
+
+static void publishTrackCacheMemo(TrackCacheTeeData * data) {
+	finishTrackCacheWriter(data->writer);
+	if (fclose(data->writer->file) || rename(data->tmpFilename, data->filename)) {
+		fprintf(stderr, "Could not write track cache file %s\n", data->filename);
+		raiseError();
+	}
+	free(data->writer);
+	data->writer = NULL;
+}
+
+// A memo of the regions seeked would pass for the whole track
+static void abandonTrackCacheMemo(TrackCacheTeeData * data) {
+	fclose(data->writer->file);
+	unlink(data->tmpFilename);
+	free(data->writer);
+	data->writer = NULL;
+}
+
+static void TrackCacheTeeWiggleIteratorPop(WiggleIterator * wi) {
+	TrackCacheTeeData * data = (TrackCacheTeeData *) wi->data;
+	WiggleIterator * iter = data->iter;
+
+	if (!iter->done) {
+		wi->chrom = iter->chrom;
+		wi->start = iter->start;
+		wi->finish = iter->finish;
+		wi->value = iter->value;
+		if (data->writer)
+			addTrackCacheValue(data->writer, iter->chrom, iter->start, iter->finish, iter->value);
+		pop(iter);
+	} else {
+		if (data->writer && data->filename)
+			publishTrackCacheMemo(data);
+		else if (data->writer && !data->writer->finished)
+			finishTrackCacheWriter(data->writer);
+		wi->done = true;
+	}
+}
+
+static void TrackCacheTeeWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	TrackCacheTeeData * data = (TrackCacheTeeData *) wi->data;
+	if (data->writer && data->filename)
+		abandonTrackCacheMemo(data);
+	seek(data->iter, chrom, start, finish);
+	wi->done = false;
+	pop(wi);
+}
+
+// The records are stored as they come, overlapping or not, so that reading 
+// the cache gives back exactly the records of the input
+WiggleIterator * TrackCacheTeeWiggleIterator(WiggleIterator * i, FILE * outfile) {
+	TrackCacheTeeData * data = (TrackCacheTeeData *) calloc(1, sizeof(TrackCacheTeeData));
+	data->iter = i;
+	data->writer = openTrackCacheWriter(outfile, i->overlaps, i->finite, i->integral);
+	WiggleIterator * res = newWiggleIterator(data, &TrackCacheTeeWiggleIteratorPop, &TrackCacheTeeWiggleIteratorSeek, i->default_value);
+	res->overlaps = i->overlaps;
+	res->finite = i->finite;
+	res->integral = i->integral;
+	return res;
+}
+
+WiggleIterator * TrackCacheMemoWiggleIterator(WiggleIterator * i, char * filename) {
+	TrackCacheTeeData * data = (TrackCacheTeeData *) calloc(1, sizeof(TrackCacheTeeData));
+	FILE * file;
+
+	data->iter = i;
+	data->filename = filename;
+	data->tmpFilename = (char *) malloc(strlen(filename) + 32);
+	sprintf(data->tmpFilename, "%s.tmp-%i", filename, (int) getpid());
+	if (!(file = fopen(data->tmpFilename, "wb"))) {
+		fprintf(stderr, "Could not open track cache file %s\n", data->tmpFilename);
+		raiseError();
+	}
+	data->writer = openTrackCacheWriter(file, i->overlaps, i->finite, i->integral);
+	WiggleIterator * res = newWiggleIterator(data, &TrackCacheTeeWiggleIteratorPop, &TrackCacheTeeWiggleIteratorSeek, i->default_value);
+	res->overlaps = i->overlaps;
+	res->finite = i->finite;
+	res->integral = i->integral;
+	return res;
+}
+
+//////////////////////////////////////////////////////
+// Reader
+//////////////////////////////////////////////////////
+
+typedef struct trackCacheReaderData_st {
+	char * filename;
+	const char * map;
+	size_t size;
+	bool overlaps;
+	bool finite, integral;
+	const CacheBlock * blocks;
+	int blockCount;
+	const CacheChrom * chroms;
+	char ** labels;
+	int chromCount;
+	// Current block, and next record within it
+	int chrom;
+	int block;
+	int index;
+	int count;
+	const int32_t * starts;
+	const int32_t * finishes;
+	const StoredValue * values;
+	// Set by a seek, the records are then trimmed to [start, stop) on chromosome chrom
+	bool limited;
+	int start;
+	int stop;
+} TrackCacheReaderData;
+
+static void corruptedTrackCache(TrackCacheReaderData * data) {
+	fprintf(stderr, "Corrupted track cache file %s\n", data->filename);
+	raiseError();
+}
+
+static void loadCacheBlock(TrackCacheReaderData * data, int block) {
+	const CacheBlock * entry = data->blocks + block;
+	data->block = block;
+	data->index = 0;
+	data->count = entry->count;
+	data->starts = (const int32_t *) (data->map + entry->offset);
+	data->finishes = data->starts + entry->count;
+	data->values = (const StoredValue *) (data->finishes + entry->count);
+}
+
+// Returns false at the end of the file, or of the chromosome of a seek
+static bool nextCacheBlock(TrackCacheReaderData * data) {
+	const CacheChrom * chrom = data->chroms + data->chrom;
+	if (!data->blockCount)
+		return false;
+	if (data->block + 1 == chrom->firstBlock + chrom->blockCount) {
+		if (data->limited || data->chrom + 1 == data->chromCount)
+			return false;
+		data->chrom++;
+	}
+	loadCacheBlock(data, data->block + 1);
+	return true;
+}
+
+static void TrackCacheReaderPop(WiggleIterator * wi) {
+	TrackCacheReaderData * data = (TrackCacheReaderData *) wi->data;
+	int index, start, finish;
+
+	while (true) {
+		if (data->index == data->count && !nextCacheBlock(data)) {
+			wi->done = true;
+			return;
+		}
+
+		index = data->index++;
+		start = data->starts[index];
+		finish = data->finishes[index];
+		if (data->limited) {
+			if (start >= data->stop) {
+				wi->done = true;
+				return;
+			}
+			// Only overlapping records can end before the region after the first record
+			if (finish <= data->start)
+				continue;
+			if (start < data->start)
+				start = data->start;
+			if (finish > data->stop)
+				finish = data->stop;
+		}
+
+		wi->chrom = data->labels[data->chrom];
+		wi->start = start;
+		wi->finish = finish;
+		wi->value = data->values[index];
+		return;
+	}
+}
+
+// Records which need no trimming are copied in bulk from the mapped block
+static void TrackCacheReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	TrackCacheReaderData * data = (TrackCacheReaderData *) wi->data;
+	int space, count, i;
+
+	while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+		pushSpanBatch(batch, wi);
+		space = SPAN_BATCH_SIZE - batch->count;
+		count = data->count - data->index;
+		if (count > space)
+			count = space;
+		if (data->overlaps && data->limited)
+			count = 0;
+		else if (data->limited)
+			// Finishes are sorted if the records do not overlap
+			for (i = 0; i < count; i++)
+				if (data->finishes[data->index + i] > data->stop)
+					count = i;
+
+		memcpy(batch->starts + batch->count, data->starts + data->index, count * sizeof(int));
+		memcpy(batch->finishes + batch->count, data->finishes + data->index, count * sizeof(int));
+		for (i = 0; i < count; i++) {
+			batch->values[batch->count + i] = data->values[data->index + i];
+			batch->chroms[batch->count + i] = data->labels[data->chrom];
+		}
+		batch->count += count;
+		data->index += count;
+		TrackCacheReaderPop(wi);
+	}
+}
+
+static int findCacheChrom(TrackCacheReaderData * data, const char * chrom) {
+	int low = 0, high = data->chromCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		int cmp = compareChroms(data->labels[middle], chrom);
+		if (cmp == 0)
+			return middle;
+		else if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+static void TrackCacheReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	TrackCacheReaderData * data = (TrackCacheReaderData *) wi->data;
+	int index = findCacheChrom(data, chrom);
+	const CacheChrom * entry;
+	int low, high;
+
+	wi->done = false;
+	data->limited = true;
+	data->start = start;
+	data->stop = finish;
+	if (index < 0) {
+		wi->done = true;
+		return;
+	}
+	data->chrom = index;
+	entry = data->chroms + index;
+
+	// First block which reaches past start, the running maxima are sorted
+	low = entry->firstBlock;
+	high = entry->firstBlock + entry->blockCount;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (data->blocks[middle].maxFinish <= start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == entry->firstBlock + entry->blockCount) {
+		wi->done = true;
+		return;
+	}
+	loadCacheBlock(data, low);
+
+	// Finishes are sorted if the records do not overlap, otherwise pop skips
+	if (!data->overlaps) {
+		high = data->count;
+		while (data->index < high) {
+			int middle = (data->index + high) / 2;
+			if (data->finishes[middle] <= start)
+				data->index = middle + 1;
+			else
+				high = middle;
+		}
+	}
+	TrackCacheReaderPop(wi);
+}
+
+static void openTrackCache(TrackCacheReaderData * data) {
+	struct stat info;
+	int64_t blockTable, chromTable;
+	int32_t blockCount, chromCount, flags;
+	uint32_t mark;
+	const char * trailer;
+	const char * names;
+	int i, file;
+
+	if ((file = open(data->filename, O_RDONLY)) < 0 || fstat(file, &info)) {
+		fprintf(stderr, "Could not open track cache file %s\n", data->filename);
+		raiseError();
+	}
+	data->size = info.st_size;
+	if (data->size < HEADER_SIZE + TRAILER_SIZE) 
+		corruptedTrackCache(data);
+	if ((data->map = mmap(NULL, data->size, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Could not map track cache file %s\n", data->filename);
+		raiseError();
+	}
+	close(file);
+
+	trailer = data->map + data->size - TRAILER_SIZE;
+	if (memcmp(data->map, magic, sizeof(magic)) || memcmp(trailer + 24, magic, sizeof(magic))) {
+		fprintf(stderr, "%s is not a complete wiggletools track cache file\n", data->filename);
+		raiseError();
+	}
+	memcpy(&mark, data->map + 8, sizeof(mark));
+	if (mark != byteOrderMark) {
+		fprintf(stderr, "%s was written on a machine with a different byte order\n", data->filename);
+		raiseError();
+	}
+	memcpy(&flags, data->map + 12, sizeof(flags));
+	data->overlaps = flags & OVERLAPS_FLAG;
+	data->finite = flags & FINITE_FLAG;
+	data->integral = flags & INTEGRAL_FLAG;
+	if (((flags & FLOAT_VALUES_FLAG) != 0) != (sizeof(StoredValue) == sizeof(float))) {
+		fprintf(stderr, "%s stores its values as %s, it must be read by a build of wiggletools which does the same\n", data->filename, flags & FLOAT_VALUES_FLAG ? "floats" : "doubles");
+		raiseError();
+	}
+
+	memcpy(&blockTable, trailer, sizeof(blockTable));
+	memcpy(&chromTable, trailer + 8, sizeof(chromTable));
+	memcpy(&blockCount, trailer + 16, sizeof(blockCount));
+	memcpy(&chromCount, trailer + 20, sizeof(chromCount));
+	if (blockCount < 0 || chromCount < 0 || blockTable < HEADER_SIZE || blockTable % 8
+	    || chromTable != blockTable + blockCount * (int64_t) sizeof(CacheBlock)
+	    || chromTable + chromCount * (int64_t) sizeof(CacheChrom) > (int64_t) data->size - TRAILER_SIZE)
+		corruptedTrackCache(data);
+	data->blocks = (const CacheBlock *) (data->map + blockTable);
+	data->blockCount = blockCount;
+	data->chroms = (const CacheChrom *) (data->map + chromTable);
+	data->chromCount = chromCount;
+
+	for (i = 0; i < blockCount; i++)
+		if (data->blocks[i].offset < HEADER_SIZE || data->blocks[i].count <= 0 || data->blocks[i].offset + (8 + sizeof(StoredValue)) * (int64_t) data->blocks[i].count > blockTable)
+			corruptedTrackCache(data);
+
+	names = (const char *) (data->chroms + chromCount);
+	data->labels = (char **) calloc(chromCount, sizeof(char *));
+	for (i = 0; i < chromCount; i++) {
+		const CacheChrom * chrom = data->chroms + i;
+		if (chrom->name < 0 || names + chrom->name >= data->map + data->size - TRAILER_SIZE || !memchr(names + chrom->name, '\0', data->map + data->size - TRAILER_SIZE - names - chrom->name)
+		    || chrom->blockCount <= 0 || chrom->firstBlock < 0 || chrom->firstBlock + chrom->blockCount > blockCount)
+			corruptedTrackCache(data);
+		data->labels[i] = internChromosome(names + chrom->name);
+	}
+
+	// Chromosomes are looked up by binary search
+	for (i = 1; i < chromCount; i++)
+		if (compareChroms(data->labels[i-1], data->labels[i]) >= 0) {
+			fprintf(stderr, "Track cache %s was written in another chromosome order: %s comes after %s\n", data->filename, data->labels[i], data->labels[i-1]);
+			raiseError();
+		}
+}
+
+WiggleIterator * TrackCacheReader(char * filename) {
+	TrackCacheReaderData * data = (TrackCacheReaderData *) calloc(1, sizeof(TrackCacheReaderData));
+	data->filename = filename;
+	openTrackCache(data);
+	if (data->blockCount) 
+		loadCacheBlock(data, 0);
+	WiggleIterator * res = newWiggleIterator(data, &TrackCacheReaderPop, &TrackCacheReaderSeek, 0);
+	res->popBatch = &TrackCacheReaderPopBatch;
+	res->overlaps = data->overlaps;
+	res->finite = data->finite;
+	res->integral = data->integral;
+	return res;
+}
@@ -0,0 +1,49 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TRACK_CACHE_H_
+#define _TRACK_CACHE_H_
+
+// Track cache files (.wtc), which replay the records of another track
+//
+// The records are stored uncompressed in blocks, one array per field,
+// in the byte order of the machine, so that the reader maps the file
+// into memory and copies the records straight out of the mapped pages.
+// A footer, written once the data is exhausted, indexes the blocks by
+// chromosome:
+//
+// header    magic (8 bytes), byte order mark, flags (int32 each)
+// blocks    starts, finishes (int32[count] each), values (double[count],
+//           or float[count] if flagged so), padded to 8 bytes
+// blocks    offset (int64), count, running max of the finishes (int32 each)
+// chroms    name offset, first block, block count (int32 each), padding
+// names     NUL terminated, padded to 8 bytes
+// trailer   block table offset, chromosome table offset (int64 each),
+//           block count, chromosome count (int32 each), magic (8 bytes)
+//
+// Coordinates are stored as the iterators hold them, 1-based half open.
+
+#include <stdio.h>
+#include "wiggleIterator.h"
+
+typedef struct trackCacheWriter_st TrackCacheWriter;
+
+// Records must arrive sorted. overlaps is set if they may overlap.
+TrackCacheWriter * openTrackCacheWriter(FILE * file, bool overlaps, bool finite, bool integral);
+void addTrackCacheValue(TrackCacheWriter * writer, char * chrom, int start, int finish, double value);
+void finishTrackCacheWriter(TrackCacheWriter * writer);
+
+bool isTrackCacheFilename(const char * filename);
+
+#endif
@@ -15,10 +15,13 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
 // Local header
 #include "wiggleIterator.h"
-#include "fib.h"
+#include "server.h"
+#include "objectStore.h"
 
 //////////////////////////////////////////////////////
 // Null operator
@@ -46,6 +49,11 @@ typedef struct UnaryWiggleIteratorData_st {
 	WiggleIterator * iter;
 } UnaryWiggleIteratorData;
 
+// False for NaNs and infinities
+static bool isInteger(double value) {
+	return isfinite(value) && value == floor(value);
+}
+
 void UnaryWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
@@ -53,6 +61,55 @@ void UnaryWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start,
 	pop(wi);
 }
 
+// Batched pops of unary operators: the current record of the iterator, which
+// is already computed, is pushed onto the batch, then the source fills the rest.
+// Returns the index of the first record which was read from the source, and 
+// still needs to be processed by the caller.
+static int UnaryWiggleIteratorFillBatch(WiggleIterator * wi, WiggleIterator * source, SpanBatch * batch) {
+	pushSpanBatch(batch, wi);
+	int first = batch->count;
+	popBatch(source, batch);
+	return first;
+}
+
+static bool lagsBehind(WiggleIterator * iter, const char * chrom, int start) {
+	int chrom_cmp = compareChroms(iter->chrom, chrom);
+	return chrom_cmp < 0 || (chrom_cmp == 0 && iter->finish <= start);
+}
+
+// Forward skips of the operators which turn each record of their input into
+// at most one record, ending no later: the input skips, then the operator 
+// pops past whatever still lags.
+static void skipThroughInput(WiggleIterator * wi, WiggleIterator * input, const char * chrom, int start) {
+	if (!lagsBehind(wi, chrom, start))
+		return;
+	skipTo(input, chrom, start);
+	pop(wi);
+	while (!wi->done && lagsBehind(wi, chrom, start))
+		pop(wi);
+}
+
+// The input must be the first field of the operator data
+static void UnaryWiggleIteratorSkipTo(WiggleIterator * wi, const char * chrom, int start) {
+	skipThroughInput(wi, ((UnaryWiggleIteratorData *) wi->data)->iter, chrom, start);
+}
+
+// Skips are only worth propagating down to the inputs which can skip faster than they pop
+static void propagateSkipTo(WiggleIterator * wi, WiggleIterator * input, void (*skip)(WiggleIterator *, const char *, int)) {
+	if (input->skipTo && !input->overlaps) {
+		wi->skipTo = skip;
+		wi->seekCost = input->seekCost;
+	}
+}
+
+// Overwrite record index with record src
+static void copySpanBatchRecord(SpanBatch * batch, int index, int src) {
+	batch->chroms[index] = batch->chroms[src];
+	batch->starts[index] = batch->starts[src];
+	batch->finishes[index] = batch->finishes[src];
+	batch->values[index] = batch->values[src];
+}
+
 //////////////////////////////////////////////////////
 // Union operator
 //////////////////////////////////////////////////////
@@ -84,10 +141,48 @@ void UnionWiggleIteratorPop(WiggleIterator * wi) {
 	wi->done = (count == 0);
 }
 
+static void UnionWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
+	WiggleIterator * iter = data->iter;
+	int first = UnaryWiggleIteratorFillBatch(wi, iter, batch);
+	int i, last = first - 1;
+
+	if (batch->count == first) {
+		// Nothing read from the source, the current record is complete
+		pop(wi);
+		return;
+	}
+
+	for (i = first; i < batch->count; i++) {
+		if (batch->chroms[i] == batch->chroms[last] && batch->finishes[last] >= batch->starts[i]) {
+			if (batch->finishes[i] > batch->finishes[last])
+				batch->finishes[last] = batch->finishes[i];
+		} else {
+			copySpanBatchRecord(batch, ++last, i);
+			batch->values[last] = wi->value;
+		}
+	}
+
+	// The last union may still overlap upcoming records, it becomes the current record
+	batch->count = last;
+	wi->chrom = batch->chroms[last];
+	wi->start = batch->starts[last];
+	wi->finish = batch->finishes[last];
+	while (!iter->done && wi->chrom == iter->chrom && wi->finish >= iter->start) {
+		if (iter->finish > wi->finish)
+			wi->finish = iter->finish;
+		pop(iter);
+	}
+}
+
 WiggleIterator * UnionWiggleIterator(WiggleIterator * i) {
 	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) calloc(1, sizeof(UnaryWiggleIteratorData));
 	data->iter = i;
-	return newWiggleIterator(data, &UnionWiggleIteratorPop, &UnaryWiggleIteratorSeek, 0);
+	WiggleIterator * new = newWiggleIterator(data, &UnionWiggleIteratorPop, &UnaryWiggleIteratorSeek, 0);
+	new->popBatch = &UnionWiggleIteratorPopBatch;
+	new->finite = true;
+	new->integral = true;
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -120,7 +215,7 @@ void TestNonOverlappingWiggleIteratorPop(WiggleIterator * wi) {
 		pop(iter);
 
 		if (wi->chrom == iter->chrom && wi->finish >= iter->start)
-			exit(1);
+			raiseError();
 	}
 }
 
@@ -145,7 +240,7 @@ void isZeroPop(WiggleIterator * wi) {
 	wi->finish = data->iter->finish;
 	wi->value = data->iter->value;
 	if (wi->value != 0) {
-		exit(1);
+		raiseError();
 	}
 	pop(data->iter);
 }
@@ -175,10 +270,21 @@ void DefaultValueWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void DefaultValueWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
+	UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	pop(wi);
+}
+
 WiggleIterator * DefaultValueWiggleIterator(WiggleIterator * i, double value) {
 	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) calloc(1, sizeof(UnaryWiggleIteratorData));
 	data->iter = i;
-	return newWiggleIterator(data, &DefaultValueWiggleIteratorPop, &UnaryWiggleIteratorSeek, value);
+	WiggleIterator * new = newWiggleIterator(data, &DefaultValueWiggleIteratorPop, &UnaryWiggleIteratorSeek, value);
+	new->popBatch = &DefaultValueWiggleIteratorPopBatch;
+	new->finite = i->finite && isfinite(value);
+	new->integral = i->integral && isInteger(value);
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -198,20 +304,63 @@ void CompressionWiggleIteratorPop(WiggleIterator * wi) {
 		wi->value = iter->value;
 		pop(iter);
 
-		while (!iter->done && strcmp(iter->chrom, wi->chrom) == 0 && iter->start == wi->finish && ((isnan(iter->value) && isnan(wi->value)) || iter->value == wi->value)) {
+		while (!iter->done && iter->chrom == wi->chrom && iter->start == wi->finish && (iter->value == wi->value || (isnan(iter->value) && isnan(wi->value)))) {
 			wi->finish = iter->finish;
 			pop(iter);
 		}
 	}
 }
 
+static bool canMergeRecords(char * chrom, int finish, double value, char * nextChrom, int nextStart, double nextValue) {
+	return nextChrom == chrom && nextStart == finish && (nextValue == value || (isnan(nextValue) && isnan(value)));
+}
+
+// The records of the batch are merged in place. The last one may still 
+// extend over the next records of the source, so it goes back to being 
+// the current record, unless the source is finished.
+static void CompressionWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
+	WiggleIterator * iter = data->iter;
+	int index = UnaryWiggleIteratorFillBatch(wi, iter, batch);
+	int last = index - 1;
+
+	for (; index < batch->count; index++) {
+		if (canMergeRecords(batch->chroms[last], batch->finishes[last], batch->values[last], batch->chroms[index], batch->starts[index], batch->values[index]))
+			batch->finishes[last] = batch->finishes[index];
+		else
+			copySpanBatchRecord(batch, ++last, index);
+	}
+
+	if (iter->done) {
+		batch->count = last + 1;
+		pop(wi);
+		return;
+	}
+
+	batch->count = last;
+	wi->chrom = batch->chroms[last];
+	wi->start = batch->starts[last];
+	wi->finish = batch->finishes[last];
+	wi->value = batch->values[last];
+	while (!iter->done && canMergeRecords(wi->chrom, wi->finish, wi->value, iter->chrom, iter->start, iter->value)) {
+		wi->finish = iter->finish;
+		pop(iter);
+	}
+}
+
+// Regular bins are kept apart, to be written as fixedStep
 WiggleIterator * CompressionWiggleIterator(WiggleIterator * i) {
-	if (i->overlaps)
+	if (i->overlaps || i->compressed || i->step)
 		return i;
 	else {
 		UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) calloc(1, sizeof(UnaryWiggleIteratorData));
 		data->iter = NonOverlappingWiggleIterator(i);
-		return newWiggleIterator(data, &CompressionWiggleIteratorPop, &UnaryWiggleIteratorSeek, i->default_value);
+		WiggleIterator * new = newWiggleIterator(data, &CompressionWiggleIteratorPop, &UnaryWiggleIteratorSeek, i->default_value);
+		new->popBatch = &CompressionWiggleIteratorPopBatch;
+		new->compressed = true;
+		new->finite = i->finite;
+		new->integral = i->integral;
+		return new;
 	}
 }
 
@@ -238,13 +387,29 @@ void UnitWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void UnitWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
+	int i, last = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+
+	for (i = last; i < batch->count; i++) {
+		if (batch->values[i] != 0 && !isnan(batch->values[i])) {
+			copySpanBatchRecord(batch, last, i);
+			batch->values[last++] = wi->value;
+		}
+	}
+	batch->count = last;
+	pop(wi);
+}
+
 WiggleIterator * UnitWiggleIterator(WiggleIterator * i) {
 	if (i->overlaps) {
 		return UnionWiggleIterator(i);
 	} else {
 		UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) calloc(1, sizeof(UnaryWiggleIteratorData));
 		data->iter = i;
-		return UnionWiggleIterator(newWiggleIterator(data, &UnitWiggleIteratorPop, &UnaryWiggleIteratorSeek, 0));
+		WiggleIterator * new = newWiggleIterator(data, &UnitWiggleIteratorPop, &UnaryWiggleIteratorSeek, 0);
+		new->popBatch = &UnitWiggleIteratorPopBatch;
+		return UnionWiggleIterator(new);
 	}
 }
 
@@ -254,9 +419,50 @@ WiggleIterator * UnitWiggleIterator(WiggleIterator * i) {
 
 typedef struct CoverageWiggleIteratorData_st {
 	WiggleIterator * iter;
-	FibHeap * heap;
+	// Finishes of the reads over the current position, as a binary min-heap
+	int * finishes;
+	int count;
+	int capacity;
 } CoverageWiggleIteratorData;
 
+// Reads of equal length come in order of finish, and then sift up for free
+static void pushFinish(CoverageWiggleIteratorData * data, int finish) {
+	int pos = data->count++;
+
+	if (data->count > data->capacity) {
+		data->capacity = data->capacity ? 2 * data->capacity : 64;
+		data->finishes = (int *) realloc(data->finishes, data->capacity * sizeof(int));
+		if (!data->finishes) {
+			fprintf(stderr, "Could not allocate coverage heap of %i reads\n", data->capacity);
+			raiseError();
+		}
+	}
+
+	while (pos > 0 && data->finishes[(pos - 1) / 2] > finish) {
+		data->finishes[pos] = data->finishes[(pos - 1) / 2];
+		pos = (pos - 1) / 2;
+	}
+	data->finishes[pos] = finish;
+}
+
+static void popFinish(CoverageWiggleIteratorData * data) {
+	int last = data->finishes[--data->count];
+	int pos = 0;
+
+	for (;;) {
+		int child = 2 * pos + 1;
+		if (child >= data->count)
+			break;
+		if (child + 1 < data->count && data->finishes[child + 1] < data->finishes[child])
+			child++;
+		if (data->finishes[child] >= last)
+			break;
+		data->finishes[pos] = data->finishes[child];
+		pos = child;
+	}
+	data->finishes[pos] = last;
+}
+
 void CoverageWiggleIteratorPop(WiggleIterator * wi) {
 	CoverageWiggleIteratorData * data = (CoverageWiggleIteratorData *) wi->data;
 	WiggleIterator * iter = data->iter;
@@ -264,14 +470,14 @@ void CoverageWiggleIteratorPop(WiggleIterator * wi) {
 		if (wi->chrom[0] == '\0')
 			wi->value = 0;
 
-		while (fh_notempty(data->heap) && fh_min(data->heap) == wi->finish) {
+		while (data->count && data->finishes[0] == wi->finish) {
 			wi->value--;
-			fh_extractmin(data->heap);
+			popFinish(data);
 		}
 
 		if (wi->value < 0) {
 			fprintf(stderr, "Negative coverage???\n");
-			exit(1);
+			raiseError();
 		}
 
 		if (wi->value) {
@@ -281,34 +487,29 @@ void CoverageWiggleIteratorPop(WiggleIterator * wi) {
 			wi->start = iter->start;
 		}
 
-		while (!iter->done && !strcmp(iter->chrom, wi->chrom) && iter->start == wi->start) {
-			fh_insert(data->heap, iter->finish, 0);
+		while (!iter->done && iter->chrom == wi->chrom && iter->start == wi->start) {
+			pushFinish(data, iter->finish);
 			pop(iter);
 			wi->value++;
 		}
 
-		if (!fh_notempty(data->heap) || (!strcmp(iter->chrom, wi->chrom) && iter->start < fh_min(data->heap)))
+		if (!data->count || (iter->chrom == wi->chrom && iter->start < data->finishes[0]))
 			wi->finish = iter->start;
 		else
-			wi->finish = fh_min(data->heap);
-	} else if (fh_notempty(data->heap)) {
+			wi->finish = data->finishes[0];
+	} else if (data->count) {
 		wi->start = wi->finish;
-		while (fh_notempty(data->heap) && fh_min(data->heap) == wi->start) {
+		while (data->count && data->finishes[0] == wi->start) {
 			wi->value--;
-			fh_extractmin(data->heap);
+			popFinish(data);
 		}
 
 		if (wi->value)
-			wi->finish = fh_min(data->heap);
-		else {
+			wi->finish = data->finishes[0];
+		else
 			wi->done = true;
-			fh_deleteheap(data->heap);
-			data->heap = NULL;
-		}
 	} else {
 		wi->done = true;
-		fh_deleteheap(data->heap);
-		data->heap = NULL;
 	}
 }
 
@@ -316,8 +517,7 @@ void CoverageWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int sta
 	CoverageWiggleIteratorData * data = (CoverageWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
 	wi->value = 0;
-	fh_deleteheap(data->heap);
-	data->heap = fh_makeheap();
+	data->count = 0;
 	pop(wi);
 }
 
@@ -325,12 +525,185 @@ WiggleIterator * CoverageWiggleIterator(WiggleIterator * i) {
 	if (i->overlaps) {
 		CoverageWiggleIteratorData * data = (CoverageWiggleIteratorData *) calloc(1, sizeof(CoverageWiggleIteratorData));
 		data->iter = i;
-		data->heap = fh_makeheap();
-		return newWiggleIterator(data, &CoverageWiggleIteratorPop, &CoverageWiggleIteratorSeek, 0);
+		WiggleIterator * new = newWiggleIterator(data, &CoverageWiggleIteratorPop, &CoverageWiggleIteratorSeek, 0);
+		new->finite = true;
+		new->integral = true;
+		return new;
 	} else
 		return i;
 }
 
+//////////////////////////////////////////////////////
+// Extended coverage operator
+//////////////////////////////////////////////////////
+
+// Coverage of the records of the source, each extended into a fragment, in
+// a single sweep: the ends of the fragments go into a difference array, as
+// in bamCoverageReader.c, integrated into runs of constant depth once no
+// further fragment can start upstream. Stranded fragments run the given
+// length from the 5' end of their record, i.e. downstream of the start of
+// forward and unstranded records and upstream of the finish of reverse
+// ones. Otherwise records are extended by the given length on both sides,
+// as extend does.
+
+typedef struct extendedCoverageWiggleIteratorData_st {
+	WiggleIterator * iter;
+	int extension;
+	bool stranded;
+	// No fragment starts more than this upstream of its record
+	int lag;
+	char * chrom;
+	// Depth changes at positions base, base + 1, ... base + capacity - 1
+	int * diff;
+	int capacity, base;
+	// First unresolved position, and finish of the furthest fragment
+	int next, end;
+	int depth;
+	// Region seeked, stop is 0 when not seeked
+	int start, stop;
+} ExtendedCoverageWiggleIteratorData;
+
+static bool moreFragments(ExtendedCoverageWiggleIteratorData * data) {
+	return !data->iter->done && data->iter->chrom == data->chrom;
+}
+
+static void resetFragmentWindow(ExtendedCoverageWiggleIteratorData * data, int position) {
+	memset(data->diff, 0, data->capacity * sizeof(int));
+	data->base = data->next = data->end = position > 1 ? position : 1;
+	data->depth = 0;
+}
+
+// Makes room in the window for positions up to position included
+static void reserveFragmentWindow(ExtendedCoverageWiggleIteratorData * data, int position) {
+	if (position - data->base < data->capacity)
+		return;
+
+	// Drop resolved positions
+	int shift = data->next - data->base;
+	int used = data->end - data->next + 1;
+	memmove(data->diff, data->diff + shift, used * sizeof(int));
+	memset(data->diff + used, 0, (data->capacity - used) * sizeof(int));
+	data->base = data->next;
+
+	// Keep at least half the window free so that compactions stay rare
+	if (2 * (position - data->base) >= data->capacity) {
+		int capacity = data->capacity;
+		while (2 * (position - data->base) >= capacity)
+			capacity *= 2;
+		data->diff = (int *) realloc(data->diff, capacity * sizeof(int));
+		memset(data->diff + data->capacity, 0, (capacity - data->capacity) * sizeof(int));
+		data->capacity = capacity;
+	}
+}
+
+static void addFragment(ExtendedCoverageWiggleIteratorData * data, WiggleIterator * iter) {
+	int start, finish;
+
+	if (!data->stranded) {
+		start = iter->start - data->extension;
+		finish = iter->finish + data->extension;
+	} else if (iter->strand < 0) {
+		start = iter->finish - data->extension;
+		finish = iter->finish;
+	} else {
+		start = iter->start;
+		finish = iter->start + data->extension;
+	}
+	// Fragments cannot start before the window, which starts at the first base at the latest
+	if (start < data->base)
+		start = data->base;
+	if (finish <= start)
+		return;
+
+	reserveFragmentWindow(data, finish);
+	data->diff[start - data->base]++;
+	data->diff[finish - data->base]--;
+	if (finish > data->end)
+		data->end = finish;
+}
+
+// Adds the fragments which can cover position, the others start after it
+static void readFragmentsUpTo(ExtendedCoverageWiggleIteratorData * data, int position) {
+	WiggleIterator * iter = data->iter;
+	for (; moreFragments(data) && iter->start - data->lag <= position; pop(iter))
+		addFragment(data, iter);
+}
+
+void ExtendedCoverageWiggleIteratorPop(WiggleIterator * wi) {
+	ExtendedCoverageWiggleIteratorData * data = (ExtendedCoverageWiggleIteratorData *) wi->data;
+	WiggleIterator * iter = data->iter;
+	int start, finish;
+
+	for (;;) {
+		readFragmentsUpTo(data, data->next);
+		if (data->next >= data->end) {
+			// No fragment left over next, jump to the next record
+			if (!moreFragments(data)) {
+				if (iter->done || data->stop) {
+					wi->done = true;
+					return;
+				}
+				data->chrom = iter->chrom;
+			}
+			resetFragmentWindow(data, iter->start - data->lag);
+			continue;
+		}
+
+		start = data->next;
+		data->depth += data->diff[start - data->base];
+		for (finish = start + 1;; finish++) {
+			readFragmentsUpTo(data, finish);
+			if (data->diff[finish - data->base])
+				break;
+		}
+		data->next = finish;
+
+		if (data->stop && start >= data->stop) {
+			wi->done = true;
+			return;
+		}
+		if (data->depth && finish > data->start)
+			break;
+	}
+
+	wi->chrom = data->chrom;
+	wi->start = start > data->start ? start : data->start;
+	wi->finish = data->stop && finish > data->stop ? data->stop : finish;
+	wi->value = data->depth;
+}
+
+// Records up to lag bases away from the region reach into it
+void ExtendedCoverageWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	ExtendedCoverageWiggleIteratorData * data = (ExtendedCoverageWiggleIteratorData *) wi->data;
+	seek(data->iter, chrom, start > data->lag ? start - data->lag : 1, finish + data->lag);
+	data->chrom = (char *) chrom;
+	data->start = start;
+	data->stop = finish;
+	resetFragmentWindow(data, start - data->lag);
+	wi->done = false;
+	pop(wi);
+}
+
+WiggleIterator * ExtendedCoverageWiggleIterator(WiggleIterator * i, int extension, bool stranded) {
+	ExtendedCoverageWiggleIteratorData * data = (ExtendedCoverageWiggleIteratorData *) calloc(1, sizeof(ExtendedCoverageWiggleIteratorData));
+	if (extension < 0) {
+		fprintf(stderr, "Cannot extend records by a negative length: %i\n", extension);
+		raiseError();
+	}
+	data->iter = i;
+	data->extension = extension;
+	data->stranded = stranded;
+	data->lag = extension;
+	data->capacity = 1024;
+	data->diff = (int *) calloc(data->capacity, sizeof(int));
+	data->chrom = internChromosome("");
+	resetFragmentWindow(data, 1);
+	WiggleIterator * new = newWiggleIterator(data, &ExtendedCoverageWiggleIteratorPop, &ExtendedCoverageWiggleIteratorSeek, 0);
+	new->finite = true;
+	new->integral = true;
+	return new;
+}
+
 //////////////////////////////////////////////////////
 // High pass filter operator
 //////////////////////////////////////////////////////
@@ -344,7 +717,8 @@ void HighPassFilterWiggleIteratorPop(WiggleIterator * wi) {
 	HighPassFilterWiggleIteratorData * data = (HighPassFilterWiggleIteratorData *) wi->data;
 	WiggleIterator * iter = data->iter;
 	if (!data->iter->done) {
-		while (!data->iter->done && (data->iter->value <= data->scalar || isnan(data->iter->value)))
+		// NaN values fail the comparison and are filtered out
+		while (!data->iter->done && !(data->iter->value > data->scalar))
 			pop(data->iter);
 		if (data->iter->done) {
 			wi->done = true;
@@ -365,11 +739,28 @@ void HighPassFilterWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, i
 	pop(wi);
 }
 
+static void HighPassFilterWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	HighPassFilterWiggleIteratorData * data = (HighPassFilterWiggleIteratorData *) wi->data;
+	int i, last = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+
+	// NaN values fail the comparison and are filtered out
+	for (i = last; i < batch->count; i++) {
+		if (batch->values[i] > data->scalar) {
+			copySpanBatchRecord(batch, last, i);
+			batch->values[last++] = wi->value;
+		}
+	}
+	batch->count = last;
+	pop(wi);
+}
+
 WiggleIterator * HighPassFilterWiggleIterator(WiggleIterator * i, double s) {
 	HighPassFilterWiggleIteratorData * data = (HighPassFilterWiggleIteratorData *) calloc(1, sizeof(HighPassFilterWiggleIteratorData));
 	data->iter = i;
 	data->scalar = s;
-	return UnionWiggleIterator(newWiggleIterator(data, &HighPassFilterWiggleIteratorPop, &HighPassFilterWiggleIteratorSeek, 0));
+	WiggleIterator * new = newWiggleIterator(data, &HighPassFilterWiggleIteratorPop, &HighPassFilterWiggleIteratorSeek, 0);
+	new->popBatch = &HighPassFilterWiggleIteratorPopBatch;
+	return UnionWiggleIterator(new);
 }
 
 //////////////////////////////////////////////////////
@@ -381,21 +772,50 @@ typedef struct overlapWiggleIteratorData_st {
 	WiggleIterator * mask;
 } OverlapWiggleIteratorData;
 
+// Popping across a gap costs a record at a time, skipping it costs a restart
+// of the reader, i.e. an index lookup and a block read, and a round trip on
+// remote files. The lagging side first pops a few records, which tell how many
+// bases its records cover on average, then skips if the rest of the gap would
+// take more pops than the seek cost of the reader.
+#define CATCH_UP_POPS 32
+
+static double skipPops(WiggleIterator * iter) {
+	return iter->seekCost > 0 && isfinite(iter->seekCost) ? iter->seekCost : LOCAL_SEEK_COST;
+}
+
+// Drops the records of iter which end at or before chrom:start
+void catchUp(WiggleIterator * iter, const char * chrom, int start) {
+	char * fromChrom = iter->chrom;
+	int from = iter->start;
+	int pops;
+
+	for (pops = 0; pops < CATCH_UP_POPS && !iter->done && lagsBehind(iter, chrom, start); pops++)
+		pop(iter);
+	if (iter->done || !lagsBehind(iter, chrom, start))
+		return;
+
+	// Overlapping records do not come sorted by finish, so the gap cannot be skipped safely
+	if (!iter->skipTo || iter->overlaps)
+		skipTo(iter, chrom, start);
+	// Other chromosomes are assumed to be far away
+	else if (iter->chrom != chrom || iter->chrom != fromChrom || (start - iter->finish) * (double) CATCH_UP_POPS > skipPops(iter) * (iter->finish - from))
+		iter->skipTo(iter, chrom, start);
+	else
+		while (!iter->done && lagsBehind(iter, chrom, start))
+			pop(iter);
+}
+
 void OverlapWiggleIteratorPop(WiggleIterator * wi) {
 	OverlapWiggleIteratorData * data = (OverlapWiggleIteratorData *) wi->data;
 	WiggleIterator * source = data->source;
 	WiggleIterator * mask = data->mask;
 
 	while (!source->done && !mask->done) {
-		int chrom_cmp = strcmp(mask->chrom, source->chrom);
-		if (chrom_cmp < 0)
-			pop(mask);
-		else if (chrom_cmp > 0)
-			pop(source);
-		else if (mask->finish <= source->start)
-			pop(mask);
-		else if (source->finish <= mask->start)
-			pop(source);
+		int chrom_cmp = compareChroms(mask->chrom, source->chrom);
+		if (chrom_cmp < 0 || (chrom_cmp == 0 && mask->finish <= source->start))
+			catchUp(mask, source->chrom, source->start);
+		else if (chrom_cmp > 0 || source->finish <= mask->start)
+			catchUp(source, mask->chrom, mask->start);
 		else
 			break;
 	} 
@@ -411,6 +831,11 @@ void OverlapWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+// Only the source is skipped, the mask follows at the next pop
+static void OverlapWiggleIteratorSkipTo(WiggleIterator * wi, const char * chrom, int start) {
+	skipThroughInput(wi, ((OverlapWiggleIteratorData *) wi->data)->source, chrom, start);
+}
+
 void OverlapWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	OverlapWiggleIteratorData * data = (OverlapWiggleIteratorData *) wi->data;
 	seek(data->source, chrom, start, finish);
@@ -424,6 +849,7 @@ WiggleIterator * OverlapWiggleIterator(WiggleIterator * source, WiggleIterator *
 	data->mask = mask;
 	WiggleIterator * wi = newWiggleIterator(data, &OverlapWiggleIteratorPop, &OverlapWiggleIteratorSeek, source->default_value);
 	wi->overlaps = source->overlaps;
+	propagateSkipTo(wi, source, &OverlapWiggleIteratorSkipTo);
 	return wi;
 }
 
@@ -437,15 +863,11 @@ void TrimWiggleIteratorPop(WiggleIterator * wi) {
 	WiggleIterator * mask = data->mask;
 
 	while (!source->done && !mask->done) {
-		int chrom_cmp = strcmp(mask->chrom, source->chrom);
-		if (chrom_cmp < 0)
-			pop(mask);
-		else if (chrom_cmp > 0)
-			pop(source);
-		else if (mask->finish <= source->start)
-			pop(mask);
-		else if (source->finish <= mask->start)
-			pop(source);
+		int chrom_cmp = compareChroms(mask->chrom, source->chrom);
+		if (chrom_cmp < 0 || (chrom_cmp == 0 && mask->finish <= source->start))
+			catchUp(mask, source->chrom, source->start);
+		else if (chrom_cmp > 0 || source->finish <= mask->start)
+			catchUp(source, mask->chrom, mask->start);
 		else
 			break;
 	} 
@@ -467,6 +889,7 @@ WiggleIterator * TrimWiggleIterator(WiggleIterator * source, WiggleIterator * ma
 	data->mask = NonOverlappingWiggleIterator(mask);
 	WiggleIterator * wi = newWiggleIterator(data, &TrimWiggleIteratorPop, &OverlapWiggleIteratorSeek, source->default_value);
 	wi->overlaps = source->overlaps;
+	propagateSkipTo(wi, source, &OverlapWiggleIteratorSkipTo);
 	return wi;
 }
 
@@ -480,13 +903,11 @@ void NoverlapWiggleIteratorPop(WiggleIterator * wi) {
 	WiggleIterator * mask = data->mask;
 
 	while (!source->done && !mask->done) {
-		int chrom_cmp = strcmp(mask->chrom, source->chrom);
-		if (chrom_cmp < 0)
-			pop(mask);
+		int chrom_cmp = compareChroms(mask->chrom, source->chrom);
+		if (chrom_cmp < 0 || (chrom_cmp == 0 && mask->finish <= source->start))
+			catchUp(mask, source->chrom, source->start);
 		else if (chrom_cmp > 0)
 			break;
-		else if (mask->finish <= source->start)
-			pop(mask);
 		else if (source->finish <= mask->start)
 			break;
 		else
@@ -510,6 +931,7 @@ WiggleIterator * NoverlapWiggleIterator(WiggleIterator * source, WiggleIterator
 	data->mask = mask;
 	WiggleIterator * wi = newWiggleIterator(data, &NoverlapWiggleIteratorPop, &OverlapWiggleIteratorSeek, source->default_value);
 	wi->overlaps = source->overlaps;
+	propagateSkipTo(wi, source, &OverlapWiggleIteratorSkipTo);
 	return wi;
 }
 
@@ -536,7 +958,7 @@ void NearestWiggleIteratorPop(WiggleIterator * wi) {
 	}
 
 	while (!mask->done) {
-		int chrom_cmp = strcmp(mask->chrom, source->chrom);
+		int chrom_cmp = compareChroms(mask->chrom, source->chrom);
 		if (chrom_cmp < 0)
 			pop(mask);
 		else if (chrom_cmp > 0)
@@ -555,12 +977,12 @@ void NearestWiggleIteratorPop(WiggleIterator * wi) {
 	wi->finish = source->finish;
 
 	bool set = false;
-	if (data->prev_chrom && strcmp(data->prev_chrom, source->chrom) == 0) {
+	if (data->prev_chrom && data->prev_chrom == source->chrom) {
 		wi->value = wi->start - data->prev_finish + 1;
 		set = true;
 	}	
 
-	if (!mask->done && strcmp(mask->chrom, source->chrom) == 0 && (!set || wi->value > mask->start - wi->finish + 1)) { 
+	if (!mask->done && mask->chrom == source->chrom && (!set || wi->value > mask->start - wi->finish + 1)) { 
 		wi->value = mask->start - wi->finish + 1;
 		set = true;
 	}
@@ -616,6 +1038,14 @@ void ScaleWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void ScaleWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) wi->data;
+	int i = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	for (; i < batch->count; i++)
+		batch->values[i] *= data->scalar;
+	pop(wi);
+}
+
 void ScaleWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
@@ -631,7 +1061,12 @@ WiggleIterator * ScaleWiggleIterator(WiggleIterator * i, double s) {
 		default_value = NAN;
 	else
 		default_value = i->default_value * s;
-	return newWiggleIterator(data, &ScaleWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &ScaleWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	new->popBatch = &ScaleWiggleIteratorPopBatch;
+	new->finite = data->iter->finite && isfinite(s);
+	new->integral = data->iter->integral && isInteger(s);
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -652,6 +1087,14 @@ void ShiftWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void ShiftWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) wi->data;
+	int i = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	for (; i < batch->count; i++)
+		batch->values[i] += data->scalar;
+	pop(wi);
+}
+
 WiggleIterator * ShiftWiggleIterator(WiggleIterator * i, double s) {
 	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) calloc(1, sizeof(ScaleWiggleIteratorData));
 	data->iter = NonOverlappingWiggleIterator(i);
@@ -661,7 +1104,63 @@ WiggleIterator * ShiftWiggleIterator(WiggleIterator * i, double s) {
 		default_value = NAN;
 	else
 		default_value = i->default_value + s;
-	return newWiggleIterator(data, &ShiftWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &ShiftWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	new->popBatch = &ShiftWiggleIteratorPopBatch;
+	new->finite = data->iter->finite && isfinite(s);
+	new->integral = data->iter->integral && isInteger(s);
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
+}
+
+//////////////////////////////////////////////////////
+// Tables of logarithms and exponentials
+// Small non-negative integers, e.g. read coverage, are
+// looked up in tables filled by libm itself, so the
+// results are exactly the same as without the tables.
+//////////////////////////////////////////////////////
+
+#define LOG_TABLE_SIZE 4096
+#define EXP_TABLE_SIZE 256
+
+static double logTable[LOG_TABLE_SIZE];
+static double * naturalExpTable = NULL;
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static bool isTableIndex(double value, int size) {
+	return value >= 0 && value < size && value == (int) value;
+}
+
+// exp(radixLog * i) for i in [0, EXP_TABLE_SIZE)
+static double * newExpTable(double radixLog) {
+	double * table = (double *) calloc(EXP_TABLE_SIZE, sizeof(double));
+	int i;
+	for (i = 0; i < EXP_TABLE_SIZE; i++)
+		table[i] = exp(i * radixLog);
+	return table;
+}
+
+static void fillTables() {
+	int i;
+	for (i = 0; i < LOG_TABLE_SIZE; i++)
+		logTable[i] = log(i);
+	naturalExpTable = newExpTable(1);
+}
+
+static void initTables() {
+	pthread_once(&tablesOnce, &fillTables);
+}
+
+static inline double tableLog(double value) {
+	if (isTableIndex(value, LOG_TABLE_SIZE))
+		return logTable[(int) value];
+	return log(value);
+}
+
+// exp(radixLog * value), table being filled by newExpTable with radixLog
+static inline double tableExp(const double * table, double radixLog, double value) {
+	if (isTableIndex(value, EXP_TABLE_SIZE))
+		return table[(int) value];
+	return exp(value * radixLog);
 }
 
 //////////////////////////////////////////////////////
@@ -690,13 +1189,31 @@ void LogWiggleIteratorPop(WiggleIterator * wi) {
 		if (isnan(iter->value) || iter->value < 0)
 			wi->value = NAN;
 		else
-			wi->value = log(iter->value) / data->baseLog;
+			wi->value = tableLog(iter->value) / data->baseLog;
 		pop(data->iter);
 	} else {
 		wi->done = true;
 	}
 }
 
+static void LogWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	LogWiggleIteratorData * data = (LogWiggleIteratorData *) wi->data;
+	int i, last = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+
+	for (i = last; i < batch->count; i++) {
+		double value = batch->values[i];
+		if (value <= 0)
+			continue;
+		copySpanBatchRecord(batch, last, i);
+		if (isnan(value))
+			batch->values[last++] = NAN;
+		else
+			batch->values[last++] = tableLog(value) / data->baseLog;
+	}
+	batch->count = last;
+	pop(wi);
+}
+
 void LogWiggleIteratorSeek(WiggleIterator * wi, const char  * chrom, int start, int finish) {
 	LogWiggleIteratorData * data = (LogWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
@@ -708,12 +1225,16 @@ WiggleIterator * NaturalLogWiggleIterator(WiggleIterator * i) {
 	data->iter = i;
 	data->base = E;
 	data->baseLog = 1;
+	initTables();
 	double default_value;
 	if (!isnan(i->default_value) && i->default_value > 0)
 		default_value =  log(i->default_value) / data->baseLog;
 	else
 		default_value = NAN;
-	return newWiggleIterator(data, &LogWiggleIteratorPop, &LogWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &LogWiggleIteratorPop, &LogWiggleIteratorSeek, default_value);
+	new->popBatch = &LogWiggleIteratorPopBatch;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 WiggleIterator * LogWiggleIterator(WiggleIterator * i, double s) {
@@ -721,12 +1242,16 @@ WiggleIterator * LogWiggleIterator(WiggleIterator * i, double s) {
 	data->iter = NonOverlappingWiggleIterator(i);
 	data->base = s;
 	data->baseLog = log(s);
+	initTables();
 	double default_value;
 	if (!isnan(i->default_value) && i->default_value > 0)
 		default_value =  log(i->default_value) / data->baseLog;
 	else
 		default_value = NAN;
-	return newWiggleIterator(data, &LogWiggleIteratorPop, &LogWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &LogWiggleIteratorPop, &LogWiggleIteratorSeek, default_value);
+	new->popBatch = &LogWiggleIteratorPopBatch;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -737,6 +1262,7 @@ typedef struct expWiggleIteratorData_st {
 	WiggleIterator * iter;
 	double radix;
 	double radixLog;
+	double * table;
 } ExpWiggleIteratorData;
 
 void ExpWiggleIteratorPop(WiggleIterator * wi) {
@@ -746,13 +1272,21 @@ void ExpWiggleIteratorPop(WiggleIterator * wi) {
 		wi->chrom = iter->chrom;
 		wi->start = iter->start;
 		wi->finish = iter->finish;
-		wi->value = exp(iter->value * data->radixLog);
+		wi->value = tableExp(data->table, data->radixLog, iter->value);
 		pop(iter);
 	} else {
 		wi->done = true;
 	}
 }
 
+static void ExpWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	ExpWiggleIteratorData * data = (ExpWiggleIteratorData *) wi->data;
+	int i = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	for (; i < batch->count; i++)
+		batch->values[i] = tableExp(data->table, data->radixLog, batch->values[i]);
+	pop(wi);
+}
+
 void ExpWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	ExpWiggleIteratorData * data = (ExpWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
@@ -764,12 +1298,16 @@ WiggleIterator * ExpWiggleIterator(WiggleIterator * i, double s) {
 	data->iter = i;
 	data->radix = s;
 	data->radixLog = log(data->radix);
+	data->table = newExpTable(data->radixLog);
 	float default_value;
 	if (isnan(i->default_value))
 		default_value = NAN;
 	else
 		default_value = exp(i->default_value * data->radixLog);
-	return newWiggleIterator(data, &ExpWiggleIteratorPop, &ExpWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &ExpWiggleIteratorPop, &ExpWiggleIteratorSeek, default_value);
+	new->popBatch = &ExpWiggleIteratorPopBatch;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 WiggleIterator * NaturalExpWiggleIterator(WiggleIterator * i) {
@@ -777,12 +1315,17 @@ WiggleIterator * NaturalExpWiggleIterator(WiggleIterator * i) {
 	data->iter = NonOverlappingWiggleIterator(i);
 	data->radix = E;
 	data->radixLog = 1;
+	initTables();
+	data->table = naturalExpTable;
 	float default_value;
 	if (isnan(i->default_value))
 		default_value = NAN;
 	else
 		default_value = exp(i->default_value * data->radixLog);
-	return newWiggleIterator(data, &ExpWiggleIteratorPop, &ExpWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &ExpWiggleIteratorPop, &ExpWiggleIteratorSeek, default_value);
+	new->popBatch = &ExpWiggleIteratorPopBatch;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -807,6 +1350,18 @@ static void PowerWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void PowerWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) wi->data;
+	int i = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	for (; i < batch->count; i++) {
+		if ((data->scalar < 0 && batch->values[i] <= 0) || isnan(batch->values[i]))
+			batch->values[i] = NAN;
+		else
+			batch->values[i] = pow(batch->values[i], data->scalar);
+	}
+	pop(wi);
+}
+
 WiggleIterator * PowerWiggleIterator(WiggleIterator * i, double s) {
 	ScaleWiggleIteratorData * data = (ScaleWiggleIteratorData *) calloc(1, sizeof(ScaleWiggleIteratorData));
 	data->iter = NonOverlappingWiggleIterator(i);
@@ -816,7 +1371,10 @@ WiggleIterator * PowerWiggleIterator(WiggleIterator * i, double s) {
 		default_value = pow(i->default_value, s);
 	else
 		default_value = NAN;
-	return newWiggleIterator(data, &PowerWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &PowerWiggleIteratorPop, &ScaleWiggleIteratorSeek, default_value);
+	new->popBatch = &PowerWiggleIteratorPopBatch;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -858,7 +1416,7 @@ static void AbsWiggleIteratorPop(WiggleIterator * wi) {
 		wi->start = iter->start;
 		wi->finish = iter->finish;
 		if (!isnan(iter->value))
-			wi->value = abs(iter->value);
+			wi->value = fabs(iter->value);
 		else
 			wi->value = NAN;
 		pop(iter);
@@ -867,127 +1425,508 @@ static void AbsWiggleIteratorPop(WiggleIterator * wi) {
 	}
 }
 
+static void AbsWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) wi->data;
+	int i = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+	for (; i < batch->count; i++)
+		if (!isnan(batch->values[i]))
+			batch->values[i] = fabs(batch->values[i]);
+	pop(wi);
+}
+
 WiggleIterator * AbsWiggleIterator(WiggleIterator * i) {
 	UnaryWiggleIteratorData * data = (UnaryWiggleIteratorData *) calloc(1, sizeof(UnaryWiggleIteratorData));
 	data->iter = NonOverlappingWiggleIterator(i);
 	double default_value;
 	if (!isnan(i->default_value))
-		default_value = abs(i->default_value);
+		default_value = fabs(i->default_value);
 	else
 		default_value = NAN;
-	return newWiggleIterator(data, &AbsWiggleIteratorPop, &UnaryWiggleIteratorSeek, default_value);
+	WiggleIterator * new = newWiggleIterator(data, &AbsWiggleIteratorPop, &UnaryWiggleIteratorSeek, default_value);
+	new->popBatch = &AbsWiggleIteratorPopBatch;
+	new->finite = data->iter->finite;
+	new->integral = data->iter->integral;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	return new;
 }
 
 //////////////////////////////////////////////////////
-// Smooth' operator !
+// Fused scalar operators
 //////////////////////////////////////////////////////
 
-typedef struct SmoothWiggleIteratorData_st {
+// A chain of scalar operators evaluated within a single iterator, with
+// exactly the same results as the corresponding stack of operators above.
+
+typedef struct scalarKernel_st {
+	ScalarOperation operation;
+	double scalar;
+	// Log of the base for SCALAR_LOG
+	double scalarLog;
+	// The input of the operator holds no NaN
+	bool finite;
+} ScalarKernel;
+
+typedef struct fusedScalarWiggleIteratorData_st {
 	WiggleIterator * iter;
-	double * buffer;
-	double sum;
-	int latest;
-	int oldest;
-	int last_position;
+	ScalarKernel * kernels;
 	int count;
-	int width;
-} SmoothWiggleIteratorData;
+} FusedScalarWiggleIteratorData;
 
-static double smoothWiggleIteratorRecomputeSum(SmoothWiggleIteratorData * data) {
-       double sum = 0;
-       int index;
-       if (data->oldest < data->latest)   
-               for (index = data->oldest + 1; index < data->latest; index++)
-                       sum += data->buffer[index];
-       else {
-               for (index = data->oldest + 1; index < data->width; index++)
-                       sum += data->buffer[index];
-               for (index = 0; index < data->latest; index++)
-                       sum += data->buffer[index];
-       }
-
-       return sum;
-}
-   
-static void smoothWiggleIteratorEraseOne(SmoothWiggleIteratorData * data) {
-	if (isnan(data->buffer[data->oldest]))
-               data->sum = smoothWiggleIteratorRecomputeSum(data);
-	else
-               data->sum -= data->buffer[data->oldest];
-	data->count--;
-	if (++data->oldest >= data->width)
-		data->oldest = 0;
+// Returns false if the value is filtered out
+static bool applyScalarKernels(FusedScalarWiggleIteratorData * data, double * value) {
+	double v = *value;
+	int i;
+
+	for (i = 0; i < data->count; i++) {
+		ScalarKernel * kernel = data->kernels + i;
+		switch (kernel->operation) {
+		case SCALAR_SCALE:
+			v = isnan(v) ? NAN : v * kernel->scalar;
+			break;
+		case SCALAR_SHIFT:
+			v += kernel->scalar;
+			break;
+		case SCALAR_LOG:
+		case SCALAR_LN:
+			if (v <= 0)
+				return false;
+			v = (!kernel->finite && isnan(v)) ? NAN : tableLog(v) / kernel->scalarLog;
+			break;
+		case SCALAR_EXP:
+			v = tableExp(naturalExpTable, 1, v);
+			break;
+		case SCALAR_POW:
+			if ((kernel->scalar < 0 && v <= 0) || (!kernel->finite && isnan(v)))
+				v = NAN;
+			else
+				v = pow(v, kernel->scalar);
+			break;
+		case SCALAR_ABS:
+			v = (!kernel->finite && isnan(v)) ? NAN : fabs(v);
+			break;
+		case SCALAR_GT:
+			// NaN values fail the comparison and are filtered out
+			if (!(v > kernel->scalar))
+				return false;
+			v = 1;
+			break;
+		case SCALAR_IS_ZERO:
+			if (v != 0)
+				raiseError();
+			break;
+		case SCALAR_DEFAULT:
+			break;
+		}
+	}
+	*value = v;
+	return true;
 }
 
-static void smoothWiggleIteratorReadOne(char * chrom, int position, SmoothWiggleIteratorData * data) {
+static void FusedScalarWiggleIteratorPop(WiggleIterator * wi) {
+	FusedScalarWiggleIteratorData * data = (FusedScalarWiggleIteratorData *) wi->data;
 	WiggleIterator * iter = data->iter;
 
-	// Let iter run if necessary
-	while (!iter->done && iter->chrom == chrom && iter->finish <= position)
+	while (!iter->done) {
+		double value = iter->value;
+		if (applyScalarKernels(data, &value)) {
+			wi->chrom = iter->chrom;
+			wi->start = iter->start;
+			wi->finish = iter->finish;
+			wi->value = value;
+			pop(iter);
+			return;
+		}
 		pop(iter);
-	
-	// Record iter's value as appropriate
-	if (!iter->done && iter->chrom == chrom) {
-		if (iter->start <= position) {
-			data->buffer[data->latest] = iter->value;
-			data->sum += iter->value;
-		} else 
-			data->buffer[data->latest] = 0;
-		data->count++;
-		data->last_position = position;
-
-		// Increment ptr
-		if (++data->latest >= data->width)
-			data->latest = 0;
 	}
+	wi->done = true;
 }
 
-static void SmoothWiggleIteratorPop(WiggleIterator * wi) {
-	SmoothWiggleIteratorData * data = (SmoothWiggleIteratorData *) wi->data;
-	WiggleIterator * iter = data->iter;
-
-	if (iter->done && data->count == 0) {
-		// Source is empty, buffer ran out, going home
-		wi->done = true;
-		return;
+// Applies one operator to the records [first, count) of the batch, then
+// the next, so that each loop stays simple enough to be vectorised.
+// Returns the number of records left after filtering.
+static int applyScalarKernelToBatch(ScalarKernel * kernel, SpanBatch * batch, int first, int count) {
+	double * values = batch->values;
+	int i, last;
+
+	switch (kernel->operation) {
+	case SCALAR_SCALE:
+		for (i = first; i < count; i++)
+			values[i] *= kernel->scalar;
+		return count;
+	case SCALAR_SHIFT:
+		for (i = first; i < count; i++)
+			values[i] += kernel->scalar;
+		return count;
+	case SCALAR_LOG:
+	case SCALAR_LN:
+		for (i = last = first; i < count; i++) {
+			double value = values[i];
+			if (value <= 0)
+				continue;
+			copySpanBatchRecord(batch, last, i);
+			values[last++] = (!kernel->finite && isnan(value)) ? NAN : tableLog(value) / kernel->scalarLog;
+		}
+		return last;
+	case SCALAR_EXP:
+		for (i = first; i < count; i++)
+			values[i] = tableExp(naturalExpTable, 1, values[i]);
+		return count;
+	case SCALAR_POW:
+		for (i = first; i < count; i++) {
+			if ((kernel->scalar < 0 && values[i] <= 0) || (!kernel->finite && isnan(values[i])))
+				values[i] = NAN;
+			else
+				values[i] = pow(values[i], kernel->scalar);
+		}
+		return count;
+	case SCALAR_ABS:
+		if (kernel->finite) {
+			for (i = first; i < count; i++)
+				values[i] = fabs(values[i]);
+		} else {
+			for (i = first; i < count; i++)
+				if (!isnan(values[i]))
+					values[i] = fabs(values[i]);
+		}
+		return count;
+	case SCALAR_GT:
+		for (i = last = first; i < count; i++) {
+			if (values[i] > kernel->scalar) {
+				copySpanBatchRecord(batch, last, i);
+				values[last++] = 1;
+			}
+		}
+		return last;
+	case SCALAR_IS_ZERO:
+		for (i = first; i < count; i++)
+			if (values[i] != 0)
+				raiseError();
+		return count;
+	case SCALAR_DEFAULT:
+		return count;
+	}
+	return count;
+}
+
+static void FusedScalarWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	FusedScalarWiggleIteratorData * data = (FusedScalarWiggleIteratorData *) wi->data;
+	int i, first = UnaryWiggleIteratorFillBatch(wi, data->iter, batch);
+
+	for (i = 0; i < data->count && batch->count > first; i++)
+		batch->count = applyScalarKernelToBatch(data->kernels + i, batch, first, batch->count);
+	pop(wi);
+}
+
+static void FusedScalarWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	FusedScalarWiggleIteratorData * data = (FusedScalarWiggleIteratorData *) wi->data;
+	seek(data->iter, chrom, start, finish);
+	pop(wi);
+}
+
+// As computed by the constructors of the separate operators, single precision included
+static double scalarDefaultValue(ScalarKernel * kernel, double value) {
+	switch (kernel->operation) {
+	case SCALAR_SCALE:
+		return isnan(value) ? NAN : (float) (value * kernel->scalar);
+	case SCALAR_SHIFT:
+		return isnan(value) ? NAN : (float) (value + kernel->scalar);
+	case SCALAR_LOG:
+	case SCALAR_LN:
+		return (!isnan(value) && value > 0) ? log(value) / kernel->scalarLog : NAN;
+	case SCALAR_EXP:
+		return isnan(value) ? NAN : (float) exp(value);
+	case SCALAR_POW:
+		return (!isnan(value) && (value > 0 || kernel->scalar > 0)) ? pow(value, kernel->scalar) : NAN;
+	case SCALAR_ABS:
+		return isnan(value) ? NAN : fabs(value);
+	case SCALAR_GT:
+		return 0;
+	case SCALAR_IS_ZERO:
+		return value;
+	case SCALAR_DEFAULT:
+		return kernel->scalar;
+	}
+	return value;
+}
+
+// Whether the output of the operator holds no NaN nor infinity, given
+// that its input and default value do not either
+static bool scalarOperationKeepsFinite(ScalarKernel * kernel) {
+	switch (kernel->operation) {
+	case SCALAR_SCALE:
+	case SCALAR_SHIFT:
+	case SCALAR_DEFAULT:
+		return isfinite(kernel->scalar);
+	case SCALAR_ABS:
+	case SCALAR_GT:
+	case SCALAR_IS_ZERO:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Same, for integers
+static bool scalarOperationKeepsIntegral(ScalarKernel * kernel) {
+	switch (kernel->operation) {
+	case SCALAR_SCALE:
+	case SCALAR_SHIFT:
+	case SCALAR_DEFAULT:
+		return isInteger(kernel->scalar);
+	case SCALAR_ABS:
+	case SCALAR_GT:
+	case SCALAR_IS_ZERO:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether the separate operator merges the overlaps of its input first
+static bool scalarOperationUnifies(ScalarOperation operation) {
+	return operation == SCALAR_SCALE || operation == SCALAR_SHIFT || operation == SCALAR_LOG || operation == SCALAR_EXP || operation == SCALAR_POW || operation == SCALAR_ABS;
+}
+
+WiggleIterator * FusedScalarWiggleIterator(WiggleIterator * i, ScalarOp * ops, int count) {
+	FusedScalarWiggleIteratorData * data;
+	double default_value = i->default_value;
+	bool finite = i->finite;
+	bool integral = i->integral;
+	int index;
+
+	// The separate gt operator merges its output, so the operators after it go into a second iterator
+	for (index = 0; index < count - 1; index++)
+		if (ops[index].operation == SCALAR_GT)
+			return FusedScalarWiggleIterator(UnionWiggleIterator(FusedScalarWiggleIterator(i, ops, index + 1)), ops + index + 1, count - index - 1);
+
+	initTables();
+	data = (FusedScalarWiggleIteratorData *) calloc(1, sizeof(FusedScalarWiggleIteratorData));
+	data->kernels = (ScalarKernel *) calloc(count, sizeof(ScalarKernel));
+	data->count = count;
+	for (index = 0; index < count; index++) {
+		ScalarKernel * kernel = data->kernels + index;
+		kernel->operation = ops[index].operation;
+		kernel->scalar = ops[index].scalar;
+		if (kernel->operation == SCALAR_LOG)
+			kernel->scalarLog = log(kernel->scalar);
+		else if (kernel->operation == SCALAR_LN)
+			kernel->scalarLog = 1;
+		default_value = scalarDefaultValue(kernel, default_value);
+		kernel->finite = finite;
+		finite = (finite || kernel->operation == SCALAR_GT) && scalarOperationKeepsFinite(kernel) && isfinite(default_value);
+		integral = (integral || kernel->operation == SCALAR_GT) && scalarOperationKeepsIntegral(kernel) && isInteger(default_value);
+	}
+
+	// Operators do not mark their output as overlapping, so only the first one can see overlaps
+	if (count && scalarOperationUnifies(ops[0].operation))
+		data->iter = NonOverlappingWiggleIterator(i);
+	else
+		data->iter = i;
+
+	WiggleIterator * new = newWiggleIterator(data, &FusedScalarWiggleIteratorPop, &FusedScalarWiggleIteratorSeek, default_value);
+	new->popBatch = &FusedScalarWiggleIteratorPopBatch;
+	new->finite = finite;
+	new->integral = integral;
+	propagateSkipTo(new, data->iter, &UnaryWiggleIteratorSkipTo);
+	if (count && ops[count - 1].operation == SCALAR_GT)
+		return UnionWiggleIterator(new);
+	else
+		return new;
+}
+
+//////////////////////////////////////////////////////
+// Smooth' operator !
+//////////////////////////////////////////////////////
+
+// The value at position p is the sum of the source over the window
+// [p - before, p + after], divided by the width of the window. Gaps count
+// as zeros, and any NaN in the window makes the value NaN. Instead of
+// stepping one base at a time, the window slides over stretches where the
+// bases entering and leaving it have the same value, and the sum stays
+// constant, so that long records and gaps cost one pop each.
+
+typedef struct smoothRecord_st {
+	int start;
+	int finish;
+	double value;
+} SmoothRecord;
+
+typedef struct SmoothWiggleIteratorData_st {
+	WiggleIterator * iter;
+	// Source records overlapping the window, or just after it
+	SmoothRecord * records;
+	int capacity;
+	int head;
+	int count;
+	// Sum of the numbers in the window, and count of NaN bases
+	double sum;
+	long nans;
+	// Next position to output
+	int position;
+	// Finish of the last record read on the current chromosome
+	int last_finish;
+	int width;
+	int before;
+	int after;
+	// The source holds no NaN, nans stays at 0
+	bool finite;
+} SmoothWiggleIteratorData;
+
+static SmoothRecord * smoothRecord(SmoothWiggleIteratorData * data, int index) {
+	return data->records + (data->head + index) % data->capacity;
+}
+
+static bool smoothSourceOnChrom(SmoothWiggleIteratorData * data, const char * chrom) {
+	return !data->iter->done && data->iter->chrom == chrom;
+}
+
+// Reads all the source records which start up to position
+static void smoothWiggleIteratorRead(SmoothWiggleIteratorData * data, const char * chrom, int position) {
+	WiggleIterator * iter = data->iter;
+
+	for (; smoothSourceOnChrom(data, chrom) && iter->start <= position; pop(iter)) {
+		if (data->count == data->capacity) {
+			SmoothRecord * records = (SmoothRecord *) calloc(2 * data->capacity, sizeof(SmoothRecord));
+			int index;
+			for (index = 0; index < data->count; index++)
+				records[index] = *smoothRecord(data, index);
+			free(data->records);
+			data->records = records;
+			data->head = 0;
+			data->capacity *= 2;
+		}
+		SmoothRecord * record = smoothRecord(data, data->count++);
+		record->start = iter->start;
+		record->finish = iter->finish;
+		record->value = iter->value;
+		data->last_finish = iter->finish;
 	}
+}
 
+// Discards the records which finish before position
+static void smoothWiggleIteratorForget(SmoothWiggleIteratorData * data, int position) {
+	while (data->count && smoothRecord(data, 0)->finish <= position) {
+		data->head = (data->head + 1) % data->capacity;
+		data->count--;
+	}
 	if (data->count == 0) {
-		// Smoothing window came to an end
-		// Jump to new location
-		wi->chrom = iter->chrom;
-		wi->start = iter->start - data->width/2;
-
-		if (wi->start < 1) {
-			// If start is too close to the start, then we start at zero and prefill the buffer
-			wi->start = 1;
-			int i;
-			for (i = 0; i < data->width/2; i++)
-				smoothWiggleIteratorReadOne(wi->chrom, wi->start + i, data);
+		// Resynchronise while the window is empty
+		data->sum = 0;
+		data->nans = 0;
+	}
+}
+
+static void smoothWiggleIteratorAddWindow(SmoothWiggleIteratorData * data, int start, int finish) {
+	int index;
+	data->sum = 0;
+	data->nans = 0;
+	for (index = 0; index < data->count; index++) {
+		SmoothRecord * record = smoothRecord(data, index);
+		int overlap = (record->finish < finish ? record->finish : finish) - (record->start > start ? record->start : start);
+		if (overlap <= 0)
+			continue;
+		if (!data->finite && isnan(record->value))
+			data->nans += overlap;
+		else
+			data->sum += record->value * overlap;
+	}
+}
+
+// Value at position, looking from the index-th record on, and the first
+// position after it with another value
+static double smoothWiggleIteratorValueAt(SmoothWiggleIteratorData * data, const char * chrom, int index, int position, int * end) {
+	for (; index < data->count; index++) {
+		SmoothRecord * record = smoothRecord(data, index);
+		if (record->finish <= position)
+			continue;
+		if (record->start <= position) {
+			*end = record->finish;
+			return record->value;
 		}
-	} else
-		wi->start++;
+		*end = record->start;
+		return 0;
+	}
+
+	if (smoothSourceOnChrom(data, chrom))
+		*end = data->iter->start;
+	else
+		*end = INT_MAX;
+	return 0;
+}
 
-	// Step by one
-	wi->finish = wi->start + 1;
-	smoothWiggleIteratorReadOne(wi->chrom, wi->start + data->width/2, data);
-	wi->value = data->sum / data->width;
+static void smoothWiggleIteratorStartRun(WiggleIterator * wi, SmoothWiggleIteratorData * data) {
+	WiggleIterator * iter = data->iter;
 
-	// Discard unecessary value from buffer
-	if (data->count == data->width || data->last_position < wi->start + data->width/2)
-		smoothWiggleIteratorEraseOne(data);
+	wi->chrom = iter->chrom;
+	data->position = iter->start - data->after;
+	if (data->position < 1)
+		data->position = 1;
+	data->count = 0;
+	smoothWiggleIteratorRead(data, wi->chrom, data->position + data->after + 1);
+	smoothWiggleIteratorAddWindow(data, data->position - data->before, data->position + data->after + 1);
+}
+
+static void SmoothWiggleIteratorPop(WiggleIterator * wi) {
+	SmoothWiggleIteratorData * data = (SmoothWiggleIteratorData *) wi->data;
+
+	if (data->count == 0 && !smoothSourceOnChrom(data, wi->chrom)) {
+		if (data->iter->done) {
+			// Source is empty, window ran out, going home
+			wi->done = true;
+			return;
+		}
+		smoothWiggleIteratorStartRun(wi, data);
+	}
+
+	int position = data->position;
+	int leaving = position - data->before;
+	int entering = position + data->after + 1;
+	int leaving_end, entering_end;
+	// Leaving bases are in the oldest record, entering bases in the latest one
+	double value_out = smoothWiggleIteratorValueAt(data, wi->chrom, 0, leaving, &leaving_end);
+	double value_in = smoothWiggleIteratorValueAt(data, wi->chrom, data->count ? data->count - 1 : 0, entering, &entering_end);
+
+	wi->start = position;
+	wi->value = data->nans ? NAN : data->sum / data->width;
+
+	// Slide the window for as long as the sum is unchanged
+	int steps = 1;
+	if (value_in == value_out || (!data->finite && isnan(value_in) && isnan(value_out))) {
+		steps = leaving_end - leaving;
+		if (entering_end - entering < steps)
+			steps = entering_end - entering;
+	} else if (data->finite) {
+		data->sum -= value_out;
+		data->sum += value_in;
+	} else {
+		if (isnan(value_out))
+			data->nans--;
+		else
+			data->sum -= value_out;
+		if (isnan(value_in))
+			data->nans++;
+		else
+			data->sum += value_in;
+	}
+
+	// The window must not slide past the chromosome's last record
+	if (!smoothSourceOnChrom(data, wi->chrom) && data->last_finish + data->before - position < steps)
+		steps = data->last_finish + data->before - position;
+
+	wi->finish = position + steps;
+	data->position = wi->finish;
+	smoothWiggleIteratorForget(data, data->position - data->before);
+	smoothWiggleIteratorRead(data, wi->chrom, data->position + data->after + 1);
 }
 
 void SmoothWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	SmoothWiggleIteratorData * data = (SmoothWiggleIteratorData *) wi->data;
 	seek(data->iter, chrom, start, finish);
-	int i;
-	for (i = 0; i < data->width; i++)
-		data->buffer[i] = 0;
-	data->latest = 0;
-	data->oldest = 0;
-	data->sum = 0;
 	data->count = 0;
+	data->head = 0;
+	data->sum = 0;
+	data->nans = 0;
+	wi->chrom = NULL;
 	wi->done = false;
 	pop(wi);
 }
@@ -996,12 +1935,947 @@ WiggleIterator * SmoothWiggleIterator(WiggleIterator * i, int width) {
 	SmoothWiggleIteratorData * data = (SmoothWiggleIteratorData *) calloc(1, sizeof(SmoothWiggleIteratorData));
 	if (width < 2) {
 		fprintf(stderr, "Cannot smooth over a window of width %i, must be 2 or more\n", width);
-		exit(1);
+		raiseError();
+	}
+	data->iter = NonOverlappingWiggleIterator(i);
+	data->capacity = 16;
+	data->records = (SmoothRecord *) calloc(data->capacity, sizeof(SmoothRecord));
+	data->width = width;
+	data->after = width / 2;
+	data->before = width - 1 - data->after;
+	data->finite = data->iter->finite;
+	WiggleIterator * new = newWiggleIterator(data, &SmoothWiggleIteratorPop, &SmoothWiggleIteratorSeek, i->default_value);
+	new->finite = data->finite;
+	return new;
+}
+
+//////////////////////////////////////////////////////
+// Gaussian smoothing
+//////////////////////////////////////////////////////
+
+// The value at position p is the sum of the source weighted by a Gaussian
+// kernel of the given standard deviation centred on p, computed with the
+// recursive filter of Young and van Vliet (1995): a forward then a backward
+// pass of a third order filter, whose cost per base does not depend on
+// sigma. Gaps count as zeros, and NaN bases are filtered as zeros but stay
+// NaN. The records are cut into blocks separated by gaps wide enough for the
+// kernel to vanish in between, and each block is output up to GAUSSIAN_MARGIN
+// sigmas around its records. Within long records and gaps the filters soon
+// settle on the value of the record, and the rest of it costs a single step.
+// Long blocks are flushed in chunks, the backward pass of each chunk starting
+// a few dozen sigmas past its end, far enough for its made up starting state
+// to fade out.
+
+#define GAUSSIAN_MARGIN 6
+// Sigmas over which a wrong initial state of the filter fades below 1e-13
+#define GAUSSIAN_SETTLE 32
+// Relative to the largest value of the block
+#define GAUSSIAN_TOLERANCE 1e-13
+// Runs buffered before a chunk is flushed
+#define GAUSSIAN_CHUNK_RUNS 65536
+
+typedef struct gaussianRun_st {
+	int start;
+	int finish;
+	double value;
+	bool nan;
+} GaussianRun;
+
+typedef struct gaussianWiggleIteratorData_st {
+	WiggleIterator * iter;
+	// Filter coefficients, w[n] = B x[n] + b1 w[n-1] + b2 w[n-2] + b3 w[n-3]
+	double B, b1, b2, b3;
+	int margin;
+	int settle;
+	int chunkRuns;
+	// Forward pass over the current chunk, and the filter's last three outputs
+	GaussianRun * forward;
+	int forwardCount, forwardCapacity;
+	double w1, w2, w3;
+	// End of the forward pass, 0 between blocks
+	int position;
+	double scale;
+	// Output of the backward pass, by decreasing start: the next record is the last
+	GaussianRun * output;
+	int outputCount, outputCapacity;
+	bool finite;
+} GaussianWiggleIteratorData;
+
+static GaussianRun * pushGaussianRun(GaussianRun ** runs, int * count, int * capacity) {
+	if (*count == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 1024;
+		*runs = (GaussianRun *) realloc(*runs, *capacity * sizeof(GaussianRun));
+	}
+	return *runs + (*count)++;
+}
+
+static bool gaussianSettled(double w1, double w2, double w3, double value, double tolerance) {
+	return fabs(w1 - value) <= tolerance && fabs(w2 - value) <= tolerance && fabs(w3 - value) <= tolerance;
+}
+
+static void gaussianPushForward(GaussianWiggleIteratorData * data, int start, int finish, double value, bool nan) {
+	GaussianRun * run;
+	if (data->forwardCount) {
+		run = data->forward + data->forwardCount - 1;
+		if (run->finish == start && run->value == value && run->nan == nan) {
+			run->finish = finish;
+			return;
+		}
+	}
+	run = pushGaussianRun(&data->forward, &data->forwardCount, &data->forwardCapacity);
+	run->start = start;
+	run->finish = finish;
+	run->value = value;
+	run->nan = nan;
+}
+
+// Filters a stretch of bases with the same value
+static void gaussianFilterForward(GaussianWiggleIteratorData * data, int finish, double value, bool nan) {
+	double tolerance;
+	int position;
+
+	if (fabs(value) > data->scale)
+		data->scale = fabs(value);
+	tolerance = GAUSSIAN_TOLERANCE * data->scale;
+
+	for (position = data->position; position < finish; position++) {
+		if (gaussianSettled(data->w1, data->w2, data->w3, value, tolerance)) {
+			data->w1 = data->w2 = data->w3 = value;
+			gaussianPushForward(data, position, finish, value, nan);
+			break;
+		}
+		double w = data->B * value + data->b1 * data->w1 + data->b2 * data->w2 + data->b3 * data->w3;
+		data->w3 = data->w2;
+		data->w2 = data->w1;
+		data->w1 = w;
+		gaussianPushForward(data, position, position + 1, w, nan);
+	}
+	data->position = finish;
+}
+
+static void gaussianPushOutput(GaussianWiggleIteratorData * data, int start, int finish, double value, bool nan) {
+	GaussianRun * run;
+	if (start >= finish)
+		return;
+	if (nan)
+		value = NAN;
+	if (data->outputCount) {
+		run = data->output + data->outputCount - 1;
+		if (run->start == finish && (run->value == value || (nan && run->nan))) {
+			run->start = start;
+			return;
+		}
+	}
+	run = pushGaussianRun(&data->output, &data->outputCount, &data->outputCapacity);
+	run->start = start;
+	run->finish = finish;
+	run->value = value;
+	run->nan = nan;
+}
+
+// Runs the backward pass over the chunk from its end, and outputs the bases
+// up to a settling distance before it. The last of these are kept in the
+// forward buffer, to be filtered again with the next chunk, unless the block
+// is over.
+static void gaussianFlush(GaussianWiggleIteratorData * data, bool last) {
+	GaussianRun * runs = data->forward;
+	int limit = data->position - data->settle;
+	double tolerance = GAUSSIAN_TOLERANCE * data->scale;
+	double y1, y2, y3;
+	int index, position, kept;
+
+	if (!data->forwardCount)
+		return;
+
+	// The filter starts as if the last value went on forever
+	y1 = y2 = y3 = runs[data->forwardCount - 1].value;
+	for (index = data->forwardCount - 1; index >= 0; index--) {
+		GaussianRun * run = runs + index;
+		for (position = run->finish - 1; position >= run->start; position--) {
+			if (gaussianSettled(y1, y2, y3, run->value, tolerance)) {
+				y1 = y2 = y3 = run->value;
+				gaussianPushOutput(data, run->start, position + 1 < limit ? position + 1 : limit, run->value, run->nan);
+				break;
+			}
+			double y = data->B * run->value + data->b1 * y1 + data->b2 * y2 + data->b3 * y3;
+			y3 = y2;
+			y2 = y1;
+			y1 = y;
+			if (position < limit)
+				gaussianPushOutput(data, position, position + 1, y, run->nan);
+		}
+	}
+
+	if (last) {
+		data->forwardCount = 0;
+		data->position = 0;
+		return;
+	}
+
+	for (index = 0; runs[index].finish <= limit; index++)
+		;
+	if (runs[index].start < limit)
+		runs[index].start = limit;
+	kept = data->forwardCount - index;
+	memmove(runs, runs + index, kept * sizeof(GaussianRun));
+	data->forwardCount = kept;
+}
+
+// Filters the source until some output is ready, returns false at the end
+static bool gaussianFill(WiggleIterator * wi, GaussianWiggleIteratorData * data) {
+	WiggleIterator * iter = data->iter;
+
+	if (!data->position) {
+		if (iter->done)
+			return false;
+		// New block, the filter rests at 0 over the margin before it
+		wi->chrom = iter->chrom;
+		data->position = iter->start - data->margin;
+		if (data->position < 1)
+			data->position = 1;
+		data->w1 = data->w2 = data->w3 = 0;
+		data->scale = 0;
+		gaussianFilterForward(data, iter->start, 0, false);
+	}
+
+	while (!iter->done && iter->chrom == wi->chrom && iter->start - data->position < 2 * data->margin + data->settle) {
+		gaussianFilterForward(data, iter->start, 0, false);
+		if (isnan(iter->value))
+			gaussianFilterForward(data, iter->finish, 0, true);
+		else
+			gaussianFilterForward(data, iter->finish, iter->value, false);
+		pop(iter);
+		if (data->forwardCount >= data->chunkRuns) {
+			gaussianFlush(data, false);
+			return true;
+		}
+	}
+
+	// The block is over, the filter runs on over the margin after it
+	gaussianFilterForward(data, data->position + data->margin + data->settle, 0, false);
+	gaussianFlush(data, true);
+	return true;
+}
+
+static void GaussianWiggleIteratorPop(WiggleIterator * wi) {
+	GaussianWiggleIteratorData * data = (GaussianWiggleIteratorData *) wi->data;
+	GaussianRun * run;
+
+	while (!data->outputCount)
+		if (!gaussianFill(wi, data)) {
+			wi->done = true;
+			return;
+		}
+
+	run = data->output + --data->outputCount;
+	wi->start = run->start;
+	wi->finish = run->finish;
+	wi->value = run->value;
+}
+
+void GaussianWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	GaussianWiggleIteratorData * data = (GaussianWiggleIteratorData *) wi->data;
+	seek(data->iter, chrom, start, finish);
+	data->forwardCount = 0;
+	data->outputCount = 0;
+	data->position = 0;
+	wi->done = false;
+	pop(wi);
+}
+
+WiggleIterator * GaussianWiggleIterator(WiggleIterator * i, double sigma) {
+	GaussianWiggleIteratorData * data = (GaussianWiggleIteratorData *) calloc(1, sizeof(GaussianWiggleIteratorData));
+	double q, b0;
+
+	if (!(sigma >= 0.5)) {
+		fprintf(stderr, "Cannot smooth with a Gaussian of standard deviation %f, must be 0.5 or more\n", sigma);
+		raiseError();
+	}
+	if (sigma > INT_MAX / (2 * GAUSSIAN_MARGIN + GAUSSIAN_SETTLE + 1)) {
+		fprintf(stderr, "Cannot smooth with a Gaussian of standard deviation %f, too wide\n", sigma);
+		raiseError();
+	}
+
+	// Young and van Vliet (1995), Eq. 11b and 8c
+	if (sigma >= 2.5)
+		q = 0.98711 * sigma - 0.96330;
+	else
+		q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+	b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+	data->b1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+	data->b2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+	data->b3 = 0.422205 * q * q * q / b0;
+	data->B = 1 - (data->b1 + data->b2 + data->b3);
+
+	data->iter = NonOverlappingWiggleIterator(i);
+	data->margin = (int) ceil(GAUSSIAN_MARGIN * sigma);
+	data->settle = (int) ceil(GAUSSIAN_SETTLE * sigma) + 16;
+	data->chunkRuns = GAUSSIAN_CHUNK_RUNS + 2 * data->settle;
+	data->finite = data->iter->finite;
+	WiggleIterator * new = newWiggleIterator(data, &GaussianWiggleIteratorPop, &GaussianWiggleIteratorSeek, i->default_value);
+	new->finite = data->finite;
+	return new;
+}
+
+//////////////////////////////////////////////////////
+// Rolling window operators
+//////////////////////////////////////////////////////
+
+// The value at position p is the max, min or median of the source over the
+// window [p - before, p + after], as for smooth: gaps count as zeros, and
+// any NaN in the window makes the value NaN. The window is seen as a run of
+// segments, records or gaps, of constant value.
+//
+// The max and min only change when a segment enters or leaves the window.
+// The candidates are kept in a monotonic deque: each segment enters at the
+// back, after dropping the segments it dominates, and leaves from the front,
+// so that each costs O(1) amortised whatever the width.
+//
+// The median is kept in a tree of the distinct values of the window, with
+// their numbers of bases. As the window slides over a segment boundary, one
+// base of a value leaves and one of another enters at each step, so the
+// median only changes after a number of steps which is computed directly.
+
+typedef struct valueNode_st {
+	double value;
+	long count;
+	long total;
+	unsigned int priority;
+	struct valueNode_st * left;
+	struct valueNode_st * right;
+} ValueNode;
+
+static long valueTreeTotal(ValueNode * node) {
+	return node ? node->total : 0;
+}
+
+static void updateValueNode(ValueNode * node) {
+	node->total = node->count + valueTreeTotal(node->left) + valueTreeTotal(node->right);
+}
+
+// All the values of A are below those of B
+static ValueNode * mergeValueTrees(ValueNode * A, ValueNode * B) {
+	if (!A)
+		return B;
+	if (!B)
+		return A;
+	if (A->priority > B->priority) {
+		A->right = mergeValueTrees(A->right, B);
+		updateValueNode(A);
+		return A;
+	}
+	B->left = mergeValueTrees(A, B->left);
+	updateValueNode(B);
+	return B;
+}
+
+// Adds count bases of value, count may be negative
+static ValueNode * addToValueTree(ValueNode * node, double value, long count, unsigned int * seed) {
+	if (!node) {
+		node = (ValueNode *) calloc(1, sizeof(ValueNode));
+		node->value = value;
+		node->count = node->total = count;
+		// xorshift
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 17;
+		*seed ^= *seed << 5;
+		node->priority = *seed;
+		return node;
+	}
+
+	if (value < node->value) {
+		node->left = addToValueTree(node->left, value, count, seed);
+		if (node->left && node->left->priority > node->priority) {
+			ValueNode * left = node->left;
+			node->left = left->right;
+			left->right = node;
+			updateValueNode(node);
+			node = left;
+		}
+	} else if (value > node->value) {
+		node->right = addToValueTree(node->right, value, count, seed);
+		if (node->right && node->right->priority > node->priority) {
+			ValueNode * right = node->right;
+			node->right = right->left;
+			right->left = node;
+			updateValueNode(node);
+			node = right;
+		}
+	} else if ((node->count += count) == 0) {
+		ValueNode * merged = mergeValueTrees(node->left, node->right);
+		free(node);
+		return merged;
+	}
+	updateValueNode(node);
+	return node;
+}
+
+static void freeValueTree(ValueNode * node) {
+	if (!node)
+		return;
+	freeValueTree(node->left);
+	freeValueTree(node->right);
+	free(node);
+}
+
+// Value of the base of the given rank, 0-based, and the numbers of bases
+// below and at that value
+static double selectInValueTree(ValueNode * node, long rank, long * below, long * equal) {
+	*below = 0;
+	while (true) {
+		long left = valueTreeTotal(node->left);
+		if (rank < left)
+			node = node->left;
+		else if (rank < left + node->count) {
+			*below += left;
+			*equal = node->count;
+			return node->value;
+		} else {
+			rank -= left + node->count;
+			*below += left + node->count;
+			node = node->right;
+		}
+	}
+}
+
+typedef struct rollingSegment_st {
+	int finish;
+	double value;
+} RollingSegment;
+
+typedef struct rollingWiggleIteratorData_st {
+	// Source records and window geometry, as for smooth
+	SmoothWiggleIteratorData window;
+	RollingStatistic statistic;
+	// Max and min: candidate segments, by position then decreasing rank
+	RollingSegment * deque;
+	int dequeCapacity;
+	int dequeHead;
+	int dequeCount;
+	// End of the segment at the right edge of the window
+	int enteredEnd;
+	// End of the last NaN segment which entered
+	int nanEnd;
+	// Median: values of the window, and number of NaN bases
+	ValueNode * values;
+	long nanBases;
+	unsigned int seed;
+} RollingWiggleIteratorData;
+
+static RollingSegment * rollingSegment(RollingWiggleIteratorData * data, int index) {
+	return data->deque + (data->dequeHead + index) % data->dequeCapacity;
+}
+
+// Whether the value of A is at least as extreme as that of B
+static bool dominates(RollingWiggleIteratorData * data, double A, double B) {
+	return data->statistic == ROLLING_MAX ? A >= B : A <= B;
+}
+
+static void pushRollingSegment(RollingWiggleIteratorData * data, int finish, double value) {
+	if (isnan(value)) {
+		if (finish > data->nanEnd)
+			data->nanEnd = finish;
+		return;
+	}
+
+	while (data->dequeCount && dominates(data, value, rollingSegment(data, data->dequeCount - 1)->value))
+		data->dequeCount--;
+	if (data->dequeCount == data->dequeCapacity) {
+		RollingSegment * deque = (RollingSegment *) calloc(2 * data->dequeCapacity, sizeof(RollingSegment));
+		int index;
+		for (index = 0; index < data->dequeCount; index++)
+			deque[index] = *rollingSegment(data, index);
+		free(data->deque);
+		data->deque = deque;
+		data->dequeHead = 0;
+		data->dequeCapacity *= 2;
+	}
+	RollingSegment * segment = rollingSegment(data, data->dequeCount++);
+	segment->finish = finish;
+	segment->value = value;
+}
+
+static void dropRollingSegments(RollingWiggleIteratorData * data, int leaving) {
+	while (data->dequeCount && data->deque[data->dequeHead].finish <= leaving) {
+		data->dequeHead = (data->dequeHead + 1) % data->dequeCapacity;
+		data->dequeCount--;
+	}
+}
+
+static void addRollingBases(RollingWiggleIteratorData * data, double value, long count) {
+	if (isnan(value))
+		data->nanBases += count;
+	else
+		data->values = addToValueTree(data->values, value, count, &data->seed);
+}
+
+static void rollingWiggleIteratorStartRun(WiggleIterator * wi, RollingWiggleIteratorData * data) {
+	SmoothWiggleIteratorData * window = &data->window;
+	int base, end, index = 0;
+
+	wi->chrom = window->iter->chrom;
+	window->position = window->iter->start - window->after;
+	if (window->position < 1)
+		window->position = 1;
+	window->count = 0;
+	smoothWiggleIteratorRead(window, wi->chrom, window->position + window->after + 1);
+
+	data->dequeCount = 0;
+	data->nanEnd = INT_MIN;
+	freeValueTree(data->values);
+	data->values = NULL;
+	data->nanBases = 0;
+	for (base = window->position - window->before; base <= window->position + window->after; base = end) {
+		double value = smoothWiggleIteratorValueAt(window, wi->chrom, index, base, &end);
+		if (data->statistic == ROLLING_MEDIAN)
+			addRollingBases(data, value, (end <= window->position + window->after ? end : window->position + window->after + 1) - base);
+		else
+			pushRollingSegment(data, end, value);
+		data->enteredEnd = end;
+		while (index < window->count && smoothRecord(window, index)->finish <= end)
+			index++;
+	}
+}
+
+// Number of steps over which the median stays at value, given the numbers of
+// bases below and at value, as bases of value_out leave and bases of
+// value_in enter the window
+static long medianSteps(RollingWiggleIteratorData * data, double value, long below, long equal, double value_out, double value_in) {
+	long rank = data->window.width / 2;
+	long steps = LONG_MAX;
+	long delta_below, delta_upper;
+
+	if (data->nanBases)
+		return isnan(value_out) && !isnan(value_in) ? data->nanBases - 1 : LONG_MAX;
+	if (isnan(value_in))
+		return 0;
+
+	// The median stays while below <= rank < below + equal
+	delta_below = (value_in < value) - (value_out < value);
+	delta_upper = (value_in <= value) - (value_out <= value);
+	if (delta_below > 0)
+		steps = (rank - below) / delta_below;
+	if (delta_upper < 0 && (below + equal - rank - 1) / -delta_upper < steps)
+		steps = (below + equal - rank - 1) / -delta_upper;
+	return steps;
+}
+
+static void RollingWiggleIteratorPop(WiggleIterator * wi) {
+	RollingWiggleIteratorData * data = (RollingWiggleIteratorData *) wi->data;
+	SmoothWiggleIteratorData * window = &data->window;
+
+	if (window->count == 0 && !smoothSourceOnChrom(window, wi->chrom)) {
+		if (window->iter->done) {
+			wi->done = true;
+			return;
+		}
+		rollingWiggleIteratorStartRun(wi, data);
+	}
+
+	int position = window->position;
+	int leaving = position - window->before;
+	int entering = position + window->after + 1;
+	int leaving_end, entering_end;
+	long steps;
+	// Leaving bases are in the oldest record, entering bases in the latest one
+	double value_out = smoothWiggleIteratorValueAt(window, wi->chrom, 0, leaving, &leaving_end);
+	double value_in = smoothWiggleIteratorValueAt(window, wi->chrom, window->count ? window->count - 1 : 0, entering, &entering_end);
+
+	wi->start = position;
+	if (data->statistic == ROLLING_MEDIAN) {
+		long below = 0, equal = 0;
+		if (data->nanBases)
+			wi->value = NAN;
+		else
+			wi->value = selectInValueTree(data->values, window->width / 2, &below, &equal);
+		steps = medianSteps(data, wi->value, below, equal, value_out, value_in);
+		if (steps < LONG_MAX)
+			steps++;
+		if (leaving_end - leaving < steps)
+			steps = leaving_end - leaving;
+		if (entering_end - entering < steps)
+			steps = entering_end - entering;
+	} else {
+		if (data->nanEnd > leaving)
+			wi->value = NAN;
+		else
+			wi->value = data->deque[data->dequeHead].value;
+		// Slide the window until a segment leaves or enters it
+		steps = leaving_end - leaving;
+		if (data->enteredEnd - (entering - 1) < steps)
+			steps = data->enteredEnd - (entering - 1);
+	}
+
+	// The window must not slide past the chromosome's last record
+	if (!smoothSourceOnChrom(window, wi->chrom) && window->last_finish + window->before - position < steps)
+		steps = window->last_finish + window->before - position;
+
+	wi->finish = position + steps;
+	window->position = wi->finish;
+	if (data->statistic == ROLLING_MEDIAN) {
+		addRollingBases(data, value_out, -steps);
+		addRollingBases(data, value_in, steps);
+	} else
+		dropRollingSegments(data, window->position - window->before);
+	smoothWiggleIteratorForget(window, window->position - window->before);
+	smoothWiggleIteratorRead(window, wi->chrom, window->position + window->after + 1);
+
+	// At most one segment entered, at the right edge of the window
+	if (data->statistic != ROLLING_MEDIAN && data->enteredEnd <= window->position + window->after) {
+		int end;
+		double value = smoothWiggleIteratorValueAt(window, wi->chrom, window->count > 1 ? window->count - 2 : 0, data->enteredEnd, &end);
+		pushRollingSegment(data, end, value);
+		data->enteredEnd = end;
+	}
+}
+
+static void RollingWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	RollingWiggleIteratorData * data = (RollingWiggleIteratorData *) wi->data;
+	seek(data->window.iter, chrom, start, finish);
+	data->window.count = 0;
+	data->window.head = 0;
+	wi->chrom = NULL;
+	wi->done = false;
+	pop(wi);
+}
+
+WiggleIterator * RollingWiggleIterator(WiggleIterator * i, int width, RollingStatistic statistic) {
+	RollingWiggleIteratorData * data = (RollingWiggleIteratorData *) calloc(1, sizeof(RollingWiggleIteratorData));
+	if (width < 2) {
+		fprintf(stderr, "Cannot roll over a window of width %i, must be 2 or more\n", width);
+		raiseError();
+	}
+	data->window.iter = NonOverlappingWiggleIterator(i);
+	data->window.capacity = 16;
+	data->window.records = (SmoothRecord *) calloc(data->window.capacity, sizeof(SmoothRecord));
+	data->window.width = width;
+	data->window.after = width / 2;
+	data->window.before = width - 1 - data->window.after;
+	data->statistic = statistic;
+	data->dequeCapacity = 16;
+	data->deque = (RollingSegment *) calloc(data->dequeCapacity, sizeof(RollingSegment));
+	data->seed = 2463534242U;
+	return newWiggleIterator(data, &RollingWiggleIteratorPop, &RollingWiggleIteratorSeek, i->default_value);
+}
+
+//////////////////////////////////////////////////////
+// Rolling correlation
+//////////////////////////////////////////////////////
+
+// The value at position p is the Pearson correlation of two sources over
+// the window [p - before, p + after], as for smooth: gaps count as zeros,
+// and any NaN in the window makes the value NaN. Each source has its own
+// window of records, and both slide together. The sums of X, Y, XY, XX and
+// YY over the window are updated as a base leaves and another enters, and
+// stay constant while both carry the same pair of values, so that long
+// records and gaps cost one pop each whatever the width.
+//
+// The running sums drift as bases come and go, so they are recomputed from
+// the records once the window has moved them over its width, which costs
+// O(1) amortised per base.
+
+// Variances below this fraction of the sum of squares are rounding errors
+#define ROLLING_PEARSON_TOLERANCE 1e-9
+
+typedef struct rollingPearsonData_st {
+	SmoothWiggleIteratorData X;
+	SmoothWiggleIteratorData Y;
+	// Sums over the window, and count of bases where either value is NaN
+	double sum_X, sum_Y, sum_XY, sum_XX, sum_YY;
+	long nans;
+	// Largest sums of squares since the sums were recomputed, which bound their rounding errors
+	double scale_XX, scale_YY;
+	// Bases which moved the sums since they were last recomputed
+	int drift;
+} RollingPearsonData;
+
+static bool rollingPearsonOnChrom(RollingPearsonData * data, const char * chrom) {
+	return smoothSourceOnChrom(&data->X, chrom) || smoothSourceOnChrom(&data->Y, chrom);
+}
+
+// Count may be negative
+static void addRollingPair(RollingPearsonData * data, double X, double Y, long count) {
+	if (isnan(X) || isnan(Y))
+		data->nans += count;
+	else {
+		data->sum_X += X * count;
+		data->sum_Y += Y * count;
+		data->sum_XY += X * Y * count;
+		data->sum_XX += X * X * count;
+		data->sum_YY += Y * Y * count;
+		if (data->sum_XX > data->scale_XX)
+			data->scale_XX = data->sum_XX;
+		if (data->sum_YY > data->scale_YY)
+			data->scale_YY = data->sum_YY;
+	}
+}
+
+static void rollingPearsonAddWindow(RollingPearsonData * data, const char * chrom) {
+	int position = data->X.position;
+	int last = position + data->X.after + 1;
+	int base, end, end_X, end_Y, index_X = 0, index_Y = 0;
+
+	data->sum_X = data->sum_Y = data->sum_XY = data->sum_XX = data->sum_YY = 0;
+	data->scale_XX = data->scale_YY = 0;
+	data->nans = 0;
+	data->drift = 0;
+	for (base = position - data->X.before; base < last; base = end) {
+		double X = smoothWiggleIteratorValueAt(&data->X, chrom, index_X, base, &end_X);
+		double Y = smoothWiggleIteratorValueAt(&data->Y, chrom, index_Y, base, &end_Y);
+		end = end_X < end_Y ? end_X : end_Y;
+		if (end > last)
+			end = last;
+		addRollingPair(data, X, Y, end - base);
+		while (index_X < data->X.count && smoothRecord(&data->X, index_X)->finish <= end)
+			index_X++;
+		while (index_Y < data->Y.count && smoothRecord(&data->Y, index_Y)->finish <= end)
+			index_Y++;
+	}
+}
+
+static void rollingPearsonStartRun(WiggleIterator * wi, RollingPearsonData * data) {
+	WiggleIterator * X = data->X.iter;
+	WiggleIterator * Y = data->Y.iter;
+	int start;
+
+	if (!X->done && (Y->done || compareChroms(X->chrom, Y->chrom) <= 0))
+		wi->chrom = X->chrom;
+	else
+		wi->chrom = Y->chrom;
+	if (!smoothSourceOnChrom(&data->Y, wi->chrom))
+		start = X->start;
+	else if (!smoothSourceOnChrom(&data->X, wi->chrom) || Y->start < X->start)
+		start = Y->start;
+	else
+		start = X->start;
+
+	data->X.position = start - data->X.after;
+	if (data->X.position < 1)
+		data->X.position = 1;
+	data->X.count = data->Y.count = 0;
+	data->X.last_finish = data->Y.last_finish = 0;
+	smoothWiggleIteratorRead(&data->X, wi->chrom, data->X.position + data->X.after + 1);
+	smoothWiggleIteratorRead(&data->Y, wi->chrom, data->X.position + data->X.after + 1);
+	rollingPearsonAddWindow(data, wi->chrom);
+}
+
+static bool rollingPearsonFlat(RollingPearsonData * data) {
+	double width = data->X.width;
+	return width * data->sum_XX - data->sum_X * data->sum_X <= ROLLING_PEARSON_TOLERANCE * width * data->scale_XX
+		|| width * data->sum_YY - data->sum_Y * data->sum_Y <= ROLLING_PEARSON_TOLERANCE * width * data->scale_YY;
+}
+
+static double rollingPearsonValue(RollingPearsonData * data, const char * chrom) {
+	double width = data->X.width;
+	double res;
+
+	if (data->nans)
+		return NAN;
+	// A constant window may be left with the residues of larger values which left it
+	if (rollingPearsonFlat(data) && (data->scale_XX > data->sum_XX || data->scale_YY > data->sum_YY))
+		rollingPearsonAddWindow(data, chrom);
+	if (rollingPearsonFlat(data))
+		return NAN;
+	res = (width * data->sum_XY - data->sum_X * data->sum_Y) / sqrt((width * data->sum_XX - data->sum_X * data->sum_X) * (width * data->sum_YY - data->sum_Y * data->sum_Y));
+	if (res > 1)
+		return 1;
+	if (res < -1)
+		return -1;
+	return res;
+}
+
+static void RollingPearsonWiggleIteratorPop(WiggleIterator * wi) {
+	RollingPearsonData * data = (RollingPearsonData *) wi->data;
+
+	if (data->X.count == 0 && data->Y.count == 0 && !rollingPearsonOnChrom(data, wi->chrom)) {
+		if (data->X.iter->done && data->Y.iter->done) {
+			wi->done = true;
+			return;
+		}
+		rollingPearsonStartRun(wi, data);
+	}
+
+	int position = data->X.position;
+	int leaving = position - data->X.before;
+	int entering = position + data->X.after + 1;
+	int leaving_X, leaving_Y, entering_X, entering_Y;
+	// Leaving bases are in the oldest records, entering bases in the latest ones
+	double X_out = smoothWiggleIteratorValueAt(&data->X, wi->chrom, 0, leaving, &leaving_X);
+	double Y_out = smoothWiggleIteratorValueAt(&data->Y, wi->chrom, 0, leaving, &leaving_Y);
+	double X_in = smoothWiggleIteratorValueAt(&data->X, wi->chrom, data->X.count ? data->X.count - 1 : 0, entering, &entering_X);
+	double Y_in = smoothWiggleIteratorValueAt(&data->Y, wi->chrom, data->Y.count ? data->Y.count - 1 : 0, entering, &entering_Y);
+	bool nan_out = isnan(X_out) || isnan(Y_out);
+	bool nan_in = isnan(X_in) || isnan(Y_in);
+	bool unchanged = nan_out || nan_in ? nan_out && nan_in : X_out == X_in && Y_out == Y_in;
+
+	wi->start = position;
+	wi->value = rollingPearsonValue(data, wi->chrom);
+
+	// Slide the window for as long as the sums are unchanged
+	long steps = 1;
+	if (unchanged) {
+		steps = leaving_X - leaving;
+		if (leaving_Y - leaving < steps)
+			steps = leaving_Y - leaving;
+		if (entering_X - entering < steps)
+			steps = entering_X - entering;
+		if (entering_Y - entering < steps)
+			steps = entering_Y - entering;
+	} else {
+		addRollingPair(data, X_out, Y_out, -1);
+		addRollingPair(data, X_in, Y_in, 1);
+		data->drift++;
+	}
+
+	// The window must not slide past the chromosome's last records
+	int last_finish = data->X.last_finish > data->Y.last_finish ? data->X.last_finish : data->Y.last_finish;
+	if (!rollingPearsonOnChrom(data, wi->chrom) && last_finish + data->X.before - position < steps)
+		steps = last_finish + data->X.before - position;
+
+	wi->finish = position + steps;
+	data->X.position = wi->finish;
+	smoothWiggleIteratorForget(&data->X, data->X.position - data->X.before);
+	smoothWiggleIteratorForget(&data->Y, data->X.position - data->X.before);
+	smoothWiggleIteratorRead(&data->X, wi->chrom, data->X.position + data->X.after + 1);
+	smoothWiggleIteratorRead(&data->Y, wi->chrom, data->X.position + data->X.after + 1);
+	// Resynchronise while the window is empty, as for smooth
+	if (data->drift >= data->X.width || (data->X.count == 0 && data->Y.count == 0))
+		rollingPearsonAddWindow(data, wi->chrom);
+}
+
+static void RollingPearsonWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	RollingPearsonData * data = (RollingPearsonData *) wi->data;
+	seek(data->X.iter, chrom, start, finish);
+	seek(data->Y.iter, chrom, start, finish);
+	data->X.count = data->Y.count = 0;
+	data->X.head = data->Y.head = 0;
+	wi->chrom = NULL;
+	wi->done = false;
+	pop(wi);
+}
+
+static void initRollingPearsonWindow(SmoothWiggleIteratorData * window, WiggleIterator * source, int width) {
+	window->iter = NonOverlappingWiggleIterator(source);
+	window->capacity = 16;
+	window->records = (SmoothRecord *) calloc(window->capacity, sizeof(SmoothRecord));
+	window->width = width;
+	window->after = width / 2;
+	window->before = width - 1 - window->after;
+}
+
+WiggleIterator * RollingPearsonWiggleIterator(WiggleIterator * iterX, WiggleIterator * iterY, int width) {
+	RollingPearsonData * data = (RollingPearsonData *) calloc(1, sizeof(RollingPearsonData));
+	if (width < 3) {
+		fprintf(stderr, "Cannot correlate over a window of width %i, must be 3 or more\n", width);
+		raiseError();
+	}
+	initRollingPearsonWindow(&data->X, iterX, width);
+	initRollingPearsonWindow(&data->Y, iterY, width);
+	return newWiggleIterator(data, &RollingPearsonWiggleIteratorPop, &RollingPearsonWiggleIteratorSeek, iterY->default_value);
+}
+
+//////////////////////////////////////////////////////
+// Binning operator
+//////////////////////////////////////////////////////
+
+// The chromosomes are tiled with bins of equal width from their first
+// base, and each bin which overlaps the source gets one record, with the
+// statistic of the source over the bin, as computed by apply over the same
+// windows. NaN values are ignored. A record which spans several bins is
+// read once, and a bin costs no allocation.
+
+typedef struct binWiggleIteratorData_st {
+	WiggleIterator * iter;
+	int width;
+	BinStatistic statistic;
+	// Where the last bin ended, the source records before it are counted
+	char * chrom;
+	int position;
+	// Region of the last seek, if any
+	int start, finish;
+} BinWiggleIteratorData;
+
+static void BinWiggleIteratorPop(WiggleIterator * wi) {
+	BinWiggleIteratorData * data = (BinWiggleIteratorData *) wi->data;
+	WiggleIterator * iter = data->iter;
+	double sum = 0, span = 0, extremum = NAN;
+	int from, start, finish;
+
+	if (iter->done) {
+		wi->done = true;
+		return;
+	}
+
+	// The current source record may have been counted up to the previous bin
+	from = iter->chrom == data->chrom && data->position > iter->start ? data->position : iter->start;
+	start = from - (from - 1) % data->width;
+	finish = start + data->width;
+	wi->chrom = data->chrom = iter->chrom;
+
+	while (!iter->done && iter->chrom == wi->chrom && iter->start < finish) {
+		if (!isnan(iter->value)) {
+			int length = (iter->finish < finish ? iter->finish : finish) - (iter->start > start ? iter->start : start);
+			sum += length * iter->value;
+			span += length;
+			if (isnan(extremum) || (data->statistic == BIN_MAX ? iter->value > extremum : iter->value < extremum))
+				extremum = iter->value;
+		}
+		if (iter->finish > finish)
+			break;
+		pop(iter);
+	}
+	data->position = finish;
+
+	switch (data->statistic) {
+	case BIN_SUM:
+		wi->value = sum;
+		break;
+	case BIN_MEAN:
+		wi->value = span > 0 ? sum / span : NAN;
+		break;
+	case BIN_COVERAGE:
+		wi->value = span;
+		break;
+	default:
+		wi->value = extremum;
+	}
+
+	// Bins are clipped to the region of a seek
+	wi->start = start;
+	wi->finish = finish;
+	if (data->finish > 0) {
+		if (wi->start < data->start)
+			wi->start = data->start;
+		if (wi->finish > data->finish)
+			wi->finish = data->finish;
+	}
+}
+
+static void BinWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	BinWiggleIteratorData * data = (BinWiggleIteratorData *) wi->data;
+	data->start = start;
+	data->finish = finish;
+	data->chrom = NULL;
+	// The bins at the edges are computed over their full width
+	start -= (start - 1) % data->width;
+	if (finish > 1)
+		finish += data->width - 1 - (finish - 2) % data->width;
+	seek(data->iter, chrom, start, finish);
+	pop(wi);
+}
+
+WiggleIterator * BinWiggleIterator(WiggleIterator * i, int width, BinStatistic statistic) {
+	BinWiggleIteratorData * data = (BinWiggleIteratorData *) calloc(1, sizeof(BinWiggleIteratorData));
+	if (width < 1) {
+		fprintf(stderr, "Cannot bin over a width of %i, must be 1 or more\n", width);
+		raiseError();
 	}
 	data->iter = NonOverlappingWiggleIterator(i);
-	data->buffer = (double*) calloc(sizeof(double), width);
 	data->width = width;
-	return newWiggleIterator(data, &SmoothWiggleIteratorPop, &SmoothWiggleIteratorSeek, i->default_value);
+	data->statistic = statistic;
+	WiggleIterator * new = newWiggleIterator(data, &BinWiggleIteratorPop, &BinWiggleIteratorSeek, i->default_value);
+	new->step = width;
+	return new;
 }
 
 //////////////////////////////////////////////////////
@@ -1009,87 +2883,313 @@ WiggleIterator * SmoothWiggleIterator(WiggleIterator * i, int width) {
 //////////////////////////////////////////////////////
 
 WiggleIterator * SmartReader(char * filename, bool holdFire) {
+	char * url = objectStoreUrl(filename);
+	if (url)
+		filename = url;
 	size_t length = strlen(filename);
-	if (!strcmp(filename + length - 3, ".bw"))
+	WiggleIterator * warm;
+	// Readers kept by the server hold fire
+	if (holdFire && (warm = takeWarmReader(filename)))
+		return warm;
+	else if (!strcmp(filename + length - 3, ".bw"))
 		return BigWiggleReader(filename, holdFire);
 	else if (!strcmp(filename + length - 7, ".bigWig"))
 		return BigWiggleReader(filename, holdFire);
 	else if (!strcmp(filename + length - 7, ".bigwig"))
 		return BigWiggleReader(filename, holdFire);
 	else if (!strcmp(filename + length - 3, ".bg"))
-		return WiggleReader(filename);
+		return holdFire ? WiggleReader(filename) : ParallelWiggleReader(filename);
 	else if (!strcmp(filename + length - 4, ".wig"))
-		return WiggleReader(filename);
+		return holdFire ? WiggleReader(filename) : ParallelWiggleReader(filename);
+	else if (!strcmp(filename + length - 9, ".bedGraph") || !strcmp(filename + length - 9, ".bedgraph"))
+		return holdFire ? WiggleReader(filename) : ParallelWiggleReader(filename);
 	else if (!strcmp(filename + length - 4, ".bed"))
 		return BedReader(filename);
 	else if (!strcmp(filename + length - 3, ".bb"))
 		return BigBedReader(filename, holdFire);
 	else if (!strcmp(filename + length - 4, ".bam"))
-		return BamReader(filename, holdFire);
+		// Skip unmapped, secondary, QC failed and duplicate reads
+		return BamCoverageReader(filename, holdFire, 0, 0, 0x704, 0, -1);
+	else if (!strcmp(filename + length - 5, ".cram"))
+		return BamCoverageReader(filename, holdFire, 0, 0, 0x704, 0, -1);
 	else if (!strcmp(filename + length - 4, ".sam"))
 		return SamReader(filename);
 	else if (!strcmp(filename + length - 4, ".vcf"))
 		return VcfReader(filename);
 	else if (!strcmp(filename + length - 4, ".bcf"))
 		return BcfReader(filename, holdFire);
+	else if (!strcmp(filename + length - 6, ".bg.gz"))
+		return WiggleReader(filename);
+	else if (!strcmp(filename + length - 7, ".wig.gz"))
+		return WiggleReader(filename);
+	else if (!strcmp(filename + length - 12, ".bedGraph.gz") || !strcmp(filename + length - 12, ".bedgraph.gz"))
+		return WiggleReader(filename);
+	else if (!strcmp(filename + length - 7, ".bed.gz"))
+		return BedReader(filename);
+	else if (!strcmp(filename + length - 7, ".vcf.gz"))
+		return VcfReader(filename);
+	else if (!strcmp(filename + length - 4, ".wtc"))
+		return TrackCacheReader(filename);
+	else if (!strcmp(filename + length - 4, ".wti"))
+		return IntegerTrackReader(filename);
 	else if (!strcmp(filename, "-"))
 		return WiggleReader(filename);
 	else {
 		fprintf(stderr, "Could not recognize file format from suffix: %s\n", filename);
-		exit(1);
+		raiseError();
 	}
 }
 
+// BigBed files are read without their values and strands, for iterators
+// which only need the coordinates
+WiggleIterator * CoordinatesReader(char * filename, bool holdFire) {
+	char * url = objectStoreUrl(filename);
+	size_t length = strlen(url ? url : filename);
+	WiggleIterator * warm;
+
+	if (url)
+		filename = url;
+	if (holdFire && (warm = takeWarmReader(filename)))
+		return warm;
+	else if (length > 3 && !strcmp(filename + length - 3, ".bb"))
+		return BigBedCoordinatesReader(filename, holdFire);
+	else
+		return SmartReader(filename, holdFire);
+}
+
+// Files which SmartReader can open
+bool isWiggleFilename(char * filename) {
+	size_t length = strlen(filename);
+	static const char * suffixes[] = {".bw", ".bigWig", ".bigwig", ".bg", ".wig", ".bed", ".bb", ".bam", ".cram", ".sam", ".vcf", ".bcf", ".bg.gz", ".wig.gz", ".bedGraph", ".bedgraph", ".bedGraph.gz", ".bedgraph.gz", ".bed.gz", ".vcf.gz", ".wtc", ".wti", NULL};
+	int i;
+
+	for (i = 0; suffixes[i]; i++)
+		if (length > strlen(suffixes[i]) && !strcmp(filename + length - strlen(suffixes[i]), suffixes[i]))
+			return true;
+	return false;
+}
+
+// Files which a reader can seek into without scanning them
+bool isIndexedFile(char * filename) {
+	size_t length = strlen(filename);
+	return (length > 3 && !strcmp(filename + length - 3, ".bw"))
+		|| (length > 7 && !strcmp(filename + length - 7, ".bigWig"))
+		|| (length > 7 && !strcmp(filename + length - 7, ".bigwig"))
+		|| (length > 3 && !strcmp(filename + length - 3, ".bb"))
+		|| (length > 4 && !strcmp(filename + length - 4, ".bam"))
+		|| (length > 5 && !strcmp(filename + length - 5, ".cram"))
+		|| (length > 4 && !strcmp(filename + length - 4, ".bcf")) || (length > 4 && !strcmp(filename + length - 4, ".bed"));
+}
+
 //////////////////////////////////////////////////////
 // Concatenation 
 //////////////////////////////////////////////////////
 
+// Files read one after the other. The records of a file which end before 
+// the last record of the previous files are dropped, and those which 
+// straddle it are trimmed.
+//
+// The span of each file is noted once it has been read through, so that 
+// seeks skip the files known to be outside the region. The other files are
+// seeked in turn, on the assumption that the files cover successive 
+// stretches of the genome, e.g. one chromosome each. While a file is being
+// read, the next one is opened in the background, which reads its header 
+// and starts its download. A concatenation which holds fire opens nothing
+// but the header of its first file before the first seek.
+
+typedef struct catFile_st {
+	char * filename;
+	// Span of the records, once the file has been read through without seeking
+	bool covered;
+	bool empty;
+	char * firstChrom;
+	int firstStart;
+	char * lastChrom;
+	int lastFinish;
+} CatFile;
+
 typedef struct CatWiggleIteratorData_st {
-	char ** filenames;
+	CatFile * files;
 	int count;
 	int index;
 	WiggleIterator * iter;
+	// End of the last record of the previous files, chrom NULL if none
+	char * boundChrom;
+	int boundFinish;
+	// End of the last record returned, chrom NULL if none
+	char * emittedChrom;
+	int emittedFinish;
+	// Nothing is read before the first seek if set
+	bool holdFire;
+	// Region of the last seek
+	bool seeked;
+	char * chrom;
+	int start;
+	int finish;
+	// Next file, opened by the prefetch thread
+	bool prefetching;
+	pthread_t prefetcher;
+	int nextIndex;
+	WiggleIterator * next;
 } CatWiggleIteratorData;
 
-void CatWiggleIteratorPop(WiggleIterator * wi) {
+static bool catFileOutsideRegion(CatWiggleIteratorData * data, CatFile * file) {
+	if (!data->seeked || !file->covered)
+		return false;
+	return file->empty
+		|| compareChroms(file->lastChrom, data->chrom) < 0
+		|| (compareChroms(file->lastChrom, data->chrom) == 0 && file->lastFinish <= data->start)
+		|| compareChroms(file->firstChrom, data->chrom) > 0
+		|| (compareChroms(file->firstChrom, data->chrom) == 0 && file->firstStart >= data->finish);
+}
+
+// Index of the next file which may have records to read after index, count if none
+static int nextCatFileIndex(CatWiggleIteratorData * data, int index) {
+	while (++index < data->count && catFileOutsideRegion(data, data->files + index));
+	return index;
+}
+
+// Readers of a seeked concatenation hold fire until they are seeked themselves
+static WiggleIterator * openCatFile(CatWiggleIteratorData * data, int index) {
+	WiggleIterator * iter = SmartReader(data->files[index].filename, data->seeked);
+	if (data->seeked)
+		seek(iter, data->chrom, data->start, data->finish);
+	return iter;
+}
+
+static void * prefetchCatFile(void * args) {
+	CatWiggleIteratorData * data = (CatWiggleIteratorData *) args;
+	data->next = openCatFile(data, data->nextIndex);
+	return NULL;
+}
+
+static void launchCatPrefetch(CatWiggleIteratorData * data) {
+	data->nextIndex = nextCatFileIndex(data, data->index);
+	if (data->nextIndex == data->count)
+		return;
+	if (pthread_create(&data->prefetcher, NULL, &prefetchCatFile, data)) {
+		fprintf(stderr, "Could not create file prefetching thread\n");
+		raiseError();
+	}
+	data->prefetching = true;
+}
+
+static void joinCatPrefetch(CatWiggleIteratorData * data) {
+	if (data->prefetching) {
+		pthread_join(data->prefetcher, NULL);
+		data->prefetching = false;
+	}
+}
+
+// Moves on to the next file, returns false if there are none left
+static bool nextCatFile(CatWiggleIteratorData * data) {
+	joinCatPrefetch(data);
+	if (data->next) {
+		data->index = data->nextIndex;
+		data->iter = data->next;
+		data->next = NULL;
+	} else {
+		data->index = nextCatFileIndex(data, data->index);
+		if (data->index == data->count)
+			return false;
+		data->iter = openCatFile(data, data->index);
+	}
+
+	data->boundChrom = data->emittedChrom;
+	data->boundFinish = data->emittedFinish;
+	launchCatPrefetch(data);
+	return true;
+}
+
+// Notes the span of the records of the current file
+static void coverCatRecord(CatWiggleIteratorData * data, WiggleIterator * iter) {
+	CatFile * file = data->files + data->index;
+	if (data->seeked)
+		return;
+	if (!file->firstChrom) {
+		file->firstChrom = iter->chrom;
+		file->firstStart = iter->start;
+	}
+	if (!file->lastChrom || file->lastChrom != iter->chrom || iter->finish > file->lastFinish) {
+		file->lastChrom = iter->chrom;
+		file->lastFinish = iter->finish;
+	}
+}
+
+static void CatWiggleIteratorPop(WiggleIterator * wi) {
 	CatWiggleIteratorData * data = (CatWiggleIteratorData *) wi->data;
 	WiggleIterator * iter = data->iter;
-	if (!data->iter->done) {
-		wi->chrom = iter->chrom;
-		wi->start = iter->start;
-		wi->finish = iter->finish;
-		wi->value = iter->value;
-		pop(iter);
-	} else if (data->index < data->count - 1) {
-		while (++data->index < data->count) {
-			iter = data->iter = SmartReader(data->filenames[data->index], false);
-			while (!iter->done && (strcmp(wi->chrom, iter->chrom) >= 0 || (strcmp(wi->chrom, iter->chrom) == 0 && wi->finish >= iter->finish)))
-				pop(iter);
-			if (!iter->done) {
-				if (strcmp(wi->chrom, iter->chrom) < 0 || iter->start > wi->finish)
-					wi->start = iter->start;
-				else
-					wi->start = wi->finish;
-				wi->chrom = iter->chrom;
-				wi->finish = iter->finish;
-				wi->value = iter->value;
-				pop(iter);
-				break;
+	int cmp;
+
+	for (;;) {
+		while (iter->done) {
+			if (!data->seeked) {
+				data->files[data->index].covered = true;
+				data->files[data->index].empty = data->files[data->index].firstChrom == NULL;
+			}
+			if (!nextCatFile(data)) {
+				wi->done = true;
+				return;
 			}
+			iter = data->iter;
 		}
-	} else 
-		wi->done = true;
+		coverCatRecord(data, iter);
+		cmp = data->boundChrom ? compareChroms(iter->chrom, data->boundChrom) : 1;
+		if (cmp > 0 || (cmp == 0 && iter->finish > data->boundFinish))
+			break;
+		pop(iter);
+	}
+
+	wi->chrom = iter->chrom;
+	wi->start = cmp == 0 && iter->start < data->boundFinish ? data->boundFinish : iter->start;
+	wi->finish = iter->finish;
+	wi->value = iter->value;
+	data->emittedChrom = wi->chrom;
+	data->emittedFinish = wi->finish;
+	pop(iter);
 }
 
-void CatWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
-	puts("Cannot apply seek to a concatenation of files!");
-	exit(1);
+static void CatWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	CatWiggleIteratorData * data = (CatWiggleIteratorData *) wi->data;
+	int first;
+
+	joinCatPrefetch(data);
+	data->seeked = true;
+	data->chrom = (char *) chrom;
+	data->start = start;
+	data->finish = finish;
+	data->boundChrom = data->emittedChrom = NULL;
+
+	// The readers already open are reused if they are still needed
+	first = nextCatFileIndex(data, -1);
+	if (first == data->count) {
+		data->next = NULL;
+		wi->done = true;
+		return;
+	} else if (first == data->index)
+		seek(data->iter, chrom, start, finish);
+	else if (data->next && data->nextIndex == first) {
+		data->iter = data->next;
+		seek(data->iter, chrom, start, finish);
+	} else
+		data->iter = openCatFile(data, first);
+	data->index = first;
+	data->next = NULL;
+	launchCatPrefetch(data);
+	pop(wi);
 }
 
-WiggleIterator * CatWiggleIterator(char ** filenames, int count) {
+WiggleIterator * CatWiggleIterator(char ** filenames, int count, bool holdFire) {
 	CatWiggleIteratorData * data = (CatWiggleIteratorData *) calloc(1, sizeof(CatWiggleIteratorData));
+	int index;
+
 	data->count = count;
-	data->filenames = filenames;
-	data->iter = SmartReader(data->filenames[0], false);
+	data->files = (CatFile *) calloc(count, sizeof(CatFile));
+	for (index = 0; index < count; index++)
+		data->files[index].filename = filenames[index];
+	data->holdFire = holdFire;
+	data->iter = SmartReader(data->files[0].filename, holdFire);
+	if (!holdFire)
+		launchCatPrefetch(data);
 	return newWiggleIterator(data, &CatWiggleIteratorPop, &CatWiggleIteratorSeek, 0);
 }
@@ -16,87 +16,460 @@
 #include <string.h> 
 
 #include "wiggleIterator.h"
+#include "multiplexer.h"
+#include "lineReader.h"
+#include "vcfReader.h"
+
+//////////////////////////////////////////////////////
+// Fields
+//////////////////////////////////////////////////////
+
+// Columns of a record line
+#define VCF_QUAL_COLUMN 5
+#define VCF_INFO_COLUMN 7
+#define VCF_FORMAT_COLUMN 8
+
+enum vcfFieldType {VCF_QUAL, VCF_INFO, VCF_FORMAT};
+
+struct vcfField_st {
+	enum vcfFieldType type;
+	char * key;
+	int length;
+	bool genotype;
+};
+
+VcfField * newVcfField(char * name) {
+	VcfField * field = (VcfField *) calloc(1, sizeof(VcfField));
+	if (!strcmp(name, "QUAL"))
+		field->type = VCF_QUAL;
+	else if (!strncmp(name, "INFO/", 5) && name[5]) {
+		field->type = VCF_INFO;
+		field->key = name + 5;
+	} else if (!strncmp(name, "FORMAT/", 7) && name[7]) {
+		field->type = VCF_FORMAT;
+		field->key = name + 7;
+		field->genotype = !strcmp(field->key, "GT");
+	} else {
+		fprintf(stderr, "Unknown VCF field %s, expected QUAL, INFO/(key) or FORMAT/(key)\n", name);
+		raiseError();
+	}
+	if (field->key)
+		field->length = strlen(field->key);
+	return field;
+}
+
+// Start of the count-th column after ptr, NULL if the line is too short
+static char * skipColumns(char * ptr, char * end, int count) {
+	for (; count > 0; count--) {
+		if (!(ptr = memchr(ptr, '\t', end - ptr)))
+			return NULL;
+		ptr++;
+	}
+	return ptr;
+}
+
+// End of the subfield starting at ptr
+static char * subfieldEnd(char * ptr, char * end, char separator) {
+	for (; ptr < end && *ptr != separator && *ptr != '\t'; ptr++)
+		continue;
+	return ptr;
+}
+
+// A missing value is a lone '.'
+static bool readVcfNumber(char * ptr, char * end, double * value) {
+	if (ptr < end && *ptr == '.' && (ptr + 1 == end || ptr[1] < '0' || ptr[1] > '9'))
+		return false;
+	return parseDouble(&ptr, end, value);
+}
+
+static bool readInfoValue(VcfField * field, char * ptr, char * end, double * value) {
+	char * stop = subfieldEnd(ptr, end, '\t');
+	char * next;
+
+	for (; ptr < stop; ptr = next + 1) {
+		next = subfieldEnd(ptr, stop, ';');
+		if (next - ptr >= field->length && !memcmp(ptr, field->key, field->length)) {
+			if (ptr + field->length == next) {
+				// Flag
+				*value = 1;
+				return true;
+			} else if (ptr[field->length] == '=') 
+				return readVcfNumber(ptr + field->length + 1, next, value);
+		}
+	}
+	return false;
+}
+
+// Position of the key in the FORMAT column, -1 if absent
+static int formatIndex(VcfField * field, char * ptr, char * end) {
+	char * stop = subfieldEnd(ptr, end, '\t');
+	char * next;
+	int index;
+
+	for (index = 0; ptr < stop; ptr = next + 1, index++) {
+		next = subfieldEnd(ptr, stop, ':');
+		if (next - ptr == field->length && !memcmp(ptr, field->key, field->length))
+			return index;
+	}
+	return -1;
+}
+
+// Count of the called alleles which are not the reference, e.g. 0|1 => 1
+static bool readDosage(char * ptr, char * end, double * value) {
+	bool called = false;
+	int dosage = 0;
+
+	for (; ptr < end && *ptr != ':' && *ptr != '\t'; ptr++) {
+		if (*ptr == '/' || *ptr == '|')
+			continue;
+		if (*ptr != '.') {
+			called = true;
+			if (*ptr != '0' || (ptr + 1 < end && ptr[1] >= '0' && ptr[1] <= '9'))
+				dosage++;
+		}
+		while (ptr + 1 < end && ptr[1] >= '0' && ptr[1] <= '9')
+			ptr++;
+	}
+	*value = dosage;
+	return called;
+}
+
+// Value of one sample, whose column starts at ptr
+static bool readSampleValue(VcfField * field, int index, char * ptr, char * end, double * value) {
+	for (; index > 0; index--) {
+		ptr = subfieldEnd(ptr, end, ':');
+		if (ptr == end || *ptr != ':')
+			return false;
+		ptr++;
+	}
+	if (field->genotype)
+		return readDosage(ptr, end, value);
+	else
+		return readVcfNumber(ptr, end, value);
+}
+
+// Fills values and inplay for count samples, returns the number of samples with a value
+static int readVcfSampleValues(VcfField * field, char * line, char * end, double * values, bool * inplay, int count) {
+	char * ptr = skipColumns(line, end, VCF_FORMAT_COLUMN);
+	int index, sample, found = 0;
+
+	memset(inplay, 0, count * sizeof(bool));
+	if (!ptr || (index = formatIndex(field, ptr, end)) < 0)
+		return 0;
+
+	for (sample = 0; sample < count && (ptr = skipColumns(ptr, end, 1)); sample++) {
+		if ((inplay[sample] = readSampleValue(field, index, ptr, end, values + sample)))
+			found++;
+		else
+			values[sample] = 0;
+	}
+	return found;
+}
+
+bool readVcfValue(VcfField * field, char * line, char * end, double * value) {
+	char * ptr;
+	int index;
+	double sampleValue;
+	bool found = false;
+
+	switch (field->type) {
+	case VCF_QUAL:
+		return (ptr = skipColumns(line, end, VCF_QUAL_COLUMN)) && readVcfNumber(ptr, end, value);
+	case VCF_INFO:
+		return (ptr = skipColumns(line, end, VCF_INFO_COLUMN)) && readInfoValue(field, ptr, end, value);
+	case VCF_FORMAT:
+		if (!(ptr = skipColumns(line, end, VCF_FORMAT_COLUMN)) || (index = formatIndex(field, ptr, end)) < 0)
+			return false;
+		*value = 0;
+		while ((ptr = skipColumns(ptr, end, 1))) {
+			if (readSampleValue(field, index, ptr, end, &sampleValue)) {
+				*value += sampleValue;
+				found = true;
+			}
+		}
+		return found;
+	}
+	return false;
+}
+
+//////////////////////////////////////////////////////
+// Iterator
+//////////////////////////////////////////////////////
 
 typedef struct bedReaderData_st {
 	char  *filename;
-	FILE * file;
+	LineReader * reader;
+	bool finished;
 	char * chrom;
 	int stop;
+	// Value for each record, 1 if NULL. The values of the records at the 
+	// same position are then summed, so the next record is read ahead.
+	VcfField * field;
+	bool hasNext;
+	char * nextChrom;
+	int nextPos;
+	double nextValue;
 } VcfReaderData;
 
+// Reads the next record which has a value
+static bool readVcfRecord(VcfReaderData * data, char * lastChrom) {
+	char * line, * end;
+	int length;
+
+	while ((line = readNextLine(data->reader, &end))) {
+		if (line == end || line[0] == '#')
+			continue;
+		if (data->field && !readVcfValue(data->field, line, end, &data->nextValue))
+			continue;
+		length = tokenLength(&line, end);
+		if (strncmp(line, lastChrom, length) || lastChrom[length] != '\0')
+			data->nextChrom = internChromosomeN(line, length);
+		else
+			data->nextChrom = lastChrom;
+		line += length;
+		parseInteger(&line, end, &data->nextPos);
+		return true;
+	}
+	return false;
+}
+
 void VcfReaderPop(WiggleIterator * wi) {
 	VcfReaderData * data = (VcfReaderData *) wi->data;
-	char line[5000];
-	char chrom[1000];
 
 	if (wi->done)
 		return;
 
-	while (fgets(line, 5000, data->file)) {
-		if (line[0] != '#') {
-			sscanf(line, "%s\t%i", chrom, &wi->start);
-
-			wi->finish = wi->start + 1;
-
-			// The reason for creating a new string instead of simply 
-			// overwriting is that other functions may still be pointin
-			// at the old label
-			if (wi->chrom[0] == '\0' || strcmp(wi->chrom, chrom)) {
-				wi->chrom = (char *) calloc(strlen(chrom), sizeof(char));
-				strcpy(wi->chrom, chrom);
-			}
+	if (!data->hasNext && !readVcfRecord(data, wi->chrom)) {
+		data->finished = true;
+		wi->done = true;
+		return;
+	}
 
-			if (data->stop > 0) {
-				if ((wi->start >= data->stop && strcmp(wi->chrom, data->chrom) == 0) || strcmp(wi->chrom, data->chrom) > 0) {
-					wi->done = true;
-					return;
-				} else if (wi->finish > data->stop) {
-					wi->finish = data->stop;
-				}
-			}
-			return;
-		}
-	} 
+	wi->chrom = data->nextChrom;
+	wi->start = data->nextPos;
+	wi->finish = wi->start + 1;
+	data->hasNext = false;
+	if (data->field) {
+		wi->value = data->nextValue;
+		while ((data->hasNext = readVcfRecord(data, wi->chrom)) && data->nextChrom == wi->chrom && data->nextPos == wi->start)
+			wi->value += data->nextValue;
+	}
 
-	fclose(data->file);
-	data->file = NULL;
-	wi->done = true;
+	if (data->stop > 0) {
+		if ((wi->start >= data->stop && compareChroms(wi->chrom, data->chrom) == 0) || compareChroms(wi->chrom, data->chrom) > 0)
+			wi->done = true;
+		else if (wi->finish > data->stop)
+			wi->finish = data->stop;
+	}
 }
 
 void VcfReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	VcfReaderData * data = (VcfReaderData*) wi->data;
+	bool restart = false;
 
 	data->stop = finish;
 	data->chrom = chrom;
 
-	if (wi->done || strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && start < wi->start)) {
-		if (data->file)
-			fclose(data->file);
-		if (!(data->file = fopen(data->filename, "r"))) {
-			fprintf(stderr, "Could not open input file %s\n", data->filename);
-			exit(1);
+	if (seekLineReader(data->reader, chrom, start, finish))
+		restart = true;
+	else if (data->finished || compareChroms(chrom, wi->chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && start < wi->start)) {
+		if (!rewindLineReader(data->reader)) {
+			fprintf(stderr, "Cannot rewind input file %s\n", data->filename);
+			raiseError();
 		}
+		restart = true;
+	}
+
+	if (restart) {
+		data->finished = false;
+		data->hasNext = false;
+		wi->chrom = internChromosome("");
+		wi->start = 0;
 		wi->done = false;
 		pop(wi);
 	}
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && wi->finish < start))) 
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(chrom, wi->chrom) == 0 && wi->finish < start))) 
 		pop(wi);
 
-	if (!wi->done && strcmp(chrom, wi->chrom) == 0 && wi->start < start)
+	if (!wi->done && compareChroms(chrom, wi->chrom) == 0 && wi->start < start)
 		wi->start = start;
 }
 
-WiggleIterator * VcfReader(char * filename) {
+static WiggleIterator * newVcfReader(char * filename, VcfField * field) {
 	VcfReaderData * data = (VcfReaderData *) calloc(1, sizeof(VcfReaderData));
 	data->filename = filename;
 	data->stop = -1;
-	if (!(data->file = fopen(filename, "r"))) {
-		fprintf(stderr, "Could not open bed file %s\n", filename);
-		exit(1);
+	data->field = field;
+	if (!(data->reader = newLineReader(filename))) {
+		fprintf(stderr, "Could not open VCF file %s\n", filename);
+		raiseError();
 	}
 	WiggleIterator * res = newWiggleIterator(data, &VcfReaderPop, &VcfReaderSeek, 0);
-	res->value = 1;
-	res->overlaps = true;
+	if (!field) {
+		res->value = 1;
+		res->overlaps = true;
+	}
+	return res;
+}
+
+WiggleIterator * VcfReader(char * filename) {
+	return newVcfReader(filename, NULL);
+}
+
+WiggleIterator * VcfValueReader(char * filename, char * field, bool holdFire) {
+	size_t length = strlen(filename);
+	if (length > 4 && !strcmp(filename + length - 4, ".bcf"))
+		return BcfValueReader(filename, holdFire, newVcfField(field));
+	else
+		return newVcfReader(filename, newVcfField(field));
+}
+
+//////////////////////////////////////////////////////
+// Multiplexer across samples
+//////////////////////////////////////////////////////
+
+typedef struct vcfSampleData_st {
+	char * filename;
+	LineReader * reader;
+	VcfField * field;
+	bool finished;
+	const char * chrom;
+	int stop;
+	// Next row, read ahead to sum the rows at the same position
+	bool hasNext;
+	char * nextChrom;
+	int nextPos;
+	double * nextValues;
+	bool * nextInplay;
+} VcfSampleData;
+
+// The samples are named after the FORMAT column of the #CHROM line
+static void countVcfSamples(VcfSampleData * data, int * count) {
+	char * line, * end;
+	int columns, length;
+
+	while ((line = readNextLine(data->reader, &end)) && line < end && line[0] == '#') {
+		if (strncmp(line, "#CHROM", 6))
+			continue;
+		for (columns = 0; (length = tokenLength(&line, end)); columns++)
+			line += length;
+		if (columns <= VCF_FORMAT_COLUMN + 1)
+			break;
+		*count = columns - VCF_FORMAT_COLUMN - 1;
+		return;
+	}
+	fprintf(stderr, "VCF file %s has no samples, or no #CHROM header line\n", data->filename);
+	raiseError();
+}
+
+static bool readVcfSampleRow(VcfSampleData * data, int count, char * lastChrom) {
+	char * line, * end;
+	int length;
+
+	while ((line = readNextLine(data->reader, &end))) {
+		if (line == end || line[0] == '#')
+			continue;
+		if (!readVcfSampleValues(data->field, line, end, data->nextValues, data->nextInplay, count))
+			continue;
+
+		length = tokenLength(&line, end);
+		if (strncmp(line, lastChrom, length) || lastChrom[length] != '\0')
+			data->nextChrom = internChromosomeN(line, length);
+		else
+			data->nextChrom = lastChrom;
+		line += length;
+		parseInteger(&line, end, &data->nextPos);
+		return true;
+	}
+	return false;
+}
+
+static void VcfSamplePop(Multiplexer * multi) {
+	VcfSampleData * data = (VcfSampleData *) multi->data;
+	int sample;
+
+	if (!data->hasNext && !readVcfSampleRow(data, multi->count, multi->chrom)) {
+		data->finished = true;
+		multi->done = true;
+		return;
+	}
+
+	multi->chrom = data->nextChrom;
+	multi->start = data->nextPos;
+	multi->finish = multi->start + 1;
+	multi->change_count = -1;
+	memcpy(multi->values, data->nextValues, multi->count * sizeof(double));
+	memcpy(multi->inplay, data->nextInplay, multi->count * sizeof(bool));
+	while ((data->hasNext = readVcfSampleRow(data, multi->count, multi->chrom)) && data->nextChrom == multi->chrom && data->nextPos == multi->start) {
+		for (sample = 0; sample < multi->count; sample++) {
+			multi->values[sample] += data->nextValues[sample];
+			multi->inplay[sample] |= data->nextInplay[sample];
+		}
+	}
+	multi->inplay_count = 0;
+	for (sample = 0; sample < multi->count; sample++)
+		if (multi->inplay[sample])
+			multi->inplay_count++;
+
+	if (data->stop > 0 && ((multi->start >= data->stop && compareChroms(multi->chrom, data->chrom) == 0) || compareChroms(multi->chrom, data->chrom) > 0)) 
+		multi->done = true;
+}
+
+static void VcfSampleSeek(Multiplexer * multi, const char * chrom, int start, int finish) {
+	VcfSampleData * data = (VcfSampleData *) multi->data;
+	bool restart = false;
+
+	data->stop = finish;
+	data->chrom = chrom;
+
+	if (seekLineReader(data->reader, chrom, start, finish))
+		restart = true;
+	else if (data->finished || compareChroms(chrom, multi->chrom) < 0 || (compareChroms(chrom, multi->chrom) == 0 && start < multi->start)) {
+		// The header lines are skipped by pop
+		if (!rewindLineReader(data->reader)) {
+			fprintf(stderr, "Cannot rewind input file %s\n", data->filename);
+			raiseError();
+		}
+		restart = true;
+	}
+
+	if (restart) {
+		data->finished = false;
+		data->hasNext = false;
+		multi->chrom = internChromosome("");
+		multi->start = 0;
+		multi->done = false;
+		VcfSamplePop(multi);
+	} else if ((multi->start >= finish && compareChroms(multi->chrom, chrom) == 0) || compareChroms(multi->chrom, chrom) > 0)
+		// The current record is past the region
+		multi->done = true;
+
+	while (!multi->done && (compareChroms(multi->chrom, chrom) < 0 || (compareChroms(chrom, multi->chrom) == 0 && multi->finish <= start))) 
+		VcfSamplePop(multi);
+}
+
+Multiplexer * VcfSampleMultiplexer(char * filename, char * field) {
+	VcfSampleData * data = (VcfSampleData *) calloc(1, sizeof(VcfSampleData));
+	int count;
+
+	data->filename = filename;
+	data->field = newVcfField(field);
+	data->stop = -1;
+	if (data->field->type != VCF_FORMAT) {
+		fprintf(stderr, "Only FORMAT fields have a value per sample, not %s\n", field);
+		raiseError();
+	}
+	if (!(data->reader = newLineReader(filename))) {
+		fprintf(stderr, "Could not open VCF file %s\n", filename);
+		raiseError();
+	}
+	countVcfSamples(data, &count);
+	data->nextValues = (double *) calloc(count, sizeof(double));
+	data->nextInplay = (bool *) calloc(count, sizeof(bool));
+
+	Multiplexer * res = newCoreMultiplexer(data, count, &VcfSamplePop, &VcfSampleSeek);
+	res->chrom = internChromosome("");
+	popMultiplexer(res);
 	return res;
 }
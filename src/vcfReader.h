@@ -0,0 +1,36 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _VCF_READER_H_
+#define _VCF_READER_H_
+
+// Values extracted from the lines of VCF files, shared by the VCF and BCF readers
+//
+// A field is named as in bcftools: QUAL, INFO/(key) or FORMAT/(key). INFO
+// flags are worth 1, lists are reduced to their first number, and FORMAT/GT
+// is read as the dosage of each sample, i.e. its count of non reference
+// alleles. The columns before the one needed are skipped without being parsed.
+
+#include "wiggleIterator.h"
+
+typedef struct vcfField_st VcfField;
+
+VcfField * newVcfField(char * name);
+// Reads the field from a record line (end excluded). FORMAT fields are summed 
+// across the samples. Returns false if the record has no value.
+bool readVcfValue(VcfField * field, char * line, char * end, double * value);
+
+WiggleIterator * BcfValueReader(char * filename, bool holdFire, VcfField * field);
+
+#endif
@@ -15,8 +15,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "wiggleIterator.h"
+#include "lineReader.h"
+#include "offsetIndex.h"
+#include "profiler.h"
 
 //////////////////////////////////////////////////////
 // File Reader
@@ -24,15 +29,26 @@
 
 enum readingMode {FIXED_STEP, VARIABLE_STEP, BED_GRAPH};
 
+typedef struct parallelParse_st ParallelParse;
+
 typedef struct wiggleReaderData_st {
 	char * filename;
-	FILE * file;
+	LineReader * reader;
+	bool finished;
 	enum readingMode readingMode;
 	int step;
 	int span;
 	char words[5];
 	char * chrom;
 	int stop;
+	// Next record of the file, lines are parsed into it
+	WiggleIterator cursor;
+	// Last record popped, before it was clipped to the region
+	WiggleIterator record;
+	// Chunks parsed ahead on other threads, NULL once seeked
+	ParallelParse * parallel;
+	// Offsets of a few lines, set on the first seek of a large plain file
+	OffsetIndex * index;
 } WiggleReaderData;
 
 
@@ -54,19 +70,17 @@ static void WiggleReaderReadHeader(WiggleIterator * wi, WiggleReaderData * data,
 			token = strtok(NULL, seps);
 			if (!token) {
 				fprintf(stderr, "Empty wi->chromosome name!\n");
-				exit(1);
-			}
-			if (strcmp(wi->chrom, token)) {
-				wi->chrom = malloc(strlen(token) + 1);
-				strcpy(wi->chrom, token);
+				raiseError();
 			}
+			if (strcmp(wi->chrom, token))
+				wi->chrom = internChromosome(token);
 		}
 		if (!strcmp(token, "start")) {
 			start_b = false;
 			token = strtok(NULL, seps);
 			if (!token) {
 				fprintf(stderr, "Empty wi->start position!\n");
-				exit(1);
+				raiseError();
 			}
 			sscanf(token, "%i", &(wi->start));
 		}
@@ -74,7 +88,7 @@ static void WiggleReaderReadHeader(WiggleIterator * wi, WiggleReaderData * data,
 			token = strtok(NULL, seps);
 			if (!token) {
 				fprintf(stderr, "Empty span length!\n");
-				exit(1);
+				raiseError();
 			}
 			sscanf(token, "%i", &(data->span));
 		}
@@ -82,12 +96,12 @@ static void WiggleReaderReadHeader(WiggleIterator * wi, WiggleReaderData * data,
 			step_b = false;
 			if (data->readingMode == VARIABLE_STEP) {
 				fprintf(stderr, "Cannot specify step length on a variable length track\n");
-				exit(1);
+				raiseError();
 			}
 			token = strtok(NULL, seps);
 			if (!token) {
 				fprintf(stderr, "Empty step length!\n");
-				exit(1);
+				raiseError();
 			}
 			sscanf(token, "%i", &(data->step));
 		}
@@ -97,7 +111,7 @@ static void WiggleReaderReadHeader(WiggleIterator * wi, WiggleReaderData * data,
 	// Checking that all compulsory fields were filled:
 	if ((data->readingMode == FIXED_STEP && (chrom_b || start_b || step_b)) || (data->readingMode == VARIABLE_STEP && chrom_b)) {
 		fprintf(stderr, "Invalid header, missing data: %s\n", line);
-		exit(1);
+		raiseError();
 	}
 
 	// Backing off so as not to offset the first line
@@ -105,140 +119,682 @@ static void WiggleReaderReadHeader(WiggleIterator * wi, WiggleReaderData * data,
 		wi->start -= data->step;
 }
 
-static void WiggleReaderReadFixedStepLine(WiggleIterator * wi, char * line, int step, int span) {
-	sscanf(line, "%lf", &(wi->value));
+// Header lines are rare, they are copied out to be tokenised with strtok
+static void WiggleReaderReadHeaderLine(WiggleIterator * wi, WiggleReaderData * data, char * line, char * end) {
+	char * header = (char *) calloc(end - line + 1, sizeof(char));
+	memcpy(header, line, end - line);
+	WiggleReaderReadHeader(wi, data, header);
+	free(header);
+}
+
+static void WiggleReaderReadFixedStepLine(WiggleIterator * wi, char * line, char * end, int step, int span) {
+	parseDouble(&line, end, &(wi->value));
 	wi->start += step;
 	wi->finish = wi->start + span;
 }
 
-static void WiggleReaderReadVariableStepLine(WiggleIterator * wi, char * line, int span) {
-	sscanf(line, "%i\t%lf", &(wi->start), &(wi->value));
+static void WiggleReaderReadVariableStepLine(WiggleIterator * wi, char * line, char * end, int span) {
+	parseInteger(&line, end, &(wi->start));
+	parseDouble(&line, end, &(wi->value));
 	wi->finish = wi->start + span;
 }
 
-static void WiggleReaderReadBedGraphLine(WiggleIterator * wi, char * line) {
-	char * buffer = calloc(500, sizeof(char));
-	sscanf(line, "%s\t%i\t%i\t%lf", buffer, &(wi->start), &(wi->finish), &(wi->value));
+static void WiggleReaderReadBedGraphLine(WiggleIterator * wi, char * line, char * end) {
+	int length = tokenLength(&line, end);
+	if (strncmp(line, wi->chrom, length) || wi->chrom[length] != '\0')
+		wi->chrom = internChromosomeN(line, length);
+	line += length;
+	parseInteger(&line, end, &(wi->start));
+	parseInteger(&line, end, &(wi->finish));
+	parseDouble(&line, end, &(wi->value));
 	// BedGraphs are 0 based, half open
 	wi->start++;
 	wi->finish++;
-	if (strcmp(buffer, wi->chrom))
-		wi->chrom = buffer;
-	else
-		free(buffer);
 }
 
-static int countWords(char * line) {
+static int countWords(char * line, char * end) {
 	int count = 0;
 	char * ptr;
 
 	if (line[0] != ' ' && line[0] != '\t')
 		count++;
 
-	for (ptr = line; *ptr; ptr++)
+	for (ptr = line; ptr < end; ptr++)
 		if (*ptr == ' ' || *ptr == '\t')
 			count++;
 
 	return count;
 }
 
-static void WiggleReaderPop(WiggleIterator * wi) {
-	WiggleReaderData * data = (WiggleReaderData*) wi->data;
-	char line[5000];
+static bool startsWith(char * line, char * end, const char * prefix) {
+	int length = strlen(prefix);
+	return end - line >= length && !strncmp(prefix, line, length);
+}
 
-	if (wi->done)
-		return;
+// Parses a line into the cursor, returns false if it holds no record
+static bool WiggleReaderReadLine(WiggleReaderData * data, char * line, char * end) {
+	WiggleIterator * wi = &data->cursor;
 
-	while (fgets(line, 5000, data->file)) {
-		if (line[0] == '#' || line[0] == EOF)
-			continue;
-		else if ( !strncmp("variableStep", line, 12)) {
-			data->readingMode = VARIABLE_STEP;
-			WiggleReaderReadHeader(wi, data, line);
-			continue;
-		} else if (!strncmp("fixedStep", line, 9)) {
-			data->readingMode = FIXED_STEP;
-			WiggleReaderReadHeader(wi, data, line);
+	if (line == end || line[0] == '#' || line[0] == EOF)
+		return false;
+	else if (startsWith(line, end, "variableStep")) {
+		data->readingMode = VARIABLE_STEP;
+		WiggleReaderReadHeaderLine(wi, data, line, end);
+		return false;
+	} else if (startsWith(line, end, "fixedStep")) {
+		data->readingMode = FIXED_STEP;
+		WiggleReaderReadHeaderLine(wi, data, line, end);
+		return false;
+	} 
+	
+	switch (countWords(line, end)) {
+	case 4:
+		data->readingMode = BED_GRAPH;
+		WiggleReaderReadBedGraphLine(wi, line, end);
+		break;
+	case 2:
+		if (data->readingMode != VARIABLE_STEP) {
+			fprintf(stderr, "Badly formatted fixed step line:\n%.*s\n", (int) (end - line), line);
+			raiseError();
+		}
+		WiggleReaderReadVariableStepLine(wi, line, end, data->span);
+		break;
+	case 1:
+		if (data->readingMode != FIXED_STEP) {
+			fprintf(stderr, "Badly formatted variable step line:\n%.*s\n", (int) (end - line), line);
+			raiseError();
+		}
+		WiggleReaderReadFixedStepLine(wi, line, end, data->step, data->span);
+		break;
+	default:
+		fprintf(stderr, "Badly formatted wiggle or bed graph line :\n%.*s\n", (int) (end - line), line);
+		raiseError();
+
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////
+// Parallel parsing
+//
+// A large uncompressed file is cut into chunks of a few megabytes, at line
+// breaks, which a few threads parse into columns of records while the 
+// reader goes through the chunks in order. A chunk does not know the
+// fixedStep or variableStep header above it, until the chunks before it
+// are read: the lines before its first header are parsed with relative
+// coordinates, and placed once the reader gets to the chunk.
+//////////////////////////////////////////////////////
+
+#define PARSE_CHUNK_SIZE (4 * 1024 * 1024)
+// Smaller files are parsed on the reader's thread
+#define MIN_PARALLEL_PARSE_SIZE (16 * PARSE_CHUNK_SIZE)
+// Files parsed in parallel at once, beyond that the readers run side by side
+#define MAX_PARALLEL_PARSES 4
+
+typedef struct wiggleChunk_st {
+	int index;
+	char * begin;
+	char * end;
+	bool ready;
+	bool failed;
+	int count;
+	int capacity;
+	char ** chroms;
+	int * starts;
+	int * finishes;
+	double * values;
+	// Lines before the first header or bedGraph line. Fixed step records
+	// hold their rank (1, 2, ...) as start, variable step records their own.
+	int leading;
+	enum readingMode leadingMode;
+	char * leadingLine;
+	char * leadingEnd;
+	// Whether the chunk has a header or bedGraph line, then the state of
+	// the parser after its last line
+	bool attached;
+	WiggleReaderData state;
+} WiggleChunk;
+
+struct parallelParse_st {
+	char * map;
+	char * mapEnd;
+	int chunkCount;
+	// Slot of chunk i is i % window. Chunks up to held + window - 1 can be
+	// parsed, held being the chunk read by the reader.
+	WiggleChunk * slots;
+	int window;
+	int nextChunk;
+	int held;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t * threads;
+	int threadCount;
+	// Reader side
+	WiggleChunk * current;
+	int record;
+	enum readingMode readingMode;
+	char * chrom;
+	int start;
+	int step;
+	int span;
+};
+
+static int parseThreads = 4;
+static int parallelParses = 0;
+static pthread_mutex_t parallelParsesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void setParseThreads(int threads) {
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of parsing threads: %i\n", threads);
+		raiseError();
+	}
+	parseThreads = threads;
+}
+
+// Chunks start after the first line break at or after their nominal offset
+static char * chunkStart(ParallelParse * parse, int index) {
+	char * ptr;
+
+	if (index == 0)
+		return parse->map;
+	if (index >= parse->chunkCount)
+		return parse->mapEnd;
+	ptr = parse->map + (size_t) index * PARSE_CHUNK_SIZE - 1;
+	ptr = memchr(ptr, '\n', parse->mapEnd - ptr);
+	return ptr ? ptr + 1 : parse->mapEnd;
+}
+
+static void pushChunkRecord(WiggleChunk * chunk, char * chrom, int start, int finish, double value) {
+	if (chunk->count == chunk->capacity) {
+		chunk->capacity = chunk->capacity ? 2 * chunk->capacity : 1024;
+		chunk->chroms = (char **) realloc(chunk->chroms, chunk->capacity * sizeof(char *));
+		chunk->starts = (int *) realloc(chunk->starts, chunk->capacity * sizeof(int));
+		chunk->finishes = (int *) realloc(chunk->finishes, chunk->capacity * sizeof(int));
+		chunk->values = (double *) realloc(chunk->values, chunk->capacity * sizeof(double));
+	}
+	chunk->chroms[chunk->count] = chrom;
+	chunk->starts[chunk->count] = start;
+	chunk->finishes[chunk->count] = finish;
+	chunk->values[chunk->count] = value;
+	chunk->count++;
+}
+
+// Data line above any header of the chunk
+static void readLeadingLine(WiggleChunk * chunk, char * line, char * end, int words) {
+	enum readingMode mode = words == 1 ? FIXED_STEP : VARIABLE_STEP;
+	WiggleIterator record;
+
+	if (chunk->leading == 0) {
+		chunk->leadingMode = mode;
+		chunk->leadingLine = line;
+		chunk->leadingEnd = end;
+	} else if (mode != chunk->leadingMode) {
+		fprintf(stderr, "Badly formatted %s step line:\n%.*s\n", mode == FIXED_STEP ? "variable" : "fixed", (int) (end - line), line);
+		raiseError();
+	}
+
+	record.start = chunk->leading;
+	if (mode == FIXED_STEP)
+		WiggleReaderReadFixedStepLine(&record, line, end, 1, 0);
+	else
+		WiggleReaderReadVariableStepLine(&record, line, end, 0);
+	pushChunkRecord(chunk, NULL, record.start, record.finish, record.value);
+	chunk->leading++;
+}
+
+static void parseChunk(void * args) {
+	WiggleChunk * chunk = (WiggleChunk *) args;
+	WiggleReaderData * state = &chunk->state;
+	WiggleIterator * cursor = &state->cursor;
+	char * line, * end;
+	int words;
+
+	memset(state, 0, sizeof(WiggleReaderData));
+	state->readingMode = BED_GRAPH;
+	cursor->chrom = internChromosome("");
+
+	for (line = chunk->begin; line < chunk->end; line = end + 1) {
+		if (!(end = memchr(line, '\n', chunk->end - line)))
+			end = chunk->end;
+		if (!chunk->attached && line != end && line[0] != '#' && line[0] != EOF && !startsWith(line, end, "variableStep") && !startsWith(line, end, "fixedStep") && ((words = countWords(line, end)) == 1 || words == 2)) {
+			readLeadingLine(chunk, line, end, words);
 			continue;
-		} 
-		
-		switch (countWords(line)) {
-		case 4:
-			data->readingMode = BED_GRAPH;
-			WiggleReaderReadBedGraphLine(wi, line);
-			break;
-		case 2:
-			if (data->readingMode != VARIABLE_STEP) {
-				fprintf(stderr, "Badly formatted fixed step line:\n%s", line);
-				exit(1);
-			}
-			WiggleReaderReadVariableStepLine(wi, line,data->span);
-			break;
-		case 1:
-			if (data->readingMode != FIXED_STEP) {
-				fprintf(stderr, "Badly formatted variable step line:\n%s", line);
-				exit(1);
-			}
-			WiggleReaderReadFixedStepLine(wi, line, data->step, data->span);
+		}
+		if (line != end && line[0] != '#' && line[0] != EOF)
+			chunk->attached = true;
+		if (WiggleReaderReadLine(state, line, end))
+			pushChunkRecord(chunk, cursor->chrom, cursor->start, cursor->finish, cursor->value);
+	}
+}
+
+static void * runParseThread(void * args) {
+	ParallelParse * parse = (ParallelParse *) args;
+
+	// Parse errors are raised again by the reader, when it gets to the chunk
+	pthread_mutex_lock(&parse->lock);
+	while (true) {
+		while (!parse->stop && parse->nextChunk < parse->chunkCount && parse->nextChunk >= parse->held + parse->window)
+			pthread_cond_wait(&parse->cond, &parse->lock);
+		if (parse->stop || parse->nextChunk >= parse->chunkCount)
 			break;
-		default:
-			fprintf(stderr, "Badly formatted wiggle or bed graph line :\n%s", line);
-			exit(1);
 
+		int index = parse->nextChunk++;
+		WiggleChunk * chunk = parse->slots + index % parse->window;
+		pthread_mutex_unlock(&parse->lock);
+
+		chunk->index = index;
+		chunk->count = 0;
+		chunk->leading = 0;
+		chunk->attached = false;
+		chunk->begin = chunkStart(parse, index);
+		chunk->end = chunkStart(parse, index + 1);
+		bool failed = !catchErrors(&parseChunk, chunk);
+
+		pthread_mutex_lock(&parse->lock);
+		chunk->failed = failed;
+		chunk->ready = true;
+		pthread_cond_broadcast(&parse->cond);
+	}
+	pthread_mutex_unlock(&parse->lock);
+	return NULL;
+}
+
+static void endParallelParse(WiggleReaderData * data) {
+	ParallelParse * parse = data->parallel;
+	int i;
+
+	pthread_mutex_lock(&parse->lock);
+	parse->stop = true;
+	pthread_cond_broadcast(&parse->cond);
+	pthread_mutex_unlock(&parse->lock);
+	for (i = 0; i < parse->threadCount; i++)
+		pthread_join(parse->threads[i], NULL);
+
+	for (i = 0; i < parse->window; i++) {
+		free(parse->slots[i].chroms);
+		free(parse->slots[i].starts);
+		free(parse->slots[i].finishes);
+		free(parse->slots[i].values);
+	}
+	free(parse->slots);
+	free(parse->threads);
+	pthread_mutex_destroy(&parse->lock);
+	pthread_cond_destroy(&parse->cond);
+	free(parse);
+	data->parallel = NULL;
+
+	pthread_mutex_lock(&parallelParsesMutex);
+	parallelParses--;
+	pthread_mutex_unlock(&parallelParsesMutex);
+}
+
+// Lines before the first header of the chunk follow the header above
+static void placeLeadingRecords(ParallelParse * parse, WiggleChunk * chunk) {
+	int i;
+
+	if (chunk->leading && chunk->leadingMode != parse->readingMode) {
+		fprintf(stderr, "Badly formatted %s step line:\n%.*s\n", chunk->leadingMode == FIXED_STEP ? "variable" : "fixed", (int) (chunk->leadingEnd - chunk->leadingLine), chunk->leadingLine);
+		raiseError();
+	}
+
+	for (i = 0; i < chunk->leading; i++) {
+		chunk->chroms[i] = parse->chrom;
+		if (parse->readingMode == FIXED_STEP)
+			chunk->starts[i] = parse->start + chunk->starts[i] * parse->step;
+		chunk->finishes[i] = chunk->starts[i] + parse->span;
+	}
+
+	if (chunk->attached) {
+		parse->readingMode = chunk->state.readingMode;
+		parse->chrom = chunk->state.cursor.chrom;
+		parse->start = chunk->state.cursor.start;
+		parse->step = chunk->state.step;
+		parse->span = chunk->state.span;
+	} else if (parse->readingMode == FIXED_STEP)
+		parse->start += chunk->leading * parse->step;
+}
+
+// Returns false once all the chunks are read
+static bool nextParsedChunk(ParallelParse * parse) {
+	WiggleChunk * chunk;
+
+	pthread_mutex_lock(&parse->lock);
+	if (parse->current) {
+		parse->current->ready = false;
+		parse->current = NULL;
+		parse->held++;
+		pthread_cond_broadcast(&parse->cond);
+	}
+	if (parse->held == parse->chunkCount) {
+		pthread_mutex_unlock(&parse->lock);
+		return false;
+	}
+	chunk = parse->slots + parse->held % parse->window;
+	while (!chunk->ready || chunk->index != parse->held)
+		pthread_cond_wait(&parse->cond, &parse->lock);
+	pthread_mutex_unlock(&parse->lock);
+
+	if (chunk->failed)
+		raiseError();
+	countProfileBytes(chunk->end - chunk->begin);
+	placeLeadingRecords(parse, chunk);
+	parse->current = chunk;
+	parse->record = 0;
+	return true;
+}
+
+static void ParallelParseAdvance(WiggleReaderData * data) {
+	ParallelParse * parse = data->parallel;
+	WiggleIterator * wi = &data->cursor;
+
+	while (!parse->current || parse->record == parse->current->count) {
+		if (!nextParsedChunk(parse)) {
+			endParallelParse(data);
+			data->finished = true;
+			wi->done = true;
+			return;
 		}
+	}
 
-		if (data->stop > 0) {
-			if (wi->start >= data->stop) {
-				wi->done = true;
-				return;
-			} else if (wi->finish > data->stop) {
-				wi->finish = data->stop;
-			}
+	wi->chrom = parse->current->chroms[parse->record];
+	wi->start = parse->current->starts[parse->record];
+	wi->finish = parse->current->finishes[parse->record];
+	wi->value = parse->current->values[parse->record];
+	parse->record++;
+}
+
+// Returns false if the file is too small, not mapped, or enough files are
+// already parsed in parallel
+static bool startParallelParse(WiggleReaderData * data) {
+	ParallelParse * parse;
+	char * map, * mapEnd;
+	int i;
+
+	if (parseThreads < 2 || !(map = mappedLines(data->reader, &mapEnd)) || mapEnd - map < MIN_PARALLEL_PARSE_SIZE)
+		return false;
+
+	pthread_mutex_lock(&parallelParsesMutex);
+	if (parallelParses == MAX_PARALLEL_PARSES) {
+		pthread_mutex_unlock(&parallelParsesMutex);
+		return false;
+	}
+	parallelParses++;
+	pthread_mutex_unlock(&parallelParsesMutex);
+
+	parse = (ParallelParse *) calloc(1, sizeof(ParallelParse));
+	parse->map = map;
+	parse->mapEnd = mapEnd;
+	parse->chunkCount = (mapEnd - map + PARSE_CHUNK_SIZE - 1) / PARSE_CHUNK_SIZE;
+	parse->threadCount = parseThreads;
+	parse->window = 2 * parseThreads;
+	parse->slots = (WiggleChunk *) calloc(parse->window, sizeof(WiggleChunk));
+	parse->threads = (pthread_t *) calloc(parse->threadCount, sizeof(pthread_t));
+	parse->readingMode = BED_GRAPH;
+	parse->chrom = internChromosome("");
+	pthread_mutex_init(&parse->lock, NULL);
+	pthread_cond_init(&parse->cond, NULL);
+	data->parallel = parse;
+
+	for (i = 0; i < parse->threadCount; i++) {
+		if (pthread_create(parse->threads + i, NULL, &runParseThread, parse)) {
+			fprintf(stderr, "Could not create parsing thread\n");
+			raiseError();
 		}
+	}
+	return true;
+}
 
-		return;
+// Parses the next record into the cursor
+static void WiggleReaderAdvance(WiggleReaderData * data) {
+	WiggleIterator * wi = &data->cursor;
+	char * line, * end;
 
+	if (wi->done)
+		return;
+	if (data->parallel) {
+		ParallelParseAdvance(data);
+		return;
 	}
-	fclose(data->file);
-	data->file = NULL;
+
+	while ((line = readNextLine(data->reader, &end)))
+		if (WiggleReaderReadLine(data, line, end))
+			return;
+
+	data->finished = true;
 	wi->done = true;
 }
 
+static bool extendsRecord(WiggleIterator * cursor, char * chrom, int finish, double value) {
+	return cursor->chrom == chrom && cursor->start == finish && ((isnan(cursor->value) && isnan(value)) || cursor->value == value);
+}
+
+// Records past the end of the region seeked are left in the cursor
+static bool pastStop(WiggleReaderData * data, WiggleIterator * cursor) {
+	if (data->stop <= 0)
+		return false;
+	int cmp = compareChroms(cursor->chrom, data->chrom);
+	return cmp > 0 || (cmp == 0 && cursor->start >= data->stop);
+}
+
+// Adjacent records with the same value are merged as they are read, 
+// so the reader needs no compression operator on top
+static void WiggleReaderPop(WiggleIterator * wi) {
+	WiggleReaderData * data = (WiggleReaderData*) wi->data;
+	WiggleIterator * cursor = &data->cursor;
+	WiggleIterator * record = &data->record;
+
+	if (cursor->done || pastStop(data, cursor)) {
+		wi->done = true;
+		return;
+	}
+
+	record->chrom = cursor->chrom;
+	record->start = cursor->start;
+	record->finish = cursor->finish;
+	record->value = cursor->value;
+	WiggleReaderAdvance(data);
+
+	while (!cursor->done && !pastStop(data, cursor) && extendsRecord(cursor, record->chrom, record->finish, record->value)) {
+		record->finish = cursor->finish;
+		WiggleReaderAdvance(data);
+	}
+
+	wi->chrom = record->chrom;
+	wi->start = record->start;
+	wi->finish = record->finish;
+	wi->value = record->value;
+	if (data->stop > 0 && wi->finish > data->stop)
+		wi->finish = data->stop;
+}
+
+// The records are merged straight into the batch. The last one may still 
+// extend over the next lines, so it goes back to being the current record.
+// Within a region, the records go through WiggleReaderPop to be clipped.
+static void WiggleReaderPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	WiggleReaderData * data = (WiggleReaderData*) wi->data;
+	WiggleIterator * cursor = &data->cursor;
+	WiggleIterator * record = &data->record;
+	int last = batch->count;
+
+	if (data->stop > 0) {
+		while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+			pushSpanBatch(batch, wi);
+			WiggleReaderPop(wi);
+		}
+		return;
+	}
+
+	pushSpanBatch(batch, wi);
+	while (!cursor->done) {
+		if (extendsRecord(cursor, batch->chroms[last], batch->finishes[last], batch->values[last]))
+			batch->finishes[last] = cursor->finish;
+		else if (batch->count == SPAN_BATCH_SIZE)
+			break;
+		else
+			pushSpanBatch(batch, cursor);
+		last = batch->count - 1;
+		WiggleReaderAdvance(data);
+	}
+
+	if (cursor->done) {
+		wi->done = true;
+		return;
+	}
+
+	batch->count = last;
+	wi->chrom = record->chrom = batch->chroms[last];
+	wi->start = record->start = batch->starts[last];
+	wi->finish = record->finish = batch->finishes[last];
+	wi->value = record->value = batch->values[last];
+}
+
+//////////////////////////////////////////////////////
+// Seeks
+//
+// Plain files are indexed on their first seek, see
+// offsetIndex.h. Each entry keeps the reading mode,
+// step, span and position of the cursor before its
+// line, so that fixedStep and variableStep lines are
+// parsed as if the header above them had just been read.
+//////////////////////////////////////////////////////
+
+static void WiggleReaderIndexLines(OffsetIndex * index, char * lines, char * end) {
+	WiggleReaderData * data = (WiggleReaderData *) calloc(1, sizeof(WiggleReaderData));
+	WiggleIterator * cursor = &data->cursor;
+	char * line, * next;
+	int context[OFFSET_INDEX_CONTEXT] = {0};
+
+	data->readingMode = BED_GRAPH;
+	cursor->chrom = internChromosome("");
+	for (line = lines; line < end; line = next + 1) {
+		if (!(next = memchr(line, '\n', end - line)))
+			next = end;
+		context[0] = data->readingMode;
+		context[1] = data->step;
+		context[2] = data->span;
+		context[3] = cursor->start;
+		if (WiggleReaderReadLine(data, line, next))
+			indexRecord(index, line - lines, cursor->chrom, cursor->finish, context);
+	}
+	free(data);
+}
+
+// Moves the reader to the indexed line closest above the region, when it is 
+// behind the reader or too far ahead of it. Returns false if it did not move. 
+static bool WiggleReaderJump(WiggleReaderData * data, const char * chrom, int start, bool backwards) {
+	WiggleIterator * cursor = &data->cursor;
+	WiggleIterator * record = &data->record;
+	OffsetIndexEntry * entry;
+	char * lines, * end;
+
+	if (!data->index && (lines = mappedLines(data->reader, &end)))
+		data->index = getOffsetIndex(data->filename, lines, end, &WiggleReaderIndexLines);
+	if (!data->index || !(entry = findOffsetIndexEntry(data->index, chrom, start)))
+		return false;
+	if (!backwards && entry->offset <= lineReaderOffset(data->reader))
+		return false;
+	if (!jumpLineReader(data->reader, entry->offset))
+		return false;
+
+	data->finished = false;
+	data->readingMode = entry->context[0];
+	data->step = entry->context[1];
+	data->span = entry->context[2];
+	cursor->chrom = (char *) entry->chrom;
+	cursor->start = entry->context[3];
+	cursor->done = false;
+	WiggleReaderAdvance(data);
+	// Records above the line are unknown, seeks before its first one go back
+	record->chrom = cursor->chrom;
+	record->start = record->finish = cursor->start;
+	return true;
+}
+
 void WiggleReaderSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	WiggleReaderData * data = (WiggleReaderData*) wi->data;
+	WiggleIterator * cursor = &data->cursor;
+	WiggleIterator * record = &data->record;
+	bool backwards = data->finished || compareChroms(chrom, record->chrom) < 0 || (compareChroms(chrom, record->chrom) == 0 && start < record->start);
+	bool restart = false;
 
 	data->stop = finish;
 	data->chrom = chrom;
 
-	if (!data->file || strcmp(chrom, wi->chrom) < 0 || (strcmp(chrom, wi->chrom) == 0 && start < wi->start)) {
-		if (data->file)
-			fclose(data->file);
-		if (!(data->file = fopen(data->filename, "r"))) {
-			fprintf(stderr, "Cannot open input file %s\n", data->filename);
-			exit(1);
+	wi->done = false;
+	if (data->parallel) {
+		// The line reader was left at the start of the file
+		endParallelParse(data);
+		restart = !WiggleReaderJump(data, chrom, start, true);
+	} else if (seekLineReader(data->reader, chrom, start, finish)) {
+		// Only bedGraphs can be indexed
+		data->readingMode = BED_GRAPH;
+		restart = true;
+	} else if (!backwards && compareChroms(chrom, record->chrom) == 0 && record->finish > start) {
+		// The last record popped reaches into the region
+		wi->chrom = record->chrom;
+		wi->start = record->start < start ? start : record->start;
+		wi->finish = record->finish > finish ? finish : record->finish;
+		wi->value = record->value;
+		return;
+	} else if (!WiggleReaderJump(data, chrom, start, backwards) && backwards) {
+		if (!rewindLineReader(data->reader)) {
+			fprintf(stderr, "Cannot rewind input file %s\n", data->filename);
+			raiseError();
 		}
-		wi->done = false;
-		pop(wi);
+		restart = true;
 	}
 
-	while (!wi->done && (strcmp(wi->chrom, chrom) < 0 || (strcmp(wi->chrom, chrom) == 0 && wi->finish <= start)))
-		pop(wi);
+	if (restart) {
+		data->finished = false;
+		cursor->chrom = internChromosome("");
+		cursor->start = 0;
+		cursor->done = false;
+		record->chrom = cursor->chrom;
+		record->start = record->finish = 0;
+		WiggleReaderAdvance(data);
+	}
 
-	if (!wi->done && strcmp(chrom, wi->chrom) == 0 && wi->start < start)
+	// The records skipped still count as read, for the next seek to tell if it goes backwards
+	while (!cursor->done && (compareChroms(cursor->chrom, chrom) < 0 || (compareChroms(cursor->chrom, chrom) == 0 && cursor->finish <= start))) {
+		record->chrom = cursor->chrom;
+		record->start = cursor->start;
+		record->finish = cursor->finish;
+		record->value = cursor->value;
+		WiggleReaderAdvance(data);
+	}
+
+	WiggleReaderPop(wi);
+	if (!wi->done && compareChroms(chrom, wi->chrom) == 0 && wi->start < start)
 		wi->start = start;
 }
 
-WiggleIterator * WiggleReader(char * f) {
+static WiggleIterator * newWiggleReader(char * f, bool parallel) {
 	WiggleReaderData * data = (WiggleReaderData *) calloc(1, sizeof(WiggleReaderData));
 	data->filename = f;
-	if (strcmp(f, "-")) {
-		if (!(data->file = fopen(f, "r"))) {
-			fprintf(stderr, "Could not open input file %s\n", f);
-			exit(1);
-		}
-	} else
-		data->file = stdin;
+	if (!(data->reader = newLineReader(f))) {
+		fprintf(stderr, "Could not open input file %s\n", f);
+		raiseError();
+	}
 	data->readingMode = BED_GRAPH;
 	data->stop = -1;
-	return CompressionWiggleIterator(newWiggleIterator(data, &WiggleReaderPop, &WiggleReaderSeek, 0));
+	data->cursor.chrom = internChromosome("");
+	data->record.chrom = data->cursor.chrom;
+	if (parallel)
+		startParallelParse(data);
+	WiggleReaderAdvance(data);
+	WiggleIterator * new = newWiggleIterator(data, &WiggleReaderPop, &WiggleReaderSeek, 0);
+	new->popBatch = &WiggleReaderPopBatch;
+	new->compressed = true;
+	new->seekCost = readerSeekCost(f, lineReaderJumps(data->reader));
+	return new;
 }	
+
+WiggleIterator * WiggleReader(char * f) {
+	return newWiggleReader(f, false);
+}
+
+WiggleIterator * ParallelWiggleReader(char * f) {
+	return newWiggleReader(f, true);
+}
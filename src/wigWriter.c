@@ -17,9 +17,21 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <limits.h>
+#include <math.h>
 
 // Local header
 #include "wiggleIterator.h"
+#include "bigWigWriter.h"
+#include "integerTrack.h"
+#include "textBuffer.h"
+#include "bgzfWriter.h"
+#include "pool.h"
+#include "packedRecords.h"
+#include "memoryUsage.h"
+#include "pasteIndex.h"
+#include "outputQueue.h"
+#include "tracer.h"
 
 //////////////////////////////////////////////////////
 // Tee operator
@@ -32,38 +44,261 @@ typedef struct BlockData_st {
 	char * chroms[BLOCK_LENGTH];
 	int starts[BLOCK_LENGTH];
 	int finishes[BLOCK_LENGTH];
-	double values[BLOCK_LENGTH];
+	StoredValue values[BLOCK_LENGTH];
 	int count;
 	bool bedGraph;
-	struct BlockData_st * next;
+	// Width of the records written as fixedStep lines, see WiggleIterator
+	int step;
+	// The values are written without decimals, see WiggleIterator
+	bool integral;
 } BlockData;
 
+// Blocks wait for the writer with their records packed, see packedRecords.h,
+// and each writer thread unpacks them into a BlockData of its own to print them
+typedef struct packedBlock_st {
+	unsigned char bytes[BLOCK_LENGTH * PACKED_RECORD_BYTES + MAX_PACKED_RECORD_SIZE];
+	PackedCursor cursor;
+	int count;
+	bool bedGraph;
+	int step;
+	bool integral;
+} PackedBlock;
+
+static __thread BlockData * unpackedBlock = NULL;
+
 typedef struct TeeWiggleIteratorData_st {
 	FILE * infile;
 	FILE * outfile;
+	BgzfWriter * bgzf;
 	WiggleIterator * iter;
-	BlockData * dataBlocks;
-	BlockData * lastBlock;
-	int count;
-	pthread_t threadID;
-	pthread_mutex_t continue_mutex;
-	pthread_cond_t continue_cond;
-	bool done;
+	// Block being filled
+	PackedBlock * lastBlock;
+	// Blocks are released by the writer thread and recycled by the reader
+	Pool * blockPool;
+	// Blocks the writer may lag behind, fewer if the memory budget is tight
+	int maxOutBlocks;
+	OutputSink * sink;
+	// Set between the launch of the writer and the end of the records
+	bool writing;
 	bool bedGraph;
 } TeeWiggleIteratorData;
 
-static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
+static PackedBlock * newBlock(TeeWiggleIteratorData * data) {
+	PackedBlock * block = (PackedBlock *) poolAllocate(data->blockPool);
+	countMemory(MEMORY_WRITERS, sizeof(PackedBlock));
+	startPackedCursor(&block->cursor, block->bytes);
+	block->count = 0;
+	block->bedGraph = data->bedGraph;
+	block->step = data->iter->step;
+	block->integral = data->iter->integral;
+	return block;
+}
+
+// Counts larger than an int fall back to decimals
+static bool isPrintedAsInt(BlockData * block, double value) {
+	return block->integral && fabs(value) <= INT_MAX;
+}
+
+static void writeValue(TextBuffer * out, BlockData * block, double value) {
+	if (isPrintedAsInt(block, value))
+		writeInt(out, (int) value);
+	else
+		writeDouble(out, value);
+}
+
+//////////////////////////////////////////////////////
+// Compact wiggle encoding
+//
+// With --compact_wig, each run of records is written
+// as whichever of bedGraph, variableStep or fixedStep
+// lines takes the fewest bytes. Every line ends with
+// the value, so only the headers and coordinates are
+// weighed.
+//////////////////////////////////////////////////////
+
+static bool compactWiggle = false;
+
+void setCompactWiggle(bool value) {
+	compactWiggle = value;
+}
+
+static int digitCount(int value) {
+	int count = 1;
+	long long power = 10;
+	long long remainder = value;
+	if (remainder < 0) {
+		remainder = -remainder;
+		count++;
+	}
+	for (; remainder >= power; power *= 10)
+		count++;
+	return count;
+}
+
+// Tabs included, but not the value
+static int bedGraphCost(BlockData * block, int index, int chromLength) {
+	return chromLength + digitCount(block->starts[index] - 1) + digitCount(block->finishes[index] - 1) + 3;
+}
+
+// "fixedStep chrom= start= step= span=\n"
+static int fixedStepHeaderCost(int chromLength, int start, int step, int span) {
+	return 36 + chromLength + digitCount(start) + digitCount(step) + digitCount(span);
+}
+
+// "variableStep chrom= span=\n"
+static int variableStepHeaderCost(int chromLength, int span) {
+	return 26 + chromLength + digitCount(span);
+}
+
+typedef struct compactRun_st {
+	enum {BEDGRAPH_RUN, VARIABLE_STEP_RUN, FIXED_STEP_RUN} mode;
+	int count, step, span;
+} CompactRun;
+
+// Whether record i can follow index in a variableStep run
+static bool continuesRun(BlockData * block, int index, int i) {
+	return block->chroms[i] == block->chroms[index] && block->finishes[i] - block->starts[i] == block->finishes[index] - block->starts[index] && block->starts[i] >= block->finishes[i - 1];
+}
+
+// Of the records from index on, those on the same chromosome with the same
+// span can be variableStep lines, the first of them at a constant step a 
+// fixedStep section. Past its header, a fixedStep line is cheaper than a 
+// variableStep line, so a fixedStep section worth its header is taken 
+// whatever follows it, and a variableStep run stops short of a stretch at
+// a constant step long enough to be worth its own fixedStep header.
+static void chooseCompactRun(BlockData * block, int index, int chromLength, CompactRun * run) {
+	int span = block->finishes[index] - block->starts[index];
+	int step = index + 1 < block->count ? block->starts[index + 1] - block->starts[index] : span;
+	int count = 1, streakStart = index, streakStep = step;
+	int fixedHeader = fixedStepHeaderCost(chromLength, block->starts[index], step, span);
+	int variableHeader = variableStepHeaderCost(chromLength, span);
+	long long bedGraphLines, variableLines, streakBedGraphLines = 0, streakVariableLines = 0;
+	long long fixedSavings, variableSavings;
+	int i;
+
+	bedGraphLines = bedGraphCost(block, index, chromLength);
+	variableLines = digitCount(block->starts[index]) + 1;
+	for (i = index + 1; i < block->count && continuesRun(block, index, i) && block->starts[i] - block->starts[i - 1] == step; i++) {
+		// Once the header is paid off, the rest of the section is only counted
+		if (bedGraphLines <= fixedHeader || variableLines + variableHeader < fixedHeader) {
+			bedGraphLines += bedGraphCost(block, i, chromLength);
+			variableLines += digitCount(block->starts[i]) + 1;
+		}
+		count++;
+	}
+	run->span = span;
+	run->step = count > 1 ? step : span;
+	fixedSavings = bedGraphLines - fixedStepHeaderCost(chromLength, block->starts[index], run->step, span);
+	variableSavings = bedGraphLines - variableLines - variableHeader;
+	if (fixedSavings > 0 && fixedSavings >= variableSavings) {
+		run->mode = FIXED_STEP_RUN;
+		run->count = count;
+		return;
+	}
+
+	for (; i < block->count && continuesRun(block, index, i); i++) {
+		int bedGraphLine = bedGraphCost(block, i, chromLength);
+		int variableLine = digitCount(block->starts[i]) + 1;
+		if (block->starts[i] - block->starts[i - 1] != streakStep) {
+			streakStart = i - 1;
+			streakStep = block->starts[i] - block->starts[i - 1];
+			streakBedGraphLines = bedGraphCost(block, i - 1, chromLength);
+			streakVariableLines = digitCount(block->starts[i - 1]) + 1;
+		} else if (streakStart > index && streakVariableLines + variableLine > fixedStepHeaderCost(chromLength, block->starts[streakStart], streakStep, span)) {
+			bedGraphLines -= streakBedGraphLines;
+			variableLines -= streakVariableLines;
+			count = streakStart - index;
+			break;
+		}
+		bedGraphLines += bedGraphLine;
+		variableLines += variableLine;
+		streakBedGraphLines += bedGraphLine;
+		streakVariableLines += variableLine;
+		count++;
+	}
+	variableSavings = bedGraphLines - variableLines - variableHeader;
+	if (variableSavings > 0) {
+		run->mode = VARIABLE_STEP_RUN;
+		run->count = count;
+	} else {
+		run->mode = BEDGRAPH_RUN;
+		run->count = 1;
+	}
+}
+
+static void printCompactBlock(TextBuffer * out, BlockData * block) {
+	CompactRun run;
+	char * chrom = NULL;
+	int chromLength = 0;
+	int i, j;
+
+	for (i = 0; i < block->count; i += run.count) {
+		if (block->chroms[i] != chrom) {
+			chrom = block->chroms[i];
+			chromLength = strlen(chrom);
+		}
+		chooseCompactRun(block, i, chromLength, &run);
+
+		if (run.mode == FIXED_STEP_RUN) {
+			writeString(out, "fixedStep chrom=");
+			writeString(out, chrom);
+			writeString(out, " start=");
+			writeInt(out, block->starts[i]);
+			writeString(out, " step=");
+			writeInt(out, run.step);
+			writeString(out, " span=");
+			writeInt(out, run.span);
+			writeChar(out, '\n');
+		} else if (run.mode == VARIABLE_STEP_RUN) {
+			writeString(out, "variableStep chrom=");
+			writeString(out, chrom);
+			writeString(out, " span=");
+			writeInt(out, run.span);
+			writeChar(out, '\n');
+		}
+
+		for (j = i; j < i + run.count; j++) {
+			if (run.mode == VARIABLE_STEP_RUN) {
+				writeInt(out, block->starts[j]);
+				writeChar(out, '\t');
+			} else if (run.mode == BEDGRAPH_RUN) {
+				// Careful bedgraph lines are 0 based
+				writeString(out, chrom);
+				writeChar(out, '\t');
+				writeInt(out, block->starts[j]-1);
+				writeChar(out, '\t');
+				writeInt(out, block->finishes[j]-1);
+				writeChar(out, '\t');
+			}
+			writeValue(out, block, block->values[j]);
+			writeChar(out, '\n');
+		}
+	}
+}
+
+static void printBlock(FILE * infile, FILE * outfile, BgzfWriter * bgzf, BlockData * block) {
 	int i, j;
 	bool pointByPoint = false;
 	bool makeHeader=false;
+	bool stepping = false, stepped;
 	char ** chromPtr = block->chroms;
 	int * startPtr = block->starts;
 	int * finishPtr = block->finishes;
-	double * valuePtr = block->values;
+	StoredValue * valuePtr = block->values;
 	char * lastChrom = NULL;
 	int lastFinish = -1;
 	char buffer[5000];
-
+	char number[MAX_NUMBER_LENGTH + 1];
+	int length;
+	TextBuffer * out = (TextBuffer *) malloc(sizeof(TextBuffer));
+
+	initTextBuffer(out, outfile, bgzf);
+	if (compactWiggle && !block->bedGraph && !infile) {
+		printCompactBlock(out, block);
+		flushTextBuffer(out);
+		free(out);
+		return;
+	}
 	for (i = 0; i < block->count; i++) {
 		// Change mode
 		if (!block->bedGraph && *finishPtr - *startPtr < 2 && !pointByPoint) {
@@ -73,27 +308,59 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 			pointByPoint = false;
 		}
 
-		if (pointByPoint) {
-			if (makeHeader || (pointByPoint && (lastChrom != *chromPtr || *startPtr > lastFinish)))
-				fprintf(outfile, "fixedStep chrom=%s start=%i step=1\n", *chromPtr, *startPtr);
+		// Regular bins, as many bases per line
+		stepped = !block->bedGraph && block->step > 1 && *finishPtr - *startPtr == block->step;
+
+		if (stepped) {
+			if (!stepping || lastChrom != *chromPtr || *startPtr != lastFinish) {
+				writeString(out, "fixedStep chrom=");
+				writeString(out, *chromPtr);
+				writeString(out, " start=");
+				writeInt(out, *startPtr);
+				writeString(out, " step=");
+				writeInt(out, block->step);
+				writeString(out, " span=");
+				writeInt(out, block->step);
+				writeChar(out, '\n');
+			}
+			writeValue(out, block, *valuePtr);
+			writeChar(out, '\n');
+		} else if (pointByPoint) {
+			if (makeHeader || stepping || (pointByPoint && (lastChrom != *chromPtr || *startPtr > lastFinish))) {
+				writeString(out, "fixedStep chrom=");
+				writeString(out, *chromPtr);
+				writeString(out, " start=");
+				writeInt(out, *startPtr);
+				writeString(out, " step=1\n");
+			}
 			makeHeader = false;
+			// Same value on every line, formatted once
+			length = isPrintedAsInt(block, *valuePtr) ? formatInt(number, (int) *valuePtr) : formatDouble(number, *valuePtr);
+			number[length++] = '\n';
 			for (j = 0; j < *finishPtr - *startPtr; j++)
-				fprintf(outfile, "%lf\n", *valuePtr);
-		} else if (!infile)
+				writeBytes(out, number, length);
+		} else if (!infile) {
 			// Careful bedgraph lines are 0 based
-			fprintf(outfile, "%s\t%i\t%i\t%lf\n", *chromPtr, *startPtr-1, *finishPtr-1, *valuePtr);
-		else {
+			writeString(out, *chromPtr);
+			writeChar(out, '\t');
+			writeInt(out, *startPtr-1);
+			writeChar(out, '\t');
+			writeInt(out, *finishPtr-1);
+			writeChar(out, '\t');
+			writeValue(out, block, *valuePtr);
+			writeChar(out, '\n');
+		} else {
 			// Read next line in infile
 			if (!fgets(buffer, 5000, infile)) {
 				fprintf(stderr, "Could not paste data to file lines, inconsistent number of lines.\n");
-				exit(1);
+				raiseError();
 			}
 
 			// Skip empty lines and metadata lines:
 			while (! (strlen(buffer) && strncmp(buffer, "track", 5) && strncmp(buffer, "browser", 7))) {
 				if (!fgets(buffer, 5000, infile)) {
 					fprintf(stderr, "Could not paste data to file lines, inconsistent number of lines.\n");
-					exit(1);
+					raiseError();
 				}
 			}
 
@@ -106,9 +373,13 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 					break;
 			}
 			// Print out
-			fprintf(outfile, "%s\t%lf\n", buffer, *valuePtr);
+			writeString(out, buffer);
+			writeChar(out, '\t');
+			writeValue(out, block, *valuePtr);
+			writeChar(out, '\n');
 		}
 
+		stepping = stepped;
 		lastChrom = *chromPtr;
 		lastFinish = *finishPtr;
 		chromPtr++;
@@ -116,49 +387,50 @@ static void printBlock(FILE * infile, FILE * outfile, BlockData * block) {
 		finishPtr++;
 		valuePtr++;
 	}
+	flushTextBuffer(out);
+	free(out);
 }
 
-static bool goToNextBlock(TeeWiggleIteratorData * data) {
-	BlockData * ptr = data->dataBlocks;
-	static int i = 0;
-	i++;
-
-	pthread_mutex_lock(&data->continue_mutex);
-	// Received kill signal
-	if (data->count < 0)
-		return true;
-
-	// Check that there is work left
-	data->count--;
-	if (data->count == 0 && !data->done) 
-		pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-	pthread_cond_signal(&data->continue_cond);
-	pthread_mutex_unlock(&data->continue_mutex);
-
-	// Step forward
-	data->dataBlocks = data->dataBlocks->next;
-	free(ptr);
-	return false;
+// Kept by the writer thread for all the blocks it prints
+static BlockData * unpackBlock(PackedBlock * block) {
+	PackedCursor cursor;
+	double value;
+	int i, strand;
+
+	if (!unpackedBlock) {
+		unpackedBlock = (BlockData *) malloc(sizeof(BlockData));
+		countMemory(MEMORY_WRITERS, sizeof(BlockData));
+	}
+	startPackedCursor(&cursor, block->bytes);
+	for (i = 0; i < block->count; i++) {
+		unpackRecord(&cursor, unpackedBlock->chroms + i, unpackedBlock->starts + i, unpackedBlock->finishes + i, &value, &strand);
+		unpackedBlock->values[i] = value;
+	}
+	unpackedBlock->count = block->count;
+	unpackedBlock->bedGraph = block->bedGraph;
+	unpackedBlock->step = block->step;
+	unpackedBlock->integral = block->integral;
+	return unpackedBlock;
 }
 
-static void * printToFile(void * args) {
+static void writeBlock(void * args, void * block) {
 	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) args;
+	printBlock(data->infile, data->outfile, data->bgzf, unpackBlock((PackedBlock *) block));
+}
 
-	// Wait for first block to arrive
-	pthread_mutex_lock(&data->continue_mutex);
-	if (data->count == 0 && !data->done) 
-		pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-	pthread_mutex_unlock(&data->continue_mutex);
-
-	if (data->count < 0)
-		return NULL;
+static void releaseBlock(void * args, void * block) {
+	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) args;
+	poolRelease(data->blockPool, block);
+	countMemory(MEMORY_WRITERS, -(long long) sizeof(PackedBlock));
+}
 
-	while(data->dataBlocks) {
-		printBlock(data->infile, data->outfile, data->dataBlocks);
-		if (goToNextBlock(data))
-			return NULL;
+static void writeRecord(TeeWiggleIteratorData * data, char * chrom, int start, int finish, double value) {
+	PackedBlock * block = data->lastBlock;
+	packRecord(&block->cursor, chrom, start, finish, value, 0);
+	if (++block->count >= BLOCK_LENGTH || block->cursor.ptr - block->bytes > BLOCK_LENGTH * PACKED_RECORD_BYTES) {
+		queueOutputBlock(data->sink, data->lastBlock);
+		data->lastBlock = newBlock(data);
 	}
-	return NULL;
 }
 
 void TeeWiggleIteratorPop(WiggleIterator * wi) {
@@ -170,114 +442,114 @@ void TeeWiggleIteratorPop(WiggleIterator * wi) {
 		wi->finish = iter->finish;
 		wi->value = iter->value;
 
-		if (data->threadID) {
-			int index = data->lastBlock->count;
-			data->lastBlock->chroms[index] =  iter->chrom;
-			data->lastBlock->starts[index] =  iter->start;
-			data->lastBlock->finishes[index] =  iter->finish;
-			data->lastBlock->values[index] =  iter->value;
-			if (++data->lastBlock->count >= BLOCK_LENGTH) {
-				// Communications
-				pthread_mutex_lock(&data->continue_mutex);
-				data->count++;
-				pthread_cond_signal(&data->continue_cond);
-				if (data->count > MAX_OUT_BLOCKS)
-					pthread_cond_wait(&data->continue_cond, &data->continue_mutex);
-				pthread_mutex_unlock(&data->continue_mutex);
-
-				data->lastBlock->next = (BlockData*) calloc(1, sizeof(BlockData));
-				data->lastBlock = data->lastBlock->next;
-				data->lastBlock->bedGraph = data->bedGraph;
-			}
-		}
+		if (data->writing)
+			writeRecord(data, iter->chrom, iter->start, iter->finish, iter->value);
 		pop(iter);
-	} else if (data->threadID) {
-		pthread_mutex_lock(&data->continue_mutex);
-		data->count++;
-		data->done = true;
-		pthread_cond_signal(&data->continue_cond);
-		pthread_mutex_unlock(&data->continue_mutex);
+	} else if (data->writing) {
+		queueOutputBlock(data->sink, data->lastBlock);
+		data->lastBlock = NULL;
 		wi->done = true;
-		pthread_join(data->threadID, NULL);
+		finishOutputSink(data->sink);
+		// No writer left for a later seek to kill
+		data->writing = false;
+		if (data->bgzf)
+			finishBgzfWriter(data->bgzf);
 	}
 }
 
+// The current record was written when popped, the records read from the source are written in one go
+static void TeeWiggleIteratorPopBatch(WiggleIterator * wi, SpanBatch * batch) {
+	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) wi->data;
+	int index;
+
+	pushSpanBatch(batch, wi);
+	index = batch->count;
+	popBatch(data->iter, batch);
+	if (data->writing)
+		for (; index < batch->count; index++)
+			writeRecord(data, batch->chroms[index], batch->starts[index], batch->finishes[index], batch->values[index]);
+	pop(wi);
+}
+
+static void initBlockPool(TeeWiggleIteratorData * data) {
+	data->maxOutBlocks = memoryFits((MAX_OUT_BLOCKS + 2) * sizeof(PackedBlock)) ? MAX_OUT_BLOCKS : 1;
+	data->blockPool = newPool(sizeof(PackedBlock), data->maxOutBlocks + 2);
+	data->sink = newOutputSink(data, &writeBlock, &releaseBlock, data->maxOutBlocks);
+}
+
+// The blocks are written by the shared writer threads, see outputQueue.h
 static void launchWriter(TeeWiggleIteratorData * data) {
-	// Initialize variables
-	data->count = 0;
-	data->done = false;
-	pthread_cond_init(&data->continue_cond, NULL);
-	pthread_mutex_init(&data->continue_mutex, NULL);
-	data->dataBlocks = data->lastBlock = (BlockData*) calloc(1, sizeof(BlockData));
-	data->lastBlock->bedGraph = data->bedGraph;
-
-	// Launch pthread
-	int err = pthread_create(&data->threadID, NULL, &printToFile, data);
-	if (err) {
-		fprintf(stderr, "Could not create new thread %i\n", err);
-		exit(1);
-	}
+	data->lastBlock = newBlock(data);
+	data->writing = true;
 }
 
 static void killWriter(TeeWiggleIteratorData * data) {
-	BlockData * block;
-	
-	if (!data->threadID)
+	if (!data->writing)
 		return;
 
-	// Set trap
-	pthread_mutex_lock(&data->continue_mutex);
-	data->count = -1;
-	pthread_cond_signal(&data->continue_cond);
-	pthread_mutex_unlock(&data->continue_mutex);
-
-	// Wait for the catch
-	pthread_join(data->threadID, NULL);
-
-	// Clear variables
-	pthread_cond_destroy(&data->continue_cond);
-	pthread_mutex_destroy(&data->continue_mutex);
-
-	while (data->dataBlocks) {
-		block = data->dataBlocks;
-		data->dataBlocks = block->next;
-		free(block);
-	}
-
-	data->dataBlocks = NULL;
+	cancelOutputSink(data->sink);
+	releaseBlock(data, data->lastBlock);
 	data->lastBlock = NULL;
+	data->writing = false;
 }
 
 void TeeWiggleIteratorSeek(WiggleIterator * wi, const char * chrom, int start, int finish) {
 	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) wi->data;
 	killWriter(data);
-	fflush(data->outfile);
+	if (data->outfile)
+		fflush(data->outfile);
 	seek(data->iter, chrom, start, finish);
+	if (data->infile)
+		seekPasteFile(data->infile, chrom, start);
 	wi->done = false;
 	launchWriter(data);
 	pop(wi);
 }
 
-WiggleIterator * TeeWiggleIterator(WiggleIterator * i, FILE * outfile, bool bedGraph, bool holdFire) {
+static WiggleIterator * newTeeWiggleIterator(WiggleIterator * i, FILE * outfile, char * filename, bool bedGraph, bool holdFire) {
 	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) calloc(1, sizeof(TeeWiggleIteratorData));
 	data->iter = CompressionWiggleIterator(i);
-	data->outfile = outfile;
+	initBlockPool(data);
 	if (bedGraph || i->overlaps)
 		data->bedGraph = true;
+	// Only pure BedGraph can be tabix indexed
+	if (filename)
+		data->bgzf = openBgzfWriter(outfile, filename, data->bedGraph);
+	else
+		data->outfile = outfile;
 	// Hold fire means that you wait for the first seek before doing any writing
 	if (!holdFire)
 		launchWriter(data);
 
-	return newWiggleIterator(data, &TeeWiggleIteratorPop, &TeeWiggleIteratorSeek, i->default_value);
+	WiggleIterator * new = newWiggleIterator(data, &TeeWiggleIteratorPop, &TeeWiggleIteratorSeek, i->default_value);
+	new->popBatch = &TeeWiggleIteratorPopBatch;
+	new->finite = i->finite;
+	new->integral = i->integral;
+	return new;
+}
+
+WiggleIterator * TeeWiggleIterator(WiggleIterator * i, FILE * outfile, bool bedGraph, bool holdFire) {
+	return newTeeWiggleIterator(i, outfile, NULL, bedGraph, holdFire);
+}
+
+WiggleIterator * BgzfTeeWiggleIterator(WiggleIterator * i, FILE * outfile, char * filename, bool bedGraph, bool holdFire) {
+	return newTeeWiggleIterator(i, outfile, filename, bedGraph, holdFire);
 }
 
 void toFile(WiggleIterator * wi, char * filename, bool bedGraph, bool holdFire) {
 	FILE * file = fopen(filename, "w");
 	if (!file) {
 		fprintf(stderr, "Could not open file %s\n", filename);
-		exit(1);
+		raiseError();
 	}
-	runWiggleIterator(TeeWiggleIterator(wi, file, bedGraph, holdFire));
+	if (isBigWigFilename(filename))
+		runWiggleIterator(BigWigTeeWiggleIterator(wi, file));
+	else if (isIntegerTrackFilename(filename))
+		runWiggleIterator(IntegerTrackTeeWiggleIterator(wi, file));
+	else if (isBgzfFilename(filename))
+		runWiggleIterator(BgzfTeeWiggleIterator(wi, file, filename, bedGraph, holdFire));
+	else
+		runWiggleIterator(TeeWiggleIterator(wi, file, bedGraph, holdFire));
 }
 
 void toStdout(WiggleIterator * wi, bool bedGraph, bool holdFire) {
@@ -291,6 +563,7 @@ void toStdout(WiggleIterator * wi, bool bedGraph, bool holdFire) {
 WiggleIterator * PasteWiggleIterator(WiggleIterator * i, FILE * infile, FILE * outfile, bool holdFire) {
 	TeeWiggleIteratorData * data = (TeeWiggleIteratorData *) calloc(1, sizeof(TeeWiggleIteratorData));
 	data->iter = i;
+	initBlockPool(data);
 	data->infile = infile;
 	data->bedGraph = true;
 	data->outfile = outfile;
@@ -298,5 +571,9 @@ WiggleIterator * PasteWiggleIterator(WiggleIterator * i, FILE * infile, FILE * o
 	if (!holdFire)
 		launchWriter(data);
 
-	return newWiggleIterator(data, &TeeWiggleIteratorPop, NULL, i->default_value);
+	WiggleIterator * new = newWiggleIterator(data, &TeeWiggleIteratorPop, &TeeWiggleIteratorSeek, i->default_value);
+	new->popBatch = &TeeWiggleIteratorPopBatch;
+	new->finite = i->finite;
+	new->integral = i->integral;
+	return new;
 }
@@ -14,42 +14,227 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
 #include "wiggleIterator.h"
+#include "profiler.h"
+#include "tracer.h"
+
+//////////////////////////////////////////////////////
+// Arena
+//
+// Iterators are carved out of slabs, one slab per thread
+// at a time, in the order they are created. The parser
+// builds each operator right after its inputs, so the
+// iterators of a program lie next to each other in memory.
+// Each slot starts on a cache line, which then holds the
+// fields read at every record. Freed slots are reused by
+// the thread which frees them.
+//////////////////////////////////////////////////////
+
+#define CACHE_LINE 64
+#define SLAB_SLOTS 64
+
+typedef union iteratorSlot_u {
+	WiggleIterator iterator;
+	union iteratorSlot_u * next;
+	char padding[((sizeof(WiggleIterator) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE];
+} IteratorSlot;
+
+static __thread IteratorSlot * slab = NULL;
+static __thread int slabUsed = SLAB_SLOTS;
+static __thread IteratorSlot * freeSlots = NULL;
+
+static WiggleIterator * allocateWiggleIterator() {
+	IteratorSlot * slot;
+
+	if (freeSlots) {
+		slot = freeSlots;
+		freeSlots = slot->next;
+	} else {
+		if (slabUsed == SLAB_SLOTS) {
+			if (posix_memalign((void **) &slab, CACHE_LINE, SLAB_SLOTS * sizeof(IteratorSlot))) {
+				fprintf(stderr, "Could not allocate iterators\n");
+				raiseError();
+			}
+			slabUsed = 0;
+		}
+		slot = slab + slabUsed++;
+	}
+	memset(slot, 0, sizeof(IteratorSlot));
+	return &slot->iterator;
+}
+
+void freeWiggleIterator(WiggleIterator * wi) {
+	IteratorSlot * slot = (IteratorSlot *) wi;
+	slot->next = freeSlots;
+	freeSlots = slot;
+}
 
 WiggleIterator * newWiggleIterator(void * data, void (*popFunction)(WiggleIterator *), void (*seek)(WiggleIterator *, const char *, int, int), double default_value) {
-	WiggleIterator * new = (WiggleIterator *) calloc(1, sizeof(WiggleIterator));
+	WiggleIterator * new = allocateWiggleIterator();
 	new->data = data;
 	new->pop = popFunction;
 	new->seek = seek;
-	new->chrom = calloc(1000,1);
+	new->chrom = internChromosome("");
 	new->value = 1; // Default value for non-valued bed tracks;
 	new->strand = 0; // Default value for non-stranded data;
 	new->valuePtr = NULL;
 	new->overlaps = false;
+	new->compressed = false;
 	new->append = NULL;
+	new->popBatch = NULL;
+	new->summarize = NULL;
+	new->seekRegions = NULL;
+	new->skipTo = NULL;
+	new->seekReverse = NULL;
+	new->valueRange = NULL;
 	new->default_value = default_value;
+	new->profile = newOperatorProfile();
 	pop(new);
 	return new;
 }
 
 void destroyWiggleIterator(WiggleIterator * wi) {
 	free(wi->data);
-	free(wi->chrom);
-	free(wi);
+	freeWiggleIterator(wi);
 }
 
 void pop(WiggleIterator * wi) {
-	if (!wi->done)
+	if (wi->done)
+		return;
+	else if (wi->profile)
+		profilePop(wi);
+	else
 		wi->pop(wi);
 }
 
+// Iterators which pop by batches are driven a batch at a time, so that 
+// each operator of the chain runs over many records in a row
 void runWiggleIterator(WiggleIterator * wi) {
-	while (!wi->done)
-		wi->pop(wi);
+	if (wi->popBatch) {
+		SpanBatch * batch = newSpanBatch();
+		while (!wi->done) {
+			batch->count = 0;
+			popBatch(wi, batch);
+		}
+		destroySpanBatch(batch);
+	} else {
+		while (!wi->done)
+			pop(wi);
+	}
 }
 
 void seek(WiggleIterator * wi, const char * chrom, int start, int finish) {
+	double clock = traceClock();
 	wi->done = false;
-	(*(wi->seek))(wi, chrom, start, finish);
+	if (wi->profile)
+		profileSeek(wi, internChromosome(chrom), start, finish);
+	else
+		(*(wi->seek))(wi, internChromosome(chrom), start, finish);
+	traceSpan("seek", clock);
+}
+
+void seekRegions(WiggleIterator * wi, const char * chrom, const int * starts, const int * finishes, int count) {
+	int index, finish = finishes[0];
+
+	if (!wi->seekRegions) {
+		for (index = 1; index < count; index++)
+			if (finishes[index] > finish)
+				finish = finishes[index];
+		seek(wi, chrom, starts[0], finish);
+		return;
+	}
+
+	wi->done = false;
+	if (wi->profile)
+		profileSeekRegions(wi, internChromosome(chrom), starts, finishes, count);
+	else
+		wi->seekRegions(wi, internChromosome(chrom), starts, finishes, count);
+}
+
+double readerSeekCost(const char * filename, bool indexed) {
+	if (!indexed)
+		return INFINITY;
+	return strstr(filename, "://") ? REMOTE_SEEK_COST : LOCAL_SEEK_COST;
+}
+
+void skipTo(WiggleIterator * wi, const char * chrom, int start) {
+	if (wi->skipTo && !wi->done) {
+		wi->skipTo(wi, chrom, start);
+		return;
+	}
+	while (!wi->done && (compareChroms(wi->chrom, chrom) < 0 || (compareChroms(wi->chrom, chrom) == 0 && wi->finish <= start)))
+		pop(wi);
+}
+
+//////////////////////////////////////////////////////
+// Batched pops
+//////////////////////////////////////////////////////
+
+SpanBatch * newSpanBatch() {
+	return (SpanBatch *) calloc(1, sizeof(SpanBatch));
+}
+
+void destroySpanBatch(SpanBatch * batch) {
+	free(batch);
+}
+
+// Copies the current record of the iterator at the end of the batch
+void pushSpanBatch(SpanBatch * batch, WiggleIterator * wi) {
+	int index = batch->count++;
+	batch->chroms[index] = wi->chrom;
+	batch->starts[index] = wi->start;
+	batch->finishes[index] = wi->finish;
+	batch->values[index] = wi->value;
+}
+
+// Appends records to the batch, without overflowing it. Filtering operators
+// may return fewer records than available space, so only wi->done signals the end.
+// As with pop, the iterator is left on the first record which was not consumed.
+// Iterators which do not provide a batch function are simply popped one record at a time.
+void popBatch(WiggleIterator * wi, SpanBatch * batch) {
+	if (wi->done || batch->count == SPAN_BATCH_SIZE)
+		return;
+	else if (wi->profile)
+		profilePopBatch(wi, batch);
+	else if (wi->popBatch)
+		wi->popBatch(wi, batch);
+	else {
+		while (!wi->done && batch->count < SPAN_BATCH_SIZE) {
+			pushSpanBatch(batch, wi);
+			wi->pop(wi);
+		}
+	}
+}
+
+// Accessors for code built against the public header only, e.g. bindings.
+// The arrays belong to the batch, the chromosome names to the iterators.
+void clearSpanBatch(SpanBatch * batch) {
+	batch->count = 0;
+}
+
+int spanBatchCount(SpanBatch * batch) {
+	return batch->count;
+}
+
+char ** spanBatchChroms(SpanBatch * batch) {
+	return batch->chroms;
+}
+
+int * spanBatchStarts(SpanBatch * batch) {
+	return batch->starts;
+}
+
+int * spanBatchFinishes(SpanBatch * batch) {
+	return batch->finishes;
+}
+
+double * spanBatchValues(SpanBatch * batch) {
+	return batch->values;
+}
+
+bool isDone(WiggleIterator * wi) {
+	return wi->done;
 }
@@ -17,25 +17,109 @@
 
 #include <stdio.h>
 #include "wiggletools.h"
+#include "chromosomes.h"
 
+#define SPAN_BATCH_SIZE 1024
+
+// Typical costs of a seek, in records which could be read meanwhile: an index
+// lookup and a block read on local files, plus a round trip on remote ones
+#define LOCAL_SEEK_COST 4096
+#define REMOTE_SEEK_COST (1 << 20)
+
+// Type of the values held in buffers and cache files. Building with
+// FLOAT32_VALUES halves their size, as BigWig files store 32-bit floats
+// anyway, but rounds the values read from text files. The computations
+// are carried out in double precision either way.
+#ifdef FLOAT32_VALUES
+typedef float StoredValue;
+#else
+typedef double StoredValue;
+#endif
+
+typedef struct operatorProfile_st OperatorProfile;
+
+struct spanBatch_st {
+	char * chroms[SPAN_BATCH_SIZE];
+	int starts[SPAN_BATCH_SIZE];
+	int finishes[SPAN_BATCH_SIZE];
+	double values[SPAN_BATCH_SIZE];
+	int count;
+};
+
+// Summary of a region, as stored in the zoom levels of BigWig files
+typedef struct regionSummary_st {
+	double validCount;
+	double min;
+	double max;
+	double sum;
+	double sumSquares;
+} RegionSummary;
+
+// The fields read at every record come first, so that they share the first
+// cache line, the configuration the iterator was built with follows
 struct wiggleIterator_st {
 	char * chrom;
 	int start;
 	int finish;
 	double value;
-	void * valuePtr;
 	bool done;
 	int strand;
 	void * data;
 	void (*pop)(WiggleIterator *);
+	// Optional, see popBatch
+	void (*popBatch)(WiggleIterator *, SpanBatch *);
+	// Only set when profiling
+	OperatorProfile * profile;
+
+	void * valuePtr;
 	void (*seek)(WiggleIterator *, const char *, int, int);
+	// Optional, splits a region into equal bins and summarises each of them.
+	// Returns false if the summaries cannot be computed.
+	bool (*summarize)(WiggleIterator *, const char *, int, int, RegionSummary *, int);
+	// Optional, bounds of all the values of the input, known before reading it.
+	// Returns false if they are not known.
+	bool (*valueRange)(WiggleIterator *, double *, double *);
+	// Optional, see seekRegions
+	void (*seekRegions)(WiggleIterator *, const char *, const int *, const int *, int);
+	// Optional, see skipTo
+	void (*skipTo)(WiggleIterator *, const char *, int);
+	// Optional, see ReverseWiggleIterator
+	void (*seekReverse)(WiggleIterator *, const char *, int, int);
 	bool overlaps;
+	// No two records overlap, nor touch with the same value: compression is a no-op
+	bool compressed;
+	// Neither the values nor the default are NaN or infinite: the isnan
+	// checks on them can be skipped. Readers of counts set it, operators pass
+	// it on when they cannot produce NaNs, else it is left false.
+	bool finite;
+	// Besides, the values and the default are integers, such as read counts:
+	// they are added up exactly, and written without decimals
+	bool integral;
+	// Width of the records, if they tile the chromosomes from their first base, else 0
+	int step;
+	// Records which could be read in the time of a seek, see readerSeekCost.
+	// INFINITY if seeking ahead reads through the gap anyway, 0 if unknown.
+	double seekCost;
 	double default_value;
 	WiggleIterator * append;
 };
 
 WiggleIterator * newWiggleIterator(void * data, void (*pop)(WiggleIterator *), void (*seek)(WiggleIterator *, const char *, int, int), double default_value);
+// Iterators come out of an arena, see wiggleIterator.c, and must be freed here
+void freeWiggleIterator(WiggleIterator *);
 void pop(WiggleIterator *);
+// Seeks regions of a chromosome sorted by start, as one region spanning them all,
+// except that indexed readers may skip the records which overlap none of them
+void seekRegions(WiggleIterator *, const char *, const int *, const int *, int);
+// Forward only: drops the records which end at or before chrom:start. Unlike a seek, 
+// the next record is left whole and the iterator carries on past the chromosome. 
+// Indexed readers jump straight there, the others pop through.
+void skipTo(WiggleIterator *, const char *, int);
+// As skipTo, but pops through short gaps rather than restarting an indexed reader
+void catchUp(WiggleIterator *, const char *, int);
+// Seek cost of a reader of the file, depending on whether it can jump to a region
+double readerSeekCost(const char * filename, bool indexed);
+void pushSpanBatch(SpanBatch *, WiggleIterator *);
 WiggleIterator * CompressionWiggleIterator(WiggleIterator *);
 
 #endif
@@ -19,14 +19,277 @@
 // Local header
 #include "wiggletools.h"
 
+static bool isOptionFlag(char * option) {
+	return strcmp(option, "--compact_wig") == 0 || strcmp(option, "--coverage_sidecars") == 0 || strcmp(option, "--huge_pages") == 0 || strcmp(option, "--numa") == 0 || strcmp(option, "--memory_stats") == 0 || strcmp(option, "--cache_stats") == 0 || strcmp(option, "--profile") == 0 || strcmp(option, "--resume") == 0;
+}
+
+// Options which report on, cache or checkpoint the whole run
+static bool isRunOption(char * option) {
+	return strcmp(option, "--memory_stats") == 0 || strcmp(option, "--cache_stats") == 0 || strcmp(option, "--profile") == 0 || strcmp(option, "--resume") == 0 || strcmp(option, "--trace") == 0 || strcmp(option, "--progress") == 0 || strcmp(option, "--checkpoint") == 0 || strcmp(option, "--status_file") == 0 || strcmp(option, "--cache") == 0 || strcmp(option, "--cache_size") == 0;
+}
+
+// The group passes of grouped reductions run with the other options
+static void passGroupOptions(char ** options, int count) {
+	char ** passed = (char **) calloc(count, sizeof(char *));
+	int i, passedCount = 0, length;
+
+	for (i = 0; i < count; i += length) {
+		length = isOptionFlag(options[i]) ? 1 : 2;
+		if (!isRunOption(options[i])) {
+			memcpy(passed + passedCount, options + i, length * sizeof(char *));
+			passedCount += length;
+		}
+	}
+	setGroupPassOptions(passed, passedCount);
+}
+
 int main(int argc, char ** argv) {
+	char ** options = argv + 1;
+	char * cacheDirectory = NULL;
+	long long cacheSize = 1024;
+	bool cacheStats = false;
+	bool memoryStats = false;
+	double progressInterval = 0;
+	char * statusFile = NULL;
+	char * checkpointFile = NULL;
+	bool resume = false;
+
 	if (argc < 2 || strcmp(argv[1], "--help") == 0) {
 		printHelp();
 		return 0;
 	}
 
-	rollYourOwn(argc-1, argv+1);
+	// Remote file cache and output options
+	while (argc > 2) {
+		if (strcmp(argv[1], "--cache") == 0) {
+			cacheDirectory = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--cache_size") == 0) {
+			cacheSize = atoll(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--precision") == 0) {
+			setOutputPrecision(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--apply_threads") == 0) {
+			setApplyThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--chrom_order") == 0) {
+			setChromosomeOrder(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--format_threads") == 0) {
+			setFormatThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--write_threads") == 0) {
+			setWriteThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--open_threads") == 0) {
+			setOpenThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--parse_threads") == 0) {
+			setParseThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--inflate_threads") == 0) {
+			setInflateThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--result_cache") == 0) {
+			setResultCacheSize(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--sort_memory") == 0) {
+			setSortMemory(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--bgzf_threads") == 0) {
+			setBgzfThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--io_threads") == 0) {
+			setIoThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--async_reads") == 0) {
+			setAsyncReadDepth(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--fetch_connections") == 0) {
+			setFetchConnections(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--correlation_threads") == 0) {
+			setCorrelationThreads(atoi(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--max_memory") == 0) {
+			setMaxMemory(atoll(argv[2]) * 1024 * 1024);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--compact_wig") == 0) {
+			setCompactWiggle(true);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--coverage_sidecars") == 0) {
+			setCoverageSidecars(true);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--huge_pages") == 0) {
+			setHugePages(true);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--numa") == 0) {
+			setNuma(true);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--memory_stats") == 0) {
+			memoryStats = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--cache_stats") == 0) {
+			cacheStats = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--profile") == 0) {
+			enableProfiling();
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--trace") == 0) {
+			enableTracing(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--progress") == 0) {
+			progressInterval = atof(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--checkpoint") == 0) {
+			checkpointFile = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--resume") == 0) {
+			resume = true;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--status_file") == 0) {
+			statusFile = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else
+			break;
+	}
+	passGroupOptions(options, argv + 1 - options);
+	if (strcmp(argv[1], "--group_pass") == 0) {
+		runGroupPass(argc - 2, argv + 2);
+		return 0;
+	}
+	if (cacheDirectory)
+		setBlockCache(cacheDirectory, cacheSize * 1024 * 1024);
+	if (progressInterval > 0 || statusFile)
+		startProgress(progressInterval, statusFile);
+
+	if (resume && !checkpointFile) {
+		fprintf(stderr, "Usage: wiggletools --checkpoint checkpoint_file --resume [--threads N] --chrom_sizes chrom_sizes.txt program\n");
+		return 1;
+	}
+	if (checkpointFile)
+		setCheckpoint(checkpointFile, resume);
+
+	if (strcmp(argv[1], "--threads") == 0 || strcmp(argv[1], "--chrom_sizes") == 0 || strcmp(argv[1], "--worker") == 0) {
+		int threads = 1, shard = 0, shards = 0, port = 0;
+		double fraction = 0;
+		if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+			threads = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
+		if (argc > 1 && strcmp(argv[1], "--worker") == 0) {
+			if (argc != 5 || strcmp(argv[3], "--secret")) {
+				fprintf(stderr, "Usage: wiggletools [--threads N] --worker host:port --secret secret_file\n");
+				return 1;
+			}
+			if (checkpointFile) {
+				fprintf(stderr, "wiggletools: a worker cannot be checkpointed\n");
+				return 1;
+			}
+			runShardWorker(argv[2], threads, argv[4]);
+		} else {
+			if (argc < 4 || strcmp(argv[1], "--chrom_sizes")) {
+				fprintf(stderr, "Usage: wiggletools [--threads N] --chrom_sizes chrom_sizes.txt [--shard i/N | --sample fraction] program\n");
+				return 1;
+			}
+			char * chromSizes = argv[2];
+			// Only reachable from this machine unless told otherwise
+			char * bindAddress = "127.0.0.1";
+			char * secretFile = NULL;
+			argc -= 2;
+			argv += 2;
+			while (argc > 2 && (strcmp(argv[1], "--bind") == 0 || strcmp(argv[1], "--secret") == 0)) {
+				if (strcmp(argv[1], "--bind") == 0)
+					bindAddress = argv[2];
+				else
+					secretFile = argv[2];
+				argc -= 2;
+				argv += 2;
+			}
+			if ((strcmp(bindAddress, "127.0.0.1") || secretFile) && strcmp(argv[1], "--coordinate")) {
+				fprintf(stderr, "Usage: wiggletools --chrom_sizes chrom_sizes.txt [--bind address] --secret secret_file --coordinate port shards program\n");
+				return 1;
+			}
+			if (strcmp(argv[1], "--shard") == 0) {
+				if (argc < 4 || sscanf(argv[2], "%i/%i", &shard, &shards) != 2) {
+					fprintf(stderr, "Usage: wiggletools [--threads N] --chrom_sizes chrom_sizes.txt [--shard i/N | --sample fraction] program\n");
+					return 1;
+				}
+				argc -= 2;
+				argv += 2;
+			} else if (strcmp(argv[1], "--sample") == 0) {
+				if (argc < 4 || sscanf(argv[2], "%lf", &fraction) != 1 || !(fraction > 0 && fraction <= 1)) {
+					fprintf(stderr, "Usage: wiggletools [--threads N] --chrom_sizes chrom_sizes.txt [--shard i/N | --sample fraction] program\n");
+					return 1;
+				}
+				argc -= 2;
+				argv += 2;
+			} else if (strcmp(argv[1], "--coordinate") == 0) {
+				if (argc < 5 || (port = atoi(argv[2])) <= 0 || (shards = atoi(argv[3])) <= 0 || !secretFile) {
+					fprintf(stderr, "Usage: wiggletools --chrom_sizes chrom_sizes.txt [--bind address] --secret secret_file --coordinate port shards program\n");
+					return 1;
+				}
+				if (checkpointFile) {
+					fprintf(stderr, "wiggletools: a coordinator cannot be checkpointed\n");
+					return 1;
+				}
+				argc -= 3;
+				argv += 3;
+			}
+			if (port)
+				coordinateShards(argc-1, argv+1, chromSizes, bindAddress, port, shards, secretFile);
+			else if (fraction)
+				rollYourOwnSample(argc-1, argv+1, threads, chromSizes, fraction);
+			else if (shards)
+				rollYourOwnShard(argc-1, argv+1, threads, chromSizes, shard, shards);
+			else
+				rollYourOwnInParallel(argc-1, argv+1, threads, chromSizes);
+		}
+	} else if (checkpointFile) {
+		fprintf(stderr, "Usage: wiggletools --checkpoint checkpoint_file [--resume] [--threads N] --chrom_sizes chrom_sizes.txt program\n");
+		return 1;
+	} else
+		rollYourOwn(argc-1, argv+1);
 
+	finishProgress();
+	if (cacheStats)
+		printBlockCacheStatistics(stderr);
+	if (memoryStats)
+		printMemoryStatistics(stderr);
+	printProfile(stderr);
+	finishTracing();
 	return 0;
 }
 
@@ -27,22 +27,63 @@ typedef struct wiggleIterator_st WiggleIterator;
 typedef struct multiplexer_st Multiplexer;
 typedef struct multiset_st Multiset;
 typedef struct histogram_st Histogram;
+typedef struct topRegions_st TopRegions;
+typedef struct spanBatch_st SpanBatch;
+
+// Errors
+//
+// An error prints its message to stderr, then ends the process, unless the
+// thread raising it is running a function under catchErrors, which then 
+// returns false instead. The iterators involved in the error are left as 
+// they were, and must not be used any more. Errors of the Kent library 
+// (errAbort) are caught the same way. Errors raised by the downloads 
+// of the readers opened within catchErrors are raised again by the thread 
+// which pops them. Settings, e.g. setMaxBlocks, are shared by all threads,
+// and are best changed before building any iterator.
+bool catchErrors(void (*function)(void *), void * args);
+void raiseError() __attribute__((noreturn));
 
 // Creators
 WiggleIterator * SmartReader (char *, bool);
-WiggleIterator * CatWiggleIterator (char **, int);
+// Same, but the records of BigBed files are read without values or strands
+WiggleIterator * CoordinatesReader (char *, bool);
+bool isIndexedFile(char *);
+bool isWiggleFilename(char *);
+WiggleIterator * CatWiggleIterator (char **, int, bool);
 // Secondary creators (to force file format recognition if necessary)
 WiggleIterator * WiggleReader (char *);
+// Large uncompressed files are parsed ahead on a few threads
+WiggleIterator * ParallelWiggleReader (char *);
 WiggleIterator * BigWiggleReader (char *, bool);
 WiggleIterator * BedReader (char *);
 WiggleIterator * BigBedReader (char *, bool);
+// Reads the score column of the regions as their value
+WiggleIterator * BigBedScoreReader (char *, bool);
+// Reads only the coordinates of the regions, with value 1
+WiggleIterator * BigBedCoordinatesReader (char *, bool);
 WiggleIterator * BamReader (char *, bool);
+WiggleIterator * BamCoverageReader (char *, bool, int, int, int, int, int);
 WiggleIterator * SamReader (char *);
 WiggleIterator * VcfReader (char *);
+// Extracts a field, QUAL, INFO/(key) or FORMAT/(key), from each record
+WiggleIterator * VcfValueReader (char *, char *, bool);
 WiggleIterator * BcfReader (char *, bool);
+WiggleIterator * TrackCacheReader (char *);
+WiggleIterator * IntegerTrackReader (char *);
 
 // Generic class functions 
 void seek(WiggleIterator *, const char *, int, int);
+SpanBatch * newSpanBatch();
+void popBatch(WiggleIterator *, SpanBatch *);
+void destroySpanBatch(SpanBatch *);
+void clearSpanBatch(SpanBatch *);
+// Contents of a batch: records 0 to spanBatchCount - 1
+int spanBatchCount(SpanBatch *);
+char ** spanBatchChroms(SpanBatch *);
+int * spanBatchStarts(SpanBatch *);
+int * spanBatchFinishes(SpanBatch *);
+double * spanBatchValues(SpanBatch *);
+bool isDone(WiggleIterator *);
 
 // Algebraic operations on iterators
 	
@@ -60,6 +101,11 @@ WiggleIterator * OverlapWiggleIterator(WiggleIterator *, WiggleIterator *);
 WiggleIterator * TrimWiggleIterator(WiggleIterator *, WiggleIterator *);
 WiggleIterator * NoverlapWiggleIterator(WiggleIterator *, WiggleIterator *);
 WiggleIterator * NearestWiggleIterator(WiggleIterator *, WiggleIterator *);
+// Masks: the non-zero positions of the inputs, read once and held in memory
+WiggleIterator * MaskWiggleIterator(WiggleIterator *);
+WiggleIterator * AndMaskWiggleIterator(WiggleIterator *, WiggleIterator *);
+WiggleIterator * OrMaskWiggleIterator(WiggleIterator *, WiggleIterator *);
+WiggleIterator * AndNotMaskWiggleIterator(WiggleIterator *, WiggleIterator *);
 WiggleIterator * IsZero(WiggleIterator *);
 	// Scalar operations
 WiggleIterator * ScaleWiggleIterator (WiggleIterator *, double);
@@ -69,11 +115,50 @@ WiggleIterator * LogWiggleIterator (WiggleIterator * , double);
 WiggleIterator * ExpWiggleIterator (WiggleIterator *, double);
 WiggleIterator * DefaultValueWiggleIterator(WiggleIterator *, double);
 WiggleIterator * HighPassFilterWiggleIterator(WiggleIterator *, double);
+	// Chains of scalar operations, evaluated by a single iterator
+typedef enum {SCALAR_SCALE, SCALAR_SHIFT, SCALAR_LOG, SCALAR_LN, SCALAR_EXP, SCALAR_POW, SCALAR_ABS, SCALAR_GT, SCALAR_IS_ZERO, SCALAR_DEFAULT} ScalarOperation;
+typedef struct scalarOp_st {
+	ScalarOperation operation;
+	double scalar;
+} ScalarOp;
+// ops[0] is applied first
+WiggleIterator * FusedScalarWiggleIterator(WiggleIterator *, ScalarOp *, int);
 WiggleIterator * SmoothWiggleIterator(WiggleIterator * i, int);
+// Gaussian kernel of the given standard deviation, by recursive filtering
+WiggleIterator * GaussianWiggleIterator(WiggleIterator * i, double);
 WiggleIterator * ExtendWiggleIterator(WiggleIterator * i, int);
+// Coverage of the records extended by the given length on both sides, or
+// if stranded into fragments of that length from their 5' end
+WiggleIterator * ExtendedCoverageWiggleIterator(WiggleIterator * i, int, bool);
+// One record per bin of the given width overlapping the input
+typedef enum {BIN_SUM, BIN_MEAN, BIN_MAX, BIN_MIN, BIN_COVERAGE} BinStatistic;
+WiggleIterator * BinWiggleIterator(WiggleIterator * i, int, BinStatistic);
+// Max, min or median over a sliding window of the given width, as for smooth
+typedef enum {ROLLING_MAX, ROLLING_MIN, ROLLING_MEDIAN} RollingStatistic;
+WiggleIterator * RollingWiggleIterator(WiggleIterator * i, int, RollingStatistic);
+// Pearson correlation of two iterators over a window of the given width centred on each base
+WiggleIterator * RollingPearsonWiggleIterator(WiggleIterator *, WiggleIterator *, int);
+// Reads the regions it is seeked to backwards: the records of the input which
+// overlap the region, clipped to it, by decreasing start. BigWig and BigBed
+// readers stream them block by block, see seekReverse in wiggleIterator.h,
+// other inputs are read over the region into memory. Empty until seeked, and
+// only meant for code walking regions backwards, as all the other iterators
+// expect their inputs in order.
+WiggleIterator * ReverseWiggleIterator(WiggleIterator *);
 
 // Sets of iterators 
 Multiplexer * newMultiplexer(WiggleIterator **, int, bool);
+Multiplexer * MatrixMultiplexer(char *);
+// One input per sample, with the values of a FORMAT field
+Multiplexer * VcfSampleMultiplexer(char *, char *);
+// Forward, reverse and total coverage of a BAM file, then the same above a mapping quality if positive
+Multiplexer * BamStrandsMultiplexer(char *, int, int, int);
+// Weighted sums of the inputs, given as rows of weights, one output per row
+Multiplexer * LinearCombinationMultiplexer(Multiplexer *, double *, int);
+// Overlap flags, or nearest distances if true, of the spans of a signal with each of the masks
+Multiplexer * AnnotationMultiplexer(WiggleIterator *, WiggleIterator **, int, bool);
+// Values of each input at the first base of each span of the positions, out of play where they hold none
+Multiplexer * LookupMultiplexer(WiggleIterator *, WiggleIterator **, int);
 
 // Reduction operators on sets
 
@@ -90,20 +175,62 @@ WiggleIterator * CVReduction ( Multiplexer * );
 WiggleIterator * MedianReduction ( Multiplexer * );
 WiggleIterator * FillInReduction( Multiplexer * );
 
+// Same reductions over more than GROUPED_REDUCTION_MIN_INPUTS files, reduced
+// by groups in child processes, so as to bound the files open at once
+#define GROUPED_REDUCTION_MIN_INPUTS 1024
+typedef enum {GROUPED_SUM, GROUPED_MEAN, GROUPED_MAX, GROUPED_MIN, GROUPED_VARIANCE, GROUPED_STDDEV} GroupedReducer;
+bool isGroupedReduction(int);
+WiggleIterator * GroupedReduction(char **, int, GroupedReducer);
+// Options of the program passed on to the group passes
+void setGroupPassOptions(char **, int);
+void runGroupPass(int, char **);
+
 // Sets of sets iterators 
 Multiset * newMultiset(Multiplexer **, int);
 
 // Reduction operators on sets of sets:
 WiggleIterator * TTestReduction(Multiset *);
 WiggleIterator * FTestReduction(Multiset *);
+// The test statistic, or 1 where the p-value is below alpha and 0 elsewhere,
+// which mostly spares computing the p-value
+WiggleIterator * TTestStatisticReduction(Multiset *);
+WiggleIterator * TTestCallReduction(Multiset *, double alpha);
+WiggleIterator * FTestStatisticReduction(Multiset *);
+WiggleIterator * FTestCallReduction(Multiset *, double alpha);
 WiggleIterator * MWUReduction(Multiset *);
+// Empirical p-values, over the given number of random permutations of the
+// inputs between the sets, evaluated together at each position
+WiggleIterator * TTestPermutationReduction(Multiset *, int permutations);
+WiggleIterator * FTestPermutationReduction(Multiset *, int permutations);
+WiggleIterator * MWUPermutationReduction(Multiset *, int permutations);
 
 // Output
 void toFile (WiggleIterator *, char *, bool, bool);
 void toStdout (WiggleIterator *, bool, bool);
 WiggleIterator * TeeWiggleIterator(WiggleIterator *, FILE *, bool, bool);
+WiggleIterator * BigWigTeeWiggleIterator(WiggleIterator *, FILE *);
+// Same, with zoom levels of the given widths, increasing multiples of each other
+WiggleIterator * ZoomedBigWigTeeWiggleIterator(WiggleIterator *, FILE *, int *, int);
+WiggleIterator * BgzfTeeWiggleIterator(WiggleIterator *, FILE *, char *, bool, bool);
+WiggleIterator * TrackCacheTeeWiggleIterator(WiggleIterator *, FILE *);
+// Integer valued tracks only, e.g. coverage
+WiggleIterator * IntegerTrackTeeWiggleIterator(WiggleIterator *, FILE *);
+// Same, into a file which only appears once the iterator is exhausted, unless it was seeked
+WiggleIterator * IntegerTrackMemoWiggleIterator(WiggleIterator *, char *);
+// Several resolutions of an iterator from one pass: each level bins the
+// source, and is handed back wrapped in a writer, before the pyramid
+// iterator passes the source through and drives the writers
+typedef struct pyramid_st Pyramid;
+Pyramid * newPyramid(WiggleIterator *);
+WiggleIterator * PyramidBinWiggleIterator(Pyramid *, int, BinStatistic);
+void addPyramidLevel(Pyramid *, WiggleIterator *);
+WiggleIterator * PyramidWiggleIterator(Pyramid *);
+// Same, into a file which only appears once the iterator is exhausted, unless it was seeked
+WiggleIterator * TrackCacheMemoWiggleIterator(WiggleIterator *, char *);
 void runWiggleIterator(WiggleIterator * );
 Multiplexer * TeeMultiplexer(Multiplexer *, FILE *, bool, bool);
+Multiplexer * MatrixTeeMultiplexer(Multiplexer *, FILE *, bool);
+Multiplexer * MatrixAppendMultiplexer(Multiplexer *, char *, bool);
 void toStdoutMultiplexer (Multiplexer *, bool, bool);
 void runMultiplexer(Multiplexer * );
 WiggleIterator * PrintStatisticsWiggleIterator(WiggleIterator * i, FILE * file);
@@ -117,19 +244,65 @@ WiggleIterator * MaxIntegrator (WiggleIterator *);
 WiggleIterator * VarianceIntegrator (WiggleIterator *);
 WiggleIterator * StandardDeviationIntegrator (WiggleIterator *);
 WiggleIterator * CoefficientOfVariationIntegrator (WiggleIterator *);
+// Approximate quantile (between 0 and 1) of the values, weighted by span length
+WiggleIterator * QuantileIntegrator (WiggleIterator *, double);
+// Unary creator of the above, as listed in apply. Up to 8 different quantiles
+WiggleIterator * (*quantileIntegratorCreator(double))(WiggleIterator *);
 WiggleIterator * NDPearsonIntegrator(Multiset *);
-void regionProfile(WiggleIterator *, double *, int, int, bool);
+void regionProfile(WiggleIterator *, double *, int, int, int, bool);
 void addProfile(double *, double *, int);
 //	Binary 
 WiggleIterator * PearsonIntegrator (WiggleIterator * , WiggleIterator * );
 //	Histograms
 Histogram * histogram(WiggleIterator **, int, int);
+Histogram * emptyHistogram(WiggleIterator **, int, int);
+// True if all the inputs can tell the range of their values beforehand, e.g. BigWig files
+bool histogramRangeKnown(WiggleIterator **, int);
+void addBatchToHistogram(Histogram *, SpanBatch *, int row);
 void normalize_histogram(Histogram *);
 void print_histogram(Histogram *, FILE *);
+void mergeHistograms(Histogram *, Histogram *);
+// Binary dumps, read back by merge_partials
+void dumpHistogram(Histogram *, FILE *);
+Histogram * loadHistogram(FILE *);
+// Counts of one input, over width bins spread evenly from min to max
+double * histogramRow(Histogram *, int row, int * width, double * min, double * max);
+int histogramRowCount(Histogram *);
+void destroyHistogram(Histogram *);
+// Empty, with the same dimensions and range of bins
+Histogram * emptyHistogramLike(Histogram *);
+//	Records with the highest values, up to a bounded number
+TopRegions * topRegions(WiggleIterator *, int);
+TopRegions * newTopRegions(int);
+void addTopRegion(TopRegions *, const char *, int, int, double);
+void mergeTopRegions(TopRegions *, TopRegions *);
+void printTopRegions(TopRegions *, FILE *);
+void dumpTopRegions(TopRegions *, FILE *);
+TopRegions * loadTopRegions(FILE *);
+//	Pearson correlations of all pairs of inputs, weighted by span length
+void printCorrelations(Multiplexer *, FILE *);
+//	Merging statistics computed over separate regions
+void mergeStatistics(WiggleIterator *, WiggleIterator *);
+// Binary dumps of the state of a chain of statistics, read back by merge_partials
+void dumpStatistics(WiggleIterator *, FILE *);
+WiggleIterator * loadStatistics(FILE *);
+// Results of a chain of statistics which was run, e.g. meanI maxI x, in the order of the program
+double * statisticResults(WiggleIterator *, int * count);
+// How each of these results grows with the regions covered: totals (AUC, span), extrema (maxI, minI) or averages (the others)
+typedef enum {STATISTIC_TOTAL, STATISTIC_EXTREMUM, STATISTIC_AVERAGE} StatisticKind;
+StatisticKind * statisticKinds(WiggleIterator *, int * count);
 
 // Regional statistics
 Multiplexer * ApplyMultiplexer(WiggleIterator *, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator *, bool strict);
+// With zoom, the statistics come from the summaries of the input where canZoomApply.
+// Otherwise, prefetch is a second reader on the input, or NULL, which the next batch
+// of regions is read from in the background. It is not needed, nor used, when zoomed.
+Multiplexer * ApplyMultiplexerFull(WiggleIterator *, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator *, bool strict, bool zoom, WiggleIterator * prefetch);
+bool canZoomApply(WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator *);
+// Same regions and statistics on each of the inputs, see MultiApplyMultiplexer
+Multiplexer * MultiApplyMultiplexer(WiggleIterator *, WiggleIterator * (**statistics)(WiggleIterator *), int count, WiggleIterator **, int, bool strict, bool zoom, bool holdFire);
 Multiplexer * ProfileMultiplexer(WiggleIterator *, int, WiggleIterator *);
+Multiplexer * ProfileMultiplexerFull(WiggleIterator *, int, WiggleIterator *, bool zoom, WiggleIterator * prefetch);
 Multiplexer * PasteMultiplexer(Multiplexer *,  FILE *, FILE *, bool);
 
 // Cleaning up
@@ -137,10 +310,116 @@ void destroyWiggleIterator (WiggleIterator *);
 
 // Big file params
 void setMaxBlocks(int);
+void setDecompressionThreads(int);
+void setCompressionThreads(int);
 void setMaxHeadStart(int);
+void setBlockSize(int);
+void setReadAhead(int);
+// BAM and CRAM coverage is stored in .wti sidecars the first time it is read whole, then read from them
+void setCoverageSidecars(bool);
+void setBlockCache(char * directory, long long maxSize);
+void printBlockCacheStatistics(FILE * file);
+
+// Decimals printed in text output
+void setOutputPrecision(int);
+
+// Wiggle output written in the cheapest of bedGraph, variableStep and fixedStep lines for each run of records
+void setCompactWiggle(bool);
+
+// Threads computing apply, profile and profiles over buffered regions
+void setApplyThreads(int);
+
+// Threads formatting the text output of mwrite and mwrite_bg
+void setFormatThreads(int);
+
+// Threads shared by all the outputs of write, write_bg, mwrite, apply_paste etc.
+void setWriteThreads(int);
+
+// Threads opening the files of a list of inputs
+void setOpenThreads(int);
+
+// Threads parsing each large uncompressed wiggle or bedGraph file, 1 for none
+void setParseThreads(int);
+
+// Threads inflating each bgzipped text file, 0 inflating on the reader's thread
+void setInflateThreads(int);
+
+// Memory in MB of each run of the external sort of unsorted BED and SAM
+// files, 0 (default) requiring sorted files
+void setSortMemory(int);
+
+// Genome order followed by all readers and multiplexers, as listed in the
+// first column of a text file (e.g. chromosome sizes) or a BAM header
+void setChromosomeOrder(char * filename);
+
+// Threads shared by the downloads of all readers, 0 for one thread per reader
+void setIoThreads(int);
+
+// Reads of local BigWig and BigBed files queued at once by those threads, 0 for blocking reads
+void setAsyncReadDepth(int);
+
+// Concurrent range requests to remote BigWig and BigBed files, 1 for one at a time
+void setFetchConnections(int);
+
+// Threads inflating the blocks of each BAM file ahead of its reader, 0 for none
+void setBgzfThreads(int);
+
+// Threads updating the matrix of correlations
+void setCorrelationThreads(int);
+
+// Memory budget in bytes, 0 for none, and peak usage per subsystem
+void setMaxMemory(long long bytes);
+void printMemoryStatistics(FILE * file);
+
+// Large buffers backed by transparent huge pages
+void setHugePages(bool);
+// Threads of a multithreaded run pinned to the NUMA nodes in turn, with their buffers
+void setNuma(bool);
+
+// Per operator counters, reported as a tree
+void enableProfiling();
+void printProfile(FILE * file);
+
+// Timeline of the work of each thread, written as a Chrome trace
+void enableTracing(char * filename);
+void finishTracing();
+
+// Reports of the position and throughput of the program, to stderr every
+// interval seconds if positive, and to a JSON status file if not NULL
+void startProgress(double interval, char * statusFile);
+void finishProgress();
+
+// Records the progress of a run over --chrom_sizes in a file after each
+// chromosome, and resumes from that file if asked to and it exists
+void setCheckpoint(char * filename, bool resume);
 
 // Command line parser
 void rollYourOwn(int argc, char ** argv);
+// A single iterator, resp. a list of iterators, as in the histogram command. If hold is
+// true, the readers wait for a seek before reading.
+WiggleIterator * parseIterator(int argc, char ** argv, bool hold);
+WiggleIterator ** parseIteratorList(int argc, char ** argv, bool hold, int * count);
+void rollYourOwnInParallel(int argc, char ** argv, int threads, char * chromSizesFile);
+// Runs the program over shard number shard (from 1) of shards stretches of the genome
+// of equal length, and prints its partial results to stdout, see merge_partials
+void rollYourOwnShard(int argc, char ** argv, int threads, char * chromSizesFile, int shard, int shards);
+// Estimates of the statistics or histogram of the program, with their confidence intervals, from a fraction of the genome
+void rollYourOwnSample(int argc, char ** argv, int threads, char * chromSizesFile, double fraction);
 void printHelp();
+// Runs the programs sent over a Unix socket, one per line, and streams back their output
+void serve(char * socketPath);
+// Size in megabytes of the outputs kept by the server, 0 to keep none
+void setResultCacheSize(int megabytes);
+// Multi-node runs: the coordinator hands out the shards of the program to the
+// workers which connect to its TCP port, and merges their partial results into
+// the output of the program. A worker runs the shards it is sent until there
+// are none left. Both ends must read the same secret from their secret file.
+// The coordinator listens on bindAddress, or on all interfaces for "*".
+void coordinateShards(int argc, char ** argv, char * chromSizesFile, char * bindAddress, int port, int shards, char * secretFile);
+void runShardWorker(char * address, int threads, char * secretFile);
+// Output file, or stdout for "-". Exits if the file already exists.
+FILE * openOutputFile(char * filename);
+// Merges partial files, as merge_partials, into the output, which it closes
+void writeMergedPartials(char * filename, FILE * file, FILE ** partials, int count);
 
 #endif
@@ -0,0 +1,154 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "workEstimates.h"
+
+// Kent library headers
+#include "common.h"
+#include "bbiFile.h"
+#include "bigWig.h"
+
+#include "sam.h"
+
+// Defined in bam_aux.c, but not declared by the samtools headers
+void bam_init_header_hash(bam_header_t * header);
+
+struct workEstimator_st {
+	struct bbiFile * bwf;
+	bamFile bam;
+	bam_header_t * header;
+	bam_index_t * idx;
+	bam1_t * read;
+	long long fileSize;
+};
+
+static bool hasSuffix(const char * filename, const char * suffix) {
+	size_t length = strlen(filename);
+	size_t suffixLength = strlen(suffix);
+	return length > suffixLength && strcmp(filename + length - suffixLength, suffix) == 0;
+}
+
+WorkEstimator * openWorkEstimator(const char * filename) {
+	WorkEstimator * estimator;
+	struct stat info;
+	char index[5000];
+
+	// Remote files are not worth the round trips
+	if (stat(filename, &info))
+		return NULL;
+
+	estimator = (WorkEstimator *) calloc(1, sizeof(WorkEstimator));
+	estimator->fileSize = info.st_size;
+	if (hasSuffix(filename, ".bw") || hasSuffix(filename, ".bigWig") || hasSuffix(filename, ".bigwig"))
+		estimator->bwf = bigWigFileOpen((char *) filename);
+	else if (hasSuffix(filename, ".bam")) {
+		snprintf(index, sizeof(index), "%s.bai", filename);
+		if (access(index, R_OK) == 0 && (estimator->bam = bam_open(filename, "r"))) {
+			estimator->header = bam_header_read(estimator->bam);
+			bam_init_header_hash(estimator->header);
+			estimator->idx = bam_index_load(filename);
+			estimator->read = bam_init1();
+		}
+	}
+
+	if (!estimator->bwf && !estimator->idx) {
+		closeWorkEstimator(estimator);
+		return NULL;
+	}
+	return estimator;
+}
+
+void closeWorkEstimator(WorkEstimator * estimator) {
+	if (estimator->bwf)
+		bbiFileClose(&estimator->bwf);
+	if (estimator->read)
+		bam_destroy1(estimator->read);
+	if (estimator->idx)
+		bam_index_destroy(estimator->idx);
+	if (estimator->header)
+		bam_header_destroy(estimator->header);
+	if (estimator->bam)
+		bam_close(estimator->bam);
+	free(estimator);
+}
+
+static bool estimateBigWigWork(WorkEstimator * estimator, const char * chrom, int start, int finish, double * work, int count) {
+	struct bbiSummaryElement * elements = (struct bbiSummaryElement *) calloc(count, sizeof(struct bbiSummaryElement));
+	bool found;
+	int i;
+
+	// -1 because BigWig coords are 0-based...
+	if ((found = bigWigSummaryArrayExtended(estimator->bwf, (char *) chrom, start - 1, finish - 1, count, elements)))
+		for (i = 0; i < count; i++)
+			work[i] += elements[i].validCount;
+	free(elements);
+	return found;
+}
+
+// Compressed offset of the first read of chromosome tid which ends after start 
+// (0-based), or -1 if there is none
+static long long firstReadOffset(WorkEstimator * estimator, int tid, int start) {
+	bam_iter_t iter = bam_iter_query(estimator->idx, tid, start, INT_MAX);
+	long long offset = -1;
+
+	if (bam_iter_read(estimator->bam, iter, estimator->read) >= 0)
+		offset = bam_tell(estimator->bam) >> 16;
+	bam_iter_destroy(iter);
+	return offset;
+}
+
+static long long chromEndOffset(WorkEstimator * estimator, int tid) {
+	long long offset;
+
+	for (tid++; tid < estimator->header->n_targets; tid++)
+		if ((offset = firstReadOffset(estimator, tid, 0)) >= 0)
+			return offset;
+	return estimator->fileSize;
+}
+
+static bool estimateBamWork(WorkEstimator * estimator, const char * chrom, int start, int finish, double * work, int count) {
+	int tid = bam_get_tid(estimator->header, chrom);
+	long long * offsets;
+	double width = (finish - start) / (double) count;
+	int i;
+
+	if (tid < 0)
+		return false;
+
+	offsets = (long long *) calloc(count + 1, sizeof(long long));
+	offsets[count] = firstReadOffset(estimator, tid, finish - 1);
+	if (offsets[count] < 0)
+		offsets[count] = chromEndOffset(estimator, tid);
+	// Bins without reads start where the next bin does
+	for (i = count - 1; i >= 0; i--)
+		if ((offsets[i] = firstReadOffset(estimator, tid, start - 1 + (int) (i * width))) < 0 || offsets[i] > offsets[i+1])
+			offsets[i] = offsets[i+1];
+	for (i = 0; i < count; i++)
+		work[i] += offsets[i+1] - offsets[i];
+	free(offsets);
+	return true;
+}
+
+bool estimateWork(WorkEstimator * estimator, const char * chrom, int start, int finish, double * work, int count) {
+	if (estimator->bwf)
+		return estimateBigWigWork(estimator, chrom, start, finish, work, count);
+	else
+		return estimateBamWork(estimator, chrom, start, finish, work, count);
+}
@@ -0,0 +1,36 @@
+// Copyright [1999-2016] EMBL-European Bioinformatics Institute
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WORK_ESTIMATES_H_
+#define _WORK_ESTIMATES_H_
+
+#include "wiggletools.h"
+
+// Estimates of the amount of data of an input file over regions, read off
+// its index, used to balance the work between shards
+//
+// BigWig files count the bases covered, from their zoom levels, and BAM 
+// files the compressed bytes, from the offsets of the first reads found 
+// by their index at regular intervals. The units therefore only compare 
+// within a file.
+typedef struct workEstimator_st WorkEstimator;
+
+// NULL if the file cannot estimate its data
+WorkEstimator * openWorkEstimator(const char * filename);
+// Splits the region into count equal bins, and adds the estimate of each to
+// work. Returns false, leaving work unchanged, if the region is not known. 
+bool estimateWork(WorkEstimator * estimator, const char * chrom, int start, int finish, double * work, int count);
+void closeWorkEstimator(WorkEstimator * estimator);
+
+#endif
@@ -0,0 +1,237 @@
+#!/usr/bin/env python
+# Copyright [1999-2016] EMBL-European Bioinformatics Institute
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Timed scenarios on large synthetic inputs
+#
+# The inputs are generated once into bench_data/ (with a fixed seed, so
+# that they are identical across runs and machines) and reused afterwards.
+# Each scenario is run several times, and the timings are written as JSON
+# so that the results of two commits can be compared:
+#
+#   python bench.py --output before.json
+#   python bench.py --output after.json --compare before.json
+
+import sys
+import os
+import time
+import json
+import random
+import shutil
+import argparse
+import subprocess
+
+WIGGLETOOLS = '../bin/wiggletools'
+SAMTOOLS = '../samtools/samtools'
+DATA = 'bench_data'
+TMP = 'bench_tmp'
+
+CHROMS = [('chr1', 10000000), ('chr2', 5000000), ('chr3', 2000000)]
+SAMPLES = 8
+READ_LENGTH = 100
+
+def path(name):
+	return os.path.join(DATA, name)
+
+def chromSizes(scale):
+	return [(chrom, int(length * scale)) for chrom, length in CHROMS]
+
+##################################################
+## Generators
+##################################################
+
+def writeDenseBedGraph(filename, sizes, step, rand):
+	# Contiguous records of variable width, as produced by coverage tools
+	out = open(filename, 'w')
+	for chrom, length in sizes:
+		start = 0
+		while start < length:
+			finish = min(length, start + rand.randint(1, 2 * step))
+			out.write('%s\t%i\t%i\t%.3f\n' % (chrom, start, finish, rand.random() * 100))
+			start = finish
+	out.close()
+
+def writeSparseBedGraph(filename, sizes, gap, rand):
+	out = open(filename, 'w')
+	for chrom, length in sizes:
+		start = rand.randint(0, gap)
+		while start < length:
+			finish = min(length, start + rand.randint(10, 500))
+			out.write('%s\t%i\t%i\t%.3f\n' % (chrom, start, finish, rand.expovariate(0.1)))
+			start = finish + rand.randint(0, gap)
+	out.close()
+
+def writePeaks(filename, sizes, gap, rand):
+	out = open(filename, 'w')
+	for chrom, length in sizes:
+		start = rand.randint(0, gap)
+		while start < length:
+			finish = min(length, start + rand.randint(200, 2000))
+			out.write('%s\t%i\t%i\n' % (chrom, start, finish))
+			start = finish + rand.randint(1, gap)
+	out.close()
+
+def writeChromSizes(filename, sizes):
+	out = open(filename, 'w')
+	for chrom, length in sizes:
+		out.write('%s\t%i\n' % (chrom, length))
+	out.close()
+
+def writeReads(filename, sizes, depth, rand):
+	# Reads sorted by position over the first fifth of each chromosome, without header
+	out = open(filename, 'w')
+	quality = 'I' * READ_LENGTH
+	index = 0
+	for chrom, length in sizes:
+		span = length // 5
+		count = span * depth // READ_LENGTH
+		starts = sorted(rand.randint(1, span - READ_LENGTH) for i in range(count))
+		for start in starts:
+			sequence = ''.join(rand.choice('ACGT') for i in range(READ_LENGTH)) if index % 1000 == 0 else 'A' * READ_LENGTH
+			out.write('r%i\t0\t%s\t%i\t60\t%iM\t*\t0\t0\t%s\t%s\n' % (index, chrom, start, READ_LENGTH, sequence, quality))
+			index += 1
+	out.close()
+
+def run(cmd):
+	if subprocess.call(cmd, shell = True) != 0:
+		print('Failed: %s' % cmd)
+		sys.exit(1)
+
+def generate(scale):
+	stamp = path('scale')
+	if os.path.exists(stamp) and open(stamp).read() == str(scale):
+		return
+	if os.path.exists(DATA):
+		shutil.rmtree(DATA)
+	os.mkdir(DATA)
+
+	rand = random.Random(1)
+	sizes = chromSizes(scale)
+	print('Generating inputs in %s' % DATA)
+	writeDenseBedGraph(path('dense.bg'), sizes, 10, rand)
+	writePeaks(path('peaks.bed'), sizes, 20000, rand)
+	for sample in range(SAMPLES):
+		writeSparseBedGraph(path('sample_%i.bg' % sample), sizes, 200, rand)
+		run('%s write %s %s' % (WIGGLETOOLS, path('sample_%i.bw' % sample), path('sample_%i.bg' % sample)))
+		os.remove(path('sample_%i.bg' % sample))
+	writeReads(path('deep.sam'), sizes, 30, rand)
+	if os.path.exists(SAMTOOLS):
+		writeChromSizes(path('chrom_sizes'), sizes)
+		run('%s view -bt %s %s > %s' % (SAMTOOLS, path('chrom_sizes'), path('deep.sam'), path('deep.bam')))
+		run('%s index %s' % (SAMTOOLS, path('deep.bam')))
+		os.remove(path('deep.sam'))
+
+	out = open(stamp, 'w')
+	out.write(str(scale))
+	out.close()
+
+##################################################
+## Scenarios
+##################################################
+
+def scenarios():
+	samples = ' '.join(path('sample_%i.bw' % sample) for sample in range(SAMPLES))
+	reads = path('deep.bam') if os.path.exists(path('deep.bam')) else path('deep.sam')
+	return [
+		('read_bedgraph', 'meanI %s' % path('dense.bg')),
+		('read_bed', 'meanI %s' % path('peaks.bed')),
+		('read_bigwig', 'meanI %s' % path('sample_0.bw')),
+		('read_reads', 'meanI %s' % reads),
+		('fanin_sum', 'meanI sum %s' % samples),
+		('reduce_mean', 'meanI mean %s' % samples),
+		('reduce_max', 'meanI max %s' % samples),
+		('reduce_median', 'meanI median %s' % samples),
+		('reduce_variance', 'meanI variance %s' % samples),
+		('apply_paste', 'apply_paste %s meanI %s %s' % (os.path.join(TMP, 'apply.txt'), path('peaks.bed'), path('sample_0.bw'))),
+		('smooth', 'meanI smooth 100 %s' % path('sample_0.bw')),
+		('write_bedgraph', 'write_bg %s %s' % (os.path.join(TMP, 'out.bg'), path('dense.bg'))),
+		('write_wig', 'write %s %s' % (os.path.join(TMP, 'out.wig'), path('sample_0.bw'))),
+		('write_bigwig', 'write %s %s' % (os.path.join(TMP, 'out.bw'), path('dense.bg'))),
+		('write_bgzf', 'write_bg %s %s' % (os.path.join(TMP, 'out.bg.gz'), path('dense.bg'))),
+	]
+
+def median(values):
+	values = sorted(values)
+	middle = len(values) // 2
+	if len(values) % 2:
+		return values[middle]
+	else:
+		return (values[middle - 1] + values[middle]) / 2
+
+def clearOutputs():
+	# The writers refuse to overwrite existing files
+	if os.path.exists(TMP):
+		shutil.rmtree(TMP)
+	os.mkdir(TMP)
+
+def timeScenario(name, program, runs):
+	cmd = '%s %s > /dev/null' % (WIGGLETOOLS, program)
+	print('Timing %s: %s' % (name, cmd))
+	seconds = []
+	for i in range(runs):
+		clearOutputs()
+		start = time.time()
+		status = subprocess.call(cmd, shell = True)
+		seconds.append(time.time() - start)
+		if status != 0:
+			print('Failed: %s' % cmd)
+			return {'name': name, 'command': cmd, 'status': status}
+	return {'name': name, 'command': cmd, 'status': 0, 'seconds': seconds, 'median': median(seconds), 'min': min(seconds)}
+
+def commit():
+	try:
+		return subprocess.check_output(['git', 'rev-parse', 'HEAD'], stderr = open(os.devnull, 'w')).decode().strip()
+	except Exception:
+		return None
+
+def compare(results, filename):
+	previous = dict((result['name'], result) for result in json.load(open(filename))['results'])
+	print('%-20s %10s %10s %8s' % ('scenario', 'before', 'after', 'ratio'))
+	for result in results:
+		before = previous.get(result['name'])
+		if before and 'median' in before and 'median' in result:
+			print('%-20s %10.3f %10.3f %8.2f' % (result['name'], before['median'], result['median'], result['median'] / before['median']))
+
+def main():
+	parser = argparse.ArgumentParser(description = 'Times wiggletools on large synthetic inputs')
+	parser.add_argument('--scale', type = float, default = 1, help = 'Multiplies the size of the generated chromosomes (default 1, i.e. 17Mb)')
+	parser.add_argument('--runs', type = int, default = 3, help = 'Number of runs of each scenario (default 3)')
+	parser.add_argument('--output', default = 'bench_results.json', help = 'JSON file for the results (default bench_results.json)')
+	parser.add_argument('--compare', help = 'Previous results to compare against')
+	parser.add_argument('scenarios', nargs = '*', help = 'Scenarios to run (default all)')
+	args = parser.parse_args()
+
+	generate(args.scale)
+
+	results = []
+	for name, program in scenarios():
+		if not args.scenarios or name in args.scenarios:
+			results.append(timeScenario(name, program, args.runs))
+
+	out = open(args.output, 'w')
+	json.dump({'commit': commit(), 'date': time.strftime('%Y-%m-%dT%H:%M:%S'), 'scale': args.scale, 'runs': args.runs, 'results': results}, out, indent = 1, sort_keys = True)
+	out.write('\n')
+	out.close()
+	if os.path.exists(TMP):
+		shutil.rmtree(TMP)
+	print('Results written to %s' % args.output)
+
+	if args.compare:
+		compare(results, args.compare)
+
+	if any(result['status'] != 0 for result in results):
+		sys.exit(1)
+
+if __name__ == '__main__':
+	main()
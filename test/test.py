@@ -2,6 +2,9 @@ import sys
 import os
 import shutil
 import subprocess
+import socket
+import struct
+import time
 
 def test(cmd):
 	print 'Testing: %s' % cmd
@@ -30,23 +33,62 @@ assert test('../bin/wiggletools do isZero diff fixedStep.bw fixedStep.wig') == 0
 # Testing ratios and offset 
 assert test('../bin/wiggletools do isZero offset -1 ratio variableStep.bw variableStep.wig') == 0
 
+# Testing chains of scalar operators
+assert test('../bin/wiggletools do isZero diff offset 2 scale 2 fixedStep.wig scale 2 offset 1 fixedStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff abs scale -1 fixedStep.wig fixedStep.wig') == 0
+
+# Testing selection, the unselected inputs are not opened
+assert test('../bin/wiggletools do isZero diff variableStep.wig select 2 fixedStep.wig variableStep.wig missing.wig') == 0
+
+# Testing linear combinations
+assert test('../bin/wiggletools do isZero diff sum scale 0.5 fixedStep.wig scale 2 variableStep.wig : lincomb 0.5,2 fixedStep.wig variableStep.wig') == 0
+
+# Testing concatenation, the overlapping part of the second file is dropped
+assert test('../bin/wiggletools do isZero diff fixedStep.wig cat fixedStep.wig variableStep.wig') == 0
+
+# Testing bins
+assert test('../bin/wiggletools do isZero diff bin 1 mean fixedStep.wig fixedStep.wig') == 0
+assert test('../bin/wiggletools write_pyramid tmp/pyramid.bg 1,2 max variableStep.wig') == 0
+assert testOutput('cat tmp/pyramid.2.bg') == testOutput('../bin/wiggletools bin 2 max variableStep.wig')
+os.remove('tmp/pyramid.1.bg')
+os.remove('tmp/pyramid.2.bg')
+
+# Testing repeated files
+assert test('../bin/wiggletools do isZero diff fixedStep.wig scale 0.5 sum fixedStep.wig fixedStep.wig') == 0
+
 # Testing BAM & BedGraph 
 assert test('../bin/wiggletools do isZero diff bam.bam pileup.bg') == 0
+assert test('../bin/wiggletools do isZero diff pileup bam.bam pileup.bg') == 0
+assert test('../bin/wiggletools do isZero diff select 3 bam_strands bam.bam bam.bam') == 0
+assert test('../bin/wiggletools do isZero diff bam -e 0 bam.bam bam.bam') == 0
 
 # Testing BAM & SAM 
 assert test('../bin/wiggletools do isZero diff bam.bam sam.sam') == 0
 
+# Testing BAM & CRAM
+assert test('../bin/wiggletools do isZero diff bam.bam cram.cram') == 0
+
 # Testing BAM & SAM 
 assert test('cat sam.sam | ../bin/wiggletools do isZero diff bam.bam sam -') == 0
+assert testOutput('cat bam.bam | ../bin/wiggletools seek GL000213.1 1 100000 bam -e 200 -') == testOutput('../bin/wiggletools seek GL000213.1 1 100000 bam -e 200 bam.bam')
 
 # Testing Bed and BigBed
 assert test('../bin/wiggletools do isZero diff overlapping.bed overlapping.bb') == 0
+assert test('../bin/wiggletools do isZero diff overlapping.bed gt 500 score overlapping.bb') == 0
+assert test('../bin/wiggletools do isZero diff unit overlapping.bed unit overlapping.bb') == 0
+assert test('tac overlapping.bed > tmp/reversed.bed') == 0
+assert test('../bin/wiggletools --sort_memory 1 do isZero diff overlapping.bed tmp/reversed.bed') == 0
+os.remove('tmp/reversed.bed')
+assert test('../bin/wiggletools do isZero diff unit fixedStep.wig mask fixedStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff and fixedStep.wig variableStep.wig trim unit fixedStep.wig unit variableStep.wig') == 0
 
 # Testing Wig and BigWig
 assert test('../bin/wiggletools do isZero diff variableStep.bw variableStep.wig') == 0
 
 # Testing VCF and BCF
 assert test('../bin/wiggletools do isZero diff vcf.vcf bcf.bcf') == 0
+assert test('../bin/wiggletools do isZero diff vcf FORMAT/GT vcf.vcf sum vcf_samples FORMAT/GT vcf.vcf') == 0
+assert test('../bin/wiggletools do isZero diff vcf FORMAT/DP vcf.vcf vcf FORMAT/DP bcf.bcf') == 0
 
 # Testing sum, scale and multiplexers
 assert test('../bin/wiggletools do isZero diff sum fixedStep.bw fixedStep.bw : scale 2 fixedStep.bw') == 0
@@ -66,24 +108,67 @@ assert test('../bin/wiggletools do isZero diff pow 2 fixedStep.bw mult fixedStep
 # Testing smoothing
 # TODO : Find better test
 # assert test('../bin/wiggletools do isZero diff smooth 2 fixedStep.wig fixedStep.wig') == 0
+# Gaussian smoothing is linear
+assert test('../bin/wiggletools do isZero diff gaussian 2 scale 2 fixedStep.wig scale 2 gaussian 2 fixedStep.wig') == 0
+
+# Testing rolling windows
+# The upper median of two values is their max
+assert test('../bin/wiggletools do isZero diff roll 2 median fixedStep.wig roll 2 max fixedStep.wig') == 0
+# A track is anticorrelated with its negation in every window
+rows = testOutput('../bin/wiggletools write_bg - roll 5 pearson fixedStep.wig scale -2 fixedStep.wig').splitlines()
+assert len(rows) > 0 and all(abs(float(row.split('\t')[3]) + 1) < 1e-6 for row in rows)
 
 # Testing filters
 assert test('../bin/wiggletools do isZero diff lt 5 fixedStep.wig gt -5 scale -1 fixedStep.wig') == 0
 
+# Testing multithreaded execution
+assert test('../bin/wiggletools --threads 2 --chrom_sizes chrom_sizes do isZero diff sum fixedStep.bw fixedStep.bw : scale 2 fixedStep.wig') == 0
+# Histograms are only split when their bins are known beforehand
+assert testOutput('../bin/wiggletools --threads 2 --chrom_sizes chrom_sizes histogram - 5 fixedStep.bw variableStep.bw') == testOutput('../bin/wiggletools histogram - 5 fixedStep.bw variableStep.bw')
+assert test('../bin/wiggletools --threads 2 --chrom_sizes chrom_sizes histogram - 5 fixedStep.wig') != 0
+
 # Testing apply
 assert test('../bin/wiggletools apply_paste tmp/regional_means.txt meanI overlapping.bed fixedStep.wig') == 0
+rows = zip(testOutput('../bin/wiggletools apply_paste - meanI AUC overlapping.bed fixedStep.wig variableStep.wig').splitlines(), testOutput('../bin/wiggletools apply_paste - meanI AUC overlapping.bed fixedStep.wig').splitlines(), testOutput('../bin/wiggletools apply_paste - meanI AUC overlapping.bed variableStep.wig').splitlines())
+assert len(rows) > 0 and all(both.split('\t') == first.split('\t') + second.split('\t')[-2:] for both, first, second in rows)
+assert testOutput('../bin/wiggletools --threads 2 --chrom_sizes chrom_sizes apply_paste - meanI AUC overlapping.bed fixedStep.wig variableStep.wig') == testOutput('../bin/wiggletools apply_paste - meanI AUC overlapping.bed fixedStep.wig variableStep.wig')
+# A checkpointed run without a checkpoint to resume from starts afresh, and removes its checkpoint once done
+assert test('../bin/wiggletools --checkpoint tmp/checkpoint --resume --threads 2 --chrom_sizes chrom_sizes apply_paste tmp/checkpointed.txt meanI AUC overlapping.bed fixedStep.wig variableStep.wig') == 0
+assert open('tmp/checkpointed.txt').read() == testOutput('../bin/wiggletools apply_paste - meanI AUC overlapping.bed fixedStep.wig variableStep.wig') and not os.path.exists('tmp/checkpoint')
+os.remove('tmp/checkpointed.txt')
+assert testOutput('../bin/wiggletools seek chr2 1 31 apply_paste - meanI overlapping.bed fixedStep.wig') == testOutput('../bin/wiggletools apply_paste - meanI overlapping.bed fixedStep.wig').splitlines(True)[-1]
 
 # Testing pearson
 assert test('../bin/wiggletools print tmp/pearson.txt pearson fixedStep.wig variableStep.wig') == 0
 
 # Testing profiles
 assert test('../bin/wiggletools profiles tmp/profiles.txt 3 overlapping.bed fixedStep.wig') == 0
+# Binary profiles hold the same rows, as float32, and their regions alongside
+assert test('../bin/wiggletools profiles tmp/profiles.npy 3 overlapping.bed fixedStep.wig') == 0
+npy = open('tmp/profiles.npy', 'rb').read()
+rows = testOutput('../bin/wiggletools profiles - 3 overlapping.bed fixedStep.wig').splitlines()
+assert npy[:6] == '\x93NUMPY' and "'shape': (%i, 3)" % len(rows) in npy[10:128]
+assert all(abs(a - float(b)) < 1e-5 for a, b in zip(struct.unpack('<%if' % (3 * len(rows)), npy[128:]), [value for row in rows for value in row.split('\t')[3:]]))
+assert [row.split('\t')[:3] for row in rows] == [line.split() for line in open('tmp/profiles.npy.regions')]
+os.remove('tmp/profiles.npy')
+os.remove('tmp/profiles.npy.regions')
+
+# Test permutation tests: the p-values are the same from one run to the next, and with 9
+# permutations lie in [1/10, 1], or are NaN where the statistic cannot be computed
+for cmd in ['ttest permute 9 fixedStep.wig variableStep.wig : variableStep.wig fixedStep.wig fixedStep.wig', 'wilcoxon permute 9 fixedStep.wig variableStep.wig : variableStep.wig fixedStep.wig']:
+	out = testOutput('../bin/wiggletools write_bg - ' + cmd)
+	assert out == testOutput('../bin/wiggletools write_bg - ' + cmd)
+	pvalues = [float(line.split('\t')[3]) for line in out.splitlines()]
+	assert any(pvalue == pvalue for pvalue in pvalues)
+	assert all(pvalue != pvalue or 0.1 <= pvalue <= 1 for pvalue in pvalues)
 
 # Testing profile
 assert test('../bin/wiggletools profile tmp/profile.txt 3 overlapping.bed fixedStep.wig') == 0
 
 # Test overlap
 assert test('../bin/wiggletools do isZero diff fixedStep.wig overlaps fixedStep.wig fixedStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff select 1 annotate overlaps fixedStep.wig overlapping.bed variableStep.wig : unit overlaps overlapping.bed fixedStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff select 1 annotate values fixedStep.wig fixedStep.wig variableStep.wig : fixedStep.wig') == 0
 
 # Test nearest #1
 assert test('../bin/wiggletools write_bg tmp/nearest_overlapping.bg nearest variableStep.wig overlapping.bed') == 0
@@ -96,15 +181,157 @@ assert float(testOutput('../bin/wiggletools print - minI fixedStep.wig')) == 0
 
 # Test max
 assert float(testOutput('../bin/wiggletools print - maxI fixedStep.wig')) == 9
+assert float(testOutput('../bin/wiggletools print - quantileI 0.5 fixedStep.wig')) == 4.5
+assert testOutput('../bin/wiggletools print - maxI entropy fixedStep.wig variableStep.wig') == '0.693147\n'
+assert testOutput('../bin/wiggletools top - 2 fixedStep.wig') == 'chr1\t9\t10\t9.000000\nchr1\t8\t9\t8.000000\n'
+
+# Test variance
+assert abs(float(testOutput('../bin/wiggletools print - varI fixedStep.wig')) - 55 / 6.) < 1e-6
+
+# Test partial results
+assert test('../bin/wiggletools partial tmp/partial_variance.bin varI fixedStep.wig') == 0
+assert abs(float(testOutput('../bin/wiggletools merge_partials - tmp/partial_variance.bin')) - 55 / 6.) < 1e-6
+os.remove('tmp/partial_variance.bin')
+
+# Test shards of the genome
+for shard in range(1, 4):
+	assert test('../bin/wiggletools --chrom_sizes chrom_sizes --shard %i/3 write_bg - fixedStep.wig > tmp/shard_%i.bin' % (shard, shard)) == 0
+assert testOutput('../bin/wiggletools merge_partials - tmp/shard_3.bin tmp/shard_1.bin tmp/shard_2.bin') == testOutput('../bin/wiggletools write_bg - fixedStep.wig')
+for shard in range(1, 4):
+	os.remove('tmp/shard_%i.bin' % shard)
+
+# Test sampled estimates, exact over the whole genome
+assert testOutput('../bin/wiggletools --chrom_sizes chrom_sizes --sample 1 meanI AUC fixedStep.wig').split('\n')[:3] == ['4.500000\t45.000000'] * 3
+
+# Test output precision
+assert testOutput('../bin/wiggletools --precision 2 write_bg - fixedStep.wig').split('\n')[1] == 'chr1\t1\t2\t1.00'
+
+# Test compact wiggle output, which reads back as the same track
+assert test('../bin/wiggletools --compact_wig write tmp/compact.wig variableStep.wig') == 0
+assert testOutput('../bin/wiggletools write_bg - tmp/compact.wig') == testOutput('../bin/wiggletools write_bg - variableStep.wig')
+assert os.path.getsize('tmp/compact.wig') < len(testOutput('../bin/wiggletools write - variableStep.wig'))
+os.remove('tmp/compact.wig')
+
+# Test BigWig output, which reads back as the same track
+assert test('../bin/wiggletools write tmp/x.bw fixedStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff tmp/x.bw fixedStep.wig') == 0
+os.remove('tmp/x.bw')
+
+# Test BGZF output, which reads back as the same track, indexed for BedGraph
+assert test('../bin/wiggletools write tmp/x.wig.gz variableStep.wig') == 0
+assert test('../bin/wiggletools do isZero diff tmp/x.wig.gz variableStep.wig') == 0
+os.remove('tmp/x.wig.gz')
+assert test('../bin/wiggletools write_bg tmp/x.bg.gz fixedStep.wig') == 0
+assert os.path.exists('tmp/x.bg.gz.tbi')
+assert test('../bin/wiggletools do isZero diff tmp/x.bg.gz fixedStep.wig') == 0
+os.remove('tmp/x.bg.gz')
+os.remove('tmp/x.bg.gz.tbi')
+
+# Test track cache
+assert test('../bin/wiggletools cache tmp/overlapping.wtc overlapping.bed') == 0
+assert testOutput('../bin/wiggletools write_bg - tmp/overlapping.wtc') == testOutput('../bin/wiggletools write_bg - overlapping.bed')
+os.remove('tmp/overlapping.wtc')
+
+# Test integer tracks
+assert test('../bin/wiggletools write tmp/pileup.wti pileup.bg') == 0
+assert testOutput('../bin/wiggletools write_bg - tmp/pileup.wti') == testOutput('../bin/wiggletools write_bg - bam.bam')
+assert test('../bin/wiggletools write tmp/halves.wti scale 0.5 fixedStep.wig') != 0
+os.remove('tmp/pileup.wti')
+if os.path.exists('tmp/halves.wti'):
+	os.remove('tmp/halves.wti')
+os.mkdir('tmp/sidecars')
+assert testOutput('../bin/wiggletools --cache tmp/sidecars --coverage_sidecars write_bg - bam.bam') == testOutput('../bin/wiggletools write_bg - bam.bam')
+assert len(os.listdir('tmp/sidecars')) == 1
+assert testOutput('../bin/wiggletools --cache tmp/sidecars --coverage_sidecars write_bg - bam.bam') == testOutput('../bin/wiggletools write_bg - bam.bam')
+shutil.rmtree('tmp/sidecars')
+
+# Test matrix store
+assert test('../bin/wiggletools mwrite_matrix tmp/samples.wtm fixedStep.wig variableStep.wig overlapping.bed') == 0
+assert testOutput('../bin/wiggletools mwrite_bg - tmp/samples.wtm') == testOutput('../bin/wiggletools mwrite_bg - fixedStep.wig variableStep.wig overlapping.bed')
+assert testOutput('../bin/wiggletools seek chr1 10 200 mean tmp/samples.wtm') == testOutput('../bin/wiggletools seek chr1 10 200 mean fixedStep.wig variableStep.wig overlapping.bed')
+os.remove('tmp/samples.wtm')
+assert test('../bin/wiggletools mwrite_matrix tmp/appended.wtm fixedStep.wig') == 0
+assert test('../bin/wiggletools mappend_matrix tmp/appended.wtm variableStep.wig overlapping.bed') == 0
+assert testOutput('../bin/wiggletools mwrite_bg - tmp/appended.wtm') == testOutput('../bin/wiggletools mwrite_bg - fixedStep.wig variableStep.wig overlapping.bed')
+assert test('../bin/wiggletools compact_matrix tmp/appended.wtm') == 0
+assert not os.path.exists('tmp/appended.wtm.1')
+assert testOutput('../bin/wiggletools mwrite_bg - tmp/appended.wtm') == testOutput('../bin/wiggletools mwrite_bg - fixedStep.wig variableStep.wig overlapping.bed')
+os.remove('tmp/appended.wtm')
+
+# Test memory budget
+assert testOutput('../bin/wiggletools --max_memory 1 apply_paste - meanI overlapping.bed fixedStep.wig') == testOutput('../bin/wiggletools apply_paste - meanI overlapping.bed fixedStep.wig')
 
 # Test coverage 
 assert test('../bin/wiggletools do isZero diff overlapping_coverage.wig coverage overlapping.bed') == 0
+assert test('../bin/wiggletools do isZero diff overlapping_coverage.wig coverage extend 0 overlapping.bed') == 0
 
 #Test trim
 assert test('../bin/wiggletools do isZero diff trim overlapping.bed variableStep.wig mult overlapping.bed variableStep.wig') == 0
 
+# Test server mode
+server = subprocess.Popen(['../bin/wiggletools', 'serve', 'tmp/server.sock'])
+while not os.path.exists('tmp/server.sock'):
+	time.sleep(0.1)
+def serverOutput(program):
+	print 'Testing server: %s' % program
+	client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	client.connect('tmp/server.sock')
+	client.sendall(program + '\n')
+	out = ''
+	data = client.recv(65536)
+	while data:
+		out += data
+		data = client.recv(65536)
+	client.close()
+	return out
+for i in range(2):
+	assert serverOutput('seek chr1 1 100 mean fixedStep.wig variableStep.wig') == testOutput('../bin/wiggletools seek chr1 1 100 mean fixedStep.wig variableStep.wig')
+assert serverOutput('batch chr1:1-3,chr1:5-8 meanI fixedStep.wig') == testOutput('../bin/wiggletools batch chr1:1-3,chr1:5-8 meanI fixedStep.wig')
+assert serverOutput('batch chr1:5-8,chr1:1-3 meanI fixedStep.wig') == '# chr1:5-8\n5.000000\n# chr1:1-3\n0.500000\n'
+assert os.stat('tmp/server.sock').st_mode & 0777 == 0600
+# Overlong requests are dropped, and a second server cannot take over the socket
+client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+client.connect('tmp/server.sock')
+try:
+	client.sendall('meanI ' + 'x' * (1 << 21) + '\n')
+	assert client.recv(65536) == ''
+except socket.error:
+	pass
+client.close()
+assert test('../bin/wiggletools serve tmp/server.sock') != 0
+server.kill()
+server.wait()
+# The socket left behind is replaced, connections are refused until then
+server = subprocess.Popen(['../bin/wiggletools', 'serve', 'tmp/server.sock'])
+while True:
+	try:
+		out = serverOutput('meanI fixedStep.wig')
+		break
+	except socket.error:
+		time.sleep(0.1)
+assert out == testOutput('../bin/wiggletools meanI fixedStep.wig')
+server.kill()
+server.wait()
+os.remove('tmp/server.sock')
+
+# Test multi-node runs, on the loopback interface
+probe = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+probe.bind(('127.0.0.1', 0))
+port = probe.getsockname()[1]
+probe.close()
+open('tmp/secret', 'w').write('sesame\n')
+open('tmp/wrong_secret', 'w').write('open\n')
+coordinator = subprocess.Popen('../bin/wiggletools --chrom_sizes chrom_sizes --secret tmp/secret --coordinate %i 3 write_bg tmp/coordinated.bg mean fixedStep.wig variableStep.wig' % port, shell = True)
+assert test('../bin/wiggletools --worker 127.0.0.1:%i --secret tmp/wrong_secret' % port) == 1
+assert test('../bin/wiggletools --worker 127.0.0.1:%i --secret tmp/secret' % port) == 0
+assert coordinator.wait() == 0
+assert open('tmp/coordinated.bg').read() == testOutput('../bin/wiggletools write_bg - mean fixedStep.wig variableStep.wig')
+for name in ['secret', 'wrong_secret', 'coordinated.bg']:
+	os.remove('tmp/' + name)
+
 # Test program file
 assert test('../bin/wiggletools run program.txt') == 0
+assert testOutput('../bin/wiggletools run programs.txt') == ''.join(testOutput('../bin/wiggletools ' + cmd) for cmd in ['AUC fixedStep.wig', 'meanI variableStep.wig', 'maxI mean fixedStep.wig variableStep.wig', 'apply_paste - AUC overlapping.bed fixedStep.wig'])
 
 assert test('diff tmp expected') == 0
 